@@ -90,6 +90,21 @@ bool AsyncFetch::Write(const StringPiece& sp, MessageHandler* handler) {
   return ret;
 }
 
+bool AsyncFetch::WriteShared(const SharedString& content,
+                             MessageHandler* handler) {
+  bool ret = true;
+  if (!content.empty()) {
+    if (!headers_complete_) {
+      HeadersComplete();
+    }
+    if (request_headers()->method() == RequestHeaders::kHead) {
+      return ret;
+    }
+    ret = HandleWriteShared(content, handler);
+  }
+  return ret;
+}
+
 bool AsyncFetch::Flush(MessageHandler* handler) {
   if (!headers_complete_) {
     HeadersComplete();
@@ -351,11 +366,11 @@ void FallbackSharedAsyncFetch::HandleHeadersComplete() {
     // Add a warning header indicating that the response is stale.
     response_headers()->Add(HttpAttributes::kWarning, kStaleWarningHeaderValue);
     response_headers()->ComputeCaching();
-    StringPiece contents;
+    SharedString contents;
     fallback_.ExtractContents(&contents);
     set_content_length(contents.size());
     SharedAsyncFetch::HandleHeadersComplete();
-    SharedAsyncFetch::HandleWrite(contents, handler_);
+    SharedAsyncFetch::HandleWriteShared(contents, handler_);
     SharedAsyncFetch::HandleFlush(handler_);
     if (fallback_responses_served_ != NULL) {
       fallback_responses_served_->Add(1);
@@ -375,6 +390,14 @@ bool FallbackSharedAsyncFetch::HandleWrite(const StringPiece& content,
   return SharedAsyncFetch::HandleWrite(content, handler);
 }
 
+bool FallbackSharedAsyncFetch::HandleWriteShared(const SharedString& content,
+                                                 MessageHandler* handler) {
+  if (serving_fallback_) {
+    return true;
+  }
+  return SharedAsyncFetch::HandleWriteShared(content, handler);
+}
+
 bool FallbackSharedAsyncFetch::HandleFlush(MessageHandler* handler) {
   if (serving_fallback_) {
     return true;
@@ -446,9 +469,9 @@ void ConditionalSharedAsyncFetch::HandleHeadersComplete() {
       response_headers()->ComputeCaching();
     }
     SharedAsyncFetch::HandleHeadersComplete();
-    StringPiece contents;
+    SharedString contents;
     cached_value_.ExtractContents(&contents);
-    SharedAsyncFetch::HandleWrite(contents, handler_);
+    SharedAsyncFetch::HandleWriteShared(contents, handler_);
     SharedAsyncFetch::HandleFlush(handler_);
     // Do not call Done() on the base fetch yet since it could delete shared
     // pointers.
@@ -468,6 +491,14 @@ bool ConditionalSharedAsyncFetch::HandleWrite(const StringPiece& content,
   return SharedAsyncFetch::HandleWrite(content, handler);
 }
 
+bool ConditionalSharedAsyncFetch::HandleWriteShared(
+    const SharedString& content, MessageHandler* handler) {
+  if (serving_cached_value_) {
+    return true;
+  }
+  return SharedAsyncFetch::HandleWriteShared(content, handler);
+}
+
 bool ConditionalSharedAsyncFetch::HandleFlush(MessageHandler* handler) {
   if (serving_cached_value_) {
     return true;
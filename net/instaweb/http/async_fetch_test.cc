@@ -17,14 +17,18 @@
 
 #include "net/instaweb/http/public/async_fetch.h"
 
+#include <vector>
 
 #include "net/instaweb/http/public/request_context.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/gtest.h"
 #include "pagespeed/kernel/base/mock_message_handler.h"
 #include "pagespeed/kernel/base/null_mutex.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/http/http_names.h"
 #include "pagespeed/kernel/http/http_options.h"
+#include "pagespeed/kernel/http/request_headers.h"
 #include "pagespeed/kernel/http/response_headers.h"
 
 namespace net_instaweb {
@@ -45,6 +49,32 @@ class TestSharedAsyncFetch : public SharedAsyncFetch {
   DISALLOW_COPY_AND_ASSIGN(TestSharedAsyncFetch);
 };
 
+// Keeps the slices passed to WriteShared, and copies anything passed to
+// Write.
+class SliceRecordingFetch : public StringAsyncFetch {
+ public:
+  explicit SliceRecordingFetch(const RequestContextPtr& request_context)
+      : StringAsyncFetch(request_context) {
+  }
+
+  virtual ~SliceRecordingFetch() {
+  }
+
+  const std::vector<SharedString>& slices() const { return slices_; }
+
+ protected:
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler) {
+    slices_.push_back(content);
+    return true;
+  }
+
+ private:
+  std::vector<SharedString> slices_;
+
+  DISALLOW_COPY_AND_ASSIGN(SliceRecordingFetch);
+};
+
 // Tests the AsyncFetch class and some of its derivations.
 class AsyncFetchTest : public testing::Test {
  protected:
@@ -129,6 +159,59 @@ TEST_F(AsyncFetchTest, ContentLengthPropagatesToConditional) {
   EXPECT_EQ(42, string_fetch_.content_length());
 }
 
+TEST_F(AsyncFetchTest, WriteSharedCopiesByDefault) {
+  string_fetch_.response_headers()->set_status_code(HttpStatus::kOK);
+  SharedString contents("hello");
+  EXPECT_TRUE(string_fetch_.WriteShared(contents, &handler_));
+  EXPECT_TRUE(string_fetch_.headers_complete());
+  EXPECT_EQ("hello", string_fetch_.buffer());
+}
+
+TEST_F(AsyncFetchTest, WriteSharedPassesSlicesThroughShared) {
+  SliceRecordingFetch recorder(request_context_);
+  TestSharedAsyncFetch fetch(&recorder);
+  fetch.response_headers()->set_status_code(HttpStatus::kOK);
+  SharedString storage("headers:body");
+  SharedString body(storage);
+  body.RemovePrefix(STATIC_STRLEN("headers:"));
+  EXPECT_TRUE(fetch.WriteShared(body, &handler_));
+  EXPECT_TRUE(fetch.WriteShared(SharedString(), &handler_));  // Dropped.
+  ASSERT_EQ(1, recorder.slices().size());
+  EXPECT_EQ("body", recorder.slices()[0].Value());
+  EXPECT_TRUE(recorder.slices()[0].SharesStorage(storage));
+  EXPECT_TRUE(recorder.buffer().empty());
+}
+
+TEST_F(AsyncFetchTest, WriteSharedSkipsBodyForHead) {
+  SliceRecordingFetch recorder(request_context_);
+  recorder.request_headers()->set_method(RequestHeaders::kHead);
+  recorder.response_headers()->set_status_code(HttpStatus::kOK);
+  EXPECT_TRUE(recorder.WriteShared(SharedString("body"), &handler_));
+  EXPECT_TRUE(recorder.headers_complete());
+  EXPECT_TRUE(recorder.slices().empty());
+}
+
+TEST_F(AsyncFetchTest, FallbackServesSharedContents) {
+  ResponseHeaders fallback_headers;
+  fallback_headers.SetStatusAndReason(HttpStatus::kOK);
+  fallback_headers.Add(HttpAttributes::kContentType, "text/plain");
+  fallback_value_.SetHeaders(&fallback_headers);
+  fallback_value_.Write("stale", &handler_);
+
+  SliceRecordingFetch recorder(request_context_);
+  FallbackSharedAsyncFetch* fetch =
+      new FallbackSharedAsyncFetch(&recorder, &fallback_value_, &handler_);
+  fetch->response_headers()->SetStatusAndReason(HttpStatus::kBadGateway);
+  EXPECT_TRUE(fetch->Write("error page", &handler_));
+  fetch->Done(false);  // Deletes fetch.
+
+  ASSERT_EQ(1, recorder.slices().size());
+  EXPECT_EQ("stale", recorder.slices()[0].Value());
+  EXPECT_TRUE(recorder.slices()[0].SharesStorage(fallback_value_.share()));
+  EXPECT_TRUE(recorder.buffer().empty());
+  EXPECT_TRUE(recorder.success());
+}
+
 TEST_F(AsyncFetchTest, ViaHandling) {
   EXPECT_FALSE(CheckCacheControlPublicWithVia(nullptr));
   EXPECT_TRUE(CheckCacheControlPublicWithVia("1.1 google"));
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Serves a cached resource through a CacheUrlAsyncFetcher and a couple of
+// pass-through SharedAsyncFetches to a fetch that stands in for the server
+// gasket.  Like ApacheFetch in buffered mode, the gasket copies the bytes
+// passed to Write into a buffer of its own, and copies them again when
+// handing them to the server, but hands off slices passed to WriteShared as
+// they are.  The Copying benchmarks disable WriteShared in the gasket, to
+// show the cost of the old path.
+//
+// Each benchmark checks that the gasket copied the bytes it should have for
+// each resource served:
+//
+//   body size  1k    100k    1M
+//   ---------------------------------
+//   Copying    2048  204800  2097152
+//   Shared     0     0       0
+//
+// Benchmark                  Time(ns) Iterations
+// ----------------------------------------------
+// BM_ServeCopying1K              6740     160000
+// BM_ServeShared1K               6732     160000
+// BM_ServeCopying100K           54233      32000
+// BM_ServeShared100K             6902     160000
+// BM_ServeCopying1M            949120       1600
+// BM_ServeShared1M               6835     160000
+//
+// Disclaimer: comparing runs over time and across different machines
+// can be misleading.  When contemplating an algorithm change, always do
+// interleaved runs with the old & new algorithm.
+
+#include <vector>
+
+#include "base/logging.h"
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/http/public/cache_url_async_fetcher.h"
+#include "net/instaweb/http/public/http_cache.h"
+#include "net/instaweb/http/public/request_context.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/benchmark.h"
+#include "pagespeed/kernel/base/mock_hasher.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/null_message_handler.h"
+#include "pagespeed/kernel/base/null_mutex.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/lru_cache.h"
+#include "pagespeed/kernel/http/content_type.h"
+#include "pagespeed/kernel/http/http_names.h"
+#include "pagespeed/kernel/http/request_headers.h"
+#include "pagespeed/kernel/http/response_headers.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace {
+
+const char kUrl[] = "http://www.example.com/image.jpg";
+const char kFragment[] = "www.example.com";
+const int kNumPassThroughFetches = 2;
+
+// Stands in for a server gasket's fetch; see the file comment.
+class GasketFetch : public net_instaweb::AsyncFetch {
+ public:
+  GasketFetch(const net_instaweb::RequestContextPtr& request_context,
+              bool accept_shared)
+      : net_instaweb::AsyncFetch(request_context),
+        accept_shared_(accept_shared),
+        bytes_copied_(0) {
+  }
+  virtual ~GasketFetch() {}
+
+  int64 bytes_copied() const { return bytes_copied_; }
+
+ protected:
+  virtual void HandleHeadersComplete() {}
+  virtual bool HandleWrite(const StringPiece& content,
+                           net_instaweb::MessageHandler* handler) {
+    content.AppendToString(&buffer_);
+    bytes_copied_ += content.size();
+    return true;
+  }
+  virtual bool HandleWriteShared(const net_instaweb::SharedString& content,
+                                 net_instaweb::MessageHandler* handler) {
+    if (!accept_shared_) {
+      return HandleWrite(content.Value(), handler);
+    }
+    slices_.push_back(content);
+    return true;
+  }
+  virtual bool HandleFlush(net_instaweb::MessageHandler* handler) {
+    return true;
+  }
+  virtual void HandleDone(bool success) {
+    CHECK(success);
+    // Hands the buffered bytes to the "server", as ap_rwrite would.  The
+    // slices are handed over by reference.
+    connection_.append(buffer_);
+    bytes_copied_ += buffer_.size();
+  }
+
+ private:
+  bool accept_shared_;
+  GoogleString buffer_;
+  GoogleString connection_;
+  std::vector<net_instaweb::SharedString> slices_;
+  int64 bytes_copied_;
+
+  DISALLOW_COPY_AND_ASSIGN(GasketFetch);
+};
+
+class PassThroughFetch : public net_instaweb::SharedAsyncFetch {
+ public:
+  explicit PassThroughFetch(net_instaweb::AsyncFetch* base_fetch)
+      : net_instaweb::SharedAsyncFetch(base_fetch) {
+  }
+  virtual ~PassThroughFetch() {}
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(PassThroughFetch);
+};
+
+void ServeFromCache(int body_size, bool accept_shared, int iters) {
+  StopBenchmarkTiming();
+  net_instaweb::scoped_ptr<net_instaweb::ThreadSystem> thread_system(
+      net_instaweb::Platform::CreateThreadSystem());
+  net_instaweb::SimpleStats stats(thread_system.get());
+  net_instaweb::HTTPCache::InitStats(&stats);
+  net_instaweb::MockTimer timer(new net_instaweb::NullMutex,
+                                net_instaweb::MockTimer::kApr_5_2010_ms);
+  net_instaweb::MockHasher hasher;
+  net_instaweb::LRUCache lru_cache(2 * body_size + 10000);
+  net_instaweb::HTTPCache http_cache(&lru_cache, &timer, &hasher, &stats);
+  net_instaweb::NullMessageHandler handler;
+
+  // With no fetcher, there are no background fetches, so no locks are taken.
+  net_instaweb::CacheUrlAsyncFetcher cache_fetcher(
+      &hasher, NULL, &http_cache, kFragment, NULL, NULL);
+
+  net_instaweb::ResponseHeaders headers;
+  headers.SetStatusAndReason(net_instaweb::HttpStatus::kOK);
+  headers.Add(net_instaweb::HttpAttributes::kContentType,
+              net_instaweb::kContentTypeJpeg.mime_type());
+  headers.SetDateAndCaching(timer.NowMs(), net_instaweb::Timer::kYearMs);
+  headers.ComputeCaching();
+  GoogleString body(body_size, 'x');
+  net_instaweb::RequestHeaders request_headers;
+  http_cache.Put(kUrl, kFragment, request_headers.GetProperties(),
+                 net_instaweb::ResponseHeaders::kRespectVaryOnResources,
+                 &headers, body, &handler);
+
+  net_instaweb::RequestContextPtr request_context(
+      net_instaweb::RequestContext::NewTestRequestContext(
+          thread_system.get()));
+  int64 bytes_copied = 0;
+  StartBenchmarkTiming();
+  for (int i = 0; i < iters; ++i) {
+    GasketFetch gasket(request_context, accept_shared);
+    net_instaweb::AsyncFetch* fetch = &gasket;
+    std::vector<PassThroughFetch*> pass_through;
+    for (int j = 0; j < kNumPassThroughFetches; ++j) {
+      pass_through.push_back(new PassThroughFetch(fetch));
+      fetch = pass_through.back();
+    }
+    cache_fetcher.Fetch(kUrl, &handler, fetch);
+    bytes_copied += gasket.bytes_copied();
+    for (int j = 0; j < kNumPassThroughFetches; ++j) {
+      delete pass_through[j];
+    }
+  }
+  StopBenchmarkTiming();
+
+  // Copying writes each byte into the gasket's buffer, and out again.
+  int64 body_bytes = static_cast<int64>(iters) * body_size;
+  CHECK_EQ(accept_shared ? 0 : 2 * body_bytes, bytes_copied);
+  SetBenchmarkBytesProcessed(body_bytes);
+}
+
+static void BM_ServeCopying1K(int iters) {
+  ServeFromCache(1024, false, iters);
+}
+
+static void BM_ServeShared1K(int iters) {
+  ServeFromCache(1024, true, iters);
+}
+
+static void BM_ServeCopying100K(int iters) {
+  ServeFromCache(100 * 1024, false, iters);
+}
+
+static void BM_ServeShared100K(int iters) {
+  ServeFromCache(100 * 1024, true, iters);
+}
+
+static void BM_ServeCopying1M(int iters) {
+  ServeFromCache(1024 * 1024, false, iters);
+}
+
+static void BM_ServeShared1M(int iters) {
+  ServeFromCache(1024 * 1024, true, iters);
+}
+
+}  // namespace
+
+BENCHMARK(BM_ServeCopying1K);
+BENCHMARK(BM_ServeShared1K);
+BENCHMARK(BM_ServeCopying100K);
+BENCHMARK(BM_ServeShared100K);
+BENCHMARK(BM_ServeCopying1M);
+BENCHMARK(BM_ServeShared1M);
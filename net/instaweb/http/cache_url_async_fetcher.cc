@@ -18,6 +18,8 @@
 
 #include "net/instaweb/http/public/cache_url_async_fetcher.h"
 
+#include <algorithm>
+
 #include "base/logging.h"
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/http/public/async_fetch_with_lock.h"
@@ -30,6 +32,7 @@
 #include "net/instaweb/http/public/url_async_fetcher.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/statistics.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
@@ -118,6 +121,16 @@ class CachePutFetch : public SharedAsyncFetch {
     return ret;
   }
 
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler) {
+    bool ret = true;
+    ret &= SharedAsyncFetch::HandleWriteShared(content, handler);
+    if (cacheable_) {
+      ret &= cache_value_writer_.Write(content.Value(), handler);
+    }
+    return ret;
+  }
+
   virtual bool HandleFlush(MessageHandler* handler) {
     // Note cache_value_.Flush doesn't do anything.
     return SharedAsyncFetch::HandleFlush(handler);
@@ -202,12 +215,14 @@ class CacheFindCallback : public HTTPCache::Callback {
         NamedLockManager* lock_manager,
         MessageHandler* message_handler,
         CacheFindCallback* callback,
-        CacheUrlAsyncFetcher::AsyncOpHooks* async_op_hooks)
+        CacheUrlAsyncFetcher::AsyncOpHooks* async_op_hooks,
+        Variable* num_background_freshens_skipped)
         : AsyncFetchWithLock(
               lock_hasher, request_context, url, url /* cache_key*/,
               lock_manager, message_handler),
           callback_(callback),
-          async_op_hooks_(async_op_hooks) {
+          async_op_hooks_(async_op_hooks),
+          num_background_freshens_skipped_(num_background_freshens_skipped) {
       async_op_hooks_->StartAsyncOp();
     }
 
@@ -227,9 +242,20 @@ class CacheFindCallback : public HTTPCache::Callback {
 
     virtual bool IsBackgroundFetch() const { return true; }
 
+   protected:
+    virtual void Finalize(bool lock_failure, bool success) {
+      // Someone else is already fetching this resource, and will put the
+      // fresh response in the cache.
+      if (lock_failure && num_background_freshens_skipped_ != NULL) {
+        num_background_freshens_skipped_->Add(1);
+      }
+      AsyncFetchWithLock::Finalize(lock_failure, success);
+    }
+
    private:
     CacheFindCallback* callback_;
     CacheUrlAsyncFetcher::AsyncOpHooks* async_op_hooks_;
+    Variable* num_background_freshens_skipped_;
 
     DISALLOW_COPY_AND_ASSIGN(BackgroundFreshenFetch);
   };
@@ -260,6 +286,9 @@ class CacheFindCallback : public HTTPCache::Callback {
         num_conditional_refreshes_(owner->num_conditional_refreshes()),
         num_proactively_freshen_user_facing_request_(
             owner->num_proactively_freshen_user_facing_request()),
+        num_background_freshens_(owner->num_background_freshens()),
+        num_background_freshens_skipped_(
+            owner->num_background_freshens_skipped()),
         handler_(handler),
         http_options_(base_fetch->request_context()->options()),
         respect_vary_(ResponseHeaders::GetVaryOption(owner->respect_vary())),
@@ -269,7 +298,8 @@ class CacheFindCallback : public HTTPCache::Callback {
         proactively_freshen_user_facing_request_(
             owner->proactively_freshen_user_facing_request()),
         serve_stale_while_revalidate_threshold_sec_(
-            owner->serve_stale_while_revalidate_threshold_sec()) {
+            owner->serve_stale_while_revalidate_threshold_sec()),
+        honor_stale_while_revalidate_(owner->honor_stale_while_revalidate()) {
     // Note that this is a cache lookup: there are no request-headers.  At
     // this level, we have already made a policy decision that any Vary
     // headers present will be ignored.  See
@@ -312,7 +342,7 @@ class CacheFindCallback : public HTTPCache::Callback {
           // http server gaskets have an opportunity to examine
           // content_length_known() in HandleHeadersComplete and thereby serve
           // non-chunked responses.
-          StringPiece contents;
+          SharedString contents;
           http_value()->ExtractContents(&contents);
           base_fetch_->set_content_length(contents.size());
           response_headers()->ComputeCaching();
@@ -323,7 +353,7 @@ class CacheFindCallback : public HTTPCache::Callback {
           // fact might be useful to the HtmlParser if this is HTML. Perhaps
           // we should add an API for conveying that information, which can
           // be detected via AsyncFetch::content_length_known().
-          base_fetch_->Write(contents, handler_);
+          base_fetch_->WriteShared(contents, handler_);
         } else {
           response_headers()->ComputeCaching();
           is_imminently_expiring = IsImminentlyExpiring(*response_headers());
@@ -421,7 +451,10 @@ class CacheFindCallback : public HTTPCache::Callback {
 
  private:
   bool ServedStaleContentWhileRevalidate(AsyncFetch* base_fetch) {
-    if (serve_stale_while_revalidate_threshold_sec_ == 0 ||
+    // Without async_op_hooks_ we can't safely freshen in the background.
+    if ((serve_stale_while_revalidate_threshold_sec_ == 0 &&
+         !honor_stale_while_revalidate_) ||
+        async_op_hooks_ == NULL ||
         fallback_http_value() == NULL ||
         fallback_http_value()->Empty()) {
       return false;
@@ -435,12 +468,20 @@ class CacheFindCallback : public HTTPCache::Callback {
     response_headers->ComputeCaching();
     const int64 expiry_ms = response_headers->CacheExpirationTimeMs();
     const int64 now_ms = cache_->timer()->NowMs();
-    const int64 serve_stale_threshold_ms =
-        serve_stale_while_revalidate_threshold_sec_ * 1000;
-    if (now_ms > expiry_ms +  serve_stale_threshold_ms ||
-        response_headers->IsHtmlLike()) {
+    int64 serve_stale_threshold_ms =
+        serve_stale_while_revalidate_threshold_sec_ * Timer::kSecondMs;
+    int64 header_threshold_ms;
+    if (honor_stale_while_revalidate_ &&
+        response_headers->GetStaleWhileRevalidateMs(&header_threshold_ms)) {
+      serve_stale_threshold_ms =
+          std::max(serve_stale_threshold_ms, header_threshold_ms);
+    }
+    if (now_ms > expiry_ms + serve_stale_threshold_ms ||
+        response_headers->IsHtmlLike() ||
+        response_headers->RequiresProxyRevalidation()) {
       // Serve non-html request with fallback http value if resource
-      // was expired within serve_stale_while_revalidate_threshold_ms_.
+      // was expired within serve_stale_threshold_ms, unless the origin
+      // insists on revalidation.
       response_headers->Clear();
       return false;
     }
@@ -456,9 +497,9 @@ class CacheFindCallback : public HTTPCache::Callback {
     response_headers->RemoveAll(HttpAttributes::kExpires);
     response_headers->ComputeCaching();
     base_fetch_->HeadersComplete();
-    StringPiece contents;
+    SharedString contents;
     fallback_http_value()->ExtractContents(&contents);
-    base_fetch_->Write(contents, handler_);
+    base_fetch_->WriteShared(contents, handler_);
 
     // Issue a background fetch to update the cache with a fresh value so
     // that future request will be responded with fresh content.
@@ -468,6 +509,9 @@ class CacheFindCallback : public HTTPCache::Callback {
   }
 
   void TriggerBackgroundFreshenFetch() {
+    if (num_background_freshens_ != NULL) {
+      num_background_freshens_->Add(1);
+    }
     AsyncFetchWithLock* fetch = new BackgroundFreshenFetch(
         lock_hasher_,
         base_fetch_->request_context(),
@@ -475,7 +519,8 @@ class CacheFindCallback : public HTTPCache::Callback {
         lock_manager_,
         handler_,
         this,
-        async_op_hooks_);
+        async_op_hooks_,
+        num_background_freshens_skipped_);
     RequestHeaders* request_headers = fetch->request_headers();
     request_headers->CopyFrom(*base_fetch_->request_headers());
     DCHECK(request_headers->method() == RequestHeaders::kGet ||
@@ -563,6 +608,8 @@ class CacheFindCallback : public HTTPCache::Callback {
   Variable* fallback_responses_served_while_revalidate_;
   Variable* num_conditional_refreshes_;
   Variable* num_proactively_freshen_user_facing_request_;
+  Variable* num_background_freshens_;
+  Variable* num_background_freshens_skipped_;
   MessageHandler* handler_;
 
   const HttpOptions http_options_;
@@ -573,6 +620,7 @@ class CacheFindCallback : public HTTPCache::Callback {
   bool default_cache_html_;
   bool proactively_freshen_user_facing_request_;
   int64 serve_stale_while_revalidate_threshold_sec_;
+  bool honor_stale_while_revalidate_;
   Sequence* response_sequence_;
 
   DISALLOW_COPY_AND_ASSIGN(CacheFindCallback);
@@ -597,6 +645,8 @@ CacheUrlAsyncFetcher::CacheUrlAsyncFetcher(const Hasher* lock_hasher,
       fallback_responses_served_while_revalidate_(NULL),
       num_conditional_refreshes_(NULL),
       num_proactively_freshen_user_facing_request_(NULL),
+      num_background_freshens_(NULL),
+      num_background_freshens_skipped_(NULL),
       respect_vary_(false),
       ignore_recent_fetch_failed_(false),
       serve_stale_if_fetch_error_(false),
@@ -604,6 +654,7 @@ CacheUrlAsyncFetcher::CacheUrlAsyncFetcher(const Hasher* lock_hasher,
       proactively_freshen_user_facing_request_(false),
       own_fetcher_(false),
       serve_stale_while_revalidate_threshold_sec_(0),
+      honor_stale_while_revalidate_(false),
       response_sequence_(NULL) {
 }
 
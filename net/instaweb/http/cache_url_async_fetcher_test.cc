@@ -849,6 +849,74 @@ TEST_F(CacheUrlAsyncFetcherTest, ServeStaleContentWhileRevalidate) {
                 ->fallback_responses_served_while_revalidate()->Get());
 }
 
+TEST_F(CacheUrlAsyncFetcherTest, ServeStaleContentWithinStaleWhileRevalidate) {
+  const char kSwrUrl[] = "http://www.example.com/swr.css";
+  ResponseHeaders swr_headers;
+  SetDefaultHeaders(kContentTypeCss, &swr_headers);
+  swr_headers.SetDateAndCaching(timer_.NowMs(), ttl_ms_,
+                                ", stale-while-revalidate=7200");
+  mock_fetcher_.SetResponse(kSwrUrl, swr_headers, cache_body_);
+  Variable* num_background_freshens =
+      statistics_.AddVariable("num_background_freshens");
+  cache_fetcher_->set_num_background_freshens(num_background_freshens);
+
+  // The directive is ignored unless we've been told to honor it.
+  ExpectCache(kSwrUrl, cache_body_);
+  timer_.AdvanceMs(ttl_ms_ + Timer::kHourMs);
+  ClearStats();
+  FetchAndValidate(kSwrUrl, empty_request_headers_, true, HttpStatus::kOK,
+                   cache_body_, kBackendFetch, true);
+  EXPECT_EQ(0,
+            cache_fetcher_
+                ->fallback_responses_served_while_revalidate()->Get());
+
+  // Within the two hours after expiry, the stale response is served and
+  // freshened in the background.
+  cache_fetcher_->set_honor_stale_while_revalidate(true);
+  timer_.AdvanceMs(ttl_ms_ + Timer::kHourMs);
+  ClearStats();
+  FetchAndValidate(kSwrUrl, empty_request_headers_, true, HttpStatus::kOK,
+                   cache_body_, kServeStaleContentWhileRevalidate, true);
+  EXPECT_EQ(1, counting_fetcher_.fetch_count());
+  EXPECT_EQ(1, http_cache_->cache_inserts()->Get());
+  EXPECT_EQ(1, num_background_freshens->Get());
+  EXPECT_EQ(1,
+            cache_fetcher_
+                ->fallback_responses_served_while_revalidate()->Get());
+
+  // After that, we have to wait for the origin.
+  timer_.AdvanceMs(ttl_ms_ + 3 * Timer::kHourMs);
+  ClearStats();
+  FetchAndValidate(kSwrUrl, empty_request_headers_, true, HttpStatus::kOK,
+                   cache_body_, kBackendFetch, true);
+  EXPECT_EQ(1, counting_fetcher_.fetch_count());
+  EXPECT_EQ(0, num_background_freshens->Get());
+  EXPECT_EQ(0,
+            cache_fetcher_
+                ->fallback_responses_served_while_revalidate()->Get());
+}
+
+TEST_F(CacheUrlAsyncFetcherTest, NoStaleContentIfRevalidationRequired) {
+  const char kRevalidateUrl[] = "http://www.example.com/revalidate.css";
+  ResponseHeaders revalidate_headers;
+  SetDefaultHeaders(kContentTypeCss, &revalidate_headers);
+  revalidate_headers.SetDateAndCaching(timer_.NowMs(), ttl_ms_,
+                                       ", proxy-revalidate");
+  mock_fetcher_.SetResponse(kRevalidateUrl, revalidate_headers, cache_body_);
+  cache_fetcher_->set_serve_stale_while_revalidate_threshold_sec(
+      Timer::kDayMs / Timer::kSecondMs);
+
+  ExpectCache(kRevalidateUrl, cache_body_);
+  timer_.AdvanceMs(ttl_ms_ + Timer::kHourMs);
+  ClearStats();
+  FetchAndValidate(kRevalidateUrl, empty_request_headers_, true,
+                   HttpStatus::kOK, cache_body_, kBackendFetch, true);
+  EXPECT_EQ(1, counting_fetcher_.fetch_count());
+  EXPECT_EQ(0,
+            cache_fetcher_
+                ->fallback_responses_served_while_revalidate()->Get());
+}
+
 TEST_F(CacheUrlAsyncFetcherTest, CachingWithHttpsHtmlCachingEnabled) {
   // With caching of html on https enabled, both html and css hosted on https
   // get cached.
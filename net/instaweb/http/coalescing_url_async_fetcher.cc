@@ -0,0 +1,320 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "net/instaweb/http/public/coalescing_url_async_fetcher.h"
+
+#include "base/logging.h"
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/http/public/http_value.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/http/http_names.h"
+#include "pagespeed/kernel/http/request_headers.h"
+#include "pagespeed/kernel/http/response_headers.h"
+
+namespace net_instaweb {
+
+const char CoalescingUrlAsyncFetcher::kCoalescedFetches[] =
+    "coalesced_fetches";
+const char CoalescingUrlAsyncFetcher::kCoalescedFetchesSaved[] =
+    "coalesced_fetches_saved";
+const char CoalescingUrlAsyncFetcher::kCoalescedFetchTimeouts[] =
+    "coalesced_fetch_timeouts";
+
+const int64 CoalescingUrlAsyncFetcher::kMaxSharedBodyBytes = 16 * 1024 * 1024;
+
+namespace {
+
+// We don't otherwise look at Range, so there's no name for it in
+// HttpAttributes.
+const char kRange[] = "Range";
+
+// Request headers whose values select between representations of a resource,
+// or make the origin answer differently.  Requests only share a response if
+// they agree on all of them.
+const char* const kKeyHeaders[] = {
+  HttpAttributes::kAcceptEncoding,
+  HttpAttributes::kIfModifiedSince,
+  HttpAttributes::kIfNoneMatch,
+};
+
+}  // namespace
+
+// Passes the response through to the fetch it wraps, keeping a copy of it to
+// share with the fetches that waited for it.
+class CoalescingUrlAsyncFetcher::CoalescingFetch : public SharedAsyncFetch {
+ public:
+  CoalescingFetch(CoalescingUrlAsyncFetcher* fetcher, const GoogleString& key,
+                  AsyncFetch* base_fetch)
+      : SharedAsyncFetch(base_fetch),
+        fetcher_(fetcher),
+        key_(key),
+        shareable_(false),
+        saved_headers_(base_fetch->response_headers()->http_options()) {
+  }
+
+  virtual ~CoalescingFetch() {}
+
+ protected:
+  virtual void HandleHeadersComplete() {
+    // Copy the headers before anyone downstream gets to modify them.
+    saved_headers_.CopyFrom(*response_headers());
+    saved_headers_.ComputeCaching();
+    int status = saved_headers_.status_code();
+    // A 304 only goes to waiters that sent the same validators (they are
+    // part of the key), so it's fine to share even if it isn't cacheable.
+    // Otherwise, share only what we could have served from a shared cache
+    // to a request with cookies.
+    shareable_ = (status == HttpStatus::kNotModified) ||
+        (status == HttpStatus::kOK && saved_headers_.IsProxyCacheable());
+    SharedAsyncFetch::HandleHeadersComplete();
+  }
+
+  virtual bool HandleWrite(const StringPiece& content,
+                           MessageHandler* handler) {
+    SaveForWaiters(content, handler);
+    return SharedAsyncFetch::HandleWrite(content, handler);
+  }
+
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler) {
+    SaveForWaiters(content.Value(), handler);
+    return SharedAsyncFetch::HandleWriteShared(content, handler);
+  }
+
+  virtual void HandleDone(bool success) {
+    bool share = success && shareable_;
+    if (share) {
+      // The X-Original-Content-Length header is added to the extra headers
+      // after HandleHeadersComplete(), so pick it up now.
+      const char* orig_content_length = extra_response_headers()->Lookup1(
+          HttpAttributes::kXOriginalContentLength);
+      int64 ocl;
+      if (orig_content_length != NULL &&
+          StringToInt64(orig_content_length, &ocl)) {
+        saved_headers_.SetOriginalContentLength(ocl);
+      }
+      value_.SetHeaders(&saved_headers_);
+    }
+
+    SharedAsyncFetch::HandleDone(success);
+    // The base fetch, and so our request and response headers, may be gone
+    // now.
+    fetcher_->FinishFlight(key_, share ? &value_ : NULL);
+    delete this;
+  }
+
+ private:
+  void SaveForWaiters(const StringPiece& content, MessageHandler* handler) {
+    if (shareable_) {
+      if (value_.contents_size() + static_cast<int64>(content.size()) >
+          kMaxSharedBodyBytes) {
+        shareable_ = false;
+        value_.Clear();
+      } else {
+        value_.Write(content, handler);
+      }
+    }
+  }
+
+  CoalescingUrlAsyncFetcher* fetcher_;
+  const GoogleString key_;
+  bool shareable_;
+  ResponseHeaders saved_headers_;
+  HTTPValue value_;
+
+  DISALLOW_COPY_AND_ASSIGN(CoalescingFetch);
+};
+
+CoalescingUrlAsyncFetcher::CoalescingUrlAsyncFetcher(
+    UrlAsyncFetcher* fetcher, Scheduler* scheduler, int max_waiters,
+    int64 timeout_ms, Statistics* statistics)
+    : base_fetcher_(fetcher),
+      scheduler_(scheduler),
+      max_waiters_(max_waiters),
+      timeout_ms_(timeout_ms),
+      next_waiter_id_(0),
+      coalesced_fetches_(statistics->GetVariable(kCoalescedFetches)),
+      coalesced_fetches_saved_(
+          statistics->GetVariable(kCoalescedFetchesSaved)),
+      coalesced_fetch_timeouts_(
+          statistics->GetVariable(kCoalescedFetchTimeouts)) {
+}
+
+CoalescingUrlAsyncFetcher::~CoalescingUrlAsyncFetcher() {
+  // Every fetch in flight holds a pointer to us, so we must outlive them.
+  ScopedMutex lock(scheduler_->mutex());
+  DCHECK(flights_.empty());
+}
+
+void CoalescingUrlAsyncFetcher::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kCoalescedFetches);
+  statistics->AddVariable(kCoalescedFetchesSaved);
+  statistics->AddVariable(kCoalescedFetchTimeouts);
+}
+
+// static
+bool CoalescingUrlAsyncFetcher::CoalescingKey(
+    const GoogleString& url, const RequestHeaders& request_headers,
+    GoogleString* key) {
+  if (request_headers.method() != RequestHeaders::kGet ||
+      request_headers.Has(HttpAttributes::kAuthorization) ||
+      request_headers.Has(HttpAttributes::kCookie) ||
+      request_headers.Has(HttpAttributes::kCookie2) ||
+      request_headers.Has(kRange)) {
+    return false;
+  }
+  *key = url;
+  for (int i = 0, n = arraysize(kKeyHeaders); i < n; ++i) {
+    StrAppend(key, "\n");
+    ConstStringStarVector values;
+    if (request_headers.Lookup(kKeyHeaders[i], &values)) {
+      for (int j = 0, m = values.size(); j < m; ++j) {
+        if (j != 0) {
+          StrAppend(key, ", ");
+        }
+        if (values[j] != NULL) {
+          StrAppend(key, *values[j]);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void CoalescingUrlAsyncFetcher::Fetch(const GoogleString& url,
+                                      MessageHandler* message_handler,
+                                      AsyncFetch* fetch) {
+  GoogleString key;
+  if (!CoalescingKey(url, *fetch->request_headers(), &key)) {
+    base_fetcher_->Fetch(url, message_handler, fetch);
+    return;
+  }
+
+  bool leader = false;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    std::pair<FlightMap::iterator, bool> result =
+        flights_.insert(FlightMap::value_type(key, WaiterVector()));
+    if (result.second) {
+      leader = true;
+    } else {
+      WaiterVector* waiters = &result.first->second;
+      if (static_cast<int>(waiters->size()) < max_waiters_) {
+        Waiter waiter;
+        waiter.id = next_waiter_id_++;
+        waiter.url = url;
+        waiter.handler = message_handler;
+        waiter.fetch = fetch;
+        waiter.alarm = NULL;
+        if (timeout_ms_ > 0) {
+          waiter.alarm = scheduler_->AddAlarmAtUsMutexHeld(
+              scheduler_->timer()->NowUs() + timeout_ms_ * Timer::kMsUs,
+              MakeFunction(this, &CoalescingUrlAsyncFetcher::WaiterTimedOut,
+                           key, waiter.id));
+        }
+        waiters->push_back(waiter);
+        fetch = NULL;
+      }
+    }
+  }
+
+  if (fetch == NULL) {
+    coalesced_fetches_->Add(1);
+    return;
+  }
+  if (leader) {
+    fetch = new CoalescingFetch(this, key, fetch);
+  }
+  // Either we are first, or there are already max_waiters_ waiting.
+  base_fetcher_->Fetch(url, message_handler, fetch);
+}
+
+void CoalescingUrlAsyncFetcher::FinishFlight(const GoogleString& key,
+                                             HTTPValue* value) {
+  WaiterVector waiters;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    FlightMap::iterator p = flights_.find(key);
+    CHECK(p != flights_.end());
+    waiters.swap(p->second);
+    flights_.erase(p);
+    // The waiters can't have timed out since WaiterTimedOut would have taken
+    // them out of flights_, so cancelling their alarms is safe.  If an alarm
+    // has already started to run, it will find nothing to do.
+    for (int i = 0, n = waiters.size(); i < n; ++i) {
+      if (waiters[i].alarm != NULL) {
+        scheduler_->CancelAlarm(waiters[i].alarm);
+      }
+    }
+  }
+
+  for (int i = 0, n = waiters.size(); i < n; ++i) {
+    const Waiter& waiter = waiters[i];
+    AsyncFetch* fetch = waiter.fetch;
+    if (value == NULL ||
+        !value->ExtractHeaders(fetch->response_headers(), waiter.handler)) {
+      fetch->response_headers()->Clear();
+      base_fetcher_->Fetch(waiter.url, waiter.handler, fetch);
+      continue;
+    }
+    SharedString contents;
+    value->ExtractContents(&contents);
+    fetch->set_content_length(contents.size());
+    fetch->HeadersComplete();
+    fetch->WriteShared(contents, waiter.handler);
+    fetch->Done(true);
+    coalesced_fetches_saved_->Add(1);
+  }
+}
+
+void CoalescingUrlAsyncFetcher::WaiterTimedOut(GoogleString key, int64 id) {
+  Waiter waiter;
+  bool found = false;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    FlightMap::iterator p = flights_.find(key);
+    if (p != flights_.end()) {
+      WaiterVector* waiters = &p->second;
+      for (WaiterVector::iterator q = waiters->begin(), e = waiters->end();
+           q != e; ++q) {
+        if (q->id == id) {
+          waiter = *q;
+          waiters->erase(q);
+          found = true;
+          break;
+        }
+      }
+    }
+  }
+  if (found) {
+    // Stop waiting, and fetch it ourselves.
+    coalesced_fetch_timeouts_->Add(1);
+    base_fetcher_->Fetch(waiter.url, waiter.handler, waiter.fetch);
+  }
+}
+
+void CoalescingUrlAsyncFetcher::ShutDown() {
+  // The fetches in flight will fail, and their waiters will then be passed
+  // on to base_fetcher_, which quick-fails them.
+  base_fetcher_->ShutDown();
+}
+
+}  // namespace net_instaweb
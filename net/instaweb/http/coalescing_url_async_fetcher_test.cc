@@ -0,0 +1,209 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "net/instaweb/http/public/coalescing_url_async_fetcher.h"
+
+#include <vector>
+
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/http/public/counting_url_async_fetcher.h"
+#include "net/instaweb/http/public/mock_url_fetcher.h"
+#include "net/instaweb/http/public/request_context.h"
+#include "net/instaweb/http/public/wait_url_async_fetcher.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/null_message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/http/http_names.h"
+#include "pagespeed/kernel/http/request_headers.h"
+#include "pagespeed/kernel/http/response_headers.h"
+#include "pagespeed/kernel/thread/mock_scheduler.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kUrl[] = "http://www.example.com/style.css";
+const char kPrivateUrl[] = "http://www.example.com/private.css";
+const char kBody[] = "body {}";
+const int kMaxWaiters = 2;
+const int64 kTimeoutMs = 1000;
+
+class CoalescingUrlAsyncFetcherTest : public ::testing::Test {
+ protected:
+  CoalescingUrlAsyncFetcherTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        stats_(thread_system_.get()),
+        timer_(thread_system_->NewMutex(), MockTimer::kApr_5_2010_ms),
+        scheduler_(thread_system_.get(), &timer_),
+        wait_fetcher_(&mock_fetcher_, thread_system_->NewMutex()),
+        counting_fetcher_(&wait_fetcher_) {
+    CoalescingUrlAsyncFetcher::InitStats(&stats_);
+    fetcher_.reset(new CoalescingUrlAsyncFetcher(
+        &counting_fetcher_, &scheduler_, kMaxWaiters, kTimeoutMs, &stats_));
+
+    ResponseHeaders headers;
+    headers.SetStatusAndReason(HttpStatus::kOK);
+    headers.SetDateAndCaching(timer_.NowMs(), Timer::kHourMs);
+    mock_fetcher_.SetResponse(kUrl, headers, kBody);
+    headers.SetDateAndCaching(timer_.NowMs(), Timer::kHourMs, ", private");
+    mock_fetcher_.SetResponse(kPrivateUrl, headers, kBody);
+  }
+
+  StringAsyncFetch* NewFetch() {
+    StringAsyncFetch* fetch = new StringAsyncFetch(
+        RequestContext::NewTestRequestContext(thread_system_.get()));
+    fetches_.push_back(fetch);
+    return fetch;
+  }
+
+  StringAsyncFetch* StartFetch(const GoogleString& url) {
+    StringAsyncFetch* fetch = NewFetch();
+    fetcher_->Fetch(url, &handler_, fetch);
+    return fetch;
+  }
+
+  void ExpectServed(StringAsyncFetch* fetch) {
+    EXPECT_TRUE(fetch->done());
+    EXPECT_TRUE(fetch->success());
+    EXPECT_EQ(kBody, fetch->buffer());
+    EXPECT_EQ(HttpStatus::kOK, fetch->response_headers()->status_code());
+  }
+
+  int64 Stat(const char* name) {
+    return stats_.GetVariable(name)->Get();
+  }
+
+  virtual void TearDown() {
+    for (int i = 0, n = fetches_.size(); i < n; ++i) {
+      delete fetches_[i];
+    }
+  }
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  SimpleStats stats_;
+  MockTimer timer_;
+  MockScheduler scheduler_;
+  MockUrlFetcher mock_fetcher_;
+  WaitUrlAsyncFetcher wait_fetcher_;
+  CountingUrlAsyncFetcher counting_fetcher_;
+  scoped_ptr<CoalescingUrlAsyncFetcher> fetcher_;
+  NullMessageHandler handler_;
+  std::vector<StringAsyncFetch*> fetches_;
+};
+
+TEST_F(CoalescingUrlAsyncFetcherTest, CoalescesConcurrentFetches) {
+  StringAsyncFetch* first = StartFetch(kUrl);
+  StringAsyncFetch* second = StartFetch(kUrl);
+  StringAsyncFetch* third = StartFetch(kUrl);
+  EXPECT_EQ(1, counting_fetcher_.fetch_start_count());
+  EXPECT_FALSE(second->done());
+
+  wait_fetcher_.CallCallbacks();
+  ExpectServed(first);
+  ExpectServed(second);
+  ExpectServed(third);
+  EXPECT_EQ(1, counting_fetcher_.fetch_start_count());
+  EXPECT_EQ(2, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetches));
+  EXPECT_EQ(2, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetchesSaved));
+
+  // Once the first fetch is done, the next one goes to the origin again.
+  StartFetch(kUrl);
+  EXPECT_EQ(2, counting_fetcher_.fetch_start_count());
+  wait_fetcher_.CallCallbacks();
+}
+
+TEST_F(CoalescingUrlAsyncFetcherTest, WaiterListIsBounded) {
+  for (int i = 0; i < kMaxWaiters + 2; ++i) {
+    StartFetch(kUrl);
+  }
+  // The first fetch and the one that didn't fit on the waiter list.
+  EXPECT_EQ(2, counting_fetcher_.fetch_start_count());
+  wait_fetcher_.CallCallbacks();
+  for (int i = 0, n = fetches_.size(); i < n; ++i) {
+    ExpectServed(fetches_[i]);
+  }
+  EXPECT_EQ(kMaxWaiters,
+            Stat(CoalescingUrlAsyncFetcher::kCoalescedFetchesSaved));
+}
+
+TEST_F(CoalescingUrlAsyncFetcherTest, DifferentRepresentationsNotCoalesced) {
+  StartFetch(kUrl);
+  StringAsyncFetch* gzip = NewFetch();
+  gzip->request_headers()->Add(HttpAttributes::kAcceptEncoding, "gzip");
+  fetcher_->Fetch(kUrl, &handler_, gzip);
+  StringAsyncFetch* cookie = NewFetch();
+  cookie->request_headers()->Add(HttpAttributes::kCookie, "a=b");
+  fetcher_->Fetch(kUrl, &handler_, cookie);
+  EXPECT_EQ(3, counting_fetcher_.fetch_start_count());
+  wait_fetcher_.CallCallbacks();
+  EXPECT_EQ(0, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetches));
+}
+
+TEST_F(CoalescingUrlAsyncFetcherTest, PrivateResponseNotShared) {
+  StringAsyncFetch* first = StartFetch(kPrivateUrl);
+  StringAsyncFetch* second = StartFetch(kPrivateUrl);
+  EXPECT_EQ(1, counting_fetcher_.fetch_start_count());
+
+  // The waiter is sent to the origin on its own once the response turns out
+  // to be private.
+  wait_fetcher_.CallCallbacks();
+  ExpectServed(first);
+  EXPECT_FALSE(second->done());
+  EXPECT_EQ(2, counting_fetcher_.fetch_start_count());
+  wait_fetcher_.CallCallbacks();
+  ExpectServed(second);
+  EXPECT_EQ(1, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetches));
+  EXPECT_EQ(0, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetchesSaved));
+}
+
+TEST_F(CoalescingUrlAsyncFetcherTest, WaitersTimeOut) {
+  StringAsyncFetch* first = StartFetch(kUrl);
+  scheduler_.AdvanceTimeMs(kTimeoutMs / 2);
+  StringAsyncFetch* second = StartFetch(kUrl);
+  EXPECT_EQ(1, counting_fetcher_.fetch_start_count());
+
+  // The second fetch gives up waiting, and fetches on its own.
+  scheduler_.AdvanceTimeMs(kTimeoutMs);
+  EXPECT_EQ(2, counting_fetcher_.fetch_start_count());
+  EXPECT_EQ(1, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetchTimeouts));
+
+  wait_fetcher_.CallCallbacks();
+  ExpectServed(first);
+  ExpectServed(second);
+  EXPECT_EQ(0, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetchesSaved));
+}
+
+TEST_F(CoalescingUrlAsyncFetcherTest, FinishingCancelsTimeouts) {
+  StartFetch(kUrl);
+  StringAsyncFetch* second = StartFetch(kUrl);
+  wait_fetcher_.CallCallbacks();
+  ExpectServed(second);
+
+  scheduler_.AdvanceTimeMs(2 * kTimeoutMs);
+  EXPECT_EQ(1, counting_fetcher_.fetch_start_count());
+  EXPECT_EQ(0, Stat(CoalescingUrlAsyncFetcher::kCoalescedFetchTimeouts));
+}
+
+}  // namespace
+
+}  // namespace net_instaweb
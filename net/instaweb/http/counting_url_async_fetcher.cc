@@ -20,6 +20,7 @@
 
 #include "net/instaweb/http/public/async_fetch.h"
 #include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 
@@ -44,6 +45,15 @@ class CountingUrlAsyncFetcher::CountingFetch : public SharedAsyncFetch {
     return SharedAsyncFetch::HandleWrite(content, handler);
   }
 
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler) {
+    {
+      ScopedMutex lock(counter_->mutex_.get());
+      counter_->byte_count_ += content.size();
+    }
+    return SharedAsyncFetch::HandleWriteShared(content, handler);
+  }
+
   virtual void HandleDone(bool success) {
     {
       ScopedMutex lock(counter_->mutex_.get());
@@ -1304,14 +1304,14 @@ TEST_F(HTTPCacheWriteThroughTest, PutGet) {
 // Check size-limits for the small cache
 TEST_F(HTTPCacheWriteThroughTest, SizeLimit) {
   ClearStats();
-  write_through_cache_.set_cache1_limit(183);  // See below.
+  write_through_cache_.set_cache1_limit(154);  // See below.
   ResponseHeaders headers_in;
   InitHeaders(&headers_in, "max-age=300");
 
   // This one will fit. Size:
   // Key: v2/www.test.com/http://www.test.com/1 --- 37 bytes.
-  // Value: 145 bytes
-  // 145 + 37 = 182.
+  // Value: 116 bytes
+  // 116 + 37 = 153.
   Put(key_, fragment_, &headers_in, "Name");
   EXPECT_EQ(0, GetStat(HTTPCache::kCacheHits));
   EXPECT_EQ(0, GetStat(HTTPCache::kCacheMisses));
@@ -34,6 +34,11 @@ namespace {
 // and vice versa.  Both the headers and body are variable length, and to avoid
 // having to re-shuffle memory, we encode which is first in the buffer as the
 // first byte.  The next four bytes encode the size.
+//
+// The headers are written with ResponseHeaders::WriteAsCompactBinary, so
+// that a lookup which only needs the status code and caching fields does not
+// decode every header.  Entries written before that, with WriteAsBinary, are
+// still read by ResponseHeaders::ReadFromBinary.
 const char kHeadersFirst = 'h';
 const char kBodyFirst = 'b';
 
@@ -60,7 +65,7 @@ void HTTPValue::SetHeaders(ResponseHeaders* headers) {
   CopyOnWrite();
   GoogleString headers_string;
   StringWriter writer(&headers_string);
-  headers->WriteAsBinary(&writer, NULL);
+  headers->WriteAsCompactBinary(&writer, NULL);
   if (storage_.empty()) {
     storage_.Append(&kHeadersFirst, 1);
     SetSizeOfFirstChunk(headers_string.size());
@@ -178,6 +183,18 @@ bool HTTPValue::ExtractContents(StringPiece* val) const {
   return ret;
 }
 
+bool HTTPValue::ExtractContents(SharedString* contents) const {
+  StringPiece body;
+  if (!ExtractContents(&body)) {
+    return false;
+  }
+  *contents = storage_;  // Links the storage; no bytes are copied.
+  int prefix = body.data() - storage_.data();
+  contents->RemoveSuffix(storage_.size() - prefix - body.size());
+  contents->RemovePrefix(prefix);
+  return true;
+}
+
 int64 HTTPValue::ComputeContentsSize() const {
   // Return size as 0 if the cache is corrupted.
   int64 size = 0;
@@ -202,18 +219,13 @@ bool HTTPValue::Link(const SharedString& src, ResponseHeaders* headers,
   if (src.size() >= kStorageOverhead) {
     // The simplest way to ensure that src is well formed is to save the
     // existing storage_ in a temp, assign the storage, and make sure
-    // Headers and Contents return true.  The drawback is that the headers
-    // parsing is arguably a little heavyweight.  We could consider encoding
-    // the headers in an easier-to-extract form, so we don't have to give up
-    // the integrity checks.
+    // Headers and Contents return true.  For headers in the compact
+    // encoding this only checks the name/value pairs, leaving them to be
+    // decoded when they are first accessed.
     SharedString temp(storage_);
     storage_ = src;
     contents_size_ = ComputeContentsSize();
 
-    // TODO(jmarantz): this could be a lot lighter weight, but we are going
-    // to be sure at this point that both the headers and the contents are
-    // valid.  It would be nice to have an HTML headers parser that didn't
-    // actually create new temp copies of all the names/values.
     ok = ExtractHeaders(headers, handler);
     if (!ok) {
       storage_ = temp;
@@ -108,6 +108,39 @@ TEST_F(HTTPValueTest, EmptyContentsFirst) {
   CheckResponseHeaders(check_headers);
 }
 
+TEST_F(HTTPValueTest, ExtractSharedContents) {
+  ResponseHeaders headers;
+  FillResponseHeaders(&headers);
+
+  HTTPValue headers_first, contents_first;
+  headers_first.SetHeaders(&headers);
+  headers_first.Write("body", &message_handler_);
+  contents_first.Write("body", &message_handler_);
+  contents_first.SetHeaders(&headers);
+
+  SharedString headers_first_body, contents_first_body;
+  ASSERT_TRUE(headers_first.ExtractContents(&headers_first_body));
+  ASSERT_TRUE(contents_first.ExtractContents(&contents_first_body));
+  EXPECT_EQ("body", headers_first_body.Value());
+  EXPECT_EQ("body", contents_first_body.Value());
+
+  // The slices refer to the values' storage rather than copies of it.
+  EXPECT_TRUE(headers_first_body.SharesStorage(headers_first.share()));
+  EXPECT_TRUE(contents_first_body.SharesStorage(contents_first.share()));
+  EXPECT_FALSE(headers_first.unique());
+
+  // Further writes to the value copy its storage, leaving the slice alone,
+  // and the slice outlives the value's own reference to the storage.
+  headers_first.Write(" and more", &message_handler_);
+  contents_first.Clear();
+  EXPECT_EQ("body", headers_first_body.Value());
+  EXPECT_EQ("body", contents_first_body.Value());
+
+  HTTPValue empty;
+  SharedString empty_body;
+  EXPECT_FALSE(empty.ExtractContents(&empty_body));
+}
+
 TEST_F(HTTPValueTest, TestCopyOnWrite) {
   HTTPValue v1;
   v1.Write("Hello", &message_handler_);
@@ -311,13 +344,30 @@ TEST_F(HTTPValueEncodeTest, EncodeDecodeGold) {
   StringPiece body_first_golden_value(
       body_first_golden_value_buf, STATIC_STRLEN(body_first_golden_value_buf));
 
-  // These tests should work even if proto formats change.
+  // The values above hold the headers as an HttpResponseHeaders protobuf,
+  // as they were written before the compact encoding.  Those must keep
+  // decoding, even if proto formats change.
   EXPECT_STREQ(example_http, Decode(header_first_golden_value));
   EXPECT_STREQ(example_http, Decode(body_first_golden_value));
 
-  // Note: This might change when proto formats change.
+  const char header_first_compact_golden_value_buf[] =
+      "h\xFA\0\0\0\x7\x1\xFF\xBF\x1\xC8\x1\x1\x1\x80\x89\x96\xCC\xD5)"
+      "\xC0\xD8\xBA\xCC\xD5)\xE0\xC8\xBA\xC1\xBA)\xC0\xCF$\x2OK\t\x12H"
+      "Apache/2.2.29 (Unix) mod_ssl/2.2.29 OpenSSL/1.0.1j DAV/2"
+      " mod_fcgid/2.3.9\xE\x1D" "Fri, 20 Feb 2015 18:10:04 GMT"
+      "\x1\x5" "bytes\t\x2" "21\0\xE" "X-Extra-Header\x1" "1"
+      "\x5\x13public, max-age=600\n\btext/css"
+      "\xC\x12W/\"PSA-35DPOkCBal\"\xB\x1D" "Fri, 15 May 2015 21:40:32 GMT"
+      ".blue {color: blue;}\n";
+  StringPiece header_first_compact_golden_value(
+      header_first_compact_golden_value_buf,
+      STATIC_STRLEN(header_first_compact_golden_value_buf));
+  EXPECT_STREQ(example_http, Decode(header_first_compact_golden_value));
+
+  // Note: This changes if the compact headers encoding changes, which also
+  // requires a new version number for it.
   // Note: Can't use STREQ, it doesn't check past embedded nulls.
-  EXPECT_EQ(header_first_golden_value, Encode(example_http));
+  EXPECT_EQ(header_first_compact_golden_value, Encode(example_http));
 }
 
 TEST_F(HTTPValueEncodeTest, EncodeInvalid) {
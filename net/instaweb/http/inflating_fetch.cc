@@ -102,6 +102,14 @@ bool InflatingFetch::HandleWrite(const StringPiece& sp,
   return status && !inflate_failure_;
 }
 
+bool InflatingFetch::HandleWriteShared(const SharedString& content,
+                                       MessageHandler* handler) {
+  if (inflater_.get() == NULL && !inflate_failure_) {
+    return SharedAsyncFetch::HandleWriteShared(content, handler);
+  }
+  return HandleWrite(content.Value(), handler);
+}
+
 // Inflate a HTTPValue, if it was gzip compressed.
 bool InflatingFetch::UnGzipValueIfCompressed(const HTTPValue& src,
                                              ResponseHeaders* headers,
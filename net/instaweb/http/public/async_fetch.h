@@ -25,6 +25,7 @@
 #include "net/instaweb/http/public/http_value.h"
 #include "net/instaweb/http/public/request_context.h"
 #include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/writer.h"
@@ -76,6 +77,13 @@ class AsyncFetch : public Writer {
   virtual bool Write(const StringPiece& content, MessageHandler* handler);
   virtual bool Flush(MessageHandler* handler);
 
+  // Same as Write, but passes a reference-counted slice of the contents,
+  // e.g. from HTTPValue::ExtractContents, which implementors may retain
+  // past the call instead of copying it.  Implementors may override
+  // HandleWriteShared; by default it calls HandleWrite with the slice's
+  // bytes.
+  bool WriteShared(const SharedString& content, MessageHandler* handler);
+
   // Is the cache entry corresponding to headers valid? Default is that it is
   // valid. Sub-classes can provide specific implementations, e.g., based on
   // cache invalidation timestamp in domain specific options.
@@ -170,6 +178,10 @@ class AsyncFetch : public Writer {
   virtual bool HandleFlush(MessageHandler* handler) = 0;
   virtual void HandleDone(bool success) = 0;
   virtual void HandleHeadersComplete() = 0;
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler) {
+    return HandleWrite(content.Value(), handler);
+  }
 
  private:
   RequestHeaders* request_headers_;
@@ -275,6 +287,10 @@ class AsyncFetchUsingWriter : public AsyncFetch {
 // be overridden by inheritors of this class, but to propagate the
 // callbacks to the base-fetch, overrides should upcall this class,
 // e.g. SharedAsyncFetch::HandleWrite(...).
+//
+// Shared writes are passed through to the base fetch as they are, so an
+// inheritor that overrides HandleWrite to look at or alter the contents
+// must also override HandleWriteShared, if only to call HandleWrite.
 class SharedAsyncFetch : public AsyncFetch {
  public:
   explicit SharedAsyncFetch(AsyncFetch* base_fetch);
@@ -298,6 +314,11 @@ class SharedAsyncFetch : public AsyncFetch {
     return base_fetch_->Flush(handler);
   }
 
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler) {
+    return base_fetch_->WriteShared(content, handler);
+  }
+
   virtual void HandleHeadersComplete();
 
   virtual bool IsCachedResultValid(const ResponseHeaders& headers) {
@@ -339,6 +360,8 @@ class FallbackSharedAsyncFetch : public SharedAsyncFetch {
  protected:
   virtual void HandleDone(bool success);
   virtual bool HandleWrite(const StringPiece& content, MessageHandler* handler);
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler);
   virtual bool HandleFlush(MessageHandler* handler);
   virtual void HandleHeadersComplete();
 
@@ -374,6 +397,8 @@ class ConditionalSharedAsyncFetch : public SharedAsyncFetch {
  protected:
   virtual void HandleDone(bool success);
   virtual bool HandleWrite(const StringPiece& content, MessageHandler* handler);
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler);
   virtual bool HandleFlush(MessageHandler* handler);
   virtual void HandleHeadersComplete();
 
@@ -56,6 +56,14 @@ class Variable;
 // otherwise, fetcher object accessed by BackgroundFreshenFetch may be deleted
 // by the time origin fetch finishes.
 //
+// Similarly, a non-HTML resource that expired less than
+// serve_stale_while_revalidate_threshold_sec ago (or, with
+// honor_stale_while_revalidate, within its own stale-while-revalidate window)
+// is served stale right away, and freshened with a background fetch.  These
+// background fetches go through the same per-URL lock, so only one runs at a
+// time for any resource, and report IsBackgroundFetch() so the fetcher can
+// rate-limit them.
+//
 // TODO(sligocki): In order to use this for fetching resources for rewriting
 // we'd need to integrate resource locking in this class. Do we want that?
 class CacheUrlAsyncFetcher : public UrlAsyncFetcher {
@@ -135,6 +143,24 @@ class CacheUrlAsyncFetcher : public UrlAsyncFetcher {
     return num_proactively_freshen_user_facing_request_;
   }
 
+  // Counts the background fetches started to freshen the cache, and those
+  // that were dropped because the resource was already being fetched.
+  void set_num_background_freshens(Variable* x) {
+    num_background_freshens_ = x;
+  }
+
+  Variable* num_background_freshens() const {
+    return num_background_freshens_;
+  }
+
+  void set_num_background_freshens_skipped(Variable* x) {
+    num_background_freshens_skipped_ = x;
+  }
+
+  Variable* num_background_freshens_skipped() const {
+    return num_background_freshens_skipped_;
+  }
+
   void set_respect_vary(bool x) { respect_vary_ = x; }
   bool respect_vary() const { return respect_vary_; }
 
@@ -161,6 +187,17 @@ class CacheUrlAsyncFetcher : public UrlAsyncFetcher {
     return serve_stale_while_revalidate_threshold_sec_;
   }
 
+  // If true, a resource with a Cache-Control: stale-while-revalidate
+  // directive may be served stale for as long as that directive allows,
+  // if that's longer than serve_stale_while_revalidate_threshold_sec.
+  void set_honor_stale_while_revalidate(bool x) {
+    honor_stale_while_revalidate_ = x;
+  }
+
+  bool honor_stale_while_revalidate() const {
+    return honor_stale_while_revalidate_;
+  }
+
   void set_default_cache_html(bool x) { default_cache_html_ = x; }
   bool default_cache_html() const { return default_cache_html_; }
 
@@ -204,6 +241,8 @@ class CacheUrlAsyncFetcher : public UrlAsyncFetcher {
   Variable* fallback_responses_served_while_revalidate_;  // may be NULL.
   Variable* num_conditional_refreshes_;  // may be NULL.
   Variable* num_proactively_freshen_user_facing_request_;  // may be NULL.
+  Variable* num_background_freshens_;  // may be NULL.
+  Variable* num_background_freshens_skipped_;  // may be NULL.
 
   bool respect_vary_;
   bool ignore_recent_fetch_failed_;
@@ -212,6 +251,7 @@ class CacheUrlAsyncFetcher : public UrlAsyncFetcher {
   bool proactively_freshen_user_facing_request_;
   bool own_fetcher_;  // set true to transfer ownership of fetcher to this.
   int64 serve_stale_while_revalidate_threshold_sec_;
+  bool honor_stale_while_revalidate_;
   Sequence* response_sequence_;
 
   DISALLOW_COPY_AND_ASSIGN(CacheUrlAsyncFetcher);
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NET_INSTAWEB_HTTP_PUBLIC_COALESCING_URL_ASYNC_FETCHER_H_
+#define NET_INSTAWEB_HTTP_PUBLIC_COALESCING_URL_ASYNC_FETCHER_H_
+
+#include <map>
+#include <vector>
+
+#include "net/instaweb/http/public/url_async_fetcher.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/thread/scheduler.h"
+
+namespace net_instaweb {
+
+class AsyncFetch;
+class HTTPValue;
+class MessageHandler;
+class RequestHeaders;
+class Statistics;
+class Variable;
+
+// Fetcher that merges concurrent fetches of the same resource into a single
+// fetch from the fetcher it wraps.  When a popular resource expires, every
+// request for it misses in the HTTP cache at about the same time; without
+// this, each of them would go to the origin.
+//
+// The first fetch of a URL goes ahead, and identical fetches that arrive
+// before it finishes wait for it.  Once it is done, its response is copied
+// to each of them, provided it could have been served to any of them from a
+// shared cache anyway.  Otherwise, and for waiters that give up after
+// timeout_ms, each waiter is fetched on its own, just as it would have been
+// without coalescing.
+//
+// Only GETs without cookies, credentials or ranges are coalesced, and
+// requests only wait for one another when they agree on the request headers
+// that select between representations (see CoalescingKey).
+class CoalescingUrlAsyncFetcher : public UrlAsyncFetcher {
+ public:
+  static const char kCoalescedFetches[];
+  static const char kCoalescedFetchesSaved[];
+  static const char kCoalescedFetchTimeouts[];
+
+  // Responses with bodies larger than this are not shared with waiters.
+  static const int64 kMaxSharedBodyBytes;
+
+  // Does not take ownership of fetcher or scheduler.  At most max_waiters
+  // fetches wait for each fetch in progress; more are passed straight
+  // through.  A timeout_ms of 0 lets waiters wait for as long as the fetch
+  // they are waiting for takes.  InitStats must have been called during
+  // stats initialization.
+  CoalescingUrlAsyncFetcher(UrlAsyncFetcher* fetcher, Scheduler* scheduler,
+                            int max_waiters, int64 timeout_ms,
+                            Statistics* statistics);
+  virtual ~CoalescingUrlAsyncFetcher();
+
+  static void InitStats(Statistics* statistics);
+
+  virtual bool SupportsHttps() const { return base_fetcher_->SupportsHttps(); }
+
+  virtual void Fetch(const GoogleString& url,
+                     MessageHandler* message_handler,
+                     AsyncFetch* fetch);
+
+  virtual void ShutDown();
+
+  // Computes the key under which a fetch of url with request_headers is
+  // coalesced, returning false if it must not be coalesced at all.
+  static bool CoalescingKey(const GoogleString& url,
+                            const RequestHeaders& request_headers,
+                            GoogleString* key);
+
+ private:
+  class CoalescingFetch;
+  friend class CoalescingFetch;
+
+  struct Waiter {
+    int64 id;
+    GoogleString url;
+    MessageHandler* handler;
+    AsyncFetch* fetch;
+    Scheduler::Alarm* alarm;  // NULL if there is no timeout.
+  };
+  typedef std::vector<Waiter> WaiterVector;
+  typedef std::map<GoogleString, WaiterVector> FlightMap;
+
+  // Called by the CoalescingFetch for key once it is done.  value holds the
+  // response to share with the waiters, or is NULL if they must be fetched
+  // on their own.
+  void FinishFlight(const GoogleString& key, HTTPValue* value)
+      LOCKS_EXCLUDED(scheduler_->mutex());
+
+  // Alarm callback for a waiter that has waited for timeout_ms.
+  void WaiterTimedOut(GoogleString key, int64 id)
+      LOCKS_EXCLUDED(scheduler_->mutex());
+
+  UrlAsyncFetcher* base_fetcher_;
+  Scheduler* scheduler_;
+  const int max_waiters_;
+  const int64 timeout_ms_;
+
+  // The scheduler's mutex also guards our state, so that a waiter's alarm
+  // can be safely cancelled once the waiter has been taken out of flights_.
+  FlightMap flights_ GUARDED_BY(scheduler_->mutex());
+  int64 next_waiter_id_ GUARDED_BY(scheduler_->mutex());
+
+  Variable* coalesced_fetches_;
+  Variable* coalesced_fetches_saved_;
+  Variable* coalesced_fetch_timeouts_;
+
+  DISALLOW_COPY_AND_ASSIGN(CoalescingUrlAsyncFetcher);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NET_INSTAWEB_HTTP_PUBLIC_COALESCING_URL_ASYNC_FETCHER_H_
@@ -71,6 +71,12 @@ class HTTPValue : public Writer {
   // object is in scope.
   bool ExtractContents(StringPiece* str) const;
 
+  // Retrieves the contents as a view of this value's storage, returning
+  // false if empty.  Unlike the StringPiece variant, the returned
+  // SharedString holds a reference to the storage, so it stays valid after
+  // this HTTPValue is cleared or destroyed, and no bytes are copied.
+  bool ExtractContents(SharedString* contents) const;
+
   // Tests whether this reference is the only active one to the string object.
   bool unique() const { return storage_.unique(); }
 
@@ -23,6 +23,7 @@
 #include "net/instaweb/http/public/http_value.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/http/response_headers.h"
 #include "pagespeed/kernel/util/gzip_inflater.h"
@@ -73,6 +74,10 @@ class InflatingFetch : public SharedAsyncFetch {
   // otherwise just passes bytes.
   virtual bool HandleWrite(const StringPiece& sp, MessageHandler* handler);
 
+  // Passes shared bytes through as they are if no inflation is needed.
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler);
+
   // Analyzes headers and depending on the request settings and flags will
   // either setup inflater or not.
   virtual void HandleHeadersComplete();
@@ -20,6 +20,7 @@
 
 #include "base/logging.h"
 #include "net/instaweb/http/public/async_fetch.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/statistics.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
@@ -76,6 +77,12 @@ class UrlAsyncFetcherStats::StatsAsyncFetch : public SharedAsyncFetch {
     return SharedAsyncFetch::HandleWrite(content, handler);
   }
 
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler) {
+    size_ += content.size();
+    return SharedAsyncFetch::HandleWriteShared(content, handler);
+  }
+
  private:
   UrlAsyncFetcherStats* stats_fetcher_;
   int64 start_time_us_;
@@ -1223,6 +1223,7 @@
         'http/async_fetch.cc',
         'http/async_fetch_with_lock.cc',
         'http/cache_url_async_fetcher.cc',
+        'http/coalescing_url_async_fetcher.cc',
         'http/external_url_fetcher.cc',
         'http/http_cache.cc',
         'http/http_cache_failure.cc',
@@ -1571,6 +1572,7 @@
         'rewriter/add_instrumentation_filter.cc',
         'rewriter/base_tag_filter.cc',
         'rewriter/cache_extender.cc',
+        'rewriter/cache_warmer.cc',
         'rewriter/cacheable_resource_base.cc',
         'rewriter/collect_dependencies_filter.cc',
         'rewriter/common_filter.cc',
@@ -1703,6 +1705,8 @@
         '<(DEPTH)/pagespeed/system/add_headers_fetcher.cc',
         '<(DEPTH)/pagespeed/system/admin_site.cc',
         '<(DEPTH)/pagespeed/system/apr_mem_cache.cc',
+        '<(DEPTH)/pagespeed/system/async_mem_cache.cc',
+        '<(DEPTH)/pagespeed/system/async_redis_cache.cc',
         '<(DEPTH)/pagespeed/system/redis_cache.cc',
         '<(DEPTH)/pagespeed/system/apr_thread_compatible_pool.cc',
         '<(DEPTH)/pagespeed/system/controller_manager.cc',
@@ -0,0 +1,626 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "net/instaweb/rewriter/public/cache_warmer.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/http/public/request_context.h"
+#include "net/instaweb/http/public/url_async_fetcher.h"
+#include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/rewriter/public/rewrite_query.h"
+#include "net/instaweb/rewriter/public/server_context.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/condvar.h"
+#include "pagespeed/kernel/base/file_system.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/null_writer.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/html/html_keywords.h"
+#include "pagespeed/kernel/http/content_type.h"
+#include "pagespeed/kernel/http/google_url.h"
+#include "pagespeed/kernel/http/http_names.h"
+#include "pagespeed/kernel/http/response_headers.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// How long ShutDown waits at a time for pages being warmed to finish.
+const int64 kShutDownWaitMs = 100;
+
+}  // namespace
+
+const char CacheWarmer::kPagesWarmed[] = "cache_warmer_pages_warmed";
+const char CacheWarmer::kPagesSkipped[] = "cache_warmer_pages_skipped";
+const char CacheWarmer::kPagesFailed[] = "cache_warmer_pages_failed";
+const char CacheWarmer::kPagesDropped[] = "cache_warmer_pages_dropped";
+const char CacheWarmer::kPagesOverQueueLimit[] =
+    "cache_warmer_pages_over_queue_limit";
+
+const int64 CacheWarmer::kMaxSourceBytes = 16 * 1000 * 1000;
+
+// The pages queued by one call to Warm.
+class CacheWarmer::Batch {
+ public:
+  Batch(int remaining, Function* done) : remaining_(remaining), done_(done) {}
+
+  int remaining_;
+  Function* done_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(Batch);
+};
+
+// Lets the callbacks of the pages being warmed find the warmer, until
+// ShutDown abandons them.
+class CacheWarmer::Tracker : public RefCounted<Tracker> {
+ public:
+  Tracker(CacheWarmer* warmer, ThreadSystem* thread_system)
+      : mutex_(thread_system->NewMutex()),
+        left_(mutex_->NewCondvar()),
+        warmer_(warmer),
+        busy_(0) {
+  }
+
+  // Returns the warmer, which won't be deleted until Leave is called, or
+  // NULL if the pages have been abandoned.
+  CacheWarmer* Enter() {
+    ScopedMutex lock(mutex_.get());
+    if (warmer_ != NULL) {
+      ++busy_;
+    }
+    return warmer_;
+  }
+
+  void Leave() {
+    ScopedMutex lock(mutex_.get());
+    if (--busy_ == 0) {
+      left_->Broadcast();
+    }
+  }
+
+  // Waits for the callbacks that have entered to leave, and turns away any
+  // that come later.
+  void Abandon() {
+    ScopedMutex lock(mutex_.get());
+    while (busy_ > 0) {
+      left_->Wait();
+    }
+    warmer_ = NULL;
+  }
+
+ private:
+  friend class RefCounted<Tracker>;
+  ~Tracker() {}
+
+  scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex_;
+  scoped_ptr<ThreadSystem::Condvar> left_;
+  CacheWarmer* warmer_ GUARDED_BY(mutex_);
+  int busy_ GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(Tracker);
+};
+
+class CacheWarmer::Page {
+ public:
+  Page(const QueuedUrl& queued, ServerContext* server_context,
+       const RefCountedPtr<Tracker>& tracker)
+      : url_(queued.url),
+        batch_(queued.batch),
+        tracker_(tracker),
+        request_context_(new RequestContext(
+            server_context->global_options()->ComputeHttpOptions(),
+            server_context->thread_system()->NewMutex(),
+            server_context->timer())),
+        sequence_(NULL),
+        parse_start_us_(0) {
+  }
+
+  const GoogleString url_;
+  Batch* batch_;
+  RefCountedPtr<Tracker> tracker_;
+  RequestContextPtr request_context_;
+  GoogleString body_;
+  NullWriter writer_;
+  QueuedWorkerPool::Sequence* sequence_;
+  int64 parse_start_us_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(Page);
+};
+
+// Runs a method of the warmer on a page, or just deletes the page if the
+// warmer has abandoned it.  Cancel runs cancel, if given, and otherwise run.
+class CacheWarmer::PageStep : public Function {
+ public:
+  typedef Function* (CacheWarmer::*Method)(Page* page);
+
+  PageStep(Page* page, Method run, Method cancel)
+      : page_(page), run_(run), cancel_(cancel) {
+  }
+
+ protected:
+  virtual void Run() { Step(run_); }
+  virtual void Cancel() { Step((cancel_ != NULL) ? cancel_ : run_); }
+
+ private:
+  void Step(Method method) {
+    // The page may be deleted by method.
+    RefCountedPtr<Tracker> tracker(page_->tracker_);
+    CacheWarmer* warmer = tracker->Enter();
+    if (warmer == NULL) {
+      // Any sequence of the page's is left to the pool, which deletes its
+      // sequences when it is deleted.
+      delete page_;
+      return;
+    }
+    Function* done = (warmer->*method)(page_);
+    tracker->Leave();
+    if (done != NULL) {
+      done->CallRun();
+    }
+  }
+
+  Page* page_;
+  Method run_;
+  Method cancel_;
+
+  DISALLOW_COPY_AND_ASSIGN(PageStep);
+};
+
+// Collects a page's HTML, and hands it back to the warmer.
+class CacheWarmer::WarmFetch : public StringAsyncFetch {
+ public:
+  explicit WarmFetch(Page* page)
+      : StringAsyncFetch(page->request_context_, &page->body_),
+        page_(page) {
+    // Ask the origin for the page as it is, rather than rewriting it in
+    // the serving path as well as here.
+    request_headers()->Add(RewriteQuery::kPageSpeed, "off");
+  }
+
+  virtual void HandleDone(bool success) {
+    const ResponseHeaders* headers = response_headers();
+    bool fetched = success && (headers->status_code() == HttpStatus::kOK);
+    RefCountedPtr<Tracker> tracker(page_->tracker_);
+    CacheWarmer* warmer = tracker->Enter();
+    Function* done = NULL;
+    if (warmer == NULL) {
+      delete page_;
+    } else {
+      done = warmer->FetchDone(page_, fetched,
+                               fetched && headers->IsHtmlLike());
+      tracker->Leave();
+    }
+    delete this;
+    if (done != NULL) {
+      done->CallRun();
+    }
+  }
+
+ private:
+  Page* page_;
+
+  DISALLOW_COPY_AND_ASSIGN(WarmFetch);
+};
+
+CacheWarmer::CacheWarmer(const Options& options,
+                         ServerContext* server_context)
+    : options_(options),
+      server_context_(server_context),
+      scheduler_(server_context->scheduler()),
+      tracker_(new Tracker(this, server_context->thread_system())),
+      active_(0),
+      next_start_us_(0),
+      alarm_(NULL),
+      shut_down_(false),
+      recent_urls_mutex_(server_context->thread_system()->NewMutex()) {
+  Statistics* stats = server_context->statistics();
+  pages_warmed_ = stats->GetVariable(kPagesWarmed);
+  pages_skipped_ = stats->GetVariable(kPagesSkipped);
+  pages_failed_ = stats->GetVariable(kPagesFailed);
+  pages_dropped_ = stats->GetVariable(kPagesDropped);
+  pages_over_queue_limit_ = stats->GetVariable(kPagesOverQueueLimit);
+}
+
+CacheWarmer::~CacheWarmer() {
+  ShutDown();
+}
+
+void CacheWarmer::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kPagesWarmed);
+  statistics->AddVariable(kPagesSkipped);
+  statistics->AddVariable(kPagesFailed);
+  statistics->AddVariable(kPagesDropped);
+  statistics->AddVariable(kPagesOverQueueLimit);
+}
+
+void CacheWarmer::ParseAccessLog(StringPiece log, const GoogleUrl& base,
+                                 StringVector* urls) {
+  StringPieceVector lines;
+  SplitStringPieceToVector(log, "\n", &lines, true /* omit_empty_strings */);
+  std::set<GoogleString> seen;
+  for (int i = 0, n = lines.size(); i < n; ++i) {
+    // 1.2.3.4 - - [date] "GET /path HTTP/1.1" 200 1234 ...
+    StringPiece line = lines[i];
+    StringPiece::size_type open = line.find('"');
+    if (open == StringPiece::npos) {
+      continue;
+    }
+    StringPiece::size_type close = line.find('"', open + 1);
+    if (close == StringPiece::npos) {
+      continue;
+    }
+    StringPieceVector request;
+    SplitStringPieceToVector(line.substr(open + 1, close - open - 1), " ",
+                             &request, true /* omit_empty_strings */);
+    StringPieceVector response;
+    SplitStringPieceToVector(line.substr(close + 1), " ", &response,
+                             true /* omit_empty_strings */);
+    if ((request.size() < 2) || (request[0] != "GET") || response.empty() ||
+        ((response[0] != "200") && (response[0] != "304"))) {
+      continue;
+    }
+    GoogleUrl url(base, request[1]);
+    if (!url.IsWebValid()) {
+      continue;
+    }
+    const ContentType* type = NameExtensionToContentType(url.LeafSansQuery());
+    if ((type != NULL) && !type->IsHtmlLike()) {
+      continue;
+    }
+    GoogleString spec;
+    url.Spec().CopyToString(&spec);
+    if (seen.insert(spec).second) {
+      urls->push_back(spec);
+    }
+  }
+}
+
+void CacheWarmer::ParseSitemap(StringPiece sitemap, StringVector* urls) {
+  static const char kLocStart[] = "<loc>";
+  static const char kLocEnd[] = "</loc>";
+  StringPiece rest = sitemap;
+  while (true) {
+    StringPiece::size_type start = rest.find(kLocStart);
+    if (start == StringPiece::npos) {
+      break;
+    }
+    rest.remove_prefix(start + STATIC_STRLEN(kLocStart));
+    StringPiece::size_type end = rest.find(kLocEnd);
+    if (end == StringPiece::npos) {
+      break;
+    }
+    StringPiece loc = rest.substr(0, end);
+    TrimWhitespace(&loc);
+    GoogleString buf;
+    bool decoding_error = false;
+    StringPiece url = HtmlKeywords::Unescape(loc, &buf, &decoding_error);
+    if (!url.empty() && !decoding_error) {
+      urls->push_back(url.as_string());
+    }
+    rest.remove_prefix(end + STATIC_STRLEN(kLocEnd));
+  }
+}
+
+int64 CacheWarmer::IdleTimeUs(int64 busy_us, int cpu_percent) {
+  if (cpu_percent >= 100) {
+    return 0;
+  }
+  cpu_percent = std::max(cpu_percent, 1);
+  return busy_us * (100 - cpu_percent) / cpu_percent;
+}
+
+int CacheWarmer::Warm(const StringVector& urls, Function* done) {
+  int num_queued = 0;
+  int num_dropped = 0;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    if (shut_down_) {
+      num_dropped = urls.size();
+    } else {
+      int room = options_.max_queued_urls - static_cast<int>(queue_.size());
+      num_queued = std::max(0, std::min(static_cast<int>(urls.size()), room));
+      if (num_queued > 0) {
+        Batch* batch = new Batch(num_queued, done);
+        for (int i = 0; i < num_queued; ++i) {
+          QueuedUrl queued;
+          queued.url = urls[i];
+          queued.batch = batch;
+          queue_.push_back(queued);
+        }
+      }
+    }
+  }
+  if (num_dropped > 0) {
+    pages_dropped_->Add(num_dropped);
+  }
+  int num_over_limit = urls.size() - num_queued - num_dropped;
+  if (num_over_limit > 0) {
+    pages_over_queue_limit_->Add(num_over_limit);
+  }
+  if (num_queued == 0) {
+    if (done != NULL) {
+      done->CallRun();
+    }
+    return 0;
+  }
+  StartPages();
+  return num_queued;
+}
+
+bool CacheWarmer::WarmFromSource(StringPiece name, const GoogleUrl& base,
+                                 Function* done, int* num_queued,
+                                 GoogleString* error) {
+  *num_queued = 0;
+  // Only read files directly in source_dir, so that the admin site can't be
+  // used to read anything else on the server.
+  bool ok = false;
+  GoogleString contents;
+  if (options_.source_dir.empty()) {
+    *error = "No CacheWarmingDirectory is configured";
+  } else if (name.empty() || (name == ".") || (name == "..") ||
+             (name.find('/') != StringPiece::npos) ||
+             (name.find('\0') != StringPiece::npos)) {
+    *error = StrCat("Not a file name: ", name);
+  } else {
+    GoogleString path = options_.source_dir;
+    EnsureEndsInSlash(&path);
+    StrAppend(&path, name);
+    ok = server_context_->file_system()->ReadFile(
+        path.c_str(), kMaxSourceBytes, &contents,
+        server_context_->message_handler());
+    if (!ok) {
+      *error = StrCat("Could not read ", name, ", or it is over ",
+                      Integer64ToString(kMaxSourceBytes), " bytes");
+    }
+  }
+  if (!ok) {
+    if (done != NULL) {
+      done->CallRun();
+    }
+    return false;
+  }
+  StringVector urls;
+  if (contents.find("<loc>") != GoogleString::npos) {
+    ParseSitemap(contents, &urls);
+  } else {
+    ParseAccessLog(contents, base, &urls);
+  }
+  *num_queued = Warm(urls, done);
+  return true;
+}
+
+void CacheWarmer::RecordUrl(StringPiece url) {
+  GoogleString url_string = url.as_string();
+  ScopedMutex lock(recent_urls_mutex_.get());
+  if ((options_.max_recent_urls <= 0) ||
+      !recent_url_set_.insert(url_string).second) {
+    return;
+  }
+  recent_urls_.push_back(url_string);
+  if (static_cast<int>(recent_urls_.size()) > options_.max_recent_urls) {
+    recent_url_set_.erase(recent_urls_.front());
+    recent_urls_.pop_front();
+  }
+}
+
+int CacheWarmer::WarmRecentUrls(Function* done) {
+  StringVector urls;
+  {
+    ScopedMutex lock(recent_urls_mutex_.get());
+    urls.assign(recent_urls_.begin(), recent_urls_.end());
+  }
+  return Warm(urls, done);
+}
+
+int CacheWarmer::pending() {
+  ScopedMutex lock(scheduler_->mutex());
+  return queue_.size() + active_;
+}
+
+void CacheWarmer::ShutDown() {
+  std::vector<Function*> done_callbacks;
+  int num_dropped = 0;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    shut_down_ = true;
+    for (; !queue_.empty(); queue_.pop_front()) {
+      ++num_dropped;
+      Function* done = BatchDone(queue_.front().batch);
+      if (done != NULL) {
+        done_callbacks.push_back(done);
+      }
+    }
+    // If the alarm has already started to run, it will clear alarm_ itself,
+    // which it does promptly, so it is waited for regardless of the timeout.
+    if ((alarm_ != NULL) && scheduler_->CancelAlarm(alarm_)) {
+      alarm_ = NULL;
+    }
+    Timer* timer = scheduler_->timer();
+    int64 deadline_ms = timer->NowMs() + options_.shutdown_timeout_ms;
+    while (alarm_ != NULL) {
+      scheduler_->BlockingTimedWaitMs(kShutDownWaitMs);
+    }
+    for (int64 now_ms = timer->NowMs(); (active_ > 0) && (now_ms < deadline_ms);
+         now_ms = timer->NowMs()) {
+      scheduler_->BlockingTimedWaitMs(
+          std::min(kShutDownWaitMs, deadline_ms - now_ms));
+    }
+  }
+
+  // Turn away the callbacks of pages still being warmed, waiting for any
+  // already running, then finish their batches for them.
+  tracker_->Abandon();
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    for (std::multiset<Batch*>::iterator p = active_batches_.begin(),
+             e = active_batches_.end(); p != e; ++p) {
+      ++num_dropped;
+      Function* done = BatchDone(*p);
+      if (done != NULL) {
+        done_callbacks.push_back(done);
+      }
+    }
+    active_batches_.clear();
+    active_ = 0;
+  }
+  pages_dropped_->Add(num_dropped);
+  for (int i = 0, n = done_callbacks.size(); i < n; ++i) {
+    done_callbacks[i]->CallRun();
+  }
+}
+
+void CacheWarmer::StartPages() {
+  std::vector<Page*> pages;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    TakePages(&pages);
+  }
+  FetchPages(pages);
+}
+
+void CacheWarmer::TakePages(std::vector<Page*>* pages) {
+  int64 now_us = scheduler_->timer()->NowUs();
+  while (!shut_down_ && !queue_.empty() &&
+         (active_ < options_.max_concurrency)) {
+    if (now_us < next_start_us_) {
+      if (alarm_ == NULL) {
+        alarm_ = scheduler_->AddAlarmAtUsMutexHeld(
+            next_start_us_, MakeFunction(this, &CacheWarmer::AlarmFired));
+      }
+      break;
+    }
+    pages->push_back(new Page(queue_.front(), server_context_, tracker_));
+    active_batches_.insert(queue_.front().batch);
+    queue_.pop_front();
+    ++active_;
+  }
+}
+
+void CacheWarmer::FetchPages(const std::vector<Page*>& pages) {
+  for (int i = 0, n = pages.size(); i < n; ++i) {
+    WarmFetch* fetch = new WarmFetch(pages[i]);
+    server_context_->DefaultSystemFetcher()->Fetch(
+        pages[i]->url_, server_context_->message_handler(), fetch);
+  }
+}
+
+void CacheWarmer::AlarmFired() {
+  std::vector<Page*> pages;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    alarm_ = NULL;
+    if (shut_down_) {
+      scheduler_->Signal();
+      return;
+    }
+    TakePages(&pages);
+  }
+  FetchPages(pages);
+}
+
+Function* CacheWarmer::FetchDone(Page* page, bool fetched, bool is_html) {
+  if (!fetched) {
+    return PageDone(page, pages_failed_, 0);
+  } else if (!is_html) {
+    return PageDone(page, pages_skipped_, 0);
+  }
+  QueuedWorkerPool* pool = server_context_->low_priority_rewrite_workers();
+  page->sequence_ = pool->NewSequence();
+  if (page->sequence_ == NULL) {
+    return PageDone(page, pages_dropped_, 0);  // Shutting down.
+  }
+  page->sequence_->Add(new PageStep(page, &CacheWarmer::ParsePage,
+                                    &CacheWarmer::ParseCancelled));
+  return NULL;
+}
+
+Function* CacheWarmer::ParsePage(Page* page) {
+  server_context_->low_priority_rewrite_workers()->FreeSequence(
+      page->sequence_);
+  page->parse_start_us_ = scheduler_->timer()->NowUs();
+  RewriteDriver* driver =
+      server_context_->NewRewriteDriver(page->request_context_);
+  driver->set_fully_rewrite_on_flush(true);
+  driver->SetWriter(&page->writer_);
+  if (!driver->StartParse(page->url_)) {
+    driver->Cleanup();
+    return PageDone(page, pages_failed_, 0);
+  }
+  driver->ParseText(page->body_);
+  driver->FinishParseAsync(new PageStep(page, &CacheWarmer::ParseDone, NULL));
+  return NULL;
+}
+
+Function* CacheWarmer::ParseCancelled(Page* page) {
+  // The low-priority pool sheds work when the server is busy.
+  server_context_->low_priority_rewrite_workers()->FreeSequence(
+      page->sequence_);
+  return PageDone(page, pages_dropped_, 0);
+}
+
+Function* CacheWarmer::ParseDone(Page* page) {
+  return PageDone(page, pages_warmed_,
+                  scheduler_->timer()->NowUs() - page->parse_start_us_);
+}
+
+Function* CacheWarmer::PageDone(Page* page, Variable* stat, int64 busy_us) {
+  stat->Add(1);
+  Batch* batch = page->batch_;
+  delete page;
+
+  // Anything more to do is decided under the lock, so that ShutDown either
+  // sees the pages started here as active, or stops them being started.
+  Function* done = NULL;
+  std::vector<Page*> pages;
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    --active_;
+    active_batches_.erase(active_batches_.find(batch));
+    if (busy_us > 0) {
+      int64 now_us = scheduler_->timer()->NowUs();
+      next_start_us_ = std::max(next_start_us_, now_us) +
+          IdleTimeUs(busy_us, options_.cpu_percent);
+    }
+    done = BatchDone(batch);
+    if (shut_down_) {
+      scheduler_->Signal();
+    } else {
+      TakePages(&pages);
+    }
+  }
+  FetchPages(pages);
+  return done;
+}
+
+Function* CacheWarmer::BatchDone(Batch* batch) {
+  if (--batch->remaining_ > 0) {
+    return NULL;
+  }
+  Function* done = batch->done_;
+  delete batch;
+  return done;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,473 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the cache warmer.
+
+#include "net/instaweb/rewriter/public/cache_warmer.h"
+
+#include "net/instaweb/http/public/counting_url_async_fetcher.h"
+#include "net/instaweb/http/public/wait_url_async_fetcher.h"
+#include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/rewriter/public/rewrite_test_base.h"
+#include "net/instaweb/rewriter/public/server_context.h"
+#include "net/instaweb/rewriter/public/test_rewrite_driver_factory.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/lru_cache.h"
+#include "pagespeed/kernel/html/empty_html_filter.h"
+#include "pagespeed/kernel/http/content_type.h"
+#include "pagespeed/kernel/http/google_url.h"
+#include "pagespeed/kernel/thread/mock_scheduler.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
+#include "pagespeed/kernel/thread/worker_test_base.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kCss[] = "  a  {  color:  red  }  ";
+const char kPageWithCss[] =
+    "<html><head><link rel=stylesheet href=a.css></head></html>";
+const char kPlainPage[] = "<html><body>Hello</body></html>";
+const int64 kParseMs = 100;
+
+// Makes each parse take kParseMs, as far as the mock timer is concerned.
+class SlowParseFilter : public EmptyHtmlFilter {
+ public:
+  explicit SlowParseFilter(MockTimer* timer) : timer_(timer) {}
+
+  virtual void StartDocument() { timer_->AdvanceMs(kParseMs); }
+  virtual const char* Name() const { return "SlowParse"; }
+
+ private:
+  MockTimer* timer_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlowParseFilter);
+};
+
+class SlowParseFilterCallback
+    : public TestRewriteDriverFactory::CreateFilterCallback {
+ public:
+  explicit SlowParseFilterCallback(MockTimer* timer) : timer_(timer) {}
+
+  virtual HtmlFilter* Done(RewriteDriver* driver) {
+    return new SlowParseFilter(timer_);
+  }
+
+ private:
+  MockTimer* timer_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlowParseFilterCallback);
+};
+
+// Counts how often it is run, and notifies sync.
+class CountingFunction : public Function {
+ public:
+  CountingFunction(int* count, WorkerTestBase::SyncPoint* sync)
+      : count_(count), sync_(sync) {}
+
+ protected:
+  virtual void Run() {
+    ++*count_;
+    sync_->Notify();
+  }
+
+ private:
+  int* count_;
+  WorkerTestBase::SyncPoint* sync_;
+
+  DISALLOW_COPY_AND_ASSIGN(CountingFunction);
+};
+
+}  // namespace
+
+class CacheWarmerTest : public RewriteTestBase {
+ protected:
+  virtual void SetUp() {
+    RewriteTestBase::SetUp();
+    RewriteOptions* global_options = server_context()->global_options();
+    global_options->ClearSignatureForTesting();
+    global_options->EnableFilter(RewriteOptions::kRewriteCss);
+    server_context()->ComputeSignature(global_options);
+
+    SetResponseWithDefaultHeaders("a.css", kContentTypeCss, kCss, 100);
+    SetResponseWithDefaultHeaders("page.html", kContentTypeHtml,
+                                  kPageWithCss, 100);
+    SetResponseWithDefaultHeaders("plain1.html", kContentTypeHtml,
+                                  kPlainPage, 100);
+    SetResponseWithDefaultHeaders("plain2.html", kContentTypeHtml,
+                                  kPlainPage, 100);
+  }
+
+  virtual void TearDown() {
+    warmer_.reset(NULL);
+    RewriteTestBase::TearDown();
+  }
+
+  void Init() {
+    warmer_.reset(new CacheWarmer(warmer_options_, server_context()));
+  }
+
+  // Warms url, and waits until that's done.
+  void WarmAndWait(StringPiece url) {
+    WorkerTestBase::SyncPoint sync(server_context()->thread_system());
+    StringVector urls;
+    urls.push_back(AbsolutifyUrl(url));
+    warmer_->Warm(urls, new WorkerTestBase::NotifyRunFunction(&sync));
+    sync.Wait();
+  }
+
+  int64 Stat(const char* name) {
+    return statistics()->GetVariable(name)->Get();
+  }
+
+  CacheWarmer::Options warmer_options_;
+  scoped_ptr<CacheWarmer> warmer_;
+};
+
+TEST_F(CacheWarmerTest, ParseAccessLog) {
+  const char kLog[] =
+      "1.2.3.4 - - [10/Oct/2016:13:55:36 -0700] \"GET /index.html HTTP/1.1\" "
+          "200 2326\n"
+      "1.2.3.4 - - [10/Oct/2016:13:55:37 -0700] \"GET /a.css HTTP/1.1\" "
+          "200 100\n"
+      "1.2.3.4 - - [10/Oct/2016:13:55:38 -0700] \"POST /form HTTP/1.1\" "
+          "200 10\n"
+      "1.2.3.4 - - [10/Oct/2016:13:55:39 -0700] \"GET /missing HTTP/1.1\" "
+          "404 10\n"
+      "1.2.3.4 - - [10/Oct/2016:13:55:40 -0700] \"GET /dir/?q=1 HTTP/1.1\" "
+          "304 - \"http://example.com/\" \"Mozilla/5.0\"\n"
+      "1.2.3.4 - - [10/Oct/2016:13:55:41 -0700] \"GET /index.html HTTP/1.1\" "
+          "200 2326\n"
+      "garbage\n";
+  GoogleUrl base("http://example.com/");
+  StringVector urls;
+  CacheWarmer::ParseAccessLog(kLog, base, &urls);
+  ASSERT_EQ(2, urls.size());
+  EXPECT_EQ("http://example.com/index.html", urls[0]);
+  EXPECT_EQ("http://example.com/dir/?q=1", urls[1]);
+}
+
+TEST_F(CacheWarmerTest, ParseSitemap) {
+  const char kSitemap[] =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\">\n"
+      "  <url><loc>http://example.com/</loc></url>\n"
+      "  <url>\n"
+      "    <loc>\n      http://example.com/a?b=1&amp;c=2\n    </loc>\n"
+      "    <lastmod>2016-01-01</lastmod>\n"
+      "  </url>\n"
+      "</urlset>\n";
+  StringVector urls;
+  CacheWarmer::ParseSitemap(kSitemap, &urls);
+  ASSERT_EQ(2, urls.size());
+  EXPECT_EQ("http://example.com/", urls[0]);
+  EXPECT_EQ("http://example.com/a?b=1&c=2", urls[1]);
+}
+
+TEST_F(CacheWarmerTest, IdleTime) {
+  EXPECT_EQ(0, CacheWarmer::IdleTimeUs(1000, 100));
+  EXPECT_EQ(1000, CacheWarmer::IdleTimeUs(1000, 50));
+  EXPECT_EQ(9000, CacheWarmer::IdleTimeUs(1000, 10));
+}
+
+TEST_F(CacheWarmerTest, WarmsPage) {
+  Init();
+  WarmAndWait("page.html");
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesWarmed));
+  EXPECT_EQ(2, counting_url_async_fetcher()->fetch_count());  // Page and CSS.
+  EXPECT_LT(0, lru_cache()->num_inserts());
+
+  // Warming the page again only needs the page itself: its rewrites are
+  // cached.
+  ClearStats();
+  WarmAndWait("page.html");
+  EXPECT_EQ(1, counting_url_async_fetcher()->fetch_count());
+  EXPECT_LT(0, lru_cache()->num_hits());
+}
+
+TEST_F(CacheWarmerTest, SkipsNonHtml) {
+  Init();
+  WarmAndWait("a.css");
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesSkipped));
+  EXPECT_EQ(0, Stat(CacheWarmer::kPagesWarmed));
+}
+
+TEST_F(CacheWarmerTest, FetchFailure) {
+  SetFetchResponse404("missing.html");
+  Init();
+  WarmAndWait("missing.html");
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesFailed));
+  EXPECT_EQ(0, Stat(CacheWarmer::kPagesWarmed));
+}
+
+TEST_F(CacheWarmerTest, RecentUrls) {
+  warmer_options_.max_recent_urls = 2;
+  Init();
+  warmer_->RecordUrl(AbsolutifyUrl("missing.html"));
+  warmer_->RecordUrl(AbsolutifyUrl("plain1.html"));
+  warmer_->RecordUrl(AbsolutifyUrl("plain1.html"));
+  warmer_->RecordUrl(AbsolutifyUrl("plain2.html"));
+
+  // Only the two most recent distinct URLs are remembered.
+  WorkerTestBase::SyncPoint sync(server_context()->thread_system());
+  warmer_->WarmRecentUrls(new WorkerTestBase::NotifyRunFunction(&sync));
+  sync.Wait();
+  EXPECT_EQ(2, Stat(CacheWarmer::kPagesWarmed));
+  EXPECT_EQ(0, Stat(CacheWarmer::kPagesFailed));
+}
+
+TEST_F(CacheWarmerTest, Concurrency) {
+  SetupWaitFetcher();
+  warmer_options_.max_concurrency = 1;
+  Init();
+  StringVector urls;
+  urls.push_back(AbsolutifyUrl("plain1.html"));
+  urls.push_back(AbsolutifyUrl("plain2.html"));
+  WorkerTestBase::SyncPoint sync(server_context()->thread_system());
+  warmer_->Warm(urls, new WorkerTestBase::NotifyRunFunction(&sync));
+
+  // Only one page is fetched at a time, so releasing the held fetches lets
+  // just the first through.
+  EXPECT_EQ(2, warmer_->pending());
+  factory()->wait_url_async_fetcher()->CallCallbacks();
+  EXPECT_EQ(1, counting_url_async_fetcher()->fetch_count());
+  factory()->wait_url_async_fetcher()->SetPassThroughMode(true);
+  sync.Wait();
+  EXPECT_EQ(2, counting_url_async_fetcher()->fetch_count());
+  EXPECT_EQ(2, Stat(CacheWarmer::kPagesWarmed));
+  EXPECT_EQ(0, warmer_->pending());
+}
+
+TEST_F(CacheWarmerTest, CpuBudget) {
+  SlowParseFilterCallback slow_parse(factory()->mock_timer());
+  factory()->AddCreateFilterCallback(&slow_parse);
+  warmer_options_.max_concurrency = 1;
+  warmer_options_.cpu_percent = 50;
+  Init();
+
+  WorkerTestBase::SyncPoint sync1(server_context()->thread_system());
+  WorkerTestBase::SyncPoint sync2(server_context()->thread_system());
+  StringVector urls;
+  urls.push_back(AbsolutifyUrl("plain1.html"));
+  warmer_->Warm(urls, new WorkerTestBase::NotifyRunFunction(&sync1));
+  urls[0] = AbsolutifyUrl("plain2.html");
+  warmer_->Warm(urls, new WorkerTestBase::NotifyRunFunction(&sync2));
+  sync1.Wait();
+
+  // The first parse took kParseMs, so at 50% the second page waits as long
+  // again before it's fetched.
+  EXPECT_EQ(1, counting_url_async_fetcher()->fetch_count());
+  EXPECT_EQ(1, warmer_->pending());
+  mock_scheduler()->AdvanceTimeMs(kParseMs - 1);
+  EXPECT_EQ(1, counting_url_async_fetcher()->fetch_count());
+  mock_scheduler()->AdvanceTimeMs(1);
+  sync2.Wait();
+  EXPECT_EQ(2, counting_url_async_fetcher()->fetch_count());
+  factory()->ClearFilterCallbackVector();
+}
+
+TEST_F(CacheWarmerTest, QueueLimit) {
+  SetupWaitFetcher();
+  warmer_options_.max_concurrency = 1;
+  warmer_options_.max_queued_urls = 1;
+  Init();
+  StringVector urls;
+  urls.push_back(AbsolutifyUrl("plain1.html"));
+  urls.push_back(AbsolutifyUrl("plain2.html"));
+  urls.push_back(AbsolutifyUrl("page.html"));
+  WorkerTestBase::SyncPoint sync1(server_context()->thread_system());
+  WorkerTestBase::SyncPoint sync2(server_context()->thread_system());
+  EXPECT_EQ(1, warmer_->Warm(urls,
+                             new WorkerTestBase::NotifyRunFunction(&sync1)));
+  EXPECT_EQ(2, Stat(CacheWarmer::kPagesOverQueueLimit));
+
+  // The first page is being fetched rather than queued, so there is room for
+  // one more.
+  EXPECT_EQ(1, warmer_->Warm(urls,
+                             new WorkerTestBase::NotifyRunFunction(&sync2)));
+  EXPECT_EQ(4, Stat(CacheWarmer::kPagesOverQueueLimit));
+  EXPECT_EQ(2, warmer_->pending());
+  factory()->wait_url_async_fetcher()->SetPassThroughMode(true);
+  sync1.Wait();
+  sync2.Wait();
+  EXPECT_EQ(2, Stat(CacheWarmer::kPagesWarmed));
+}
+
+TEST_F(CacheWarmerTest, WarmFromSource) {
+  GoogleString dir = StrCat(GTestTempDir(), "/warm");
+  warmer_options_.source_dir = dir;
+  Init();
+  WriteFile(StrCat(dir, "/sitemap.xml").c_str(),
+            StrCat("<urlset><url><loc>", AbsolutifyUrl("plain1.html"),
+                   "</loc></url></urlset>"));
+
+  WorkerTestBase::SyncPoint sync(server_context()->thread_system());
+  GoogleUrl base(kTestDomain);
+  int num_queued = 0;
+  GoogleString error;
+  EXPECT_TRUE(warmer_->WarmFromSource(
+      "sitemap.xml", base, new WorkerTestBase::NotifyRunFunction(&sync),
+      &num_queued, &error));
+  sync.Wait();
+  EXPECT_EQ(1, num_queued);
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesWarmed));
+}
+
+TEST_F(CacheWarmerTest, WarmFromSourceOnlyReadsSourceDir) {
+  GoogleString dir = StrCat(GTestTempDir(), "/warm");
+  warmer_options_.source_dir = dir;
+  Init();
+  GoogleString sitemap = StrCat("<urlset><url><loc>",
+                                AbsolutifyUrl("plain1.html"),
+                                "</loc></url></urlset>");
+  WriteFile(StrCat(GTestTempDir(), "/secret.xml").c_str(), sitemap);
+  WriteFile(StrCat(dir, "/sub/sitemap.xml").c_str(), sitemap);
+
+  GoogleUrl base(kTestDomain);
+  int num_queued = 0;
+  GoogleString error;
+  EXPECT_FALSE(warmer_->WarmFromSource("../secret.xml", base, NULL,
+                                       &num_queued, &error));
+  EXPECT_FALSE(warmer_->WarmFromSource(StrCat(GTestTempDir(), "/secret.xml"),
+                                       base, NULL, &num_queued, &error));
+  EXPECT_FALSE(warmer_->WarmFromSource("sub/sitemap.xml", base, NULL,
+                                       &num_queued, &error));
+  EXPECT_FALSE(warmer_->WarmFromSource("..", base, NULL, &num_queued,
+                                       &error));
+  EXPECT_FALSE(warmer_->WarmFromSource("missing.xml", base, NULL,
+                                       &num_queued, &error));
+  EXPECT_EQ(0, num_queued);
+  EXPECT_EQ(0, warmer_->pending());
+  EXPECT_EQ(0, counting_url_async_fetcher()->fetch_count());
+}
+
+TEST_F(CacheWarmerTest, WarmFromSourceLimits) {
+  GoogleString dir = StrCat(GTestTempDir(), "/warm");
+  WriteFile(StrCat(dir, "/big.log").c_str(),
+            GoogleString(CacheWarmer::kMaxSourceBytes + 1, '\n'));
+  WriteFile(StrCat(dir, "/sitemap.xml").c_str(), "<loc>/a</loc>");
+  GoogleUrl base(kTestDomain);
+  int num_queued = 0;
+  GoogleString error;
+
+  // Without a source_dir nothing is read.
+  Init();
+  EXPECT_FALSE(warmer_->WarmFromSource("sitemap.xml", base, NULL,
+                                       &num_queued, &error));
+
+  warmer_options_.source_dir = dir;
+  Init();
+  EXPECT_FALSE(warmer_->WarmFromSource("big.log", base, NULL, &num_queued,
+                                       &error));
+  EXPECT_EQ(0, counting_url_async_fetcher()->fetch_count());
+}
+
+TEST_F(CacheWarmerTest, ShutDownDropsPages) {
+  Init();
+  warmer_->ShutDown();
+  StringVector urls;
+  urls.push_back(AbsolutifyUrl("plain1.html"));
+  WorkerTestBase::SyncPoint sync(server_context()->thread_system());
+  warmer_->Warm(urls, new WorkerTestBase::NotifyRunFunction(&sync));
+  sync.Wait();
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesDropped));
+  EXPECT_EQ(0, counting_url_async_fetcher()->fetch_count());
+}
+
+TEST_F(CacheWarmerTest, ShutDownAbandonsSlowFetches) {
+  SetupWaitFetcher();
+  warmer_options_.shutdown_timeout_ms = 1000;
+  Init();
+  StringVector urls;
+  urls.push_back(AbsolutifyUrl("plain1.html"));
+  int num_done = 0;
+  WorkerTestBase::SyncPoint sync(server_context()->thread_system());
+  warmer_->Warm(urls, new CountingFunction(&num_done, &sync));
+  EXPECT_EQ(1, warmer_->pending());
+
+  // The fetch is held, so ShutDown gives up on it after the timeout, and
+  // finishes its batch.
+  int64 start_ms = timer()->NowMs();
+  warmer_->ShutDown();
+  sync.Wait();
+  EXPECT_LE(start_ms + 1000, timer()->NowMs());
+  EXPECT_EQ(0, warmer_->pending());
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesDropped));
+  EXPECT_EQ(1, num_done);
+
+  // When the fetch does finish, the page is cleaned up without the warmer,
+  // which is gone by then, and the batch isn't finished again.
+  warmer_.reset(NULL);
+  factory()->wait_url_async_fetcher()->CallCallbacks();
+  EXPECT_EQ(1, counting_url_async_fetcher()->fetch_count());
+  EXPECT_EQ(0, Stat(CacheWarmer::kPagesWarmed));
+  EXPECT_EQ(0, Stat(CacheWarmer::kPagesFailed));
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesDropped));
+  EXPECT_EQ(1, num_done);
+}
+
+TEST_F(CacheWarmerTest, ShutDownAbandonsQueuedParses) {
+  warmer_options_.shutdown_timeout_ms = 1000;
+  Init();
+
+  // Wedge the low-priority pool's only worker, so the page's parse waits
+  // behind it.
+  QueuedWorkerPool* pool = server_context()->low_priority_rewrite_workers();
+  QueuedWorkerPool::Sequence* wedge = pool->NewSequence();
+  WorkerTestBase::SyncPoint wedge_started(server_context()->thread_system());
+  WorkerTestBase::SyncPoint wedge_release(server_context()->thread_system());
+  wedge->Add(new WorkerTestBase::NotifyRunFunction(&wedge_started));
+  wedge->Add(new WorkerTestBase::WaitRunFunction(&wedge_release));
+  wedge_started.Wait();
+
+  StringVector urls;
+  urls.push_back(AbsolutifyUrl("plain1.html"));
+  int num_done = 0;
+  WorkerTestBase::SyncPoint sync(server_context()->thread_system());
+  warmer_->Warm(urls, new CountingFunction(&num_done, &sync));
+  EXPECT_EQ(1, counting_url_async_fetcher()->fetch_count());
+  EXPECT_EQ(1, warmer_->pending());
+
+  warmer_->ShutDown();
+  sync.Wait();
+  EXPECT_EQ(0, warmer_->pending());
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesDropped));
+  EXPECT_EQ(1, num_done);
+
+  // Once the worker is free, the parse step only deletes the page: the warmer
+  // is gone by then.  A sequence queued after the page's runs after it.
+  warmer_.reset(NULL);
+  QueuedWorkerPool::Sequence* after = pool->NewSequence();
+  WorkerTestBase::SyncPoint after_done(server_context()->thread_system());
+  after->Add(new WorkerTestBase::NotifyRunFunction(&after_done));
+  wedge_release.Notify();
+  after_done.Wait();
+  EXPECT_EQ(0, Stat(CacheWarmer::kPagesWarmed));
+  EXPECT_EQ(1, Stat(CacheWarmer::kPagesDropped));
+  EXPECT_EQ(1, num_done);
+  pool->FreeSequence(after);
+  pool->FreeSequence(wedge);
+}
+
+}  // namespace net_instaweb
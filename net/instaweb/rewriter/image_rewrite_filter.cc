@@ -558,9 +558,15 @@ void ImageRewriteFilter::Context::RewriteSingle(
   bool is_ipro = IsNestedIn(RewriteOptions::kInPlaceRewriteId);
   AttachDependentRequestTrace(is_ipro ? "IproProcessImage" : "ProcessImage");
   AddLinkRelCanonical(input_resource, output_resource->response_headers());
+  InvokeRewriteFunction* invoke_rewrite = new InvokeRewriteFunction(
+      this, filter_, input_resource, output_resource);
+  // Let the controller estimate what this will cost from similar images.
+  if (input_resource->type() != NULL) {
+    invoke_rewrite->set_operation_type(input_resource->type()->mime_type());
+  }
+  invoke_rewrite->set_input_bytes(input_resource->UncompressedContentsSize());
   FindServerContext()->central_controller()->ScheduleExpensiveOperation(
-      new InvokeRewriteFunction(this, filter_, input_resource,
-                                output_resource));
+      invoke_rewrite);
 }
 
 void ImageRewriteFilter::Context::Render() {
@@ -196,6 +196,11 @@ bool RecordingFetch::HandleWrite(const StringPiece& content,
   return result;
 }
 
+bool RecordingFetch::HandleWriteShared(const SharedString& content,
+                                       MessageHandler* handler) {
+  return HandleWrite(content.Value(), handler);
+}
+
 bool RecordingFetch::HandleFlush(MessageHandler* handler) {
   if (streaming_) {
     return SharedAsyncFetch::HandleFlush(handler);
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NET_INSTAWEB_REWRITER_PUBLIC_CACHE_WARMER_H_
+#define NET_INSTAWEB_REWRITER_PUBLIC_CACHE_WARMER_H_
+
+#include <deque>
+#include <set>
+#include <vector>
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/ref_counted_ptr.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/thread/scheduler.h"
+
+namespace net_instaweb {
+
+class Function;
+class GoogleUrl;
+class ServerContext;
+class Statistics;
+class Variable;
+
+// Warms the metadata cache and HTTPCache for a list of pages, so that the
+// first visitors after a deploy or a cache flush don't pay for every rewrite
+// on their page.
+//
+// Each page is fetched from the origin with PageSpeed turned off, and parsed
+// by a RewriteDriver that rewrites fully, which runs every rewrite the page
+// would get and caches the results.  The parses run in the server context's
+// low-priority worker pool, which drops them under load, and at most
+// max_concurrency pages are warmed at once.  To leave the CPU to live traffic,
+// after each page the warmer idles long enough that the time spent parsing
+// stays within cpu_percent of the time elapsed.
+//
+// Pages can be listed directly, or extracted from an access log or a sitemap
+// with ParseAccessLog and ParseSitemap.  WarmFromSource reads those from
+// source_dir, and from nowhere else.  The warmer also remembers the
+// max_recent_urls HTML pages most recently passed to RecordUrl, so they can be
+// warmed again after a cache flush with WarmRecentUrls.  At most
+// max_queued_urls pages wait to be warmed; any more are dropped, and counted
+// in kPagesOverQueueLimit.
+//
+// ShutDown waits at most shutdown_timeout_ms for the pages being warmed.
+// Pages still outstanding then, such as those waiting on a slow origin, are
+// abandoned: they are counted as dropped, and are cleaned up without calling
+// back into the warmer when their fetch or parse eventually finishes.
+//
+// This class is thread-safe.
+class CacheWarmer {
+ public:
+  struct Options {
+    Options()
+        : max_concurrency(2),
+          cpu_percent(10),
+          max_recent_urls(1000),
+          max_queued_urls(10000),
+          shutdown_timeout_ms(2000) {
+    }
+
+    int max_concurrency;
+    int cpu_percent;  // 100 means no limit.
+    int max_recent_urls;
+    int max_queued_urls;
+    int64 shutdown_timeout_ms;
+    GoogleString source_dir;  // Empty means WarmFromSource always fails.
+    // Copy-construction and assign are allowed.
+  };
+
+  static const char kPagesWarmed[];
+  static const char kPagesSkipped[];
+  static const char kPagesFailed[];
+  static const char kPagesDropped[];
+  static const char kPagesOverQueueLimit[];
+
+  // Sources larger than this are not read by WarmFromSource.
+  static const int64 kMaxSourceBytes;
+
+  CacheWarmer(const Options& options, ServerContext* server_context);
+  ~CacheWarmer();
+
+  static void InitStats(Statistics* statistics);
+
+  // Appends to *urls the pages requested successfully with GET in an access
+  // log in the common or combined log format, resolved against base.  URLs
+  // whose extension shows they aren't HTML, and repeats, are left out.
+  static void ParseAccessLog(StringPiece log, const GoogleUrl& base,
+                             StringVector* urls);
+
+  // Appends to *urls the <loc> entries of an XML sitemap.
+  static void ParseSitemap(StringPiece sitemap, StringVector* urls);
+
+  // How long to idle after spending busy_us parsing, to stay within
+  // cpu_percent.
+  static int64 IdleTimeUs(int64 busy_us, int cpu_percent);
+
+  // Queues urls for warming, and returns how many were queued.  done, if not
+  // NULL, is run once they have all been warmed, skipped, or dropped.
+  int Warm(const StringVector& urls, Function* done);
+
+  // Queues for warming, as Warm does, the pages of the sitemap or access log
+  // called name in source_dir, resolving access log entries against base.
+  // Returns false, setting *error and running done, if name is not the name
+  // of a file directly in source_dir, or the file can't be read or is larger
+  // than kMaxSourceBytes.
+  bool WarmFromSource(StringPiece name, const GoogleUrl& base, Function* done,
+                      int* num_queued, GoogleString* error);
+
+  // Remembers url as a recently served HTML page.
+  void RecordUrl(StringPiece url);
+
+  // Queues the pages passed to RecordUrl for warming, as Warm does, and
+  // returns how many were queued.
+  int WarmRecentUrls(Function* done);
+
+  // Returns the number of pages queued or being warmed.
+  int pending();
+
+  // Drops the queued pages, and waits up to shutdown_timeout_ms for those
+  // being warmed to finish, abandoning any that haven't.  Called by the
+  // destructor.
+  void ShutDown();
+
+ private:
+  class Batch;
+  class Page;
+  class PageStep;
+  class Tracker;
+  class WarmFetch;
+  friend class WarmFetch;
+
+  struct QueuedUrl {
+    GoogleString url;
+    Batch* batch;
+  };
+
+  // Starts warming queued pages, as far as concurrency and the CPU budget
+  // allow.
+  void StartPages() LOCKS_EXCLUDED(scheduler_->mutex());
+  void AlarmFired() LOCKS_EXCLUDED(scheduler_->mutex());
+
+  // Takes the pages that may be started now off the queue, counting them as
+  // active, and sets an alarm for when the CPU budget allows more.
+  void TakePages(std::vector<Page*>* pages)
+      EXCLUSIVE_LOCKS_REQUIRED(scheduler_->mutex());
+
+  // Fetches pages taken by TakePages, and continues with ParsePage for those
+  // that are HTML.  Each step of a page's warming returns the callback of its
+  // batch if the page was the last of it, to be run once the step is over:
+  // the callback may delete the warmer.
+  void FetchPages(const std::vector<Page*>& pages)
+      LOCKS_EXCLUDED(scheduler_->mutex());
+  Function* FetchDone(Page* page, bool fetched, bool is_html);
+  Function* ParsePage(Page* page);
+  Function* ParseCancelled(Page* page);
+  Function* ParseDone(Page* page);
+
+  // Finishes with page, which took busy_us of parsing, counting it in stat,
+  // and starts the next pages.
+  Function* PageDone(Page* page, Variable* stat, int64 busy_us)
+      LOCKS_EXCLUDED(scheduler_->mutex());
+
+  // Counts a page of batch as done, returning batch's callback if it was the
+  // last.
+  static Function* BatchDone(Batch* batch);
+
+  const Options options_;
+  ServerContext* server_context_;
+  Scheduler* scheduler_;
+
+  // Shared with the pages being warmed, whose callbacks only reach us
+  // through it, so that ShutDown can abandon them.
+  RefCountedPtr<Tracker> tracker_;
+
+  // The scheduler's mutex guards our state, so that our alarm can be
+  // cancelled safely.
+  std::deque<QueuedUrl> queue_ GUARDED_BY(scheduler_->mutex());
+  int active_ GUARDED_BY(scheduler_->mutex());
+  // The batch of each page being warmed, to finish if the page is abandoned.
+  std::multiset<Batch*> active_batches_ GUARDED_BY(scheduler_->mutex());
+  int64 next_start_us_ GUARDED_BY(scheduler_->mutex());
+  Scheduler::Alarm* alarm_ GUARDED_BY(scheduler_->mutex());
+  bool shut_down_ GUARDED_BY(scheduler_->mutex());
+
+  // RecordUrl is called for every HTML page served, so it has a mutex of its
+  // own rather than contending with the scheduler.
+  scoped_ptr<AbstractMutex> recent_urls_mutex_;
+  std::deque<GoogleString> recent_urls_ GUARDED_BY(recent_urls_mutex_);
+  std::set<GoogleString> recent_url_set_ GUARDED_BY(recent_urls_mutex_);
+
+  Variable* pages_warmed_;
+  Variable* pages_skipped_;
+  Variable* pages_failed_;
+  Variable* pages_dropped_;
+  Variable* pages_over_queue_limit_;
+
+  DISALLOW_COPY_AND_ASSIGN(CacheWarmer);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NET_INSTAWEB_REWRITER_PUBLIC_CACHE_WARMER_H_
@@ -32,6 +32,7 @@
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/proto_util.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/http/content_type.h"
@@ -196,6 +197,9 @@ class RecordingFetch : public SharedAsyncFetch {
   virtual void HandleHeadersComplete();
   // Implements SharedAsyncFetch::HandleWrite().
   virtual bool HandleWrite(const StringPiece& content, MessageHandler* handler);
+  // Implements SharedAsyncFetch::HandleWriteShared(), via HandleWrite().
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler);
   // Implements SharedAsyncFetch::HandleFlush().
   virtual bool HandleFlush(MessageHandler* handler);
   // Implements SharedAsyncFetch::HandleDone().
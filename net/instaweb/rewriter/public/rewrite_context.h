@@ -210,6 +210,11 @@ class RewriteContext {
   // must therefore be started by a predecessor and not RewriteDriver.
   bool chained() const { return chained_; }
 
+  // Appends to *keys the metadata cache key this context will look up when
+  // it starts, unless it won't look one up.  Called by RewriteDriver before
+  // initiating its rewrites, so their lookups can be prefetched together.
+  void AppendMetadataCacheKey(StringVector* keys);
+
   // Resource slots must be added to a Rewrite before Initiate() can
   // be called.  Starting the rewrite sets in motion a sequence
   // of async cache-lookups &/or fetches.
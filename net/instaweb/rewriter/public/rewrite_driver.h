@@ -962,6 +962,25 @@ class RewriteDriver : public HtmlParse {
     return low_priority_rewrite_worker_;
   }
 
+  // Sets the deadline, in the timer's microseconds, that tasks queued on
+  // the rewrite and low-priority rewrite workers are scheduled by, when
+  // those pools schedule by deadline.  Work started for an earlier deadline
+  // may still be queued, so a deadline later than the current one is
+  // ignored, as is QueuedWorkerPool::kNoDeadline, until
+  // ClearRewriteDeadline is called.
+  void SetRewriteDeadlineUs(int64 deadline_us) LOCKS_EXCLUDED(rewrite_mutex());
+
+  // Makes the work queued on the rewrite workers background work again.
+  // Called once nothing is waiting on it, and by Clear.
+  void ClearRewriteDeadline() LOCKS_EXCLUDED(rewrite_mutex());
+
+  // The current deadline set by SetRewriteDeadlineUs, or
+  // QueuedWorkerPool::kNoDeadline if there is none.
+  int64 rewrite_deadline_us() const LOCKS_EXCLUDED(rewrite_mutex()) {
+    ScopedMutex lock(rewrite_mutex());
+    return rewrite_deadline_us_;
+  }
+
   // Make the rewrite_worker tasks run on the request thread.  This
   // must be called immediately after initializing the driver, before
   // it starts processing the request.
@@ -1308,6 +1327,13 @@ class RewriteDriver : public HtmlParse {
 
   bool RewritesComplete() const EXCLUSIVE_LOCKS_REQUIRED(rewrite_mutex());
 
+  // Versions of SetRewriteDeadlineUs and ClearRewriteDeadline for callers
+  // that already hold rewrite_mutex().
+  void SetRewriteDeadlineUsMutexHeld(int64 deadline_us)
+      EXCLUSIVE_LOCKS_REQUIRED(rewrite_mutex());
+  void ClearRewriteDeadlineMutexHeld()
+      EXCLUSIVE_LOCKS_REQUIRED(rewrite_mutex());
+
   // Sets the base GURL in response to a base-tag being parsed.  This
   // should only be called by ScanFilter.
   void SetBaseUrlIfUnset(const StringPiece& new_base);
@@ -1674,6 +1700,8 @@ class RewriteDriver : public HtmlParse {
   QueuedWorkerPool::Sequence* html_worker_;
   QueuedWorkerPool::Sequence* rewrite_worker_;
   QueuedWorkerPool::Sequence* low_priority_rewrite_worker_;
+  // See SetRewriteDeadlineUs.
+  int64 rewrite_deadline_us_ GUARDED_BY(rewrite_mutex());
   scoped_ptr<Scheduler::Sequence> scheduler_sequence_;
 
   Writer* writer_;
@@ -380,6 +380,20 @@ class RewriteDriverFactory {
   // QueuedWorkerPool::set_load_shedding_threshold
   virtual int LowPriorityLoadSheddingThreshold() const;
 
+  // Subclasses can override this to have the rewrite pools dispatch through
+  // per-worker run queues (see QueuedWorkerPool::set_work_stealing) instead
+  // of one shared queue. The default implementation returns false.
+  // This is experimental: it gives up queue ordering, and is only worth
+  // it when many rewrite threads contend for the pools on many cores.
+  virtual bool RewriteWorkersStealWork();
+
+  // Subclasses can override this to have the rewrite pools run the work
+  // with the nearest rewrite deadline first (see
+  // QueuedWorkerPool::EnableDeadlineScheduling) rather than in the order it
+  // was queued. The default implementation returns false. It is ignored
+  // when RewriteWorkersStealWork() returns true.
+  virtual bool RewriteWorkersScheduleByDeadline();
+
   // Subclasses can override this to create an appropriate Scheduler
   // subclass if the default isn't acceptable.
   virtual Scheduler* CreateScheduler();
@@ -297,6 +297,7 @@ class RewriteOptions {
   static const char kGoogleFontCssInlineMaxBytes[];
   static const char kForbidAllDisabledFilters[];
   static const char kHideRefererUsingMeta[];
+  static const char kHonorStaleWhileRevalidate[];
   static const char kHttpCacheCompressionLevel[];
   static const char kIdleFlushTimeMs[];
   static const char kImageInlineMaxBytes[];
@@ -2035,6 +2036,13 @@ class RewriteOptions {
     return serve_stale_while_revalidate_threshold_sec_.value();
   }
 
+  void set_honor_stale_while_revalidate(bool x) {
+    set_option(x, &honor_stale_while_revalidate_);
+  }
+  bool honor_stale_while_revalidate() const {
+    return honor_stale_while_revalidate_.value();
+  }
+
   void set_default_cache_html(bool x) { set_option(x, &default_cache_html_); }
   bool default_cache_html() const { return default_cache_html_.value(); }
 
@@ -3799,6 +3807,9 @@ class RewriteOptions {
   // Threshold for serving stale responses while revalidating in background.
   // 0 means don't serve stale content.
   Option<int64> serve_stale_while_revalidate_threshold_sec_;
+  // Whether a Cache-Control: stale-while-revalidate directive on a resource
+  // can extend the above threshold for it.
+  Option<bool> honor_stale_while_revalidate_;
 
   // When default_cache_html_ is false (default) we do not cache
   // input HTML which lacks Cache-Control headers. But, when set true,
@@ -98,6 +98,12 @@ class RewriteStats {
 
   Variable* num_conditional_refreshes() { return num_conditional_refreshes_; }
 
+  Variable* num_background_freshens() { return num_background_freshens_; }
+
+  Variable* num_background_freshens_skipped() {
+    return num_background_freshens_skipped_;
+  }
+
   Variable* ipro_served() { return ipro_served_; }
   Variable* ipro_not_in_cache() { return ipro_not_in_cache_; }
   Variable* ipro_not_rewritable() { return ipro_not_rewritable_; }
@@ -129,6 +135,19 @@ class RewriteStats {
     return thread_queue_depths_[pool];
   }
 
+  // Returns histograms of the time in ms that work waited in the given pool's
+  // queue before running, for work that ran before its deadline, and for
+  // work that had none or missed it.  NULL for pools that don't schedule by
+  // deadline.
+  Histogram* on_time_queue_delay_histogram(
+      RewriteDriverFactory::WorkerPoolCategory pool) {
+    return on_time_queue_delay_histograms_[pool];
+  }
+  Histogram* background_queue_delay_histogram(
+      RewriteDriverFactory::WorkerPoolCategory pool) {
+    return background_queue_delay_histograms_[pool];
+  }
+
   TimedVariable* num_rewrites_executed() { return num_rewrites_executed_; }
   TimedVariable* num_rewrites_dropped() { return num_rewrites_dropped_; }
 
@@ -152,6 +171,8 @@ class RewriteStats {
   Variable* num_proactively_freshen_user_facing_request_;
   Variable* fallback_responses_served_while_revalidate_;
   Variable* num_conditional_refreshes_;
+  Variable* num_background_freshens_;
+  Variable* num_background_freshens_skipped_;
   Variable* ipro_served_;
   Variable* ipro_not_in_cache_;
   Variable* ipro_not_rewritable_;
@@ -169,6 +190,8 @@ class RewriteStats {
   TimedVariable* num_rewrites_dropped_;
 
   std::vector<Waveform*> thread_queue_depths_;
+  std::vector<Histogram*> on_time_queue_delay_histograms_;
+  std::vector<Histogram*> background_queue_delay_histograms_;
 
   DISALLOW_COPY_AND_ASSIGN(RewriteStats);
 };
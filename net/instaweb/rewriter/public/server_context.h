@@ -81,6 +81,7 @@ class Scheduler;
 class StaticAssetManager;
 class Statistics;
 class ThreadSynchronizer;
+class TieredMetadataCache;
 class Timer;
 class UrlNamer;
 class UsageDataReporter;
@@ -258,6 +259,16 @@ class ServerContext {
   CacheInterface* metadata_cache() const { return metadata_cache_; }
   void set_metadata_cache(CacheInterface* x) { metadata_cache_ = x; }
 
+  // The TieredMetadataCache under metadata_cache(), if one is configured,
+  // through which the RewriteDriver prefetches the metadata of the rewrites
+  // it initiates.  May be NULL.  This class does not take ownership.
+  TieredMetadataCache* tiered_metadata_cache() const {
+    return tiered_metadata_cache_;
+  }
+  void set_tiered_metadata_cache(TieredMetadataCache* x) {
+    tiered_metadata_cache_ = x;
+  }
+
   CriticalImagesFinder* critical_images_finder() const {
     return critical_images_finder_.get();
   }
@@ -709,6 +720,7 @@ class ServerContext {
   scoped_ptr<PropertyCache> page_property_cache_;
   CacheInterface* filesystem_metadata_cache_;
   CacheInterface* metadata_cache_;
+  TieredMetadataCache* tiered_metadata_cache_;
 
   bool store_outputs_in_file_system_;
   bool response_headers_finalized_;
@@ -185,6 +185,9 @@ class TestRewriteDriverFactory : public RewriteDriverFactory {
     return ip == "127.0.0.1";
   }
 
+  // Servers leave this off by default, but the rewrite tests cover it.
+  virtual bool RewriteWorkersScheduleByDeadline() { return true; }
+
   // Enable or disable adding the contents of rewriter_callback_vector_ within
   // AddPlatformSpecificRewritePasses. You'll also want to call
   // RebuildDecodingDriverForTests.
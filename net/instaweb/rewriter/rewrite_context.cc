@@ -718,13 +718,16 @@ class RewriteContext::FetchContext {
       if (test_force_alarm) {
         deadline_ms = 0;
       }
+      // The driver's rewrite work is scheduled by the fetch deadline.
+      int64 deadline_us = timer->NowUs() + (deadline_ms * Timer::kMsUs);
+      driver->SetRewriteDeadlineUs(deadline_us);
+
       // Startup an alarm which will cause us to return unrewritten content
       // rather than hold up the fetch too long on firing.
       deadline_alarm_ =
           new QueuedAlarm(
               driver->scheduler(), driver->rewrite_worker(),
-              timer->NowUs() + (deadline_ms * Timer::kMsUs),
-              MakeFunction(this, &FetchContext::HandleDeadline));
+              deadline_us, MakeFunction(this, &FetchContext::HandleDeadline));
     }
   }
 
@@ -740,6 +743,8 @@ class RewriteContext::FetchContext {
   void HandleDeadline() {
     deadline_alarm_ = NULL;  // avoid dangling reference.
     rewrite_context_->DetachFetch();
+    // The rest of the rewrite runs in the background.
+    rewrite_context_->Driver()->ClearRewriteDeadline();
     // It's very tempting to log the output URL here, but it's not safe to do
     // so, as OutputResource::UrlEvenIfHashNotSet can write to the hash,
     // which may race against normal setting of the hash in
@@ -1102,6 +1107,20 @@ void RewriteContext::Initiate() {
       &RewriteContext::Start, this));
 }
 
+void RewriteContext::AppendMetadataCacheKey(StringVector* keys) {
+  if (chained_ || force_rewrite_) {
+    return;
+  }
+  for (int c = 0; c < num_slots(); ++c) {
+    if (slot(c)->disable_further_processing()) {
+      return;
+    }
+  }
+  // Start sets the key again itself, as not every context is asked first.
+  SetPartitionKey();
+  keys->push_back(partition_key_);
+}
+
 // Initiate a Rewrite if it's ready to be started.  A Rewrite would not
 // be startable if was operating on a slot that was already associated
 // with another Rewrite.  We would wait for all the preceding rewrites
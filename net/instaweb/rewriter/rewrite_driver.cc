@@ -130,6 +130,7 @@
 #include "pagespeed/kernel/base/request_trace.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/sha1_signature.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/statistics.h"
 #include "pagespeed/kernel/base/stl_util.h"
 #include "pagespeed/kernel/base/string.h"
@@ -137,6 +138,7 @@
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/base/writer.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/kernel/cache/tiered_metadata_cache.h"
 #include "pagespeed/kernel/html/amp_document_filter.h"
 #include "pagespeed/kernel/html/collapse_whitespace_filter.h"
 #include "pagespeed/kernel/html/elide_attributes_filter.h"
@@ -152,6 +154,7 @@
 #include "pagespeed/kernel/http/google_url.h"
 #include "pagespeed/kernel/http/http_names.h"
 #include "pagespeed/kernel/http/request_headers.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
 #include "pagespeed/kernel/thread/scheduler.h"
 #include "pagespeed/kernel/thread/scheduler_sequence.h"
 #include "pagespeed/kernel/util/statistics_logger.h"
@@ -268,6 +271,7 @@ RewriteDriver::RewriteDriver(MessageHandler* message_handler,
       html_worker_(NULL),
       rewrite_worker_(NULL),
       low_priority_rewrite_worker_(NULL),
+      rewrite_deadline_us_(QueuedWorkerPool::kNoDeadline),
       writer_(NULL),
       fallback_property_page_(NULL),
       owns_property_page_(false),
@@ -353,9 +357,11 @@ AbstractLogRecord* RewriteDriver::log_record() {
 }
 
 RewriteDriver::~RewriteDriver() {
+  // The rewrite sequences are cleared so that Clear doesn't touch them.
   if (rewrite_worker_ != NULL) {
     scheduler_->UnregisterWorker(rewrite_worker_);
     server_context_->rewrite_workers()->FreeSequence(rewrite_worker_);
+    rewrite_worker_ = NULL;
   }
   if (html_worker_ != NULL) {
     scheduler_->UnregisterWorker(html_worker_);
@@ -365,6 +371,7 @@ RewriteDriver::~RewriteDriver() {
     scheduler_->UnregisterWorker(low_priority_rewrite_worker_);
     server_context_->low_priority_rewrite_workers()->FreeSequence(
         low_priority_rewrite_worker_);
+    low_priority_rewrite_worker_ = NULL;
   }
   Clear();
   STLDeleteElements(&filters_to_delete_);
@@ -411,6 +418,9 @@ void RewriteDriver::Clear() NO_THREAD_SAFETY_ANALYSIS {
 
   HtmlParse::Clear();
 
+  // The sequences outlive this request, when the driver is recycled.
+  ClearRewriteDeadline();
+
   // If this was a fetch, fetch_rewrites_ may still hold a reference to a
   // RewriteContext.
   STLDeleteElements(&fetch_rewrites_);
@@ -672,6 +682,18 @@ void RewriteDriver::FlushAsync(Function* callback) {
 
   int num_rewrites = rewrites_.size();
 
+  // Look up the metadata of all the rewrites about to be initiated at once,
+  // rather than one at a time as each starts.
+  TieredMetadataCache* tiered_metadata_cache =
+      server_context_->tiered_metadata_cache();
+  if ((tiered_metadata_cache != NULL) && (num_rewrites > 1)) {
+    StringVector keys;
+    for (int i = 0; i < num_rewrites; ++i) {
+      rewrites_[i]->AppendMetadataCacheKey(&keys);
+    }
+    tiered_metadata_cache->Prefetch(keys);
+  }
+
   // Copy all of the RewriteContext* into the initiated_rewrites_ set
   // *before* initiating them, as we are doing this before we lock.
   // The RewriteThread can start mutating the initiated_rewrites_
@@ -693,6 +715,14 @@ void RewriteDriver::FlushAsync(Function* callback) {
     initiated_rewrites_.insert(rewrites_.begin(), rewrites_.end());
     num_initiated_rewrites_ += num_rewrites;
 
+    // Rewrites for this flush window are needed by the time we stop waiting
+    // for them to render, so schedule their work by that deadline.
+    if (!fully_rewrite_on_flush_) {
+      SetRewriteDeadlineUsMutexHeld(
+          server_context_->timer()->NowUs() +
+          ComputeCurrentFlushWindowRewriteDelayMs() * Timer::kMsUs);
+    }
+
     // We must also start tasks while holding the lock, as otherwise a
     // successor task may complete and delete itself before we see if we
     // are the ones to start it.
@@ -742,6 +772,45 @@ int64 RewriteDriver::ComputeCurrentFlushWindowRewriteDelayMs() {
   return deadline;
 }
 
+void RewriteDriver::SetRewriteDeadlineUs(int64 deadline_us) {
+  ScopedMutex lock(rewrite_mutex());
+  SetRewriteDeadlineUsMutexHeld(deadline_us);
+}
+
+void RewriteDriver::SetRewriteDeadlineUsMutexHeld(int64 deadline_us) {
+  if ((deadline_us == QueuedWorkerPool::kNoDeadline) ||
+      ((rewrite_deadline_us_ != QueuedWorkerPool::kNoDeadline) &&
+       (rewrite_deadline_us_ <= deadline_us))) {
+    return;
+  }
+  rewrite_deadline_us_ = deadline_us;
+  if (rewrite_worker_ != NULL) {
+    rewrite_worker_->set_deadline_us(deadline_us);
+  }
+  if (low_priority_rewrite_worker_ != NULL) {
+    low_priority_rewrite_worker_->set_deadline_us(deadline_us);
+  }
+}
+
+void RewriteDriver::ClearRewriteDeadline() {
+  ScopedMutex lock(rewrite_mutex());
+  ClearRewriteDeadlineMutexHeld();
+}
+
+void RewriteDriver::ClearRewriteDeadlineMutexHeld() {
+  if (rewrite_deadline_us_ == QueuedWorkerPool::kNoDeadline) {
+    return;
+  }
+  rewrite_deadline_us_ = QueuedWorkerPool::kNoDeadline;
+  if (rewrite_worker_ != NULL) {
+    rewrite_worker_->set_deadline_us(QueuedWorkerPool::kNoDeadline);
+  }
+  if (low_priority_rewrite_worker_ != NULL) {
+    low_priority_rewrite_worker_->set_deadline_us(
+        QueuedWorkerPool::kNoDeadline);
+  }
+}
+
 void RewriteDriver::QueueFlushAsyncDone(int num_rewrites, Function* callback) {
   html_worker_->Add(MakeFunction(this, &RewriteDriver::FlushAsyncDone,
                                  num_rewrites, callback));
@@ -809,6 +878,9 @@ void RewriteDriver::FlushAsyncDone(int num_rewrites, Function* callback) {
     DCHECK_EQ(0, ref_counts_.QueryCountMutexHeld(kRefPendingRewrites));
     initiated_rewrites_.clear();
 
+    // Whatever is still queued for the detached rewrites is background work.
+    ClearRewriteDeadlineMutexHeld();
+
     slots_.clear();
     inline_slots_.clear();
     inline_attribute_slots_.clear();
@@ -1763,15 +1835,16 @@ class CacheCallback : public OptionsAwareHTTPCacheCallback {
       stats->cached_resource_fetches()->Add(1);
 
       HTTPValue* value = http_value();
-      bool success = (value->ExtractContents(&content) &&
+      SharedString shared_content;
+      bool success = (value->ExtractContents(&shared_content) &&
                       value->ExtractHeaders(response_headers, handler_));
       if (success) {
         output_resource_->Link(value, handler_);
         output_resource_->SetWritten(true);
-        async_fetch_->set_content_length(content.size());
+        async_fetch_->set_content_length(shared_content.size());
         async_fetch_->FixCacheControlForGoogleCache();
         async_fetch_->HeadersComplete();
-        success = async_fetch_->Write(content, handler_);
+        success = async_fetch_->WriteShared(shared_content, handler_);
       }
       async_fetch_->Done(success);
       driver_->FetchComplete();
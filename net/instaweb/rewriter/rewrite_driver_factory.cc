@@ -26,6 +26,7 @@
 #include "net/instaweb/http/public/request_context.h"
 #include "net/instaweb/http/public/url_async_fetcher.h"
 #include "net/instaweb/rewriter/public/beacon_critical_images_finder.h"
+#include "net/instaweb/rewriter/public/cache_warmer.h"
 #include "net/instaweb/rewriter/public/critical_images_finder.h"
 #include "net/instaweb/rewriter/public/critical_selector_finder.h"
 #include "net/instaweb/rewriter/public/experiment_matcher.h"
@@ -384,6 +385,14 @@ int RewriteDriverFactory::LowPriorityLoadSheddingThreshold() const {
   return QueuedWorkerPool::kNoLoadShedding;
 }
 
+bool RewriteDriverFactory::RewriteWorkersStealWork() {
+  return false;
+}
+
+bool RewriteDriverFactory::RewriteWorkersScheduleByDeadline() {
+  return false;
+}
+
 Scheduler* RewriteDriverFactory::CreateScheduler() {
   return new Scheduler(thread_system(), timer());
 }
@@ -421,6 +430,17 @@ QueuedWorkerPool* RewriteDriverFactory::WorkerPool(WorkerPoolCategory pool) {
       worker_pools_[pool]->SetLoadSheddingThreshold(
           LowPriorityLoadSheddingThreshold());
     }
+    if (pool != kHtmlWorkers && RewriteWorkersStealWork()) {
+      // Work stealing and deadline scheduling are exclusive.
+      worker_pools_[pool]->set_work_stealing(true);
+    } else if (pool != kHtmlWorkers && RewriteWorkersScheduleByDeadline()) {
+      // Rewrites carry the deadline they must render by, so run the most
+      // urgent first, and whatever has missed it in the background.
+      worker_pools_[pool]->EnableDeadlineScheduling(timer());
+      worker_pools_[pool]->set_queue_delay_histograms(
+          rewrite_stats()->on_time_queue_delay_histogram(pool),
+          rewrite_stats()->background_queue_delay_histogram(pool));
+    }
   }
 
   return worker_pools_[pool];
@@ -717,6 +737,7 @@ void RewriteDriverFactory::InitStats(Statistics* statistics) {
   RewriteDriver::InitStats(statistics);
   RewriteStats::InitStats(statistics);
   CacheBatcher::InitStats(statistics);
+  CacheWarmer::InitStats(statistics);
   InProcessCentralController::InitStats(statistics);
   CriticalImagesFinder::InitStats(statistics);
   CriticalSelectorFinder::InitStats(statistics);
@@ -25,12 +25,15 @@
 #include "net/instaweb/http/public/mock_url_fetcher.h"
 #include "net/instaweb/http/public/wait_url_async_fetcher.h"
 #include "net/instaweb/rewriter/public/domain_lawyer.h"
+#include "net/instaweb/rewriter/public/fake_filter.h"
 #include "net/instaweb/rewriter/public/file_load_policy.h"
 #include "net/instaweb/rewriter/public/mock_resource_callback.h"
 #include "net/instaweb/rewriter/public/output_resource_kind.h"
 #include "net/instaweb/rewriter/public/request_properties.h"
 #include "net/instaweb/rewriter/public/resource.h"
 #include "net/instaweb/rewriter/public/resource_slot.h"
+#include "net/instaweb/rewriter/public/rewrite_context.h"
+#include "net/instaweb/rewriter/public/rewrite_driver_factory.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
 #include "net/instaweb/rewriter/public/rewrite_stats.h"
 #include "net/instaweb/rewriter/public/rewrite_test_base.h"
@@ -61,6 +64,7 @@
 #include "pagespeed/kernel/http/request_headers.h"
 #include "pagespeed/kernel/http/semantic_type.h"
 #include "pagespeed/kernel/http/user_agent_matcher_test_base.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
 #include "pagespeed/kernel/thread/worker_test_base.h"
 
 namespace net_instaweb {
@@ -825,6 +829,230 @@ TEST_F(RewriteDriverTest, TestComputeCurrentFlushWindowRewriteDelayMs) {
   rewrite_driver()->FinishParse();
 }
 
+// A FakeFilter that records the driver's rewrite deadline as its rewrite
+// starts.
+class DeadlineRecordingFilter : public FakeFilter {
+ public:
+  static const char kFilterId[];
+
+  class Context : public FakeFilter::Context {
+   public:
+    Context(DeadlineRecordingFilter* filter, RewriteDriver* driver,
+            RewriteContext* parent, ResourceContext* resource_context)
+        : FakeFilter::Context(filter, driver, parent, resource_context),
+          filter_(filter) { }
+
+    virtual void RewriteSingle(const ResourcePtr& input,
+                               const OutputResourcePtr& output) {
+      filter_->set_deadline_us(Driver()->rewrite_deadline_us());
+      FakeFilter::Context::RewriteSingle(input, output);
+    }
+
+   private:
+    DeadlineRecordingFilter* filter_;
+    DISALLOW_COPY_AND_ASSIGN(Context);
+  };
+
+  explicit DeadlineRecordingFilter(RewriteDriver* rewrite_driver)
+      : FakeFilter(kFilterId, rewrite_driver, semantic_type::kStylesheet),
+        deadline_us_(QueuedWorkerPool::kNoDeadline) { }
+
+  virtual RewriteContext* MakeFakeContext(
+      RewriteDriver* driver, RewriteContext* parent,
+      ResourceContext* resource_context) {
+    return new Context(this, driver, parent, resource_context);
+  }
+
+  void set_deadline_us(int64 x) { deadline_us_ = x; }
+  int64 deadline_us() const { return deadline_us_; }
+
+ private:
+  int64 deadline_us_;
+  DISALLOW_COPY_AND_ASSIGN(DeadlineRecordingFilter);
+};
+
+const char DeadlineRecordingFilter::kFilterId[] = "dl";
+
+// Records the driver's rewrite deadline as the fetch completes.
+class DeadlineRecordingFetch : public StringAsyncFetch {
+ public:
+  DeadlineRecordingFetch(const RequestContextPtr& request_context,
+                         RewriteDriver* driver)
+      : StringAsyncFetch(request_context),
+        driver_(driver),
+        deadline_us_(QueuedWorkerPool::kNoDeadline) { }
+
+  virtual void HandleDone(bool success) {
+    deadline_us_ = driver_->rewrite_deadline_us();
+    StringAsyncFetch::HandleDone(success);
+  }
+
+  int64 deadline_us() const { return deadline_us_; }
+
+ private:
+  RewriteDriver* driver_;
+  int64 deadline_us_;
+  DISALLOW_COPY_AND_ASSIGN(DeadlineRecordingFetch);
+};
+
+TEST_F(RewriteDriverTest, RewriteDeadlineKeepsEarliest) {
+  int64 now_us = timer()->NowUs();
+  EXPECT_EQ(QueuedWorkerPool::kNoDeadline,
+            rewrite_driver()->rewrite_deadline_us());
+
+  rewrite_driver()->SetRewriteDeadlineUs(now_us + 200);
+  EXPECT_EQ(now_us + 200, rewrite_driver()->rewrite_deadline_us());
+
+  // Work queued for the earlier deadline may still be waiting, so neither a
+  // later deadline nor kNoDeadline replaces it.
+  rewrite_driver()->SetRewriteDeadlineUs(now_us + 300);
+  EXPECT_EQ(now_us + 200, rewrite_driver()->rewrite_deadline_us());
+  rewrite_driver()->SetRewriteDeadlineUs(QueuedWorkerPool::kNoDeadline);
+  EXPECT_EQ(now_us + 200, rewrite_driver()->rewrite_deadline_us());
+
+  // An earlier one does.
+  rewrite_driver()->SetRewriteDeadlineUs(now_us + 100);
+  EXPECT_EQ(now_us + 100, rewrite_driver()->rewrite_deadline_us());
+
+  // Once cleared, any deadline is taken.
+  rewrite_driver()->ClearRewriteDeadline();
+  EXPECT_EQ(QueuedWorkerPool::kNoDeadline,
+            rewrite_driver()->rewrite_deadline_us());
+  rewrite_driver()->SetRewriteDeadlineUs(now_us + 300);
+  EXPECT_EQ(now_us + 300, rewrite_driver()->rewrite_deadline_us());
+
+  // Clear resets it for the driver's next request.
+  rewrite_driver()->Clear();
+  EXPECT_EQ(QueuedWorkerPool::kNoDeadline,
+            rewrite_driver()->rewrite_deadline_us());
+}
+
+TEST_F(RewriteDriverTest, FlushWindowSetsAndClearsRewriteDeadline) {
+  const char kCss[] = "* { display: none; }";
+  SetResponseWithDefaultHeaders("a.css", kContentTypeCss, kCss, 100);
+  options()->set_rewrite_deadline_ms(20);
+  DeadlineRecordingFilter* filter =
+      new DeadlineRecordingFilter(rewrite_driver());
+  rewrite_driver()->AppendRewriteFilter(filter);
+  rewrite_driver()->AddFilters();
+
+  // The rewrite runs by the end of its flush window, and the deadline is
+  // cleared once the window is done.
+  int64 start_us = timer()->NowUs();
+  Parse("flush_deadline", CssLinkHref("a.css"));
+  EXPECT_EQ(1, filter->num_rewrites());
+  EXPECT_EQ(start_us + 20 * Timer::kMsUs, filter->deadline_us());
+  EXPECT_EQ(QueuedWorkerPool::kNoDeadline,
+            rewrite_driver()->rewrite_deadline_us());
+}
+
+TEST_F(RewriteDriverTest, FetchSetsAndClearsRewriteDeadline) {
+  const char kCss[] = "* { display: none; }";
+  SetResponseWithDefaultHeaders("a.css", kContentTypeCss, kCss, 100);
+  options()->set_rewrite_deadline_ms(20);
+  DeadlineRecordingFilter* filter =
+      new DeadlineRecordingFilter(rewrite_driver());
+  rewrite_driver()->AppendRewriteFilter(filter);
+  rewrite_driver()->AddFilters();
+  SetDriverRequestHeaders();
+  GoogleString url = Encode(kTestDomain, DeadlineRecordingFilter::kFilterId,
+                            "0", "a.css", "css");
+
+  // A fetch that is rewritten in time leaves the deadline for Clear.
+  int64 start_us = timer()->NowUs();
+  DeadlineRecordingFetch fetch(CreateRequestContext(), rewrite_driver());
+  EXPECT_TRUE(rewrite_driver()->FetchResource(url, &fetch));
+  rewrite_driver()->WaitForShutDown();
+  EXPECT_TRUE(fetch.done());
+  EXPECT_EQ(1, filter->num_rewrites());
+  EXPECT_EQ(start_us + 20 * Timer::kMsUs, filter->deadline_us());
+  EXPECT_EQ(start_us + 20 * Timer::kMsUs, fetch.deadline_us());
+  rewrite_driver()->Clear();
+  EXPECT_EQ(QueuedWorkerPool::kNoDeadline,
+            rewrite_driver()->rewrite_deadline_us());
+}
+
+TEST_F(RewriteDriverTest, FetchDeadlineAlarmClearsRewriteDeadline) {
+  const char kCss[] = "* { display: none; }";
+  SetResponseWithDefaultHeaders("a.css", kContentTypeCss, kCss, 100);
+  options()->set_rewrite_deadline_ms(20);
+  DeadlineRecordingFilter* filter =
+      new DeadlineRecordingFilter(rewrite_driver());
+  filter->set_exceed_deadline(true);
+  rewrite_driver()->AppendRewriteFilter(filter);
+  rewrite_driver()->AddFilters();
+  SetDriverRequestHeaders();
+  GoogleString url = Encode(kTestDomain, DeadlineRecordingFilter::kFilterId,
+                            "0", "a.css", "css");
+
+  // The deadline alarm serves the original, and the rewrite finishes in the
+  // background.
+  int64 start_us = timer()->NowUs();
+  DeadlineRecordingFetch fetch(CreateRequestContext(), rewrite_driver());
+  EXPECT_TRUE(rewrite_driver()->FetchResource(url, &fetch));
+  rewrite_driver()->WaitForShutDown();
+  EXPECT_TRUE(fetch.done());
+  EXPECT_EQ(kCss, fetch.buffer());
+  EXPECT_EQ(1, statistics()->GetVariable(
+      RewriteContext::kNumDeadlineAlarmInvocations)->Get());
+  EXPECT_EQ(start_us + 20 * Timer::kMsUs, filter->deadline_us());
+  EXPECT_EQ(QueuedWorkerPool::kNoDeadline, fetch.deadline_us());
+  EXPECT_EQ(QueuedWorkerPool::kNoDeadline,
+            rewrite_driver()->rewrite_deadline_us());
+  rewrite_driver()->Clear();
+}
+
+TEST_F(RewriteDriverTest, QueueDelayHistogramsSplitByDeadline) {
+  RewriteStats* stats = server_context()->rewrite_stats();
+  Histogram* on_time = stats->on_time_queue_delay_histogram(
+      RewriteDriverFactory::kLowPriorityRewriteWorkers);
+  Histogram* background = stats->background_queue_delay_histogram(
+      RewriteDriverFactory::kLowPriorityRewriteWorkers);
+  ASSERT_TRUE(on_time != NULL);
+  ASSERT_TRUE(background != NULL);
+  on_time->Clear();
+  background->Clear();
+
+  // Each driver has its own sequence, so each task waits for a worker.
+  RewriteDriver* no_deadline =
+      server_context()->NewRewriteDriver(CreateRequestContext());
+  RewriteDriver* future_deadline =
+      server_context()->NewRewriteDriver(CreateRequestContext());
+  RewriteDriver* past_deadline =
+      server_context()->NewRewriteDriver(CreateRequestContext());
+  int64 now_us = timer()->NowUs();
+  future_deadline->SetRewriteDeadlineUs(now_us + Timer::kSecondUs);
+  past_deadline->SetRewriteDeadlineUs(now_us - Timer::kSecondUs);
+
+  WorkerTestBase::SyncPoint no_deadline_sync(
+      server_context()->thread_system());
+  no_deadline->AddLowPriorityRewriteTask(
+      new WorkerTestBase::NotifyRunFunction(&no_deadline_sync));
+  no_deadline_sync.Wait();
+  EXPECT_EQ(0, on_time->Count());
+  EXPECT_EQ(1, background->Count());
+
+  WorkerTestBase::SyncPoint future_deadline_sync(
+      server_context()->thread_system());
+  future_deadline->AddLowPriorityRewriteTask(
+      new WorkerTestBase::NotifyRunFunction(&future_deadline_sync));
+  future_deadline_sync.Wait();
+  EXPECT_EQ(1, on_time->Count());
+  EXPECT_EQ(1, background->Count());
+
+  WorkerTestBase::SyncPoint past_deadline_sync(
+      server_context()->thread_system());
+  past_deadline->AddLowPriorityRewriteTask(
+      new WorkerTestBase::NotifyRunFunction(&past_deadline_sync));
+  past_deadline_sync.Wait();
+  EXPECT_EQ(1, on_time->Count());
+  EXPECT_EQ(2, background->Count());
+
+  no_deadline->Cleanup();
+  future_deadline->Cleanup();
+  past_deadline->Cleanup();
+}
+
 // Extension of above with cache invalidation.
 TEST_F(RewriteDriverTest, TestCacheUseOnTheFlyWithInvalidation) {
   AddFilter(RewriteOptions::kExtendCacheCss);
@@ -131,6 +131,8 @@ const char RewriteOptions::kForbidAllDisabledFilters[] =
 const char RewriteOptions::kGoogleFontCssInlineMaxBytes[] =
     "GoogleFontCssInlineMaxBytes";
 const char RewriteOptions::kHideRefererUsingMeta[] = "HideRefererUsingMeta";
+const char RewriteOptions::kHonorStaleWhileRevalidate[] =
+    "HonorStaleWhileRevalidate";
 const char RewriteOptions::kHttpCacheCompressionLevel[] =
     "HttpCacheCompressionLevel";
 const char RewriteOptions::kIdleFlushTimeMs[] = "IdleFlushTimeMs";
@@ -1547,6 +1549,13 @@ void RewriteOptions::AddProperties() {
       "Threshold for serving serving stale responses while revalidating in "
       "background. 0 means don't serve stale content."
       "Note: Stale response will be served only for non-html requests.", true);
+  AddBaseProperty(
+      false, &RewriteOptions::honor_stale_while_revalidate_, "hswr",
+      kHonorStaleWhileRevalidate,
+      kDirectoryScope,
+      "Whether a resource's Cache-Control: stale-while-revalidate directive "
+      "can extend ServeStaleWhileRevalidateThresholdSec for that resource.",
+      true);
   AddBaseProperty(
       true, &RewriteOptions::follow_flushes_, "ff", kFollowFlushes,
       kDirectoryScope,
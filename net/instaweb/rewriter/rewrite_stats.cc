@@ -45,6 +45,8 @@ const char kProactivelyFreshenUserFacingRequest[] =
 const char kFallbackResponsesServedWhileRevalidate[] =
     "num_fallback_responses_served_while_revalidate";
 const char kNumConditionalRefreshes[] = "num_conditional_refreshes";
+const char kNumBackgroundFreshens[] = "num_background_freshens";
+const char kNumBackgroundFreshensSkipped[] = "num_background_freshens_skipped";
 
 const char kIproServed[] = "ipro_served";
 const char kIproNotInCache[] = "ipro_not_in_cache";
@@ -74,6 +76,22 @@ const char kRewriteLatencyHistogram[] = "Rewrite Latency Histogram";
 const char kBackendLatencyHistogram[] =
     "Backend Fetch First Byte Latency Histogram";
 
+// How long work waited in the queue of each worker pool that schedules by
+// deadline, in ms, split by whether it ran before its deadline.  The html
+// pool doesn't, so has none.
+const char* kOnTimeQueueDelayHistograms[
+    RewriteDriverFactory::kNumWorkerPools] = {
+  NULL,
+  "Rewrite Worker On-Time Queue Delay (ms)",
+  "Low-Priority Rewrite Worker On-Time Queue Delay (ms)"
+};
+const char* kBackgroundQueueDelayHistograms[
+    RewriteDriverFactory::kNumWorkerPools] = {
+  NULL,
+  "Rewrite Worker Background Queue Delay (ms)",
+  "Low-Priority Rewrite Worker Background Queue Delay (ms)"
+};
+
 // TimedVariable names.
 const char kTotalFetchCount[] = "total_fetch_count";
 const char kTotalRewriteCount[] = "total_rewrite_count";
@@ -128,10 +146,18 @@ void RewriteStats::InitStats(Statistics* statistics) {
   statistics->AddHistogram(kFetchLatencyHistogram);
   statistics->AddHistogram(kRewriteLatencyHistogram);
   statistics->AddHistogram(kBackendLatencyHistogram);
+  for (int i = 0; i < RewriteDriverFactory::kNumWorkerPools; ++i) {
+    if (kOnTimeQueueDelayHistograms[i] != NULL) {
+      statistics->AddHistogram(kOnTimeQueueDelayHistograms[i]);
+      statistics->AddHistogram(kBackgroundQueueDelayHistograms[i]);
+    }
+  }
   statistics->AddVariable(kFallbackResponsesServed);
   statistics->AddVariable(kProactivelyFreshenUserFacingRequest);
   statistics->AddVariable(kFallbackResponsesServedWhileRevalidate);
   statistics->AddVariable(kNumConditionalRefreshes);
+  statistics->AddVariable(kNumBackgroundFreshens);
+  statistics->AddVariable(kNumBackgroundFreshensSkipped);
   statistics->AddVariable(kIproServed);
   statistics->AddVariable(kIproNotInCache);
   statistics->AddVariable(kIproNotRewritable);
@@ -200,6 +226,9 @@ RewriteStats::RewriteStats(bool has_waveforms,
           stats->GetVariable(kFallbackResponsesServedWhileRevalidate)),
       num_conditional_refreshes_(
           stats->GetVariable(kNumConditionalRefreshes)),
+      num_background_freshens_(stats->GetVariable(kNumBackgroundFreshens)),
+      num_background_freshens_skipped_(
+          stats->GetVariable(kNumBackgroundFreshensSkipped)),
       ipro_served_(stats->GetVariable(kIproServed)),
       ipro_not_in_cache_(stats->GetVariable(kIproNotInCache)),
       ipro_not_rewritable_(stats->GetVariable(kIproNotRewritable)),
@@ -237,6 +266,14 @@ RewriteStats::RewriteStats(bool has_waveforms,
     } else {
       thread_queue_depths_.push_back(NULL);
     }
+    Histogram* on_time = NULL;
+    Histogram* background = NULL;
+    if (kOnTimeQueueDelayHistograms[i] != NULL) {
+      on_time = stats->GetHistogram(kOnTimeQueueDelayHistograms[i]);
+      background = stats->GetHistogram(kBackgroundQueueDelayHistograms[i]);
+    }
+    on_time_queue_delay_histograms_.push_back(on_time);
+    background_queue_delay_histograms_.push_back(background);
   }
 }
 
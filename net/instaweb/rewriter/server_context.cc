@@ -253,6 +253,7 @@ ServerContext::ServerContext(RewriteDriverFactory* factory)
       timer_(NULL),
       filesystem_metadata_cache_(NULL),
       metadata_cache_(NULL),
+      tiered_metadata_cache_(NULL),
       store_outputs_in_file_system_(false),
       response_headers_finalized_(true),
       enable_property_cache_(true),
@@ -1399,6 +1400,11 @@ CacheUrlAsyncFetcher* ServerContext::CreateCustomCacheFetcher(
       stats->num_proactively_freshen_user_facing_request());
   cache_fetcher->set_serve_stale_while_revalidate_threshold_sec(
       options->serve_stale_while_revalidate_threshold_sec());
+  cache_fetcher->set_honor_stale_while_revalidate(
+      options->honor_stale_while_revalidate());
+  cache_fetcher->set_num_background_freshens(stats->num_background_freshens());
+  cache_fetcher->set_num_background_freshens_skipped(
+      stats->num_background_freshens_skipped());
   return cache_fetcher;
 }
 
@@ -83,6 +83,7 @@
         'config/rewrite_options_manager_test.cc',
         'http/async_fetch_test.cc',
         'http/cache_url_async_fetcher_test.cc',
+        'http/coalescing_url_async_fetcher_test.cc',
         'http/fetcher_test.cc',
         'http/headers_cookie_util_test.cc',
         'http/http_cache_test.cc',
@@ -109,6 +110,7 @@
         'rewriter/base_tag_filter_test.cc',
         'rewriter/beacon_critical_images_finder_test.cc',
         'rewriter/cache_extender_test.cc',
+        'rewriter/cache_warmer_test.cc',
         'rewriter/cacheable_resource_base_test.cc',
         'rewriter/collect_dependencies_filter_test.cc',
         'rewriter/common_filter_test.cc',
@@ -223,12 +225,16 @@
         'spriter/image_spriter_test.cc',
         'spriter/libpng_image_library_test.cc',
         '<(DEPTH)/pagespeed/system/apr_mem_cache_test.cc',
+        '<(DEPTH)/pagespeed/system/async_mem_cache_test.cc',
+        '<(DEPTH)/pagespeed/system/async_redis_cache_test.cc',
+        '<(DEPTH)/pagespeed/system/memcached_server_for_testing.cc',
         '<(DEPTH)/pagespeed/system/redis_cache_test.cc',
         '<(DEPTH)/pagespeed/system/redis_cache_cluster_test.cc',
         '<(DEPTH)/pagespeed/system/admin_site_test.cc',
         '<(DEPTH)/pagespeed/system/system_message_handler_test.cc',
         '<(DEPTH)/pagespeed/controller/central_controller_callback_test.cc',
         '<(DEPTH)/pagespeed/controller/context_registry_test.cc',
+        '<(DEPTH)/pagespeed/controller/cost_weighted_expensive_operation_controller_test.cc',
         '<(DEPTH)/pagespeed/controller/expensive_operation_rpc_context_test.cc',
         '<(DEPTH)/pagespeed/controller/expensive_operation_rpc_handler_test.cc',
         '<(DEPTH)/pagespeed/controller/grpc_server_test.cc',
@@ -238,6 +244,7 @@
         '<(DEPTH)/pagespeed/controller/rpc_handler_test.cc',
         '<(DEPTH)/pagespeed/controller/schedule_rewrite_rpc_context_test.cc',
         '<(DEPTH)/pagespeed/controller/schedule_rewrite_rpc_handler_test.cc',
+        '<(DEPTH)/pagespeed/controller/shared_mem_central_controller_test.cc',
         '<(DEPTH)/pagespeed/controller/queued_expensive_operation_controller_test.cc',
         '<(DEPTH)/pagespeed/controller/work_bound_expensive_operation_controller_test.cc',
         '<(DEPTH)/pagespeed/kernel/base/annotated_message_handler_test.cc',
@@ -281,20 +288,26 @@
         '<(DEPTH)/pagespeed/kernel/base/wildcard_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/async_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/cache_batcher_test.cc',
-        '<(DEPTH)/pagespeed/kernel/cache/cache_key_prepender.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/cache_dictionary_builder_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/cache_key_prepender_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/cache_stats_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/compressed_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/delay_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/fallback_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/file_cache_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/frequency_admission_policy_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/frequency_sketch_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/hot_key_replica_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/in_memory_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/key_value_codec_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/lru_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/mock_time_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/purge_context_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/purge_set_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/segment_file_cache_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/sharded_lru_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/threadsafe_cache_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/tiered_metadata_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/write_through_cache_test.cc',
         '<(DEPTH)/pagespeed/kernel/html/amp_document_filter_test.cc',
         '<(DEPTH)/pagespeed/kernel/html/canonical_attributes_test.cc',
@@ -351,6 +364,7 @@
         '<(DEPTH)/pagespeed/kernel/thread/scheduler_thread_test.cc',
         '<(DEPTH)/pagespeed/kernel/thread/slow_worker_test.cc',
         '<(DEPTH)/pagespeed/kernel/thread/thread_synchronizer_test.cc',
+        '<(DEPTH)/pagespeed/kernel/thread/timer_wheel_test.cc',
         '<(DEPTH)/pagespeed/kernel/util/brotli_inflater_test.cc',
         '<(DEPTH)/pagespeed/kernel/util/categorized_refcount_test.cc',
         '<(DEPTH)/pagespeed/kernel/util/copy_on_write_test.cc',
@@ -503,6 +517,8 @@
         'test_util',
         '<(DEPTH)/net/instaweb/instaweb.gyp:instaweb_console_css_data2c',
         '<(DEPTH)/net/instaweb/instaweb.gyp:instaweb_console_js_data2c',
+        '<(DEPTH)/net/instaweb/instaweb.gyp:instaweb_system',
+        '<(DEPTH)/pagespeed/controller.gyp:pagespeed_controller',
         '<(DEPTH)/pagespeed/kernel.gyp:pthread_system',
         '<(DEPTH)/pagespeed/kernel.gyp:pagespeed_base_core',
         '<(DEPTH)/pagespeed/kernel.gyp:pagespeed_http',
@@ -515,20 +531,31 @@
         '<(DEPTH)/third_party/css_parser/src',
       ],
       'sources': [
+        'http/cache_serving_speed_test.cc',
         'rewriter/css_minify_speed_test.cc',
         'rewriter/domain_lawyer_speed_test.cc',
         'rewriter/image_speed_test.cc',
         'rewriter/javascript_minify_speed_test.cc',
         'rewriter/rewrite_driver_speed_test.cc',
+        '<(DEPTH)/pagespeed/controller/central_controller_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/base/fast_wildcard_group_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/base/file_system_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/base/string_multi_map_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/base/wildcard_group.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/cache_admission_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/compressed_cache_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/cache/lru_cache_speed_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/purge_set_speed_test.cc',
+        '<(DEPTH)/pagespeed/kernel/cache/segment_file_cache_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/html/html_parse_speed_test.cc',
+        '<(DEPTH)/pagespeed/kernel/http/response_headers_speed_test.cc',
+        '<(DEPTH)/pagespeed/kernel/sharedmem/shared_mem_cache_snapshot_speed_test.cc',
+        '<(DEPTH)/pagespeed/kernel/sharedmem/slab_shared_mem_cache_speed_test.cc',
+        '<(DEPTH)/pagespeed/kernel/thread/queued_worker_pool_speed_test.cc',
+        '<(DEPTH)/pagespeed/kernel/thread/scheduler_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/util/deque_speed_test.cc',
         '<(DEPTH)/pagespeed/kernel/util/url_escaper_speed_test.cc',
+        '<(DEPTH)/pagespeed/system/redis_cache_speed_test.cc',
       ],
     },
     {
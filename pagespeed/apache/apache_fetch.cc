@@ -133,7 +133,8 @@ void ApacheFetch::SendOutHeaders() {
     apache_writer_->OutputHeaders(response_headers());
     if (!error_message.empty()) {
       if (buffered_) {
-        error_message.CopyToString(&output_bytes_);
+        output_.clear();
+        BufferBytes(error_message);
       } else {
         apache_writer_->Write(error_message, message_handler_);
       }
@@ -169,12 +170,35 @@ bool ApacheFetch::HandleWrite(const StringPiece& sp, MessageHandler* handler) {
   if (squelch_output_) {
     return true;  // Suppressing further output after writing error message.
   } else if (buffered_) {
-    sp.AppendToString(&output_bytes_);
+    BufferBytes(sp);
     return true;
   }
   return apache_writer_->Write(sp, handler);
 }
 
+bool ApacheFetch::HandleWriteShared(const SharedString& content,
+                                    MessageHandler* handler) {
+  if (squelch_output_) {
+    return true;
+  } else if (buffered_) {
+    output_.push_back(BufferedChunk());
+    output_.back().bytes = content;
+    output_.back().shared = true;
+    return true;
+  }
+  return apache_writer_->WriteShared(content, handler);
+}
+
+void ApacheFetch::BufferBytes(StringPiece sp) {
+  // Never append to a shared chunk, as that would write into storage that
+  // others, e.g. the cache, may be reading.
+  if (output_.empty() || output_.back().shared) {
+    output_.push_back(BufferedChunk());
+    output_.back().shared = false;
+  }
+  output_.back().bytes.Append(sp);
+}
+
 bool ApacheFetch::HandleFlush(MessageHandler* handler) {
   if (buffered_) {
     return true;  // Don't pass flushes through.
@@ -228,9 +252,15 @@ void ApacheFetch::Wait() {
   }
   if (buffered_) {
     SendOutHeaders();
-    if (!output_bytes_.empty()) {
-      apache_writer_->Write(output_bytes_, message_handler_);
+    for (int i = 0, n = output_.size(); i < n; ++i) {
+      const BufferedChunk& chunk = output_[i];
+      if (chunk.shared) {
+        apache_writer_->WriteShared(chunk.bytes, message_handler_);
+      } else {
+        apache_writer_->Write(chunk.bytes.Value(), message_handler_);
+      }
     }
+    output_.clear();
   }
 }
 
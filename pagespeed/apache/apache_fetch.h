@@ -18,6 +18,8 @@
 #ifndef PAGESPEED_APACHE_FETCH_H_
 #define PAGESPEED_APACHE_FETCH_H_
 
+#include <vector>
+
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/http/public/request_context.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
@@ -26,6 +28,7 @@
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/message_handler.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_annotations.h"
@@ -91,9 +94,22 @@ class ApacheFetch : public AsyncFetch {
       LOCKS_EXCLUDED(scheduler_->mutex());
   virtual bool HandleWrite(const StringPiece& sp, MessageHandler* handler)
       LOCKS_EXCLUDED(scheduler_->mutex());
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler)
+      LOCKS_EXCLUDED(scheduler_->mutex());
 
  private:
+  // Output buffered until Wait().  Bytes passed to HandleWrite are copied
+  // into chunks of our own, which later writes may append to, while slices
+  // passed to HandleWriteShared are kept as they are and handed to the
+  // ApacheWriter without being copied.
+  struct BufferedChunk {
+    SharedString bytes;
+    bool shared;
+  };
+
   void SendOutHeaders();
+  void BufferBytes(StringPiece sp);
 
   GoogleString mapped_url_;
   scoped_ptr<ApacheWriter> apache_writer_;
@@ -109,7 +125,7 @@ class ApacheFetch : public AsyncFetch {
   bool is_proxy_;
   bool buffered_;
   GoogleString debug_info_;
-  GoogleString output_bytes_;
+  std::vector<BufferedChunk> output_;
   RewriteDriver* driver_;
   Scheduler* scheduler_;
 
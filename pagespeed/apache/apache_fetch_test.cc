@@ -25,6 +25,7 @@
 #include "pagespeed/kernel/base/function.h"
 #include "pagespeed/kernel/base/gtest.h"
 #include "pagespeed/kernel/base/mock_message_handler.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/cache/delay_cache.h"
 #include "pagespeed/kernel/http/content_type.h"
@@ -222,6 +223,31 @@ TEST_F(ApacheFetchTest, SuccessBuffered) {
   EXPECT_EQ(kExpectedHeaders, HeadersOutToString(&request_));
 }
 
+TEST_F(ApacheFetchTest, SharedWritesBuffered) {
+  InitFetchBuffered(kExampleUrl, HttpStatus::kOK);
+  SharedString cached("headers:world");
+  SharedString body(cached);
+  body.RemovePrefix(STATIC_STRLEN("headers:"));
+  EXPECT_TRUE(apache_fetch_->Write("hello ", &message_handler_));
+  EXPECT_TRUE(apache_fetch_->WriteShared(body, &message_handler_));
+  EXPECT_TRUE(apache_fetch_->Write(".", &message_handler_));
+  EXPECT_STREQ("", MockApache::ActionsSinceLastCall());
+
+  WaitExpectSuccess();
+
+  // The shared slice is passed along by reference, between the copied bytes.
+  EXPECT_EQ(
+      "ap_set_content_type(text/plain) "
+      "ap_remove_output_filter(MOD_EXPIRES) "
+      "ap_remove_output_filter(FIXUP_HEADERS_OUT) "
+      "ap_set_content_type(text/plain) "
+      "ap_rwrite(hello ) "
+      "ap_pass_brigade(world) "
+      "ap_rwrite(.)",
+      MockApache::ActionsSinceLastCall());
+  EXPECT_EQ("headers:world", cached.Value());
+}
+
 TEST_F(ApacheFetchTest, SuccessUnbuffered) {
   InitFetchUnbuffered(kExampleUrl, HttpStatus::kOK);
   EXPECT_TRUE(apache_fetch_->Write("hello ", &message_handler_));
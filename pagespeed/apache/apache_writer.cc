@@ -22,11 +22,69 @@
 #include "pagespeed/kernel/http/http_names.h"
 #include "pagespeed/kernel/http/response_headers.h"
 
+#include "apr_buckets.h"                        // NOLINT
 #include "apr_strings.h"  // for apr_pstrdup    // NOLINT
 #include "http_protocol.h"                      // NOLINT
+#include "util_filter.h"                        // NOLINT
 
 namespace net_instaweb {
 
+namespace {
+
+// The data of a bucket made by WriteShared.  Buckets split or copied from it
+// share this, and the last one destroyed frees it, releasing our reference
+// to the SharedString's storage.
+struct SharedStringBucketData {
+  apr_bucket_refcount refcount;  // Must be first; see apr_bucket_shared_make.
+  SharedString* contents;
+};
+
+apr_status_t SharedStringBucketRead(apr_bucket* bucket, const char** str,
+                                    apr_size_t* len, apr_read_type_e block) {
+  SharedStringBucketData* data =
+      static_cast<SharedStringBucketData*>(bucket->data);
+  *str = data->contents->data() + bucket->start;
+  *len = bucket->length;
+  return APR_SUCCESS;
+}
+
+void SharedStringBucketDestroy(void* data) {
+  SharedStringBucketData* shared = static_cast<SharedStringBucketData*>(data);
+  if (apr_bucket_shared_destroy(shared)) {
+    delete shared->contents;
+    apr_bucket_free(shared);
+  }
+}
+
+// The bytes live as long as the bucket does, wherever it is set aside, so
+// like heap buckets these need no work to set aside.
+const apr_bucket_type_t kSharedStringBucketType = {
+  "PAGESPEED_SHARED_STRING", 5, apr_bucket_type_t::APR_BUCKET_DATA,
+  SharedStringBucketDestroy,
+  SharedStringBucketRead,
+  apr_bucket_setaside_noop,
+  apr_bucket_shared_split,
+  apr_bucket_shared_copy
+};
+
+apr_bucket* SharedStringBucketCreate(const SharedString& str,
+                                     apr_bucket_alloc_t* list) {
+  apr_bucket* bucket = static_cast<apr_bucket*>(
+      apr_bucket_alloc(sizeof(*bucket), list));
+  APR_BUCKET_INIT(bucket);
+  bucket->free = apr_bucket_free;
+  bucket->list = list;
+
+  SharedStringBucketData* data = static_cast<SharedStringBucketData*>(
+      apr_bucket_alloc(sizeof(*data), list));
+  data->contents = new SharedString(str);
+  bucket = apr_bucket_shared_make(bucket, data, 0, str.size());
+  bucket->type = &kSharedStringBucketType;
+  return bucket;
+}
+
+}  // namespace
+
 ApacheWriter::ApacheWriter(request_rec* r, ThreadSystem* thread_system)
     : request_(r),
       headers_out_(false),
@@ -47,6 +105,21 @@ bool ApacheWriter::Write(const StringPiece& str, MessageHandler* handler) {
   return true;
 }
 
+bool ApacheWriter::WriteShared(const SharedString& str,
+                               MessageHandler* handler) {
+  DCHECK(apache_request_thread_->IsCurrentThread());
+  DCHECK(headers_out_);
+  if (str.empty()) {
+    return true;
+  }
+  // Anything ap_rwrite has buffered is sent ahead of this brigade, so the
+  // two kinds of write can be mixed freely.
+  apr_bucket_alloc_t* list = request_->connection->bucket_alloc;
+  apr_bucket_brigade* brigade = apr_brigade_create(request_->pool, list);
+  APR_BRIGADE_INSERT_TAIL(brigade, SharedStringBucketCreate(str, list));
+  return (ap_pass_brigade(request_->output_filters, brigade) == APR_SUCCESS);
+}
+
 bool ApacheWriter::Flush(MessageHandler* handler) {
   DCHECK(apache_request_thread_->IsCurrentThread());
   DCHECK(headers_out_);
@@ -19,6 +19,7 @@
 
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/writer.h"
@@ -41,6 +42,12 @@ class ApacheWriter : public Writer {
   virtual bool Write(const StringPiece& str, MessageHandler* handler);
   virtual bool Flush(MessageHandler* handler);
 
+  // Like Write, but passes the bytes down the filter chain in a bucket that
+  // refers to str's storage rather than a copy of it.  The bucket holds a
+  // reference to the storage until Apache is done with it, so str need not
+  // outlive the call.
+  bool WriteShared(const SharedString& str, MessageHandler* handler);
+
   // Copies the contents of the specified response_headers to the Apache
   // headers_out structure.  This must be done before any bytes are flushed.
   //
@@ -22,6 +22,7 @@
 #include "pagespeed/kernel/base/gtest.h"
 #include "pagespeed/kernel/base/null_message_handler.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/null_thread_system.h"
 #include "pagespeed/kernel/http/response_headers.h"
@@ -84,6 +85,27 @@ TEST_F(ApacheWriterTest, SimpleUsage) {
   EXPECT_EQ("ap_rwrite(.)", MockApache::ActionsSinceLastCall());
 }
 
+TEST_F(ApacheWriterTest, WriteShared) {
+  apache_writer_->OutputHeaders(response_headers_.get());
+  MockApache::ActionsSinceLastCall();
+
+  SharedString cached("headers:hello world");
+  {
+    SharedString body(cached);
+    body.RemovePrefix(STATIC_STRLEN("headers:"));
+    EXPECT_TRUE(apache_writer_->WriteShared(body, &message_handler_));
+  }
+  EXPECT_EQ("ap_pass_brigade(hello world)",
+            MockApache::ActionsSinceLastCall());
+
+  // Once the filters have consumed the bucket, its reference is released.
+  EXPECT_TRUE(cached.unique());
+
+  // Empty writes are dropped.
+  EXPECT_TRUE(apache_writer_->WriteShared(SharedString(), &message_handler_));
+  EXPECT_EQ("", MockApache::ActionsSinceLastCall());
+}
+
 TEST_F(ApacheWriterTest, HTTP10) {
   // Test HTTP 1.0.
   response_headers_->set_major_version(1);
@@ -22,6 +22,7 @@
 #include "pagespeed/apache/header_util.h"
 #include "pagespeed/apache/mod_instaweb.h"
 #include "net/instaweb/http/public/request_context.h"
+#include "net/instaweb/rewriter/public/cache_warmer.h"
 #include "net/instaweb/rewriter/public/experiment_matcher.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
@@ -240,6 +241,10 @@ void InstawebContext::ProcessBytes(const char* input, int size) {
         // in all other spots as an error fallback.
         started_parse_ = rewrite_driver_->StartParseWithType(absolute_url_,
                                                              content_type_);
+        CacheWarmer* cache_warmer = server_context_->cache_warmer();
+        if (started_parse_ && (cache_warmer != NULL)) {
+          cache_warmer->RecordUrl(absolute_url_);
+        }
       }
 
       // If we buffered up any bytes in previous calls, make sure to
@@ -59,6 +59,9 @@ void MockApache::PrepareRequest(request_rec* request) {
   request->headers_in = apr_table_make(request->pool, 10);
   request->headers_out = apr_table_make(request->pool, 10);
   request->subprocess_env = apr_table_make(request->pool, 10);
+  request->connection = static_cast<conn_rec*>(
+      apr_pcalloc(request->pool, sizeof(conn_rec)));
+  request->connection->bucket_alloc = apr_bucket_alloc_create(request->pool);
 
   // Create three fake downstream filters so we can make sure the right ones are
   // removed.
@@ -162,9 +165,21 @@ apr_status_t ap_get_brigade(ap_filter_t*, apr_bucket_brigade*,
   return 0;
 }
 
-apr_status_t ap_pass_brigade(ap_filter_t*, apr_bucket_brigade*) {
-  log_fatal("ap_pass_brigade");
-  return 0;
+apr_status_t ap_pass_brigade(ap_filter_t*, apr_bucket_brigade* bb) {
+  GoogleString contents;
+  for (apr_bucket* bucket = APR_BRIGADE_FIRST(bb);
+       bucket != APR_BRIGADE_SENTINEL(bb);
+       bucket = APR_BUCKET_NEXT(bucket)) {
+    const char* buf;
+    apr_size_t bytes;
+    CHECK_EQ(APR_SUCCESS,
+             apr_bucket_read(bucket, &buf, &bytes, APR_BLOCK_READ));
+    contents.append(buf, bytes);
+  }
+  // Like the core output filter, consumes the buckets passed in.
+  apr_brigade_cleanup(bb);
+  log_action(net_instaweb::StrCat("ap_pass_brigade(", contents, ")"));
+  return APR_SUCCESS;
 }
 
 ap_filter_rec_t* ap_register_output_filter(
@@ -937,6 +937,11 @@ bool ProxyFetch::HandleWrite(const StringPiece& str,
   return ret;
 }
 
+bool ProxyFetch::HandleWriteShared(const SharedString& content,
+                                   MessageHandler* message_handler) {
+  return HandleWrite(content.Value(), message_handler);
+}
+
 bool ProxyFetch::HandleFlush(MessageHandler* message_handler) {
   // TODO(jmarantz): check if the server is being shut down and punt.
 
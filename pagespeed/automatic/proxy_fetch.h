@@ -37,6 +37,7 @@
 #include "pagespeed/kernel/base/function.h"
 #include "pagespeed/kernel/base/gtest_prod.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/http/http_names.h"
@@ -348,6 +349,8 @@ class ProxyFetch : public SharedAsyncFetch {
   // protected interface from AsyncFetch.
   virtual void HandleHeadersComplete();
   virtual bool HandleWrite(const StringPiece& content, MessageHandler* handler);
+  virtual bool HandleWriteShared(const SharedString& content,
+                                 MessageHandler* handler);
   virtual bool HandleFlush(MessageHandler* handler);
   virtual void HandleDone(bool success);
   virtual bool IsCachedResultValid(const ResponseHeaders& headers);
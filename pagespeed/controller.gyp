@@ -58,6 +58,7 @@
         'controller/central_controller_rpc_client.cc',
         'controller/central_controller_rpc_server.cc',
         'controller/compatible_central_controller.cc',
+        'controller/cost_weighted_expensive_operation_controller.cc',
         'controller/expensive_operation_callback.cc',
         'controller/expensive_operation_rpc_context.cc',
         'controller/expensive_operation_rpc_handler.cc',
@@ -68,6 +69,9 @@
         'controller/schedule_rewrite_callback.cc',
         'controller/schedule_rewrite_rpc_context.cc',
         'controller/schedule_rewrite_rpc_handler.cc',
+        'controller/shared_mem_central_controller.cc',
+        'controller/shared_mem_central_controller_server.cc',
+        'controller/shared_mem_controller_ring.cc',
         'controller/work_bound_expensive_operation_controller.cc',
       ],
       'include_dirs': [
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/controller/cost_weighted_expensive_operation_controller.h"
+
+#include <vector>
+
+#include "base/logging.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const int64 kBytesPerMbyte = 1 << 20;
+
+// Folds sample into average, which is -1 if there were no samples yet.
+int64 UpdateAverage(int64 average, int64 sample) {
+  if (average < 0) {
+    return sample;
+  }
+  const int kWeight =
+      CostWeightedExpensiveOperationController::kHistoryWeight;
+  return average + (sample - average) / kWeight;
+}
+
+}  // namespace
+
+const char CostWeightedExpensiveOperationController::kInProgressCostUs[] =
+    "cost-weighted-expensive-operations-in-progress-us";
+const char
+    CostWeightedExpensiveOperationController::kQueuedExpensiveOperations[] =
+        "cost-weighted-queued-expensive-operations";
+const char
+    CostWeightedExpensiveOperationController::kPermittedExpensiveOperations[] =
+        "cost-weighted-permitted-expensive-operations";
+
+const int CostWeightedExpensiveOperationController::kHistoryWeight;
+
+CostWeightedExpensiveOperationController::
+    CostWeightedExpensiveOperationController(int64 budget_us,
+                                             int64 default_cost_us,
+                                             Timer* timer,
+                                             ThreadSystem* thread_system,
+                                             Statistics* stats)
+    : budget_us_(budget_us),
+      default_cost_us_(default_cost_us),
+      timer_(timer),
+      mutex_(thread_system->NewMutex()),
+      in_progress_cost_us_(0),
+      num_in_progress_(0),
+      in_progress_cost_counter_(stats->GetUpDownCounter(kInProgressCostUs)),
+      queued_operations_counter_(
+          stats->GetUpDownCounter(kQueuedExpensiveOperations)),
+      permitted_operations_counter_(
+          stats->GetTimedVariable(kPermittedExpensiveOperations)) {
+}
+
+CostWeightedExpensiveOperationController::
+    ~CostWeightedExpensiveOperationController() {
+  // As in QueuedExpensiveOperationController, the queue should be empty by
+  // now, but if it isn't we delete its contents rather than risk running
+  // Cancel this late.
+  DCHECK(queue_.empty());
+  while (!queue_.empty()) {
+    delete queue_.front().callback;
+    queue_.pop_front();
+  }
+}
+
+void CostWeightedExpensiveOperationController::InitStats(
+    Statistics* statistics) {
+  statistics->AddGlobalUpDownCounter(kInProgressCostUs);
+  statistics->AddGlobalUpDownCounter(kQueuedExpensiveOperations);
+  statistics->AddTimedVariable(kPermittedExpensiveOperations,
+                               Statistics::kDefaultGroup);
+}
+
+void CostWeightedExpensiveOperationController::ScheduleExpensiveOperation(
+    Function* callback) {
+  Schedule(NULL, callback);
+}
+
+void CostWeightedExpensiveOperationController::
+    ScheduleExpensiveOperationWithCost(ExpensiveOperationCost* cost,
+                                       Function* callback) {
+  CHECK(cost != NULL);
+  Schedule(cost, callback);
+}
+
+void CostWeightedExpensiveOperationController::
+    NotifyExpensiveOperationComplete() {
+  Complete(default_cost_us_);
+}
+
+void CostWeightedExpensiveOperationController::
+    NotifyExpensiveOperationCompleteWithCost(
+        const ExpensiveOperationCost& cost, bool completed) {
+  if (completed) {
+    ScopedMutex lock(mutex_.get());
+    Learn(cost, timer_->NowUs() - cost.started_us);
+  }
+  Complete(cost.charged_us);
+}
+
+int64 CostWeightedExpensiveOperationController::EstimateCostUs(
+    const ExpensiveOperationCost& cost) {
+  ScopedMutex lock(mutex_.get());
+  return EstimateCostUsMutexHeld(cost);
+}
+
+int64 CostWeightedExpensiveOperationController::EstimateCostUsMutexHeld(
+    const ExpensiveOperationCost& cost) {
+  HistoryMap::const_iterator p = history_.find(cost.type);
+  if (p != history_.end()) {
+    const History& history = p->second;
+    if (cost.input_bytes > 0 && history.us_per_mbyte >= 0) {
+      return history.us_per_mbyte * cost.input_bytes / kBytesPerMbyte;
+    }
+    if (history.us >= 0) {
+      return history.us;
+    }
+  }
+  return default_cost_us_;
+}
+
+void CostWeightedExpensiveOperationController::Learn(
+    const ExpensiveOperationCost& cost, int64 duration_us) {
+  if (duration_us < 0) {
+    return;  // The clock went backwards.
+  }
+  History* history = &history_[cost.type];
+  history->us = UpdateAverage(history->us, duration_us);
+  if (cost.input_bytes > 0) {
+    history->us_per_mbyte = UpdateAverage(
+        history->us_per_mbyte, duration_us * kBytesPerMbyte / cost.input_bytes);
+  }
+}
+
+bool CostWeightedExpensiveOperationController::Fits(int64 charge_us) const {
+  return (num_in_progress_ == 0) ||
+      (in_progress_cost_us_ + charge_us <= budget_us_);
+}
+
+void CostWeightedExpensiveOperationController::Start(
+    ExpensiveOperationCost* cost, int64 charge_us) {
+  if (cost != NULL) {
+    cost->charged_us = charge_us;
+    cost->started_us = timer_->NowUs();
+  }
+  ++num_in_progress_;
+  in_progress_cost_us_ += charge_us;
+  in_progress_cost_counter_->Set(in_progress_cost_us_);
+  permitted_operations_counter_->IncBy(1);
+}
+
+void CostWeightedExpensiveOperationController::Schedule(
+    ExpensiveOperationCost* cost, Function* callback) {
+  CHECK(callback != NULL);
+  ScopedMutex lock(mutex_.get());
+
+  // If we are configured to disallow all expensive operations, immediately deny
+  // the request and don't queue it.
+  if (budget_us_ <= 0) {
+    lock.Release();
+    callback->CallCancel();
+    return;
+  }
+
+  int64 charge_us =
+      (cost == NULL) ? default_cost_us_ : EstimateCostUsMutexHeld(*cost);
+  // Nothing jumps the queue, however small, so that large operations are not
+  // starved.
+  if (queue_.empty() && Fits(charge_us)) {
+    Start(cost, charge_us);
+    lock.Release();
+    callback->CallRun();
+  } else {
+    queue_.push_back(Waiting(cost, charge_us, callback));
+    queued_operations_counter_->Set(queue_.size());
+  }
+}
+
+void CostWeightedExpensiveOperationController::Complete(int64 charged_us) {
+  std::vector<Function*> to_run;
+  {
+    ScopedMutex lock(mutex_.get());
+    DCHECK_GT(num_in_progress_, 0);
+    if (num_in_progress_ > 0) {
+      --num_in_progress_;
+      in_progress_cost_us_ -= charged_us;
+      in_progress_cost_counter_->Set(in_progress_cost_us_);
+    }
+
+    // Start as many of the waiting operations as now fit.
+    while (!queue_.empty() && Fits(queue_.front().charge_us)) {
+      const Waiting& waiting = queue_.front();
+      Start(waiting.cost, waiting.charge_us);
+      to_run.push_back(waiting.callback);
+      queue_.pop_front();
+    }
+    queued_operations_counter_->Set(queue_.size());
+  }
+  for (int i = 0, n = to_run.size(); i < n; ++i) {
+    to_run[i]->CallRun();
+  }
+}
+
+}  // namespace net_instaweb
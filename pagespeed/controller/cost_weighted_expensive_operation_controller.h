@@ -0,0 +1,140 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_CONTROLLER_COST_WEIGHTED_EXPENSIVE_OPERATION_CONTROLLER_H_
+#define PAGESPEED_CONTROLLER_COST_WEIGHTED_EXPENSIVE_OPERATION_CONTROLLER_H_
+
+#include <deque>
+#include <map>
+
+#include "pagespeed/controller/expensive_operation_controller.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+
+namespace net_instaweb {
+
+// Implements ExpensiveOperationController by admitting operations against a
+// budget of CPU time, rather than a count: the estimated cost of the
+// operations running at once may not exceed the budget, so many small
+// operations may run together, but only a few large ones. An operation that
+// would exceed the budget waits in a queue, in strict order, until enough
+// of the operations ahead of it complete. So that no operation waits
+// forever, one is always let run when nothing else is.
+//
+// An operation's cost is estimated from how long operations of the same type
+// have taken, per byte of input, or in total if its input size isn't known.
+// Types with no history yet are charged default_cost_us. The time from
+// letting an operation run to its completion stands in for its CPU time,
+// since each operation runs on a single thread.
+//
+// Like QueuedExpensiveOperationController, this does not communicate across
+// process boundaries, so to share a budget across processes it must run in
+// the central controller process, with requests routed to it over RPC.
+class CostWeightedExpensiveOperationController
+    : public ExpensiveOperationController {
+ public:
+  static const char kInProgressCostUs[];
+  static const char kQueuedExpensiveOperations[];
+  static const char kPermittedExpensiveOperations[];
+
+  // Weight given to each new timing in the per-type averages, as 1/N.
+  static const int kHistoryWeight = 8;
+
+  // budget_us is the total estimated CPU time, in us, of the operations that
+  // may run at once; a budget of 0 denies everything. Statistics must have
+  // been initialized with InitStats.
+  CostWeightedExpensiveOperationController(int64 budget_us,
+                                           int64 default_cost_us,
+                                           Timer* timer,
+                                           ThreadSystem* thread_system,
+                                           Statistics* stats);
+  virtual ~CostWeightedExpensiveOperationController();
+
+  // ExpensiveOperationController interface. Operations with no cost are
+  // charged default_cost_us, and don't contribute to the history.
+  virtual void ScheduleExpensiveOperation(Function* callback);
+  virtual void NotifyExpensiveOperationComplete();
+  virtual void ScheduleExpensiveOperationWithCost(ExpensiveOperationCost* cost,
+                                                  Function* callback);
+  virtual void NotifyExpensiveOperationCompleteWithCost(
+      const ExpensiveOperationCost& cost, bool completed);
+
+  // Returns the cost, in us, that an operation described by cost would be
+  // charged now.
+  int64 EstimateCostUs(const ExpensiveOperationCost& cost);
+
+  static void InitStats(Statistics* stats);
+
+ private:
+  struct History {
+    History() : us_per_mbyte(-1), us(-1) {}
+
+    // Averages of the time taken per megabyte of input, and in total, or -1
+    // if there were no timings yet.
+    int64 us_per_mbyte;
+    int64 us;
+  };
+  typedef std::map<GoogleString, History> HistoryMap;
+
+  struct Waiting {
+    Waiting(ExpensiveOperationCost* cost_in, int64 charge_us_in,
+            Function* callback_in)
+        : cost(cost_in), charge_us(charge_us_in), callback(callback_in) {}
+
+    ExpensiveOperationCost* cost;  // May be NULL.
+    int64 charge_us;
+    Function* callback;
+  };
+
+  void Schedule(ExpensiveOperationCost* cost, Function* callback);
+  void Complete(int64 charged_us);
+  int64 EstimateCostUsMutexHeld(const ExpensiveOperationCost& cost)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void Learn(const ExpensiveOperationCost& cost, int64 duration_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Returns true if an operation charged charge_us may run now.
+  bool Fits(int64 charge_us) const EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Charges an operation and marks it started.
+  void Start(ExpensiveOperationCost* cost, int64 charge_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const int64 budget_us_;
+  const int64 default_cost_us_;
+  Timer* timer_;
+  scoped_ptr<AbstractMutex> mutex_;
+  HistoryMap history_ GUARDED_BY(mutex_);
+  std::deque<Waiting> queue_ GUARDED_BY(mutex_);
+  int64 in_progress_cost_us_ GUARDED_BY(mutex_);
+  int num_in_progress_ GUARDED_BY(mutex_);
+  UpDownCounter* in_progress_cost_counter_;
+  UpDownCounter* queued_operations_counter_;
+  TimedVariable* permitted_operations_counter_;
+
+  DISALLOW_COPY_AND_ASSIGN(CostWeightedExpensiveOperationController);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_CONTROLLER_COST_WEIGHTED_EXPENSIVE_OPERATION_CONTROLLER_H_
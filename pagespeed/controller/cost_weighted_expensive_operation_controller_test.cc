@@ -0,0 +1,238 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/controller/cost_weighted_expensive_operation_controller.h"
+
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const int64 kBudgetUs = 1000;
+const int64 kDefaultCostUs = 100;
+const int64 kMbyte = 1 << 20;
+
+class TrackCallsFunction : public Function {
+ public:
+  TrackCallsFunction() : run_called_(false), cancel_called_(false) {
+    set_delete_after_callback(false);
+  }
+  virtual ~TrackCallsFunction() { }
+
+  virtual void Run() { run_called_ = true; }
+  virtual void Cancel() { cancel_called_ = true; }
+
+  bool run_called_;
+  bool cancel_called_;
+};
+
+class CostWeightedExpensiveOperationTest : public testing::Test {
+ public:
+  CostWeightedExpensiveOperationTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        timer_(thread_system_->NewMutex(), MockTimer::kApr_5_2010_ms),
+        stats_(thread_system_.get()) {
+    CostWeightedExpensiveOperationController::InitStats(&stats_);
+    InitWithBudget(kBudgetUs);
+  }
+
+  void InitWithBudget(int64 budget_us) {
+    controller_.reset(new CostWeightedExpensiveOperationController(
+        budget_us, kDefaultCostUs, &timer_, thread_system_.get(), &stats_));
+  }
+
+  void SetCost(StringPiece type, int64 input_bytes,
+               ExpensiveOperationCost* cost) {
+    type.CopyToString(&cost->type);
+    cost->input_bytes = input_bytes;
+  }
+
+  // Runs an operation of the given type and size, taking duration_us, with
+  // nothing else in progress.
+  void RunOperation(StringPiece type, int64 input_bytes, int64 duration_us) {
+    ExpensiveOperationCost cost;
+    SetCost(type, input_bytes, &cost);
+    TrackCallsFunction f;
+    controller_->ScheduleExpensiveOperationWithCost(&cost, &f);
+    ASSERT_TRUE(f.run_called_);
+    timer_.AdvanceUs(duration_us);
+    controller_->NotifyExpensiveOperationCompleteWithCost(cost, true);
+  }
+
+  int64 Estimate(StringPiece type, int64 input_bytes) {
+    ExpensiveOperationCost cost;
+    SetCost(type, input_bytes, &cost);
+    return controller_->EstimateCostUs(cost);
+  }
+
+  int64 in_progress_cost_us() {
+    return stats_.GetUpDownCounter(
+        CostWeightedExpensiveOperationController::kInProgressCostUs)->Get();
+  }
+
+  int64 queued_operations() {
+    return stats_
+        .GetUpDownCounter(CostWeightedExpensiveOperationController::
+                              kQueuedExpensiveOperations)
+        ->Get();
+  }
+
+  int64 permitted_operations() {
+    return stats_
+        .GetTimedVariable(CostWeightedExpensiveOperationController::
+                              kPermittedExpensiveOperations)
+        ->Get(TimedVariable::START);
+  }
+
+ protected:
+  scoped_ptr<ThreadSystem> thread_system_;
+  MockTimer timer_;
+  SimpleStats stats_;
+  scoped_ptr<CostWeightedExpensiveOperationController> controller_;
+};
+
+TEST_F(CostWeightedExpensiveOperationTest, CheapOperationsShareBudget) {
+  const int kNumFit = kBudgetUs / kDefaultCostUs;
+  TrackCallsFunction f[kNumFit + 1];
+  for (int i = 0; i < kNumFit; ++i) {
+    controller_->ScheduleExpensiveOperation(&f[i]);
+    EXPECT_TRUE(f[i].run_called_);
+  }
+  EXPECT_EQ(kBudgetUs, in_progress_cost_us());
+  EXPECT_EQ(kNumFit, permitted_operations());
+
+  controller_->ScheduleExpensiveOperation(&f[kNumFit]);
+  EXPECT_FALSE(f[kNumFit].run_called_);
+  EXPECT_FALSE(f[kNumFit].cancel_called_);
+  EXPECT_EQ(1, queued_operations());
+
+  controller_->NotifyExpensiveOperationComplete();
+  EXPECT_TRUE(f[kNumFit].run_called_);
+  EXPECT_EQ(0, queued_operations());
+  EXPECT_EQ(kNumFit + 1, permitted_operations());
+
+  for (int i = 0; i < kNumFit; ++i) {
+    controller_->NotifyExpensiveOperationComplete();
+  }
+  EXPECT_EQ(0, in_progress_cost_us());
+}
+
+TEST_F(CostWeightedExpensiveOperationTest, EstimatesFromHistory) {
+  // No history, so the default.
+  EXPECT_EQ(kDefaultCostUs, Estimate("image/jpeg", kMbyte));
+
+  RunOperation("image/jpeg", kMbyte, 2000);
+  EXPECT_EQ(2000, Estimate("image/jpeg", kMbyte));
+  EXPECT_EQ(500, Estimate("image/jpeg", kMbyte / 4));
+  EXPECT_EQ(20000, Estimate("image/jpeg", 10 * kMbyte));
+  // Without a size, the average time.
+  EXPECT_EQ(2000, Estimate("image/jpeg", 0));
+  // Other types are separate.
+  EXPECT_EQ(kDefaultCostUs, Estimate("image/png", kMbyte));
+
+  // Later timings are averaged in.
+  RunOperation("image/jpeg", kMbyte / 2, 2000 + 8 * 800);
+  int64 us_per_mbyte = 2000 + ((2 * (2000 + 8 * 800)) - 2000) / 8;
+  EXPECT_EQ(us_per_mbyte, Estimate("image/jpeg", kMbyte));
+  EXPECT_EQ(2000 + 800, Estimate("image/jpeg", 0));
+
+  // An operation whose caller went away doesn't count.
+  ExpensiveOperationCost cost;
+  SetCost("image/jpeg", kMbyte, &cost);
+  TrackCallsFunction f;
+  controller_->ScheduleExpensiveOperationWithCost(&cost, &f);
+  EXPECT_EQ(us_per_mbyte, cost.charged_us);
+  timer_.AdvanceMs(100);
+  controller_->NotifyExpensiveOperationCompleteWithCost(cost, false);
+  EXPECT_EQ(us_per_mbyte, Estimate("image/jpeg", kMbyte));
+  EXPECT_EQ(0, in_progress_cost_us());
+}
+
+TEST_F(CostWeightedExpensiveOperationTest, ExpensiveOperationRunsAlone) {
+  RunOperation("image/jpeg", kMbyte, kBudgetUs);
+
+  // Twice the budget, but nothing else is running.
+  ExpensiveOperationCost big;
+  SetCost("image/jpeg", 2 * kMbyte, &big);
+  TrackCallsFunction f_big;
+  controller_->ScheduleExpensiveOperationWithCost(&big, &f_big);
+  EXPECT_TRUE(f_big.run_called_);
+  EXPECT_EQ(2 * kBudgetUs, in_progress_cost_us());
+
+  // So even something cheap must wait for it.
+  ExpensiveOperationCost small;
+  SetCost("image/png", 1024, &small);
+  TrackCallsFunction f_small;
+  controller_->ScheduleExpensiveOperationWithCost(&small, &f_small);
+  EXPECT_FALSE(f_small.run_called_);
+
+  timer_.AdvanceUs(2 * kBudgetUs);
+  controller_->NotifyExpensiveOperationCompleteWithCost(big, true);
+  EXPECT_TRUE(f_small.run_called_);
+  EXPECT_EQ(kDefaultCostUs, in_progress_cost_us());
+  controller_->NotifyExpensiveOperationCompleteWithCost(small, true);
+  EXPECT_EQ(0, in_progress_cost_us());
+}
+
+TEST_F(CostWeightedExpensiveOperationTest, StrictOrder) {
+  RunOperation("image/jpeg", kMbyte, kBudgetUs);
+
+  TrackCallsFunction f_first;
+  controller_->ScheduleExpensiveOperation(&f_first);
+  EXPECT_TRUE(f_first.run_called_);
+
+  // Doesn't fit alongside the first, so waits.
+  ExpensiveOperationCost big;
+  SetCost("image/jpeg", kMbyte, &big);
+  TrackCallsFunction f_big;
+  controller_->ScheduleExpensiveOperationWithCost(&big, &f_big);
+  EXPECT_FALSE(f_big.run_called_);
+
+  // Would fit, but mustn't starve the big one.
+  TrackCallsFunction f_small;
+  controller_->ScheduleExpensiveOperation(&f_small);
+  EXPECT_FALSE(f_small.run_called_);
+  EXPECT_EQ(2, queued_operations());
+
+  controller_->NotifyExpensiveOperationComplete();
+  EXPECT_TRUE(f_big.run_called_);
+  EXPECT_FALSE(f_small.run_called_);
+  controller_->NotifyExpensiveOperationCompleteWithCost(big, true);
+  EXPECT_TRUE(f_small.run_called_);
+  controller_->NotifyExpensiveOperationComplete();
+  EXPECT_EQ(0, in_progress_cost_us());
+  EXPECT_EQ(0, queued_operations());
+}
+
+TEST_F(CostWeightedExpensiveOperationTest, ZeroBudgetDenies) {
+  InitWithBudget(0);
+  TrackCallsFunction f;
+  controller_->ScheduleExpensiveOperation(&f);
+  EXPECT_FALSE(f.run_called_);
+  EXPECT_TRUE(f.cancel_called_);
+  EXPECT_EQ(0, permitted_operations());
+}
+
+}  // namespace
+
+}  // namespace net_instaweb
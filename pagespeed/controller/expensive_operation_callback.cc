@@ -26,7 +26,8 @@ ExpensiveOperationContext::~ExpensiveOperationContext() {
 
 ExpensiveOperationCallback::ExpensiveOperationCallback(
     Sequence* sequence)
-    : CentralControllerCallback<ExpensiveOperationContext>(sequence) {
+    : CentralControllerCallback<ExpensiveOperationContext>(sequence),
+      input_bytes_(0) {
 }
 
 ExpensiveOperationCallback::~ExpensiveOperationCallback() {
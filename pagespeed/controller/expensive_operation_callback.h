@@ -20,6 +20,8 @@
 #include "pagespeed/controller/central_controller_callback.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/thread/sequence.h"
 
 // Callback classes to support ExpensiveOperation features in CentralController.
@@ -49,11 +51,22 @@ class ExpensiveOperationCallback
   explicit ExpensiveOperationCallback(Sequence* sequence);
   virtual ~ExpensiveOperationCallback();
 
+  // Describes the operation, so that controllers which weigh operations by
+  // cost can estimate it: the kind of operation, eg its input's mime type,
+  // and the size of its input. Set these before scheduling.
+  const GoogleString& operation_type() const { return operation_type_; }
+  void set_operation_type(StringPiece x) { x.CopyToString(&operation_type_); }
+  int64 input_bytes() const { return input_bytes_; }
+  void set_input_bytes(int64 x) { input_bytes_ = x; }
+
  private:
   // CentralControllerCallback interface.
   virtual void RunImpl(scoped_ptr<ExpensiveOperationContext>* context) = 0;
   virtual void CancelImpl() = 0;
 
+  GoogleString operation_type_;
+  int64 input_bytes_;
+
   DISALLOW_COPY_AND_ASSIGN(ExpensiveOperationCallback);
 };
 
@@ -19,9 +19,24 @@
 
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/string.h"
 
 namespace net_instaweb {
 
+// Describes an expensive operation, for controllers that weigh operations by
+// what they are expected to cost. The caller fills in what it knows, and the
+// controller records what it charged the operation when it let it run.
+struct ExpensiveOperationCost {
+  ExpensiveOperationCost() : input_bytes(0), charged_us(0), started_us(0) { }
+
+  GoogleString type;  // Kind of operation, eg the input's mime type.
+  int64 input_bytes;  // Size of the input, or 0 if unknown.
+
+  // Set by the controller.
+  int64 charged_us;
+  int64 started_us;
+};
+
 // Abstract interface class that supports PSOL operations for rate-limiting
 // CPU intensive operations. For use in CentralController.
 
@@ -38,6 +53,20 @@ class ExpensiveOperationController {
   // Should only be called if Run() was invoked on callback above.
   virtual void NotifyExpensiveOperationComplete() = 0;
 
+  // As above, for an operation described by *cost. The same cost must be
+  // passed to NotifyExpensiveOperationCompleteWithCost, and outlive the
+  // operation. completed is false if the caller went away rather than
+  // reporting completion, so its timing means nothing. By default, the cost
+  // is ignored.
+  virtual void ScheduleExpensiveOperationWithCost(ExpensiveOperationCost* cost,
+                                                  Function* callback) {
+    ScheduleExpensiveOperation(callback);
+  }
+  virtual void NotifyExpensiveOperationCompleteWithCost(
+      const ExpensiveOperationCost& cost, bool completed) {
+    NotifyExpensiveOperationComplete();
+  }
+
  protected:
   ExpensiveOperationController() { }
 
@@ -22,7 +22,9 @@
 #include "pagespeed/controller/controller.pb.h"
 #include "pagespeed/controller/expensive_operation_callback.h"
 #include "pagespeed/controller/request_result_rpc_client.h"
+#include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/util/grpc.h"
 
@@ -37,7 +39,9 @@ class ExpensiveOperationRpcContext::ExpensiveOperationRequestResultRpcClient
       grpc::CentralControllerRpcService::StubInterface* stub,
       ::grpc::CompletionQueue* queue, ThreadSystem* thread_system,
       MessageHandler* handler, ExpensiveOperationCallback* callback)
-      : RequestResultRpcClient(queue, thread_system, handler, callback) {
+      : RequestResultRpcClient(queue, thread_system, handler, callback),
+        operation_type_(callback->operation_type()),
+        input_bytes_(callback->input_bytes()) {
     // Nothing will happen until a call to Start() is made. We don't do it here
     // because the wrapper needs to call SetTransactionContext first.
   }
@@ -55,15 +59,19 @@ class ExpensiveOperationRpcContext::ExpensiveOperationRequestResultRpcClient
 
   void Done() {
     ScheduleExpensiveOperationRequest req;
-    // req has no fields.
+    // The result needs no fields.
     SendResultToServer(req);
   }
 
  private:
   void PopulateServerRequest(
       ScheduleExpensiveOperationRequest* request) override {
-    // request has no fields, so this is a no-op.
+    request->set_operation_type(operation_type_);
+    request->set_input_bytes(input_bytes_);
   }
+
+  const GoogleString operation_type_;
+  const int64 input_bytes_;
 };
 
 ExpensiveOperationRpcContext::ExpensiveOperationRpcContext(
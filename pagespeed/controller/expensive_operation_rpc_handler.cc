@@ -25,16 +25,18 @@ ExpensiveOperationRpcHandler::ExpensiveOperationRpcHandler(
 
 void ExpensiveOperationRpcHandler::HandleClientRequest(
     const ScheduleExpensiveOperationRequest& req, Function* callback) {
-  controller()->ScheduleExpensiveOperation(callback);
+  cost_.type = req.operation_type();
+  cost_.input_bytes = req.input_bytes();
+  controller()->ScheduleExpensiveOperationWithCost(&cost_, callback);
 }
 
 void ExpensiveOperationRpcHandler::HandleClientResult(
     const ScheduleExpensiveOperationRequest& req) {
-  controller()->NotifyExpensiveOperationComplete();
+  controller()->NotifyExpensiveOperationCompleteWithCost(cost_, true);
 }
 
 void ExpensiveOperationRpcHandler::HandleOperationFailed() {
-  controller()->NotifyExpensiveOperationComplete();
+  controller()->NotifyExpensiveOperationCompleteWithCost(cost_, false);
 }
 
 void ExpensiveOperationRpcHandler::InitResponder(
@@ -73,6 +73,10 @@ class ExpensiveOperationRpcHandler
   friend class RequestResultRpcHandler;
   friend class ExpensiveOperationRpcHandlerTest;
 
+  // What the client told us about the operation, and what the controller
+  // charged for it.
+  ExpensiveOperationCost cost_;
+
   DISALLOW_COPY_AND_ASSIGN(ExpensiveOperationRpcHandler);
 };
 
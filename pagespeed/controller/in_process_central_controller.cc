@@ -16,6 +16,7 @@
 
 #include "pagespeed/controller/in_process_central_controller.h"
 
+#include "pagespeed/controller/cost_weighted_expensive_operation_controller.h"
 #include "pagespeed/controller/expensive_operation_callback.h"
 #include "pagespeed/controller/named_lock_schedule_rewrite_controller.h"
 #include "pagespeed/controller/popularity_contest_schedule_rewrite_controller.h"
@@ -34,12 +35,14 @@ class ExpensiveOperationContextImpl : public ExpensiveOperationContext {
   ExpensiveOperationContextImpl(ExpensiveOperationController* controller,
                                 ExpensiveOperationCallback* callback)
       : controller_(controller), callback_(callback) {
+    cost_.type = callback_->operation_type();
+    cost_.input_bytes = callback_->input_bytes();
     // SetTransactionContext steals ownership, which means we will never outlive
     // the callback.
     callback_->SetTransactionContext(this);
-    controller_->ScheduleExpensiveOperation(
-        MakeFunction(this, &ExpensiveOperationContextImpl::CallRun,
-                     &ExpensiveOperationContextImpl::CallCancel));
+    controller_->ScheduleExpensiveOperationWithCost(
+        &cost_, MakeFunction(this, &ExpensiveOperationContextImpl::CallRun,
+                             &ExpensiveOperationContextImpl::CallCancel));
   }
 
   ~ExpensiveOperationContextImpl() {
@@ -48,7 +51,7 @@ class ExpensiveOperationContextImpl : public ExpensiveOperationContext {
 
   void Done() override {
     if (controller_ != nullptr) {
-      controller_->NotifyExpensiveOperationComplete();
+      controller_->NotifyExpensiveOperationCompleteWithCost(cost_, true);
       controller_ = nullptr;
     }
   }
@@ -65,6 +68,7 @@ class ExpensiveOperationContextImpl : public ExpensiveOperationContext {
 
   ExpensiveOperationController* controller_;
   ExpensiveOperationCallback* callback_;
+  ExpensiveOperationCost cost_;
 };
 
 class ScheduleRewriteContextImpl : public ScheduleRewriteContext {
@@ -126,6 +130,7 @@ InProcessCentralController::~InProcessCentralController() {
 }
 
 void InProcessCentralController::InitStats(Statistics* statistics) {
+  CostWeightedExpensiveOperationController::InitStats(statistics);
   NamedLockScheduleRewriteController::InitStats(statistics);
   PopularityContestScheduleRewriteController::InitStats(statistics);
   QueuedExpensiveOperationController::InitStats(statistics);
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/controller/shared_mem_central_controller.h"
+
+#include <unistd.h>
+
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/thread.h"
+#include "pagespeed/kernel/base/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// The answer thread is woken whenever an answer arrives or we shut down, so
+// this only bounds how long a lost wakeup could go unnoticed.
+const int64 kAnswerWaitMs = Timer::kSecondMs;
+
+}  // namespace
+
+class SharedMemCentralController::AnswerThread : public ThreadSystem::Thread {
+ public:
+  AnswerThread(SharedMemCentralController* controller,
+               ThreadSystem* thread_system)
+      : Thread(thread_system, "shm_controller", ThreadSystem::kJoinable),
+        controller_(controller) {}
+
+  void Run() override {
+    SharedMemControllerRing* ring = controller_->ring_.get();
+    while (true) {
+      uint32 sequence = ring->ChannelSequence(controller_->channel_);
+      int delivered = controller_->DeliverAnswers();
+      if (delivered < 0) {
+        return;
+      } else if (delivered == 0) {
+        ring->WaitForChannel(controller_->channel_, sequence, kAnswerWaitMs);
+      }
+    }
+  }
+
+ private:
+  SharedMemCentralController* controller_;
+
+  DISALLOW_COPY_AND_ASSIGN(AnswerThread);
+};
+
+// Owns a granted slot, and tells the controller when the operation in it is
+// done, exactly once.
+class SharedMemCentralController::Transaction {
+ public:
+  explicit Transaction(SharedMemControllerRing* ring)
+      : ring_(ring), slot_(-1) {}
+  virtual ~Transaction() {}
+
+  void Granted(int slot) { slot_ = slot; }
+
+ protected:
+  void Finish(bool succeeded) {
+    if (slot_ >= 0) {
+      ring_->Finish(slot_, succeeded);
+      slot_ = -1;
+    }
+  }
+
+ private:
+  SharedMemControllerRing* ring_;
+  int slot_;
+
+  DISALLOW_COPY_AND_ASSIGN(Transaction);
+};
+
+class SharedMemCentralController::ExpensiveOperationContextImpl
+    : public ExpensiveOperationContext,
+      public Transaction {
+ public:
+  explicit ExpensiveOperationContextImpl(SharedMemControllerRing* ring)
+      : Transaction(ring) {}
+
+  ~ExpensiveOperationContextImpl() override {
+    Done();
+  }
+
+  void Done() override {
+    Finish(true);
+  }
+};
+
+class SharedMemCentralController::ScheduleRewriteContextImpl
+    : public ScheduleRewriteContext,
+      public Transaction {
+ public:
+  explicit ScheduleRewriteContextImpl(SharedMemControllerRing* ring)
+      : Transaction(ring) {}
+
+  ~ScheduleRewriteContextImpl() override {
+    MarkSucceeded();
+  }
+
+  void MarkSucceeded() override {
+    Finish(true);
+  }
+
+  void MarkFailed() override {
+    Finish(false);
+  }
+};
+
+SharedMemCentralController::SharedMemCentralController(
+    AbstractSharedMem* shm_runtime, const GoogleString& segment_name,
+    int num_slots, ThreadSystem* thread_system, MessageHandler* handler)
+    : ring_(new SharedMemControllerRing(shm_runtime, segment_name, num_slots)),
+      pid_(getpid()),
+      channel_(pid_ % SharedMemControllerRing::kNumChannels),
+      attached_(false),
+      mutex_(thread_system->NewMutex()),
+      shut_down_(false) {
+  attached_ = ring_->Attach(handler);
+  if (attached_) {
+    answer_thread_.reset(new AnswerThread(this, thread_system));
+    CHECK(answer_thread_->Start());
+  }
+}
+
+SharedMemCentralController::~SharedMemCentralController() {
+  ShutDown();
+}
+
+void SharedMemCentralController::ScheduleExpensiveOperation(
+    ExpensiveOperationCallback* callback) {
+  SharedMemControllerRing::Request request;
+  request.kind = SharedMemControllerRing::kExpensiveOperation;
+  request.key = callback->operation_type();
+  request.input_bytes = callback->input_bytes();
+  ExpensiveOperationContextImpl* context =
+      new ExpensiveOperationContextImpl(ring_.get());
+  // SetTransactionContext steals ownership, which means the context will never
+  // outlive the callback.
+  callback->SetTransactionContext(context);
+  StartRequest(request, callback, context);
+}
+
+void SharedMemCentralController::ScheduleRewrite(
+    ScheduleRewriteCallback* callback) {
+  SharedMemControllerRing::Request request;
+  request.kind = SharedMemControllerRing::kRewrite;
+  request.key = callback->key();
+  ScheduleRewriteContextImpl* context =
+      new ScheduleRewriteContextImpl(ring_.get());
+  callback->SetTransactionContext(context);
+  StartRequest(request, callback, context);
+}
+
+void SharedMemCentralController::StartRequest(
+    const SharedMemControllerRing::Request& input, Function* callback,
+    Transaction* transaction) {
+  SharedMemControllerRing::Request request(input);
+  request.owner_pid = pid_;
+  int slot = -1;
+  {
+    ScopedMutex lock(mutex_.get());
+    if (attached_ && !shut_down_) {
+      slot = ring_->ClaimSlot(request, channel_);
+      if (slot >= 0) {
+        pending_[slot] = Pending(callback, transaction);
+      }
+    }
+  }
+  if (slot < 0) {
+    // Shut down, or the controller isn't keeping up. The transaction has no
+    // slot, so won't notify anyone.
+    callback->CallCancel();
+    return;
+  }
+  ring_->PostRequest(slot);
+}
+
+int SharedMemCentralController::DeliverAnswers() {
+  std::vector<int> slots;
+  std::vector<SharedMemControllerRing::State> states;
+  std::vector<Function*> to_run;
+  std::vector<Function*> to_cancel;
+  {
+    ScopedMutex lock(mutex_.get());
+    if (shut_down_) {
+      return -1;
+    }
+    for (PendingMap::const_iterator p = pending_.begin(), e = pending_.end();
+         p != e; ++p) {
+      slots.push_back(p->first);
+    }
+    ring_->TakeAnswers(slots, &states);
+    for (int i = 0, n = slots.size(); i < n; ++i) {
+      if (states[i] == SharedMemControllerRing::kGranted) {
+        Pending* pending = &pending_[slots[i]];
+        pending->transaction->Granted(slots[i]);
+        to_run.push_back(pending->callback);
+        pending_.erase(slots[i]);
+      } else if (states[i] == SharedMemControllerRing::kDenied) {
+        to_cancel.push_back(pending_[slots[i]].callback);
+        pending_.erase(slots[i]);
+      }
+    }
+  }
+  // The callbacks just requeue themselves onto their sequences, so are quick.
+  for (int i = 0, n = to_run.size(); i < n; ++i) {
+    to_run[i]->CallRun();
+  }
+  for (int i = 0, n = to_cancel.size(); i < n; ++i) {
+    to_cancel[i]->CallCancel();
+  }
+  return to_run.size() + to_cancel.size();
+}
+
+void SharedMemCentralController::ShutDown() {
+  PendingMap pending;
+  {
+    ScopedMutex lock(mutex_.get());
+    if (shut_down_) {
+      return;
+    }
+    shut_down_ = true;
+    pending.swap(pending_);
+  }
+  if (answer_thread_ != nullptr) {
+    // Wake the answer thread so it notices. This may wake other processes
+    // sharing our channel too, but they'll just go back to sleep.
+    ring_->RingChannel(channel_);
+    answer_thread_->Join();
+  }
+  // Whatever the controller made of these requests, it will free their slots
+  // and release anything it granted.
+  for (PendingMap::const_iterator p = pending.begin(), e = pending.end();
+       p != e; ++p) {
+    ring_->Abandon(p->first);
+    p->second.callback->CallCancel();
+  }
+}
+
+}  // namespace net_instaweb
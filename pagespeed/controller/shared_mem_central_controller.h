@@ -0,0 +1,109 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_CONTROLLER_SHARED_MEM_CENTRAL_CONTROLLER_H_
+#define PAGESPEED_CONTROLLER_SHARED_MEM_CENTRAL_CONTROLLER_H_
+
+#include <map>
+#include <memory>
+
+#include "pagespeed/controller/central_controller.h"
+#include "pagespeed/controller/expensive_operation_callback.h"
+#include "pagespeed/controller/schedule_rewrite_callback.h"
+#include "pagespeed/controller/shared_mem_controller_ring.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+
+namespace net_instaweb {
+
+// CentralController implementation that forwards all requests to a
+// SharedMemCentralControllerServer through a SharedMemControllerRing, rather
+// than over gRPC as CentralControllerRpcClient does. That saves serializing
+// each request and a round trip through a socket: a request is a few stores
+// into shared memory and, if the controller is asleep, a futex wakeup.
+//
+// Answers are collected by a thread of our own, which hands them to the
+// callbacks much as the gRPC client thread does. The segment has a fixed
+// number of slots shared by all processes, so if the controller stops
+// answering they soon run out, and from then on requests are cancelled
+// immediately. Requests already waiting are answered once the babysitter
+// restarts the controller.
+//
+// Transaction contexts handed to callbacks must not outlive this object.
+class SharedMemCentralController : public CentralController {
+ public:
+  // The segment must have been initialized by the root process, with the
+  // same segment_name and num_slots. If it can't be attached to, every
+  // request will be cancelled.
+  SharedMemCentralController(AbstractSharedMem* shm_runtime,
+                             const GoogleString& segment_name, int num_slots,
+                             ThreadSystem* thread_system,
+                             MessageHandler* handler);
+  ~SharedMemCentralController() override;
+
+  // CentralController implementation.
+  void ScheduleExpensiveOperation(
+      ExpensiveOperationCallback* callback) override;
+  void ScheduleRewrite(ScheduleRewriteCallback* callback) override;
+  void ShutDown() override LOCKS_EXCLUDED(mutex_);
+
+ private:
+  class AnswerThread;
+  class Transaction;
+  class ExpensiveOperationContextImpl;
+  class ScheduleRewriteContextImpl;
+
+  struct Pending {
+    Pending() : callback(nullptr), transaction(nullptr) {}
+    Pending(Function* callback_in, Transaction* transaction_in)
+        : callback(callback_in), transaction(transaction_in) {}
+
+    Function* callback;
+    Transaction* transaction;
+  };
+  typedef std::map<int, Pending> PendingMap;
+
+  // Posts request, calling callback when it's answered. transaction is the
+  // context that will own the slot if the request is granted.
+  void StartRequest(const SharedMemControllerRing::Request& request,
+                    Function* callback, Transaction* transaction)
+      LOCKS_EXCLUDED(mutex_);
+
+  // Hands the answers that have arrived to their callbacks, returning how
+  // many there were, or -1 once we are shut down. Called by AnswerThread.
+  int DeliverAnswers() LOCKS_EXCLUDED(mutex_);
+
+  std::unique_ptr<SharedMemControllerRing> ring_;
+  const int32 pid_;
+  const int channel_;
+  bool attached_;  // Set only by the constructor.
+  std::unique_ptr<AbstractMutex> mutex_;
+  PendingMap pending_ GUARDED_BY(mutex_);
+  bool shut_down_ GUARDED_BY(mutex_);
+  std::unique_ptr<AnswerThread> answer_thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemCentralController);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_CONTROLLER_SHARED_MEM_CENTRAL_CONTROLLER_H_
@@ -0,0 +1,233 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/controller/shared_mem_central_controller_server.h"
+
+#include <errno.h>
+#include <signal.h>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/function.h"
+
+namespace net_instaweb {
+
+namespace {
+
+typedef SharedMemControllerRing Ring;
+
+}  // namespace
+
+const int64 SharedMemCentralControllerServer::kSweepIntervalMs;
+
+SharedMemCentralControllerServer::SharedMemCentralControllerServer(
+    AbstractSharedMem* shm_runtime, const GoogleString& segment_name,
+    int num_slots,
+    ExpensiveOperationController* expensive_operation_controller,
+    ScheduleRewriteController* rewrite_controller,
+    ThreadSystem* thread_system, Timer* timer, MessageHandler* handler)
+    : ring_(new Ring(shm_runtime, segment_name, num_slots)),
+      expensive_operation_controller_(expensive_operation_controller),
+      rewrite_controller_(rewrite_controller),
+      timer_(timer),
+      handler_(handler),
+      mutex_(thread_system->NewMutex()),
+      slots_(num_slots) {
+}
+
+SharedMemCentralControllerServer::~SharedMemCentralControllerServer() {
+}
+
+int SharedMemCentralControllerServer::Setup() {
+  return ring_->Attach(handler_) ? 0 : 1;
+}
+
+int SharedMemCentralControllerServer::Run() {
+  PS_LOG_INFO(handler_,
+              "SharedMemCentralControllerServer processing requests");
+
+  // A previous incarnation may have left requests queued, so start by
+  // looking at every slot.
+  std::vector<int> events;
+  for (int i = 0, n = ring_->num_slots(); i < n; ++i) {
+    events.push_back(i);
+  }
+  int64 next_sweep_ms = timer_->NowMs() + kSweepIntervalMs;
+  while (!stopped_.value()) {
+    uint32 sequence = ring_->ServerSequence();
+    ring_->TakeEvents(&events);
+    for (int i = 0, n = events.size(); i < n; ++i) {
+      HandleEvent(events[i]);
+    }
+    int64 now_ms = timer_->NowMs();
+    if (now_ms >= next_sweep_ms) {
+      SweepDeadOwners();
+      next_sweep_ms = now_ms + kSweepIntervalMs;
+    } else if (events.empty()) {
+      ring_->WaitForServer(sequence, next_sweep_ms - now_ms);
+    }
+    events.clear();
+  }
+
+  // Cancel whatever is waiting for a rewrite, so the workers hear about it.
+  rewrite_controller_->ShutDown();
+  PS_LOG_INFO(handler_, "SharedMemCentralControllerServer terminated");
+  return 0;
+}
+
+void SharedMemCentralControllerServer::Stop() {
+  PS_LOG_INFO(handler_, "Shutting down SharedMemCentralControllerServer.");
+  stopped_.set_value(true);
+  ring_->RingServer();
+}
+
+SharedMemCentralControllerServer::Held SharedMemCentralControllerServer::held(
+    int slot) {
+  ScopedMutex lock(mutex_.get());
+  return slots_[slot].held;
+}
+
+void SharedMemCentralControllerServer::set_held(int slot, Held held) {
+  ScopedMutex lock(mutex_.get());
+  slots_[slot].held = held;
+}
+
+void SharedMemCentralControllerServer::HandleEvent(int slot) {
+  // Events may be stale, so act on the slot's current state. The worker may
+  // change it under us, so retry if it does.
+  while (true) {
+    Ring::Request request;
+    Ring::State state = ring_->GetSlot(slot, &request);
+    switch (state) {
+      case Ring::kRequested:
+        if (!ring_->CompareAndSwapState(slot, Ring::kRequested,
+                                        Ring::kQueued)) {
+          continue;  // Abandoned in the meantime.
+        }
+        Schedule(slot, request);
+        return;
+      case Ring::kQueued:
+        // Queued by a previous incarnation, which we replaced.
+        if (held(slot) == kNotHeld) {
+          Schedule(slot, request);
+        }
+        return;
+      case Ring::kSucceeded:
+      case Ring::kFailed:
+        Release(slot, state == Ring::kSucceeded, state);
+        return;
+      case Ring::kAbandoned:
+        // If it's queued, it's freed when the controller answers.
+        if (held(slot) == kNotHeld) {
+          ring_->FreeSlot(slot, Ring::kAbandoned);
+        }
+        return;
+      case Ring::kFree:
+      case Ring::kClaimed:
+      case Ring::kGranted:
+      case Ring::kDenied:
+      case Ring::kRunning:
+        return;
+    }
+  }
+}
+
+void SharedMemCentralControllerServer::Schedule(int slot,
+                                                const Ring::Request& request) {
+  ExpensiveOperationCost* cost;
+  {
+    ScopedMutex lock(mutex_.get());
+    SlotInfo* info = &slots_[slot];
+    info->held = kHeldQueued;
+    info->kind = request.kind;
+    info->key = request.key;
+    info->cost = ExpensiveOperationCost();
+    info->cost.type = request.key;
+    info->cost.input_bytes = request.input_bytes;
+    cost = &info->cost;
+  }
+  Function* callback = MakeFunction(
+      this, &SharedMemCentralControllerServer::Grant,
+      &SharedMemCentralControllerServer::Deny, slot);
+  if (request.kind == Ring::kExpensiveOperation) {
+    expensive_operation_controller_->ScheduleExpensiveOperationWithCost(
+        cost, callback);
+  } else {
+    rewrite_controller_->ScheduleRewrite(request.key, callback);
+  }
+}
+
+void SharedMemCentralControllerServer::Grant(int slot) {
+  set_held(slot, kHeldGranted);
+  if (!ring_->CompareAndSwapState(slot, Ring::kQueued, Ring::kGranted)) {
+    // The worker gave up waiting, so give it straight back.
+    Release(slot, false, Ring::kAbandoned);
+  }
+}
+
+void SharedMemCentralControllerServer::Deny(int slot) {
+  set_held(slot, kNotHeld);
+  if (!ring_->CompareAndSwapState(slot, Ring::kQueued, Ring::kDenied)) {
+    ring_->FreeSlot(slot, Ring::kAbandoned);
+  }
+}
+
+void SharedMemCentralControllerServer::Release(int slot, bool succeeded,
+                                               Ring::State state) {
+  Held held;
+  Ring::Kind kind;
+  GoogleString key;
+  ExpensiveOperationCost cost;
+  {
+    ScopedMutex lock(mutex_.get());
+    SlotInfo* info = &slots_[slot];
+    held = info->held;
+    kind = info->kind;
+    key = info->key;
+    cost = info->cost;
+    info->held = kNotHeld;
+  }
+  // Otherwise it was granted by a previous incarnation, and there's nothing
+  // to release.
+  if (held == kHeldGranted) {
+    if (kind == Ring::kExpensiveOperation) {
+      ExpensiveOperationController* controller =
+          expensive_operation_controller_.get();
+      controller->NotifyExpensiveOperationCompleteWithCost(cost, succeeded);
+    } else if (succeeded) {
+      rewrite_controller_->NotifyRewriteComplete(key);
+    } else {
+      rewrite_controller_->NotifyRewriteFailed(key);
+    }
+  }
+  ring_->FreeSlot(slot, state);
+}
+
+void SharedMemCentralControllerServer::SweepDeadOwners() {
+  for (int i = 0, n = ring_->num_slots(); i < n; ++i) {
+    Ring::Request request;
+    Ring::State state = ring_->GetSlot(i, &request);
+    if (state != Ring::kFree && request.owner_pid > 0 &&
+        kill(request.owner_pid, 0) != 0 && errno == ESRCH &&
+        ring_->Abandon(i)) {
+      // Abandon posted an event, which we'll pick up next time round.
+      handler_->Message(kWarning,
+                        "Released central controller slot %d of dead "
+                        "process %d", i, static_cast<int>(request.owner_pid));
+    }
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_CONTROLLER_SHARED_MEM_CENTRAL_CONTROLLER_SERVER_H_
+#define PAGESPEED_CONTROLLER_SHARED_MEM_CENTRAL_CONTROLLER_SERVER_H_
+
+#include <memory>
+#include <vector>
+
+#include "pagespeed/controller/expensive_operation_controller.h"
+#include "pagespeed/controller/schedule_rewrite_controller.h"
+#include "pagespeed/controller/shared_mem_controller_ring.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/atomic_bool.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/system/controller_process.h"
+
+namespace net_instaweb {
+
+// ControllerProcess implementation that serves SharedMemCentralController
+// requests from a SharedMemControllerRing, handing them to the same
+// controllers as CentralControllerRpcServer does.
+//
+// Run() sleeps on the ring's doorbell until requests or completions arrive.
+// Every so often it also looks for slots held by processes that have died,
+// and releases them as if they failed, as a broken gRPC connection would.
+class SharedMemCentralControllerServer : public ControllerProcess {
+ public:
+  // How often to look for slots held by dead processes.
+  static const int64 kSweepIntervalMs = 5 * Timer::kSecondMs;
+
+  // The segment must have been initialized by the root process, with the
+  // same segment_name and num_slots. Takes ownership of both controllers.
+  SharedMemCentralControllerServer(
+      AbstractSharedMem* shm_runtime, const GoogleString& segment_name,
+      int num_slots,
+      ExpensiveOperationController* expensive_operation_controller,
+      ScheduleRewriteController* rewrite_controller,
+      ThreadSystem* thread_system, Timer* timer, MessageHandler* handler);
+  ~SharedMemCentralControllerServer() override;
+
+  // ControllerProcess implementation.
+  int Setup() override;
+  int Run() override;
+  void Stop() override;
+
+ private:
+  // What we know of a slot, beyond what's in the ring.
+  enum Held {
+    kNotHeld,
+    kHeldQueued,   // Waiting in one of the controllers.
+    kHeldGranted,  // Granted by one of the controllers, and not released.
+  };
+
+  struct SlotInfo {
+    SlotInfo() : held(kNotHeld), kind(SharedMemControllerRing::kRewrite) {}
+
+    Held held;
+    SharedMemControllerRing::Kind kind;
+    GoogleString key;
+    ExpensiveOperationCost cost;
+  };
+
+  // Acts on the current state of slot.
+  void HandleEvent(int slot);
+  // Passes the request in a kQueued slot to its controller.
+  void Schedule(int slot, const SharedMemControllerRing::Request& request);
+  // Called by the controllers when they grant or deny a request.
+  void Grant(int slot);
+  void Deny(int slot);
+  // Tells the controller that granted slot, if any, that the operation in it
+  // is done, and frees it.
+  void Release(int slot, bool succeeded, SharedMemControllerRing::State state);
+  // Abandons the slots of processes that no longer exist.
+  void SweepDeadOwners();
+
+  Held held(int slot) LOCKS_EXCLUDED(mutex_);
+  void set_held(int slot, Held held) LOCKS_EXCLUDED(mutex_);
+
+  std::unique_ptr<SharedMemControllerRing> ring_;
+  std::unique_ptr<ExpensiveOperationController> expensive_operation_controller_;
+  std::unique_ptr<ScheduleRewriteController> rewrite_controller_;
+  Timer* timer_;
+  MessageHandler* handler_;
+  AtomicBool stopped_;
+
+  // The controllers may call Grant and Deny from within calls we make to
+  // them, so mutex_ is never held while calling them.
+  std::unique_ptr<AbstractMutex> mutex_;
+  std::vector<SlotInfo> slots_ GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemCentralControllerServer);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_CONTROLLER_SHARED_MEM_CENTRAL_CONTROLLER_SERVER_H_
@@ -0,0 +1,407 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/controller/shared_mem_central_controller.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "pagespeed/controller/expensive_operation_callback.h"
+#include "pagespeed/controller/popularity_contest_schedule_rewrite_controller.h"
+#include "pagespeed/controller/queued_expensive_operation_controller.h"
+#include "pagespeed/controller/schedule_rewrite_callback.h"
+#include "pagespeed/controller/shared_mem_central_controller_server.h"
+#include "pagespeed/controller/shared_mem_controller_ring.h"
+#include "pagespeed/kernel/base/condvar.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_message_handler.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/sharedmem/inprocess_shared_mem.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
+#include "pagespeed/kernel/thread/worker_test_base.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kSegmentName[] = "shm_controller_test";
+const int kNumSlots = 16;
+const int kMaxExpensiveOperations = 1;
+const int64 kWaitMs = 10 * Timer::kSecondMs;
+
+// Records what became of a request, for the test thread to wait on.
+class Outcome {
+ public:
+  explicit Outcome(ThreadSystem* thread_system)
+      : mutex_(thread_system->NewMutex()),
+        condvar_(mutex_->NewCondvar()),
+        ran_(false),
+        cancelled_(false) {}
+
+  void Ran(scoped_ptr<ExpensiveOperationContext>* context) {
+    ScopedMutex lock(mutex_.get());
+    expensive_context_.reset(context->release());
+    ran_ = true;
+    condvar_->Signal();
+  }
+
+  void Ran(scoped_ptr<ScheduleRewriteContext>* context) {
+    ScopedMutex lock(mutex_.get());
+    rewrite_context_.reset(context->release());
+    ran_ = true;
+    condvar_->Signal();
+  }
+
+  void Cancelled() {
+    ScopedMutex lock(mutex_.get());
+    cancelled_ = true;
+    condvar_->Signal();
+  }
+
+  // Waits for the request to be answered, and returns whether it ran.
+  bool WaitForAnswer() {
+    ScopedMutex lock(mutex_.get());
+    int64 waited_ms = 0;
+    while (!ran_ && !cancelled_ && waited_ms < kWaitMs) {
+      condvar_->TimedWait(Timer::kSecondMs);
+      waited_ms += Timer::kSecondMs;
+    }
+    EXPECT_TRUE(ran_ || cancelled_) << "No answer";
+    return ran_;
+  }
+
+  bool answered() {
+    ScopedMutex lock(mutex_.get());
+    return ran_ || cancelled_;
+  }
+
+  // Releases whatever the controller granted.
+  void Done() {
+    ScopedMutex lock(mutex_.get());
+    expensive_context_.reset();
+    rewrite_context_.reset();
+  }
+
+  void MarkRewriteFailed() {
+    ScopedMutex lock(mutex_.get());
+    rewrite_context_->MarkFailed();
+    rewrite_context_.reset();
+  }
+
+ private:
+  scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex_;
+  scoped_ptr<ThreadSystem::Condvar> condvar_;
+  bool ran_;
+  bool cancelled_;
+  scoped_ptr<ExpensiveOperationContext> expensive_context_;
+  scoped_ptr<ScheduleRewriteContext> rewrite_context_;
+};
+
+class TestExpensiveOperationCallback : public ExpensiveOperationCallback {
+ public:
+  TestExpensiveOperationCallback(Sequence* sequence, Outcome* outcome)
+      : ExpensiveOperationCallback(sequence), outcome_(outcome) {}
+
+  void RunImpl(scoped_ptr<ExpensiveOperationContext>* context) override {
+    outcome_->Ran(context);
+  }
+
+  void CancelImpl() override {
+    outcome_->Cancelled();
+  }
+
+ private:
+  Outcome* outcome_;
+};
+
+class TestScheduleRewriteCallback : public ScheduleRewriteCallback {
+ public:
+  TestScheduleRewriteCallback(const GoogleString& key, Sequence* sequence,
+                              Outcome* outcome)
+      : ScheduleRewriteCallback(key, sequence), outcome_(outcome) {}
+
+  void RunImpl(scoped_ptr<ScheduleRewriteContext>* context) override {
+    outcome_->Ran(context);
+  }
+
+  void CancelImpl() override {
+    outcome_->Cancelled();
+  }
+
+ private:
+  Outcome* outcome_;
+};
+
+class ServerThread : public ThreadSystem::Thread {
+ public:
+  ServerThread(SharedMemCentralControllerServer* server,
+               ThreadSystem* thread_system)
+      : Thread(thread_system, "shm_server", ThreadSystem::kJoinable),
+        server_(server) {}
+
+  void Run() override {
+    server_->Run();
+  }
+
+ private:
+  SharedMemCentralControllerServer* server_;
+};
+
+// Inheriting from WorkerTestBase for its thread system.
+class SharedMemCentralControllerTest : public WorkerTestBase {
+ public:
+  SharedMemCentralControllerTest()
+      : shm_runtime_(new InProcessSharedMem(thread_runtime_.get())),
+        timer_(thread_runtime_->NewMutex(), MockTimer::kApr_5_2010_ms),
+        stats_(thread_runtime_.get()),
+        handler_(thread_runtime_->NewMutex()),
+        worker_(new QueuedWorkerPool(1, "shm_controller_test",
+                                     thread_runtime_.get())),
+        sequence_(worker_->NewSequence()) {
+    PopularityContestScheduleRewriteController::InitStats(&stats_);
+    QueuedExpensiveOperationController::InitStats(&stats_);
+  }
+
+  void SetUp() override {
+    ring_.reset(new SharedMemControllerRing(shm_runtime_.get(), kSegmentName,
+                                            kNumSlots));
+    ASSERT_TRUE(ring_->Initialize(&handler_));
+    StartServer();
+    controller_.reset(new SharedMemCentralController(
+        shm_runtime_.get(), kSegmentName, kNumSlots, thread_runtime_.get(),
+        &handler_));
+  }
+
+  void TearDown() override {
+    controller_->ShutDown();
+    StopServer();
+    worker_->ShutDown();
+    SharedMemControllerRing::GlobalCleanup(shm_runtime_.get(), kSegmentName,
+                                           &handler_);
+  }
+
+ protected:
+  void StartServer() {
+    server_.reset(new SharedMemCentralControllerServer(
+        shm_runtime_.get(), kSegmentName, kNumSlots,
+        new QueuedExpensiveOperationController(
+            kMaxExpensiveOperations, thread_runtime_.get(), &stats_),
+        new PopularityContestScheduleRewriteController(
+            thread_runtime_.get(), &stats_, &timer_, 10 /* max running */,
+            10 /* max queued */),
+        thread_runtime_.get(), &timer_, &handler_));
+    ASSERT_EQ(0, server_->Setup());
+    server_thread_.reset(new ServerThread(server_.get(),
+                                          thread_runtime_.get()));
+    ASSERT_TRUE(server_thread_->Start());
+  }
+
+  void StopServer() {
+    server_->Stop();
+    server_thread_->Join();
+  }
+
+  void ScheduleExpensiveOperation(Outcome* outcome) {
+    controller_->ScheduleExpensiveOperation(
+        new TestExpensiveOperationCallback(sequence_, outcome));
+  }
+
+  void ScheduleRewrite(const GoogleString& key, Outcome* outcome) {
+    controller_->ScheduleRewrite(
+        new TestScheduleRewriteCallback(key, sequence_, outcome));
+  }
+
+  // Waits for the server to have handled everything posted so far, by
+  // scheduling a rewrite with a fresh key and waiting for it.
+  void Sync() {
+    static int serial = 0;
+    Outcome outcome(thread_runtime_.get());
+    ScheduleRewrite(StrCat("sync", IntegerToString(++serial)), &outcome);
+    EXPECT_TRUE(outcome.WaitForAnswer());
+    outcome.Done();
+  }
+
+  scoped_ptr<InProcessSharedMem> shm_runtime_;
+  MockTimer timer_;
+  SimpleStats stats_;
+  MockMessageHandler handler_;
+  scoped_ptr<QueuedWorkerPool> worker_;
+  Sequence* sequence_;
+  scoped_ptr<SharedMemControllerRing> ring_;
+  std::unique_ptr<SharedMemCentralControllerServer> server_;
+  std::unique_ptr<ServerThread> server_thread_;
+  std::unique_ptr<SharedMemCentralController> controller_;
+};
+
+TEST_F(SharedMemCentralControllerTest, ExpensiveOperationsAreLimited) {
+  Outcome first(thread_runtime_.get());
+  ScheduleExpensiveOperation(&first);
+  EXPECT_TRUE(first.WaitForAnswer());
+
+  Outcome second(thread_runtime_.get());
+  ScheduleExpensiveOperation(&second);
+  Sync();
+  EXPECT_FALSE(second.answered());
+
+  first.Done();
+  EXPECT_TRUE(second.WaitForAnswer());
+  second.Done();
+}
+
+TEST_F(SharedMemCentralControllerTest, RewritesAreExclusive) {
+  Outcome first(thread_runtime_.get());
+  ScheduleRewrite("key", &first);
+  EXPECT_TRUE(first.WaitForAnswer());
+
+  // Already running, so rejected.
+  Outcome second(thread_runtime_.get());
+  ScheduleRewrite("key", &second);
+  EXPECT_FALSE(second.WaitForAnswer());
+
+  // Once it fails, it may be retried.
+  first.MarkRewriteFailed();
+  Outcome third(thread_runtime_.get());
+  ScheduleRewrite("key", &third);
+  EXPECT_TRUE(third.WaitForAnswer());
+  third.Done();
+}
+
+TEST_F(SharedMemCentralControllerTest, LongKeys) {
+  GoogleString long_key(3 * SharedMemControllerRing::kMaxKeySize, 'a');
+  GoogleString other_long_key = long_key + "b";
+  Outcome first(thread_runtime_.get());
+  ScheduleRewrite(long_key, &first);
+  EXPECT_TRUE(first.WaitForAnswer());
+
+  // Same prefix, but a different key.
+  Outcome second(thread_runtime_.get());
+  ScheduleRewrite(other_long_key, &second);
+  EXPECT_TRUE(second.WaitForAnswer());
+
+  Outcome third(thread_runtime_.get());
+  ScheduleRewrite(long_key, &third);
+  EXPECT_FALSE(third.WaitForAnswer());
+
+  first.Done();
+  second.Done();
+}
+
+TEST_F(SharedMemCentralControllerTest, CancelledWhenSlotsRunOut) {
+  Outcome running(thread_runtime_.get());
+  ScheduleExpensiveOperation(&running);
+  EXPECT_TRUE(running.WaitForAnswer());
+
+  // Fill every remaining slot with an operation waiting for the first.
+  std::vector<Outcome*> waiting;
+  for (int i = 1; i < kNumSlots; ++i) {
+    waiting.push_back(new Outcome(thread_runtime_.get()));
+    ScheduleExpensiveOperation(waiting.back());
+  }
+  Outcome overflow(thread_runtime_.get());
+  ScheduleExpensiveOperation(&overflow);
+  EXPECT_FALSE(overflow.WaitForAnswer());
+
+  // Each runs in turn.
+  running.Done();
+  for (int i = 0, n = waiting.size(); i < n; ++i) {
+    EXPECT_TRUE(waiting[i]->WaitForAnswer());
+    waiting[i]->Done();
+    delete waiting[i];
+  }
+}
+
+TEST_F(SharedMemCentralControllerTest, ShutDownCancelsWaiting) {
+  Outcome running(thread_runtime_.get());
+  ScheduleExpensiveOperation(&running);
+  EXPECT_TRUE(running.WaitForAnswer());
+  Outcome waiting(thread_runtime_.get());
+  ScheduleExpensiveOperation(&waiting);
+
+  controller_->ShutDown();
+  EXPECT_FALSE(waiting.WaitForAnswer());
+  Outcome late(thread_runtime_.get());
+  ScheduleExpensiveOperation(&late);
+  EXPECT_FALSE(late.WaitForAnswer());
+
+  // The abandoned request must not tie up the controller: a new client gets
+  // the operation as soon as the running one is done.
+  running.Done();
+  controller_.reset(new SharedMemCentralController(
+      shm_runtime_.get(), kSegmentName, kNumSlots, thread_runtime_.get(),
+      &handler_));
+  Outcome next(thread_runtime_.get());
+  ScheduleExpensiveOperation(&next);
+  EXPECT_TRUE(next.WaitForAnswer());
+  next.Done();
+}
+
+TEST_F(SharedMemCentralControllerTest, RequestsSurviveServerRestart) {
+  StopServer();
+  Outcome outcome(thread_runtime_.get());
+  ScheduleExpensiveOperation(&outcome);
+  EXPECT_FALSE(outcome.answered());
+
+  StartServer();
+  EXPECT_TRUE(outcome.WaitForAnswer());
+  outcome.Done();
+}
+
+TEST_F(SharedMemCentralControllerTest, DeadProcessesAreReleased) {
+  // Find a pid that is no longer in use.
+  pid_t dead_pid = fork();
+  if (dead_pid == 0) {
+    _exit(0);
+  }
+  ASSERT_GT(dead_pid, 0);
+  ASSERT_EQ(dead_pid, waitpid(dead_pid, NULL, 0));
+
+  // Ask for the only expensive operation on its behalf.
+  SharedMemControllerRing::Request request;
+  request.owner_pid = dead_pid;
+  int slot = ring_->ClaimSlot(request, 0);
+  ASSERT_LE(0, slot);
+  ring_->PostRequest(slot);
+  Sync();
+
+  Outcome outcome(thread_runtime_.get());
+  ScheduleExpensiveOperation(&outcome);
+  Sync();
+  EXPECT_FALSE(outcome.answered());
+
+  // Once the server notices, the operation is released.
+  timer_.AdvanceMs(SharedMemCentralControllerServer::kSweepIntervalMs);
+  ring_->RingServer();
+  EXPECT_TRUE(outcome.WaitForAnswer());
+  outcome.Done();
+  Sync();
+  // The slot was freed, though it may have been reused since.
+  ring_->GetSlot(slot, &request);
+  EXPECT_NE(dead_pid, request.owner_pid);
+}
+
+}  // namespace
+
+}  // namespace net_instaweb
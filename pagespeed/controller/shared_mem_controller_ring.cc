@@ -0,0 +1,465 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/controller/shared_mem_controller_ring.h"
+
+#ifdef linux
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <time.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstddef>
+#include <cstring>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/atomicops.h"
+#include "pagespeed/kernel/base/md5_hasher.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/timer.h"
+
+namespace net_instaweb {
+
+using base::subtle::Atomic32;
+
+namespace SharedMemControllerRingData {
+
+// Memory structure:
+//
+// Mutex
+// (pad to 64-byte alignment)
+// RingHeader
+// Events: (kEventsPerSlot * num_slots) slot numbers, read from event_head to
+//         event_tail, wrapping around.
+// (pad to 64-byte alignment)
+// Slot 0
+// ...
+// Slot num_slots - 1
+//
+// Each slot is posted to the controller at most twice per use, once when
+// requested and once when finished or abandoned, but stale events may linger
+// after a slot is reused, so the ring may still fill up. If it does, further
+// events are dropped and events_overflowed is set, which makes the controller
+// look at every slot instead.
+
+const int kEventsPerSlot = 4;
+
+struct Doorbell {
+  Atomic32 sequence;  // Futex word; incremented by every ring.
+  Atomic32 waiters;
+};
+
+struct RingHeader {
+  int32 num_slots;
+  int32 free_head;  // -1 if no slot is free.
+  uint32 event_head;
+  uint32 event_tail;
+  int32 events_overflowed;
+  Doorbell server;
+  Doorbell channels[SharedMemControllerRing::kNumChannels];
+};
+
+struct Slot {
+  int32 state;
+  int32 kind;
+  int32 next_free;
+  int32 owner_pid;
+  int32 channel;
+  int32 key_size;
+  int64 input_bytes;
+  char key[SharedMemControllerRing::kMaxKeySize];
+};
+
+inline size_t Align64(size_t in) {
+  return (in + 63) & ~63;
+}
+
+}  // namespace SharedMemControllerRingData
+
+namespace Data = SharedMemControllerRingData;
+
+namespace {
+
+size_t HeaderOffset(size_t mutex_size) {
+  return Data::Align64(mutex_size);
+}
+
+size_t EventsOffset(size_t mutex_size) {
+  return HeaderOffset(mutex_size) + sizeof(Data::RingHeader);
+}
+
+size_t SlotsOffset(size_t mutex_size, int num_slots) {
+  return Data::Align64(EventsOffset(mutex_size) +
+                       Data::kEventsPerSlot * num_slots * sizeof(int32));
+}
+
+#ifdef linux
+
+void FutexWait(volatile Atomic32* word, Atomic32 expected, int64 timeout_ms) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / Timer::kSecondMs;
+  timeout.tv_nsec = (timeout_ms % Timer::kSecondMs) * Timer::kMsUs * 1000;
+  // Not FUTEX_PRIVATE_FLAG, since the word is shared between processes.
+  syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+void FutexWakeAll(volatile Atomic32* word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+// Without futexes, waiters poll.
+const int64 kPollIntervalUs = 1000;
+
+void FutexWait(volatile Atomic32* word, Atomic32 expected, int64 timeout_ms) {
+  int64 timeout_us = timeout_ms * Timer::kMsUs;
+  for (int64 waited_us = 0;
+       waited_us < timeout_us &&
+           base::subtle::Acquire_Load(word) == expected;
+       waited_us += kPollIntervalUs) {
+    usleep(kPollIntervalUs);
+  }
+}
+
+void FutexWakeAll(volatile Atomic32* word) {
+}
+
+#endif
+
+}  // namespace
+
+const int SharedMemControllerRing::kDefaultNumSlots;
+const int SharedMemControllerRing::kMaxKeySize;
+const int SharedMemControllerRing::kNumChannels;
+
+SharedMemControllerRing::SharedMemControllerRing(
+    AbstractSharedMem* shm_runtime, const GoogleString& segment_name,
+    int num_slots)
+    : shm_runtime_(shm_runtime),
+      segment_name_(segment_name),
+      num_slots_(num_slots),
+      header_(NULL),
+      events_(NULL),
+      slots_(NULL) {
+  CHECK_GT(num_slots_, 0);
+}
+
+SharedMemControllerRing::~SharedMemControllerRing() {
+}
+
+size_t SharedMemControllerRing::SegmentSize() const {
+  return SlotsOffset(shm_runtime_->SharedMutexSize(), num_slots_) +
+         num_slots_ * sizeof(Data::Slot);
+}
+
+bool SharedMemControllerRing::InitializeLayout() {
+  size_t mutex_size = shm_runtime_->SharedMutexSize();
+  char* base = const_cast<char*>(segment_->Base());
+  header_ = reinterpret_cast<Data::RingHeader*>(base +
+                                                HeaderOffset(mutex_size));
+  events_ = reinterpret_cast<int32*>(base + EventsOffset(mutex_size));
+  slots_ = base + SlotsOffset(mutex_size, num_slots_);
+  mutex_.reset(segment_->AttachToSharedMutex(0));
+  return mutex_.get() != NULL;
+}
+
+Data::Slot* SharedMemControllerRing::slot(int index) {
+  DCHECK_GE(index, 0);
+  DCHECK_LT(index, num_slots_);
+  return reinterpret_cast<Data::Slot*>(slots_) + index;
+}
+
+bool SharedMemControllerRing::Initialize(MessageHandler* handler) {
+  segment_.reset(
+      shm_runtime_->CreateSegment(segment_name_, SegmentSize(), handler));
+  if (segment_.get() == NULL) {
+    handler->Message(kError,
+                     "Unable to create central controller SHM segment %s",
+                     segment_name_.c_str());
+    return false;
+  }
+  if (!segment_->InitializeSharedMutex(0, handler) || !InitializeLayout()) {
+    handler->Message(kError,
+                     "Unable to create central controller SHM mutex");
+    segment_.reset(NULL);
+    shm_runtime_->DestroySegment(segment_name_, handler);
+    return false;
+  }
+
+  // The segment is zeroed, so all slots are kFree already, and only the
+  // free list needs building.
+  header_->num_slots = num_slots_;
+  header_->free_head = -1;
+  for (int i = num_slots_ - 1; i >= 0; --i) {
+    PushFree(i);
+  }
+  return true;
+}
+
+bool SharedMemControllerRing::Attach(MessageHandler* handler) {
+  segment_.reset(
+      shm_runtime_->AttachToSegment(segment_name_, SegmentSize(), handler));
+  if (segment_.get() == NULL) {
+    handler->Message(kWarning,
+                     "Unable to attach to central controller SHM segment %s",
+                     segment_name_.c_str());
+    return false;
+  }
+  if (!InitializeLayout() || header_->num_slots != num_slots_) {
+    handler->Message(kWarning,
+                     "Central controller SHM segment %s is not as expected",
+                     segment_name_.c_str());
+    segment_.reset(NULL);
+    return false;
+  }
+  return true;
+}
+
+void SharedMemControllerRing::GlobalCleanup(AbstractSharedMem* shm_runtime,
+                                            const GoogleString& segment_name,
+                                            MessageHandler* handler) {
+  shm_runtime->DestroySegment(segment_name, handler);
+}
+
+void SharedMemControllerRing::PushEvent(int slot) {
+  uint32 capacity = Data::kEventsPerSlot * num_slots_;
+  if (header_->event_tail - header_->event_head >= capacity) {
+    header_->events_overflowed = 1;
+    return;
+  }
+  events_[header_->event_tail % capacity] = slot;
+  ++header_->event_tail;
+}
+
+void SharedMemControllerRing::PushFree(int index) {
+  Data::Slot* s = slot(index);
+  s->state = kFree;
+  s->owner_pid = 0;
+  s->next_free = header_->free_head;
+  header_->free_head = index;
+}
+
+int SharedMemControllerRing::ClaimSlot(const Request& request, int channel) {
+  // Hash outside the lock.
+  GoogleString hashed_key;
+  StringPiece key(request.key);
+  if (key.size() > static_cast<size_t>(kMaxKeySize)) {
+    MD5Hasher hasher(kMaxKeySize);
+    hashed_key = hasher.Hash(key);
+    key = hashed_key;
+  }
+
+  ScopedMutex lock(mutex_.get());
+  int index = header_->free_head;
+  if (index < 0) {
+    return -1;
+  }
+  Data::Slot* s = slot(index);
+  DCHECK_EQ(kFree, s->state);
+  header_->free_head = s->next_free;
+  s->state = kClaimed;
+  s->kind = request.kind;
+  s->next_free = -1;
+  s->owner_pid = request.owner_pid;
+  s->channel = channel % kNumChannels;
+  s->input_bytes = request.input_bytes;
+  s->key_size = key.size();
+  memcpy(s->key, key.data(), key.size());
+  return index;
+}
+
+void SharedMemControllerRing::PostRequest(int index) {
+  {
+    ScopedMutex lock(mutex_.get());
+    Data::Slot* s = slot(index);
+    DCHECK_EQ(kClaimed, s->state);
+    s->state = kRequested;
+    PushEvent(index);
+  }
+  RingServer();
+}
+
+void SharedMemControllerRing::ReleaseClaim(int index) {
+  ScopedMutex lock(mutex_.get());
+  DCHECK_EQ(kClaimed, slot(index)->state);
+  PushFree(index);
+}
+
+void SharedMemControllerRing::TakeAnswers(const std::vector<int>& slots,
+                                          std::vector<State>* states) {
+  states->resize(slots.size());
+  ScopedMutex lock(mutex_.get());
+  for (int i = 0, n = slots.size(); i < n; ++i) {
+    Data::Slot* s = slot(slots[i]);
+    State state = static_cast<State>(s->state);
+    if (state == kGranted) {
+      s->state = kRunning;
+    } else if (state == kDenied) {
+      PushFree(slots[i]);
+    }
+    (*states)[i] = state;
+  }
+}
+
+void SharedMemControllerRing::Finish(int index, bool succeeded) {
+  {
+    ScopedMutex lock(mutex_.get());
+    Data::Slot* s = slot(index);
+    DCHECK_EQ(kRunning, s->state);
+    s->state = succeeded ? kSucceeded : kFailed;
+    PushEvent(index);
+  }
+  RingServer();
+}
+
+bool SharedMemControllerRing::Abandon(int index) {
+  {
+    ScopedMutex lock(mutex_.get());
+    Data::Slot* s = slot(index);
+    switch (static_cast<State>(s->state)) {
+      case kClaimed:
+      case kDenied:
+        PushFree(index);
+        return true;
+      case kRequested:
+      case kQueued:
+        s->state = kAbandoned;
+        break;
+      case kGranted:
+      case kRunning:
+        s->state = kFailed;
+        break;
+      case kFree:
+      case kSucceeded:
+      case kFailed:
+      case kAbandoned:
+        return false;
+    }
+    PushEvent(index);
+  }
+  RingServer();
+  return true;
+}
+
+void SharedMemControllerRing::TakeEvents(std::vector<int>* slots) {
+  ScopedMutex lock(mutex_.get());
+  if (header_->events_overflowed) {
+    header_->events_overflowed = 0;
+    header_->event_head = header_->event_tail;
+    for (int i = 0; i < num_slots_; ++i) {
+      slots->push_back(i);
+    }
+    return;
+  }
+  uint32 capacity = Data::kEventsPerSlot * num_slots_;
+  for (; header_->event_head != header_->event_tail; ++header_->event_head) {
+    slots->push_back(events_[header_->event_head % capacity]);
+  }
+}
+
+SharedMemControllerRing::State SharedMemControllerRing::GetSlot(
+    int index, Request* request) {
+  ScopedMutex lock(mutex_.get());
+  Data::Slot* s = slot(index);
+  if (request != NULL) {
+    request->kind = static_cast<Kind>(s->kind);
+    request->key.assign(s->key, s->key_size);
+    request->input_bytes = s->input_bytes;
+    request->owner_pid = s->owner_pid;
+  }
+  return static_cast<State>(s->state);
+}
+
+bool SharedMemControllerRing::CompareAndSwapState(int index, State expected,
+                                                  State desired) {
+  int channel;
+  {
+    ScopedMutex lock(mutex_.get());
+    Data::Slot* s = slot(index);
+    if (s->state != expected) {
+      return false;
+    }
+    s->state = desired;
+    channel = s->channel;
+  }
+  if (desired == kGranted || desired == kDenied) {
+    RingChannel(channel);
+  }
+  return true;
+}
+
+bool SharedMemControllerRing::FreeSlot(int index, State expected) {
+  ScopedMutex lock(mutex_.get());
+  if (slot(index)->state != expected) {
+    return false;
+  }
+  PushFree(index);
+  return true;
+}
+
+uint32 SharedMemControllerRing::Sequence(Data::Doorbell* doorbell) {
+  return base::subtle::Acquire_Load(&doorbell->sequence);
+}
+
+void SharedMemControllerRing::Wait(Data::Doorbell* doorbell, uint32 sequence,
+                                   int64 timeout_ms) {
+  // Register as a waiter before the final check, so that a ring after it
+  // sees us and issues a wakeup.
+  base::subtle::Barrier_AtomicIncrement(&doorbell->waiters, 1);
+  if (Sequence(doorbell) == sequence) {
+    FutexWait(&doorbell->sequence, sequence, timeout_ms);
+  }
+  base::subtle::Barrier_AtomicIncrement(&doorbell->waiters, -1);
+}
+
+void SharedMemControllerRing::Ring(Data::Doorbell* doorbell) {
+  base::subtle::Barrier_AtomicIncrement(&doorbell->sequence, 1);
+  // Only pay for the system call if someone is asleep.
+  if (base::subtle::Acquire_Load(&doorbell->waiters) > 0) {
+    FutexWakeAll(&doorbell->sequence);
+  }
+}
+
+uint32 SharedMemControllerRing::ServerSequence() {
+  return Sequence(&header_->server);
+}
+
+void SharedMemControllerRing::WaitForServer(uint32 sequence,
+                                            int64 timeout_ms) {
+  Wait(&header_->server, sequence, timeout_ms);
+}
+
+void SharedMemControllerRing::RingServer() {
+  Ring(&header_->server);
+}
+
+uint32 SharedMemControllerRing::ChannelSequence(int channel) {
+  return Sequence(&header_->channels[channel % kNumChannels]);
+}
+
+void SharedMemControllerRing::WaitForChannel(int channel, uint32 sequence,
+                                             int64 timeout_ms) {
+  Wait(&header_->channels[channel % kNumChannels], sequence, timeout_ms);
+}
+
+void SharedMemControllerRing::RingChannel(int channel) {
+  Ring(&header_->channels[channel % kNumChannels]);
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,214 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_CONTROLLER_SHARED_MEM_CONTROLLER_RING_H_
+#define PAGESPEED_CONTROLLER_SHARED_MEM_CONTROLLER_RING_H_
+
+#include <vector>
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+class MessageHandler;
+
+namespace SharedMemControllerRingData {
+
+struct Doorbell;
+struct RingHeader;
+struct Slot;
+
+}  // namespace SharedMemControllerRingData
+
+// The shared memory segment through which SharedMemCentralController talks to
+// SharedMemCentralControllerServer, in place of gRPC.
+//
+// The segment holds a fixed number of slots, each carrying one request from
+// a worker to the controller and its answer back. A worker claims a free
+// slot, writes the request into it and posts it; the controller grants or
+// denies it by changing the slot's state; and once a granted operation is
+// done the worker marks the slot finished, so the controller can release
+// whatever it held and free the slot. Posts and completions are announced to
+// the controller through a ring of slot numbers, so it needn't scan every
+// slot. Each side sleeps on a futex "doorbell" which the other side rings
+// after changing something; workers' doorbells are shared between processes
+// by channel, so a wakeup may find nothing to do.
+//
+// All slot states and the ring are guarded by a mutex in the segment.
+// Nothing in a slot is trusted to survive a crash of either side: the
+// controller frees the slots of workers that have died, and a restarted
+// controller picks up requests that its predecessor had queued.
+//
+// Like the other shared memory users, Initialize() must be called in the
+// root process and Attach() in the others.
+class SharedMemControllerRing {
+ public:
+  // The life of a slot. The worker moves it from kFree to kClaimed to
+  // kRequested, the controller on to kQueued and then kGranted or kDenied.
+  // A denied slot is freed by the worker. A granted one is moved to
+  // kRunning by the worker, and then to kSucceeded or kFailed once done, at
+  // which point the controller frees it. A worker that gives up on a
+  // request before it's answered moves it to kAbandoned, for the controller
+  // to clean up.
+  enum State {
+    kFree = 0,
+    kClaimed,
+    kRequested,
+    kQueued,
+    kGranted,
+    kDenied,
+    kRunning,
+    kSucceeded,
+    kFailed,
+    kAbandoned,
+  };
+
+  enum Kind {
+    kExpensiveOperation = 0,
+    kRewrite,
+  };
+
+  // What a worker asked for; see ClaimSlot.
+  struct Request {
+    Request() : kind(kExpensiveOperation), input_bytes(0), owner_pid(0) {}
+
+    Kind kind;
+    GoogleString key;
+    int64 input_bytes;
+    int32 owner_pid;
+  };
+
+  static const int kDefaultNumSlots = 4096;
+
+  // Keys longer than this are replaced by their hash.
+  static const int kMaxKeySize = 240;
+
+  // Number of doorbells shared by the workers.
+  static const int kNumChannels = 64;
+
+  SharedMemControllerRing(AbstractSharedMem* shm_runtime,
+                          const GoogleString& segment_name,
+                          int num_slots);
+  ~SharedMemControllerRing();
+
+  // Creates the segment. Call in the root process. Returns whether
+  // successful.
+  bool Initialize(MessageHandler* handler);
+
+  // Attaches to the segment created by Initialize. Returns whether
+  // successful.
+  bool Attach(MessageHandler* handler);
+
+  // Removes the segment. Call in the root process as it exits.
+  static void GlobalCleanup(AbstractSharedMem* shm_runtime,
+                            const GoogleString& segment_name,
+                            MessageHandler* handler);
+
+  int num_slots() const { return num_slots_; }
+
+  // Worker side.
+
+  // Claims a free slot for request, whose answer will be announced on
+  // channel. Returns the slot, in state kClaimed, or -1 if none is free.
+  int ClaimSlot(const Request& request, int channel);
+
+  // Hands a slot from ClaimSlot to the controller.
+  void PostRequest(int slot);
+
+  // Returns a slot from ClaimSlot without posting it.
+  void ReleaseClaim(int slot);
+
+  // Takes the controller's answers to the requests in slots, setting
+  // (*states)[i] to the state of slots[i]: a granted slot is moved to
+  // kRunning and reported as kGranted, and a denied one is freed and reported
+  // as kDenied. Slots not yet answered are left alone.
+  void TakeAnswers(const std::vector<int>& slots, std::vector<State>* states);
+
+  // Marks the operation in a kRunning slot done, for the controller to
+  // release.
+  void Finish(int slot, bool succeeded);
+
+  // Gives up on slot, whatever its state; the controller will release
+  // anything it granted, and free the slot. Returns false if the slot was
+  // already free or given up on.
+  bool Abandon(int slot);
+
+  // Controller side.
+
+  // Appends the slots that have been posted to, finished or abandoned since
+  // the last call to slots, possibly with duplicates and stale entries. The
+  // caller should act on the slots' current states.
+  void TakeEvents(std::vector<int>* slots);
+
+  // Returns the state of slot, and, if request is non-NULL, the request in
+  // it.
+  State GetSlot(int slot, Request* request);
+
+  // Atomically changes slot's state from expected to desired, returning
+  // whether it did. Rings the slot's channel when desired is kGranted or
+  // kDenied.
+  bool CompareAndSwapState(int slot, State expected, State desired);
+
+  // Frees a slot the controller is done with, if it's in state expected.
+  bool FreeSlot(int slot, State expected);
+
+  // Doorbells. The sequence number changes every time the doorbell is rung,
+  // so a waiter takes it, checks for work, and waits if there's none; it
+  // will not sleep through a ring that happened after taking the sequence.
+  uint32 ServerSequence();
+  void WaitForServer(uint32 sequence, int64 timeout_ms);
+  void RingServer();
+  uint32 ChannelSequence(int channel);
+  void WaitForChannel(int channel, uint32 sequence, int64 timeout_ms);
+  void RingChannel(int channel);
+
+ private:
+  size_t SegmentSize() const;
+  bool InitializeLayout();
+  SharedMemControllerRingData::Slot* slot(int index);
+
+  // Queues an event for the controller. Requires mutex_.
+  void PushEvent(int slot);
+  // Puts slot on the free list. Requires mutex_.
+  void PushFree(int slot);
+
+  static uint32 Sequence(SharedMemControllerRingData::Doorbell* doorbell);
+  static void Wait(SharedMemControllerRingData::Doorbell* doorbell,
+                   uint32 sequence, int64 timeout_ms);
+  static void Ring(SharedMemControllerRingData::Doorbell* doorbell);
+
+  AbstractSharedMem* shm_runtime_;
+  const GoogleString segment_name_;
+  const int num_slots_;
+  scoped_ptr<AbstractSharedMemSegment> segment_;
+  scoped_ptr<AbstractMutex> mutex_;
+
+  // Pointers into segment_.
+  SharedMemControllerRingData::RingHeader* header_;
+  int32* events_;
+  char* slots_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemControllerRing);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_CONTROLLER_SHARED_MEM_CONTROLLER_RING_H_
@@ -157,6 +157,7 @@
         'kernel/base/gtest.cc',
         'kernel/base/message_handler_test_base.cc',
         'kernel/cache/cache_spammer.cc',
+        'kernel/cache/synthetic_cache_trace.cc',
         'kernel/http/user_agent_matcher_test_base.cc',
         'kernel/sharedmem/shared_circular_buffer_test_base.cc',
         'kernel/sharedmem/shared_dynamic_string_map_test_base.cc',
@@ -165,6 +166,7 @@
         'kernel/sharedmem/shared_mem_lock_manager_test_base.cc',
         'kernel/sharedmem/shared_mem_statistics_test_base.cc',
         'kernel/sharedmem/shared_mem_test_base.cc',
+        'kernel/sharedmem/slab_shared_mem_cache_test_base.cc',
         'kernel/thread/thread_system_test_base.cc',
         'kernel/thread/worker_test_base.cc',
         'kernel/util/lock_manager_spammer.cc',
@@ -192,21 +194,32 @@
       'sources': [
         'kernel/cache/async_cache.cc',
         'kernel/cache/cache_batcher.cc',
+        'kernel/cache/cache_codec.cc',
+        'kernel/cache/cache_dictionary_builder.cc',
+        'kernel/cache/cache_key_prepender.cc',
         'kernel/cache/cache_stats.cc',
         'kernel/cache/compressed_cache.cc',
         'kernel/cache/delegating_cache_callback.cc',
         'kernel/cache/fallback_cache.cc',
         'kernel/cache/file_cache.cc',
+        'kernel/cache/frequency_admission_policy.cc',
+        'kernel/cache/frequency_sketch.cc',
+        'kernel/cache/hot_key_replica.cc',
         'kernel/cache/in_memory_cache.cc',
         'kernel/cache/key_value_codec.cc',
         'kernel/cache/lru_cache.cc',
         'kernel/cache/purge_context.cc',
         'kernel/cache/purge_set.cc',
+        'kernel/cache/segment_file_cache.cc',
+        'kernel/cache/sharded_lru_cache.cc',
         'kernel/cache/threadsafe_cache.cc',
+        'kernel/cache/tiered_metadata_cache.cc',
         'kernel/cache/write_through_cache.cc',
        ],
       'dependencies': [
+        'brotli',
         'pagespeed_base',
+        'util',
         '<(DEPTH)/third_party/rdestl/rdestl.gyp:rdestl',
       ],
       'include_dirs': [
@@ -609,10 +622,13 @@
         'kernel/sharedmem/shared_mem_cache_data.cc',
         'kernel/sharedmem/shared_mem_lock_manager.cc',
         'kernel/sharedmem/shared_mem_statistics.cc',
+        'kernel/sharedmem/slab_shared_mem_cache.cc',
       ],
       'dependencies': [
         'pagespeed_base',
+        'pagespeed_cache',
         'pagespeed_sharedmem_pb',
+        '<(DEPTH)/third_party/zlib/zlib.gyp:zlib',
       ],
       'include_dirs': [
         '<(DEPTH)',
@@ -632,6 +648,7 @@
         'kernel/thread/sequence.cc',
         'kernel/thread/slow_worker.cc',
         'kernel/thread/thread_synchronizer.cc',
+        'kernel/thread/timer_wheel.cc',
         'kernel/thread/worker.cc',
       ],
       'dependencies': [
@@ -105,6 +105,10 @@ class FileSystem {
     virtual bool ReadFile(GoogleString* buf, int64 max_file_size,
                           MessageHandler* handler) = 0;
 
+    // Positions the file so that the next Read starts at the given byte
+    // offset from the beginning of the file.  Returns false on error.
+    virtual bool Seek(int64 offset, MessageHandler* handler) = 0;
+
    protected:
     friend class FileSystem;
     virtual ~InputFile();
@@ -148,6 +148,26 @@ void FileSystemTest::TestAppend() {
   CheckRead(filename, "Hello world!");
 }
 
+// Write a file, then read parts of it out of order.
+void FileSystemTest::TestSeek() {
+  GoogleString filename = WriteNewFile("/seek.txt", "Hello, world!");
+  FileSystem::InputFile* ifile =
+      file_system()->OpenInputFile(filename.c_str(), &handler_);
+  ASSERT_TRUE(ifile != nullptr);
+  char buf[5];
+  ASSERT_TRUE(ifile->Seek(7, &handler_));
+  ASSERT_EQ(5, ifile->Read(buf, sizeof(buf), &handler_));
+  EXPECT_EQ("world", StringPiece(buf, sizeof(buf)));
+  ASSERT_TRUE(ifile->Seek(0, &handler_));
+  ASSERT_EQ(5, ifile->Read(buf, sizeof(buf), &handler_));
+  EXPECT_EQ("Hello", StringPiece(buf, sizeof(buf)));
+
+  // Reads past the end of the file come up short.
+  ASSERT_TRUE(ifile->Seek(10, &handler_));
+  EXPECT_EQ(3, ifile->Read(buf, sizeof(buf), &handler_));
+  EXPECT_TRUE(file_system()->Close(ifile, &handler_));
+}
+
 // Write a temp file, rename it, then read it.
 void FileSystemTest::TestRename() {
   GoogleString from_text = "Now is time time";
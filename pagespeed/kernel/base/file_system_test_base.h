@@ -93,6 +93,7 @@ class FileSystemTest : public testing::Test {
   void TestWriteRead();
   void TestTemp();
   void TestAppend();
+  void TestSeek();
   void TestRename();
   void TestRemove();
   void TestExists();
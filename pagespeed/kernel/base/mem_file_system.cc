@@ -69,6 +69,14 @@ class MemInputFile : public FileSystem::InputFile {
     return true;
   }
 
+  bool Seek(int64 offset, MessageHandler* message_handler) override {
+    if (offset < 0 || offset > static_cast<int64>(contents_.length())) {
+      return false;
+    }
+    offset_ = offset;
+    return true;
+  }
+
  private:
   const GoogleString contents_;
   const GoogleString filename_;
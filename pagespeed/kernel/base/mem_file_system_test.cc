@@ -81,6 +81,11 @@ TEST_F(MemFileSystemTest, TestAppend) {
   TestAppend();
 }
 
+// Write a file, then read parts of it out of order.
+TEST_F(MemFileSystemTest, TestSeek) {
+  TestSeek();
+}
+
 // Write a temp file, rename it, then read it.
 TEST_F(MemFileSystemTest, TestRename) {
   TestRename();
@@ -148,6 +148,18 @@ class StdioInputFile : public FileSystem::InputFile {
     return ret;
   }
 
+  bool Seek(int64 offset, MessageHandler* message_handler) override {
+#ifdef WIN32
+    bool ret = (_fseeki64(file_helper_.file_, offset, SEEK_SET) == 0);
+#else
+    bool ret = (fseeko(file_helper_.file_, offset, SEEK_SET) == 0);
+#endif  // WIN32
+    if (!ret) {
+      file_helper_.ReportError(message_handler, "seeking in file");
+    }
+    return ret;
+  }
+
   bool Close(MessageHandler* message_handler) override {
     return file_helper_.Close(message_handler);
   }
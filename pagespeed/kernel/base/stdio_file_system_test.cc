@@ -121,6 +121,11 @@ TEST_F(StdioFileSystemTest, TestAppend) {
   TestAppend();
 }
 
+// Write a file, then read parts of it out of order.
+TEST_F(StdioFileSystemTest, TestSeek) {
+  TestSeek();
+}
+
 // Write a temp file, rename it, then read it.
 TEST_F(StdioFileSystemTest, TestRename) {
   TestRename();
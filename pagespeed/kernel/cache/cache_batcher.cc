@@ -18,51 +18,69 @@
 
 #include "pagespeed/kernel/cache/cache_batcher.h"
 
+#include <algorithm>
 #include <utility>
 
 #include "base/logging.h"
 #include "pagespeed/kernel/base/abstract_mutex.h"
 #include "pagespeed/kernel/base/atomic_int32.h"
+#include "pagespeed/kernel/base/function.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/statistics.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/kernel/thread/scheduler.h"
 
 namespace {
 
 const char kDroppedGets[] = "cache_batcher_dropped_gets";
 const char kCoalescedGets[] = "cache_batcher_coalesced_gets";
 const char kQueuedGets[] = "cache_batcher_queued_gets";
+const char kExpiredGets[] = "cache_batcher_expired_gets";
+const char kBatchSizeHistogram[] = "cache_batcher_batch_size";
+const char kLookupLatencyUsHistogram[] = "cache_batcher_lookup_latency_us";
+
+const int kLookupLatencyUsHistogramMaxValue = 500 * 1000;
 
 }  // namespace
 
 namespace net_instaweb {
 
+const int CacheBatcher::kDefaultMaxAdaptiveParallelLookups;
+const int64 CacheBatcher::kDefaultTargetLatencyUs;
+const int CacheBatcher::kLatencyWindow;
+const int CacheBatcher::kMinAdaptiveBatchSize;
+const int CacheBatcher::kBatchSizeIncrement;
+
 // Used to track the progress of a MultiGet, so that we can keep track
 // of how many lookups are outstanding, where a MultiGet counts as one
 // lookup independent of how many keys it has.
 class CacheBatcher::Group {
  public:
-  Group(CacheBatcher* batcher, int group_size)
+  Group(CacheBatcher* batcher, int group_size, int64 start_us)
       : batcher_(batcher),
+        group_size_(group_size),
+        start_us_(start_us),
         outstanding_lookups_(group_size) {
   }
 
   void Done() {
     if (outstanding_lookups_.BarrierIncrement(-1) == 0) {
-      batcher_->GroupComplete();
+      batcher_->GroupComplete(start_us_, group_size_);
       delete this;
     }
   }
 
  private:
   CacheBatcher* batcher_;
+  int group_size_;
+  int64 start_us_;
   AtomicInt32 outstanding_lookups_;
 
   DISALLOW_COPY_AND_ASSIGN(Group);
 };
-
 class CacheBatcher::MultiCallback : public CacheInterface::Callback {
  public:
   MultiCallback(CacheBatcher* batcher, Group* group)
@@ -76,9 +94,10 @@ class CacheBatcher::MultiCallback : public CacheInterface::Callback {
   bool ValidateCandidate(
       const GoogleString& key, CacheInterface::KeyState state) override {
     if (saved_.empty()) {
+      // If the Gets waiting on us expired, there is nobody left to report
+      // to.
       std::vector<CacheInterface::Callback*> callbacks;
-      batcher_->ExtractInFlightKeys(key, &callbacks);
-      DCHECK(!callbacks.empty());
+      batcher_->ExtractInFlightKeys(key, this, &callbacks);
       saved_.reserve(callbacks.size());
       for (Callback* callback : callbacks) {
         saved_.emplace_back(callback, false /* available */, state);
@@ -132,20 +151,52 @@ class CacheBatcher::MultiCallback : public CacheInterface::Callback {
 
 CacheBatcher::CacheBatcher(const Options& options, CacheInterface* cache,
                            AbstractMutex* mutex, Statistics* statistics)
+    : CacheBatcher(options, cache, NULL, mutex, statistics) {
+}
+
+CacheBatcher::CacheBatcher(const Options& options, CacheInterface* cache,
+                           Scheduler* scheduler, AbstractMutex* mutex,
+                           Statistics* statistics)
     : cache_(cache),
+      scheduler_(scheduler),
+      timer_(scheduler == NULL ? NULL : scheduler->timer()),
       dropped_gets_(statistics->GetVariable(kDroppedGets)),
       coalesced_gets_(statistics->GetVariable(kCoalescedGets)),
       queued_gets_(statistics->GetVariable(kQueuedGets)),
+      expired_gets_(statistics->GetVariable(kExpiredGets)),
+      batch_size_histogram_(statistics->GetHistogram(kBatchSizeHistogram)),
+      lookup_latency_histogram_(
+          statistics->GetHistogram(kLookupLatencyUsHistogram)),
       last_batch_size_(-1),
       mutex_(mutex),
       num_in_flight_groups_(0),
       num_in_flight_keys_(0),
       num_pending_gets_(0),
       options_(options),
-      shutdown_(false) {
+      shutdown_(false),
+      alarm_(NULL),
+      alarm_time_us_(0),
+      alarm_generation_(0),
+      parallelism_(options.max_parallel_lookups),
+      batch_size_(options.max_batch_size > 0 ? options.max_batch_size
+                                             : options.max_pending_gets),
+      median_latency_us_(0),
+      saw_backlog_(false) {
+  DCHECK(timer_ != NULL ||
+         (!options_.adaptive && (options_.get_deadline_us == 0)))
+      << "Adaptive mode and Get deadlines need a scheduler";
+  if (options_.adaptive) {
+    parallelism_ = std::max(
+        1, std::min(parallelism_, options_.max_adaptive_parallel_lookups));
+    latency_window_us_.reserve(kLatencyWindow);
+  }
+  batch_size_histogram_->SetMaxValue(kDefaultMaxPendingGets);
+  lookup_latency_histogram_->SetMaxValue(kLookupLatencyUsHistogramMaxValue);
 }
 
 CacheBatcher::~CacheBatcher() {
+  ScopedMutex mutex(mutex_.get());
+  CancelDeadlineAlarm();
 }
 
 GoogleString CacheBatcher::FormatName(StringPiece cache, int parallelism,
@@ -155,7 +206,19 @@ GoogleString CacheBatcher::FormatName(StringPiece cache, int parallelism,
                 ",max=", IntegerToString(max), ")");
 }
 
+GoogleString CacheBatcher::FormatAdaptiveName(StringPiece cache,
+                                              int max_parallelism, int max) {
+  return StrCat("AdaptiveBatcher(cache=", cache,
+                ",parallelism<=", IntegerToString(max_parallelism),
+                ",max=", IntegerToString(max), ")");
+}
+
 GoogleString CacheBatcher::Name() const {
+  if (options_.adaptive) {
+    return FormatAdaptiveName(cache_->Name(),
+                              options_.max_adaptive_parallel_lookups,
+                              options_.max_pending_gets);
+  }
   return FormatName(cache_->Name(), options_.max_parallel_lookups,
                     options_.max_pending_gets);
 }
@@ -164,113 +227,298 @@ void CacheBatcher::InitStats(Statistics* statistics) {
   statistics->AddVariable(kDroppedGets);
   statistics->AddVariable(kCoalescedGets);
   statistics->AddVariable(kQueuedGets);
+  statistics->AddVariable(kExpiredGets);
+  Histogram* batch_size = statistics->AddHistogram(kBatchSizeHistogram);
+  batch_size->SetMaxValue(kDefaultMaxPendingGets);
+  Histogram* lookup_latency =
+      statistics->AddHistogram(kLookupLatencyUsHistogram);
+  lookup_latency->SetMaxValue(kLookupLatencyUsHistogramMaxValue);
+}
+
+int64 CacheBatcher::NowUs() const {
+  return (timer_ == NULL) ? 0 : timer_->NowUs();
 }
 
 bool CacheBatcher::CanIssueGet() const {
-  return !shutdown_ && num_in_flight_groups_ < options_.max_parallel_lookups;
+  return !shutdown_ && num_in_flight_groups_ < parallelism_;
 }
 
 bool CacheBatcher::CanQueueCallback() const {
   return !shutdown_ && num_pending_gets_ < options_.max_pending_gets;
 }
 
+bool CacheBatcher::WouldMissDeadline() const {
+  if (!options_.adaptive || (options_.get_deadline_us <= 0) ||
+      (median_latency_us_ == 0)) {
+    return false;
+  }
+  // The queue drains batch_size_ keys per lookup, parallelism_ lookups at a
+  // time, so a new key has to wait for this many rounds of lookups.
+  int64 lookups_ahead = 1 + queued_.size() / batch_size_;
+  int64 rounds = (lookups_ahead + parallelism_ - 1) / parallelism_;
+  return rounds * median_latency_us_ > options_.get_deadline_us;
+}
+
 void CacheBatcher::Get(const GoogleString& key, Callback* callback) {
-  bool immediate = false;
+  MultiCallback* lookup = NULL;
   bool drop_get = false;
+  int64 now_us = NowUs();
+  int64 deadline_us =
+      (options_.get_deadline_us > 0) ? now_us + options_.get_deadline_us : 0;
+  DroppedGets expired;
   {
     ScopedMutex mutex(mutex_.get());
+    ExpireGets(now_us, &expired);
 
     // Determine if a lookup of this key is already in flight (and this callback
     // should be added to the list of in-flight callbacks under that key), can
     // be issued immediately, should be "queued", or should be dropped.
     bool can_queue = CanQueueCallback();
-    if (can_queue) {
-      auto iter = in_flight_.find(key);
-      if (iter != in_flight_.end()) {
-        iter->second.push_back(callback);
-        ++num_pending_gets_;
-        coalesced_gets_->Add(1);
-        return;
-      }
-    }
-    if (CanIssueGet()) {
-      immediate = true;
+    CallbackMap::iterator iter =
+        can_queue ? in_flight_.find(key) : in_flight_.end();
+    if (iter != in_flight_.end()) {
+      iter->second.callbacks.push_back(callback);
+      ++num_pending_gets_;
+      coalesced_gets_->Add(1);
+    } else if (CanIssueGet()) {
       ++num_in_flight_groups_;
       ++num_pending_gets_;
       ++num_in_flight_keys_;
-      in_flight_[key].push_back(callback);
-    } else if (can_queue) {
-      queued_[key].push_back(callback);
+      lookup = new MultiCallback(this, new Group(this, 1, now_us));
+      std::vector<Callback*> callbacks(1, callback);
+      AddInFlight(key, deadline_us, lookup, &callbacks);
+    } else if (can_queue && !WouldMissDeadline()) {
+      QueuedGets& queued = queued_[key];
+      if (queued.callbacks.empty()) {
+        queued.deadline_us = deadline_us;
+        queue_order_.push_back(key);
+      }
+      queued.callbacks.push_back(callback);
       queued_gets_->Add(1);
       ++num_pending_gets_;
+      saw_backlog_ = true;
     } else {
       drop_get = true;
+      saw_backlog_ = true;
     }
+    UpdateDeadlineAlarm();
   }
-  if (immediate) {
-    Group* group = new Group(this, 1);
-    callback = new MultiCallback(this, group);
-    cache_->Get(key, callback);
+  ReportNotFound(expired);
+  if (lookup != NULL) {
+    cache_->Get(key, lookup);
   } else if (drop_get) {
     ValidateAndReportResult(key, CacheInterface::kNotFound, callback);
     dropped_gets_->Add(1);
   }
 }
 
-void CacheBatcher::GroupComplete() {
-  MultiGetRequest* request = NULL;
+void CacheBatcher::ExpireGets(int64 now_us, DroppedGets* expired) {
+  if (options_.get_deadline_us <= 0) {
+    return;
+  }
+  size_t num_expired = expired->size();
+
+  // The lookups of these keys go on, but there will be nobody to report
+  // their results to; see ExtractInFlightKeys.
+  while (!in_flight_deadlines_.empty() &&
+         (in_flight_deadlines_.begin()->first <= now_us)) {
+    CallbackMap::iterator iter =
+        in_flight_.find(in_flight_deadlines_.begin()->second);
+    DCHECK(iter != in_flight_.end());
+    for (Callback* callback : iter->second.callbacks) {
+      expired->emplace_back(iter->first, callback);
+    }
+    num_pending_gets_ -= iter->second.callbacks.size();
+    in_flight_.erase(iter);
+    in_flight_deadlines_.erase(in_flight_deadlines_.begin());
+  }
+
+  // Deadlines are a fixed interval after queueing, so the expired queued
+  // keys are all at the front of the queue.
+  while (!queue_order_.empty()) {
+    QueueMap::iterator iter = queued_.find(queue_order_.front());
+    DCHECK(iter != queued_.end());
+    if (iter->second.deadline_us > now_us) {
+      break;
+    }
+    for (Callback* callback : iter->second.callbacks) {
+      expired->emplace_back(iter->first, callback);
+    }
+    num_pending_gets_ -= iter->second.callbacks.size();
+    queued_.erase(iter);
+    queue_order_.pop_front();
+  }
+  if (expired->size() > num_expired) {
+    expired_gets_->Add(expired->size() - num_expired);
+  }
+}
+
+void CacheBatcher::UpdateDeadlineAlarm() {
+  if ((scheduler_ == NULL) || (options_.get_deadline_us <= 0) || shutdown_) {
+    return;
+  }
+  int64 deadline_us = 0;
+  if (!queue_order_.empty()) {
+    deadline_us = queued_[queue_order_.front()].deadline_us;
+  }
+  if (!in_flight_deadlines_.empty() &&
+      ((deadline_us == 0) ||
+       (in_flight_deadlines_.begin()->first < deadline_us))) {
+    deadline_us = in_flight_deadlines_.begin()->first;
+  }
+  // An alarm that goes off early finds nothing to do, and sets the next one.
+  if ((deadline_us == 0) ||
+      ((alarm_ != NULL) && (alarm_time_us_ <= deadline_us))) {
+    return;
+  }
+  CancelDeadlineAlarm();
+  ScopedMutex lock(scheduler_->mutex());
+  alarm_time_us_ = deadline_us;
+  alarm_ = scheduler_->AddAlarmAtUsMutexHeld(
+      deadline_us,
+      MakeFunction(this, &CacheBatcher::DeadlineAlarm, ++alarm_generation_));
+}
+
+void CacheBatcher::CancelDeadlineAlarm() {
+  if (alarm_ != NULL) {
+    // If the alarm is already running, it will see that it has been
+    // superseded.
+    ScopedMutex lock(scheduler_->mutex());
+    scheduler_->CancelAlarm(alarm_);
+    alarm_ = NULL;
+    ++alarm_generation_;
+  }
+}
+
+void CacheBatcher::DeadlineAlarm(int64 generation) {
+  DroppedGets expired;
   {
     ScopedMutex mutex(mutex_.get());
-    if (queued_.empty()) {
-      --num_in_flight_groups_;
+    if (generation != alarm_generation_) {
       return;
     }
-    last_batch_size_ = queued_.size();
-    request = CreateRequestForQueuedKeys();
+    alarm_ = NULL;
+    ExpireGets(NowUs(), &expired);
+    UpdateDeadlineAlarm();
   }
-  cache_->MultiGet(request);
+  ReportNotFound(expired);
 }
 
-CacheBatcher::MultiGetRequest* CacheBatcher::CreateRequestForQueuedKeys() {
-  MultiGetRequest* request = ConvertMapToRequest(queued_);
-  MoveQueuedKeys();
-  return request;
+void CacheBatcher::ReportNotFound(const DroppedGets& dropped) {
+  for (const auto& pair : dropped) {
+    ValidateAndReportResult(pair.first, CacheInterface::kNotFound,
+                            pair.second);
+  }
 }
 
-void CacheBatcher::MoveQueuedKeys() {
-  num_in_flight_keys_ += queued_.size();
-  for (const auto& pair : queued_) {
-    const GoogleString& key = pair.first;
-    const std::vector<Callback*>& src_callbacks = pair.second;
-    bool inserted;
+void CacheBatcher::GroupComplete(int64 start_us, int num_keys) {
+  std::vector<MultiGetRequest*> requests;
+  DroppedGets expired;
+  int64 now_us = NowUs();
+  batch_size_histogram_->Add(num_keys);
+  if (timer_ != NULL) {
+    lookup_latency_histogram_->Add(now_us - start_us);
+  }
+  {
+    ScopedMutex mutex(mutex_.get());
+    if (options_.adaptive) {
+      AdaptToLatency(now_us - start_us);
+    }
+    ExpireGets(now_us, &expired);
 
-    std::tie(std::ignore, inserted) = in_flight_.emplace(key, src_callbacks);
-    // It should be impossible to have both in_flight_[key] and queued_[key]
-    // exist and be nonempty simultaneously.
-    DCHECK(inserted);
+    // Reuse this lookup's slot for the queued keys, and if the parallelism
+    // has grown, take the new slots too.
+    --num_in_flight_groups_;
+    while (!queued_.empty() && CanIssueGet()) {
+      ++num_in_flight_groups_;
+      requests.push_back(CreateRequestForQueuedKeys(now_us));
+      last_batch_size_ = requests.back()->size();
+    }
+    UpdateDeadlineAlarm();
+  }
+  ReportNotFound(expired);
+  for (MultiGetRequest* request : requests) {
+    cache_->MultiGet(request);
   }
-  queued_.clear();
 }
 
-CacheBatcher::MultiGetRequest* CacheBatcher::ConvertMapToRequest(
-    const CallbackMap &map) {
-  Group* group = new Group(this, map.size());
-  MultiGetRequest* request = new MultiGetRequest();
-  for (const auto& pair : map) {
-    const GoogleString& key = pair.first;
-    request->emplace_back(key, new MultiCallback(this, group));
+void CacheBatcher::AdaptToLatency(int64 latency_us) {
+  latency_window_us_.push_back(latency_us);
+  if (latency_window_us_.size() < static_cast<size_t>(kLatencyWindow)) {
+    return;
+  }
+  std::sort(latency_window_us_.begin(), latency_window_us_.end());
+  median_latency_us_ = latency_window_us_[kLatencyWindow / 2];
+  int64 p90_latency_us = latency_window_us_[kLatencyWindow * 9 / 10];
+  int max_batch_size = (options_.max_batch_size > 0)
+      ? options_.max_batch_size : options_.max_pending_gets;
+  if (p90_latency_us > options_.target_latency_us) {
+    // The backend is falling behind: back off multiplicatively.
+    parallelism_ = std::max(1, parallelism_ / 2);
+    batch_size_ = std::min(max_batch_size,
+                           std::max(kMinAdaptiveBatchSize, batch_size_ / 2));
+  } else if (saw_backlog_) {
+    // Gets are waiting and the backend is keeping up: probe additively.
+    parallelism_ = std::min(options_.max_adaptive_parallel_lookups,
+                            parallelism_ + 1);
+    batch_size_ = std::min(max_batch_size, batch_size_ + kBatchSizeIncrement);
   }
+  latency_window_us_.clear();
+  saw_backlog_ = false;
+}
 
+CacheBatcher::MultiGetRequest* CacheBatcher::CreateRequestForQueuedKeys(
+    int64 start_us) {
+  int num_keys = std::min(static_cast<size_t>(batch_size_),
+                          queue_order_.size());
+  Group* group = new Group(this, num_keys, start_us);
+  MultiGetRequest* request = new MultiGetRequest();
+  request->reserve(num_keys);
+  num_in_flight_keys_ += num_keys;
+  for (int i = 0; i < num_keys; ++i) {
+    const GoogleString& key = queue_order_.front();
+    QueueMap::iterator iter = queued_.find(key);
+    DCHECK(iter != queued_.end());
+    MultiCallback* lookup = new MultiCallback(this, group);
+    AddInFlight(key, iter->second.deadline_us, lookup,
+                &iter->second.callbacks);
+    queued_.erase(iter);
+    request->emplace_back(key, lookup);
+    queue_order_.pop_front();
+  }
   return request;
 }
 
+void CacheBatcher::AddInFlight(const GoogleString& key, int64 deadline_us,
+                               MultiCallback* lookup,
+                               std::vector<Callback*>* callbacks) {
+  bool inserted;
+  CallbackMap::iterator iter;
+  std::tie(iter, inserted) = in_flight_.emplace(key, InFlightGets());
+  // It should be impossible to have both in_flight_[key] and queued_[key]
+  // exist and be nonempty simultaneously.
+  DCHECK(inserted);
+  iter->second.deadline_us = deadline_us;
+  iter->second.lookup = lookup;
+  iter->second.callbacks.swap(*callbacks);
+  if (deadline_us != 0) {
+    in_flight_deadlines_.emplace(deadline_us, key);
+  }
+}
+
 void CacheBatcher::ExtractInFlightKeys(
-    const GoogleString& key,
+    const GoogleString& key, MultiCallback* lookup,
     std::vector<CacheInterface::Callback*>* callbacks) {
   ScopedMutex mutex(mutex_.get());
   auto iter = in_flight_.find(key);
-  CHECK(iter != in_flight_.end());
-  iter->second.swap(*callbacks);
+  // Once expired, the key may have been looked up again, by another lookup.
+  if ((iter == in_flight_.end()) || (iter->second.lookup != lookup)) {
+    return;
+  }
+  iter->second.callbacks.swap(*callbacks);
+  if (iter->second.deadline_us != 0) {
+    in_flight_deadlines_.erase(std::make_pair(iter->second.deadline_us, key));
+  }
   in_flight_.erase(iter);
 }
 
@@ -298,20 +546,33 @@ int CacheBatcher::num_in_flight_keys() {
   return num_in_flight_keys_;
 }
 
+int CacheBatcher::parallelism() const {
+  ScopedMutex mutex(mutex_.get());
+  return parallelism_;
+}
+
+int CacheBatcher::batch_size() const {
+  ScopedMutex mutex(mutex_.get());
+  return batch_size_;
+}
+
 void CacheBatcher::ShutDown() {
-  MultiGetRequest* request = nullptr;
+  DroppedGets dropped;
   {
     ScopedMutex mutex(mutex_.get());
     shutdown_ = true;
-    if (!queued_.empty()) {
-      request = ConvertMapToRequest(queued_);
-      queued_.clear();
+    CancelDeadlineAlarm();
+    for (const GoogleString& key : queue_order_) {
+      for (Callback* callback : queued_[key].callbacks) {
+        dropped.emplace_back(key, callback);
+      }
     }
+    num_pending_gets_ -= dropped.size();
+    queued_.clear();
+    queue_order_.clear();
   }
 
-  if (request != nullptr) {
-    ReportMultiGetNotFound(request);
-  }
+  ReportNotFound(dropped);
   cache_->ShutDown();
 }
 
@@ -21,7 +21,10 @@
 
 #include <cstddef>
 
+#include <deque>
+#include <set>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "pagespeed/kernel/base/abstract_mutex.h"
@@ -32,10 +35,13 @@
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_annotations.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/kernel/thread/scheduler.h"
 
 namespace net_instaweb {
 
+class Histogram;
 class Statistics;
+class Timer;
 class Variable;
 
 // Batches up cache lookups to exploit implementations that have MultiGet
@@ -48,6 +54,20 @@ class Variable;
 // There is also a maximum queue size.  If Gets stream in faster than they
 // are completed and the queue overflows, then we respond with a fast kNotFound.
 //
+// In adaptive mode the parallelism and the number of keys sent in each
+// MultiGet are not fixed, but adjusted from the observed latency of the
+// lookups, in the manner of TCP's AIMD congestion control.  The latencies of
+// the last kLatencyWindow lookups are collected; if their 90th percentile
+// exceeds target_latency_us both limits are halved, and otherwise, if Gets
+// are waiting in the queue, parallelism grows by one and the batch size by
+// kBatchSizeIncrement.  Gets may also be given a deadline, after which they
+// are reported as kNotFound rather than left waiting, whether they are still
+// queued or their lookup is in flight; whatever such a lookup finds later is
+// discarded.  In adaptive mode a Get whose expected wait would exceed its
+// deadline is dropped immediately.  Deadlines are enforced by a scheduler
+// alarm set for the earliest one, as well as whenever a Get arrives or a
+// lookup completes.
+//
 // Note that this class is designed for use with an asynchronous cache
 // implementation.  To use this with a blocking cache implementation, please
 // wrap the blocking cache in an AsyncCache.
@@ -72,20 +92,59 @@ class CacheBatcher : public CacheInterface {
   // immediately with kNotFound.
   static const size_t kDefaultMaxPendingGets = 1000;
 
+  // Defaults for adaptive mode.
+  static const int kDefaultMaxAdaptiveParallelLookups = 8;
+  static const int64 kDefaultTargetLatencyUs = 10 * 1000;
+
+  // The number of lookup latencies considered by each adaptive adjustment.
+  static const int kLatencyWindow = 16;
+
+  // Adaptive mode never shrinks MultiGets below kMinAdaptiveBatchSize keys,
+  // and grows them by kBatchSizeIncrement keys at a time.
+  static const int kMinAdaptiveBatchSize = 8;
+  static const int kBatchSizeIncrement = 8;
+
   struct Options {
     Options()
         : max_parallel_lookups(kDefaultMaxParallelLookups),
-          max_pending_gets(kDefaultMaxPendingGets) {
+          max_pending_gets(kDefaultMaxPendingGets),
+          max_batch_size(0),
+          adaptive(false),
+          max_adaptive_parallel_lookups(kDefaultMaxAdaptiveParallelLookups),
+          target_latency_us(kDefaultTargetLatencyUs),
+          get_deadline_us(0) {
     }
 
+    // In adaptive mode, this is the initial parallelism.
     int max_parallel_lookups;
     int max_pending_gets;
+
+    // The most keys sent in a single MultiGet; 0 means no limit.  In adaptive
+    // mode this is the ceiling on the batch size (max_pending_gets if 0).
+    int max_batch_size;
+
+    // Adaptive mode, described above, and its bounds.  Requires a scheduler.
+    bool adaptive;
+    int max_adaptive_parallel_lookups;
+    int64 target_latency_us;
+
+    // How long a Get may wait, queued or in flight, before being reported as
+    // kNotFound; 0 means no limit.  Requires a scheduler.
+    int64 get_deadline_us;
     // Copy-construction and assign are allowed.
   };
 
   // Does not take ownership of the cache. Takes ownership of the mutex.
   CacheBatcher(const Options& options, CacheInterface* cache,
                AbstractMutex* mutex, Statistics* statistics);
+
+  // As above, with a scheduler for adaptive mode and Get deadlines, whose
+  // timer is used to measure latencies.  Does not take ownership of the
+  // scheduler.  With deadlines, ShutDown must be called before destruction,
+  // to cancel the alarm.
+  CacheBatcher(const Options& options, CacheInterface* cache,
+               Scheduler* scheduler, AbstractMutex* mutex,
+               Statistics* statistics);
   virtual ~CacheBatcher();
 
   // Startup-time (pre-construction) initialization of statistics
@@ -98,6 +157,8 @@ class CacheBatcher : public CacheInterface {
   virtual void Delete(const GoogleString& key);
   virtual GoogleString Name() const;
   static GoogleString FormatName(StringPiece cache, int parallelism, int max);
+  static GoogleString FormatAdaptiveName(StringPiece cache,
+                                         int max_parallelism, int max);
 
   // Note: CacheBatcher cannot do any batching if given a blocking cache,
   // however it is still functional so pass on the bit.
@@ -107,22 +168,75 @@ class CacheBatcher : public CacheInterface {
   virtual void ShutDown();
 
  private:
-  typedef std::unordered_map<GoogleString, std::vector<Callback*>> CallbackMap;
-
   class Group;
   class MultiCallback;
 
+  // The callbacks waiting on the lookup of a key in flight, which
+  // lookup owns them, and when they expire.
+  struct InFlightGets {
+    InFlightGets() : deadline_us(0), lookup(NULL) {}
+
+    int64 deadline_us;
+    MultiCallback* lookup;
+    std::vector<Callback*> callbacks;
+  };
+  typedef std::unordered_map<GoogleString, InFlightGets> CallbackMap;
+
+  // The callbacks queued for a key, and when they expire.
+  struct QueuedGets {
+    QueuedGets() : deadline_us(0) {}
+
+    int64 deadline_us;
+    std::vector<Callback*> callbacks;
+  };
+  typedef std::unordered_map<GoogleString, QueuedGets> QueueMap;
+  typedef std::vector<std::pair<GoogleString, Callback*>> DroppedGets;
+  // The keys in flight with deadlines, soonest first.
+  typedef std::set<std::pair<int64, GoogleString>> DeadlineSet;
+
   bool CanIssueGet() const EXCLUSIVE_LOCKS_REQUIRED(mutex_);
   bool CanQueueCallback() const EXCLUSIVE_LOCKS_REQUIRED(mutex_);
-  void GroupComplete();
+  void GroupComplete(int64 start_us, int num_keys);
+
+  // Returns true if a newly queued Get would be expected to wait past its
+  // deadline, given the recent lookup latency.
+  bool WouldMissDeadline() const EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Moves queued and in-flight Gets that have passed their deadlines to
+  // *expired.
+  void ExpireGets(int64 now_us, DroppedGets* expired)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void ReportNotFound(const DroppedGets& dropped) LOCKS_EXCLUDED(mutex_);
+
+  // Makes sure the alarm will go off by the earliest deadline.  Takes the
+  // scheduler's mutex, which is always taken after mutex_.
+  void UpdateDeadlineAlarm() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void CancelDeadlineAlarm() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Run by the alarm; generation tells a superseded alarm from the current
+  // one.
+  void DeadlineAlarm(int64 generation) LOCKS_EXCLUDED(mutex_);
 
-  MultiGetRequest* ConvertMapToRequest(const CallbackMap& map)
+  // Records the latency of a completed lookup and, every kLatencyWindow
+  // lookups, adjusts the parallelism and batch size.
+  void AdaptToLatency(int64 latency_us) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  int64 NowUs() const;
+
+  // Takes up to batch_size_ of the oldest queued keys, moving them in flight,
+  // and returns the request to look them up.
+  MultiGetRequest* CreateRequestForQueuedKeys(int64 start_us)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
-  MultiGetRequest* CreateRequestForQueuedKeys()
+
+  // Moves key in flight, to be looked up by lookup.
+  void AddInFlight(const GoogleString& key, int64 deadline_us,
+                   MultiCallback* lookup, std::vector<Callback*>* callbacks)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
-  void MoveQueuedKeys() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
-  void ExtractInFlightKeys(const GoogleString& key,
-                   std::vector<CacheInterface::Callback*>* callbacks)
+
+  // Takes the callbacks waiting on lookup's result for key, which are none
+  // if they have expired.
+  void ExtractInFlightKeys(const GoogleString& key, MultiCallback* lookup,
+                           std::vector<CacheInterface::Callback*>* callbacks)
       LOCKS_EXCLUDED(mutex_);
 
   void DecrementInFlightGets(int n) LOCKS_EXCLUDED(mutex_);
@@ -131,11 +245,18 @@ class CacheBatcher : public CacheInterface {
   friend class CacheBatcherTestingPeer;
   int last_batch_size() const LOCKS_EXCLUDED(mutex_);
   int num_in_flight_keys() LOCKS_EXCLUDED(mutex_);
+  int parallelism() const LOCKS_EXCLUDED(mutex_);
+  int batch_size() const LOCKS_EXCLUDED(mutex_);
 
   CacheInterface* cache_;
+  Scheduler* scheduler_;
+  Timer* timer_;
   Variable* dropped_gets_;
   Variable* coalesced_gets_;
   Variable* queued_gets_;
+  Variable* expired_gets_;
+  Histogram* batch_size_histogram_;
+  Histogram* lookup_latency_histogram_;
   CallbackMap in_flight_ GUARDED_BY(mutex_);
   int last_batch_size_ GUARDED_BY(mutex_);
   scoped_ptr<AbstractMutex> mutex_;
@@ -143,8 +264,28 @@ class CacheBatcher : public CacheInterface {
   int num_in_flight_keys_ GUARDED_BY(mutex_);
   int num_pending_gets_ GUARDED_BY(mutex_);
   const Options options_;
-  CallbackMap queued_ GUARDED_BY(mutex_);
+  QueueMap queued_ GUARDED_BY(mutex_);
+  // The keys in queued_, oldest first.  Keys leave the queue only from the
+  // front, whether they are looked up or expire.
+  std::deque<GoogleString> queue_order_ GUARDED_BY(mutex_);
   bool shutdown_ GUARDED_BY(mutex_);
+  DeadlineSet in_flight_deadlines_ GUARDED_BY(mutex_);
+
+  // The pending deadline alarm, if any, and when it goes off.
+  Scheduler::Alarm* alarm_ GUARDED_BY(mutex_);
+  int64 alarm_time_us_ GUARDED_BY(mutex_);
+  int64 alarm_generation_ GUARDED_BY(mutex_);
+
+  // The current limits, which only change in adaptive mode.
+  int parallelism_ GUARDED_BY(mutex_);
+  int batch_size_ GUARDED_BY(mutex_);
+
+  // Adaptive-mode state: recent lookup latencies, the median of the last
+  // full window (0 until there is one), and whether any Get was queued or
+  // dropped during the current window.
+  std::vector<int64> latency_window_us_ GUARDED_BY(mutex_);
+  int64 median_latency_us_ GUARDED_BY(mutex_);
+  bool saw_backlog_ GUARDED_BY(mutex_);
 
   DISALLOW_COPY_AND_ASSIGN(CacheBatcher);
 };
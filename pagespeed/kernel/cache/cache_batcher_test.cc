@@ -23,8 +23,10 @@
 #include <cstddef>
 
 #include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_timer.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/cache/async_cache.h"
@@ -34,6 +36,7 @@
 #include "pagespeed/kernel/cache/lru_cache.h"
 #include "pagespeed/kernel/cache/threadsafe_cache.h"
 #include "pagespeed/kernel/cache/write_through_cache.h"
+#include "pagespeed/kernel/thread/mock_scheduler.h"
 #include "pagespeed/kernel/thread/queued_worker_pool.h"
 #include "pagespeed/kernel/thread/worker_test_base.h"
 #include "pagespeed/kernel/util/platform.h"
@@ -54,6 +57,10 @@ class CacheBatcherTest : public CacheTestBase {
     CacheBatcher::InitStats(statistics_.get());
     lru_cache_.reset(new LRUCache(kMaxSize));
     timer_.reset(thread_system_->NewTimer());
+    mock_timer_.reset(new MockTimer(thread_system_->NewMutex(),
+                                    MockTimer::kApr_5_2010_ms));
+    mock_scheduler_.reset(
+        new MockScheduler(thread_system_.get(), mock_timer_.get()));
     pool_.reset(
         new QueuedWorkerPool(kMaxWorkers, "cache", thread_system_.get()));
     threadsafe_cache_.reset(new ThreadsafeCache(
@@ -96,10 +103,24 @@ class CacheBatcherTest : public CacheTestBase {
                            CacheInterface* cache) {
     batcher_.reset(new CacheBatcher(options,
                                     cache,
+                                    mock_scheduler_.get(),
                                     thread_system_->NewMutex(),
                                     statistics_.get()));
   }
 
+  // Looks up num_lookups keys, one at a time, each taking latency_ms on
+  // mock_timer_.
+  void LookUpWithLatency(int num_lookups, int64 latency_ms) {
+    for (int i = 0; i < num_lookups; ++i) {
+      GoogleString key = StringPrintf("n%d", i);
+      DelayKey(key);
+      Callback* callback = InitiateGet(key);
+      mock_timer_->AdvanceMs(latency_ms);
+      ReleaseKey(key);
+      WaitAndCheck(callback, StringPrintf("v%d", i));
+    }
+  }
+
   // After the Done() callback is be called, there is a slight delay
   // in the worker thread before the CacheBatcher knows it can
   // schedule another lookup.  To test the sequences we want, wait
@@ -129,10 +150,24 @@ class CacheBatcherTest : public CacheTestBase {
     return peer_.last_batch_size(batcher_.get());
   }
 
+  int Parallelism() {
+    return peer_.parallelism(batcher_.get());
+  }
+
+  int BatchSize() {
+    return peer_.batch_size(batcher_.get());
+  }
+
+  int64 Stat(const char* name) {
+    return statistics_->GetVariable(name)->Get();
+  }
+
   scoped_ptr<LRUCache> lru_cache_;
   scoped_ptr<ThreadSystem> thread_system_;
   scoped_ptr<ThreadsafeCache> threadsafe_cache_;
   scoped_ptr<Timer> timer_;
+  scoped_ptr<MockTimer> mock_timer_;
+  scoped_ptr<MockScheduler> mock_scheduler_;
   scoped_ptr<QueuedWorkerPool> pool_;
   scoped_ptr<AsyncCache> async_cache_;
   scoped_ptr<DelayCache> delay_cache_;
@@ -492,6 +527,169 @@ TEST_F(CacheBatcherTest, CoalesceInFlightGet) {
   EXPECT_EQ(2, lru_cache_->num_hits());
 }
 
+TEST_F(CacheBatcherTest, MaxBatchSize) {
+  CacheBatcher::Options options;
+  options.max_parallel_lookups = 1;
+  options.max_batch_size = 2;
+  ChangeBatcherConfig(options, delay_cache_.get());
+  PopulateCache(5);
+
+  DelayKey("n0");
+  Callback* n0 = InitiateGet("n0");
+  Callback* n1 = InitiateGet("n1");
+  Callback* n2 = InitiateGet("n2");
+  Callback* n3 = InitiateGet("n3");
+  Callback* n4 = InitiateGet("n4");
+
+  // The four queued keys go out as two MultiGets, oldest first.
+  ReleaseKey("n0");
+  WaitAndCheck(n0, "v0");
+  WaitAndCheck(n1, "v1");
+  WaitAndCheck(n2, "v2");
+  WaitAndCheck(n3, "v3");
+  WaitAndCheck(n4, "v4");
+  EXPECT_EQ(2, LastBatchSize());
+  EXPECT_EQ(3, statistics_->GetHistogram("cache_batcher_batch_size")->Count());
+}
+
+TEST_F(CacheBatcherTest, QueuedGetDeadline) {
+  CacheBatcher::Options options;
+  options.max_parallel_lookups = 1;
+  options.get_deadline_us = 100 * Timer::kMsUs;
+  ChangeBatcherConfig(options, delay_cache_.get());
+  PopulateCache(3);
+
+  DelayKey("n0");
+  Callback* n0 = InitiateGet("n0");
+  Callback* n1 = InitiateGet("n1");
+
+  // n0 and n1 have waited past their deadlines by the time the next Get
+  // arrives, so they are reported as misses rather than waiting any longer
+  // for n0's lookup.  (Moving the timer alone doesn't fire the alarm.)
+  mock_timer_->AdvanceMs(150);
+  Callback* n2 = InitiateGet("n2");
+  WaitAndCheckNotFound(n0);
+  WaitAndCheckNotFound(n1);
+  EXPECT_EQ(2, Stat("cache_batcher_expired_gets"));
+
+  ReleaseKey("n0");
+  WaitAndCheck(n2, "v2");
+  EXPECT_EQ(2, Stat("cache_batcher_expired_gets"));
+  EXPECT_EQ(0, Stat("cache_batcher_dropped_gets"));
+}
+
+TEST_F(CacheBatcherTest, DeadlineAlarm) {
+  CacheBatcher::Options options;
+  options.max_parallel_lookups = 1;
+  options.get_deadline_us = 100 * Timer::kMsUs;
+  ChangeBatcherConfig(options, delay_cache_.get());
+  PopulateCache(2);
+
+  DelayKey("n0");
+  Callback* n0 = InitiateGet("n0");
+  mock_scheduler_->AdvanceTimeMs(50);
+  Callback* n1 = InitiateGet("n1");
+
+  // No more Gets arrive and no lookup completes, but the alarm reports each
+  // Get as a miss once its deadline passes, whether its lookup is in flight
+  // or still queued.
+  mock_scheduler_->AdvanceTimeMs(60);
+  WaitAndCheckNotFound(n0);
+  EXPECT_FALSE(n1->called());
+  EXPECT_EQ(1, Stat("cache_batcher_expired_gets"));
+  mock_scheduler_->AdvanceTimeMs(50);
+  WaitAndCheckNotFound(n1);
+  EXPECT_EQ(2, Stat("cache_batcher_expired_gets"));
+
+  // What n0's lookup finds once it completes is discarded, and its slot is
+  // free for the next Get.
+  ReleaseKey("n0");
+  PostOpCleanup();
+  CheckGet("n0", "v0");
+  EXPECT_EQ(0, Stat("cache_batcher_dropped_gets"));
+}
+
+TEST_F(CacheBatcherTest, AdaptiveIncreaseAndDecrease) {
+  CacheBatcher::Options options;
+  options.adaptive = true;
+  options.max_parallel_lookups = 4;
+  options.max_batch_size = 16;
+  options.target_latency_us = 10 * Timer::kMsUs;
+  ChangeBatcherConfig(options, delay_cache_.get());
+  PopulateCache(CacheBatcher::kLatencyWindow);
+  EXPECT_EQ(4, Parallelism());
+  EXPECT_EQ(16, BatchSize());
+
+  // A window of lookups slower than the target halves both limits.
+  LookUpWithLatency(CacheBatcher::kLatencyWindow, 20);
+  EXPECT_EQ(2, Parallelism());
+  EXPECT_EQ(CacheBatcher::kMinAdaptiveBatchSize, BatchSize());
+  EXPECT_EQ(CacheBatcher::kLatencyWindow,
+            statistics_->GetHistogram(
+                "cache_batcher_lookup_latency_us")->Count());
+
+  // Fast lookups without a backlog leave them alone.
+  LookUpWithLatency(CacheBatcher::kLatencyWindow, 0);
+  EXPECT_EQ(2, Parallelism());
+  EXPECT_EQ(CacheBatcher::kMinAdaptiveBatchSize, BatchSize());
+
+  // Fast lookups with Gets queued behind them grow both limits additively.
+  // Each round has two lookups in flight and one queued behind them.
+  for (int i = 0; i < 6; ++i) {
+    DelayKey("n0");
+    DelayKey("n1");
+    Callback* n0 = InitiateGet("n0");
+    Callback* n1 = InitiateGet("n1");
+    Callback* n2 = InitiateGet("n2");
+    ReleaseKey("n0");
+    ReleaseKey("n1");
+    WaitAndCheck(n0, "v0");
+    WaitAndCheck(n1, "v1");
+    WaitAndCheck(n2, "v2");
+  }
+  EXPECT_EQ(3, Parallelism());
+  EXPECT_EQ(CacheBatcher::kMinAdaptiveBatchSize +
+            CacheBatcher::kBatchSizeIncrement, BatchSize());
+}
+
+TEST_F(CacheBatcherTest, AdaptiveFailsFastPastDeadline) {
+  CacheBatcher::Options options;
+  options.adaptive = true;
+  options.max_parallel_lookups = 1;
+  options.target_latency_us = 10 * Timer::kMsUs;
+  options.get_deadline_us = 15 * Timer::kMsUs;
+  ChangeBatcherConfig(options, delay_cache_.get());
+  PopulateCache(CacheBatcher::kLatencyWindow);
+  LookUpWithLatency(CacheBatcher::kLatencyWindow, 20);
+
+  // Lookups are taking 20ms, so a Get queued behind one would be expected to
+  // miss its 15ms deadline: it is dropped straight away.
+  DelayKey("n0");
+  Callback* n0 = InitiateGet("n0");
+  Callback* n1 = InitiateGet("n1");
+  WaitAndCheckNotFound(n1);
+  EXPECT_EQ(1, Stat("cache_batcher_dropped_gets"));
+  ReleaseKey("n0");
+  WaitAndCheck(n0, "v0");
+}
+
+TEST_F(CacheBatcherTest, ShutDownReportsQueuedGets) {
+  CacheBatcher::Options options;
+  options.max_parallel_lookups = 1;
+  ChangeBatcherConfig(options, delay_cache_.get());
+  PopulateCache(2);
+
+  DelayKey("n0");
+  Callback* n0 = InitiateGet("n0");
+  Callback* n1 = InitiateGet("n1");
+  batcher_->ShutDown();
+  WaitAndCheckNotFound(n1);
+
+  // n0 was already in flight, and the shut-down backend reports it missing.
+  ReleaseKey("n0");
+  WaitAndCheckNotFound(n0);
+}
+
 TEST_F(CacheBatcherTest, CheckWriteThroughCacheCompatibility) {
   LRUCache small_cache(kMaxSize);
   LRUCache big_cache(kMaxSize);
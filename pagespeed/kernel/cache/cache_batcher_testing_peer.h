@@ -37,6 +37,14 @@ class CacheBatcherTestingPeer {
     return batcher->num_in_flight_keys();
   }
 
+  static int parallelism(CacheBatcher* batcher) {
+    return batcher->parallelism();
+  }
+
+  static int batch_size(CacheBatcher* batcher) {
+    return batcher->batch_size();
+  }
+
  private:
   DISALLOW_COPY_AND_ASSIGN(CacheBatcherTestingPeer);
 };
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/cache_codec.h"
+
+#include "pagespeed/kernel/base/null_message_handler.h"
+#include "pagespeed/kernel/base/string_hash.h"
+#include "pagespeed/kernel/base/string_writer.h"
+#include "pagespeed/kernel/util/brotli_inflater.h"
+#include "pagespeed/kernel/util/gzip_inflater.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Lower levels save no time on the small values we store: setting up the
+// stream costs more than compressing them.  See
+// compressed_cache_speed_test.cc.
+const int kDeflateLevel = 9;
+
+// Higher qualities cost several times the CPU for a few percent on the
+// small values we store.
+const int kBrotliQuality = 9;
+
+// Three times as fast as kBrotliQuality, but compresses the small values we
+// store by a few percent.  Lower qualities make them bigger.  See
+// compressed_cache_speed_test.cc.
+const int kBrotliFastQuality = 1;
+
+GoogleString DictionaryId(StringPiece dictionary) {
+  if (dictionary.empty()) {
+    return "";
+  }
+  uint64 hash =
+      HashString<CasePreserve, uint64>(dictionary.data(), dictionary.size());
+  return StringPrintf("%016llx", static_cast<unsigned long long>(hash));
+}
+
+}  // namespace
+
+const char CacheCodec::kDeflate[] = "deflate";
+const char CacheCodec::kBrotli[] = "brotli";
+const char CacheCodec::kBrotliFast[] = "brotli-fast";
+
+CacheCodec::~CacheCodec() {
+}
+
+CacheCodec* CacheCodec::Create(StringPiece name, StringPiece dictionary) {
+  if (name == kDeflate) {
+    return new DeflateCacheCodec(kDeflateLevel, dictionary);
+  } else if (name == kBrotli) {
+    return new BrotliCacheCodec(kBrotli, kBrotliQuality);
+  } else if (name == kBrotliFast) {
+    return new BrotliCacheCodec(kBrotliFast, kBrotliFastQuality);
+  }
+  return NULL;
+}
+
+bool CacheCodec::IsValidName(StringPiece name) {
+  return (name == kDeflate) || (name == kBrotli) || (name == kBrotliFast);
+}
+
+DeflateCacheCodec::DeflateCacheCodec(int level, StringPiece dictionary)
+    : level_(level),
+      dictionary_(dictionary.data(), dictionary.size()),
+      dictionary_id_(DictionaryId(dictionary)) {
+}
+
+DeflateCacheCodec::~DeflateCacheCodec() {
+}
+
+bool DeflateCacheCodec::Encode(StringPiece in, GoogleString* out) const {
+  StringWriter writer(out);
+  return GzipInflater::DeflateWithDictionary(in, level_, dictionary_, &writer);
+}
+
+bool DeflateCacheCodec::Decode(StringPiece in, GoogleString* out) const {
+  StringWriter writer(out);
+  return GzipInflater::InflateWithDictionary(in, dictionary_, &writer);
+}
+
+BrotliCacheCodec::BrotliCacheCodec(const char* name, int quality)
+    : name_(name),
+      quality_(quality) {
+}
+
+BrotliCacheCodec::~BrotliCacheCodec() {
+}
+
+bool BrotliCacheCodec::Encode(StringPiece in, GoogleString* out) const {
+  StringWriter writer(out);
+  NullMessageHandler handler;
+  return BrotliInflater::Compress(in, quality_, &handler, &writer);
+}
+
+bool BrotliCacheCodec::Decode(StringPiece in, GoogleString* out) const {
+  StringWriter writer(out);
+  NullMessageHandler handler;
+  return BrotliInflater::Decompress(in, &handler, &writer);
+}
+
+}  // namespace net_instaweb
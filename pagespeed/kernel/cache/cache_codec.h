@@ -0,0 +1,106 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_CACHE_CODEC_H_
+#define PAGESPEED_KERNEL_CACHE_CACHE_CODEC_H_
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+// Compresses and decompresses the values stored by a CompressedCache.
+// Implementations must be thread-safe.
+class CacheCodec {
+ public:
+  // Names accepted by Create.
+  static const char kDeflate[];     // zlib at level 9.
+  static const char kBrotli[];      // brotli at quality 9.
+  static const char kBrotliFast[];  // brotli at quality 1.
+
+  CacheCodec() {}
+  virtual ~CacheCodec();
+
+  // Returns a new codec for the given name, or NULL if the name is unknown.
+  // The zlib codec uses the dictionary, if it is not empty, as a preset
+  // dictionary; brotli ignores it.
+  static CacheCodec* Create(StringPiece name, StringPiece dictionary);
+
+  // Returns whether Create knows the name.
+  static bool IsValidName(StringPiece name);
+
+  // Stored with each value, so values written with another kind of codec
+  // are not mistaken for ours.  Codecs that only differ in their settings
+  // share an id.
+  virtual char id() const = 0;
+  virtual const char* name() const = 0;
+
+  // Identifies the dictionary the codec uses, or is empty if it uses none.
+  // The id only depends on the dictionary's contents, so every process
+  // loading the same dictionary agrees on it.
+  virtual GoogleString dictionary_id() const { return ""; }
+
+  // Appends the encoded or decoded form of in to *out.  Decode returns
+  // false if in is corrupt or needs a dictionary we don't have.
+  virtual bool Encode(StringPiece in, GoogleString* out) const = 0;
+  virtual bool Decode(StringPiece in, GoogleString* out) const = 0;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(CacheCodec);
+};
+
+// zlib streams, optionally with a preset dictionary.  The level only
+// matters when encoding.
+class DeflateCacheCodec : public CacheCodec {
+ public:
+  DeflateCacheCodec(int level, StringPiece dictionary);
+  virtual ~DeflateCacheCodec();
+
+  virtual char id() const { return 'z'; }
+  virtual const char* name() const { return kDeflate; }
+  virtual GoogleString dictionary_id() const { return dictionary_id_; }
+  virtual bool Encode(StringPiece in, GoogleString* out) const;
+  virtual bool Decode(StringPiece in, GoogleString* out) const;
+
+ private:
+  const int level_;
+  const GoogleString dictionary_;
+  const GoogleString dictionary_id_;
+
+  DISALLOW_COPY_AND_ASSIGN(DeflateCacheCodec);
+};
+
+class BrotliCacheCodec : public CacheCodec {
+ public:
+  BrotliCacheCodec(const char* name, int quality);
+  virtual ~BrotliCacheCodec();
+
+  virtual char id() const { return 'b'; }
+  virtual const char* name() const { return name_; }
+  virtual bool Encode(StringPiece in, GoogleString* out) const;
+  virtual bool Decode(StringPiece in, GoogleString* out) const;
+
+ private:
+  const char* name_;
+  const int quality_;
+
+  DISALLOW_COPY_AND_ASSIGN(BrotliCacheCodec);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_CACHE_CODEC_H_
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/cache_dictionary_builder.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/rolling_hash.h"
+#include "pagespeed/kernel/thread/slow_worker.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// The length of the byte ranges we count.  Shorter ones match in more
+// places, but zlib gains little from matches this short or shorter.
+const int kSegmentSize = 16;
+
+// One occurrence of a segment.
+struct Occurrence {
+  uint64 hash;
+  int32 sample;
+  int32 offset;
+
+  bool operator<(const Occurrence& that) const {
+    if (hash != that.hash) {
+      return hash < that.hash;
+    }
+    if (sample != that.sample) {
+      return sample < that.sample;
+    }
+    return offset < that.offset;
+  }
+};
+
+// A segment that appears in more than one sample, at its first occurrence.
+struct Candidate {
+  int count;
+  int32 sample;
+  int32 offset;
+
+  // Most common first, then in sample order.
+  bool operator<(const Candidate& that) const {
+    if (count != that.count) {
+      return count > that.count;
+    }
+    if (sample != that.sample) {
+      return sample < that.sample;
+    }
+    return offset < that.offset;
+  }
+};
+
+// A run of bytes chosen for the dictionary.
+struct Run {
+  int count;  // Of the most common segment in the run.
+  int32 sample;
+  int32 offset;
+  int32 size;
+
+  // Least common first.
+  bool operator<(const Run& that) const {
+    if (count != that.count) {
+      return count < that.count;
+    }
+    if (sample != that.sample) {
+      return sample > that.sample;
+    }
+    return offset > that.offset;
+  }
+};
+
+}  // namespace
+
+class CacheDictionaryBuilder::BuildFunction : public Function {
+ public:
+  explicit BuildFunction(CacheDictionaryBuilder* builder)
+      : builder_(builder) {}
+  virtual ~BuildFunction() {}
+
+ protected:
+  virtual void Run() { builder_->BuildDictionary(); }
+  virtual void Cancel() { builder_->BuildCancelled(); }
+
+ private:
+  CacheDictionaryBuilder* builder_;
+  DISALLOW_COPY_AND_ASSIGN(BuildFunction);
+};
+
+CacheDictionaryBuilder::CacheDictionaryBuilder(
+    int num_samples, int sample_interval, int dictionary_size,
+    SlowWorker* worker, AbstractMutex* mutex,
+    Callback1<const GoogleString&>* done)
+    : num_samples_(num_samples),
+      sample_interval_(std::max(sample_interval, 1)),
+      dictionary_size_(std::min(dictionary_size, kMaxDictionarySize)),
+      worker_(worker),
+      mutex_(mutex),
+      done_(done),
+      values_seen_(0),
+      building_(false),
+      finished_(false) {
+}
+
+CacheDictionaryBuilder::~CacheDictionaryBuilder() {
+}
+
+void CacheDictionaryBuilder::AddSample(StringPiece value) {
+  {
+    ScopedMutex lock(mutex_.get());
+    if (building_ || (values_seen_++ % sample_interval_) != 0) {
+      return;
+    }
+    if (static_cast<int>(samples_.size()) < num_samples_) {
+      samples_.push_back(value.substr(0, kMaxSampleSize).as_string());
+      if (static_cast<int>(samples_.size()) < num_samples_) {
+        return;
+      }
+    }
+    building_ = true;
+  }
+  worker_->RunIfNotBusy(new BuildFunction(this));
+}
+
+void CacheDictionaryBuilder::BuildDictionary() {
+  StringVector samples;
+  {
+    ScopedMutex lock(mutex_.get());
+    samples.swap(samples_);
+  }
+  GoogleString dictionary = Build(samples, dictionary_size_);
+  Callback1<const GoogleString&>* done;
+  {
+    ScopedMutex lock(mutex_.get());
+    finished_ = true;
+    done = done_.release();
+  }
+  done->Run(dictionary);
+}
+
+void CacheDictionaryBuilder::BuildCancelled() {
+  ScopedMutex lock(mutex_.get());
+  building_ = false;
+}
+
+bool CacheDictionaryBuilder::finished() const {
+  ScopedMutex lock(mutex_.get());
+  return finished_;
+}
+
+GoogleString CacheDictionaryBuilder::Build(const StringVector& samples,
+                                           int max_size) {
+  // Hash every segment of every sample, and sort so that the occurrences of
+  // each segment end up next to each other.
+  std::vector<Occurrence> occurrences;
+  for (int i = 0, n = samples.size(); i < n; ++i) {
+    const GoogleString& sample = samples[i];
+    int size = sample.size();
+    if (size < kSegmentSize) {
+      continue;
+    }
+    Occurrence occurrence;
+    occurrence.sample = i;
+    occurrence.hash = RollingHash(sample.data(), 0, kSegmentSize);
+    for (int offset = 0; ; ) {
+      occurrence.offset = offset;
+      occurrences.push_back(occurrence);
+      if (++offset + kSegmentSize > size) {
+        break;
+      }
+      occurrence.hash = NextRollingHash(sample.data(), offset, kSegmentSize,
+                                        occurrence.hash);
+    }
+  }
+  std::sort(occurrences.begin(), occurrences.end());
+
+  // Count the samples each segment appears in.  We ignore hash collisions:
+  // they only make the dictionary a little worse.
+  std::vector<Candidate> candidates;
+  for (int i = 0, n = occurrences.size(); i < n; ) {
+    Candidate candidate;
+    candidate.count = 1;
+    candidate.sample = occurrences[i].sample;
+    candidate.offset = occurrences[i].offset;
+    int j = i + 1;
+    for (; (j < n) && (occurrences[j].hash == occurrences[i].hash); ++j) {
+      if (occurrences[j].sample != occurrences[j - 1].sample) {
+        ++candidate.count;
+      }
+    }
+    if (candidate.count > 1) {
+      candidates.push_back(candidate);
+    }
+    i = j;
+  }
+  std::sort(candidates.begin(), candidates.end());
+  occurrences.clear();
+
+  // Mark the most common segments as chosen, in place in their samples, so
+  // overlapping and adjacent segments become one longer run.  We remember,
+  // for each chosen byte, how common the most common segment covering it
+  // was.
+  std::vector<std::vector<int> > chosen(samples.size());
+  int dictionary_size = 0;
+  for (int i = 0, n = candidates.size();
+       (i < n) && (dictionary_size < max_size); ++i) {
+    const Candidate& candidate = candidates[i];
+    std::vector<int>* counts = &chosen[candidate.sample];
+    if (counts->empty()) {
+      counts->resize(samples[candidate.sample].size(), 0);
+    }
+    for (int offset = candidate.offset;
+         (offset < candidate.offset + kSegmentSize) &&
+         (dictionary_size < max_size);
+         ++offset) {
+      if ((*counts)[offset] == 0) {
+        (*counts)[offset] = candidate.count;
+        ++dictionary_size;
+      }
+    }
+  }
+
+  std::vector<Run> runs;
+  for (int i = 0, n = chosen.size(); i < n; ++i) {
+    const std::vector<int>& counts = chosen[i];
+    for (int offset = 0, size = counts.size(); offset < size; ) {
+      if (counts[offset] == 0) {
+        ++offset;
+        continue;
+      }
+      Run run;
+      run.count = 0;
+      run.sample = i;
+      run.offset = offset;
+      for (; (offset < size) && (counts[offset] != 0); ++offset) {
+        run.count = std::max(run.count, counts[offset]);
+      }
+      run.size = offset - run.offset;
+      runs.push_back(run);
+    }
+  }
+  std::sort(runs.begin(), runs.end());
+
+  GoogleString dictionary;
+  dictionary.reserve(dictionary_size);
+  for (int i = 0, n = runs.size(); i < n; ++i) {
+    const Run& run = runs[i];
+    dictionary.append(samples[run.sample], run.offset, run.size);
+  }
+  DCHECK_LE(static_cast<int>(dictionary.size()), max_size);
+  return dictionary;
+}
+
+}  // namespace net_instaweb
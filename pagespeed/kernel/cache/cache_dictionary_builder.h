@@ -0,0 +1,91 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_CACHE_DICTIONARY_BUILDER_H_
+#define PAGESPEED_KERNEL_CACHE_CACHE_DICTIONARY_BUILDER_H_
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/callback.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+
+namespace net_instaweb {
+
+class SlowWorker;
+
+// Trains a preset dictionary for DeflateCacheCodec on a sample of the values
+// written to a cache.  Cached metadata is mostly small serialized protobufs
+// that repeat the same URLs, field layouts and header names; with those in
+// the dictionary, each value only has to encode what makes it different.
+class CacheDictionaryBuilder {
+ public:
+  // zlib only looks back 32KB, so a larger dictionary wouldn't help.
+  static const int kMaxDictionarySize = 32 * 1024;
+
+  // Only the start of larger values is sampled.
+  static const int kMaxSampleSize = 4 * 1024;
+
+  // Keeps every sample_interval'th value passed to AddSample until it has
+  // num_samples of them, then builds a dictionary of up to dictionary_size
+  // bytes on worker and passes it to done there.  Takes ownership of mutex
+  // and done.
+  CacheDictionaryBuilder(int num_samples, int sample_interval,
+                         int dictionary_size, SlowWorker* worker,
+                         AbstractMutex* mutex,
+                         Callback1<const GoogleString&>* done);
+  ~CacheDictionaryBuilder();
+
+  // Offers a value written to the cache.  Once the sample is complete this
+  // does nothing, unless the worker was too busy to build the dictionary,
+  // in which case the next sampled value tries again.
+  void AddSample(StringPiece value) LOCKS_EXCLUDED(mutex_);
+
+  // Returns whether the dictionary has been built and passed to done.
+  bool finished() const LOCKS_EXCLUDED(mutex_);
+
+  // Builds a dictionary of at most max_size bytes from samples.  It is made
+  // up of the byte ranges that recur in the most samples, with the most
+  // common ones at the end, where zlib can refer to them most cheaply.
+  // Returns an empty dictionary if nothing recurs.
+  static GoogleString Build(const StringVector& samples, int max_size);
+
+ private:
+  class BuildFunction;
+
+  // Run on the worker.
+  void BuildDictionary() LOCKS_EXCLUDED(mutex_);
+  void BuildCancelled() LOCKS_EXCLUDED(mutex_);
+
+  const int num_samples_;
+  const int sample_interval_;
+  const int dictionary_size_;
+  SlowWorker* worker_;
+  scoped_ptr<AbstractMutex> mutex_;
+  scoped_ptr<Callback1<const GoogleString&> > done_;
+  int64 values_seen_ GUARDED_BY(mutex_);
+  bool building_ GUARDED_BY(mutex_);  // Queued, running or finished.
+  bool finished_ GUARDED_BY(mutex_);
+  StringVector samples_ GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(CacheDictionaryBuilder);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_CACHE_DICTIONARY_BUILDER_H_
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the cache dictionary builder.
+
+#include "pagespeed/kernel/cache/cache_dictionary_builder.h"
+
+#include <unistd.h>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/callback.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/string_writer.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/thread/slow_worker.h"
+#include "pagespeed/kernel/util/gzip_inflater.h"
+#include "pagespeed/kernel/util/platform.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kCommon[] = "Content-Type: text/css; charset=utf-8";
+const char kLessCommon[] = "Cache-Control: max-age=31536000";
+
+class CacheDictionaryBuilderTest : public testing::Test {
+ protected:
+  CacheDictionaryBuilderTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        worker_("dictionary_builder", thread_system_.get()),
+        runs_(0) {
+  }
+
+  CacheDictionaryBuilder* NewBuilder(int num_samples, int sample_interval) {
+    return new CacheDictionaryBuilder(
+        num_samples, sample_interval, 1000, &worker_,
+        thread_system_->NewMutex(), NewDictionaryCallback());
+  }
+
+  void WaitForWorker() {
+    while (worker_.IsBusy()) {
+      usleep(10);
+    }
+  }
+
+  void DictionaryReady(const GoogleString& dictionary) {
+    dictionary_ = dictionary;
+    ++runs_;
+  }
+
+  Callback1<const GoogleString&>* NewDictionaryCallback() {
+    return NewCallback(this, &CacheDictionaryBuilderTest::DictionaryReady);
+  }
+
+  int DeflatedSize(StringPiece value, StringPiece dictionary) {
+    GoogleString deflated;
+    StringWriter writer(&deflated);
+    EXPECT_TRUE(GzipInflater::DeflateWithDictionary(value, 9, dictionary,
+                                                    &writer));
+    return deflated.size();
+  }
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  SlowWorker worker_;
+  GoogleString dictionary_;
+  int runs_;
+};
+
+TEST_F(CacheDictionaryBuilderTest, MostCommonAtEnd) {
+  StringVector samples;
+  for (int i = 0; i < 10; ++i) {
+    // Surround the common parts with a character no other sample has.
+    GoogleString unique(1, 'a' + i);
+    GoogleString sample = StrCat(unique, kCommon, unique);
+    if (i % 2 == 0) {
+      StrAppend(&sample, kLessCommon, unique);
+    }
+    samples.push_back(sample);
+  }
+  GoogleString dictionary = CacheDictionaryBuilder::Build(samples, 1000);
+  EXPECT_EQ(StrCat(kLessCommon, kCommon), dictionary);
+
+  // When space is short, the most common content is kept.
+  EXPECT_EQ(StringPiece(kCommon).substr(0, 20),
+            CacheDictionaryBuilder::Build(samples, 20));
+
+  // And the dictionary helps with values like the samples.
+  GoogleString value = StrCat("42", kCommon, "99", kLessCommon);
+  EXPECT_GT(DeflatedSize(value, ""), DeflatedSize(value, dictionary) + 20);
+}
+
+TEST_F(CacheDictionaryBuilderTest, NothingRecurs) {
+  StringVector samples;
+  samples.push_back(kCommon);
+  samples.push_back(kLessCommon);
+  samples.push_back("short");
+  EXPECT_EQ("", CacheDictionaryBuilder::Build(samples, 1000));
+  EXPECT_EQ("", CacheDictionaryBuilder::Build(StringVector(), 1000));
+}
+
+TEST_F(CacheDictionaryBuilderTest, Sampling) {
+  worker_.Start();
+  scoped_ptr<CacheDictionaryBuilder> builder(
+      NewBuilder(2 /* num_samples */, 3 /* sample_interval */));
+
+  // Only the 1st and 4th values are sampled.  The dictionary is built on
+  // the worker.
+  builder->AddSample(kCommon);
+  builder->AddSample(kLessCommon);
+  builder->AddSample(kLessCommon);
+  WaitForWorker();
+  EXPECT_FALSE(builder->finished());
+  EXPECT_EQ(0, runs_);
+  builder->AddSample(StrCat("x", kCommon));
+  WaitForWorker();
+  EXPECT_TRUE(builder->finished());
+  EXPECT_EQ(1, runs_);
+  EXPECT_EQ(kCommon, dictionary_);
+
+  builder->AddSample(kCommon);
+  WaitForWorker();
+  EXPECT_EQ(1, runs_);
+}
+
+TEST_F(CacheDictionaryBuilderTest, RetriesWhenWorkerRejects) {
+  // A worker that hasn't been started cancels what it is given, like a
+  // busy one.
+  scoped_ptr<CacheDictionaryBuilder> builder(
+      NewBuilder(2 /* num_samples */, 1 /* sample_interval */));
+  builder->AddSample(kCommon);
+  builder->AddSample(StrCat("x", kCommon));
+  EXPECT_FALSE(builder->finished());
+  EXPECT_EQ(0, runs_);
+
+  // The next sampled value tries again, with the samples already taken.
+  worker_.Start();
+  builder->AddSample(kLessCommon);
+  WaitForWorker();
+  EXPECT_TRUE(builder->finished());
+  EXPECT_EQ(1, runs_);
+  EXPECT_EQ(kCommon, dictionary_);
+}
+
+}  // namespace
+
+}  // namespace net_instaweb
@@ -102,6 +102,18 @@ void CacheStats::InitStats(StringPiece prefix, Statistics* statistics) {
   statistics->AddVariable(StrCat(prefix, kMisses));
 }
 
+int64 CacheStats::HitRatioPercent(StringPiece prefix,
+                                  Statistics* statistics) {
+  Variable* hits = statistics->FindVariable(StrCat(prefix, kHits));
+  Variable* misses = statistics->FindVariable(StrCat(prefix, kMisses));
+  if (hits == NULL || misses == NULL) {
+    return -1;
+  }
+  int64 num_hits = hits->Get();
+  int64 total = num_hits + misses->Get();
+  return (total == 0) ? -1 : (100 * num_hits) / total;
+}
+
 class CacheStats::StatsCallback : public DelegatingCacheCallback {
  public:
   StatsCallback(CacheStats* stats,
@@ -49,6 +49,11 @@ class CacheStats : public CacheInterface {
   // This must be called once for every unique cache prefix.
   static void InitStats(StringPiece prefix, Statistics* statistics);
 
+  // Returns the percentage of lookups through caches with the given prefix
+  // that hit, or -1 if there have been none.  This is computed from the hit
+  // and miss counts when asked for, rather than on every lookup.
+  static int64 HitRatioPercent(StringPiece prefix, Statistics* statistics);
+
   virtual void Get(const GoogleString& key, Callback* callback);
   virtual void MultiGet(MultiGetRequest* request);
   virtual void Put(const GoogleString& key, const SharedString& value);
@@ -101,6 +101,20 @@ TEST_F(CacheStatsTest, BasicOperation) {
   // EXPECT_EQ(1, latency->Count());
 }
 
+TEST_F(CacheStatsTest, HitRatioPercent) {
+  EXPECT_EQ(-1, CacheStats::HitRatioPercent("test", &stats_));
+  EXPECT_EQ(-1, CacheStats::HitRatioPercent("no such prefix", &stats_));
+
+  cache_stats_->Put("key", SharedString("val"));
+  CacheTestBase::Callback callback;
+  cache_stats_->Get("key", &callback);
+  EXPECT_EQ(100, CacheStats::HitRatioPercent("test", &stats_));
+  cache_stats_->Get("key", callback.Reset());
+  cache_stats_->Get("no such key", callback.Reset());
+  cache_stats_->Get("no such key", callback.Reset());
+  EXPECT_EQ(50, CacheStats::HitRatioPercent("test", &stats_));
+}
+
 TEST_F(CacheStatsTest, Backend) {
   EXPECT_EQ(delay_cache_.get(), cache_stats_->Backend());
 }
@@ -24,7 +24,10 @@
 #include "pagespeed/kernel/base/statistics.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/string_writer.h"
+#include "pagespeed/kernel/cache/cache_codec.h"
+#include "pagespeed/kernel/cache/cache_dictionary_builder.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/kernel/cache/cache_key_prepender.h"
 #include "pagespeed/kernel/util/gzip_inflater.h"
 
 namespace net_instaweb {
@@ -35,6 +38,28 @@ namespace {
 // corruption.  Note that CompressedCacheTest.CrapAtEnd fails without this.
 const char kTrailer[] = "[[]]";
 
+// Payloads written with a CacheCodec end with "[[" codec-id "]]" instead.
+const int kCodecTrailerSize = 5;
+
+void AppendCodecTrailer(char codec_id, GoogleString* buf) {
+  buf->append("[[");
+  buf->push_back(codec_id);
+  buf->append("]]");
+}
+
+// Returns the id in the codec trailer of payload, or '\0' if it has none.
+char CodecId(StringPiece payload) {
+  if (payload.size() < static_cast<size_t>(kCodecTrailerSize)) {
+    return '\0';
+  }
+  StringPiece trailer = payload.substr(payload.size() - kCodecTrailerSize);
+  if (!trailer.starts_with("[[") || !trailer.ends_with("]]") ||
+      (trailer[2] == ']')) {
+    return '\0';
+  }
+  return trailer[2];
+}
+
 // TODO(jmarantz): Evaluate the impact of histogramming the size reduction of
 // each entry.  The compressed_cache_speed_test.cc side-steps this because
 // SimpleStats doesn't implement histograms.  See split_statistics_test.cc:93
@@ -53,8 +78,9 @@ const char kCompressedCacheCorruptPayloads[] =
 class CompressedCallback : public CacheInterface::Callback {
  public:
   CompressedCallback(CacheInterface::Callback* callback,
-                     Variable* corrupt_payloads)
+                     const CacheCodec* codec, Variable* corrupt_payloads)
       : callback_(callback),
+        codec_(codec),
         corrupt_payloads_(corrupt_payloads),
         validate_candidate_called_(false) {
   }
@@ -67,13 +93,7 @@ class CompressedCallback : public CacheInterface::Callback {
     bool ret = false;
     if (state == CacheInterface::kAvailable) {
       GoogleString uncompressed;
-      StringWriter writer(&uncompressed);
-      StringPiece compressed = value().Value();
-      if (strings::EndsWith(compressed,
-                            StringPiece(kTrailer, STATIC_STRLEN(kTrailer))) &&
-          GzipInflater::Inflate(
-              compressed.substr(0, compressed.size() - STATIC_STRLEN(kTrailer)),
-              GzipInflater::kDeflate, &writer)) {
+      if (Decompress(value().Value(), &uncompressed)) {
         SharedString uncompressed_shared;
         uncompressed_shared.SwapWithString(&uncompressed);
         callback_->set_value(uncompressed_shared);
@@ -93,7 +113,22 @@ class CompressedCallback : public CacheInterface::Callback {
     delete this;
   }
 
+  bool Decompress(StringPiece compressed, GoogleString* uncompressed) {
+    if (strings::EndsWith(compressed,
+                          StringPiece(kTrailer, STATIC_STRLEN(kTrailer)))) {
+      StringWriter writer(uncompressed);
+      return GzipInflater::Inflate(
+          compressed.substr(0, compressed.size() - STATIC_STRLEN(kTrailer)),
+          GzipInflater::kDeflate, &writer);
+    }
+    return ((codec_ != NULL) && (CodecId(compressed) == codec_->id()) &&
+            codec_->Decode(
+                compressed.substr(0, compressed.size() - kCodecTrailerSize),
+                uncompressed));
+  }
+
   Callback* callback_;
+  const CacheCodec* codec_;
   Variable* corrupt_payloads_;
   bool validate_candidate_called_;
 };
@@ -101,22 +136,57 @@ class CompressedCallback : public CacheInterface::Callback {
 }  // namespace
 
 CompressedCache::CompressedCache(CacheInterface* cache, Statistics* stats)
-    : cache_(cache) {
+    : cache_(cache),
+      backend_(cache) {
+#if INCLUDE_HISTOGRAMS
+  compressed_cache_savings_ = stats->GetHistogram(kCompressedCacheSavings);
+#endif
+  corrupt_payloads_ = stats->GetVariable(kCompressedCacheCorruptPayloads);
+  original_size_ = stats->GetVariable(kCompressedCacheOriginalSize);
+  compressed_size_ = stats->GetVariable(kCompressedCacheCompressedSize);
+}
+
+CompressedCache::CompressedCache(CacheInterface* cache, CacheCodec* codec,
+                                 Statistics* stats)
+    : cache_(cache),
+      codec_(codec),
+      backend_(cache) {
 #if INCLUDE_HISTOGRAMS
   compressed_cache_savings_ = stats->GetHistogram(kCompressedCacheSavings);
 #endif
   corrupt_payloads_ = stats->GetVariable(kCompressedCacheCorruptPayloads);
   original_size_ = stats->GetVariable(kCompressedCacheOriginalSize);
   compressed_size_ = stats->GetVariable(kCompressedCacheCompressedSize);
+  GoogleString dictionary_id = codec_->dictionary_id();
+  if (!dictionary_id.empty()) {
+    dictionary_keyed_cache_.reset(
+        new CacheKeyPrepender(StrCat("dict", dictionary_id, "/"), cache));
+    backend_ = dictionary_keyed_cache_.get();
+  }
 }
 
 CompressedCache::~CompressedCache() {
 }
 
+void CompressedCache::set_dictionary_builder(CacheDictionaryBuilder* builder) {
+  dictionary_builder_.reset(builder);
+}
+
+GoogleString CompressedCache::Name() const {
+  if (codec_.get() == NULL) {
+    return FormatName(cache_->Name());
+  }
+  return FormatName(codec_->name(), cache_->Name());
+}
+
 GoogleString CompressedCache::FormatName(StringPiece name) {
   return StrCat("Compressed(", name, ")");
 }
 
+GoogleString CompressedCache::FormatName(StringPiece codec, StringPiece name) {
+  return StrCat("Compressed(", codec, ",", name, ")");
+}
+
 void CompressedCache::InitStats(Statistics* statistics) {
 #if INCLUDE_HISTOGRAMS
   statistics->AddHistogram(kCompressedCacheSavings);
@@ -127,29 +197,40 @@ void CompressedCache::InitStats(Statistics* statistics) {
 }
 
 void CompressedCache::Get(const GoogleString& key, Callback* callback) {
-  CompressedCallback* cb = new CompressedCallback(callback, corrupt_payloads_);
-  cache_->Get(key, cb);
+  CompressedCallback* cb = new CompressedCallback(callback, codec_.get(),
+                                                  corrupt_payloads_);
+  backend_->Get(key, cb);
 }
 
 void CompressedCache::Put(const GoogleString& key, const SharedString& value) {
   int64 old_size = value.size();
   GoogleString buf;
   buf.reserve(old_size + STATIC_STRLEN(kTrailer));
-  StringWriter writer(&buf);
   original_size_->Add(old_size);
-  if (GzipInflater::Deflate(value.Value(), GzipInflater::kDeflate, &writer)) {
+  if (dictionary_builder_.get() != NULL) {
+    dictionary_builder_->AddSample(value.Value());
+  }
+  bool ok;
+  if (codec_.get() == NULL) {
+    StringWriter writer(&buf);
+    ok = GzipInflater::Deflate(value.Value(), GzipInflater::kDeflate, &writer);
     buf.append(kTrailer, STATIC_STRLEN(kTrailer));
+  } else {
+    ok = codec_->Encode(value.Value(), &buf);
+    AppendCodecTrailer(codec_->id(), &buf);
+  }
+  if (ok) {
 #if INCLUDE_HISTOGRAMS
     compressed_cache_savings_->Add(
         old_size - static_cast<int64>(buf.size()));
 #endif
     compressed_size_->Add(buf.size());
-    cache_->PutSwappingString(key, &buf);
+    backend_->PutSwappingString(key, &buf);
   }
 }
 
 void CompressedCache::Delete(const GoogleString& key) {
-  cache_->Delete(key);
+  backend_->Delete(key);
 }
 
 bool CompressedCache::IsHealthy() const {
@@ -20,6 +20,7 @@
 #define PAGESPEED_KERNEL_CACHE_COMPRESSED_CACHE_H_
 
 #include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
@@ -27,6 +28,8 @@
 
 namespace net_instaweb {
 
+class CacheCodec;
+class CacheDictionaryBuilder;
 class Histogram;
 class Statistics;
 class Variable;
@@ -36,15 +39,27 @@ class CompressedCache : public CacheInterface {
  public:
   // Does not takes ownership of cache or stats.
   CompressedCache(CacheInterface* cache, Statistics* stats);
+
+  // Compresses with codec, which we take ownership of, instead of the
+  // default deflate.  Values written by a default CompressedCache can still
+  // be read, but not values written with a codec of another kind.  If the
+  // codec has a dictionary, keys are prefixed with its id, so that caches
+  // using different dictionaries don't see each other's values.
+  CompressedCache(CacheInterface* cache, CacheCodec* codec, Statistics* stats);
   virtual ~CompressedCache();
 
+  // Offers the values we are asked to Put to builder, which we take
+  // ownership of.
+  void set_dictionary_builder(CacheDictionaryBuilder* builder);
+
   static void InitStats(Statistics* stats);
 
   virtual void Get(const GoogleString& key, Callback* callback);
   virtual void Put(const GoogleString& key, const SharedString& value);
   virtual void Delete(const GoogleString& key);
-  virtual GoogleString Name() const { return FormatName(cache_->Name()); }
+  virtual GoogleString Name() const;
   static GoogleString FormatName(StringPiece cache);
+  static GoogleString FormatName(StringPiece codec, StringPiece cache);
   virtual CacheInterface* Backend() { return cache_; }
   virtual bool IsBlocking() const { return cache_->IsBlocking(); }
   virtual bool IsHealthy() const;
@@ -64,6 +79,11 @@ class CompressedCache : public CacheInterface {
 
  private:
   CacheInterface* cache_;
+  scoped_ptr<CacheCodec> codec_;  // NULL for the default deflate.
+  // Prefixes keys with the dictionary id; NULL if there is no dictionary.
+  scoped_ptr<CacheInterface> dictionary_keyed_cache_;
+  CacheInterface* backend_;  // cache_ or dictionary_keyed_cache_.
+  scoped_ptr<CacheDictionaryBuilder> dictionary_builder_;
   Histogram* compressed_cache_savings_;
   Variable* corrupt_payloads_;
   Variable* original_size_;
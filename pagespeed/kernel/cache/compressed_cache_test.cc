@@ -18,18 +18,24 @@
 
 #include "pagespeed/kernel/cache/compressed_cache.h"
 
+#include <unistd.h>
 #include <cstddef>
 
+#include "pagespeed/kernel/base/callback.h"
 #include "pagespeed/kernel/base/google_message_handler.h"
 #include "pagespeed/kernel/base/gtest.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/stack_buffer.h"
 #include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/cache/cache_codec.h"
+#include "pagespeed/kernel/cache/cache_dictionary_builder.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
 #include "pagespeed/kernel/cache/cache_test_base.h"
 #include "pagespeed/kernel/cache/lru_cache.h"
+#include "pagespeed/kernel/thread/slow_worker.h"
 #include "pagespeed/kernel/util/platform.h"
 #include "pagespeed/kernel/util/simple_random.h"
 #include "pagespeed/kernel/util/simple_stats.h"
@@ -62,6 +68,23 @@ class CompressedCacheTest : public CacheTestBase {
     return ret;
   }
 
+  // Switches to a cache using the named codec, on the same LRU cache.
+  void UseCodec(StringPiece name, StringPiece dictionary) {
+    CacheCodec* codec = CacheCodec::Create(name, dictionary);
+    ASSERT_TRUE(codec != NULL);
+    compressed_cache_.reset(
+        new CompressedCache(lru_cache_.get(), codec, &stats_));
+  }
+
+  void DictionaryReady(const GoogleString& dictionary) {
+    dictionary_ = dictionary;
+  }
+
+  Callback1<const GoogleString&>* NewDictionaryCallback() {
+    return net_instaweb::NewCallback(this,
+                                     &CompressedCacheTest::DictionaryReady);
+  }
+
   virtual CacheInterface* Cache() { return compressed_cache_.get(); }
 
   GoogleMessageHandler handler_;
@@ -70,6 +93,7 @@ class CompressedCacheTest : public CacheTestBase {
   SimpleStats stats_;
   scoped_ptr<CompressedCache> compressed_cache_;
   SimpleRandom random_;
+  GoogleString dictionary_;
 };
 
 // Simple flow of putting in an item, getting it, deleting it.
@@ -181,4 +205,123 @@ TEST_F(CompressedCacheTest, RemoveOneByteFromMiddle) {
   EXPECT_EQ(1, compressed_cache_->CorruptPayloads());
 }
 
+TEST_F(CompressedCacheTest, Codecs) {
+  const char* kCodecs[] = {
+    CacheCodec::kDeflate, CacheCodec::kBrotli, CacheCodec::kBrotliFast
+  };
+  GoogleString large = random_.GenerateHighEntropyString(5 * kStackBufferSize);
+  for (int i = 0, n = arraysize(kCodecs); i < n; ++i) {
+    UseCodec(kCodecs[i], "");
+    EXPECT_EQ(StrCat("Compressed(", kCodecs[i], ",LRUCache)"),
+              compressed_cache_->Name());
+    CheckPut("Name", "Value");
+    CheckGet("Name", "Value");
+    CheckPut("Empty", "");
+    CheckGet("Empty", "");
+    CheckPut("Large", large);
+    CheckGet("Large", large);
+    Cache()->Delete("Name");
+    CheckNotFound("Name");
+  }
+  EXPECT_EQ(0, compressed_cache_->CorruptPayloads());
+}
+
+TEST_F(CompressedCacheTest, CodecCrapAtEnd) {
+  UseCodec(CacheCodec::kBrotli, "");
+  CheckPut("key", "garbage");
+  GoogleString raw_value = GetRawValue("key");
+  StrAppend(&raw_value, "crap");
+  lru_cache_->PutSwappingString("key", &raw_value);
+  CheckNotFound("key");
+  EXPECT_EQ(1, compressed_cache_->CorruptPayloads());
+}
+
+TEST_F(CompressedCacheTest, CodecReadsDefaultPayloads) {
+  CheckPut("key", "value");
+  UseCodec(CacheCodec::kDeflate, "");
+  CheckGet("key", "value");
+
+  // But the default cache can't read what the codec writes.
+  CheckPut("key", "new value");
+  compressed_cache_.reset(new CompressedCache(lru_cache_.get(), &stats_));
+  CheckNotFound("key");
+  EXPECT_EQ(1, compressed_cache_->CorruptPayloads());
+}
+
+TEST_F(CompressedCacheTest, CodecRejectsOtherCodec) {
+  UseCodec(CacheCodec::kBrotli, "");
+  CheckPut("key", "value");
+  UseCodec(CacheCodec::kDeflate, "");
+  CheckNotFound("key");
+  EXPECT_EQ(1, compressed_cache_->CorruptPayloads());
+}
+
+TEST_F(CompressedCacheTest, BrotliReadsBrotliFast) {
+  // Both decode the same way, so each reads what the other writes.
+  UseCodec(CacheCodec::kBrotliFast, "");
+  CheckPut("key", "value");
+  UseCodec(CacheCodec::kBrotli, "");
+  CheckGet("key", "value");
+  EXPECT_EQ(0, compressed_cache_->CorruptPayloads());
+}
+
+TEST_F(CompressedCacheTest, Dictionary) {
+  const char kDictionary[] = "http://example.com/styles/main.css";
+  const char kValue[] = "http://example.com/styles/main.css?v=2";
+  UseCodec(CacheCodec::kDeflate, "");
+  CheckPut("key", kValue);
+  int64 size_without_dictionary = GetRawValue("key").size();
+  UseCodec(CacheCodec::kDeflate, kDictionary);
+  CheckPut("key", kValue);
+  CheckGet("key", kValue);
+
+  // The value is stored under a key naming the dictionary.
+  scoped_ptr<CacheCodec> codec(
+      CacheCodec::Create(CacheCodec::kDeflate, kDictionary));
+  GoogleString dictionary_key = StrCat("dict", codec->dictionary_id(), "/key");
+  EXPECT_GT(size_without_dictionary, GetRawValue(dictionary_key).size());
+
+  // Caches with another dictionary use other keys, so they neither read
+  // nor overwrite the value.
+  UseCodec(CacheCodec::kDeflate, "a different dictionary");
+  CheckNotFound("key");
+  CheckPut("key", "other");
+  UseCodec(CacheCodec::kDeflate, kDictionary);
+  CheckGet("key", kValue);
+  EXPECT_EQ(0, compressed_cache_->CorruptPayloads());
+}
+
+TEST_F(CompressedCacheTest, DictionaryId) {
+  scoped_ptr<CacheCodec> plain(CacheCodec::Create(CacheCodec::kDeflate, ""));
+  scoped_ptr<CacheCodec> first(
+      CacheCodec::Create(CacheCodec::kDeflate, "dictionary"));
+  scoped_ptr<CacheCodec> second(
+      CacheCodec::Create(CacheCodec::kDeflate, GoogleString("dictionary")));
+  scoped_ptr<CacheCodec> other(
+      CacheCodec::Create(CacheCodec::kDeflate, "other dictionary"));
+  EXPECT_EQ("", plain->dictionary_id());
+  EXPECT_EQ(16U, first->dictionary_id().size());
+  EXPECT_EQ(first->dictionary_id(), second->dictionary_id());
+  EXPECT_NE(first->dictionary_id(), other->dictionary_id());
+}
+
+TEST_F(CompressedCacheTest, DictionaryBuilder) {
+  SlowWorker worker("dictionary_builder", thread_system_.get());
+  worker.Start();
+  UseCodec(CacheCodec::kDeflate, "");
+  compressed_cache_->set_dictionary_builder(new CacheDictionaryBuilder(
+      3 /* num_samples */, 2 /* sample_interval */,
+      CacheDictionaryBuilder::kMaxDictionarySize, &worker,
+      thread_system_->NewMutex(), NewDictionaryCallback()));
+  for (int i = 0; i < 5; ++i) {
+    CheckPut(IntegerToString(i),
+             StrCat("http://example.com/images/", IntegerToString(i),
+                    "/photograph.jpg"));
+  }
+  while (worker.IsBusy()) {
+    usleep(10);
+  }
+  EXPECT_EQ("http://example.com/images/", dictionary_);
+}
+
 }  // namespace net_instaweb
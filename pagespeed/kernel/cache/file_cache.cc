@@ -52,8 +52,65 @@ struct CompareByAtime {
   }
 };
 
+// MemFileSystem lists directories with a trailing slash, StdioFileSystem
+// without.
+StringPiece StripTrailingSlash(StringPiece path) {
+  if (path.ends_with("/")) {
+    path.remove_suffix(1);
+  }
+  return path;
+}
+
+// Sorts directory entries in the order WalkSlice visits them, which must not
+// depend on whether directories are listed with a trailing slash.
+struct CompareAsEntries {
+ public:
+  bool operator()(const GoogleString& one, const GoogleString& two) const {
+    return StripTrailingSlash(one) < StripTrailingSlash(two);
+  }
+};
+
 }  // namespace
 
+// A pass of incremental cleaning: its budget and what it found.
+struct FileCache::CleanSlice {
+  CleanSlice() : files_left(0), size_bytes(0), inode_count(0),
+                 inodes_removed(0) {}
+
+  // Entries that may still be looked at or deleted in this pass.
+  int64 files_left;
+  // The last entry visited.  A trailing slash means that the walk stopped
+  // right after entering the directory.
+  GoogleString last_visited;
+  std::vector<FileSystem::FileInfo> files;
+  int64 size_bytes;
+  int64 inode_count;
+  // Empty directories removed while walking.
+  int64 inodes_removed;
+};
+
+// Incremental cleaning progress, shared between processes through the clean
+// state file.
+struct FileCache::CleanState {
+  CleanState() : estimated_size_bytes(0), estimated_inode_count(0),
+                 sweep_size_bytes(0), sweep_inode_count(0), last_pass_ms(0),
+                 evicting(false) {}
+
+  // Size of the whole cache, as of the last pass.
+  int64 estimated_size_bytes;
+  int64 estimated_inode_count;
+  // Size of the part of the cache visited by the current sweep, plus
+  // everything written since it started.  When the sweep completes this
+  // replaces the estimate, correcting for overwritten and deleted files.
+  int64 sweep_size_bytes;
+  int64 sweep_inode_count;
+  int64 last_pass_ms;
+  // Whether we are bringing the cache back down to 3/4 of its targets.
+  bool evicting;
+  // Where the current sweep left off, empty at the start of a sweep.
+  GoogleString cursor;
+};
+
 class FileCache::CacheCleanFunction : public Function {
  public:
   CacheCleanFunction(FileCache* cache, int64 next_clean_time_ms)
@@ -76,12 +133,18 @@ const char FileCache::kEvictions[] = "file_cache_evictions";
 const char FileCache::kSkippedCleanups[] = "file_cache_skipped_cleanups";
 const char FileCache::kStartedCleanups[] = "file_cache_started_cleanups";
 const char FileCache::kWriteErrors[] = "file_cache_write_errors";
+const char FileCache::kCleanPasses[] = "file_cache_clean_passes";
+const char FileCache::kFilesScanned[] = "file_cache_files_scanned";
+const char FileCache::kCleanSweeps[] = "file_cache_clean_sweeps";
+const char FileCache::kEstimatedSizeBytes[] =
+    "file_cache_estimated_size_bytes";
 
 // Filenames for the next scheduled clean time and the lockfile.  In
 // order to prevent these from colliding with actual cachefiles, they
 // contain characters that our filename encoder would escape.
 const char FileCache::kCleanTimeName[] = "!clean!time!";
 const char FileCache::kCleanLockName[] = "!clean!lock!";
+const char FileCache::kCleanStateName[] = "!clean!state!";
 
 // Be willing to wait for a cache cleaner that hasn't bumped it's lock file in
 // the last 5min.  A successful cache cleaner should be hitting it far more
@@ -94,6 +157,15 @@ namespace {
 // Bump the lock once out of this many calls to Notify().
 const int kLockBumpIntervalCycles = 1000;
 
+// Incremental cleaning runs a pass about this often.  A process that has not
+// had a chance to clean for a while gets a budget for at most
+// kMaxCleanPassBudgetMs, so it doesn't make up for lost time in a burst.
+const int64 kCleanPassIntervalMs = Timer::kSecondMs;
+const int64 kMaxCleanPassBudgetMs = 10 * Timer::kSecondMs;
+
+// First field of the clean state file.
+const char kCleanStateVersion[] = "1";
+
 class LockBumpingProgressNotifier : public FileSystem::ProgressNotifier {
  public:
   // Takes ownership of nothing.
@@ -139,9 +211,12 @@ FileCache::FileCache(const GoogleString& path, FileSystem* file_system,
       cache_policy_(policy),
       mutex_(thread_system->NewMutex()),
       next_clean_ms_(INT64_MAX),
+      unaccounted_size_bytes_(0),
+      unaccounted_inode_count_(0),
       path_length_limit_(file_system_->MaxPathLength(path)),
       clean_time_path_(path),
       clean_lock_path_(path),
+      clean_state_path_(path),
       notifier_for_tests_(nullptr),
       disk_checks_(stats->GetVariable(kDiskChecks)),
       cleanups_(stats->GetVariable(kCleanups)),
@@ -149,14 +224,20 @@ FileCache::FileCache(const GoogleString& path, FileSystem* file_system,
       bytes_freed_in_cleanup_(stats->GetVariable(kBytesFreedInCleanup)),
       skipped_cleanups_(stats->GetVariable(kSkippedCleanups)),
       started_cleanups_(stats->GetVariable(kStartedCleanups)),
-      write_errors_(stats->GetVariable(kWriteErrors)) {
+      write_errors_(stats->GetVariable(kWriteErrors)),
+      clean_passes_(stats->GetVariable(kCleanPasses)),
+      files_scanned_(stats->GetVariable(kFilesScanned)),
+      clean_sweeps_(stats->GetVariable(kCleanSweeps)),
+      estimated_size_bytes_(stats->GetUpDownCounter(kEstimatedSizeBytes)) {
   if (policy->cleaning_enabled()) {
-    next_clean_ms_ = policy->timer->NowMs() + policy->clean_interval_ms / 2;
+    next_clean_ms_ = policy->timer->NowMs() + CleanIntervalMs() / 2;
   }
   EnsureEndsInSlash(&clean_time_path_);
   StrAppend(&clean_time_path_, kCleanTimeName);
   EnsureEndsInSlash(&clean_lock_path_);
   StrAppend(&clean_lock_path_, kCleanLockName);
+  EnsureEndsInSlash(&clean_state_path_);
+  StrAppend(&clean_state_path_, kCleanStateName);
 }
 
 FileCache::~FileCache() {
@@ -170,6 +251,10 @@ void FileCache::InitStats(Statistics* statistics) {
   statistics->AddVariable(kSkippedCleanups);
   statistics->AddVariable(kStartedCleanups);
   statistics->AddVariable(kWriteErrors);
+  statistics->AddVariable(kCleanPasses);
+  statistics->AddVariable(kFilesScanned);
+  statistics->AddVariable(kCleanSweeps);
+  statistics->AddUpDownCounter(kEstimatedSizeBytes);
 }
 
 void FileCache::Get(const GoogleString& key, Callback* callback) {
@@ -194,6 +279,10 @@ void FileCache::Put(const GoogleString& key, const SharedString& value) {
       !file_system_->WriteFileAtomic(filename, value.Value(),
                                      message_handler_)) {
     write_errors_->Add(1);
+  } else if (cache_policy_->incremental_cleaning) {
+    ScopedMutex lock(mutex_.get());
+    unaccounted_size_bytes_ += value.size();
+    ++unaccounted_inode_count_;
   }
   CleanIfNeeded();
 }
@@ -348,6 +437,276 @@ bool FileCache::Clean(int64 target_size_bytes, int64 target_inode_count) {
   return everything_ok;
 }
 
+void FileCache::CleanIncrementally() {
+  DCHECK(cache_policy_->cleaning_enabled());
+  clean_passes_->Add(1);
+  const int64 now_ms = cache_policy_->timer->NowMs();
+  CleanState state;
+  ReadCleanState(&state);
+  {
+    ScopedMutex lock(mutex_.get());
+    state.estimated_size_bytes += unaccounted_size_bytes_;
+    state.sweep_size_bytes += unaccounted_size_bytes_;
+    state.estimated_inode_count += unaccounted_inode_count_;
+    state.sweep_inode_count += unaccounted_inode_count_;
+    unaccounted_size_bytes_ = 0;
+    unaccounted_inode_count_ = 0;
+  }
+
+  // The budget is proportional to the time since the last pass.
+  int64 elapsed_ms = now_ms - state.last_pass_ms;
+  if (state.last_pass_ms == 0 || elapsed_ms <= 0) {
+    elapsed_ms = kCleanPassIntervalMs;
+  }
+  elapsed_ms = std::min(elapsed_ms, kMaxCleanPassBudgetMs);
+  CleanSlice slice;
+  slice.files_left = std::max(
+      static_cast<int64>(1),
+      cache_policy_->clean_files_per_sec * elapsed_ms / Timer::kSecondMs);
+  int64 bytes_left = INT64_MAX;
+  if (cache_policy_->clean_bytes_per_sec > 0) {
+    bytes_left = std::max(
+        static_cast<int64>(1),
+        cache_policy_->clean_bytes_per_sec * elapsed_ms / Timer::kSecondMs);
+  }
+
+  LockBumpingProgressNotifier lock_bumping_notifier(
+      file_system_, &clean_lock_path_, message_handler_);
+  FileSystem::ProgressNotifier* notifier = &lock_bumping_notifier;
+  if (notifier_for_tests_ != NULL) {
+    notifier = notifier_for_tests_;
+  }
+  bool sweep_done = WalkSlice(path_, state.cursor, notifier, &slice);
+  files_scanned_->Add(slice.inode_count);
+
+  // Until the first sweep completes we only know a lower bound of the size.
+  int64 size_bytes = std::max(state.estimated_size_bytes,
+                              state.sweep_size_bytes + slice.size_bytes);
+  int64 inode_count = std::max(state.estimated_inode_count,
+                               state.sweep_inode_count + slice.inode_count) -
+      slice.inodes_removed;
+  const int64 target_size_bytes = cache_policy_->target_size_bytes;
+  const int64 target_inode_count = cache_policy_->target_inode_count;
+  if (size_bytes > target_size_bytes ||
+      (target_inode_count != 0 && inode_count > target_inode_count)) {
+    state.evicting = true;
+  }
+
+  int64 bytes_freed = 0;
+  int64 files_removed = 0;
+  if (state.evicting) {
+    // The files of a slice are an unbiased sample of the cache, as the walk
+    // order has nothing to do with access times.  So rather than finding the
+    // oldest files in the whole cache, we evict the oldest files of each
+    // slice, in the share needed to get back to 3/4 of the targets by the
+    // end of the sweep.
+    int64 excess_bytes = size_bytes - (target_size_bytes * 3) / 4;
+    int64 unswept_bytes = std::max(size_bytes - state.sweep_size_bytes,
+                                   slice.size_bytes);
+    int64 bytes_to_free = 0;
+    if (excess_bytes > 0 && unswept_bytes > 0) {
+      bytes_to_free = (slice.size_bytes * std::min(excess_bytes, unswept_bytes)
+                       + unswept_bytes - 1) / unswept_bytes;
+    }
+    int64 files_to_remove = 0;
+    if (target_inode_count != 0) {
+      int64 excess_inodes = inode_count - (target_inode_count * 3) / 4;
+      int64 unswept_inodes = std::max(inode_count - state.sweep_inode_count,
+                                      slice.inode_count);
+      if (excess_inodes > 0 && unswept_inodes > 0) {
+        files_to_remove =
+            (slice.inode_count * std::min(excess_inodes, unswept_inodes) +
+             unswept_inodes - 1) / unswept_inodes;
+      }
+    }
+
+    std::sort(slice.files.begin(), slice.files.end(), CompareByAtime());
+    for (int i = 0, n = slice.files.size();
+         i < n && slice.files_left > 0 &&
+             (bytes_freed < bytes_to_free || files_removed < files_to_remove);
+         ++i) {
+      const FileSystem::FileInfo& file = slice.files[i];
+      // Always allow one file, so a big file can't stall cleaning forever.
+      if (bytes_freed > 0 && file.size_bytes > bytes_left - bytes_freed) {
+        break;
+      }
+      notifier->Notify();
+      --slice.files_left;
+      if (file_system_->RemoveFile(file.name.c_str(), message_handler_)) {
+        bytes_freed += file.size_bytes;
+        ++files_removed;
+        evictions_->Add(1);
+      }
+    }
+    if (files_removed > 0) {
+      cleanups_->Add(1);
+      bytes_freed_in_cleanup_->Add(bytes_freed);
+    }
+  }
+
+  size_bytes -= bytes_freed;
+  inode_count -= files_removed;
+  if (size_bytes <= (target_size_bytes * 3) / 4 &&
+      (target_inode_count == 0 ||
+       inode_count <= (target_inode_count * 3) / 4)) {
+    state.evicting = false;
+  }
+  state.sweep_size_bytes += slice.size_bytes - bytes_freed;
+  state.sweep_inode_count +=
+      slice.inode_count - slice.inodes_removed - files_removed;
+  if (sweep_done) {
+    clean_sweeps_->Add(1);
+    state.estimated_size_bytes = state.sweep_size_bytes;
+    state.estimated_inode_count = state.sweep_inode_count;
+    state.sweep_size_bytes = 0;
+    state.sweep_inode_count = 0;
+    state.cursor.clear();
+    message_handler_->Message(
+        kInfo, "File cache sweep complete; cache size is about %s bytes in "
+        "%s inodes", Integer64ToString(state.estimated_size_bytes).c_str(),
+        Integer64ToString(state.estimated_inode_count).c_str());
+  } else {
+    state.estimated_size_bytes = size_bytes;
+    state.estimated_inode_count = inode_count;
+    state.cursor = slice.last_visited;
+  }
+  state.last_pass_ms = now_ms;
+  estimated_size_bytes_->Set(state.estimated_size_bytes);
+  WriteCleanState(state);
+}
+
+bool FileCache::WalkSlice(const GoogleString& dir, StringPiece resume,
+                          FileSystem::ProgressNotifier* notifier,
+                          CleanSlice* slice) {
+  notifier->Notify();
+  StringVector contents;
+  if (!file_system_->ListContents(dir, &contents, message_handler_)) {
+    return true;
+  }
+  StringPiece dir_name = StripTrailingSlash(dir);
+  if (contents.empty()) {
+    // See Clean for why empty directories must be old enough to remove.
+    int64 mtime_sec;
+    const int64 now_sec = cache_policy_->timer->NowMs() / Timer::kSecondMs;
+    if (resume.empty() && dir_name != StripTrailingSlash(path_) &&
+        file_system_->Mtime(dir, &mtime_sec, message_handler_) &&
+        now_sec - mtime_sec > kEmptyDirCleanAgeSec &&
+        file_system_->RemoveDir(dir.c_str(), message_handler_)) {
+      ++slice->inodes_removed;
+    }
+    return true;
+  }
+
+  // Find the entry of this directory the previous pass stopped at or in.
+  StringPiece resume_entry;
+  bool resume_inside_entry = false;
+  GoogleString prefix = StrCat(dir_name, "/");
+  if (resume.starts_with(prefix) && resume.size() > prefix.size()) {
+    size_t slash = resume.find('/', prefix.size());
+    resume_inside_entry = (slash != StringPiece::npos);
+    resume_entry = resume.substr(
+        0, resume_inside_entry ? slash : StringPiece::npos);
+  }
+
+  std::sort(contents.begin(), contents.end(), CompareAsEntries());
+  for (int i = 0, n = contents.size(); i < n; ++i) {
+    const GoogleString& path = contents[i];
+    StringPiece entry = StripTrailingSlash(path);
+    if (!resume_entry.empty() && entry <= resume_entry) {
+      if (entry == resume_entry && resume_inside_entry) {
+        // The directory itself was counted when the walk entered it.
+        if (!WalkSlice(path, resume, notifier, slice)) {
+          return false;
+        }
+        slice->last_visited = entry.as_string();
+      }
+      continue;
+    }
+    // Our own bookkeeping files are neither counted nor evicted.
+    if (entry == clean_time_path_ || entry == clean_state_path_ ||
+        entry == StripTrailingSlash(clean_lock_path_)) {
+      continue;
+    }
+    if (slice->files_left <= 0) {
+      return false;
+    }
+    --slice->files_left;
+    notifier->Notify();
+    int64 size_bytes = 0;
+    file_system_->Size(path, &size_bytes, message_handler_);
+    slice->size_bytes += size_bytes;
+    ++slice->inode_count;
+    BoolOrError is_dir = file_system_->IsDir(path.c_str(), message_handler_);
+    if (is_dir.is_true()) {
+      slice->last_visited = StrCat(entry, "/");
+      if (!WalkSlice(path, StringPiece(), notifier, slice)) {
+        return false;
+      }
+    } else if (is_dir.is_false()) {
+      int64 atime_sec = 0;
+      file_system_->Atime(path, &atime_sec, message_handler_);
+      slice->files.push_back(FileSystem::FileInfo(size_bytes, atime_sec, path));
+    }
+    slice->last_visited = entry.as_string();
+  }
+  return true;
+}
+
+bool FileCache::ReadCleanState(CleanState* state) {
+  GoogleString contents;
+  NullMessageHandler null_handler;
+  if (!file_system_->ReadFile(clean_state_path_.c_str(), &contents,
+                              &null_handler)) {
+    return false;
+  }
+  StringPieceVector lines;
+  SplitStringPieceToVector(contents, "\n", &lines, false);
+  StringPieceVector fields;
+  if (!lines.empty()) {
+    SplitStringPieceToVector(lines[0], " ", &fields, true);
+  }
+  CleanState parsed;
+  int evicting;
+  if (fields.size() != 7 || fields[0] != kCleanStateVersion ||
+      !StringToInt64(fields[1], &parsed.estimated_size_bytes) ||
+      !StringToInt64(fields[2], &parsed.estimated_inode_count) ||
+      !StringToInt64(fields[3], &parsed.sweep_size_bytes) ||
+      !StringToInt64(fields[4], &parsed.sweep_inode_count) ||
+      !StringToInt64(fields[5], &parsed.last_pass_ms) ||
+      !StringToInt(fields[6], &evicting)) {
+    message_handler_->Message(kWarning, "Ignoring damaged file cache state %s",
+                              clean_state_path_.c_str());
+    return false;
+  }
+  parsed.evicting = (evicting != 0);
+  if (lines.size() > 1) {
+    lines[1].CopyToString(&parsed.cursor);
+  }
+  *state = parsed;
+  return true;
+}
+
+void FileCache::WriteCleanState(const CleanState& state) {
+  GoogleString contents = StrCat(
+      kCleanStateVersion, " ",
+      Integer64ToString(state.estimated_size_bytes), " ",
+      Integer64ToString(state.estimated_inode_count), " ",
+      Integer64ToString(state.sweep_size_bytes), " ");
+  StrAppend(&contents,
+            Integer64ToString(state.sweep_inode_count), " ",
+            Integer64ToString(state.last_pass_ms), " ",
+            state.evicting ? "1" : "0", "\n", state.cursor);
+  if (!file_system_->WriteFileAtomic(clean_state_path_, contents,
+                                     message_handler_)) {
+    write_errors_->Add(1);
+  }
+}
+
+int64 FileCache::CleanIntervalMs() const {
+  return cache_policy_->incremental_cleaning ? kCleanPassIntervalMs
+                                             : cache_policy_->clean_interval_ms;
+}
+
 void FileCache::CleanWithLocking(int64 next_clean_time_ms) {
   if (file_system_->TryLockWithTimeout(clean_lock_path_, kLockTimeoutMs,
                                        cache_policy_->timer,
@@ -364,8 +723,12 @@ void FileCache::CleanWithLocking(int64 next_clean_time_ms) {
     }
 
     // Now actually clean.
-    Clean(cache_policy_->target_size_bytes,
-          cache_policy_->target_inode_count);
+    if (cache_policy_->incremental_cleaning) {
+      CleanIncrementally();
+    } else {
+      Clean(cache_policy_->target_size_bytes,
+            cache_policy_->target_inode_count);
+    }
     file_system_->Unlock(clean_lock_path_, message_handler_);
   } else {
     // The previous cache cleaning run is still active, so skip this round.
@@ -392,7 +755,7 @@ bool FileCache::ShouldClean(int64* suggested_next_clean_time_ms) {
 
   GoogleString clean_time_str;
   int64 clean_time_ms = 0;
-  int64 new_clean_time_ms = now_ms + cache_policy_->clean_interval_ms;
+  int64 new_clean_time_ms = now_ms + CleanIntervalMs();
   NullMessageHandler null_handler;
   if (file_system_->ReadFile(clean_time_path_.c_str(), &clean_time_str,
                              &null_handler)) {
@@ -405,9 +768,12 @@ bool FileCache::ShouldClean(int64* suggested_next_clean_time_ms) {
 
   // If the "clean time" written in the file is older than now, we clean.
   if (clean_time_ms < now_ms) {
-    message_handler_->Message(
-        kInfo, "Need to check cache size against target %s",
-        Integer64ToString(cache_policy_->target_size_bytes).c_str());
+    // Incremental cleaning checks every second, which isn't news.
+    if (!cache_policy_->incremental_cleaning) {
+      message_handler_->Message(
+          kInfo, "Need to check cache size against target %s",
+          Integer64ToString(cache_policy_->target_size_bytes).c_str());
+    }
     to_return = true;
   }
   // If the "clean time" is later than now plus one interval, something
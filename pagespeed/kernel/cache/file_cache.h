@@ -36,22 +36,36 @@ class MessageHandler;
 class SlowWorker;
 class Statistics;
 class Timer;
+class UpDownCounter;
 class Variable;
 
 // Simple C++ implementation of file cache.
 class FileCache : public CacheInterface {
  public:
+  static const int64 kDefaultCleanFilesPerSec = 1000;
+
   struct CachePolicy {
     CachePolicy(Timer* timer, Hasher* hasher, int64 clean_interval_ms,
                 int64 target_size_bytes, int64 target_inode_count)
         : timer(timer), hasher(hasher), clean_interval_ms(clean_interval_ms),
           target_size_bytes(target_size_bytes),
-          target_inode_count(target_inode_count) {}
+          target_inode_count(target_inode_count),
+          incremental_cleaning(false),
+          clean_files_per_sec(kDefaultCleanFilesPerSec),
+          clean_bytes_per_sec(0) {}
     const Timer* timer;
     const Hasher* hasher;
     int64 clean_interval_ms;
     int64 target_size_bytes;
     int64 target_inode_count;
+    // With incremental cleaning, instead of scanning the whole cache every
+    // clean_interval_ms, the cache is cleaned in short passes about once a
+    // second.  Each pass looks at no more than clean_files_per_sec files and
+    // deletes no more than clean_bytes_per_sec bytes (0 for no limit) for
+    // every second since the previous pass.
+    bool incremental_cleaning;
+    int64 clean_files_per_sec;
+    int64 clean_bytes_per_sec;
     bool cleaning_enabled() { return clean_interval_ms != kDisableCleaning; }
    private:
     DISALLOW_COPY_AND_ASSIGN(CachePolicy);
@@ -95,6 +109,14 @@ class FileCache : public CacheInterface {
   // Number of times we scanned the cache to see if it needed cleaning.
   static const char kStartedCleanups[];
   static const char kWriteErrors[];
+  // Incremental cleaning passes run.
+  static const char kCleanPasses[];
+  // Files looked at by incremental cleaning passes.
+  static const char kFilesScanned[];
+  // Number of times incremental cleaning finished walking the whole cache.
+  static const char kCleanSweeps[];
+  // The size of the cache as estimated by incremental cleaning.
+  static const char kEstimatedSizeBytes[];
 
   // What to set clean_interval_ms to in order to disable cleaning.  This needs
   // to be -1, because that's what we have in our public documentation.
@@ -102,6 +124,8 @@ class FileCache : public CacheInterface {
 
  private:
   class CacheCleanFunction;
+  struct CleanSlice;
+  struct CleanState;
   friend class FileCacheTest;
   friend class CacheCleanFunction;
 
@@ -112,6 +136,21 @@ class FileCache : public CacheInterface {
   // target_inode_count of 0 means no inode limit is applied.
   bool Clean(int64 target_size_bytes, int64 target_inode_count);
 
+  // Runs one pass of incremental cleaning: picks up the walk of the cache
+  // where the previous pass, in any process, left off, and evicts the least
+  // recently used share of the files it sees if the cache is too big.  Like
+  // Clean, this expects the clean lock to be held.
+  void CleanIncrementally() LOCKS_EXCLUDED(mutex_);
+
+  // Visits the entries under dir in depth-first order, starting after the
+  // path 'resume', until the slice's budget runs out.  Returns true if all
+  // of dir was visited.
+  bool WalkSlice(const GoogleString& dir, StringPiece resume,
+                 FileSystem::ProgressNotifier* notifier, CleanSlice* slice);
+
+  bool ReadCleanState(CleanState* state);
+  void WriteCleanState(const CleanState& state);
+
   // Clean the cache, taking care of interprocess locking, as well as timestamp
   // update.
   void CleanWithLocking(int64 next_clean_time_ms) LOCKS_EXCLUDED(mutex_);
@@ -128,6 +167,9 @@ class FileCache : public CacheInterface {
 
   bool EncodeFilename(const GoogleString& key, GoogleString* filename);
 
+  // The time between checks for whether the cache needs cleaning.
+  int64 CleanIntervalMs() const;
+
   const GoogleString path_;
   FileSystem* file_system_;
   SlowWorker* worker_;
@@ -135,10 +177,15 @@ class FileCache : public CacheInterface {
   const scoped_ptr<CachePolicy> cache_policy_;
   scoped_ptr<AbstractMutex> mutex_;
   int64 next_clean_ms_ GUARDED_BY(mutex_);
+  // Bytes and files written since the last incremental cleaning pass run
+  // by this process, to be added to the size estimate.
+  int64 unaccounted_size_bytes_ GUARDED_BY(mutex_);
+  int64 unaccounted_inode_count_ GUARDED_BY(mutex_);
   int path_length_limit_;  // Maximum total length of path file_system_ supports
   // The full paths to our cleanup timestamp and lock files.
   GoogleString clean_time_path_;
   GoogleString clean_lock_path_;
+  GoogleString clean_state_path_;
   // If set, we use this instead of the default LockBumpingProgressNotifier.  We
   // do not take ownership.
   FileSystem::ProgressNotifier* notifier_for_tests_;
@@ -150,11 +197,18 @@ class FileCache : public CacheInterface {
   Variable* skipped_cleanups_;
   Variable* started_cleanups_;
   Variable* write_errors_;
+  Variable* clean_passes_;
+  Variable* files_scanned_;
+  Variable* clean_sweeps_;
+  UpDownCounter* estimated_size_bytes_;
 
   // The filename where we keep the next scheduled cleanup time in seconds.
   static const char kCleanTimeName[];
   // The name of the global mutex protecting reads and writes to that file.
   static const char kCleanLockName[];
+  // The filename where incremental cleaning keeps its progress and size
+  // estimate, also protected by the clean lock.
+  static const char kCleanStateName[];
 
   // How long a cache cleaner has to go without bumping it's lock before it
   // might be usurped.
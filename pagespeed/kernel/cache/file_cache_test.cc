@@ -79,6 +79,24 @@ class FileCacheTest : public CacheTestBase {
         &stats_, &message_handler_));
   }
 
+  void ResetIncrementalFileCache(int64 clean_files_per_sec,
+                                 int64 target_size_bytes) {
+    FileCache::CachePolicy* policy = new FileCache::CachePolicy(
+        &mock_timer_, &hasher_, kCleanIntervalMs, target_size_bytes,
+        0 /* no inode limit */);
+    policy->incremental_cleaning = true;
+    policy->clean_files_per_sec = clean_files_per_sec;
+    cache_.reset(new FileCache(GTestTempDir(), &file_system_,
+                               thread_system_.get(), &worker_, policy,
+                               &stats_, &message_handler_));
+  }
+
+  // Lets a second pass, and so a full pass budget, before cleaning.
+  void RunCleanPass() {
+    mock_timer_.SleepMs(Timer::kSecondMs + 1);
+    RunClean();
+  }
+
   void CheckCleanTimestamp(int64 min_time_ms) {
     GoogleString buffer;
     file_system_.ReadFile(cache_->clean_time_path_.c_str(), &buffer,
@@ -417,6 +435,69 @@ TEST_F(FileCacheTest, CheckPartialCleanWithCleaningDisabled) {
   CheckGet("Name3", "Value3");
 }
 
+// Incremental cleaning walks the cache a few files at a time.
+TEST_F(FileCacheTest, IncrementalCleanWalksInSlices) {
+  ResetIncrementalFileCache(2 /* files per second */, 1000 * 1000);
+  for (int i = 0; i < 6; ++i) {
+    CheckPut(StrCat("Name", IntegerToString(i)), "Value");
+    WaitForWorker(&worker_);
+  }
+  // Keep file operations from stretching the time between passes, which
+  // would give them a bigger budget.
+  file_system_.set_advance_time_on_update(false, &mock_timer_);
+  // A pass long after the previous one has a budget for up to 10 seconds.
+  RunCleanPass();
+  Variable* passes = stats_.GetVariable(FileCache::kCleanPasses);
+  Variable* files_scanned = stats_.GetVariable(FileCache::kFilesScanned);
+  Variable* sweeps = stats_.GetVariable(FileCache::kCleanSweeps);
+  stats_.Clear();
+
+  // The six entries take at least three passes to get through.
+  while (sweeps->Get() == 0 && passes->Get() < 100) {
+    int64 scanned_before = files_scanned->Get();
+    RunCleanPass();
+    EXPECT_GE(2, files_scanned->Get() - scanned_before);
+  }
+  EXPECT_EQ(1, sweeps->Get());
+  EXPECT_LE(3, passes->Get());
+  EXPECT_EQ(0, evictions_->Get());
+  EXPECT_EQ(6 * STATIC_STRLEN("Value"),
+            stats_.GetUpDownCounter(FileCache::kEstimatedSizeBytes)->Get());
+  for (int i = 0; i < 6; ++i) {
+    CheckGet(StrCat("Name", IntegerToString(i)), "Value");
+  }
+}
+
+// When over the target size, incremental cleaning evicts the least recently
+// used entries.
+TEST_F(FileCacheTest, IncrementalCleanEvictsLeastRecentlyUsed) {
+  ResetIncrementalFileCache(100 /* files per second */, 1000 * 1000);
+  for (int i = 0; i < 8; ++i) {
+    CheckPut(StrCat("Name", IntegerToString(i)), "Value0");
+    WaitForWorker(&worker_);
+  }
+  CheckGet("Name0", "Value0");
+  CheckGet("Name1", "Value0");
+  WaitForWorker(&worker_);
+
+  // With 48 bytes in the cache, we need to get down to 3/4 of 40, which
+  // takes evicting three entries.
+  const int64 kSmallTargetSize = 40;
+  cache_->mutable_cache_policy()->target_size_bytes = kSmallTargetSize;
+  stats_.Clear();
+  RunCleanPass();
+  EXPECT_EQ(1, cleanups_->Get());
+  EXPECT_LT(0, evictions_->Get());
+  EXPECT_GE((kSmallTargetSize * 3) / 4,
+            stats_.GetUpDownCounter(FileCache::kEstimatedSizeBytes)->Get());
+  CheckGet("Name0", "Value0");
+  CheckGet("Name1", "Value0");
+  CheckNotFound("Name2");
+  CheckNotFound("Name3");
+  CheckNotFound("Name4");
+  CheckGet("Name7", "Value0");
+}
+
 // Test that if we start a cache cleaning run that takes longer than the
 // cleaning interval and then start another run, that the second run quits
 // immediately.
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/string_hash.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/cache/frequency_sketch.h"
+
+namespace net_instaweb {
+
+FrequencyAdmissionPolicy::FrequencyAdmissionPolicy(int num_entries,
+                                                   AbstractMutex* mutex)
+    : mutex_(mutex),
+      sketch_(num_entries),
+      num_admitted_(0),
+      num_rejected_(0) {
+}
+
+FrequencyAdmissionPolicy::~FrequencyAdmissionPolicy() {
+}
+
+void FrequencyAdmissionPolicy::RecordAccess(uint64 key_hash) {
+  ScopedMutex lock(mutex_.get());
+  sketch_.Increment(key_hash);
+}
+
+bool FrequencyAdmissionPolicy::Admit(uint64 candidate_hash,
+                                     uint64 victim_hash) {
+  ScopedMutex lock(mutex_.get());
+  bool admit = sketch_.Estimate(candidate_hash) > sketch_.Estimate(victim_hash);
+  if (admit) {
+    ++num_admitted_;
+  } else {
+    ++num_rejected_;
+  }
+  return admit;
+}
+
+int FrequencyAdmissionPolicy::EstimateFrequency(uint64 key_hash) const {
+  ScopedMutex lock(mutex_.get());
+  return sketch_.Estimate(key_hash);
+}
+
+int64 FrequencyAdmissionPolicy::num_admitted() const {
+  ScopedMutex lock(mutex_.get());
+  return num_admitted_;
+}
+
+int64 FrequencyAdmissionPolicy::num_rejected() const {
+  ScopedMutex lock(mutex_.get());
+  return num_rejected_;
+}
+
+uint64 FrequencyAdmissionPolicy::HashKey(StringPiece key) {
+  return HashString<CasePreserve, uint64>(key.data(), key.size());
+}
+
+}  // namespace net_instaweb
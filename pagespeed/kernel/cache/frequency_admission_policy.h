@@ -0,0 +1,72 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_FREQUENCY_ADMISSION_POLICY_H_
+#define PAGESPEED_KERNEL_CACHE_FREQUENCY_ADMISSION_POLICY_H_
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/cache/frequency_sketch.h"
+
+namespace net_instaweb {
+
+// Frequency-based cache admission filter, after the TinyLFU scheme.  A cache
+// reports every lookup with RecordAccess, and when inserting a new key would
+// force it to evict an existing entry it asks Admit whether the newcomer is
+// worth it.  A new key is admitted only if its estimated recent access
+// frequency is strictly greater than that of the victim, so a stream of
+// one-shot keys (unique HTML URLs, beacons) can no longer flush out
+// frequently-read entries.
+//
+// Keys are identified by 64-bit hashes; HashKey() is provided for caches
+// that do not already have a well-mixed hash of their own.
+class FrequencyAdmissionPolicy {
+ public:
+  // num_entries should approximate how many entries the filtered cache can
+  // hold; it sizes the frequency sketch.  Takes ownership of mutex.
+  FrequencyAdmissionPolicy(int num_entries, AbstractMutex* mutex);
+  ~FrequencyAdmissionPolicy();
+
+  // Records a lookup of the key with the given hash, hit or miss.
+  void RecordAccess(uint64 key_hash) LOCKS_EXCLUDED(mutex_);
+
+  // Returns true if a new entry for candidate_hash should be inserted at
+  // the cost of evicting the entry for victim_hash.
+  bool Admit(uint64 candidate_hash, uint64 victim_hash) LOCKS_EXCLUDED(mutex_);
+
+  // Estimated recent access count for a key.  Exposed for testing.
+  int EstimateFrequency(uint64 key_hash) const LOCKS_EXCLUDED(mutex_);
+
+  int64 num_admitted() const LOCKS_EXCLUDED(mutex_);
+  int64 num_rejected() const LOCKS_EXCLUDED(mutex_);
+
+  static uint64 HashKey(StringPiece key);
+
+ private:
+  scoped_ptr<AbstractMutex> mutex_;
+  FrequencySketch sketch_ GUARDED_BY(mutex_);
+  int64 num_admitted_ GUARDED_BY(mutex_);
+  int64 num_rejected_ GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(FrequencyAdmissionPolicy);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_FREQUENCY_ADMISSION_POLICY_H_
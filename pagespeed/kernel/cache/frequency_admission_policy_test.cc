@@ -0,0 +1,80 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the frequency-based cache admission policy.
+
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/null_mutex.h"
+
+namespace net_instaweb {
+
+class FrequencyAdmissionPolicyTest : public testing::Test {
+ protected:
+  FrequencyAdmissionPolicyTest()
+      : policy_(1000, new NullMutex),
+        hot_(FrequencyAdmissionPolicy::HashKey("hot")),
+        cold_(FrequencyAdmissionPolicy::HashKey("cold")) {
+  }
+
+  void Access(uint64 hash, int times) {
+    for (int i = 0; i < times; ++i) {
+      policy_.RecordAccess(hash);
+    }
+  }
+
+  FrequencyAdmissionPolicy policy_;
+  uint64 hot_;
+  uint64 cold_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(FrequencyAdmissionPolicyTest);
+};
+
+TEST_F(FrequencyAdmissionPolicyTest, AdmitsOnlyMoreFrequentKeys) {
+  Access(hot_, 3);
+  Access(cold_, 1);
+  EXPECT_EQ(3, policy_.EstimateFrequency(hot_));
+  EXPECT_EQ(1, policy_.EstimateFrequency(cold_));
+
+  EXPECT_TRUE(policy_.Admit(hot_, cold_));
+  EXPECT_FALSE(policy_.Admit(cold_, hot_));
+
+  // Ties go to the incumbent.
+  Access(cold_, 2);
+  EXPECT_FALSE(policy_.Admit(cold_, hot_));
+  EXPECT_FALSE(policy_.Admit(hot_, cold_));
+
+  EXPECT_EQ(1, policy_.num_admitted());
+  EXPECT_EQ(3, policy_.num_rejected());
+}
+
+TEST_F(FrequencyAdmissionPolicyTest, UnseenKeysAreRejected) {
+  EXPECT_FALSE(policy_.Admit(hot_, cold_));
+  Access(hot_, 1);
+  EXPECT_TRUE(policy_.Admit(hot_, cold_));
+}
+
+TEST_F(FrequencyAdmissionPolicyTest, HashKeyIsCaseSensitive) {
+  EXPECT_EQ(FrequencyAdmissionPolicy::HashKey("key"),
+            FrequencyAdmissionPolicy::HashKey("key"));
+  EXPECT_NE(FrequencyAdmissionPolicy::HashKey("key"),
+            FrequencyAdmissionPolicy::HashKey("Key"));
+}
+
+}  // namespace net_instaweb
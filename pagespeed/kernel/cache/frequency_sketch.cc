@@ -0,0 +1,121 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/frequency_sketch.h"
+
+#include <algorithm>
+
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Bounds on the number of counters per row.  The upper bound keeps a
+// misconfigured sketch from consuming an unreasonable amount of memory:
+// kDepth rows of 1<<24 one-byte counters is 64MB.
+const int kMinWidth = 16;
+const int kMaxWidth = 1 << 24;
+
+// The sketch is aged after this many increments per counter column.
+const int kSampleSizeMultiplier = 10;
+
+// Per-row multipliers; any distinct odd 64-bit constants will do.
+const uint64 kSeeds[FrequencySketch::kDepth] = {
+  0xc3a5c85c97cb3127ULL,
+  0xb492b66fbe98f273ULL,
+  0x9ae16a3b2f90404fULL,
+  0xcbf29ce484222325ULL
+};
+
+// Callers hand us hashes of widely varying quality, so scramble the bits
+// before deriving row indices (the finalizer from MurmurHash3).
+uint64 Spread(uint64 hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+}  // namespace
+
+const int FrequencySketch::kMaxCount;
+const int FrequencySketch::kDepth;
+
+FrequencySketch::FrequencySketch(int num_entries)
+    : width_(kMinWidth),
+      num_increments_(0) {
+  int target = std::min(num_entries, kMaxWidth);
+  while (width_ < target) {
+    width_ <<= 1;
+  }
+  sample_size_ = static_cast<int64>(width_) * kSampleSizeMultiplier;
+  counters_.resize(kDepth * width_, 0);
+}
+
+FrequencySketch::~FrequencySketch() {
+}
+
+int FrequencySketch::IndexOf(uint64 hash, int row) const {
+  uint64 h = (hash + kSeeds[row]) * kSeeds[row];
+  h += h >> 32;
+  return row * width_ + static_cast<int>(h & (width_ - 1));
+}
+
+void FrequencySketch::Increment(uint64 hash) {
+  hash = Spread(hash);
+  int indices[kDepth];
+  int min_count = kMaxCount;
+  for (int row = 0; row < kDepth; ++row) {
+    indices[row] = IndexOf(hash, row);
+    min_count = std::min(min_count, static_cast<int>(counters_[indices[row]]));
+  }
+  if (min_count == kMaxCount) {
+    return;  // Saturated; this increment would not change the estimate.
+  }
+  for (int row = 0; row < kDepth; ++row) {
+    if (counters_[indices[row]] == min_count) {
+      ++counters_[indices[row]];
+    }
+  }
+  if (++num_increments_ >= sample_size_) {
+    Age();
+  }
+}
+
+int FrequencySketch::Estimate(uint64 hash) const {
+  hash = Spread(hash);
+  int min_count = kMaxCount;
+  for (int row = 0; row < kDepth; ++row) {
+    min_count = std::min(min_count,
+                         static_cast<int>(counters_[IndexOf(hash, row)]));
+  }
+  return min_count;
+}
+
+void FrequencySketch::Clear() {
+  std::fill(counters_.begin(), counters_.end(), 0);
+  num_increments_ = 0;
+}
+
+void FrequencySketch::Age() {
+  for (int i = 0, n = counters_.size(); i < n; ++i) {
+    counters_[i] >>= 1;
+  }
+  num_increments_ /= 2;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_FREQUENCY_SKETCH_H_
+#define PAGESPEED_KERNEL_CACHE_FREQUENCY_SKETCH_H_
+
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+// Approximate access-frequency counter for a stream of 64-bit key hashes,
+// implemented as a count-min sketch: kDepth rows of small saturating
+// counters, each row indexed by a differently-seeded hash of the key.  The
+// estimated frequency of a key is the minimum of its kDepth counters, so
+// collisions can only ever cause over-estimates.  Increments are
+// "conservative": only the counters currently equal to that minimum are
+// bumped, which reduces the over-estimation considerably.
+//
+// To let the sketch track a changing popularity distribution, all counters
+// are halved ("aged") once the number of increments reaches sample_size(),
+// which is a fixed multiple of the table width.
+//
+// This class is not thread-safe.
+class FrequencySketch {
+ public:
+  // Counters saturate at this value.
+  static const int kMaxCount = 15;
+
+  // Number of counter rows, and thus hash functions.
+  static const int kDepth = 4;
+
+  // Sizes the sketch for roughly num_entries distinct keys of interest,
+  // which should be about the number of entries the cache can hold.
+  explicit FrequencySketch(int num_entries);
+  ~FrequencySketch();
+
+  // Records one access to the key with the given hash.
+  void Increment(uint64 hash);
+
+  // Returns the estimated number of accesses for the given hash since it
+  // was last aged, in the range [0, kMaxCount].
+  int Estimate(uint64 hash) const;
+
+  // Resets all counters to zero.
+  void Clear();
+
+  int width() const { return width_; }
+  int64 sample_size() const { return sample_size_; }
+
+  // Number of increments since the last aging.  Exposed for testing.
+  int64 num_increments() const { return num_increments_; }
+
+ private:
+  // Returns the index of the counter for hash in the given row.
+  int IndexOf(uint64 hash, int row) const;
+
+  // Halves every counter, and the increment count.
+  void Age();
+
+  int width_;  // Counters per row; always a power of 2.
+  int64 sample_size_;
+  int64 num_increments_;
+  std::vector<uint8> counters_;  // kDepth rows of width_ counters each.
+
+  DISALLOW_COPY_AND_ASSIGN(FrequencySketch);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_FREQUENCY_SKETCH_H_
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the count-min frequency sketch.
+
+#include "pagespeed/kernel/cache/frequency_sketch.h"
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/gtest.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const uint64 kKey = 0x123456789abcdef0ULL;
+
+}  // namespace
+
+TEST(FrequencySketchTest, Sizing) {
+  FrequencySketch tiny(1);
+  EXPECT_EQ(16, tiny.width());
+  EXPECT_EQ(160, tiny.sample_size());
+
+  FrequencySketch sketch(1000);
+  EXPECT_EQ(1024, sketch.width());
+  EXPECT_EQ(10240, sketch.sample_size());
+}
+
+TEST(FrequencySketchTest, CountsAndSaturates) {
+  FrequencySketch sketch(1000);
+  EXPECT_EQ(0, sketch.Estimate(kKey));
+  for (int i = 1; i <= 5; ++i) {
+    sketch.Increment(kKey);
+    EXPECT_EQ(i, sketch.Estimate(kKey));
+  }
+  for (int i = 0; i < 100; ++i) {
+    sketch.Increment(kKey);
+  }
+  EXPECT_EQ(FrequencySketch::kMaxCount, sketch.Estimate(kKey));
+
+  // Increments of a saturated key do not count towards aging.
+  EXPECT_EQ(FrequencySketch::kMaxCount, sketch.num_increments());
+
+  sketch.Clear();
+  EXPECT_EQ(0, sketch.Estimate(kKey));
+  EXPECT_EQ(0, sketch.num_increments());
+}
+
+TEST(FrequencySketchTest, DistinguishesKeys) {
+  FrequencySketch sketch(1000);
+  for (uint64 key = 0; key < 100; ++key) {
+    for (uint64 i = 0; i <= key % 4; ++i) {
+      sketch.Increment(key);
+    }
+  }
+
+  // The sketch can over-count on collisions, but never under-count, and with
+  // this much room it should be exact for nearly all keys.
+  int exact = 0;
+  for (uint64 key = 0; key < 100; ++key) {
+    int expected = (key % 4) + 1;
+    EXPECT_LE(expected, sketch.Estimate(key));
+    if (sketch.Estimate(key) == expected) {
+      ++exact;
+    }
+  }
+  EXPECT_LE(95, exact);
+  EXPECT_EQ(0, sketch.Estimate(1000));
+}
+
+TEST(FrequencySketchTest, Aging) {
+  FrequencySketch sketch(1);
+  for (int i = 0; i < 10; ++i) {
+    sketch.Increment(kKey);
+  }
+  EXPECT_EQ(10, sketch.Estimate(kKey));
+
+  // Feed other keys until the sketch reaches its sample size and halves
+  // all its counters.
+  uint64 other = 0;
+  int64 increments = sketch.num_increments();
+  while (sketch.num_increments() >= increments) {
+    increments = sketch.num_increments();
+    sketch.Increment(++other);
+  }
+  EXPECT_EQ(sketch.sample_size() / 2, sketch.num_increments());
+  EXPECT_EQ(5, sketch.Estimate(kKey));
+}
+
+}  // namespace net_instaweb
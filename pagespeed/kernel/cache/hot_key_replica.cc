@@ -0,0 +1,213 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/hot_key_replica.h"
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/condvar.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string_hash.h"
+#include "pagespeed/kernel/base/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kLocalHits[] = "_hot_key_local_hits";
+const char kCoalescedLookups[] = "_hot_key_coalesced_lookups";
+const char kPromotions[] = "_hot_key_promotions";
+
+}  // namespace
+
+HotKeyReplica::HotKeyReplica(const Options& options, StringPiece prefix,
+                             ThreadSystem* thread_system, Timer* timer,
+                             Statistics* statistics)
+    : options_(options),
+      timer_(timer),
+      mutex_(thread_system->NewMutex()),
+      fetch_done_(mutex_->NewCondvar()),
+      sketch_(options.sketch_entries),
+      num_lookups_(0),
+      local_hits_(statistics->GetVariable(StrCat(prefix, kLocalHits))),
+      coalesced_lookups_(
+          statistics->GetVariable(StrCat(prefix, kCoalescedLookups))),
+      promotions_(statistics->GetVariable(StrCat(prefix, kPromotions))) {
+  DCHECK_GT(options_.sample_rate, 0);
+  DCHECK_LE(options_.hot_threshold, FrequencySketch::kMaxCount);
+}
+
+HotKeyReplica::~HotKeyReplica() {
+}
+
+void HotKeyReplica::InitStats(StringPiece prefix, Statistics* statistics) {
+  statistics->AddVariable(StrCat(prefix, kLocalHits));
+  statistics->AddVariable(StrCat(prefix, kCoalescedLookups));
+  statistics->AddVariable(StrCat(prefix, kPromotions));
+}
+
+HotKeyReplica::Entry* HotKeyReplica::CountLookup(const GoogleString& key) {
+  EntryMap::iterator iter = hot_keys_.find(key);
+  Entry* entry = (iter == hot_keys_.end()) ? NULL : &iter->second;
+  if (++num_lookups_ % options_.sample_rate != 0) {
+    return entry;
+  }
+  uint64 hash = (entry != NULL)
+      ? entry->hash : HashString<CasePreserve, uint64>(key.data(), key.size());
+  sketch_.Increment(hash);
+  if (entry != NULL) {
+    return entry;
+  }
+  int estimate = sketch_.Estimate(hash);
+  if (estimate < options_.hot_threshold) {
+    return NULL;
+  }
+
+  // The key is hot.  Make room for it if need be, by dropping the coldest
+  // hot key, as long as it's colder than this one.  Keys being fetched are
+  // left alone, since other lookups may be waiting on them.
+  if (static_cast<int>(hot_keys_.size()) >= options_.max_hot_keys) {
+    EntryMap::iterator coldest = hot_keys_.end();
+    int coldest_estimate = FrequencySketch::kMaxCount + 1;
+    for (iter = hot_keys_.begin(); iter != hot_keys_.end(); ++iter) {
+      int hot_estimate = sketch_.Estimate(iter->second.hash);
+      if (!iter->second.fetching && (hot_estimate < coldest_estimate)) {
+        coldest = iter;
+        coldest_estimate = hot_estimate;
+      }
+    }
+    if ((coldest == hot_keys_.end()) || (coldest_estimate >= estimate)) {
+      return NULL;
+    }
+    hot_keys_.erase(coldest);
+  }
+  entry = &hot_keys_[key];
+  entry->hash = hash;
+  promotions_->Add(1);
+  return entry;
+}
+
+HotKeyReplica::LookupResult HotKeyReplica::Lookup(
+    const GoogleString& key, bool may_wait, SharedString* value, bool* found) {
+  int64 now_ms = timer_->NowMs();
+  int64 wait_deadline_ms = now_ms + options_.max_wait_ms;
+  bool waited = false;
+  ScopedMutex lock(mutex_.get());
+  Entry* entry = CountLookup(key);
+  while (entry != NULL) {
+    if (entry->expiry_ms > now_ms) {
+      *found = entry->found;
+      if (entry->found) {
+        *value = entry->value;
+      }
+      local_hits_->Add(1);
+      if (waited) {
+        coalesced_lookups_->Add(1);
+      }
+      return kLocal;
+    }
+    if (!entry->fetching) {
+      entry->fetching = true;
+      entry->stale_fetch = false;
+      return kFetchAndReport;
+    }
+    if (!may_wait || (now_ms >= wait_deadline_ms)) {
+      break;
+    }
+
+    // Another lookup is fetching the key: wait for it to finish, or for the
+    // key to drop out of the hot set.
+    fetch_done_->TimedWait(wait_deadline_ms - now_ms);
+    waited = true;
+    now_ms = timer_->NowMs();
+    EntryMap::iterator iter = hot_keys_.find(key);
+    entry = (iter == hot_keys_.end()) ? NULL : &iter->second;
+  }
+  return kFetch;
+}
+
+void HotKeyReplica::Update(const GoogleString& key, bool found,
+                           const SharedString& value) {
+  EntryMap::iterator iter = hot_keys_.find(key);
+  if (iter == hot_keys_.end()) {
+    return;
+  }
+  Entry* entry = &iter->second;
+  entry->found = found;
+  entry->value = found ? value : SharedString();
+  entry->expiry_ms = timer_->NowMs() + options_.ttl_ms;
+}
+
+void HotKeyReplica::FetchDone(const GoogleString& key, bool success,
+                              bool found, const SharedString& value) {
+  ScopedMutex lock(mutex_.get());
+  EntryMap::iterator iter = hot_keys_.find(key);
+  if (iter != hot_keys_.end()) {
+    Entry* entry = &iter->second;
+    entry->fetching = false;
+    // If the key was written while it was being fetched, the value fetched
+    // may predate the write, so keep what the write stored.
+    if (success && !entry->stale_fetch) {
+      Update(key, found, value);
+    }
+  }
+  fetch_done_->Broadcast();
+}
+
+void HotKeyReplica::Put(const GoogleString& key, const SharedString& value) {
+  ScopedMutex lock(mutex_.get());
+  EntryMap::iterator iter = hot_keys_.find(key);
+  if (iter != hot_keys_.end()) {
+    iter->second.stale_fetch = iter->second.fetching;
+    Update(key, true, value);
+  }
+}
+
+void HotKeyReplica::Delete(const GoogleString& key) {
+  ScopedMutex lock(mutex_.get());
+  EntryMap::iterator iter = hot_keys_.find(key);
+  if (iter != hot_keys_.end()) {
+    iter->second.stale_fetch = iter->second.fetching;
+    Update(key, false, SharedString());
+  }
+}
+
+bool HotKeyReplica::IsHot(const GoogleString& key) {
+  ScopedMutex lock(mutex_.get());
+  return hot_keys_.find(key) != hot_keys_.end();
+}
+
+void HotKeyReplica::AppendStatus(GoogleString* out) {
+  int64 now_ms = timer_->NowMs();
+  ScopedMutex lock(mutex_.get());
+  StrAppend(out, "Hot keys, replicated for ",
+            Integer64ToString(options_.ttl_ms), "ms:\n");
+  if (hot_keys_.empty()) {
+    StrAppend(out, "  (none)\n");
+  }
+  for (const auto& pair : hot_keys_) {
+    const Entry& entry = pair.second;
+    const char* state = "expired";
+    if (entry.expiry_ms > now_ms) {
+      state = entry.found ? "replicated" : "replicated as missing";
+    }
+    StrAppend(out, "  ", pair.first, ": frequency ",
+              IntegerToString(sketch_.Estimate(entry.hash)), ", ", state,
+              "\n");
+  }
+}
+
+}  // namespace net_instaweb
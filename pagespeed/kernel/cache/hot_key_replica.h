@@ -0,0 +1,159 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_HOT_KEY_REPLICA_H_
+#define PAGESPEED_KERNEL_CACHE_HOT_KEY_REPLICA_H_
+
+#include <map>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/cache/frequency_sketch.h"
+
+namespace net_instaweb {
+
+class Statistics;
+class Timer;
+class Variable;
+
+// A small local copy of the most frequently read keys of a remote cache, so
+// that a few very popular keys (combined CSS, site-wide metadata) don't
+// saturate the one server that owns them.
+//
+// Every sample_rate'th lookup is counted in a FrequencySketch, and a key whose
+// estimated count reaches hot_threshold is promoted to the hot set, which
+// holds at most max_hot_keys keys; when it is full, the key with the lowest
+// estimate makes way for the new one.  The sketch ages as it fills, so keys
+// that cool off are eventually displaced.
+//
+// Lookups of a hot key are answered locally, hit or miss, for ttl_ms after
+// the value was last read from or written to the remote cache.  Once that
+// expires, one lookup fetches the key again; concurrent lookups may wait for
+// it rather than each making their own round trip.  Writes through this
+// process update the replica immediately, but writes by other processes are
+// only seen once the replica expires, so ttl_ms bounds the staleness.
+//
+// This class is thread-safe.
+class HotKeyReplica {
+ public:
+  struct Options {
+    Options()
+        : ttl_ms(1000),
+          sample_rate(8),
+          hot_threshold(8),
+          max_hot_keys(32),
+          sketch_entries(1024),
+          max_wait_ms(50) {
+    }
+
+    int64 ttl_ms;
+    int sample_rate;    // Count one lookup in sample_rate.
+    int hot_threshold;  // At most FrequencySketch::kMaxCount.
+    int max_hot_keys;
+    int sketch_entries;
+    int64 max_wait_ms;  // How long a lookup may wait for another's fetch.
+    // Copy-construction and assign are allowed.
+  };
+
+  enum LookupResult {
+    // The key is hot and was answered locally: *found and *value are set.
+    kLocal,
+    // The caller must fetch the key, and then call FetchDone with the result.
+    kFetchAndReport,
+    // The caller must fetch the key, and need not report the result.
+    kFetch
+  };
+
+  // Statistics are named prefix + "_hot_key_local_hits" and so on.
+  HotKeyReplica(const Options& options, StringPiece prefix,
+                ThreadSystem* thread_system, Timer* timer,
+                Statistics* statistics);
+  ~HotKeyReplica();
+
+  static void InitStats(StringPiece prefix, Statistics* statistics);
+
+  // Counts a lookup of key and, if it is hot, answers it locally if
+  // possible.  If may_wait and another thread is already fetching the key,
+  // waits up to max_wait_ms for its result.  Callers holding other keys'
+  // fetches (such as a MultiGet) must not wait, to avoid waiting on each
+  // other.
+  LookupResult Lookup(const GoogleString& key, bool may_wait,
+                      SharedString* value, bool* found);
+
+  // Completes a kFetchAndReport lookup.  If success is false, the fetch
+  // failed and nothing is replicated; otherwise found and value are the
+  // result.
+  void FetchDone(const GoogleString& key, bool success, bool found,
+                 const SharedString& value);
+
+  // Updates the replica of key, if it is hot, after a write to the remote
+  // cache.
+  void Put(const GoogleString& key, const SharedString& value);
+  void Delete(const GoogleString& key);
+
+  // Appends the hot keys, with their estimated frequencies, to *out.
+  void AppendStatus(GoogleString* out);
+
+  // Returns whether key is currently in the hot set.
+  bool IsHot(const GoogleString& key);
+
+ private:
+  struct Entry {
+    Entry()
+        : hash(0), fetching(false), stale_fetch(false), found(false),
+          expiry_ms(0) {
+    }
+
+    uint64 hash;
+    bool fetching;
+    bool stale_fetch;  // Written since the fetch started.
+    bool found;
+    int64 expiry_ms;  // 0 if nothing has been replicated yet.
+    SharedString value;
+  };
+  typedef std::map<GoogleString, Entry> EntryMap;
+
+  // Counts a sampled lookup, promoting key to the hot set if it has become
+  // hot.  Returns the key's entry, or NULL if it isn't hot.
+  Entry* CountLookup(const GoogleString& key) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Stores the result of a fetch or write in key's entry, if it is hot.
+  void Update(const GoogleString& key, bool found, const SharedString& value)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  const Options options_;
+  Timer* timer_;
+  scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex_;
+  scoped_ptr<ThreadSystem::Condvar> fetch_done_;
+  FrequencySketch sketch_ GUARDED_BY(mutex_);
+  int64 num_lookups_ GUARDED_BY(mutex_);
+  EntryMap hot_keys_ GUARDED_BY(mutex_);
+
+  Variable* local_hits_;
+  Variable* coalesced_lookups_;
+  Variable* promotions_;
+
+  DISALLOW_COPY_AND_ASSIGN(HotKeyReplica);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_HOT_KEY_REPLICA_H_
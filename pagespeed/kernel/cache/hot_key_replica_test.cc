@@ -0,0 +1,250 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the hot-key replica.
+
+#include "pagespeed/kernel/cache/hot_key_replica.h"
+
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kPrefix[] = "test";
+const int64 kTtlMs = 1000;
+
+class LookupThread : public ThreadSystem::Thread {
+ public:
+  LookupThread(HotKeyReplica* replica, ThreadSystem* thread_system)
+      : Thread(thread_system, "lookup", ThreadSystem::kJoinable),
+        replica_(replica),
+        result_(HotKeyReplica::kFetch),
+        found_(false) {
+  }
+
+  virtual void Run() {
+    result_ = replica_->Lookup("key", true /* may_wait */, &value_, &found_);
+  }
+
+  HotKeyReplica::LookupResult result() const { return result_; }
+  const SharedString& value() const { return value_; }
+
+ private:
+  HotKeyReplica* replica_;
+  HotKeyReplica::LookupResult result_;
+  SharedString value_;
+  bool found_;
+
+  DISALLOW_COPY_AND_ASSIGN(LookupThread);
+};
+
+}  // namespace
+
+class HotKeyReplicaTest : public testing::Test {
+ protected:
+  HotKeyReplicaTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        timer_(thread_system_->NewMutex(), MockTimer::kApr_5_2010_ms),
+        stats_(thread_system_.get()) {
+    HotKeyReplica::InitStats(kPrefix, &stats_);
+    options_.ttl_ms = kTtlMs;
+    options_.sample_rate = 1;
+    options_.hot_threshold = 3;
+    options_.max_hot_keys = 2;
+  }
+
+  void Init() {
+    replica_.reset(new HotKeyReplica(options_, kPrefix, thread_system_.get(),
+                                     &timer_, &stats_));
+  }
+
+  HotKeyReplica::LookupResult Lookup(const GoogleString& key) {
+    value_.DetachRetainingContent();
+    found_ = false;
+    return replica_->Lookup(key, false /* may_wait */, &value_, &found_);
+  }
+
+  // Looks key up until it becomes hot, and replicates value for it.
+  void MakeHot(const GoogleString& key, StringPiece value) {
+    for (int i = 1; i < options_.hot_threshold; ++i) {
+      ASSERT_EQ(HotKeyReplica::kFetch, Lookup(key));
+    }
+    ASSERT_EQ(HotKeyReplica::kFetchAndReport, Lookup(key));
+    replica_->FetchDone(key, true /* success */, true /* found */,
+                        SharedString(value));
+  }
+
+  int64 Stat(const char* name) {
+    return stats_.GetVariable(StrCat(kPrefix, name))->Get();
+  }
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  MockTimer timer_;
+  SimpleStats stats_;
+  HotKeyReplica::Options options_;
+  scoped_ptr<HotKeyReplica> replica_;
+  SharedString value_;
+  bool found_;
+};
+
+TEST_F(HotKeyReplicaTest, ReplicatesOnceHot) {
+  Init();
+  MakeHot("key", "value");
+  EXPECT_TRUE(replica_->IsHot("key"));
+  EXPECT_EQ(HotKeyReplica::kLocal, Lookup("key"));
+  EXPECT_TRUE(found_);
+  EXPECT_EQ("value", value_.Value());
+  EXPECT_EQ(1, Stat("_hot_key_local_hits"));
+  EXPECT_EQ(1, Stat("_hot_key_promotions"));
+
+  // Other keys are unaffected.
+  EXPECT_EQ(HotKeyReplica::kFetch, Lookup("other"));
+  EXPECT_FALSE(replica_->IsHot("other"));
+}
+
+TEST_F(HotKeyReplicaTest, ExpiresAfterTtl) {
+  Init();
+  MakeHot("key", "value");
+  timer_.AdvanceMs(kTtlMs - 1);
+  EXPECT_EQ(HotKeyReplica::kLocal, Lookup("key"));
+  timer_.AdvanceMs(1);
+
+  // Only one lookup refetches; the others go to the remote cache as usual
+  // until it reports.
+  EXPECT_EQ(HotKeyReplica::kFetchAndReport, Lookup("key"));
+  EXPECT_EQ(HotKeyReplica::kFetch, Lookup("key"));
+  replica_->FetchDone("key", true, true, SharedString("new"));
+  EXPECT_EQ(HotKeyReplica::kLocal, Lookup("key"));
+  EXPECT_EQ("new", value_.Value());
+}
+
+TEST_F(HotKeyReplicaTest, ReplicatesMisses) {
+  Init();
+  for (int i = 1; i < options_.hot_threshold; ++i) {
+    Lookup("key");
+  }
+  ASSERT_EQ(HotKeyReplica::kFetchAndReport, Lookup("key"));
+  replica_->FetchDone("key", true, false /* found */, SharedString());
+  EXPECT_EQ(HotKeyReplica::kLocal, Lookup("key"));
+  EXPECT_FALSE(found_);
+}
+
+TEST_F(HotKeyReplicaTest, FailedFetchIsNotReplicated) {
+  Init();
+  for (int i = 1; i < options_.hot_threshold; ++i) {
+    Lookup("key");
+  }
+  ASSERT_EQ(HotKeyReplica::kFetchAndReport, Lookup("key"));
+  replica_->FetchDone("key", false /* success */, false, SharedString());
+  EXPECT_EQ(HotKeyReplica::kFetchAndReport, Lookup("key"));
+}
+
+TEST_F(HotKeyReplicaTest, WritesUpdateReplica) {
+  Init();
+  MakeHot("key", "value");
+  replica_->Put("key", SharedString("put"));
+  EXPECT_EQ(HotKeyReplica::kLocal, Lookup("key"));
+  EXPECT_EQ("put", value_.Value());
+
+  replica_->Delete("key");
+  EXPECT_EQ(HotKeyReplica::kLocal, Lookup("key"));
+  EXPECT_FALSE(found_);
+
+  // Writes to keys that aren't hot aren't replicated.
+  replica_->Put("other", SharedString("put"));
+  EXPECT_FALSE(replica_->IsHot("other"));
+}
+
+TEST_F(HotKeyReplicaTest, WriteDuringFetchWins) {
+  Init();
+  MakeHot("key", "value");
+  timer_.AdvanceMs(kTtlMs);
+  ASSERT_EQ(HotKeyReplica::kFetchAndReport, Lookup("key"));
+  replica_->Put("key", SharedString("put"));
+  replica_->FetchDone("key", true, true, SharedString("fetched"));
+  EXPECT_EQ(HotKeyReplica::kLocal, Lookup("key"));
+  EXPECT_EQ("put", value_.Value());
+}
+
+TEST_F(HotKeyReplicaTest, Sampling) {
+  options_.sample_rate = 4;
+  options_.hot_threshold = 2;
+  Init();
+
+  // Only every 4th lookup is counted, so it takes 8 to reach 2.
+  for (int i = 0; i < 7; ++i) {
+    EXPECT_EQ(HotKeyReplica::kFetch, Lookup("key"));
+  }
+  EXPECT_EQ(HotKeyReplica::kFetchAndReport, Lookup("key"));
+}
+
+TEST_F(HotKeyReplicaTest, HotterKeysDisplaceColderOnes) {
+  Init();
+  MakeHot("a", "a");
+  MakeHot("b", "b");
+  Lookup("b");
+  Lookup("b");
+
+  // The set is full, and "c" is no hotter than "a", so it can't get in.
+  for (int i = 0; i < options_.hot_threshold; ++i) {
+    EXPECT_EQ(HotKeyReplica::kFetch, Lookup("c"));
+  }
+  EXPECT_FALSE(replica_->IsHot("c"));
+
+  // Once it is, it displaces "a".
+  EXPECT_EQ(HotKeyReplica::kFetchAndReport, Lookup("c"));
+  EXPECT_TRUE(replica_->IsHot("c"));
+  EXPECT_FALSE(replica_->IsHot("a"));
+  EXPECT_TRUE(replica_->IsHot("b"));
+}
+
+TEST_F(HotKeyReplicaTest, ConcurrentLookupsWaitForFetch) {
+  Init();
+  for (int i = 1; i < options_.hot_threshold; ++i) {
+    Lookup("key");
+  }
+  ASSERT_EQ(HotKeyReplica::kFetchAndReport, Lookup("key"));
+
+  // A lookup that may not wait goes to the remote cache itself; one that may
+  // gets the result of the fetch in progress.
+  EXPECT_EQ(HotKeyReplica::kFetch, Lookup("key"));
+  LookupThread thread(replica_.get(), thread_system_.get());
+  ASSERT_TRUE(thread.Start());
+  replica_->FetchDone("key", true, true, SharedString("value"));
+  thread.Join();
+  EXPECT_EQ(HotKeyReplica::kLocal, thread.result());
+  EXPECT_EQ("value", thread.value().Value());
+}
+
+TEST_F(HotKeyReplicaTest, Status) {
+  Init();
+  MakeHot("key", "value");
+  GoogleString status;
+  replica_->AppendStatus(&status);
+  EXPECT_NE(GoogleString::npos, status.find("key: frequency 3, replicated"))
+      << status;
+}
+
+}  // namespace net_instaweb
@@ -22,9 +22,11 @@
 #include <cstddef>
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/cache_interface.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
 #include "pagespeed/kernel/cache/lru_cache_base.h"
 
 namespace net_instaweb {
@@ -61,6 +63,13 @@ class LRUCache : public CacheInterface {
   // Not part of cache interface. Exported for testing only.
   void DeleteWithPrefixForTesting(StringPiece prefix);
 
+  // Filters insertions through a frequency-based admission policy; see
+  // LRUCacheBase.  Takes ownership of policy.
+  void set_admission_policy(FrequencyAdmissionPolicy* policy) {
+    admission_policy_.reset(policy);
+    base_.set_admission_policy(policy);
+  }
+
   // Total size in bytes of keys and values stored.
   size_t size_bytes() const { return base_.size_bytes(); }
 
@@ -78,6 +87,9 @@ class LRUCache : public CacheInterface {
     return base_.num_identical_reinserts();
   }
   size_t num_deletes() const { return base_.num_deletes(); }
+  size_t num_admission_rejections() const {
+    return base_.num_admission_rejections();
+  }
 
   // Sanity check the cache data structures.
   void SanityCheck() { base_.SanityCheck(); }
@@ -116,6 +128,7 @@ class LRUCache : public CacheInterface {
   Base base_;
   bool is_healthy_;
   SharedStringHelper value_helper_;
+  scoped_ptr<FrequencyAdmissionPolicy> admission_policy_;
 
   DISALLOW_COPY_AND_ASSIGN(LRUCache);
 };
@@ -30,7 +30,7 @@
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_hash.h"
 #include "pagespeed/kernel/base/string_util.h"
-
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
 
 namespace net_instaweb {
 
@@ -57,6 +57,11 @@ namespace net_instaweb {
 //                      const ValueType& new_value) const;
 //
 // ValueType must support copy-construction and assign-by-value.
+//
+// Optionally, a FrequencyAdmissionPolicy can be attached, in which case a
+// Put of a new key that would require an eviction is dropped unless the
+// new key has been looked up more often, recently, than the least recently
+// used entry it would displace.
 template<class ValueType, class ValueHelper>
 class LRUCacheBase {
   typedef std::pair<GoogleString, ValueType> KeyValuePair;
@@ -95,7 +100,8 @@ class LRUCacheBase {
   LRUCacheBase(size_t max_size, ValueHelper* value_helper)
       : max_bytes_in_cache_(max_size),
         current_bytes_in_cache_(0),
-        value_helper_(value_helper) {
+        value_helper_(value_helper),
+        admission_policy_(NULL) {
     ClearStats();
   }
   ~LRUCacheBase() {
@@ -109,11 +115,18 @@ class LRUCacheBase {
     max_bytes_in_cache_ = max_size;
   }
 
+  // Sets the policy used to decide whether new keys may evict old ones.
+  // Does not take ownership; NULL (the default) admits everything.
+  void set_admission_policy(FrequencyAdmissionPolicy* policy) {
+    admission_policy_ = policy;
+  }
+
   // Returns a pointer to the stored value, or NULL if not found, freshening
   // the entry in the lru-list.  Note: this pointer is safe to use until the
   // next call to Put or Delete in the cache.
   ValueType* GetFreshen(const GoogleString& key) {
     ValueType* value = NULL;
+    RecordAccess(key);
     typename Map::iterator p = map_.find(key);
     if (p != map_.end()) {
       ListNode cell = p->second;
@@ -133,6 +146,7 @@ class LRUCacheBase {
 
   ValueType* GetNoFreshen(const GoogleString& key) const {
     ValueType* value = NULL;
+    RecordAccess(key);
     typename Map::const_iterator p = map_.find(key);
     if (p != map_.end()) {
       ListNode cell = p->second;
@@ -191,7 +205,12 @@ class LRUCacheBase {
       // insertions the same way.  In both cases, the new key is in the map
       // as a result of the call to map_.insert above.
 
-      if (EvictIfNecessary(key.size() + value_helper_->size(new_value))) {
+      size_t bytes_needed = key.size() + value_helper_->size(new_value);
+      if (!found && !ShouldAdmit(key, bytes_needed)) {
+        // The admission policy prefers the entry we would have to evict.
+        map_.erase(map_iter);
+        ++num_admission_rejections_;
+      } else if (EvictIfNecessary(bytes_needed)) {
         // The new value fits.  Put it in the LRU-list.
         KeyValuePair* kvp = new KeyValuePair(map_iter->first, new_value);
         lru_ordered_list_.push_front(kvp);
@@ -240,6 +259,7 @@ class LRUCacheBase {
     num_inserts_ += src.num_inserts_;
     num_identical_reinserts_ += src.num_identical_reinserts_;
     num_deletes_ += src.num_deletes_;
+    num_admission_rejections_ += src.num_admission_rejections_;
   }
 
   // Total size in bytes of keys and values stored.
@@ -257,6 +277,7 @@ class LRUCacheBase {
   size_t num_inserts() const { return num_inserts_; }
   size_t num_identical_reinserts() const { return num_identical_reinserts_; }
   size_t num_deletes() const { return num_deletes_; }
+  size_t num_admission_rejections() const { return num_admission_rejections_; }
 
   // Sanity check the cache data structures.
   void SanityCheck() {
@@ -309,6 +330,7 @@ class LRUCacheBase {
     num_inserts_ = 0;
     num_identical_reinserts_ = 0;
     num_deletes_ = 0;
+    num_admission_rejections_ = 0;
   }
 
   // Iterators for walking cache entries from oldest to youngest.
@@ -343,6 +365,29 @@ class LRUCacheBase {
     ++num_deletes_;
   }
 
+  void RecordAccess(const GoogleString& key) const {
+    if (admission_policy_ != NULL) {
+      admission_policy_->RecordAccess(
+          FrequencyAdmissionPolicy::HashKey(key));
+    }
+  }
+
+  // Returns false if inserting a new entry of the given size would evict the
+  // least recently used entry, and the admission policy rates that entry
+  // above the new key.  Entries too big to ever fit are left for
+  // EvictIfNecessary to reject.
+  bool ShouldAdmit(const GoogleString& key, size_t bytes_needed) {
+    if ((admission_policy_ == NULL) || lru_ordered_list_.empty() ||
+        (bytes_needed >= max_bytes_in_cache_) ||
+        (bytes_needed + current_bytes_in_cache_ <= max_bytes_in_cache_)) {
+      return true;
+    }
+    const KeyValuePair* victim = lru_ordered_list_.back();
+    return admission_policy_->Admit(
+        FrequencyAdmissionPolicy::HashKey(key),
+        FrequencyAdmissionPolicy::HashKey(victim->first));
+  }
+
   bool EvictIfNecessary(size_t bytes_needed) {
     bool ret = false;
     if (bytes_needed < max_bytes_in_cache_) {
@@ -371,9 +416,11 @@ class LRUCacheBase {
   size_t num_inserts_;
   size_t num_identical_reinserts_;
   size_t num_deletes_;
+  size_t num_admission_rejections_;
   EntryList lru_ordered_list_;
   Map map_;
   ValueHelper* value_helper_;
+  FrequencyAdmissionPolicy* admission_policy_;
 
   DISALLOW_COPY_AND_ASSIGN(LRUCacheBase);
 };
@@ -41,9 +41,16 @@
 #include "pagespeed/kernel/base/benchmark.h"
 #include "pagespeed/kernel/base/cache_interface.h"
 #include "pagespeed/kernel/base/null_mutex.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/stl_util.h"
 #include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/cache/sharded_lru_cache.h"
+#include "pagespeed/kernel/cache/threadsafe_cache.h"
+#include "pagespeed/kernel/util/platform.h"
 #include "pagespeed/kernel/util/simple_random.h"
 
 namespace {
@@ -52,6 +59,14 @@ const int kNumKeys = 100000;
 const int kKeySize = 50;
 const int kPayloadSize = 100;
 
+// Parameters for the multi-threaded benchmarks.  The total number of
+// operations is held constant and divided among the threads, so perfect
+// scaling shows up as the time per iteration dropping with the thread count.
+const int kNumThreadedKeys = 10000;
+const int kTotalThreadedOps = 1 << 18;
+const int kPutsPerHundredOps = 10;
+const int kNumShards = 64;
+
 class EmptyCallback : public net_instaweb::CacheInterface::Callback {
  public:
   EmptyCallback() {}
@@ -188,6 +203,125 @@ static void LRUEvictions(int iters) {
   CHECK_LT(0, static_cast<int>(payload.lru_cache()->num_evictions()));
 }
 
+// Issues a mix of Gets and Puts against a shared cache from its own thread.
+class CacheHammer : public net_instaweb::ThreadSystem::Thread {
+ public:
+  CacheHammer(net_instaweb::ThreadSystem* thread_system,
+              net_instaweb::CacheInterface* cache,
+              const net_instaweb::StringVector* keys,
+              const std::vector<net_instaweb::SharedString>* values,
+              int index, int num_ops)
+      : Thread(thread_system, "cache_hammer",
+               net_instaweb::ThreadSystem::kJoinable),
+        cache_(cache),
+        keys_(keys),
+        values_(values),
+        index_(index),
+        num_ops_(num_ops) {
+  }
+
+  virtual void Run() {
+    // Stride through the keys starting from a different place in each
+    // thread, so that threads do not march through the shards in lockstep.
+    int num_keys = keys_->size();
+    int k = (index_ * 7919) % num_keys;
+    for (int i = 0; i < num_ops_; ++i) {
+      k = (k + 101) % num_keys;
+      if ((i % 100) < kPutsPerHundredOps) {
+        cache_->Put((*keys_)[k], (*values_)[k]);
+      } else {
+        cache_->Get((*keys_)[k], &empty_callback_);
+      }
+    }
+  }
+
+ private:
+  net_instaweb::CacheInterface* cache_;
+  const net_instaweb::StringVector* keys_;
+  const std::vector<net_instaweb::SharedString>* values_;
+  int index_;
+  int num_ops_;
+  EmptyCallback empty_callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(CacheHammer);
+};
+
+// Holds a populated thread-safe cache, and runs a fixed amount of mixed
+// Get/Put traffic against it split across a number of threads.
+class ThreadedPayload {
+ public:
+  ThreadedPayload(bool sharded, net_instaweb::ThreadSystem* thread_system)
+      : thread_system_(thread_system),
+        keys_(kNumThreadedKeys),
+        values_(kNumThreadedKeys) {
+    StopBenchmarkTiming();
+    // Size the cache so that all the keys fit; we are measuring lock
+    // contention, not eviction.
+    int cache_size = 2 * kNumThreadedKeys * (kKeySize + kPayloadSize);
+    if (sharded) {
+      cache_.reset(new net_instaweb::ShardedLRUCache(
+          cache_size, kNumShards, thread_system));
+    } else {
+      lru_cache_.reset(new net_instaweb::LRUCache(cache_size));
+      cache_.reset(new net_instaweb::ThreadsafeCache(
+          lru_cache_.get(), thread_system->NewMutex()));
+    }
+    net_instaweb::SimpleRandom random(new net_instaweb::NullMutex);
+    GoogleString key_prefix = random.GenerateHighEntropyString(kKeySize);
+    GoogleString value = random.GenerateHighEntropyString(kPayloadSize);
+    for (int k = 0; k < kNumThreadedKeys; ++k) {
+      keys_[k] = net_instaweb::StrCat(key_prefix,
+                                      net_instaweb::IntegerToString(k));
+      values_[k].Assign(value);
+      cache_->Put(keys_[k], values_[k]);
+    }
+    StartBenchmarkTiming();
+  }
+
+  void Run(int num_threads) {
+    std::vector<CacheHammer*> hammers(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      hammers[i] = new CacheHammer(thread_system_, cache_.get(), &keys_,
+                                   &values_, i,
+                                   kTotalThreadedOps / num_threads);
+    }
+    for (int i = 0; i < num_threads; ++i) {
+      hammers[i]->Start();
+    }
+    for (int i = 0; i < num_threads; ++i) {
+      hammers[i]->Join();
+    }
+    STLDeleteElements(&hammers);
+  }
+
+ private:
+  net_instaweb::ThreadSystem* thread_system_;
+  scoped_ptr<net_instaweb::LRUCache> lru_cache_;
+  scoped_ptr<net_instaweb::CacheInterface> cache_;
+  net_instaweb::StringVector keys_;
+  std::vector<net_instaweb::SharedString> values_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadedPayload);
+};
+
+static void ThreadsafeLRUGetsPuts(int iters, int num_threads) {
+  scoped_ptr<net_instaweb::ThreadSystem> thread_system(
+      net_instaweb::Platform::CreateThreadSystem());
+  ThreadedPayload payload(false, thread_system.get());
+  for (int i = 0; i < iters; ++i) {
+    payload.Run(num_threads);
+  }
+}
+
+static void ShardedLRUGetsPuts(int iters, int num_threads) {
+  scoped_ptr<net_instaweb::ThreadSystem> thread_system(
+      net_instaweb::Platform::CreateThreadSystem());
+  ThreadedPayload payload(true, thread_system.get());
+  for (int i = 0; i < iters; ++i) {
+    payload.Run(num_threads);
+  }
+}
+
 }  // namespace
 
 BENCHMARK(LRUPuts);
@@ -196,3 +330,5 @@ BENCHMARK(LRUReplaceNewValue);
 BENCHMARK(LRUGets);
 BENCHMARK(LRUFailedGets);
 BENCHMARK(LRUEvictions);
+BENCHMARK_RANGE(ThreadsafeLRUGetsPuts, 1, 32);
+BENCHMARK_RANGE(ShardedLRUGetsPuts, 1, 32);
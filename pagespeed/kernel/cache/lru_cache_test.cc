@@ -21,8 +21,14 @@
 #include "pagespeed/kernel/cache/lru_cache.h"
 
 #include <cstddef>
+
 #include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/null_mutex.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/cache/cache_test_base.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+#include "pagespeed/kernel/cache/synthetic_cache_trace.h"
 
 namespace {
 const size_t kMaxSize = 100;
@@ -163,6 +169,90 @@ TEST_F(LRUCacheTest, LeastRecentlyUsed) {
   }
 }
 
+// With an admission policy, a new key only displaces the LRU victim if it
+// has been looked up more often.
+TEST_F(LRUCacheTest, AdmissionPolicy) {
+  cache_.set_admission_policy(new FrequencyAdmissionPolicy(1000,
+                                                           new NullMutex));
+  GoogleString keys[10], values[10];
+  for (int i = 0; i < 10; ++i) {
+    SStringPrintf(&keys[i], "name%d", i);
+    SStringPrintf(&values[i], "valu%d", i);
+    CheckPut(keys[i], values[i]);
+  }
+  EXPECT_EQ(kMaxSize, cache_.size_bytes());
+  for (int i = 0; i < 10; ++i) {
+    CheckGet(keys[i], values[i]);
+    CheckGet(keys[i], values[i]);
+  }
+
+  // A key that was looked up once does not get to evict name0.
+  CheckNotFound("nameA");
+  CheckPut("nameA", "valuA");
+  CheckNotFound("nameA");
+  CheckGet("name0", "valu0");
+  EXPECT_EQ(static_cast<size_t>(1), cache_.num_admission_rejections());
+  EXPECT_EQ(static_cast<size_t>(0), cache_.num_evictions());
+
+  // One that has been asked for three times displaces the LRU, name1.
+  CheckNotFound("nameB");
+  CheckNotFound("nameB");
+  CheckNotFound("nameB");
+  CheckPut("nameB", "valuB");
+  CheckGet("nameB", "valuB");
+  CheckNotFound("name1");
+  EXPECT_EQ(static_cast<size_t>(1), cache_.num_admission_rejections());
+  EXPECT_EQ(static_cast<size_t>(1), cache_.num_evictions());
+
+  // Replacing the value of an existing key is always allowed.
+  CheckPut("name2", "VALU2");
+  CheckGet("name2", "VALU2");
+  EXPECT_EQ(static_cast<size_t>(1), cache_.num_admission_rejections());
+}
+
+namespace {
+
+// Looks up each key in trace in a cache of cache_bytes, inserting it if it
+// misses, and returns the number of hits.
+int ReplayTrace(const StringVector& trace, size_t cache_bytes,
+                bool use_admission_policy) {
+  const int kPayloadSize = 100;
+  LRUCache cache(cache_bytes);
+  if (use_admission_policy) {
+    cache.set_admission_policy(new FrequencyAdmissionPolicy(
+        cache_bytes / (50 + kPayloadSize), new NullMutex));
+  }
+  SharedString value(GoogleString(kPayloadSize, 'x'));
+  int hits = 0;
+  CacheTestBase::Callback callback;
+  for (int i = 0, n = trace.size(); i < n; ++i) {
+    cache.Get(trace[i], callback.Reset());
+    if (callback.state() == CacheInterface::kAvailable) {
+      ++hits;
+    } else {
+      cache.Put(trace[i], value);
+    }
+  }
+  return hits;
+}
+
+}  // namespace
+
+// The synthetic trace cache_admission_speed_test replays, on a smaller scale:
+// Zipf-distributed popular keys interleaved with keys that are requested only
+// once, as unique HTML URLs are.  Turning the popular keys away for the sake
+// of the one-shot keys is exactly what the admission policy should prevent.
+TEST_F(LRUCacheTest, AdmissionPolicyBeatsLruOnOneShotKeys) {
+  StringVector trace;
+  GenerateSyntheticCacheTrace(50000, 2000, 35, 0.9, &trace);
+
+  for (size_t cache_kb = 16; cache_kb <= 64; cache_kb *= 2) {
+    int lru_hits = ReplayTrace(trace, cache_kb * 1024, false);
+    int admission_hits = ReplayTrace(trace, cache_kb * 1024, true);
+    EXPECT_GT(admission_hits, lru_hits) << cache_kb << "kB";
+  }
+}
+
 TEST_F(LRUCacheTest, BasicInvalid) {
   // Check that we honor callback veto on validity.
   CheckPut("nameA", "valueA");
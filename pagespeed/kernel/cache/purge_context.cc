@@ -18,7 +18,10 @@
 
 #include "pagespeed/kernel/cache/purge_context.h"
 
+#include <algorithm>
+
 #include "base/logging.h"
+#include "strings/stringpiece_utils.h"
 #include "pagespeed/kernel/base/abstract_mutex.h"
 #include "pagespeed/kernel/base/atomic_bool.h"
 #include "pagespeed/kernel/base/basictypes.h"
@@ -45,6 +48,13 @@ const int64 kStealLockAfterMs = 2 * Timer::kSecondMs;
 const int64 kTimeoutMs = 3 * Timer::kSecondMs;
 const int kMaxContentionRetries = 2;
 
+// The purge file is compacted once it's this many times larger than the
+// purge set can hold.
+const int kCompactionFactor = 4;
+
+// Readers take the purge file this many bytes at a time.
+const int kReadChunkBytes = 4096;
+
 }  // namespace
 
 const char PurgeContext::kCancellations[]        = "purge_cancellations";
@@ -130,6 +140,7 @@ PurgeContext::PurgeContext(StringPiece filename,
       num_consecutive_failures_(0),
       waiting_for_interprocess_lock_(false),
       reading_(false),
+      file_offset_(0),
       enable_purge_(true),
       max_bytes_in_cache_(max_bytes_in_cache),
       request_batching_delay_ms_(0),
@@ -183,10 +194,53 @@ bool PurgeContext::ParseAndValidateTimestamp(
   return true;
 }
 
-// Parses the cache purge file.
-void PurgeContext::ReadPurgeFile(PurgeSet* purges_from_file) {
-  GoogleString buffer;
+bool PurgeContext::ParseHeader(StringPiece line, int64 now_ms,
+                               int64* timestamp_ms, int64* generation) {
+  *generation = 0;
+  TrimWhitespace(&line);
+  stringpiece_ssize_type pos = line.find(' ');
+  if (pos == StringPiece::npos) {
+    return ParseAndValidateTimestamp(line, now_ms, timestamp_ms);
+  }
+  return (ParseAndValidateTimestamp(line.substr(0, pos), now_ms,
+                                    timestamp_ms) &&
+          StringToInt64(line.substr(pos + 1), generation));
+}
+
+int PurgeContext::ParseRecords(StringPiece records, int64 now_ms,
+                               PurgeSet* purges) {
+  StringPieceVector lines;
+  SplitStringPieceToVector(records, "\n", &lines, true);
+  int num_records = 0;
+  int64 timestamp_ms = 0;
+  for (int i = 0, n = lines.size(); i < n; ++i) {
+    // Each line is in the form "TIMESTAMP_MS URL", or just "TIMESTAMP_MS"
+    // for a purge of the whole cache.  The url has no character restrictions
+    // in this file format, and terminates at newline.  The timestamp is a
+    // 64-bit decimal number measured in milliseconds since 1970.
+    StringPiece line = lines[i];
+    stringpiece_ssize_type pos = line.find(' ');
+    if (pos == StringPiece::npos) {
+      if (!ParseAndValidateTimestamp(line, now_ms, &timestamp_ms)) {
+        file_parse_failures_->Add(1);
+      } else {
+        purges->UpdateGlobalInvalidationTimestampMs(timestamp_ms);
+        ++num_records;
+      }
+    } else if (!ParseAndValidateTimestamp(line.substr(0, pos), now_ms,
+                                          &timestamp_ms)) {
+      file_parse_failures_->Add(1);
+    } else {
+      StringPiece url = line.substr(pos + 1);
+      purges->Put(url.as_string(), timestamp_ms);
+      ++num_records;
+    }
+  }
+  return num_records;
+}
 
+// Reads the legacy cache flush file, whose contents are not significant.
+void PurgeContext::ReadPurgeFile(PurgeSet* purges_from_file) {
   file_stats_->Add(1);
   NullMessageHandler null_handler;
 
@@ -194,54 +248,47 @@ void PurgeContext::ReadPurgeFile(PurgeSet* purges_from_file) {
   // significant, and generally empty, and only the timestamp of the file
   // itself was important, meaning "wipe everything out of the cache predating
   // that timestamp."
-  if (!enable_purge_) {
-    int64 timestamp_sec;
-    if (file_system_->Mtime(filename_, &timestamp_sec, &null_handler)) {
-      int64 timestamp_ms = timestamp_sec * Timer::kSecondMs;
-      purges_from_file->UpdateGlobalInvalidationTimestampMs(timestamp_ms);
-    }
-    return;
+  DCHECK(!enable_purge_);
+  int64 timestamp_sec;
+  if (file_system_->Mtime(filename_, &timestamp_sec, &null_handler)) {
+    int64 timestamp_ms = timestamp_sec * Timer::kSecondMs;
+    purges_from_file->UpdateGlobalInvalidationTimestampMs(timestamp_ms);
   }
+}
 
-  if (!file_system_->ReadFile(filename_.c_str(), &buffer, &null_handler)) {
-    // If the file simply doesn't exist, that's a 'successful' read.  It's
-    // fine for there to be no cache file and no invalidation data, and thus
-    // we swallow file-not-found messages with NullMessageHandler.
-    return;
-  }
-  StringPieceVector lines;
-  SplitStringPieceToVector(buffer, "\n", &lines, true);
-  int64 timestamp_ms = 0;
-  int64 now_ms = timer_->NowMs();
-
-  // The first line should contain the global invalidation timestamp,
-  // though we'll just silently leave the invalidation timestamp unchanged
-  // if the file was empty.
-  if (lines.empty() || !ParseAndValidateTimestamp(lines[0], now_ms,
-                                                  &timestamp_ms)) {
-    file_parse_failures_->Add(1);
-    return;
+bool PurgeContext::ReadPurgeFileContents(GoogleString* contents,
+                                         bool* incremental) {
+  // If the file simply doesn't exist, that's a 'successful' read.  It's
+  // fine for there to be no cache file and no invalidation data, and thus
+  // we swallow file-not-found messages with NullMessageHandler.
+  NullMessageHandler null_handler;
+  FileSystem::InputFile* file =
+      file_system_->OpenInputFile(filename_.c_str(), &null_handler);
+  if (file == NULL) {
+    return false;
   }
-  purges_from_file->UpdateGlobalInvalidationTimestampMs(timestamp_ms);
 
-  for (int i = 1, n = lines.size(); i < n; ++i) {
-    // Each line is in the form "TIMESTAMP_MS URL".  The url
-    // has no character restrictions in this file format, and terminates at
-    // newline.  The timestamp is a 64-bit decimal number measured in
-    // milliseconds since 1970.
-    StringPiece line = lines[i];
-    if (!line.empty()) {  // skip empty lines but include them in line-count.
-      stringpiece_ssize_type pos = line.find(' ');
-      if ((pos == StringPiece::npos) ||
-          !ParseAndValidateTimestamp(line.substr(0, pos), now_ms,
-                                     &timestamp_ms)) {
-        file_parse_failures_->Add(1);
-      } else {
-        StringPiece url = line.substr(pos + 1);
-        purges_from_file->Put(url.as_string(), timestamp_ms);
-      }
+  // The header is rewritten whenever the file is, so if it hasn't changed,
+  // the file has only been appended to since we last read it.
+  char buf[kReadChunkBytes];
+  int num_read = std::max(0, file->Read(buf, sizeof(buf), &null_handler));
+  StringPiece chunk(buf, num_read);
+  *incremental = false;
+  if (!file_header_.empty() && chunk.starts_with(file_header_)) {
+    if (file_offset_ <= static_cast<int64>(chunk.size())) {
+      chunk.remove_prefix(file_offset_);
+      *incremental = true;
+    } else if (file->Seek(file_offset_, &null_handler)) {
+      chunk.clear();
+      *incremental = true;
     }
   }
+  chunk.CopyToString(contents);
+  while ((num_read = file->Read(buf, sizeof(buf), &null_handler)) > 0) {
+    contents->append(buf, num_read);
+  }
+  file_system_->Close(file, &null_handler);
+  return true;
 }
 
 // While still holding the interprocess lock, verify that the bytes in
@@ -274,12 +321,54 @@ void PurgeContext::UpdateCachePurgeFile() {
   // interprocess_lock_.  Note that during 'modify' we need to
   // also grab mutex_, so we'll need to collect the serizlized
   // buffer and callback-list at the same time for atomicity.
-  GoogleString buffer, verify;
-  ReadPurgeFile(&purges_from_file);                                   // read
-  ModifyPurgeSet(&purges_from_file, &buffer, &callbacks,
-                 &return_purges, &failures);                          // modify
-  if (!WritePurgeFile(buffer) ||                                      // write
-      !Verify(buffer)) {                                              // verify
+  //
+  // Usually the new purges are just appended to the file, which other
+  // processes then only need to read from where they left off.  Once the
+  // file has grown well past what the purge set can hold, or if it's
+  // invalid, it is compacted: we parse it, and atomically rewrite it with
+  // the records that are still live under a new header.
+  GoogleString old_contents, buffer;
+  int64 generation = 0;
+  bool append = false;
+  if (!enable_purge_) {
+    ReadPurgeFile(&purges_from_file);                                 // read
+  } else {
+    file_stats_->Add(1);
+    NullMessageHandler null_handler;
+    if (file_system_->ReadFile(filename_.c_str(), &old_contents,
+                               &null_handler)) {
+      int64 now_ms = timer_->NowMs();
+      int64 timestamp_ms;
+      StringPiece records(old_contents);
+      stringpiece_ssize_type header_end = records.find('\n');
+      StringPiece header = records.substr(0, header_end);
+      records.remove_prefix((header_end == StringPiece::npos) ?
+                            records.size() : header_end + 1);
+      if (!ParseHeader(header, now_ms, &timestamp_ms, &generation)) {
+        file_parse_failures_->Add(1);
+      } else if ((header_end != StringPiece::npos) &&
+                 strings::EndsWith(old_contents, "\n") &&
+                 (static_cast<int64>(old_contents.size()) <
+                  kCompactionFactor * max_bytes_in_cache_)) {
+        append = true;
+      } else {
+        purges_from_file.UpdateGlobalInvalidationTimestampMs(timestamp_ms);
+        ParseRecords(records, now_ms, &purges_from_file);
+      }
+    }
+  }
+  if (!append) {
+    // The new header tells readers to read the whole file again.
+    generation = std::max(timer_->NowUs(), generation + 1);
+  }
+  ModifyPurgeSet(&purges_from_file, append, generation, &buffer,
+                 &callbacks, &return_purges, &failures);              // modify
+  bool written = append ? AppendPurgeFile(buffer) :                   // write
+      WritePurgeFile(buffer);
+  if (append) {
+    buffer = StrCat(old_contents, buffer);
+  }
+  if (!written || !Verify(buffer)) {                                  // verify
     contentions_->Add(1);
     success = false;
     HandleWriteFailure(failures, &callbacks, &return_purges, &lock_and_update);
@@ -351,6 +440,7 @@ void PurgeContext::HandleWriteFailure(int failures,
 }
 
 void PurgeContext::ModifyPurgeSet(PurgeSet* purges_from_file,
+                                  bool append, int64 generation,
                                   GoogleString* buffer,
                                   PurgeCallbackVector* return_callbacks,
                                   PurgeSet* return_purges,
@@ -379,10 +469,17 @@ void PurgeContext::ModifyPurgeSet(PurgeSet* purges_from_file,
   // again.
 
   // Collect the write-buffer from the aggregated PurgeSet while we
-  // have mutex_ held.
-  StrAppend(buffer, Integer64ToString(
-      purges_from_file->global_invalidation_timestamp_ms()),
-            "\n");
+  // have mutex_ held.  When appending, a global invalidation is a record
+  // of its own; otherwise it goes in the header.
+  if (!append) {
+    StrAppend(buffer, Integer64ToString(
+        purges_from_file->global_invalidation_timestamp_ms()),
+              " ", Integer64ToString(generation), "\n");
+  } else if (purges_from_file->has_global_invalidation_timestamp_ms()) {
+    StrAppend(buffer, Integer64ToString(
+        purges_from_file->global_invalidation_timestamp_ms()),
+              "\n");
+  }
   for (PurgeSet::Iterator p = purges_from_file->Begin(),
            e = purges_from_file->End();
        p != e; ++p) {
@@ -410,6 +507,18 @@ bool PurgeContext::WritePurgeFile(const GoogleString& buffer) {
   return file_system_->WriteFileAtomic(filename_, buffer, message_handler_);
 }
 
+bool PurgeContext::AppendPurgeFile(const GoogleString& buffer) {
+  // Readers may see a partial append, but they only take complete lines.
+  file_writes_->Add(1);
+  FileSystem::OutputFile* file = file_system_->OpenOutputFileForAppend(
+      filename_.c_str(), message_handler_);
+  if (file == NULL) {
+    return false;
+  }
+  bool ret = file->Write(buffer, message_handler_);
+  return file_system_->Close(file, message_handler_) && ret;
+}
+
 // There is a non-zero chance that this thread will be unable to
 // acquire the named-lock in the given time-limit.  We'll just bump up
 // the cancellation count.
@@ -518,17 +627,77 @@ void PurgeContext::ReadFileAndCallCallbackIfChanged(bool needs_update) {
   CopyOnWrite<PurgeSet> purges_from_file;
   PurgeSet* mutable_purges_from_file = purges_from_file.MakeWriteable();
   mutable_purges_from_file->set_max_size(max_bytes_in_cache_);
+  bool changed = false;
   bool call_callback = false;
 
   // Note that we don't hold the global lock while reading the file.
   // But under mutex we have set reading_ so another thread doesn't
   // try a concurrent read.
   DCHECK(reading_);
-  ReadPurgeFile(mutable_purges_from_file);
+  GoogleString contents;
+  bool incremental = false;
+  bool exists = false;
+  if (!enable_purge_) {
+    ReadPurgeFile(mutable_purges_from_file);
+  } else {
+    file_stats_->Add(1);
+    exists = ReadPurgeFileContents(&contents, &incremental);
+  }
+
+  int64 now_ms = timer_->NowMs();
+  if (incremental) {
+    // Replay the records appended since the last read onto a copy of the
+    // current purge set.  A partially appended last line is left for next
+    // time.
+    int64 complete_size = contents.rfind('\n') + 1;
+    if (complete_size > 0) {
+      {
+        ScopedMutex lock(mutex_.get());
+        purges_from_file = purge_set_;
+      }
+      changed = (ParseRecords(StringPiece(contents.data(), complete_size),
+                              now_ms, purges_from_file.MakeWriteable()) > 0);
+      file_offset_ += complete_size;
+    }
+  } else {
+    file_header_.clear();
+    file_offset_ = 0;
+    if (!contents.empty()) {
+      // The first line should contain the global invalidation timestamp,
+      // though we'll just silently leave the invalidation timestamp
+      // unchanged if the file was empty.
+      StringPiece records(contents);
+      stringpiece_ssize_type header_end = records.find('\n');
+      StringPiece header = records.substr(0, header_end);
+      int64 timestamp_ms, generation;
+      if (!ParseHeader(header, now_ms, &timestamp_ms, &generation)) {
+        file_parse_failures_->Add(1);
+      } else {
+        mutable_purges_from_file->UpdateGlobalInvalidationTimestampMs(
+            timestamp_ms);
+        if (header_end != StringPiece::npos) {
+          // As when reading incrementally, a partially appended last line
+          // is left for the next read, which starts at file_offset_.
+          int64 complete_size = contents.rfind('\n') + 1;
+          records = records.substr(header_end + 1,
+                                   complete_size - (header_end + 1));
+          ParseRecords(records, now_ms, mutable_purges_from_file);
+          header = StringPiece(contents.data(), header_end + 1);
+          header.CopyToString(&file_header_);
+          file_offset_ = complete_size;
+        }
+      }
+    } else if (exists) {
+      file_parse_failures_->Add(1);
+    }
+  }
 
   {
     ScopedMutex lock(mutex_.get());
-    if (!purge_set_->Equals(*purges_from_file)) {
+    if (!incremental) {
+      changed = !purge_set_->Equals(*purges_from_file);
+    }
+    if (changed) {
       if (!needs_update) {
         // This update was induced by a timeout in this process, rather
         // than by a signal from another process or an UpdateCachePurgeFile
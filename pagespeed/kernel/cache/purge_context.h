@@ -47,6 +47,14 @@ class Variable;
 // multiple concurrent threads/processes to handle purge requests and
 // propagate them to the other processes.
 //
+// The purge file starts with a header line, "GLOBAL_TIMESTAMP_MS GENERATION",
+// followed by one line per record: "TIMESTAMP_MS URL" to purge a URL (or, if
+// it ends in '*', every URL with that prefix), or just "TIMESTAMP_MS" to purge
+// everything.  New records are appended, so other processes only replay the
+// bytes they haven't seen yet.  Once the file grows well past what the
+// PurgeSet holds, it is compacted by rewriting it atomically with a new
+// generation in the header, which tells readers to read the whole file.
+//
 // All public methods in this class are thread-safe.
 //
 // This class depends on Statistics being functional.  If statistics are off,
@@ -145,18 +153,34 @@ class PurgeContext {
   // held.
   void UpdateCachePurgeFile();
 
-  // Reads the contents of filename_ into *purges_from_file.  Any invalid
-  // data in the file is ignored.
+  // Reads the timestamp of filename_ into *purges_from_file, when
+  // enable_purge_ is false and only the file's mtime is significant.
   //
   // This method doesn't read or write dynamic data from the class other
-  // than statistics, so it's thread-safe.  Also it does not need to be
-  // called with interprocess_lock_ held as the writes are made atomic
-  // via write-to-temp + rename.
+  // than statistics, so it's thread-safe.
   void ReadPurgeFile(PurgeSet* purges_from_file);
+
+  // Reads filename_ into *contents, returning false if it doesn't exist.
+  // If its header is still file_header_, only the bytes past file_offset_
+  // are read, and *incremental is set.  This does not need to be called
+  // with interprocess_lock_ held, as the file is only appended to, or
+  // replaced atomically via write-to-temp + rename.
+  bool ReadPurgeFileContents(GoogleString* contents, bool* incremental);
   void ReadFileAndCallCallbackIfChanged(bool needs_update);
 
+  // Parses the header line of the purge file.  Files written before the
+  // file was appended to have no generation, which reads as 0.
+  bool ParseHeader(StringPiece line, int64 now_ms, int64* timestamp_ms,
+                   int64* generation);
+
+  // Applies the purge records in records to *purges, returning how many
+  // were valid.  Invalid records are counted in file_parse_failures_.
+  int ParseRecords(StringPiece records, int64 now_ms, PurgeSet* purges);
+
   // Combines the purges_from_file with pending_purges_ and purge_set_,
   // serializes the result into *buffer for writing back to the file.
+  // If append, *buffer only gets records to append to the file, and
+  // otherwise it gets a whole file with generation in its header.
   //
   // Note: this does *not* update purge_set_ (it treats it as read-only).
   // However, it bumps purge_index_ to induce a file-read on
@@ -178,7 +202,8 @@ class PurgeContext {
   // transaction which should be made an explicit class or struct.
   //
   // This method is thread-safe; it grabs mutex_.
-  void ModifyPurgeSet(PurgeSet* purges_from_file, GoogleString* buffer,
+  void ModifyPurgeSet(PurgeSet* purges_from_file, bool append,
+                      int64 generation, GoogleString* buffer,
                       PurgeCallbackVector* return_callbacks,
                       PurgeSet* return_purges,
                       int* failures);
@@ -196,6 +221,10 @@ class PurgeContext {
   // or update dynamic data in this.
   bool WritePurgeFile(const GoogleString& buffer);
 
+  // Appends serialized purge records to filename_, with the same
+  // requirements as WritePurgeFile.
+  bool AppendPurgeFile(const GoogleString& buffer);
+
   // Returns true if the contents of filename_ matches the specified buffer.
   bool Verify(const GoogleString& expected_purge_file_contents);
 
@@ -241,6 +270,11 @@ class PurgeContext {
   bool waiting_for_interprocess_lock_;     // protected_by mutex_
   bool reading_;                           // protected_by mutex_
 
+  // The header line of the purge file as of our last read, and how far we
+  // read into it.  These are only accessed by the thread that set reading_.
+  GoogleString file_header_;
+  int64 file_offset_;
+
   bool enable_purge_;           // When false, can only flush entire cache.
   int max_bytes_in_cache_;
 
@@ -68,6 +68,14 @@ class PurgeContextTest : public ::testing::Test,
     return purge_set->IsValid(url, now_ms);
   }
 
+  void AppendToPurgeFile(StringPiece records) {
+    FileSystem::OutputFile* file =
+        file_system_.OpenOutputFileForAppend(kPurgeFile, &message_handler_);
+    ASSERT_TRUE(file != NULL);
+    EXPECT_TRUE(file->Write(records, &message_handler_));
+    EXPECT_TRUE(file_system_.Close(file, &message_handler_));
+  }
+
   bool PollAndTest1(const GoogleString& url, int64 now_ms) {
     return PollAndTest(url, now_ms, purge_set1_, purge_context1_.get());
   }
@@ -370,7 +378,98 @@ TEST_P(PurgeContextTest, InvalidTimestampInPurgeRecord) {
   EXPECT_FALSE(PollAndTest1("a", 500));
   EXPECT_EQ(ExpectStat(3), file_parse_failures());
   EXPECT_TRUE(PollAndTest1("a", 501));
-  EXPECT_EQ(ExpectStat(6), file_parse_failures());
+
+  // The file hasn't changed, so it isn't parsed again.
+  EXPECT_EQ(ExpectStat(3), file_parse_failures());
+}
+
+TEST_P(PurgeContextTest, PurgesAreAppended) {
+  scheduler_.AdvanceTimeMs(1000);
+  purge_context1_->AddPurgeUrl("a", 500000, ExpectSuccess());
+  EXPECT_FALSE(PollAndTest2("a", 500000));
+  GoogleString contents;
+  ASSERT_TRUE(file_system_.ReadFile(kPurgeFile, &contents, &message_handler_));
+  StringPiece header = StringPiece(contents).substr(0, contents.find('\n'));
+
+  // A global purge, and a second URL, are appended to the file, and the
+  // other context replays just them.
+  purge_context2_->SetCachePurgeGlobalTimestampMs(550000, ExpectSuccess());
+  purge_context2_->AddPurgeUrl("b", 600000, ExpectSuccess());
+  scheduler_.AdvanceTimeMs(10 * Timer::kSecondMs);
+  EXPECT_FALSE(PollAndTest1("b", 600000));
+  EXPECT_TRUE(PollAndTest1("b", 600001));
+  EXPECT_FALSE(PollAndTest1("a", 500000));
+  EXPECT_FALSE(PollAndTest1("c", 550000));
+  EXPECT_TRUE(PollAndTest1("c", 550001));
+  GoogleString appended;
+  ASSERT_TRUE(file_system_.ReadFile(kPurgeFile, &appended,
+                                    &message_handler_));
+  EXPECT_EQ(StrCat(contents, "550000\n600000 b\n"), appended);
+  EXPECT_TRUE(StringPiece(appended).starts_with(header));
+  EXPECT_EQ(0, file_parse_failures());
+}
+
+TEST_P(PurgeContextTest, PartialRecordIsReadOnceComplete) {
+  ASSERT_TRUE(file_system_.WriteFile(kPurgeFile, "-1 1\n500 a\n",
+                                     &message_handler_));
+  EXPECT_FALSE(PollAndTest1("a", 500));
+
+  // Another process has only written part of its record so far.
+  AppendToPurgeFile("700 b");
+  scheduler_.AdvanceTimeMs(10 * Timer::kSecondMs);
+  EXPECT_TRUE(PollAndTest1("b", 600));
+  AppendToPurgeFile("b\n");
+  scheduler_.AdvanceTimeMs(10 * Timer::kSecondMs);
+  EXPECT_TRUE(PollAndTest1("b", 600));
+  EXPECT_FALSE(PollAndTest1("bb", 700));
+  EXPECT_FALSE(PollAndTest1("a", 500));
+  EXPECT_EQ(0, file_parse_failures());
+}
+
+TEST_P(PurgeContextTest, PartialRecordIsSkippedOnFullRead) {
+  // The first read is of the whole file, whose last record is incomplete.
+  ASSERT_TRUE(file_system_.WriteFile(kPurgeFile, "-1 1\n500 a\n700 b",
+                                     &message_handler_));
+  EXPECT_FALSE(PollAndTest1("a", 500));
+  EXPECT_TRUE(PollAndTest1("b", 600));
+  AppendToPurgeFile("b\n");
+  scheduler_.AdvanceTimeMs(10 * Timer::kSecondMs);
+  EXPECT_TRUE(PollAndTest1("b", 600));
+  EXPECT_FALSE(PollAndTest1("bb", 700));
+  EXPECT_FALSE(PollAndTest1("a", 500));
+  EXPECT_EQ(0, file_parse_failures());
+}
+
+TEST_P(PurgeContextTest, LargeFileIsCompacted) {
+  scheduler_.AdvanceTimeMs(1000);
+  GoogleString contents;
+  for (int i = 0; i < 100; ++i) {
+    purge_context1_->AddPurgeUrl(StrCat("url", IntegerToString(i)),
+                                 500000 + i, ExpectSuccess());
+    ASSERT_TRUE(file_system_.ReadFile(kPurgeFile, &contents,
+                                      &message_handler_));
+    EXPECT_GT(4 * kMaxBytes + 20, static_cast<int>(contents.size()));
+  }
+
+  // The other context reads the whole rewritten file, which retains the
+  // most recent purges.
+  scheduler_.AdvanceTimeMs(10 * Timer::kSecondMs);
+  EXPECT_FALSE(PollAndTest2("url99", 500099));
+  EXPECT_TRUE(PollAndTest2("url99", 500100));
+  EXPECT_FALSE(PollAndTest2("url98", 500098));
+  EXPECT_TRUE(PollAndTest1("url99", 500100));
+  EXPECT_EQ(0, file_parse_failures());
+}
+
+TEST_P(PurgeContextTest, WildcardPurge) {
+  scheduler_.AdvanceTimeMs(1000);
+  purge_context1_->AddPurgeUrl("http://example.com/dir/*", 500000,
+                               ExpectSuccess());
+  scheduler_.AdvanceTimeMs(10 * Timer::kSecondMs);
+  EXPECT_FALSE(PollAndTest2("http://example.com/dir/a.css", 500000));
+  EXPECT_FALSE(PollAndTest2("http://example.com/dir/sub/b.css", 500000));
+  EXPECT_TRUE(PollAndTest2("http://example.com/dir/a.css", 500001));
+  EXPECT_TRUE(PollAndTest2("http://example.com/other/a.css", 500000));
 }
 
 // We test with use_null_statistics == GetParam() as both true and false.
@@ -18,6 +18,9 @@
 
 #include "pagespeed/kernel/cache/purge_set.h"
 
+#include <algorithm>
+#include <map>
+#include <utility>
 #include <vector>
 
 #include "base/logging.h"
@@ -26,25 +29,139 @@
 
 namespace net_instaweb {
 
+namespace {
+
+// Prefix indexes are rebuilt without their stale records once they have
+// grown this much since the last rebuild.
+const int kMinPrefixesBeforePrune = 16;
+
+bool IsWildcard(const GoogleString& key) {
+  return !key.empty() && (key[key.size() - 1] == '*');
+}
+
+}  // namespace
+
+// A trie of wildcard prefixes, each node holding the latest purge of the
+// prefix that leads to it.
+class PurgeSet::PrefixIndex {
+ public:
+  PrefixIndex() : num_prefixes_(0), num_prefixes_after_prune_(0) {
+    Clear();
+  }
+
+  void Clear() {
+    nodes_.clear();
+    nodes_.resize(1);
+    num_prefixes_ = 0;
+    num_prefixes_after_prune_ = 0;
+  }
+
+  bool empty() const { return num_prefixes_ == 0; }
+
+  void Put(StringPiece prefix, int64 timestamp_ms) {
+    int node = 0;
+    for (int i = 0, n = prefix.size(); i < n; ++i) {
+      std::pair<ChildMap::iterator, bool> insertion =
+          nodes_[node].children.insert(
+              ChildMap::value_type(prefix[i], nodes_.size()));
+      node = insertion.first->second;
+      if (insertion.second) {
+        nodes_.push_back(Node());
+      }
+    }
+    if (nodes_[node].timestamp_ms == kInitialTimestampMs) {
+      ++num_prefixes_;
+    }
+    nodes_[node].timestamp_ms =
+        std::max(nodes_[node].timestamp_ms, timestamp_ms);
+  }
+
+  // Returns the latest purge of any prefix of key, or kInitialTimestampMs.
+  int64 Lookup(StringPiece key) const {
+    int64 timestamp_ms = nodes_[0].timestamp_ms;
+    int node = 0;
+    for (int i = 0, n = key.size(); i < n; ++i) {
+      const ChildMap& children = nodes_[node].children;
+      ChildMap::const_iterator child = children.find(key[i]);
+      if (child == children.end()) {
+        break;
+      }
+      node = child->second;
+      timestamp_ms = std::max(timestamp_ms, nodes_[node].timestamp_ms);
+    }
+    return timestamp_ms;
+  }
+
+  // Rebuilds the index without prefixes purged no later than
+  // global_timestamp_ms, if enough may have gone stale since the last time.
+  void MaybePrune(int64 global_timestamp_ms) {
+    if (num_prefixes_ <
+        2 * num_prefixes_after_prune_ + kMinPrefixesBeforePrune) {
+      return;
+    }
+    std::vector<std::pair<GoogleString, int64> > live;
+    GoogleString prefix;
+    Collect(0, global_timestamp_ms, &prefix, &live);
+    Clear();
+    for (int i = 0, n = live.size(); i < n; ++i) {
+      Put(live[i].first, live[i].second);
+    }
+    num_prefixes_after_prune_ = num_prefixes_;
+  }
+
+ private:
+  typedef std::map<char, int> ChildMap;
+
+  struct Node {
+    Node() : timestamp_ms(kInitialTimestampMs) {}
+
+    int64 timestamp_ms;
+    ChildMap children;  // Indexes into nodes_.
+  };
+
+  void Collect(int node, int64 global_timestamp_ms, GoogleString* prefix,
+               std::vector<std::pair<GoogleString, int64> >* live) const {
+    if (nodes_[node].timestamp_ms > global_timestamp_ms) {
+      live->push_back(std::make_pair(*prefix, nodes_[node].timestamp_ms));
+    }
+    const ChildMap& children = nodes_[node].children;
+    for (ChildMap::const_iterator p = children.begin(), e = children.end();
+         p != e; ++p) {
+      prefix->push_back(p->first);
+      Collect(p->second, global_timestamp_ms, prefix, live);
+      prefix->resize(prefix->size() - 1);
+    }
+  }
+
+  std::vector<Node> nodes_;  // nodes_[0] is the root.
+  int num_prefixes_;
+  int num_prefixes_after_prune_;
+
+  DISALLOW_COPY_AND_ASSIGN(PrefixIndex);
+};
+
 PurgeSet::PurgeSet()
     : global_invalidation_timestamp_ms_(kInitialTimestampMs),
       last_invalidation_timestamp_ms_(0),
       helper_(this),
-      lru_(new Lru(1, &helper_)) {  // 1 byte max size till someone sets it.
+      lru_(new Lru(1, &helper_)),  // 1 byte max size till someone sets it.
+      prefix_index_(new PrefixIndex) {
 }
 
 PurgeSet::PurgeSet(size_t max_size)
     : global_invalidation_timestamp_ms_(kInitialTimestampMs),
       last_invalidation_timestamp_ms_(0),
       helper_(this),
-      lru_(new Lru(max_size, &helper_)) {
+      lru_(new Lru(max_size, &helper_)),
+      prefix_index_(new PrefixIndex) {
 }
 
 PurgeSet::PurgeSet(const PurgeSet& src)
     : global_invalidation_timestamp_ms_(kInitialTimestampMs),
       last_invalidation_timestamp_ms_(0),
       helper_(this),
-      lru_(new Lru(src.lru_->max_bytes_in_cache(), &helper_)) {
+      lru_(new Lru(src.lru_->max_bytes_in_cache(), &helper_)),
+      prefix_index_(new PrefixIndex) {
   Merge(src);
 }
 
@@ -62,6 +179,7 @@ PurgeSet& PurgeSet::operator=(const PurgeSet& src) {
 
 void PurgeSet::Clear() {
   lru_->Clear();
+  prefix_index_->Clear();
   global_invalidation_timestamp_ms_ = kInitialTimestampMs;
 }
 
@@ -169,6 +287,7 @@ void PurgeSet::Merge(const PurgeSet& src) {
 
   lru_->Clear();
   lru_->ClearStats();
+  prefix_index_->Clear();
   last_invalidation_timestamp_ms_ = global_invalidation_timestamp_ms_;
   for (int i = 0, n = merge_context.size(); i < n; ++i) {
     CHECK(Put(merge_context.key(i), merge_context.value(i)));
@@ -201,6 +320,11 @@ bool PurgeSet::Put(const GoogleString& key, int64 timestamp_ms) {
   // invalidation timestamp.
   if (timestamp_ms > global_invalidation_timestamp_ms_) {
     lru_->Put(key, timestamp_ms);
+    if (IsWildcard(key)) {
+      prefix_index_->Put(StringPiece(key.data(), key.size() - 1),
+                         timestamp_ms);
+      prefix_index_->MaybePrune(global_invalidation_timestamp_ms_);
+    }
   }
   return true;
 }
@@ -229,11 +353,16 @@ bool PurgeSet::IsValid(const GoogleString& key, int64 timestamp_ms) const {
     return false;
   }
   int64* purge_timestamp_ms = lru_->GetNoFreshen(key);
-  return ((purge_timestamp_ms == NULL) || (timestamp_ms > *purge_timestamp_ms));
+  if ((purge_timestamp_ms != NULL) && (timestamp_ms <= *purge_timestamp_ms)) {
+    return false;
+  }
+  return (prefix_index_->empty() ||
+          (timestamp_ms > prefix_index_->Lookup(key)));
 }
 
 void PurgeSet::Swap(PurgeSet* that) {
   lru_.swap(that->lru_);  // scoped_ptr::swap
+  prefix_index_.swap(that->prefix_index_);
   std::swap(global_invalidation_timestamp_ms_,
             that->global_invalidation_timestamp_ms_);
   helper_.Swap(&that->helper_);
@@ -38,11 +38,17 @@ namespace net_instaweb {
 // The entire cache can be flushed as of a certain point in time by
 // calling UpdateInvalidationTimestampMs.
 //
+// A purge record whose key ends in '*' is a wildcard: it purges every key
+// starting with the rest of it.  Wildcards are indexed in a trie, so a
+// validation costs one hash lookup plus a walk down the key's prefixes,
+// however many records there are.
+//
 // We bound the cache-purge data to a certain number of bytes.  When
 // we exceed that, we discard old invalidation records, and bump up
 // the global invalidation timestamp to cover the evicted purges.
 class PurgeSet {
   class InvalidationTimestampHelper;
+  class PrefixIndex;
   typedef LRUCacheBase<int64, InvalidationTimestampHelper> Lru;
 
  public:
@@ -92,7 +98,8 @@ class PurgeSet {
   void Merge(const PurgeSet& src);
 
   // Validates a key against specific invalidation records for that
-  // key, and against the overall invalidation timestamp/
+  // key, against wildcard records matching it, and against the overall
+  // invalidation timestamp.
   bool IsValid(const GoogleString& key, int64 timestamp_ms) const;
 
   int64 global_invalidation_timestamp_ms() const {
@@ -185,6 +192,11 @@ class PurgeSet {
   InvalidationTimestampHelper helper_;
   scoped_ptr<Lru> lru_;
 
+  // The wildcard records in lru_.  Records evicted from lru_ may linger here
+  // until the next prune, which is harmless as they predate the global
+  // invalidation timestamp.
+  scoped_ptr<PrefixIndex> prefix_index_;
+
   // Explicit copy-constructor and assign-operator are provided so
   // this class can be used for CopyOnWrite.
 };
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests the speed of PurgeSet::IsValid, which is called on every cache
+// lookup, with a growing number of purged URLs.  Each iteration checks one
+// URL; half of those checked have been purged.  In the wildcard variant, a
+// tenth of the purges are of a directory, "http://example.com/dirN/*".
+//
+// Benchmark                                 Time(ns) Iterations
+// -------------------------------------------------------------
+// PurgeSetIsValid/1024                            79   16000000
+// PurgeSetIsValid/8192                           100   12800000
+// PurgeSetIsValid/65536                          219    8388608
+// PurgeSetIsValid/131072                         288    4194304
+// PurgeSetIsValidWithWildcards/1024              142   12800000
+// PurgeSetIsValidWithWildcards/8192              171    6400000
+// PurgeSetIsValidWithWildcards/65536             333    4194304
+// PurgeSetIsValidWithWildcards/131072            489    2097152
+//
+// Disclaimer: comparing runs over time and across different machines
+// can be misleading.  When contemplating an algorithm change, always do
+// interleaved runs with the old & new algorithm.
+
+#include "pagespeed/kernel/cache/purge_set.h"
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/benchmark.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace {
+
+const int64 kPurgeTimestampMs = 1000000;
+
+class TestPayload {
+ public:
+  TestPayload(int num_purges, bool wildcards)
+      : purge_set_(1 << 30) {
+    StopBenchmarkTiming();
+    for (int i = 0; i < num_purges; ++i) {
+      GoogleString dir = net_instaweb::StrCat(
+          "http://example.com/dir", net_instaweb::IntegerToString(i));
+      if (wildcards && ((i % 10) == 0)) {
+        purge_set_.Put(net_instaweb::StrCat(dir, "/*"), kPurgeTimestampMs);
+      } else {
+        purge_set_.Put(net_instaweb::StrCat(dir, "/file.css"),
+                       kPurgeTimestampMs);
+      }
+
+      // Check URLs in the purged directories, and ones that aren't.
+      keys_.push_back(net_instaweb::StrCat(dir, "/file.css"));
+      keys_.push_back(net_instaweb::StrCat(
+          "http://example.com/other", net_instaweb::IntegerToString(i),
+          "/file.css"));
+    }
+    StartBenchmarkTiming();
+  }
+
+  // Returns the number of valid URLs found in iters checks.
+  int Check(int iters) {
+    int num_valid = 0;
+    for (int i = 0, n = keys_.size(); i < iters; ++i) {
+      if (purge_set_.IsValid(keys_[i % n], kPurgeTimestampMs)) {
+        ++num_valid;
+      }
+    }
+    return num_valid;
+  }
+
+ private:
+  net_instaweb::PurgeSet purge_set_;
+  net_instaweb::StringVector keys_;
+
+  DISALLOW_COPY_AND_ASSIGN(TestPayload);
+};
+
+static void PurgeSetIsValid(int iters, int num_purges) {
+  TestPayload payload(num_purges, false);
+  CHECK_GE(iters, payload.Check(iters));
+}
+
+static void PurgeSetIsValidWithWildcards(int iters, int num_purges) {
+  TestPayload payload(num_purges, true);
+  CHECK_GE(iters, payload.Check(iters));
+}
+
+}  // namespace
+
+BENCHMARK_RANGE(PurgeSetIsValid, 1 << 10, 1 << 17);
+BENCHMARK_RANGE(PurgeSetIsValidWithWildcards, 1 << 10, 1 << 17);
@@ -168,6 +168,56 @@ TEST_F(PurgeSetTest, Assign) {
   EXPECT_TRUE(purge_set_.Equals(other));
 }
 
+TEST_F(PurgeSetTest, Wildcard) {
+  ASSERT_TRUE(purge_set_.Put("http://a.com/dir/*", 50));
+  EXPECT_FALSE(purge_set_.IsValid("http://a.com/dir/", 50));
+  EXPECT_FALSE(purge_set_.IsValid("http://a.com/dir/x.css", 40));
+  EXPECT_TRUE(purge_set_.IsValid("http://a.com/dir/x.css", 51));
+  EXPECT_TRUE(purge_set_.IsValid("http://a.com/di", 40));
+  EXPECT_TRUE(purge_set_.IsValid("http://a.com/other/x.css", 40));
+
+  // The latest of the matching records wins.
+  ASSERT_TRUE(purge_set_.Put("http://a.com/*", 60));
+  ASSERT_TRUE(purge_set_.Put("http://a.com/dir/x.css", 70));
+  EXPECT_FALSE(purge_set_.IsValid("http://a.com/dir/y.css", 55));
+  EXPECT_FALSE(purge_set_.IsValid("http://a.com/other/x.css", 55));
+  EXPECT_TRUE(purge_set_.IsValid("http://a.com/dir/y.css", 65));
+  EXPECT_FALSE(purge_set_.IsValid("http://a.com/dir/x.css", 65));
+  EXPECT_TRUE(purge_set_.IsValid("http://b.com/dir/x.css", 55));
+}
+
+TEST_F(PurgeSetTest, WildcardMergeAndCopy) {
+  PurgeSet src(kMaxSize);
+  ASSERT_TRUE(src.Put("a/*", 50));
+  purge_set_.Merge(src);
+  EXPECT_FALSE(purge_set_.IsValid("a/b", 40));
+  PurgeSet copy(purge_set_);
+  EXPECT_FALSE(copy.IsValid("a/b", 40));
+  PurgeSet other(kMaxSize);
+  other.Swap(&copy);
+  EXPECT_FALSE(other.IsValid("a/b", 40));
+  EXPECT_TRUE(copy.IsValid("a/b", 40));
+  purge_set_.Clear();
+  EXPECT_TRUE(purge_set_.IsValid("a/b", 40));
+}
+
+TEST_F(PurgeSetTest, EvictedWildcardsStayPurged) {
+  for (int i = 0; i < kMaxSize * 10; ++i) {
+    ASSERT_TRUE(purge_set_.Put(StrCat("a", IntegerToString(i), "/*"), i + 1));
+  }
+
+  // Evicted wildcards are covered by the global invalidation timestamp.
+  int64 global_ms = purge_set_.global_invalidation_timestamp_ms();
+  EXPECT_LT(0, global_ms);
+  EXPECT_FALSE(purge_set_.IsValid("a0/x", global_ms));
+  EXPECT_TRUE(purge_set_.IsValid("a0/x", global_ms + 1));
+  int last = kMaxSize * 10 - 1;
+  EXPECT_FALSE(purge_set_.IsValid(StrCat("a", IntegerToString(last), "/x"),
+                                  last + 1));
+  EXPECT_TRUE(purge_set_.IsValid(StrCat("a", IntegerToString(last), "/x"),
+                                 last + 2));
+}
+
 TEST_F(PurgeSetTest, ToString) {
   ASSERT_TRUE(purge_set_.UpdateGlobalInvalidationTimestampMs(
       MockTimer::kApr_5_2010_ms));
@@ -0,0 +1,1183 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/segment_file_cache.h"
+
+#include <unistd.h>  // for getpid()
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/file_system.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/null_message_handler.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/stl_util.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_hash.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/thread/slow_worker.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Each record in a segment is a fixed-size header followed by the key and
+// the value.  The header holds, in host byte order:
+//   uint32 magic
+//   uint32 key size
+//   uint32 value size, or kTombstoneSize for a Delete
+//   uint32 check: a hash of the key and the other header fields
+//   int64  write time in ms, used to decide what to evict
+//   uint64 sequence number, which orders writes of the same key, including
+//          those of different processes
+const uint32 kRecordMagic = 0x32434653;  // "SFC2"
+const int kHeaderSize = 32;
+const uint32 kTombstoneSize = 0xffffffff;
+const uint32 kMaxKeySize = 64 * 1024;
+
+// The index file of a shard holds:
+//   uint32 magic, uint32 version
+//   uint32 number of segments, then for each:
+//     uint32 name size, name, int64 bytes covered by the index
+//   uint64 number of entries, then for each:
+//     uint32 key size, key, uint32 segment number, uint32 value size,
+//     int64 offset, int64 write ms, uint64 sequence, int64 atime ms
+//   uint64 hash of everything before it
+const uint32 kIndexMagic = 0x49434653;  // "SFCI"
+const uint32 kIndexVersion = 2;
+
+// As with FileCache, the names of our bookkeeping files contain characters
+// that distinguish them from segments.
+const char kSegmentSuffix[] = ".seg";
+const char kIndexName[] = "!index!";
+const char kLockName[] = "!compact!lock!";
+
+// Segments are scanned this many bytes at a time.
+const int kScanChunkBytes = 1 << 20;
+
+// Be willing to take over the compaction lock of a shard from a process
+// that hasn't bumped it for this long (see FileCache::kLockTimeoutMs).
+const int64 kLockTimeoutMs = 5 * Timer::kMinuteMs;
+
+uint64 HashKey(StringPiece key) {
+  uint64 hash = HashString<CasePreserve, uint64>(key.data(), key.size());
+  // The polynomial string hash leaves the high bits, which select the shard,
+  // poorly mixed, so apply the finalizer from MurmurHash3.
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+uint32 HeaderCheck(uint64 key_hash, uint32 key_size, uint32 value_size,
+                   int64 write_ms, uint64 sequence) {
+  uint64 check = key_hash;
+  check = check * 131 + key_size;
+  check = check * 131 + value_size;
+  check = check * 131 + static_cast<uint64>(write_ms);
+  check = check * 131 + sequence;
+  return static_cast<uint32>(check ^ (check >> 32));
+}
+
+template<typename T> void AppendScalar(T value, GoogleString* out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T> T LoadScalar(const char* data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Removes a value of type T from the front of *data, returning false if
+// there isn't enough data left.
+template<typename T> bool ConsumeScalar(StringPiece* data, T* value) {
+  if (data->size() < sizeof(T)) {
+    return false;
+  }
+  *value = LoadScalar<T>(data->data());
+  data->remove_prefix(sizeof(T));
+  return true;
+}
+
+void EncodeHeader(StringPiece key, uint32 value_size, int64 write_ms,
+                  uint64 sequence, GoogleString* out) {
+  out->reserve(kHeaderSize + key.size());
+  AppendScalar<uint32>(kRecordMagic, out);
+  AppendScalar<uint32>(key.size(), out);
+  AppendScalar<uint32>(value_size, out);
+  AppendScalar<uint32>(
+      HeaderCheck(HashKey(key), key.size(), value_size, write_ms, sequence),
+      out);
+  AppendScalar<int64>(write_ms, out);
+  AppendScalar<uint64>(sequence, out);
+  key.AppendToString(out);
+}
+
+// Decodes the header at data, returning false if it is not one.  The check
+// can only be verified once the key has been read.
+bool DecodeHeader(const char* data, uint32* key_size, uint32* value_size,
+                  uint32* check, int64* write_ms, uint64* sequence) {
+  if (LoadScalar<uint32>(data) != kRecordMagic) {
+    return false;
+  }
+  *key_size = LoadScalar<uint32>(data + 4);
+  *value_size = LoadScalar<uint32>(data + 8);
+  *check = LoadScalar<uint32>(data + 12);
+  *write_ms = LoadScalar<int64>(data + 16);
+  *sequence = LoadScalar<uint64>(data + 24);
+  return *key_size <= kMaxKeySize;
+}
+
+bool ReadFully(FileSystem::InputFile* file, char* buf, int64 size) {
+  NullMessageHandler null_handler;
+  while (size > 0) {
+    int nread = file->Read(buf, size, &null_handler);
+    if (nread <= 0) {
+      return false;
+    }
+    buf += nread;
+    size -= nread;
+  }
+  return true;
+}
+
+// Segment names start with their creation time, zero-padded so that they
+// sort oldest first, followed by the id of the process writing them.
+GoogleString SegmentName(int64 now_us, int pid) {
+  GoogleString time = Integer64ToString(now_us);
+  if (time.size() < 20) {
+    time.insert(0, 20 - time.size(), '0');
+  }
+  return StrCat(time, "-", IntegerToString(pid), kSegmentSuffix);
+}
+
+// Returns the creation time encoded in a segment name, in ms.
+int64 SegmentCreationMs(StringPiece name) {
+  int64 now_us = 0;
+  StringToInt64(name.substr(0, 20).as_string(), &now_us);
+  return now_us / Timer::kMsUs;
+}
+
+}  // namespace
+
+struct SegmentFileCache::Segment {
+  explicit Segment(const GoogleString& name_in)
+      : name(name_in), size(0), live_bytes(0) {}
+
+  const GoogleString name;
+  int64 size;        // Bytes written or scanned so far.
+  int64 live_bytes;  // Bytes of the records the index points to.
+
+  // The keys of the index entries pointing into this segment, which point
+  // at the keys stored in the index.
+  std::unordered_set<const GoogleString*> keys;
+};
+
+// Deleted keys keep an entry pointing at their tombstone, so that
+// compaction can carry the tombstone along for as long as an older value
+// of the key may be left in some segment.
+struct SegmentFileCache::Entry {
+  bool tombstone() const { return value_size == kTombstoneSize; }
+  int64 record_size(int64 key_size) const {
+    return kHeaderSize + key_size + (tombstone() ? 0 : value_size);
+  }
+
+  Segment* segment;
+  int64 offset;
+  int64 write_ms;
+  uint64 sequence;
+  int64 atime_ms;
+  uint32 value_size;
+};
+
+// A record as found by ScanSegment or written by Put.
+struct SegmentFileCache::Record {
+  bool tombstone() const { return value_size == kTombstoneSize; }
+  int64 size() const {
+    return kHeaderSize + key.size() + (tombstone() ? 0 : value_size);
+  }
+
+  GoogleString key;
+  int64 offset;
+  int64 write_ms;
+  uint64 sequence;
+  uint32 value_size;
+};
+
+// The index of a shard as read back from disk.
+struct SegmentFileCache::IndexImage {
+  struct Item {
+    Record record;
+    uint32 segment;
+    int64 atime_ms;
+  };
+
+  std::vector<std::pair<GoogleString, int64> > segments;
+  std::vector<Item> items;
+};
+
+// Each shard has two locks.  The mutex guards the index and the segment
+// map, and is only held briefly.  The append mutex is held for all of an
+// append, so that the file I/O doesn't hold up lookups, and so that records
+// reach the index in the order they were written.  When both are needed,
+// the append mutex is taken first.
+struct SegmentFileCache::Shard {
+  typedef std::unordered_map<GoogleString, Entry> Index;
+  typedef std::map<GoogleString, Segment> SegmentMap;  // Oldest first.
+
+  Shard(const GoogleString& dir_in, AbstractMutex* mutex_in,
+        AbstractMutex* append_mutex_in)
+      : dir(dir_in),
+        index_path(StrCat(dir_in, "/", kIndexName)),
+        lock_path(StrCat(dir_in, "/", kLockName)),
+        mutex(mutex_in),
+        append_mutex(append_mutex_in),
+        num_tombstones(0),
+        next_sequence(0),
+        active(NULL),
+        active_file(NULL),
+        active_size(0),
+        active_created_ms(0),
+        active_pid(0),
+        claimed(false),
+        loaded(false),
+        next_sync_ms(0) {
+  }
+
+  GoogleString SegmentPath(StringPiece name) const {
+    return StrCat(dir, "/", name);
+  }
+
+  Segment* FindOrAddSegment(const GoogleString& name)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+    SegmentMap::iterator p = segments.find(name);
+    if (p == segments.end()) {
+      p = segments.insert(std::make_pair(name, Segment(name))).first;
+    }
+    return &p->second;
+  }
+
+  // Points the given entry at a record in segment.
+  void MoveEntry(Index::iterator p, Segment* segment, int64 offset)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+    Entry* entry = &p->second;
+    int64 record_size = entry->record_size(p->first.size());
+    entry->segment->live_bytes -= record_size;
+    entry->segment->keys.erase(&p->first);
+    entry->segment = segment;
+    entry->offset = offset;
+    segment->live_bytes += record_size;
+    segment->keys.insert(&p->first);
+  }
+
+  void EraseEntry(Index::iterator p) EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+    Entry* entry = &p->second;
+    entry->segment->live_bytes -= entry->record_size(p->first.size());
+    entry->segment->keys.erase(&p->first);
+    if (entry->tombstone()) {
+      --num_tombstones;
+    }
+    index.erase(p);
+  }
+
+  // Forgets the given segment and the entries pointing into it, returning
+  // the number of values dropped, not counting tombstones.
+  int64 RemoveSegment(SegmentMap::iterator p) EXCLUSIVE_LOCKS_REQUIRED(mutex) {
+    Segment* segment = &p->second;
+    int64 dropped = 0;
+    while (!segment->keys.empty()) {
+      Index::iterator q = index.find(**segment->keys.begin());
+      DCHECK(q != index.end());
+      if (!q->second.tombstone()) {
+        ++dropped;
+      }
+      EraseEntry(q);
+    }
+    segments.erase(p);
+    return dropped;
+  }
+
+  const GoogleString dir;
+  const GoogleString index_path;
+  const GoogleString lock_path;
+  scoped_ptr<AbstractMutex> mutex;
+  scoped_ptr<AbstractMutex> append_mutex;
+  Index index GUARDED_BY(mutex);
+  int64 num_tombstones GUARDED_BY(mutex);
+  SegmentMap segments GUARDED_BY(mutex);
+
+  // Sequence numbers are microsecond timestamps, except that they are kept
+  // above every sequence number seen so far in the shard, including those
+  // of other processes' records.
+  uint64 next_sequence GUARDED_BY(mutex);
+
+  // The segment this process is appending to, if any.  It is only changed
+  // with both locks held, so either suffices to read it.
+  Segment* active;
+  FileSystem::OutputFile* active_file GUARDED_BY(append_mutex);
+  int64 active_size GUARDED_BY(append_mutex);
+  int64 active_created_ms GUARDED_BY(append_mutex);
+  int active_pid GUARDED_BY(append_mutex);
+
+  bool claimed GUARDED_BY(mutex);
+  bool loaded GUARDED_BY(mutex);  // Whether the index on disk was read.
+  int64 next_sync_ms GUARDED_BY(mutex);
+};
+
+class SegmentFileCache::CompactFunction : public Function {
+ public:
+  explicit CompactFunction(SegmentFileCache* cache) : cache_(cache) {}
+  virtual ~CompactFunction() {}
+  virtual void Run() { cache_->Compact(); }
+
+ private:
+  SegmentFileCache* cache_;
+  DISALLOW_COPY_AND_ASSIGN(CompactFunction);
+};
+
+const int SegmentFileCache::kSegmentsPerShard;
+const int64 SegmentFileCache::kMinSegmentSizeBytes;
+const int64 SegmentFileCache::kMaxSegmentSizeBytes;
+const int64 SegmentFileCache::kMaxActiveSegmentAgeMs = 5 * Timer::kMinuteMs;
+const int64 SegmentFileCache::kSealedSegmentIdleMs = 10 * Timer::kMinuteMs;
+const int64 SegmentFileCache::kSyncIntervalMs = Timer::kSecondMs;
+const int64 SegmentFileCache::kCompactionIntervalMs = 10 * Timer::kSecondMs;
+
+const char SegmentFileCache::kBytesReclaimed[] =
+    "segment_file_cache_bytes_reclaimed";
+const char SegmentFileCache::kCompactions[] = "segment_file_cache_compactions";
+const char SegmentFileCache::kEvictions[] = "segment_file_cache_evictions";
+const char SegmentFileCache::kReadErrors[] = "segment_file_cache_read_errors";
+const char SegmentFileCache::kWriteErrors[] =
+    "segment_file_cache_write_errors";
+
+SegmentFileCache::SegmentFileCache(const GoogleString& path, int num_shards,
+                                   int64 target_size_bytes,
+                                   FileSystem* file_system,
+                                   ThreadSystem* thread_system, Timer* timer,
+                                   SlowWorker* worker, Statistics* stats,
+                                   MessageHandler* handler)
+    : path_(path),
+      file_system_(file_system),
+      timer_(timer),
+      worker_(worker),
+      message_handler_(handler),
+      target_size_bytes_(0),
+      segment_size_bytes_(0),
+      mutex_(thread_system->NewMutex()),
+      next_compaction_ms_(timer->NowMs() + kCompactionIntervalMs),
+      bytes_reclaimed_(stats->GetVariable(kBytesReclaimed)),
+      compactions_(stats->GetVariable(kCompactions)),
+      evictions_(stats->GetVariable(kEvictions)),
+      read_errors_(stats->GetVariable(kReadErrors)),
+      write_errors_(stats->GetVariable(kWriteErrors)) {
+  CHECK_LT(0, num_shards);
+  GoogleString prefix = path;
+  EnsureEndsInSlash(&prefix);
+  for (int i = 0; i < num_shards; ++i) {
+    shards_.push_back(new Shard(StrCat(prefix, "shard", IntegerToString(i)),
+                                thread_system->NewMutex(),
+                                thread_system->NewMutex()));
+  }
+  set_target_size_bytes(target_size_bytes);
+}
+
+SegmentFileCache::~SegmentFileCache() {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    ScopedMutex append_lock(shards_[i]->append_mutex.get());
+    CloseActiveSegment(shards_[i]);
+  }
+  STLDeleteElements(&shards_);
+}
+
+void SegmentFileCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kBytesReclaimed);
+  statistics->AddVariable(kCompactions);
+  statistics->AddVariable(kEvictions);
+  statistics->AddVariable(kReadErrors);
+  statistics->AddVariable(kWriteErrors);
+}
+
+void SegmentFileCache::set_target_size_bytes(int64 x) {
+  target_size_bytes_ = x;
+  segment_size_bytes_ = SegmentSizeForTarget(x);
+}
+
+int64 SegmentFileCache::SegmentSizeForTarget(int64 target_size_bytes) const {
+  if (target_size_bytes <= 0) {
+    return kMaxSegmentSizeBytes;
+  }
+  int64 size = target_size_bytes / (shards_.size() * kSegmentsPerShard);
+  return std::max(kMinSegmentSizeBytes, std::min(kMaxSegmentSizeBytes, size));
+}
+
+SegmentFileCache::Shard* SegmentFileCache::ShardForHash(uint64 hash) {
+  return shards_[(hash >> 32) % shards_.size()];
+}
+
+void SegmentFileCache::Get(const GoogleString& key, Callback* callback) {
+  Shard* shard = ShardForHash(HashKey(key));
+  MaybeSync(shard);
+
+  bool found = false;
+  Entry entry;
+  GoogleString segment_name;
+  {
+    ScopedMutex lock(shard->mutex.get());
+    Shard::Index::iterator p = shard->index.find(key);
+    if (p != shard->index.end() && !p->second.tombstone()) {
+      found = true;
+      entry = p->second;
+      segment_name = entry.segment->name;
+      p->second.atime_ms = timer_->NowMs();
+    }
+  }
+
+  KeyState state = kNotFound;
+  if (found) {
+    // Suppress read errors: segments can be compacted away by other
+    // processes before we notice, which just turns this into a miss.
+    NullMessageHandler null_handler;
+    bool read_ok = false;
+    FileSystem::InputFile* file = file_system_->OpenInputFile(
+        shard->SegmentPath(segment_name).c_str(), &null_handler);
+    if (file != NULL) {
+      GoogleString header_and_key(kHeaderSize + key.size(), '\0');
+      uint32 key_size, value_size, check;
+      int64 write_ms;
+      uint64 sequence;
+      GoogleString value(entry.value_size, '\0');
+      if (file->Seek(entry.offset, &null_handler) &&
+          ReadFully(file, &header_and_key[0], header_and_key.size()) &&
+          DecodeHeader(header_and_key.data(), &key_size, &value_size, &check,
+                       &write_ms, &sequence) &&
+          key_size == key.size() && value_size == entry.value_size &&
+          sequence == entry.sequence &&
+          StringPiece(header_and_key).substr(kHeaderSize) == key &&
+          ReadFully(file, &value[0], value.size())) {
+        read_ok = true;
+        SharedString shared_value;
+        shared_value.SwapWithString(&value);
+        callback->set_value(shared_value);
+        state = kAvailable;
+      }
+      file_system_->Close(file, &null_handler);
+    }
+    if (!read_ok) {
+      read_errors_->Add(1);
+      ScopedMutex lock(shard->mutex.get());
+      Shard::Index::iterator p = shard->index.find(key);
+      if (p != shard->index.end() && p->second.offset == entry.offset &&
+          p->second.segment->name == segment_name) {
+        shard->EraseEntry(p);
+      }
+    }
+  }
+  ValidateAndReportResult(key, state, callback);
+}
+
+void SegmentFileCache::Put(const GoogleString& key, const SharedString& value) {
+  if (key.size() > kMaxKeySize ||
+      static_cast<uint64>(value.size()) >= kTombstoneSize) {
+    return;
+  }
+  WriteRecord(key, value.Value(), value.size());
+  CompactIfNeeded();
+}
+
+void SegmentFileCache::Delete(const GoogleString& key) {
+  if (key.size() > kMaxKeySize) {
+    return;
+  }
+  // Other processes may have the key, so the deletion has to be logged
+  // even if we don't.
+  WriteRecord(key, StringPiece(), kTombstoneSize);
+}
+
+void SegmentFileCache::WriteRecord(const GoogleString& key, StringPiece value,
+                                   uint32 value_size) {
+  Shard* shard = ShardForHash(HashKey(key));
+  Record record;
+  record.key = key;
+  record.write_ms = timer_->NowMs();
+  record.value_size = value_size;
+  ScopedMutex append_lock(shard->append_mutex.get());
+  {
+    ScopedMutex lock(shard->mutex.get());
+    record.sequence = std::max<uint64>(shard->next_sequence,
+                                       timer_->NowUs());
+    shard->next_sequence = record.sequence + 1;
+  }
+  GoogleString header_and_key;
+  EncodeHeader(key, record.value_size, record.write_ms, record.sequence,
+               &header_and_key);
+  Segment* segment;
+  if (AppendRecord(shard, header_and_key, value, &segment, &record.offset)) {
+    ScopedMutex lock(shard->mutex.get());
+    ApplyRecord(shard, segment, record, record.write_ms);
+  }
+}
+
+void SegmentFileCache::ShutDown() {
+  Checkpoint();
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    ScopedMutex append_lock(shards_[i]->append_mutex.get());
+    CloseActiveSegment(shards_[i]);
+  }
+}
+
+bool SegmentFileCache::AppendRecord(Shard* shard, StringPiece header_and_key,
+                                    StringPiece value, Segment** segment,
+                                    int64* offset) {
+  // A process forked after opening a segment must not append to it, as the
+  // parent might too.
+  int pid = getpid();
+  int64 now_ms = timer_->NowMs();
+  if (shard->active_file != NULL &&
+      (shard->active_pid != pid ||
+       now_ms - shard->active_created_ms >= kMaxActiveSegmentAgeMs)) {
+    CloseActiveSegment(shard);
+  }
+  if (shard->active_file == NULL) {
+    GoogleString name = SegmentName(timer_->NowUs(), pid);
+    FileSystem::OutputFile* file = file_system_->OpenOutputFileForAppend(
+        shard->SegmentPath(name).c_str(), message_handler_);
+    if (file == NULL) {
+      write_errors_->Add(1);
+      return false;
+    }
+    ScopedMutex lock(shard->mutex.get());
+    shard->active = shard->FindOrAddSegment(name);
+    shard->active_file = file;
+    shard->active_size = shard->active->size;
+    shard->active_created_ms = now_ms;
+    shard->active_pid = pid;
+  }
+
+  *segment = shard->active;
+  *offset = shard->active_size;
+  if (!shard->active_file->Write(header_and_key, message_handler_) ||
+      !shard->active_file->Write(value, message_handler_) ||
+      !shard->active_file->Flush(message_handler_)) {
+    // We don't know how much of the record made it to disk, so leave the
+    // segment behind; scans will stop at the damaged record.
+    write_errors_->Add(1);
+    CloseActiveSegment(shard);
+    return false;
+  }
+  shard->active_size += header_and_key.size() + value.size();
+  {
+    ScopedMutex lock(shard->mutex.get());
+    shard->active->size = std::max(shard->active->size, shard->active_size);
+  }
+  if (shard->active_size >= segment_size_bytes_) {
+    CloseActiveSegment(shard);
+  }
+  return true;
+}
+
+void SegmentFileCache::CloseActiveSegment(Shard* shard) {
+  if (shard->active_file != NULL) {
+    file_system_->Close(shard->active_file, message_handler_);
+    shard->active_file = NULL;
+  }
+  ScopedMutex lock(shard->mutex.get());
+  shard->active = NULL;
+}
+
+void SegmentFileCache::ApplyRecord(Shard* shard, Segment* segment,
+                                   const Record& record, int64 atime_ms) {
+  shard->next_sequence = std::max(shard->next_sequence, record.sequence + 1);
+  Shard::Index::iterator p = shard->index.find(record.key);
+  if (p != shard->index.end()) {
+    Entry* entry = &p->second;
+    // Relocated records keep their sequence number, so on a tie the copy
+    // in the newer segment wins.
+    if (entry->sequence > record.sequence ||
+        (entry->sequence == record.sequence &&
+         (entry->segment->name > segment->name ||
+          (entry->segment == segment && entry->offset >= record.offset)))) {
+      return;
+    }
+    entry->segment->live_bytes -= entry->record_size(record.key.size());
+    entry->segment->keys.erase(&p->first);
+    if (entry->tombstone()) {
+      --shard->num_tombstones;
+    } else if (!record.tombstone()) {
+      atime_ms = std::max(atime_ms, entry->atime_ms);
+    }
+  } else {
+    p = shard->index.insert(std::make_pair(record.key, Entry())).first;
+  }
+  Entry* entry = &p->second;
+  entry->segment = segment;
+  entry->offset = record.offset;
+  entry->write_ms = record.write_ms;
+  entry->sequence = record.sequence;
+  entry->atime_ms = atime_ms;
+  entry->value_size = record.value_size;
+  segment->live_bytes += record.size();
+  segment->keys.insert(&p->first);
+  if (record.tombstone()) {
+    ++shard->num_tombstones;
+  }
+}
+
+bool SegmentFileCache::ClaimShard(Shard* shard) {
+  ScopedMutex lock(shard->mutex.get());
+  if (shard->claimed) {
+    return false;
+  }
+  shard->claimed = true;
+  return true;
+}
+
+void SegmentFileCache::ReleaseShard(Shard* shard) {
+  ScopedMutex lock(shard->mutex.get());
+  shard->claimed = false;
+}
+
+void SegmentFileCache::MaybeSync(Shard* shard) {
+  {
+    ScopedMutex lock(shard->mutex.get());
+    if (shard->claimed || timer_->NowMs() < shard->next_sync_ms) {
+      return;
+    }
+    shard->claimed = true;
+  }
+  SyncClaimedShard(shard);
+  ReleaseShard(shard);
+}
+
+void SegmentFileCache::SyncClaimedShard(Shard* shard) {
+  // The shard directory won't exist until something is written to it, so
+  // don't report errors.
+  NullMessageHandler null_handler;
+  std::map<GoogleString, int64> known_sizes;
+  GoogleString active_name;
+  bool load;
+  // Don't hold on to a segment we won't append to again: other processes
+  // may compact it away once it has been idle for a while.  If an append is
+  // in progress, it will do that itself.
+  if (shard->append_mutex->TryLock()) {
+    if (shard->active_file != NULL &&
+        timer_->NowMs() - shard->active_created_ms >=
+            kMaxActiveSegmentAgeMs) {
+      CloseActiveSegment(shard);
+    }
+    shard->append_mutex->Unlock();
+  }
+  {
+    ScopedMutex lock(shard->mutex.get());
+    for (Shard::SegmentMap::iterator p = shard->segments.begin(),
+             e = shard->segments.end(); p != e; ++p) {
+      known_sizes[p->first] = p->second.size;
+    }
+    if (shard->active != NULL) {
+      active_name = shard->active->name;
+    }
+    load = !shard->loaded;
+  }
+
+  IndexImage image;
+  std::map<GoogleString, int64> image_sizes;
+  if (load) {
+    GoogleString data;
+    if (file_system_->ReadFile(shard->index_path.c_str(), &data,
+                               &null_handler) &&
+        ParseIndex(data, &image)) {
+      image_sizes.insert(image.segments.begin(), image.segments.end());
+    } else {
+      image.segments.clear();
+      image.items.clear();
+    }
+  }
+
+  // Find the records appended to each segment since we last looked.
+  typedef std::map<GoogleString, std::pair<int64, std::vector<Record> > >
+      ScanMap;
+  ScanMap scans;
+  StringVector files;
+  bool listed = file_system_->ListContents(shard->dir, &files, &null_handler);
+  for (int i = 0, n = files.size(); i < n; ++i) {
+    StringPiece name(files[i]);
+    stringpiece_ssize_type slash = name.rfind('/');
+    if (slash != StringPiece::npos) {
+      name.remove_prefix(slash + 1);
+    }
+    if (!strings::EndsWith(name, kSegmentSuffix)) {
+      continue;
+    }
+    std::pair<int64, std::vector<Record> >& scan = scans[name.as_string()];
+    std::map<GoogleString, int64>::iterator known =
+        known_sizes.find(name.as_string());
+    if (known != known_sizes.end()) {
+      scan.first = known->second;
+    } else {
+      known = image_sizes.find(name.as_string());
+      scan.first = (known == image_sizes.end()) ? 0 : known->second;
+    }
+    int64 size;
+    if (name != active_name &&
+        file_system_->Size(files[i], &size, &null_handler) &&
+        size > scan.first) {
+      scan.first = ScanSegment(files[i], scan.first, size, &scan.second);
+    }
+  }
+
+  // The append mutex keeps segments that appends have just written to from
+  // being removed before their records reach the index.
+  ScopedMutex append_lock(shard->append_mutex.get());
+  ScopedMutex lock(shard->mutex.get());
+  if (load) {
+    std::vector<Segment*> image_segments(image.segments.size(), NULL);
+    for (int i = 0, n = image.segments.size(); i < n; ++i) {
+      if (scans.find(image.segments[i].first) != scans.end()) {
+        image_segments[i] = shard->FindOrAddSegment(image.segments[i].first);
+      }
+    }
+    for (int i = 0, n = image.items.size(); i < n; ++i) {
+      const IndexImage::Item& item = image.items[i];
+      if (image_segments[item.segment] != NULL) {
+        ApplyRecord(shard, image_segments[item.segment], item.record,
+                    item.atime_ms);
+      }
+    }
+    shard->loaded = true;
+  }
+  for (ScanMap::iterator p = scans.begin(), e = scans.end(); p != e; ++p) {
+    if (p->first == active_name) {
+      continue;
+    }
+    Segment* segment = shard->FindOrAddSegment(p->first);
+    const std::vector<Record>& records = p->second.second;
+    for (int i = 0, n = records.size(); i < n; ++i) {
+      ApplyRecord(shard, segment, records[i], records[i].write_ms);
+    }
+    segment->size = std::max(segment->size, p->second.first);
+  }
+
+  // Forget the segments that other processes compacted away.  Segments
+  // this process created since we listed the directory are left alone.
+  if (listed) {
+    for (Shard::SegmentMap::iterator p = shard->segments.begin();
+         p != shard->segments.end(); ) {
+      if (&p->second != shard->active &&
+          known_sizes.find(p->first) != known_sizes.end() &&
+          scans.find(p->first) == scans.end()) {
+        shard->RemoveSegment(p++);
+      } else {
+        ++p;
+      }
+    }
+  }
+  shard->next_sync_ms = timer_->NowMs() + kSyncIntervalMs;
+}
+
+int64 SegmentFileCache::ScanSegment(const GoogleString& filename, int64 start,
+                                    int64 end, std::vector<Record>* records) {
+  NullMessageHandler null_handler;
+  FileSystem::InputFile* file =
+      file_system_->OpenInputFile(filename.c_str(), &null_handler);
+  if (file == NULL) {
+    return start;
+  }
+  GoogleString chunk;
+  int64 pos = start;
+  bool done = false;
+  while (!done && end - pos >= kHeaderSize) {
+    int64 chunk_size = std::min<int64>(kScanChunkBytes, end - pos);
+    chunk.resize(chunk_size);
+    if (!file->Seek(pos, &null_handler) ||
+        !ReadFully(file, &chunk[0], chunk_size)) {
+      break;
+    }
+
+    // Parse every record whose header and key are in the chunk.  Values
+    // can extend past it.
+    int64 parsed = 0;
+    while (chunk_size - parsed >= kHeaderSize) {
+      const char* header = chunk.data() + parsed;
+      Record record;
+      uint32 key_size, check;
+      if (!DecodeHeader(header, &key_size, &record.value_size, &check,
+                        &record.write_ms, &record.sequence)) {
+        done = true;
+        break;
+      }
+      if (chunk_size - parsed < kHeaderSize + key_size) {
+        break;
+      }
+      StringPiece key(header + kHeaderSize, key_size);
+      if (check != HeaderCheck(HashKey(key), key_size, record.value_size,
+                               record.write_ms, record.sequence)) {
+        done = true;
+        break;
+      }
+      key.CopyToString(&record.key);
+      record.offset = pos + parsed;
+      if (record.offset + record.size() > end) {
+        // The record is still being written, or was cut short.
+        done = true;
+        break;
+      }
+      records->push_back(record);
+      parsed += record.size();
+    }
+    if (parsed == 0) {
+      break;
+    }
+    pos += parsed;
+  }
+  file_system_->Close(file, &null_handler);
+  return pos;
+}
+
+void SegmentFileCache::CompactIfNeeded() {
+  if (worker_ == NULL) {
+    return;
+  }
+  {
+    ScopedMutex lock(mutex_.get());
+    int64 now_ms = timer_->NowMs();
+    if (now_ms < next_compaction_ms_) {
+      return;
+    }
+    next_compaction_ms_ = now_ms + kCompactionIntervalMs;
+  }
+  worker_->Start();
+  worker_->RunIfNotBusy(new CompactFunction(this));
+}
+
+void SegmentFileCache::Compact() {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    Shard* shard = shards_[i];
+    // The lock lives in the shard directory, which may not exist yet.
+    if (!file_system_->RecursivelyMakeDir(shard->dir, message_handler_)) {
+      continue;
+    }
+    // Only one process compacts a shard at a time; the others skip it.
+    if (!file_system_->TryLockWithTimeout(shard->lock_path, kLockTimeoutMs,
+                                          timer_,
+                                          message_handler_).is_true()) {
+      continue;
+    }
+    if (ClaimShard(shard)) {
+      // Catch up first, so that we don't drop entries written by others.
+      SyncClaimedShard(shard);
+      CompactClaimedShard(shard);
+      CheckpointClaimedShard(shard);
+      ReleaseShard(shard);
+    }
+    file_system_->Unlock(shard->lock_path, message_handler_);
+  }
+}
+
+void SegmentFileCache::CompactClaimedShard(Shard* shard) {
+  struct Candidate {
+    GoogleString name;
+    int64 size;
+    int64 live_bytes;
+  };
+  std::vector<Candidate> candidates;
+  int64 total_bytes = 0;
+  {
+    ScopedMutex lock(shard->mutex.get());
+    for (Shard::SegmentMap::iterator p = shard->segments.begin(),
+             e = shard->segments.end(); p != e; ++p) {
+      total_bytes += p->second.size;
+      if (&p->second != shard->active) {
+        Candidate candidate = {p->first, p->second.size, p->second.live_bytes};
+        candidates.push_back(candidate);
+      }
+    }
+  }
+
+  int64 budget = target_size_bytes_ / shards_.size();
+  int64 now_ms = timer_->NowMs();
+  NullMessageHandler null_handler;
+  for (int i = 0, n = candidates.size(); i < n; ++i) {
+    const Candidate& candidate = candidates[i];
+    int64 mtime_sec;
+    if (!file_system_->Mtime(shard->SegmentPath(candidate.name), &mtime_sec,
+                             &null_handler)) {
+      continue;
+    }
+    // Entries read after the end of the second the segment was last written
+    // in have been used since they were stored.
+    int64 last_write_ms = (mtime_sec + 1) * Timer::kSecondMs;
+    if (candidate.size < segment_size_bytes_ &&
+        now_ms - last_write_ms < kSealedSegmentIdleMs) {
+      continue;  // Possibly still being written to.
+    }
+    bool evict = (target_size_bytes_ > 0) && (total_bytes > budget);
+    if (evict || (candidate.live_bytes * 2 < candidate.size)) {
+      total_bytes -= CompactSegment(shard, candidate.name, evict,
+                                    last_write_ms);
+      file_system_->BumpLockTimeout(shard->lock_path, message_handler_);
+    }
+  }
+}
+
+int64 SegmentFileCache::CompactSegment(Shard* shard, const GoogleString& name,
+                                       bool evict, int64 cutoff_ms) {
+  // Since the shard is claimed, nothing else can remove the segment.  Taking
+  // the append mutex lets any append that just filled it reach the index.
+  Segment* segment;
+  int64 segment_size;
+  std::vector<std::pair<int64, GoogleString> > keep;  // (offset, key)
+  {
+    ScopedMutex append_lock(shard->append_mutex.get());
+    ScopedMutex lock(shard->mutex.get());
+    Shard::SegmentMap::iterator p = shard->segments.find(name);
+    if (p == shard->segments.end()) {
+      return 0;
+    }
+    segment = &p->second;
+    segment_size = segment->size;
+    // A tombstone has to be kept while an older value of its key may be
+    // left in another segment, or a rebuild of the index would bring the
+    // value back.
+    int64 oldest_other_ms = kint64max;
+    for (Shard::SegmentMap::iterator q = shard->segments.begin(),
+             e = shard->segments.end(); q != e; ++q) {
+      if (&q->second != segment) {
+        oldest_other_ms = SegmentCreationMs(q->first);
+        break;
+      }
+    }
+    for (std::unordered_set<const GoogleString*>::iterator q =
+             segment->keys.begin(), e = segment->keys.end(); q != e; ++q) {
+      const Entry& entry = shard->index.find(**q)->second;
+      if (entry.tombstone() ? (oldest_other_ms <= entry.write_ms)
+                            : (!evict || entry.atime_ms > cutoff_ms)) {
+        keep.push_back(std::make_pair(entry.offset, **q));
+      }
+    }
+  }
+  std::sort(keep.begin(), keep.end());
+
+  int64 relocated_bytes = 0;
+  GoogleString filename = shard->SegmentPath(name);
+  NullMessageHandler null_handler;
+  FileSystem::InputFile* file =
+      file_system_->OpenInputFile(filename.c_str(), &null_handler);
+  if (file != NULL) {
+    GoogleString record;
+    for (int i = 0, n = keep.size(); i < n; ++i) {
+      int64 offset = keep[i].first;
+      const GoogleString& key = keep[i].second;
+      int64 record_size;
+      uint64 entry_sequence;
+      {
+        ScopedMutex lock(shard->mutex.get());
+        Shard::Index::iterator p = shard->index.find(key);
+        if (p == shard->index.end() || p->second.segment != segment ||
+            p->second.offset != offset) {
+          continue;  // Overwritten since we looked.
+        }
+        record_size = p->second.record_size(key.size());
+        entry_sequence = p->second.sequence;
+      }
+      record.resize(record_size);
+      uint32 key_size, value_size, check;
+      int64 write_ms;
+      uint64 sequence;
+      if (!file->Seek(offset, &null_handler) ||
+          !ReadFully(file, &record[0], record_size) ||
+          !DecodeHeader(record.data(), &key_size, &value_size, &check,
+                        &write_ms, &sequence) ||
+          key_size != key.size() || sequence != entry_sequence ||
+          StringPiece(record.data() + kHeaderSize, key_size) != key) {
+        read_errors_->Add(1);
+        continue;
+      }
+
+      ScopedMutex append_lock(shard->append_mutex.get());
+      Segment* target;
+      int64 target_offset;
+      if (AppendRecord(shard, record, StringPiece(), &target,
+                       &target_offset)) {
+        ScopedMutex lock(shard->mutex.get());
+        Shard::Index::iterator p = shard->index.find(key);
+        if (p != shard->index.end() && p->second.segment == segment &&
+            p->second.offset == offset) {
+          shard->MoveEntry(p, target, target_offset);
+          relocated_bytes += record_size;
+        }
+      }
+    }
+    file_system_->Close(file, &null_handler);
+  }
+
+  if (!file_system_->RemoveFile(filename.c_str(), message_handler_)) {
+    return 0;
+  }
+  int64 evicted;
+  {
+    ScopedMutex lock(shard->mutex.get());
+    evicted = shard->RemoveSegment(shard->segments.find(name));
+  }
+  int64 freed = segment_size - relocated_bytes;
+  compactions_->Add(1);
+  evictions_->Add(evicted);
+  bytes_reclaimed_->Add(freed);
+  return freed;
+}
+
+void SegmentFileCache::Checkpoint() {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    if (ClaimShard(shards_[i])) {
+      SyncClaimedShard(shards_[i]);
+      CheckpointClaimedShard(shards_[i]);
+      ReleaseShard(shards_[i]);
+    }
+  }
+}
+
+void SegmentFileCache::CheckpointClaimedShard(Shard* shard) {
+  GoogleString data;
+  {
+    ScopedMutex lock(shard->mutex.get());
+    // Until we have read the index on disk, it knows more than we do.
+    if (!shard->loaded || shard->segments.empty()) {
+      return;
+    }
+    SerializeIndex(shard, &data);
+  }
+  file_system_->WriteFileAtomic(shard->index_path, data, message_handler_);
+}
+
+void SegmentFileCache::SerializeIndex(Shard* shard, GoogleString* out) {
+  std::unordered_map<const Segment*, uint32> numbers;
+  AppendScalar<uint32>(kIndexMagic, out);
+  AppendScalar<uint32>(kIndexVersion, out);
+  AppendScalar<uint32>(shard->segments.size(), out);
+  for (Shard::SegmentMap::iterator p = shard->segments.begin(),
+           e = shard->segments.end(); p != e; ++p) {
+    uint32 number = numbers.size();
+    numbers[&p->second] = number;
+    AppendScalar<uint32>(p->first.size(), out);
+    out->append(p->first);
+    AppendScalar<int64>(p->second.size, out);
+  }
+  AppendScalar<uint64>(shard->index.size(), out);
+  for (Shard::Index::iterator p = shard->index.begin(),
+           e = shard->index.end(); p != e; ++p) {
+    const Entry& entry = p->second;
+    AppendScalar<uint32>(p->first.size(), out);
+    out->append(p->first);
+    AppendScalar<uint32>(numbers[entry.segment], out);
+    AppendScalar<uint32>(entry.value_size, out);
+    AppendScalar<int64>(entry.offset, out);
+    AppendScalar<int64>(entry.write_ms, out);
+    AppendScalar<uint64>(entry.sequence, out);
+    AppendScalar<int64>(entry.atime_ms, out);
+  }
+  AppendScalar<uint64>(
+      HashString<CasePreserve, uint64>(out->data(), out->size()), out);
+}
+
+bool SegmentFileCache::ParseIndex(StringPiece data, IndexImage* image) {
+  if (data.size() < sizeof(uint64)) {
+    return false;
+  }
+  StringPiece body = data.substr(0, data.size() - sizeof(uint64));
+  if (LoadScalar<uint64>(data.data() + body.size()) !=
+      HashString<CasePreserve, uint64>(body.data(), body.size())) {
+    return false;
+  }
+  uint32 magic, version, num_segments;
+  if (!ConsumeScalar(&body, &magic) || magic != kIndexMagic ||
+      !ConsumeScalar(&body, &version) || version != kIndexVersion ||
+      !ConsumeScalar(&body, &num_segments)) {
+    return false;
+  }
+  for (uint32 i = 0; i < num_segments; ++i) {
+    uint32 name_size;
+    int64 size;
+    if (!ConsumeScalar(&body, &name_size) || body.size() < name_size) {
+      return false;
+    }
+    GoogleString name = body.substr(0, name_size).as_string();
+    body.remove_prefix(name_size);
+    if (!ConsumeScalar(&body, &size)) {
+      return false;
+    }
+    image->segments.push_back(std::make_pair(name, size));
+  }
+  uint64 num_items;
+  if (!ConsumeScalar(&body, &num_items)) {
+    return false;
+  }
+  for (uint64 i = 0; i < num_items; ++i) {
+    IndexImage::Item item;
+    uint32 key_size;
+    if (!ConsumeScalar(&body, &key_size) || key_size > kMaxKeySize ||
+        body.size() < key_size) {
+      return false;
+    }
+    body.substr(0, key_size).CopyToString(&item.record.key);
+    body.remove_prefix(key_size);
+    if (!ConsumeScalar(&body, &item.segment) ||
+        !ConsumeScalar(&body, &item.record.value_size) ||
+        !ConsumeScalar(&body, &item.record.offset) ||
+        !ConsumeScalar(&body, &item.record.write_ms) ||
+        !ConsumeScalar(&body, &item.record.sequence) ||
+        !ConsumeScalar(&body, &item.atime_ms) ||
+        item.segment >= num_segments) {
+      return false;
+    }
+    image->items.push_back(item);
+  }
+  return body.empty();
+}
+
+int64 SegmentFileCache::SizeBytes() {
+  int64 size = 0;
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    ScopedMutex lock(shards_[i]->mutex.get());
+    for (Shard::SegmentMap::iterator p = shards_[i]->segments.begin(),
+             e = shards_[i]->segments.end(); p != e; ++p) {
+      size += p->second.size;
+    }
+  }
+  return size;
+}
+
+int64 SegmentFileCache::NumEntries() {
+  int64 entries = 0;
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    ScopedMutex lock(shards_[i]->mutex.get());
+    entries += shards_[i]->index.size() - shards_[i]->num_tombstones;
+  }
+  return entries;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,233 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_SEGMENT_FILE_CACHE_H_
+#define PAGESPEED_KERNEL_CACHE_SEGMENT_FILE_CACHE_H_
+
+#include <vector>
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/cache_interface.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+
+namespace net_instaweb {
+
+class FileSystem;
+class MessageHandler;
+class SlowWorker;
+class Statistics;
+class ThreadSystem;
+class Timer;
+class Variable;
+
+// An on-disk cache that appends values to large segment files and keeps an
+// in-memory index from each key to the location of its latest value, so
+// that neither lookups nor cleaning have to walk a directory tree with a
+// file per entry as FileCache does.  Space is reclaimed by compacting
+// segments: the live records of a segment are copied to the end of the log
+// and the segment file is removed.  When the cache is over its target size,
+// compaction starts from the oldest segment and only keeps the entries
+// that were read since that segment was last written to, evicting the
+// rest.
+//
+// Keys are spread over a number of shards, each with its own directory,
+// index and lock, to reduce contention.  Several processes can share a
+// cache directory: each process appends only to segments it created, and
+// periodically scans the segments of other processes for records it hasn't
+// seen yet.  A value written by one process thus becomes visible to others
+// about a second later.  Compaction is coordinated between processes by a
+// per-shard lock file.
+//
+// The index of each shard is written to disk after every compaction and on
+// ShutDown, so a restarted process only has to scan the segments written
+// since.  If the index is missing or damaged, it is rebuilt by scanning all
+// segments.
+//
+// Writes of the same key are ordered by sequence numbers stored in their
+// records, so the index comes out the same whichever order segments are
+// scanned in, and deletions survive compaction.
+//
+// Index memory use is about 130 bytes per entry plus the size of the key,
+// independent of value sizes.
+class SegmentFileCache : public CacheInterface {
+ public:
+  // Shards default to this many segments' worth of the target size.
+  static const int kSegmentsPerShard = 8;
+  static const int64 kMinSegmentSizeBytes = 4 * 1024;
+  static const int64 kMaxSegmentSizeBytes = 64 * 1024 * 1024;
+
+  // Segments written by a process are sealed after this long, even if they
+  // have not reached the segment size.
+  static const int64 kMaxActiveSegmentAgeMs;
+  // Other processes' segments are assumed sealed once they have not been
+  // written to for this long.
+  static const int64 kSealedSegmentIdleMs;
+  // Minimum interval between scans for other processes' writes.
+  static const int64 kSyncIntervalMs;
+  // Minimum interval between compaction passes.
+  static const int64 kCompactionIntervalMs;
+
+  // A target_size_bytes of 0 disables eviction: compaction then only
+  // reclaims space taken by overwritten and deleted values.
+  SegmentFileCache(const GoogleString& path, int num_shards,
+                   int64 target_size_bytes, FileSystem* file_system,
+                   ThreadSystem* thread_system, Timer* timer,
+                   SlowWorker* worker, Statistics* stats,
+                   MessageHandler* handler);
+  virtual ~SegmentFileCache();
+
+  static void InitStats(Statistics* statistics);
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, const SharedString& value);
+  virtual void Delete(const GoogleString& key);
+  void set_worker(SlowWorker* worker) { worker_ = worker; }
+  SlowWorker* worker() { return worker_; }
+
+  static GoogleString FormatName() { return "SegmentFileCache"; }
+  virtual GoogleString Name() const { return FormatName(); }
+
+  virtual bool IsBlocking() const { return true; }
+  virtual bool IsHealthy() const { return true; }
+
+  // Writes out the index of every shard and closes the segments this
+  // process is writing to.
+  virtual void ShutDown();
+
+  const GoogleString& path() const { return path_; }
+  int num_shards() const { return shards_.size(); }
+
+  // Changing the target size also changes the size at which new segments
+  // are sealed.  This must be called before the cache is used.
+  void set_target_size_bytes(int64 x);
+  int64 target_size_bytes() const { return target_size_bytes_; }
+  int64 segment_size_bytes() const { return segment_size_bytes_; }
+
+  // Reclaims space in every shard whose compaction lock can be taken.  This
+  // is run on the worker after Put when kCompactionIntervalMs has elapsed
+  // since the last pass, and may take a while.
+  void Compact();
+
+  // Catches up with other processes' writes and writes the index of every
+  // shard to disk.
+  void Checkpoint();
+
+  // Returns the total size of the segment files of all shards, as of the
+  // last time each shard caught up with other processes' writes.
+  int64 SizeBytes();
+
+  // Returns the number of keys in the index.
+  int64 NumEntries();
+
+  // Variable names.
+  static const char kBytesReclaimed[];
+  static const char kCompactions[];
+  static const char kEvictions[];
+  static const char kReadErrors[];
+  static const char kWriteErrors[];
+
+ private:
+  class CompactFunction;
+  struct Shard;
+  struct Entry;
+  struct IndexImage;
+  struct Record;
+  struct Segment;
+
+  Shard* ShardForHash(uint64 hash);
+  int64 SegmentSizeForTarget(int64 target_size_bytes) const;
+
+  // Catches up with records appended by other processes, if at least
+  // kSyncIntervalMs has passed since the last time.  The first call also
+  // loads the shard's persisted index.
+  void MaybeSync(Shard* shard);
+
+  // Claiming a shard gives the caller exclusive use of its I/O outside of
+  // appends: syncing, compaction, and checkpointing.  Returns false if the
+  // shard was already claimed.
+  bool ClaimShard(Shard* shard);
+  void ReleaseShard(Shard* shard);
+  void SyncClaimedShard(Shard* shard);
+  void CompactClaimedShard(Shard* shard);
+  void CheckpointClaimedShard(Shard* shard);
+
+  // Copies the still-live records of the given segment to the end of the
+  // log and removes it.  If evict is set, only the records read after
+  // cutoff_ms are kept.  Returns the number of bytes freed.
+  int64 CompactSegment(Shard* shard, const GoogleString& segment_name,
+                       bool evict, int64 cutoff_ms);
+
+  // Appends a record for key with a new sequence number and applies it to
+  // the index.  A value_size of kTombstoneSize records a Delete.
+  void WriteRecord(const GoogleString& key, StringPiece value,
+                   uint32 value_size);
+
+  // The following require the shard's append mutex, but not its mutex, to
+  // be held.
+  //
+  // Appends a record consisting of header_and_key followed by value to the
+  // segment this process is writing to, returning the segment in *segment
+  // and the record's offset in it in *offset.
+  bool AppendRecord(Shard* shard, StringPiece header_and_key,
+                    StringPiece value, Segment** segment, int64* offset);
+  void CloseActiveSegment(Shard* shard);
+
+  // The following require the shard's mutex to be held.
+  //
+  // Points the index at the given record, unless it already has a newer
+  // record for the key.
+  void ApplyRecord(Shard* shard, Segment* segment, const Record& record,
+                   int64 atime_ms);
+  void SerializeIndex(Shard* shard, GoogleString* out);
+
+  // Scans the records in [start, end) of the given segment file, appending
+  // the well-formed ones to *records.  Returns the offset just past the last
+  // complete record, where the next scan should start.
+  int64 ScanSegment(const GoogleString& filename, int64 start, int64 end,
+                    std::vector<Record>* records);
+
+  static bool ParseIndex(StringPiece data, IndexImage* image);
+
+  void CompactIfNeeded();
+
+  const GoogleString path_;
+  FileSystem* file_system_;
+  Timer* timer_;
+  SlowWorker* worker_;
+  MessageHandler* message_handler_;
+  int64 target_size_bytes_;
+  int64 segment_size_bytes_;
+  std::vector<Shard*> shards_;
+
+  scoped_ptr<AbstractMutex> mutex_;
+  int64 next_compaction_ms_ GUARDED_BY(mutex_);
+
+  Variable* bytes_reclaimed_;
+  Variable* compactions_;
+  Variable* evictions_;
+  Variable* read_errors_;
+  Variable* write_errors_;
+
+  DISALLOW_COPY_AND_ASSIGN(SegmentFileCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_SEGMENT_FILE_CACHE_H_
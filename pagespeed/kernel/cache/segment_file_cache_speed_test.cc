@@ -0,0 +1,213 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares FileCache and SegmentFileCache on a real disk.  Both caches are
+// filled with 20000 1KB values under GTestTempDir() before timing starts.
+// Get and Put access the keys in order.  The Scan benchmarks measure what a
+// server has to read to learn how much the cache holds: FileCache walks its
+// directory tree as its cleaner does, while a freshly started
+// SegmentFileCache loads its indexes and checks its segments for writes
+// they don't cover.
+//
+// Benchmark                      Time(ns) Iterations
+// ---------------------------------------------------
+// FileCacheGet                       5294     277161
+// SegmentFileCacheGet                4535     346819
+// FileCachePut                      76388      26685
+// SegmentFileCachePut                2765     478926
+// FileCacheScan                  64027478         19
+// SegmentFileCacheScan           35967948         36
+//
+// Disclaimer: comparing runs over time and across different machines
+// can be misleading.  When contemplating an algorithm change, always do
+// interleaved runs with the old & new algorithm.
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/benchmark.h"
+#include "pagespeed/kernel/base/cache_interface.h"
+#include "pagespeed/kernel/base/file_system.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/md5_hasher.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/null_message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/stdio_file_system.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/file_cache.h"
+#include "pagespeed/kernel/cache/segment_file_cache.h"
+#include "pagespeed/kernel/thread/slow_worker.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace {
+
+const int kNumKeys = 20000;
+const int kValueSize = 1024;
+const int kNumShards = 16;
+const int64 kTargetSizeBytes = 1024 * 1024 * 1024;  // No eviction.
+
+class HitCallback : public net_instaweb::CacheInterface::Callback {
+ public:
+  HitCallback() : hit_(false) {}
+  virtual ~HitCallback() {}
+  virtual void Done(net_instaweb::CacheInterface::KeyState state) {
+    hit_ = (state == net_instaweb::CacheInterface::kAvailable);
+  }
+
+  bool hit() const { return hit_; }
+
+ private:
+  bool hit_;
+
+  DISALLOW_COPY_AND_ASSIGN(HitCallback);
+};
+
+GoogleString Key(int i) {
+  return net_instaweb::StrCat("http://example.com/rewritten/",
+                              net_instaweb::IntegerToString(i),
+                              ".pagespeed.ce.0123456789.css");
+}
+
+// Both caches, filled once and shared by all the benchmarks.
+class Caches {
+ public:
+  Caches()
+      : thread_system_(net_instaweb::Platform::CreateThreadSystem()),
+        timer_(net_instaweb::Platform::CreateTimer()),
+        worker_("cleaner", thread_system_.get()),
+        stats_(thread_system_.get()),
+        file_cache_path_(net_instaweb::StrCat(net_instaweb::GTestTempDir(),
+                                              "/file_cache_speed")),
+        segment_cache_path_(net_instaweb::StrCat(
+            net_instaweb::GTestTempDir(), "/segment_file_cache_speed")) {
+    net_instaweb::FileCache::InitStats(&stats_);
+    net_instaweb::SegmentFileCache::InitStats(&stats_);
+    file_cache_.reset(new net_instaweb::FileCache(
+        file_cache_path_, &file_system_, thread_system_.get(), &worker_,
+        new net_instaweb::FileCache::CachePolicy(
+            timer_.get(), &hasher_,
+            net_instaweb::FileCache::kDisableCleaning, 0, 0),
+        &stats_, &handler_));
+    segment_cache_.reset(NewSegmentFileCache());
+    net_instaweb::SharedString value(GoogleString(kValueSize, 'v'));
+    for (int i = 0; i < kNumKeys; ++i) {
+      file_cache_->Put(Key(i), value);
+      segment_cache_->Put(Key(i), value);
+    }
+    segment_cache_->Checkpoint();
+  }
+
+  net_instaweb::SegmentFileCache* NewSegmentFileCache() {
+    return new net_instaweb::SegmentFileCache(
+        segment_cache_path_, kNumShards, kTargetSizeBytes, &file_system_,
+        thread_system_.get(), timer_.get(), NULL /* worker */, &stats_,
+        &handler_);
+  }
+
+  net_instaweb::FileCache* file_cache() { return file_cache_.get(); }
+  net_instaweb::SegmentFileCache* segment_cache() {
+    return segment_cache_.get();
+  }
+  net_instaweb::FileSystem* file_system() { return &file_system_; }
+  net_instaweb::MessageHandler* handler() { return &handler_; }
+  const GoogleString& file_cache_path() const { return file_cache_path_; }
+
+ private:
+  scoped_ptr<net_instaweb::ThreadSystem> thread_system_;
+  scoped_ptr<net_instaweb::Timer> timer_;
+  net_instaweb::SlowWorker worker_;
+  net_instaweb::StdioFileSystem file_system_;
+  net_instaweb::MD5Hasher hasher_;
+  net_instaweb::NullMessageHandler handler_;
+  net_instaweb::SimpleStats stats_;
+  GoogleString file_cache_path_;
+  GoogleString segment_cache_path_;
+  scoped_ptr<net_instaweb::FileCache> file_cache_;
+  scoped_ptr<net_instaweb::SegmentFileCache> segment_cache_;
+};
+
+Caches* GetCaches() {
+  static Caches* caches = NULL;
+  if (caches == NULL) {
+    StopBenchmarkTiming();
+    caches = new Caches;
+    StartBenchmarkTiming();
+  }
+  return caches;
+}
+
+void Get(int iters, net_instaweb::CacheInterface* cache) {
+  HitCallback callback;
+  for (int i = 0; i < iters; ++i) {
+    cache->Get(Key(i % kNumKeys), &callback);
+    CHECK(callback.hit());
+  }
+}
+
+void Put(int iters, net_instaweb::CacheInterface* cache) {
+  net_instaweb::SharedString value(GoogleString(kValueSize, 'w'));
+  for (int i = 0; i < iters; ++i) {
+    cache->Put(Key(i % kNumKeys), value);
+  }
+}
+
+static void FileCacheGet(int iters) {
+  Get(iters, GetCaches()->file_cache());
+}
+
+static void SegmentFileCacheGet(int iters) {
+  Get(iters, GetCaches()->segment_cache());
+}
+
+static void FileCachePut(int iters) {
+  Put(iters, GetCaches()->file_cache());
+}
+
+static void SegmentFileCachePut(int iters) {
+  Put(iters, GetCaches()->segment_cache());
+}
+
+static void FileCacheScan(int iters) {
+  Caches* caches = GetCaches();
+  for (int i = 0; i < iters; ++i) {
+    net_instaweb::FileSystem::DirInfo dir_info;
+    caches->file_system()->GetDirInfo(caches->file_cache_path(), &dir_info,
+                                      caches->handler());
+  }
+}
+
+static void SegmentFileCacheScan(int iters) {
+  Caches* caches = GetCaches();
+  for (int i = 0; i < iters; ++i) {
+    scoped_ptr<net_instaweb::SegmentFileCache> cache(
+        caches->NewSegmentFileCache());
+    cache->Checkpoint();
+  }
+}
+
+}  // namespace
+
+BENCHMARK(FileCacheGet);
+BENCHMARK(SegmentFileCacheGet);
+BENCHMARK(FileCachePut);
+BENCHMARK(SegmentFileCachePut);
+BENCHMARK(FileCacheScan);
+BENCHMARK(SegmentFileCacheScan);
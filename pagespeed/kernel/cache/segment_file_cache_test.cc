@@ -0,0 +1,356 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the segment file cache.
+
+#include "pagespeed/kernel/cache/segment_file_cache.h"
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/google_message_handler.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mem_file_system.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_test_base.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kPath[] = "/segments";
+const int kNumShards = 2;
+
+// Small enough that a few dozen values fill a segment.
+const int64 kTargetSize = 64 * 1024;
+const int kValueSize = 100;
+
+}  // namespace
+
+class SegmentFileCacheTest : public CacheTestBase {
+ protected:
+  SegmentFileCacheTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        mock_timer_(thread_system_->NewMutex(), MockTimer::kApr_5_2010_ms),
+        file_system_(thread_system_.get(), &mock_timer_),
+        stats_(thread_system_.get()) {
+    SegmentFileCache::InitStats(&stats_);
+    cache_.reset(NewCache(kTargetSize));
+  }
+
+  SegmentFileCache* NewCache(int64 target_size) {
+    return new SegmentFileCache(kPath, kNumShards, target_size, &file_system_,
+                                thread_system_.get(), &mock_timer_,
+                                NULL /* worker */, &stats_, &message_handler_);
+  }
+
+  // Simulates a restart of the server.
+  void RestartCache() {
+    cache_->ShutDown();
+    cache_.reset(NewCache(kTargetSize));
+  }
+
+  virtual CacheInterface* Cache() { return cache_.get(); }
+
+  GoogleString Value(int i) {
+    GoogleString value = IntegerToString(i);
+    value.resize(kValueSize, 'x');
+    return value;
+  }
+
+  // Makes writes by other caches visible, and lets segments that are no
+  // longer written to be compacted.
+  void AdvancePastSealing() {
+    mock_timer_.AdvanceMs(SegmentFileCache::kSealedSegmentIdleMs +
+                          Timer::kSecondMs);
+  }
+
+  int64 Stat(const char* name) {
+    return stats_.GetVariable(name)->Get();
+  }
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  MockTimer mock_timer_;
+  MemFileSystem file_system_;
+  SimpleStats stats_;
+  GoogleMessageHandler message_handler_;
+  scoped_ptr<SegmentFileCache> cache_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(SegmentFileCacheTest);
+};
+
+TEST_F(SegmentFileCacheTest, PutGetDelete) {
+  CheckNotFound("Name");
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  CheckPut("Name", "NewValue");
+  CheckGet("Name", "NewValue");
+  CheckPut("Other", "");
+  CheckGet("Other", "");
+  EXPECT_EQ(2, cache_->NumEntries());
+
+  CheckDelete("Name");
+  CheckNotFound("Name");
+  CheckGet("Other", "");
+  EXPECT_EQ(1, cache_->NumEntries());
+}
+
+TEST_F(SegmentFileCacheTest, MultiGet) {
+  TestMultiGet();
+}
+
+TEST_F(SegmentFileCacheTest, SegmentSize) {
+  EXPECT_EQ(kTargetSize / (kNumShards * SegmentFileCache::kSegmentsPerShard),
+            cache_->segment_size_bytes());
+  cache_->set_target_size_bytes(0);
+  EXPECT_EQ(SegmentFileCache::kMaxSegmentSizeBytes,
+            cache_->segment_size_bytes());
+  cache_->set_target_size_bytes(1);
+  EXPECT_EQ(SegmentFileCache::kMinSegmentSizeBytes,
+            cache_->segment_size_bytes());
+}
+
+TEST_F(SegmentFileCacheTest, SharedBetweenProcesses) {
+  // Each cache stands for a process sharing the directory.
+  scoped_ptr<SegmentFileCache> other(NewCache(kTargetSize));
+  CheckNotFound("Name");
+  CheckNotFound("Other");
+  CheckPut("Name", "Value");
+  mock_timer_.AdvanceMs(1);  // So the caches' segment names differ.
+  CheckPut(other.get(), "Name", "OtherValue");
+  CheckPut(other.get(), "Other", "Value");
+
+  // The other cache's writes only show up at our next scan.
+  CheckGet("Name", "Value");
+  CheckNotFound("Other");
+  mock_timer_.AdvanceMs(SegmentFileCache::kSyncIntervalMs);
+  CheckGet("Name", "OtherValue");
+  CheckGet("Other", "Value");
+
+  // Deletions are seen too.
+  other->Delete("Other");
+  mock_timer_.AdvanceMs(SegmentFileCache::kSyncIntervalMs);
+  CheckNotFound("Other");
+  CheckGet(other.get(), "Name", "OtherValue");
+}
+
+TEST_F(SegmentFileCacheTest, IndexSurvivesRestart) {
+  for (int i = 0; i < 50; ++i) {
+    CheckPut(IntegerToString(i), Value(i));
+  }
+  CheckDelete("7");
+  RestartCache();
+  EXPECT_EQ(0, cache_->NumEntries());
+  for (int i = 0; i < 50; ++i) {
+    if (i == 7) {
+      CheckNotFound("7");
+    } else {
+      CheckGet(IntegerToString(i), Value(i));
+    }
+  }
+  EXPECT_EQ(49, cache_->NumEntries());
+
+  // Writes made after the index was written are found in the segments.
+  CheckPut("50", Value(50));
+  cache_.reset(NewCache(kTargetSize));
+  for (int i = 0; i <= 50; ++i) {
+    if (i != 7) {
+      CheckGet(IntegerToString(i), Value(i));
+    }
+  }
+  EXPECT_EQ(50, cache_->NumEntries());
+}
+
+TEST_F(SegmentFileCacheTest, RebuildsDamagedIndex) {
+  for (int i = 0; i < 50; ++i) {
+    CheckPut(IntegerToString(i), Value(i));
+  }
+  CheckDelete("7");
+  RestartCache();
+
+  // Damage the index of each shard; the segments still have everything.
+  for (int shard = 0; shard < kNumShards; ++shard) {
+    GoogleString index = StrCat(kPath, "/shard", IntegerToString(shard),
+                                "/!index!");
+    GoogleString contents;
+    ASSERT_TRUE(file_system_.ReadFile(index.c_str(), &contents,
+                                      &message_handler_));
+    contents[contents.size() / 2] ^= 1;
+    ASSERT_TRUE(file_system_.WriteFile(index.c_str(), contents,
+                                       &message_handler_));
+  }
+  for (int i = 0; i < 50; ++i) {
+    if (i == 7) {
+      CheckNotFound("7");
+    } else {
+      CheckGet(IntegerToString(i), Value(i));
+    }
+  }
+  EXPECT_EQ(49, cache_->NumEntries());
+}
+
+TEST_F(SegmentFileCacheTest, CompactionReclaimsOverwrittenValues) {
+  for (int round = 0; round < 10; ++round) {
+    for (int i = 0; i < 20; ++i) {
+      CheckPut(IntegerToString(i), Value(i + round));
+    }
+  }
+  int64 size_before = cache_->SizeBytes();
+  AdvancePastSealing();
+  cache_->Compact();
+  EXPECT_LT(0, Stat(SegmentFileCache::kCompactions));
+  EXPECT_LT(0, Stat(SegmentFileCache::kBytesReclaimed));
+  EXPECT_EQ(0, Stat(SegmentFileCache::kEvictions));
+  EXPECT_GT(size_before, cache_->SizeBytes());
+  for (int i = 0; i < 20; ++i) {
+    CheckGet(IntegerToString(i), Value(i + 9));
+  }
+
+  // The relocated values survive a restart.
+  RestartCache();
+  for (int i = 0; i < 20; ++i) {
+    CheckGet(IntegerToString(i), Value(i + 9));
+  }
+}
+
+TEST_F(SegmentFileCacheTest, CompactionKeepsDeletions) {
+  for (int i = 0; i < 20; ++i) {
+    CheckPut(IntegerToString(i), Value(i));
+  }
+
+  // Delete a key in a later segment, which then fills up with values that
+  // are overwritten, so that it is compacted while the deleted value's
+  // segment is not.
+  AdvancePastSealing();
+  CheckDelete("3");
+  for (int round = 0; round < 5; ++round) {
+    for (int i = 0; i < 40; ++i) {
+      CheckPut(StrCat("y", IntegerToString(i)), Value(i + round));
+    }
+  }
+  AdvancePastSealing();
+  cache_->Compact();
+  EXPECT_LT(0, Stat(SegmentFileCache::kCompactions));
+  EXPECT_EQ(0, Stat(SegmentFileCache::kEvictions));
+  CheckNotFound("3");
+  EXPECT_EQ(59, cache_->NumEntries());
+
+  RestartCache();
+  CheckNotFound("3");
+
+  // Rebuilding the index from the segments doesn't bring the value back.
+  cache_->ShutDown();
+  for (int shard = 0; shard < kNumShards; ++shard) {
+    GoogleString index = StrCat(kPath, "/shard", IntegerToString(shard),
+                                "/!index!");
+    ASSERT_TRUE(file_system_.RemoveFile(index.c_str(), &message_handler_));
+  }
+  cache_.reset(NewCache(kTargetSize));
+  for (int i = 0; i < 20; ++i) {
+    if (i == 3) {
+      CheckNotFound("3");
+    } else {
+      CheckGet(IntegerToString(i), Value(i));
+    }
+  }
+  for (int i = 0; i < 40; ++i) {
+    CheckGet(StrCat("y", IntegerToString(i)), Value(i + 4));
+  }
+  EXPECT_EQ(59, cache_->NumEntries());
+}
+
+TEST_F(SegmentFileCacheTest, EvictsUnreadEntriesWhenOverTarget) {
+  const int kNumKeys = 2000;  // About three times the target size.
+  for (int i = 0; i < kNumKeys; ++i) {
+    CheckPut(IntegerToString(i), Value(i));
+  }
+  EXPECT_LT(kTargetSize, cache_->SizeBytes());
+
+  // Read the first keys, which landed in the oldest segments, after their
+  // segments were sealed.
+  AdvancePastSealing();
+  for (int i = 0; i < 10; ++i) {
+    CheckGet(IntegerToString(i), Value(i));
+  }
+  mock_timer_.AdvanceMs(Timer::kSecondMs);
+  cache_->Compact();
+  EXPECT_LT(0, Stat(SegmentFileCache::kEvictions));
+  EXPECT_GE(kTargetSize, cache_->SizeBytes());
+  for (int i = 0; i < 10; ++i) {
+    CheckGet(IntegerToString(i), Value(i));
+  }
+  CheckNotFound("10");
+}
+
+TEST_F(SegmentFileCacheTest, OtherProcessCompaction) {
+  mock_timer_.AdvanceMs(1);
+  scoped_ptr<SegmentFileCache> other(NewCache(kTargetSize));
+  for (int round = 0; round < 10; ++round) {
+    for (int i = 0; i < 20; ++i) {
+      CheckPut(IntegerToString(i), Value(i + round));
+    }
+  }
+
+  // The other cache moves the live values out of our sealed segments and
+  // removes them.  We find the values in their new place after our next
+  // scan.
+  AdvancePastSealing();
+  for (int i = 0; i < 20; ++i) {
+    CheckGet(IntegerToString(i), Value(i + 9));
+  }
+  other->Compact();
+  EXPECT_LT(0, Stat(SegmentFileCache::kCompactions));
+  mock_timer_.AdvanceMs(SegmentFileCache::kSyncIntervalMs);
+  for (int i = 0; i < 20; ++i) {
+    CheckGet(IntegerToString(i), Value(i + 9));
+  }
+  EXPECT_EQ(0, Stat(SegmentFileCache::kReadErrors));
+}
+
+TEST_F(SegmentFileCacheTest, DamagedSegmentTail) {
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  RestartCache();
+
+  // Append half a record to the segment, as a crashed writer might.
+  StringVector files;
+  for (int shard = 0; shard < kNumShards; ++shard) {
+    file_system_.ListContents(StrCat(kPath, "/shard", IntegerToString(shard)),
+                              &files, &message_handler_);
+  }
+  for (int i = 0, n = files.size(); i < n; ++i) {
+    if (StringPiece(files[i]).ends_with(".seg")) {
+      FileSystem::OutputFile* file = file_system_.OpenOutputFileForAppend(
+          files[i].c_str(), &message_handler_);
+      ASSERT_TRUE(file != NULL);
+      file->Write("SFC2garbagegarbagegarbagegarbagegarbage", &message_handler_);
+      file_system_.Close(file, &message_handler_);
+    }
+  }
+  cache_.reset(NewCache(kTargetSize));
+  CheckGet("Name", "Value");
+  CheckPut("Other", "Value");
+  CheckGet("Other", "Value");
+}
+
+}  // namespace net_instaweb
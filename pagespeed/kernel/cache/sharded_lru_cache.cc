@@ -0,0 +1,599 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/sharded_lru_cache.h"
+
+#include <cstddef>
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/cache_interface.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/stl_util.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_hash.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Initial number of table slots per shard.  Must be a power of 2.
+const int kInitialTableSize = 64;
+
+// Index used to terminate the intrusive LRU list.
+const int32 kNoEntry = -1;
+
+// Mixes the bits of the string hash so that both the shard selection (high
+// bits) and the table placement (low bits) are well distributed.  This is
+// the 64-bit finalizer from MurmurHash3.
+uint64 MixHash(uint64 h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+}  // namespace
+
+// Totals of the per-shard counters, as reported by the accessors.
+struct ShardedLRUCache::Stats {
+  Stats()
+      : bytes(0), max_bytes(0), elements(0), evictions(0), hits(0), misses(0),
+        inserts(0), identical_reinserts(0), deletes(0),
+        admission_rejections(0) {
+  }
+
+  size_t bytes;
+  size_t max_bytes;
+  size_t elements;
+  size_t evictions;
+  size_t hits;
+  size_t misses;
+  size_t inserts;
+  size_t identical_reinserts;
+  size_t deletes;
+  size_t admission_rejections;
+};
+
+// A single independently-locked LRU segment.
+class ShardedLRUCache::Shard {
+ public:
+  Shard(size_t max_bytes, AbstractMutex* mutex)
+      : mutex_(mutex),
+        table_(kInitialTableSize),
+        mask_(kInitialTableSize - 1),
+        head_(kNoEntry),
+        tail_(kNoEntry),
+        num_elements_(0),
+        max_bytes_in_cache_(max_bytes),
+        current_bytes_in_cache_(0),
+        admission_policy_(NULL) {
+    ClearStatsLockHeld();
+  }
+
+  // Does not take ownership of policy.
+  void set_admission_policy(FrequencyAdmissionPolicy* policy)
+      LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    admission_policy_ = policy;
+  }
+
+  // Looks up key, freshening it on a hit.  The value is copied (which only
+  // bumps its reference count) so that the caller can use it after the
+  // lock is released.
+  bool Get(const GoogleString& key, uint64 hash, SharedString* value)
+      LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    if (admission_policy_ != NULL) {
+      admission_policy_->RecordAccess(hash);
+    }
+    int32 index = Find(key, hash);
+    if (index == kNoEntry) {
+      ++num_misses_;
+      return false;
+    }
+    Freshen(index);
+    *value = table_[index].value;
+    ++num_hits_;
+    return true;
+  }
+
+  void Put(const GoogleString& key, uint64 hash, const SharedString& value)
+      LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    int32 index = Find(key, hash);
+    if (index != kNoEntry) {
+      Entry* entry = &table_[index];
+      if (entry->value.Value() == value.Value()) {
+        Freshen(index);
+        ++num_identical_reinserts_;
+        return;
+      }
+      ++num_deletes_;
+      Erase(index);
+    } else if (!ShouldAdmit(hash, key.size() + value.size())) {
+      // The admission policy prefers the entry we would have to evict.
+      ++num_admission_rejections_;
+      return;
+    }
+
+    if (EvictIfNecessary(key.size() + value.size())) {
+      Insert(key, hash, value);
+      ++num_inserts_;
+    }
+  }
+
+  void Delete(const GoogleString& key, uint64 hash) LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    int32 index = Find(key, hash);
+    if (index != kNoEntry) {
+      Erase(index);
+      ++num_deletes_;
+    }
+  }
+
+  void Clear() LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    std::vector<Entry> empty_table(kInitialTableSize);
+    table_.swap(empty_table);
+    mask_ = kInitialTableSize - 1;
+    head_ = kNoEntry;
+    tail_ = kNoEntry;
+    num_elements_ = 0;
+    current_bytes_in_cache_ = 0;
+  }
+
+  void ClearStats() LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    ClearStatsLockHeld();
+  }
+
+  void SanityCheck() LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    size_t count = 0;
+    size_t bytes_used = 0;
+    int32 prev = kNoEntry;
+    for (int32 index = head_; index != kNoEntry;
+         prev = index, index = table_[index].next, ++count) {
+      const Entry& entry = table_[index];
+      CHECK(entry.in_use);
+      CHECK_EQ(prev, entry.prev);
+      CHECK_EQ(index, Find(entry.key, entry.hash));
+      bytes_used += EntrySize(entry);
+    }
+    CHECK_EQ(prev, tail_);
+    CHECK_EQ(num_elements_, count);
+    CHECK_EQ(current_bytes_in_cache_, bytes_used);
+    CHECK_LE(current_bytes_in_cache_, max_bytes_in_cache_);
+
+    // Every occupied slot must be on the list.
+    count = 0;
+    for (int i = 0, n = table_.size(); i < n; ++i) {
+      if (table_[i].in_use) {
+        ++count;
+      }
+    }
+    CHECK_EQ(num_elements_, count);
+  }
+
+  // Adds this shard's counters into the passed-in totals.
+  void AddStatsTo(Stats* stats) const LOCKS_EXCLUDED(mutex_) {
+    ScopedMutex lock(mutex_.get());
+    stats->bytes += current_bytes_in_cache_;
+    stats->max_bytes += max_bytes_in_cache_;
+    stats->elements += num_elements_;
+    stats->evictions += num_evictions_;
+    stats->hits += num_hits_;
+    stats->misses += num_misses_;
+    stats->inserts += num_inserts_;
+    stats->identical_reinserts += num_identical_reinserts_;
+    stats->deletes += num_deletes_;
+    stats->admission_rejections += num_admission_rejections_;
+  }
+
+ private:
+  // Table slot.  Entries are linked onto the LRU list by table index, with
+  // head_ being the most recently used.
+  struct Entry {
+    Entry() : hash(0), prev(kNoEntry), next(kNoEntry), in_use(false) {}
+
+    GoogleString key;
+    SharedString value;
+    uint64 hash;
+    int32 prev;  // More recently used neighbor.
+    int32 next;  // Less recently used neighbor.
+    bool in_use;
+  };
+
+  static size_t EntrySize(const Entry& entry) {
+    return entry.key.size() + entry.value.size();
+  }
+
+  void ClearStatsLockHeld() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    num_evictions_ = 0;
+    num_hits_ = 0;
+    num_misses_ = 0;
+    num_inserts_ = 0;
+    num_identical_reinserts_ = 0;
+    num_deletes_ = 0;
+    num_admission_rejections_ = 0;
+  }
+
+  int32 HomeSlot(uint64 hash) const {
+    return static_cast<int32>(hash & mask_);
+  }
+
+  int32 Find(const GoogleString& key, uint64 hash) const
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    // The table is never allowed to fill up, so this terminates.
+    for (int32 index = HomeSlot(hash); table_[index].in_use;
+         index = (index + 1) & mask_) {
+      const Entry& entry = table_[index];
+      if ((entry.hash == hash) && (entry.key == key)) {
+        return index;
+      }
+    }
+    return kNoEntry;
+  }
+
+  void LinkAtHead(int32 index) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    Entry* entry = &table_[index];
+    entry->prev = kNoEntry;
+    entry->next = head_;
+    if (head_ != kNoEntry) {
+      table_[head_].prev = index;
+    } else {
+      tail_ = index;
+    }
+    head_ = index;
+  }
+
+  void Unlink(int32 index) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    Entry* entry = &table_[index];
+    if (entry->prev != kNoEntry) {
+      table_[entry->prev].next = entry->next;
+    } else {
+      head_ = entry->next;
+    }
+    if (entry->next != kNoEntry) {
+      table_[entry->next].prev = entry->prev;
+    } else {
+      tail_ = entry->prev;
+    }
+    entry->prev = kNoEntry;
+    entry->next = kNoEntry;
+  }
+
+  void Freshen(int32 index) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    if (index != head_) {
+      Unlink(index);
+      LinkAtHead(index);
+    }
+  }
+
+  // Places a new entry into the table, which must not already contain key,
+  // and makes it the most recently used.  The caller is responsible for
+  // having made room for it in the byte budget.
+  void Insert(const GoogleString& key, uint64 hash, const SharedString& value)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    // Keep the load factor at or below 3/4 so probe sequences stay short.
+    if (4 * (num_elements_ + 1) > 3 * table_.size()) {
+      Grow();
+    }
+    int32 index = HomeSlot(hash);
+    while (table_[index].in_use) {
+      index = (index + 1) & mask_;
+    }
+    Entry* entry = &table_[index];
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+    entry->in_use = true;
+    LinkAtHead(index);
+    ++num_elements_;
+  }
+
+  // Removes the entry at index and closes the gap in its probe sequence by
+  // shifting back any following entries that would otherwise become
+  // unreachable, so no tombstones are needed.
+  void Erase(int32 index) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    DCHECK_GE(current_bytes_in_cache_, EntrySize(table_[index]));
+    current_bytes_in_cache_ -= EntrySize(table_[index]);
+    Unlink(index);
+    ClearSlot(index);
+    --num_elements_;
+
+    int32 hole = index;
+    for (int32 scan = (hole + 1) & mask_; table_[scan].in_use;
+         scan = (scan + 1) & mask_) {
+      int32 home = HomeSlot(table_[scan].hash);
+      // The entry at 'scan' can stay put if its home slot lies cyclically
+      // in (hole, scan]; otherwise the hole breaks its probe sequence.
+      bool stays = (hole <= scan)
+          ? ((hole < home) && (home <= scan))
+          : ((hole < home) || (home <= scan));
+      if (!stays) {
+        MoveEntry(scan, hole);
+        hole = scan;
+      }
+    }
+  }
+
+  // Relocates an entry from slot 'from' into the empty slot 'to', fixing up
+  // the LRU links that refer to it.
+  void MoveEntry(int32 from, int32 to) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    Entry* src = &table_[from];
+    Entry* dest = &table_[to];
+    DCHECK(!dest->in_use);
+    dest->key.swap(src->key);
+    dest->value = src->value;
+    dest->hash = src->hash;
+    dest->prev = src->prev;
+    dest->next = src->next;
+    dest->in_use = true;
+    if (dest->prev != kNoEntry) {
+      table_[dest->prev].next = to;
+    } else {
+      head_ = to;
+    }
+    if (dest->next != kNoEntry) {
+      table_[dest->next].prev = to;
+    } else {
+      tail_ = to;
+    }
+    ClearSlot(from);
+  }
+
+  void ClearSlot(int32 index) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    Entry* entry = &table_[index];
+    GoogleString empty_key;
+    entry->key.swap(empty_key);
+    entry->value = empty_value_;
+    entry->prev = kNoEntry;
+    entry->next = kNoEntry;
+    entry->in_use = false;
+  }
+
+  // Doubles the table size, reinserting entries from least to most recently
+  // used so that the LRU order is preserved.
+  void Grow() EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    std::vector<Entry> old_table(2 * table_.size());
+    old_table.swap(table_);
+    mask_ = table_.size() - 1;
+    int32 old_tail = tail_;
+    head_ = kNoEntry;
+    tail_ = kNoEntry;
+    for (int32 old_index = old_tail; old_index != kNoEntry;
+         old_index = old_table[old_index].prev) {
+      Entry* src = &old_table[old_index];
+      int32 index = HomeSlot(src->hash);
+      while (table_[index].in_use) {
+        index = (index + 1) & mask_;
+      }
+      Entry* dest = &table_[index];
+      dest->key.swap(src->key);
+      dest->value = src->value;
+      src->value = empty_value_;
+      dest->hash = src->hash;
+      dest->in_use = true;
+      LinkAtHead(index);
+    }
+  }
+
+  // Returns false if inserting a new entry of the given size would evict the
+  // least recently used entry, and the admission policy rates that entry
+  // above the new key.  Entries too big to ever fit are left for
+  // EvictIfNecessary to reject.
+  bool ShouldAdmit(uint64 hash, size_t bytes_needed)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    if ((admission_policy_ == NULL) || (tail_ == kNoEntry) ||
+        (bytes_needed >= max_bytes_in_cache_) ||
+        (bytes_needed + current_bytes_in_cache_ <= max_bytes_in_cache_)) {
+      return true;
+    }
+    return admission_policy_->Admit(hash, table_[tail_].hash);
+  }
+
+  bool EvictIfNecessary(size_t bytes_needed) EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+    if (bytes_needed >= max_bytes_in_cache_) {
+      return false;
+    }
+    while (bytes_needed + current_bytes_in_cache_ > max_bytes_in_cache_) {
+      DCHECK_NE(kNoEntry, tail_);
+      Erase(tail_);
+      ++num_evictions_;
+    }
+    current_bytes_in_cache_ += bytes_needed;
+    return true;
+  }
+
+  scoped_ptr<AbstractMutex> mutex_;
+  const SharedString empty_value_;  // Assigned to vacated slots.
+  std::vector<Entry> table_ GUARDED_BY(mutex_);
+  uint64 mask_ GUARDED_BY(mutex_);
+  int32 head_ GUARDED_BY(mutex_);
+  int32 tail_ GUARDED_BY(mutex_);
+  size_t num_elements_ GUARDED_BY(mutex_);
+  size_t max_bytes_in_cache_;
+  size_t current_bytes_in_cache_ GUARDED_BY(mutex_);
+  size_t num_evictions_ GUARDED_BY(mutex_);
+  size_t num_hits_ GUARDED_BY(mutex_);
+  size_t num_misses_ GUARDED_BY(mutex_);
+  size_t num_inserts_ GUARDED_BY(mutex_);
+  size_t num_identical_reinserts_ GUARDED_BY(mutex_);
+  size_t num_deletes_ GUARDED_BY(mutex_);
+  size_t num_admission_rejections_ GUARDED_BY(mutex_);
+  FrequencyAdmissionPolicy* admission_policy_ GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(Shard);
+};
+
+ShardedLRUCache::ShardedLRUCache(size_t max_size, int num_shards,
+                                 ThreadSystem* thread_system) {
+  CHECK_LT(0, num_shards);
+  shards_.reserve(num_shards);
+  for (int i = 0; i < num_shards; ++i) {
+    shards_.push_back(new Shard(max_size / num_shards,
+                                thread_system->NewMutex()));
+  }
+  set_is_healthy(true);
+}
+
+ShardedLRUCache::~ShardedLRUCache() {
+  STLDeleteElements(&shards_);
+}
+
+void ShardedLRUCache::set_admission_policy(FrequencyAdmissionPolicy* policy) {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    shards_[i]->set_admission_policy(policy);
+  }
+  admission_policy_.reset(policy);
+}
+
+GoogleString ShardedLRUCache::FormatName(int num_shards) {
+  return StrCat("ShardedLRUCache(", IntegerToString(num_shards), ")");
+}
+
+ShardedLRUCache::Shard* ShardedLRUCache::ShardForKey(const GoogleString& key,
+                                                     uint64* hash) const {
+  *hash = MixHash(HashString<CasePreserve, uint64>(key.data(), key.size()));
+  return shards_[(*hash >> 32) % shards_.size()];
+}
+
+void ShardedLRUCache::Get(const GoogleString& key, Callback* callback) {
+  KeyState key_state = kNotFound;
+  if (IsHealthy()) {
+    uint64 hash;
+    SharedString value;
+    if (ShardForKey(key, &hash)->Get(key, hash, &value)) {
+      key_state = kAvailable;
+      callback->set_value(value);
+    }
+  }
+  ValidateAndReportResult(key, key_state, callback);
+}
+
+void ShardedLRUCache::Put(const GoogleString& key,
+                          const SharedString& new_value) {
+  if (!IsHealthy()) {
+    return;
+  }
+  uint64 hash;
+  ShardForKey(key, &hash)->Put(key, hash, new_value);
+}
+
+void ShardedLRUCache::Delete(const GoogleString& key) {
+  if (!IsHealthy()) {
+    return;
+  }
+  uint64 hash;
+  ShardForKey(key, &hash)->Delete(key, hash);
+}
+
+void ShardedLRUCache::AggregateStats(Stats* stats) const {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    shards_[i]->AddStatsTo(stats);
+  }
+}
+
+size_t ShardedLRUCache::size_bytes() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.bytes;
+}
+
+size_t ShardedLRUCache::max_bytes_in_cache() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.max_bytes;
+}
+
+size_t ShardedLRUCache::num_elements() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.elements;
+}
+
+size_t ShardedLRUCache::num_evictions() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.evictions;
+}
+
+size_t ShardedLRUCache::num_hits() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.hits;
+}
+
+size_t ShardedLRUCache::num_misses() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.misses;
+}
+
+size_t ShardedLRUCache::num_inserts() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.inserts;
+}
+
+size_t ShardedLRUCache::num_identical_reinserts() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.identical_reinserts;
+}
+
+size_t ShardedLRUCache::num_deletes() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.deletes;
+}
+
+size_t ShardedLRUCache::num_admission_rejections() const {
+  Stats stats;
+  AggregateStats(&stats);
+  return stats.admission_rejections;
+}
+
+void ShardedLRUCache::SanityCheck() {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    shards_[i]->SanityCheck();
+  }
+}
+
+void ShardedLRUCache::Clear() {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    shards_[i]->Clear();
+  }
+}
+
+void ShardedLRUCache::ClearStats() {
+  for (int i = 0, n = shards_.size(); i < n; ++i) {
+    shards_[i]->ClearStats();
+  }
+}
+
+}  // namespace net_instaweb
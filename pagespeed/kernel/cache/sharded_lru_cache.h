@@ -0,0 +1,122 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_SHARDED_LRU_CACHE_H_
+#define PAGESPEED_KERNEL_CACHE_SHARDED_LRU_CACHE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "pagespeed/kernel/base/atomic_bool.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/cache_interface.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+
+namespace net_instaweb {
+
+class ThreadSystem;
+
+// Thread-safe in-memory LRU cache, split into a number of independent
+// segments ("shards"), each guarded by its own mutex.  A key is assigned
+// to a shard by its hash, so concurrent lookups of different keys rarely
+// contend for the same lock, unlike ThreadsafeCache(LRUCache), which
+// serializes every operation on a single mutex.
+//
+// Each shard stores its entries inline in an open-addressed hash table
+// (linear probing, backward-shift deletion) and threads them onto an
+// intrusive doubly-linked LRU list using table indices, so Get, Put and
+// Delete are O(1) and do not allocate list or map nodes.
+//
+// The byte budget is divided evenly between the shards, and LRU order is
+// maintained per shard, so eviction is only approximately LRU across the
+// cache as a whole.  As with LRUCache, only key and value bytes are counted
+// against the budget.
+//
+// Callbacks are run without any shard lock held.
+class ShardedLRUCache : public CacheInterface {
+ public:
+  // max_size is the total byte budget, which is split across num_shards.
+  ShardedLRUCache(size_t max_size, int num_shards, ThreadSystem* thread_system);
+  virtual ~ShardedLRUCache();
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, const SharedString& new_value);
+  virtual void Delete(const GoogleString& key);
+
+  int num_shards() const { return shards_.size(); }
+
+  // Filters insertions through a frequency-based admission policy, shared
+  // by all the shards, so it needs a real mutex.  A new key is only let in
+  // if it would displace its shard's LRU entry and the policy rates it above
+  // that entry.  Takes ownership of policy.  Should be called at setup time.
+  void set_admission_policy(FrequencyAdmissionPolicy* policy);
+
+  // The following accessors aggregate across all shards, taking each shard
+  // lock in turn.  They are intended for tests and statistics, and are not
+  // a consistent snapshot if the cache is being concurrently mutated.
+  size_t size_bytes() const;
+  size_t max_bytes_in_cache() const;
+  size_t num_elements() const;
+  size_t num_evictions() const;
+  size_t num_hits() const;
+  size_t num_misses() const;
+  size_t num_inserts() const;
+  size_t num_identical_reinserts() const;
+  size_t num_deletes() const;
+  size_t num_admission_rejections() const;
+
+  // Sanity check the cache data structures in every shard.
+  void SanityCheck();
+
+  // Clear the entire cache.  Note that this will not clear the stats.
+  void Clear();
+
+  // Clear the stats -- note that this will not clear the content.
+  void ClearStats();
+
+  static GoogleString FormatName(int num_shards);
+  virtual GoogleString Name() const { return FormatName(num_shards()); }
+  virtual bool IsBlocking() const { return true; }
+  virtual bool IsHealthy() const { return is_healthy_.value(); }
+  virtual void ShutDown() { set_is_healthy(false); }
+
+  void set_is_healthy(bool x) { is_healthy_.set_value(x); }
+
+ private:
+  class Shard;
+  struct Stats;
+
+  // Sums the counters of all shards into stats.
+  void AggregateStats(Stats* stats) const;
+
+  // Returns the shard responsible for key, and fills in its hash code,
+  // which the shard uses to place the key in its table.
+  Shard* ShardForKey(const GoogleString& key, uint64* hash) const;
+
+  std::vector<Shard*> shards_;
+  AtomicBool is_healthy_;
+  scoped_ptr<FrequencyAdmissionPolicy> admission_policy_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedLRUCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_SHARDED_LRU_CACHE_H_
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the sharded LRU cache.
+
+#include "pagespeed/kernel/cache/sharded_lru_cache.h"
+
+#include <cstddef>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/cache/cache_spammer.h"
+#include "pagespeed/kernel/cache/cache_test_base.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+#include "pagespeed/kernel/util/platform.h"
+
+namespace {
+const size_t kMaxSize = 100;
+const int kNumThreads = 4;
+const int kNumIters = 10000;
+const int kNumInserts = 10;
+}
+
+namespace net_instaweb {
+
+class ShardedLRUCacheTest : public CacheTestBase {
+ protected:
+  ShardedLRUCacheTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        cache_(new ShardedLRUCache(kMaxSize, 1, thread_system_.get())) {
+  }
+
+  // Replaces the cache with one having the given total size and shard count.
+  void ResetCache(size_t max_size, int num_shards) {
+    cache_.reset(new ShardedLRUCache(max_size, num_shards,
+                                     thread_system_.get()));
+  }
+
+  virtual CacheInterface* Cache() { return cache_.get(); }
+  virtual void PostOpCleanup() { cache_->SanityCheck(); }
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  scoped_ptr<ShardedLRUCache> cache_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ShardedLRUCacheTest);
+};
+
+// Simple flow of putting in an item, getting it, deleting it.
+TEST_F(ShardedLRUCacheTest, PutGetDelete) {
+  EXPECT_EQ(static_cast<size_t>(0), cache_->size_bytes());
+  EXPECT_EQ(static_cast<size_t>(0), cache_->num_elements());
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  EXPECT_EQ(static_cast<size_t>(9), cache_->size_bytes());  // "Name" + "Value"
+  EXPECT_EQ(static_cast<size_t>(1), cache_->num_elements());
+  CheckNotFound("Another Name");
+
+  CheckPut("Name", "NewValue");
+  CheckGet("Name", "NewValue");
+  EXPECT_EQ(static_cast<size_t>(12),
+            cache_->size_bytes());  // "Name" + "NewValue"
+  EXPECT_EQ(static_cast<size_t>(1), cache_->num_elements());
+
+  CheckDelete("Name");
+  CheckNotFound("Name");
+  EXPECT_EQ(static_cast<size_t>(0), cache_->size_bytes());
+  EXPECT_EQ(static_cast<size_t>(0), cache_->num_elements());
+  EXPECT_EQ(static_cast<size_t>(2), cache_->num_hits());
+  EXPECT_EQ(static_cast<size_t>(2), cache_->num_misses());
+  EXPECT_EQ(static_cast<size_t>(2), cache_->num_inserts());
+  EXPECT_EQ(static_cast<size_t>(2), cache_->num_deletes());
+}
+
+// With a single shard, eviction is exact LRU.  This mirrors the
+// LRUCacheTest.LeastRecentlyUsed scenario.
+TEST_F(ShardedLRUCacheTest, LeastRecentlyUsed) {
+  GoogleString keys[10], values[10];
+  const char key_pattern[]      = "name%d";
+  const char value_pattern[]    = "valu%d";
+  const int key_plus_value_size = 10;  // strlen("name7") + strlen("valu7")
+  const size_t num_elements     = kMaxSize / key_plus_value_size;
+  for (int i = 0; i < 10; ++i) {
+    SStringPrintf(&keys[i], key_pattern, i);
+    SStringPrintf(&values[i], value_pattern, i);
+    CheckPut(keys[i], values[i]);
+  }
+  EXPECT_EQ(kMaxSize, cache_->size_bytes());
+  EXPECT_EQ(num_elements, cache_->num_elements());
+  for (int i = 0; i < 10; ++i) {
+    CheckGet(keys[i], values[i]);
+  }
+
+  // Inserting a new 10-byte entry evicts name0; touching name1 makes it
+  // the MRU so that nameB evicts name2 instead.
+  CheckPut("nameA", "valuA");
+  CheckNotFound("name0");
+  CheckGet("name1", "valu1");
+  CheckPut("nameB", "valuB");
+  CheckGet("name1", "valu1");
+  CheckNotFound("name2");
+
+  // An 11-byte entry requires two evictions.
+  CheckPut("nameC", "valueC");
+  CheckNotFound("name3");
+  CheckNotFound("name4");
+  for (int i = 5; i < 10; ++i) {
+    CheckGet(keys[i], values[i]);
+  }
+
+  // Re-inserting an identical value freshens it without an insert.
+  size_t inserts = cache_->num_inserts();
+  CheckPut("nameA", "valuA");
+  EXPECT_EQ(inserts, cache_->num_inserts());
+  EXPECT_EQ(static_cast<size_t>(1), cache_->num_identical_reinserts());
+  CheckPut("nameD", "valuD");
+  CheckNotFound("nameB");
+  CheckGet("nameA", "valuA");
+  EXPECT_EQ(static_cast<size_t>(5), cache_->num_evictions());
+}
+
+// As with LRUCacheTest.AdmissionPolicy, a new key only displaces the LRU
+// victim if it has been looked up more often.
+TEST_F(ShardedLRUCacheTest, AdmissionPolicy) {
+  cache_->set_admission_policy(new FrequencyAdmissionPolicy(
+      1000, thread_system_->NewMutex()));
+  GoogleString keys[10], values[10];
+  for (int i = 0; i < 10; ++i) {
+    SStringPrintf(&keys[i], "name%d", i);
+    SStringPrintf(&values[i], "valu%d", i);
+    CheckPut(keys[i], values[i]);
+  }
+  EXPECT_EQ(kMaxSize, cache_->size_bytes());
+  for (int i = 0; i < 10; ++i) {
+    CheckGet(keys[i], values[i]);
+    CheckGet(keys[i], values[i]);
+  }
+
+  // A key that was looked up once does not get to evict name0.
+  CheckNotFound("nameA");
+  CheckPut("nameA", "valuA");
+  CheckNotFound("nameA");
+  CheckGet("name0", "valu0");
+  EXPECT_EQ(static_cast<size_t>(1), cache_->num_admission_rejections());
+  EXPECT_EQ(static_cast<size_t>(0), cache_->num_evictions());
+
+  // One that has been asked for three times displaces the LRU, name1.
+  CheckNotFound("nameB");
+  CheckNotFound("nameB");
+  CheckNotFound("nameB");
+  CheckPut("nameB", "valuB");
+  CheckGet("nameB", "valuB");
+  CheckNotFound("name1");
+  EXPECT_EQ(static_cast<size_t>(1), cache_->num_admission_rejections());
+  EXPECT_EQ(static_cast<size_t>(1), cache_->num_evictions());
+
+  // Replacing the value of an existing key is always allowed.
+  CheckPut("name2", "VALU2");
+  CheckGet("name2", "VALU2");
+  EXPECT_EQ(static_cast<size_t>(1), cache_->num_admission_rejections());
+}
+
+TEST_F(ShardedLRUCacheTest, TooBigToFit) {
+  CheckPut("name", GoogleString(kMaxSize, 'x'));
+  CheckNotFound("name");
+  EXPECT_EQ(static_cast<size_t>(0), cache_->num_elements());
+}
+
+// Exercises table growth and backward-shift deletion with many more keys
+// than the initial table size.
+TEST_F(ShardedLRUCacheTest, ManyKeys) {
+  const int kNumKeys = 1000;
+  ResetCache(1000 * 1000, 4);
+  for (int i = 0; i < kNumKeys; ++i) {
+    CheckPut(StrCat("key", IntegerToString(i)),
+             StrCat("value", IntegerToString(i)));
+  }
+  EXPECT_EQ(static_cast<size_t>(kNumKeys), cache_->num_elements());
+  for (int i = 0; i < kNumKeys; i += 2) {
+    CheckDelete(StrCat("key", IntegerToString(i)));
+  }
+  EXPECT_EQ(static_cast<size_t>(kNumKeys / 2), cache_->num_elements());
+  for (int i = 0; i < kNumKeys; ++i) {
+    GoogleString key = StrCat("key", IntegerToString(i));
+    if ((i % 2) == 0) {
+      CheckNotFound(key.c_str());
+    } else {
+      CheckGet(key, StrCat("value", IntegerToString(i)));
+    }
+  }
+
+  cache_->Clear();
+  cache_->SanityCheck();
+  EXPECT_EQ(static_cast<size_t>(0), cache_->num_elements());
+  EXPECT_EQ(static_cast<size_t>(0), cache_->size_bytes());
+  CheckNotFound("key1");
+}
+
+TEST_F(ShardedLRUCacheTest, SizeSplitAcrossShards) {
+  ResetCache(kMaxSize, 4);
+  EXPECT_EQ(4, cache_->num_shards());
+  EXPECT_EQ(kMaxSize, cache_->max_bytes_in_cache());
+  EXPECT_EQ("ShardedLRUCache(4)", cache_->Name());
+}
+
+TEST_F(ShardedLRUCacheTest, BasicInvalid) {
+  CheckPut("nameA", "valueA");
+  CheckPut("nameB", "valueB");
+  CheckGet("nameA", "valueA");
+  CheckGet("nameB", "valueB");
+  set_invalid_value("valueA");
+  CheckNotFound("nameA");
+  CheckGet("nameB", "valueB");
+}
+
+TEST_F(ShardedLRUCacheTest, MultiGet) {
+  TestMultiGet();
+}
+
+TEST_F(ShardedLRUCacheTest, DoesNotPutOrDeleteWhenUnhealthy) {
+  CheckPut("nameA", "valueA");
+  cache_->set_is_healthy(false);
+  CheckNotFound("nameA");
+  CheckPut("nameB", "valueB");
+  CheckDelete("nameA");
+
+  cache_->set_is_healthy(true);
+  CheckGet("nameA", "valueA");
+  CheckNotFound("nameB");
+}
+
+TEST_F(ShardedLRUCacheTest, SpamCacheWithDeletionsAndEvictions) {
+  ResetCache(kMaxSize, 4);
+  CacheSpammer::RunTests(kNumThreads, kNumIters, kNumInserts,
+                         true /* expecting_evictions */,
+                         true /* do_deletes */, "value", cache_.get(),
+                         thread_system_.get());
+  cache_->SanityCheck();
+}
+
+TEST_F(ShardedLRUCacheTest, SpamCacheNoEvictionsOrDeletions) {
+  // Leave plenty of headroom per shard so that no shard needs to evict even
+  // if the keys hash unevenly.
+  ResetCache(kMaxSize * kNumThreads * kNumInserts, 4);
+  CacheSpammer::RunTests(kNumThreads, kNumIters, kNumInserts,
+                         false /* expecting_evictions */,
+                         false /* do_deletes */, "valu", cache_.get(),
+                         thread_system_.get());
+  cache_->SanityCheck();
+  EXPECT_EQ(static_cast<size_t>(0), cache_->num_evictions());
+}
+
+}  // namespace net_instaweb
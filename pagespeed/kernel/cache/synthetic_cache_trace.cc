@@ -0,0 +1,59 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/synthetic_cache_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/null_mutex.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/util/simple_random.h"
+
+namespace net_instaweb {
+
+void GenerateSyntheticCacheTrace(int length, int num_popular_keys,
+                                 int one_shot_percent, double zipf_exponent,
+                                 StringVector* trace) {
+  // Cumulative distribution of popular-key ranks.
+  std::vector<double> cdf(num_popular_keys);
+  double total = 0;
+  for (int i = 0; i < num_popular_keys; ++i) {
+    total += 1.0 / pow(i + 1, zipf_exponent);
+    cdf[i] = total;
+  }
+
+  SimpleRandom random(new NullMutex);
+  for (int i = 0; i < length; ++i) {
+    uint32 r = random.Next();
+    if (static_cast<int>(r % 100) < one_shot_percent) {
+      trace->push_back(StrCat("http://example.com/page.html?unique=",
+                              IntegerToString(i)));
+    } else {
+      double target = total * random.Next() / 4294967296.0;
+      int rank = std::lower_bound(cdf.begin(), cdf.end(), target) -
+          cdf.begin();
+      trace->push_back(StrCat("http://example.com/rewritten/",
+                              IntegerToString(rank),
+                              ".pagespeed.ce.0123456789.css"));
+    }
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Generates the synthetic trace of cache keys replayed by
+// cache_admission_speed_test and the admission policy's unit tests.
+
+#ifndef PAGESPEED_KERNEL_CACHE_SYNTHETIC_CACHE_TRACE_H_
+#define PAGESPEED_KERNEL_CACHE_SYNTHETIC_CACHE_TRACE_H_
+
+#include "pagespeed/kernel/base/string_util.h"
+
+namespace net_instaweb {
+
+// Appends length keys to *trace: a Zipf-distributed set of num_popular_keys
+// rewritten resource URLs, interleaved with page URLs that are only ever
+// requested once, as with unique HTML URLs or beacons.  one_shot_percent of
+// the keys are one-shot.  The trace only depends on the arguments.
+void GenerateSyntheticCacheTrace(int length, int num_popular_keys,
+                                 int one_shot_percent, double zipf_exponent,
+                                 StringVector* trace);
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_SYNTHETIC_CACHE_TRACE_H_
@@ -0,0 +1,486 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/cache/tiered_metadata_cache.h"
+
+#include <cstddef>
+#include <utility>
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_interface.h"
+
+namespace {
+
+const char kL1Hits[] = "tiered_metadata_cache_l1_hits";
+const char kL2Hits[] = "tiered_metadata_cache_l2_hits";
+const char kNegativeHits[] = "tiered_metadata_cache_negative_hits";
+const char kMisses[] = "tiered_metadata_cache_misses";
+const char kPromotions[] = "tiered_metadata_cache_promotions";
+const char kPrefetchedKeys[] = "tiered_metadata_cache_prefetched_keys";
+
+// Sizes the frequency sketch used to decide on promotions.  Metadata cache
+// L1s hold tens of thousands of entries at most.
+const int kFrequencySketchEntries = 32 * 1024;
+
+}  // namespace
+
+namespace net_instaweb {
+
+const size_t TieredMetadataCache::kUnlimited = static_cast<size_t>(-1);
+const int64 TieredMetadataCache::kDefaultNegativeTtlMs = 10 * Timer::kSecondMs;
+const int TieredMetadataCache::kDefaultPromotionThreshold = 2;
+const size_t TieredMetadataCache::kDefaultMaxNegativeBytes = 1024 * 1024;
+const size_t TieredMetadataCache::kMaxPrefetchedBytes = 4 * 1024 * 1024;
+const int64 TieredMetadataCache::kPrefetchedValueLifetimeMs =
+    5 * Timer::kSecondMs;
+
+// Wraps the caller's callback through the L1 lookup, then the L2 lookup or
+// the prefetch answering in its stead, and the bookkeeping done after each.
+class TieredMetadataCache::TieredCallback : public CacheInterface::Callback {
+ public:
+  enum Tier { kL1, kL2, kPrefetch };
+
+  TieredCallback(TieredMetadataCache* cache, const GoogleString& key,
+                 uint64 key_hash, CacheInterface::Callback* callback)
+      : cache_(cache),
+        key_(key),
+        key_hash_(key_hash),
+        callback_(callback),
+        tier_(kL1) {
+  }
+  virtual ~TieredCallback() {}
+
+  void set_tier(Tier tier) { tier_ = tier; }
+
+  virtual bool ValidateCandidate(const GoogleString& key,
+                                 CacheInterface::KeyState state) {
+    callback_->set_value(value());
+    return callback_->DelegatedValidateCandidate(key, state);
+  }
+
+  virtual void Done(CacheInterface::KeyState state) {
+    if (tier_ == kL1) {
+      SharedString prefetched;
+      if (state == CacheInterface::kAvailable) {
+        cache_->l1_hits_->Add(1);
+      } else if (cache_->TakePrefetched(key_, &prefetched)) {
+        tier_ = kPrefetch;
+        set_value(prefetched);
+        cache_->ValidateAndReportResult(key_, CacheInterface::kAvailable,
+                                        this);
+        return;
+      } else if (cache_->IsKnownMissing(key_)) {
+        cache_->negative_hits_->Add(1);
+        state = CacheInterface::kNotFound;
+      } else if (cache_->WaitForPrefetch(key_, this)) {
+        return;
+      } else {
+        cache_->GetFromL2(key_, this);
+        return;
+      }
+    } else {
+      // A Put or Delete during the lookup makes what it found out of date.
+      // Prefetches have already checked for that themselves.
+      bool current = (tier_ != kL2) || cache_->L2GetDone(key_);
+      if (state == CacheInterface::kAvailable) {
+        cache_->l2_hits_->Add(1);
+        if (current && cache_->ShouldPromote(key_hash_)) {
+          cache_->promotions_->Add(1);
+          cache_->PutInL1(key_, value());
+        }
+      } else {
+        cache_->misses_->Add(1);
+        // Timeouts and errors from L2 are not remembered as misses, and
+        // prefetches remember their own.
+        if (current && (tier_ == kL2) &&
+            (state == CacheInterface::kNotFound)) {
+          cache_->RememberMissing(key_);
+        }
+      }
+    }
+    callback_->DelegatedDone(state);
+    delete this;
+  }
+
+ private:
+  TieredMetadataCache* cache_;
+  GoogleString key_;
+  uint64 key_hash_;
+  CacheInterface::Callback* callback_;
+  Tier tier_;
+
+  DISALLOW_COPY_AND_ASSIGN(TieredCallback);
+};
+
+// Collects the keys of a Prefetch that miss in L1, and once all the L1
+// lookups are done, looks them up in L2.
+class TieredMetadataCache::PrefetchBatch {
+ public:
+  PrefetchBatch(TieredMetadataCache* cache, int num_keys)
+      : cache_(cache),
+        mutex_(cache->mutex_.get()),
+        remaining_(num_keys) {
+  }
+
+  void L1Done(const GoogleString& key, CacheInterface::KeyState state) {
+    StringVector misses;
+    {
+      ScopedMutex lock(mutex_);
+      if (state != CacheInterface::kAvailable) {
+        misses_.push_back(key);
+      }
+      --remaining_;
+      if (remaining_ != 0) {
+        return;
+      }
+      misses.swap(misses_);
+    }
+    TieredMetadataCache* cache = cache_;
+    delete this;
+    if (!misses.empty()) {
+      cache->PrefetchFromL2(misses);
+    }
+  }
+
+ private:
+  TieredMetadataCache* cache_;
+  AbstractMutex* mutex_;
+  StringVector misses_;
+  int remaining_;
+
+  DISALLOW_COPY_AND_ASSIGN(PrefetchBatch);
+};
+
+class TieredMetadataCache::PrefetchL1Callback
+    : public CacheInterface::Callback {
+ public:
+  PrefetchL1Callback(PrefetchBatch* batch, const GoogleString& key)
+      : batch_(batch), key_(key) {
+  }
+  virtual ~PrefetchL1Callback() {}
+
+  virtual void Done(CacheInterface::KeyState state) {
+    batch_->L1Done(key_, state);
+    delete this;
+  }
+
+ private:
+  PrefetchBatch* batch_;
+  GoogleString key_;
+
+  DISALLOW_COPY_AND_ASSIGN(PrefetchL1Callback);
+};
+
+class TieredMetadataCache::PrefetchL2Callback
+    : public CacheInterface::Callback {
+ public:
+  PrefetchL2Callback(TieredMetadataCache* cache, const GoogleString& key)
+      : cache_(cache), key_(key) {
+  }
+  virtual ~PrefetchL2Callback() {}
+
+  virtual void Done(CacheInterface::KeyState state) {
+    cache_->PrefetchDone(key_, state, value());
+    delete this;
+  }
+
+ private:
+  TieredMetadataCache* cache_;
+  GoogleString key_;
+
+  DISALLOW_COPY_AND_ASSIGN(PrefetchL2Callback);
+};
+
+TieredMetadataCache::TieredMetadataCache(CacheInterface* l1,
+                                         CacheInterface* l2, Timer* timer,
+                                         ThreadSystem* thread_system,
+                                         Statistics* statistics)
+    : l1_(l1),
+      l2_(l2),
+      timer_(timer),
+      l1_size_limit_(kUnlimited),
+      negative_ttl_ms_(kDefaultNegativeTtlMs),
+      promotion_threshold_(kDefaultPromotionThreshold),
+      frequency_(kFrequencySketchEntries, thread_system->NewMutex()),
+      mutex_(thread_system->NewMutex()),
+      negative_entries_(kDefaultMaxNegativeBytes, &negative_helper_),
+      prefetched_values_(kMaxPrefetchedBytes, &prefetched_helper_),
+      l1_hits_(statistics->GetVariable(kL1Hits)),
+      l2_hits_(statistics->GetVariable(kL2Hits)),
+      negative_hits_(statistics->GetVariable(kNegativeHits)),
+      misses_(statistics->GetVariable(kMisses)),
+      promotions_(statistics->GetVariable(kPromotions)),
+      prefetched_keys_(statistics->GetVariable(kPrefetchedKeys)) {
+}
+
+TieredMetadataCache::~TieredMetadataCache() {
+}
+
+void TieredMetadataCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kL1Hits);
+  statistics->AddVariable(kL2Hits);
+  statistics->AddVariable(kNegativeHits);
+  statistics->AddVariable(kMisses);
+  statistics->AddVariable(kPromotions);
+  statistics->AddVariable(kPrefetchedKeys);
+}
+
+void TieredMetadataCache::PrintStats(Statistics* statistics,
+                                     GoogleString* out) {
+  int64 l1_hits = statistics->GetVariable(kL1Hits)->Get();
+  int64 l2_hits = statistics->GetVariable(kL2Hits)->Get();
+  int64 negative_hits = statistics->GetVariable(kNegativeHits)->Get();
+  int64 misses = statistics->GetVariable(kMisses)->Get();
+  int64 lookups = l1_hits + l2_hits + negative_hits + misses;
+  StrAppend(out, "\nTiered metadata cache statistics:\n");
+  const struct {
+    const char* label;
+    int64 count;
+  } kLookupCounts[] = {
+    {"l1_hits:       ", l1_hits},
+    {"l2_hits:       ", l2_hits},
+    {"negative_hits: ", negative_hits},
+    {"misses:        ", misses},
+  };
+  for (int i = 0, n = arraysize(kLookupCounts); i < n; ++i) {
+    StrAppend(out, kLookupCounts[i].label,
+              Integer64ToString(kLookupCounts[i].count));
+    if (lookups > 0) {
+      StrAppend(out, " (", Integer64ToString(
+          (100 * kLookupCounts[i].count) / lookups), "%)");
+    }
+    StrAppend(out, "\n");
+  }
+  StrAppend(out, "promotions:    ", Integer64ToString(
+      statistics->GetVariable(kPromotions)->Get()), "\n");
+  StrAppend(out, "prefetched:    ", Integer64ToString(
+      statistics->GetVariable(kPrefetchedKeys)->Get()), "\n");
+}
+
+GoogleString TieredMetadataCache::FormatName(StringPiece l1, StringPiece l2) {
+  return StrCat("TieredMetadataCache(l1=", l1, ",l2=", l2, ")");
+}
+
+void TieredMetadataCache::set_max_negative_bytes(size_t x) {
+  ScopedMutex lock(mutex_.get());
+  negative_entries_.set_max_bytes_in_cache(x);
+}
+
+void TieredMetadataCache::Get(const GoogleString& key, Callback* callback) {
+  uint64 key_hash = FrequencyAdmissionPolicy::HashKey(key);
+  frequency_.RecordAccess(key_hash);
+  l1_->Get(key, new TieredCallback(this, key, key_hash, callback));
+}
+
+void TieredMetadataCache::Put(const GoogleString& key,
+                              const SharedString& value) {
+  Forget(key);
+  PutInL1(key, value);
+  l2_->Put(key, value);
+}
+
+void TieredMetadataCache::Delete(const GoogleString& key) {
+  Forget(key);
+  l1_->Delete(key);
+  l2_->Delete(key);
+}
+
+void TieredMetadataCache::PutInL1(const GoogleString& key,
+                                  const SharedString& value) {
+  if ((l1_size_limit_ == kUnlimited) ||
+      (key.size() + value.size() < l1_size_limit_)) {
+    l1_->Put(key, value);
+  }
+}
+
+bool TieredMetadataCache::ShouldPromote(uint64 key_hash) {
+  return ((promotion_threshold_ <= 1) ||
+          (frequency_.EstimateFrequency(key_hash) >= promotion_threshold_));
+}
+
+bool TieredMetadataCache::IsKnownMissing(const GoogleString& key) {
+  if (negative_ttl_ms_ <= 0) {
+    return false;
+  }
+  ScopedMutex lock(mutex_.get());
+  return IsKnownMissingLockHeld(key);
+}
+
+bool TieredMetadataCache::IsKnownMissingLockHeld(const GoogleString& key) {
+  int64* expiration_ms = negative_entries_.GetFreshen(key);
+  if (expiration_ms == NULL) {
+    return false;
+  }
+  if (*expiration_ms <= timer_->NowMs()) {
+    negative_entries_.Delete(key);
+    return false;
+  }
+  return true;
+}
+
+void TieredMetadataCache::RememberMissing(const GoogleString& key) {
+  if (negative_ttl_ms_ > 0) {
+    int64 expiration_ms = timer_->NowMs() + negative_ttl_ms_;
+    ScopedMutex lock(mutex_.get());
+    negative_entries_.Put(key, expiration_ms);
+  }
+}
+
+void TieredMetadataCache::Forget(const GoogleString& key) {
+  ScopedMutex lock(mutex_.get());
+  negative_entries_.Delete(key);
+  prefetched_values_.Delete(key);
+  PendingMap::iterator p = pending_prefetches_.find(key);
+  if (p != pending_prefetches_.end()) {
+    p->second.stale = true;
+  }
+  PendingLookupMap::iterator q = pending_lookups_.find(key);
+  if (q != pending_lookups_.end()) {
+    q->second.written = true;
+  }
+}
+
+void TieredMetadataCache::GetFromL2(const GoogleString& key,
+                                    TieredCallback* callback) {
+  callback->set_tier(TieredCallback::kL2);
+  {
+    ScopedMutex lock(mutex_.get());
+    ++pending_lookups_[key].in_flight;
+  }
+  l2_->Get(key, callback);
+}
+
+bool TieredMetadataCache::L2GetDone(const GoogleString& key) {
+  ScopedMutex lock(mutex_.get());
+  PendingLookupMap::iterator p = pending_lookups_.find(key);
+  DCHECK(p != pending_lookups_.end());
+  if (p == pending_lookups_.end()) {
+    return false;
+  }
+  bool current = !p->second.written;
+  if (--p->second.in_flight == 0) {
+    pending_lookups_.erase(p);
+  }
+  return current;
+}
+
+bool TieredMetadataCache::TakePrefetched(const GoogleString& key,
+                                         SharedString* value) {
+  ScopedMutex lock(mutex_.get());
+  PrefetchedValue* prefetched = prefetched_values_.GetNoFreshen(key);
+  if (prefetched == NULL) {
+    return false;
+  }
+  bool valid = (prefetched->expiration_ms > timer_->NowMs());
+  if (valid) {
+    *value = prefetched->value;
+  }
+  prefetched_values_.Delete(key);
+  return valid;
+}
+
+bool TieredMetadataCache::WaitForPrefetch(const GoogleString& key,
+                                          TieredCallback* callback) {
+  ScopedMutex lock(mutex_.get());
+  PendingMap::iterator p = pending_prefetches_.find(key);
+  if ((p == pending_prefetches_.end()) || p->second.stale) {
+    return false;
+  }
+  callback->set_tier(TieredCallback::kPrefetch);
+  p->second.waiters.push_back(callback);
+  return true;
+}
+
+void TieredMetadataCache::Prefetch(const StringVector& keys) {
+  if (keys.empty()) {
+    return;
+  }
+  PrefetchBatch* batch = new PrefetchBatch(this, keys.size());
+  MultiGetRequest* request = new MultiGetRequest;
+  for (int i = 0, n = keys.size(); i < n; ++i) {
+    request->push_back(
+        KeyCallback(keys[i], new PrefetchL1Callback(batch, keys[i])));
+  }
+  l1_->MultiGet(request);
+}
+
+void TieredMetadataCache::PrefetchFromL2(const StringVector& keys) {
+  MultiGetRequest* request = new MultiGetRequest;
+  {
+    ScopedMutex lock(mutex_.get());
+    for (int i = 0, n = keys.size(); i < n; ++i) {
+      const GoogleString& key = keys[i];
+      if (((negative_ttl_ms_ > 0) && IsKnownMissingLockHeld(key)) ||
+          (prefetched_values_.GetNoFreshen(key) != NULL) ||
+          !pending_prefetches_.insert(
+              PendingMap::value_type(key, PendingPrefetch())).second) {
+        continue;
+      }
+      request->push_back(KeyCallback(key, new PrefetchL2Callback(this, key)));
+    }
+  }
+  if (request->empty()) {
+    delete request;
+    return;
+  }
+  prefetched_keys_->Add(request->size());
+  l2_->MultiGet(request);
+}
+
+void TieredMetadataCache::PrefetchDone(const GoogleString& key,
+                                       CacheInterface::KeyState state,
+                                       const SharedString& value) {
+  CallbackVector waiters;
+  bool stale = false;
+  {
+    ScopedMutex lock(mutex_.get());
+    PendingMap::iterator p = pending_prefetches_.find(key);
+    DCHECK(p != pending_prefetches_.end());
+    if (p != pending_prefetches_.end()) {
+      waiters.swap(p->second.waiters);
+      stale = p->second.stale;
+      pending_prefetches_.erase(p);
+    }
+    if (stale) {
+      // The key was written since the lookup, so what it found may be out of
+      // date, and must not shadow the new value.
+    } else if ((state == kNotFound) && (negative_ttl_ms_ > 0)) {
+      negative_entries_.Put(key, timer_->NowMs() + negative_ttl_ms_);
+    } else if ((state == kAvailable) && waiters.empty()) {
+      PrefetchedValue prefetched;
+      prefetched.value = value;
+      prefetched.expiration_ms = timer_->NowMs() + kPrefetchedValueLifetimeMs;
+      prefetched_values_.Put(key, prefetched);
+    }
+  }
+  for (int i = 0, n = waiters.size(); i < n; ++i) {
+    if (stale) {
+      // Look again rather than hand over, and maybe promote, an old value.
+      GetFromL2(key, waiters[i]);
+    } else {
+      waiters[i]->set_value(value);
+      ValidateAndReportResult(key, state, waiters[i]);
+    }
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_CACHE_TIERED_METADATA_CACHE_H_
+#define PAGESPEED_KERNEL_CACHE_TIERED_METADATA_CACHE_H_
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+#include "pagespeed/kernel/cache/lru_cache_base.h"
+
+namespace net_instaweb {
+
+class Statistics;
+class ThreadSystem;
+class Timer;
+class Variable;
+
+// Composes a fast L1 cache (per-process LRU or per-machine shared memory)
+// with a slower, shared L2 cache (file cache or memcached/redis) for the
+// metadata cache.  Like WriteThroughCache, Puts go to both levels and Gets
+// try L1 first.  In addition:
+//
+// - L2 misses are remembered, in this process, for negative_ttl_ms, so
+//   slots that are never going to be rewritten don't cost an L2 lookup on
+//   every page view.  Any Put or Delete of the key forgets the miss, and
+//   whatever a Get or prefetch of the key already in flight finds.
+// - An L2 hit is only copied into L1 once the key has been looked up
+//   promotion_threshold times recently, so keys read once don't displace
+//   hot ones in the small L1.
+// - Prefetch looks up a batch of keys with one L2 MultiGet, so the lookups
+//   of a page's rewrites can be overlapped.  A Get for a key that is being
+//   prefetched waits for the prefetch rather than going to L2 itself, and
+//   the values found are held briefly for the Gets that follow.  These are
+//   counted as L2 hits, and promoted as such.
+//
+// Hits and misses are counted per tier in statistics; see InitStats and
+// PrintStats.
+class TieredMetadataCache : public CacheInterface {
+ public:
+  static const size_t kUnlimited;
+  static const int64 kDefaultNegativeTtlMs;
+  static const int kDefaultPromotionThreshold;
+  static const size_t kDefaultMaxNegativeBytes;
+  static const size_t kMaxPrefetchedBytes;
+  static const int64 kPrefetchedValueLifetimeMs;
+
+  // Does not take ownership of the caches, timer or statistics.
+  TieredMetadataCache(CacheInterface* l1, CacheInterface* l2, Timer* timer,
+                      ThreadSystem* thread_system, Statistics* statistics);
+  virtual ~TieredMetadataCache();
+
+  static void InitStats(Statistics* statistics);
+
+  // Appends a summary of the per-tier statistics to *out, for the caches
+  // page of the admin site.
+  static void PrintStats(Statistics* statistics, GoogleString* out);
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, const SharedString& value);
+  virtual void Delete(const GoogleString& key);
+
+  // Looks up keys in L1, and all the ones missing there in a single L2
+  // MultiGet.  The values found in L2 are held for kPrefetchedValueLifetimeMs
+  // to answer the next Get of each.  Returns without waiting for the
+  // lookups.
+  void Prefetch(const StringVector& keys);
+
+  // As with WriteThroughCache, key and value sizes both count toward the
+  // limit on what is put in L1.
+  void set_l1_size_limit(size_t limit) { l1_size_limit_ = limit; }
+  size_t l1_size_limit() const { return l1_size_limit_; }
+
+  // 0 disables negative caching.
+  void set_negative_ttl_ms(int64 x) { negative_ttl_ms_ = x; }
+  int64 negative_ttl_ms() const { return negative_ttl_ms_; }
+
+  // 1 copies every L2 hit into L1, as WriteThroughCache does.
+  void set_promotion_threshold(int x) { promotion_threshold_ = x; }
+  int promotion_threshold() const { return promotion_threshold_; }
+
+  // Bounds the memory used to remember misses.
+  void set_max_negative_bytes(size_t x) LOCKS_EXCLUDED(mutex_);
+
+  CacheInterface* l1() { return l1_; }
+  CacheInterface* l2() { return l2_; }
+
+  virtual bool IsBlocking() const {
+    return l1_->IsBlocking() && l2_->IsBlocking();
+  }
+
+  virtual bool IsHealthy() const {
+    return l1_->IsHealthy() && l2_->IsHealthy();
+  }
+
+  virtual void ShutDown() {
+    l1_->ShutDown();
+    l2_->ShutDown();
+  }
+
+  virtual GoogleString Name() const {
+    return FormatName(l1_->Name(), l2_->Name());
+  }
+  static GoogleString FormatName(StringPiece l1, StringPiece l2);
+
+ private:
+  class TieredCallback;
+  class PrefetchBatch;
+  class PrefetchL1Callback;
+  class PrefetchL2Callback;
+  friend class TieredCallback;
+  friend class PrefetchBatch;
+  friend class PrefetchL2Callback;
+
+  class NegativeEntryHelper {
+   public:
+    size_t size(int64 expiration_ms) const { return sizeof(expiration_ms); }
+    bool Equal(int64 a, int64 b) const { return a == b; }
+    void EvictNotify(int64 expiration_ms) {}
+    bool ShouldReplace(int64 old_ms, int64 new_ms) const { return true; }
+  };
+  typedef LRUCacheBase<int64, NegativeEntryHelper> NegativeLru;
+
+  struct PrefetchedValue {
+    SharedString value;
+    int64 expiration_ms;
+  };
+  class PrefetchedValueHelper {
+   public:
+    size_t size(const PrefetchedValue& v) const { return v.value.size(); }
+    bool Equal(const PrefetchedValue& a, const PrefetchedValue& b) const {
+      return a.value.Value() == b.value.Value();
+    }
+    void EvictNotify(const PrefetchedValue& v) {}
+    bool ShouldReplace(const PrefetchedValue& old_value,
+                       const PrefetchedValue& new_value) const {
+      return true;
+    }
+  };
+  typedef LRUCacheBase<PrefetchedValue, PrefetchedValueHelper> PrefetchedLru;
+  typedef std::vector<TieredCallback*> CallbackVector;
+  struct PendingPrefetch {
+    PendingPrefetch() : stale(false) {}
+
+    CallbackVector waiters;
+    // Set when the key is Put or Deleted while the prefetch is in flight,
+    // so that what it finds is neither remembered nor handed to waiters.
+    bool stale;
+  };
+  typedef std::map<GoogleString, PendingPrefetch> PendingMap;
+  struct PendingLookup {
+    PendingLookup() : in_flight(0), written(false) {}
+
+    int in_flight;
+    // Set when the key is Put or Deleted while any L2 Get of it is in
+    // flight; cleared once they have all finished.
+    bool written;
+  };
+  typedef std::map<GoogleString, PendingLookup> PendingLookupMap;
+
+  void PutInL1(const GoogleString& key, const SharedString& value);
+
+  // Returns true if the key missed in L2 less than negative_ttl_ms ago.
+  bool IsKnownMissing(const GoogleString& key) LOCKS_EXCLUDED(mutex_);
+  void RememberMissing(const GoogleString& key) LOCKS_EXCLUDED(mutex_);
+  bool IsKnownMissingLockHeld(const GoogleString& key)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Forgets any miss or prefetched value remembered for key, and marks any
+  // Get or prefetch of it in flight as stale.
+  void Forget(const GoogleString& key) LOCKS_EXCLUDED(mutex_);
+
+  // Called once L1 has missed.  Returns true if the key's value was
+  // prefetched, in which case it is removed and stored in *value.
+  bool TakePrefetched(const GoogleString& key, SharedString* value)
+      LOCKS_EXCLUDED(mutex_);
+
+  // Returns true if the callback was queued behind a prefetch of the key,
+  // which will finish it.  Stale prefetches aren't waited for.
+  bool WaitForPrefetch(const GoogleString& key, TieredCallback* callback)
+      LOCKS_EXCLUDED(mutex_);
+
+  // Looks key up in L2 on behalf of callback, noting the lookup is in
+  // flight.
+  void GetFromL2(const GoogleString& key, TieredCallback* callback)
+      LOCKS_EXCLUDED(mutex_);
+
+  // Called when an L2 Get started by GetFromL2 finishes.  Returns false if
+  // the key was written while it was in flight, in which case what it found
+  // must be neither remembered as a miss nor promoted.
+  bool L2GetDone(const GoogleString& key) LOCKS_EXCLUDED(mutex_);
+
+  // Issues one L2 MultiGet for those keys that aren't known to be missing
+  // or already being prefetched.
+  void PrefetchFromL2(const StringVector& keys) LOCKS_EXCLUDED(mutex_);
+  void PrefetchDone(const GoogleString& key, CacheInterface::KeyState state,
+                    const SharedString& value) LOCKS_EXCLUDED(mutex_);
+
+  // Returns true if the key has been looked up often enough recently to be
+  // copied into L1.
+  bool ShouldPromote(uint64 key_hash);
+
+  CacheInterface* l1_;
+  CacheInterface* l2_;
+  Timer* timer_;
+  size_t l1_size_limit_;
+  int64 negative_ttl_ms_;
+  int promotion_threshold_;
+  FrequencyAdmissionPolicy frequency_;
+
+  scoped_ptr<AbstractMutex> mutex_;
+  NegativeEntryHelper negative_helper_;
+  NegativeLru negative_entries_ GUARDED_BY(mutex_);
+  PendingMap pending_prefetches_ GUARDED_BY(mutex_);
+  PendingLookupMap pending_lookups_ GUARDED_BY(mutex_);
+  PrefetchedValueHelper prefetched_helper_;
+  PrefetchedLru prefetched_values_ GUARDED_BY(mutex_);
+
+  Variable* l1_hits_;
+  Variable* l2_hits_;
+  Variable* negative_hits_;
+  Variable* misses_;
+  Variable* promotions_;
+  Variable* prefetched_keys_;
+
+  DISALLOW_COPY_AND_ASSIGN(TieredMetadataCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_CACHE_TIERED_METADATA_CACHE_H_
@@ -0,0 +1,332 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the tiered metadata cache.
+
+#include "pagespeed/kernel/cache/tiered_metadata_cache.h"
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_test_base.h"
+#include "pagespeed/kernel/cache/delay_cache.h"
+#include "pagespeed/kernel/cache/lru_cache.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+
+namespace net_instaweb {
+
+class TieredMetadataCacheTest : public CacheTestBase {
+ protected:
+  TieredMetadataCacheTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        timer_(thread_system_->NewMutex(), MockTimer::kApr_5_2010_ms),
+        stats_(thread_system_.get()),
+        l1_cache_(1000),
+        l2_cache_(1000),
+        delay_cache_(&l2_cache_, thread_system_.get()) {
+    TieredMetadataCache::InitStats(&stats_);
+    tiered_cache_.reset(new TieredMetadataCache(
+        &l1_cache_, &delay_cache_, &timer_, thread_system_.get(), &stats_));
+  }
+
+  virtual CacheInterface* Cache() { return tiered_cache_.get(); }
+  virtual void PostOpCleanup() {
+    l1_cache_.SanityCheck();
+    l2_cache_.SanityCheck();
+  }
+
+  int64 Stat(const char* name) {
+    return stats_.GetVariable(StrCat("tiered_metadata_cache_", name))->Get();
+  }
+
+  int L2Lookups() {
+    return l2_cache_.num_hits() + l2_cache_.num_misses();
+  }
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  MockTimer timer_;
+  SimpleStats stats_;
+  LRUCache l1_cache_;
+  LRUCache l2_cache_;
+  DelayCache delay_cache_;
+  scoped_ptr<TieredMetadataCache> tiered_cache_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(TieredMetadataCacheTest);
+};
+
+TEST_F(TieredMetadataCacheTest, PutGetDelete) {
+  CheckPut("Name", "Value");
+  CheckGet(&l1_cache_, "Name", "Value");
+  CheckGet(&l2_cache_, "Name", "Value");
+  CheckGet("Name", "Value");
+  EXPECT_EQ(1, Stat("l1_hits"));
+  EXPECT_EQ(0, Stat("l2_hits"));
+
+  CheckDelete("Name");
+  CheckNotFound(&l1_cache_, "Name");
+  CheckNotFound(&l2_cache_, "Name");
+  CheckNotFound(Cache(), "Name");
+  EXPECT_EQ(1, Stat("misses"));
+}
+
+TEST_F(TieredMetadataCacheTest, SizeLimit) {
+  tiered_cache_->set_l1_size_limit(10);
+  CheckPut("Name", "Value");
+  CheckPut("Name2", "TooBig");
+  CheckGet(&l1_cache_, "Name", "Value");
+  CheckNotFound(&l1_cache_, "Name2");
+  CheckGet("Name2", "TooBig");
+  CheckGet("Name2", "TooBig");
+  CheckNotFound(&l1_cache_, "Name2");
+}
+
+TEST_F(TieredMetadataCacheTest, PromoteOnSecondLookup) {
+  CheckPut(&l2_cache_, "Name", "Value");
+
+  // The first lookup is served from L2 but leaves L1 alone.
+  CheckGet("Name", "Value");
+  CheckNotFound(&l1_cache_, "Name");
+  EXPECT_EQ(1, Stat("l2_hits"));
+  EXPECT_EQ(0, Stat("promotions"));
+
+  // The second copies the value into L1, and the third is served from it.
+  CheckGet("Name", "Value");
+  CheckGet(&l1_cache_, "Name", "Value");
+  EXPECT_EQ(2, Stat("l2_hits"));
+  EXPECT_EQ(1, Stat("promotions"));
+  CheckGet("Name", "Value");
+  EXPECT_EQ(1, Stat("l1_hits"));
+}
+
+TEST_F(TieredMetadataCacheTest, PromoteEveryHitWithThresholdOne) {
+  tiered_cache_->set_promotion_threshold(1);
+  CheckPut(&l2_cache_, "Name", "Value");
+  CheckGet("Name", "Value");
+  CheckGet(&l1_cache_, "Name", "Value");
+  EXPECT_EQ(1, Stat("promotions"));
+}
+
+TEST_F(TieredMetadataCacheTest, FindShadowedValid) {
+  tiered_cache_->set_promotion_threshold(1);
+  CheckPut(&l1_cache_, "Name", "invalid");
+  CheckPut(&l2_cache_, "Name", "valid");
+  set_invalid_value("invalid");
+  CheckGet("Name", "valid");
+  CheckGet(&l1_cache_, "Name", "valid");
+}
+
+TEST_F(TieredMetadataCacheTest, NegativeCaching) {
+  CheckNotFound(Cache(), "Name");
+  EXPECT_EQ(1, L2Lookups());
+  EXPECT_EQ(1, Stat("misses"));
+
+  // Within the negative TTL, the miss is answered without asking L2, even
+  // if another server has since written the value there.
+  CheckPut(&l2_cache_, "Name", "Value");
+  CheckNotFound(Cache(), "Name");
+  EXPECT_EQ(1, L2Lookups());
+  EXPECT_EQ(1, Stat("negative_hits"));
+
+  // Once it expires, L2 is asked again.
+  timer_.AdvanceMs(TieredMetadataCache::kDefaultNegativeTtlMs);
+  CheckGet("Name", "Value");
+  EXPECT_EQ(2, L2Lookups());
+  EXPECT_EQ(1, Stat("l2_hits"));
+}
+
+TEST_F(TieredMetadataCacheTest, PutForgetsMiss) {
+  CheckNotFound(Cache(), "Name");
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  EXPECT_EQ(0, Stat("negative_hits"));
+}
+
+TEST_F(TieredMetadataCacheTest, NegativeCachingDisabled) {
+  tiered_cache_->set_negative_ttl_ms(0);
+  CheckNotFound(Cache(), "Name");
+  CheckNotFound(Cache(), "Name");
+  EXPECT_EQ(2, L2Lookups());
+  EXPECT_EQ(0, Stat("negative_hits"));
+  EXPECT_EQ(2, Stat("misses"));
+}
+
+TEST_F(TieredMetadataCacheTest, Prefetch) {
+  CheckPut(&l1_cache_, "InL1", "Value1");
+  CheckPut(&l2_cache_, "InL2", "Value2");
+  StringVector keys;
+  keys.push_back("InL1");
+  keys.push_back("InL2");
+  keys.push_back("Missing");
+  tiered_cache_->Prefetch(keys);
+
+  // Only the keys missing from L1 are looked up in L2.
+  EXPECT_EQ(2, L2Lookups());
+  EXPECT_EQ(2, Stat("prefetched_keys"));
+
+  // The Gets that follow don't go to L2.  The prefetched value counts as an
+  // L2 hit, and as it's the first lookup of the key, isn't copied into L1.
+  CheckGet("InL1", "Value1");
+  CheckGet("InL2", "Value2");
+  CheckNotFound(Cache(), "Missing");
+  EXPECT_EQ(2, L2Lookups());
+  EXPECT_EQ(1, Stat("l1_hits"));
+  EXPECT_EQ(1, Stat("l2_hits"));
+  EXPECT_EQ(1, Stat("negative_hits"));
+  EXPECT_EQ(0, Stat("promotions"));
+  CheckNotFound(&l1_cache_, "InL2");
+
+  // Prefetching again only looks up "InL2", and this time it's promoted.
+  tiered_cache_->Prefetch(keys);
+  EXPECT_EQ(3, L2Lookups());
+  EXPECT_EQ(3, Stat("prefetched_keys"));
+  CheckGet("InL2", "Value2");
+  EXPECT_EQ(1, Stat("promotions"));
+  CheckGet(&l1_cache_, "InL2", "Value2");
+}
+
+TEST_F(TieredMetadataCacheTest, PrefetchedValueExpires) {
+  CheckPut(&l2_cache_, "Name", "Value");
+  StringVector keys;
+  keys.push_back("Name");
+  tiered_cache_->Prefetch(keys);
+  timer_.AdvanceMs(TieredMetadataCache::kPrefetchedValueLifetimeMs);
+  CheckGet("Name", "Value");
+  EXPECT_EQ(2, L2Lookups());
+}
+
+TEST_F(TieredMetadataCacheTest, PutReplacesPrefetchedValue) {
+  CheckPut(&l2_cache_, "Name", "Value");
+  StringVector keys;
+  keys.push_back("Name");
+  tiered_cache_->Prefetch(keys);
+  CheckPut("Name", "NewValue");
+  CheckGet("Name", "NewValue");
+}
+
+TEST_F(TieredMetadataCacheTest, GetWaitsForPrefetch) {
+  CheckPut(&l2_cache_, "Name", "Value");
+  CheckPut(&l2_cache_, "Other", "OtherValue");
+  delay_cache_.DelayKey("Name");
+  delay_cache_.DelayKey("Other");
+  StringVector keys;
+  keys.push_back("Name");
+  keys.push_back("Other");
+  keys.push_back("Missing");
+  tiered_cache_->Prefetch(keys);
+
+  // The Gets are queued behind the prefetch rather than going to L2.  The
+  // second one rejects the value it is given, which is reported as a miss.
+  Callback* name_callback = InitiateGet("Name");
+  set_invalid_value("OtherValue");
+  Callback* other_callback = InitiateGet("Other");
+  EXPECT_FALSE(name_callback->called());
+  EXPECT_FALSE(other_callback->called());
+
+  delay_cache_.ReleaseKey("Name");
+  WaitAndCheck(name_callback, "Value");
+  delay_cache_.ReleaseKey("Other");
+  WaitAndCheckNotFound(other_callback);
+  EXPECT_EQ(3, L2Lookups());
+  EXPECT_EQ(1, Stat("l2_hits"));
+  EXPECT_EQ(1, Stat("misses"));
+  EXPECT_EQ(0, Stat("promotions"));
+}
+
+TEST_F(TieredMetadataCacheTest, PutDuringPrefetchIsNotRememberedAsMissing) {
+  // Keep values out of L1, so every Get that misses there goes to L2.
+  tiered_cache_->set_l1_size_limit(1);
+  delay_cache_.DelayKey("Name");
+  StringVector keys;
+  keys.push_back("Name");
+  tiered_cache_->Prefetch(keys);
+
+  // The prefetch has missed in L2, but hasn't reported it yet.
+  CheckPut("Name", "Value");
+  delay_cache_.ReleaseKey("Name");
+  CheckGet("Name", "Value");
+  EXPECT_EQ(0, Stat("negative_hits"));
+}
+
+TEST_F(TieredMetadataCacheTest, PutDuringPrefetchReplacesStaleValue) {
+  tiered_cache_->set_l1_size_limit(1);
+  CheckPut(&l2_cache_, "Name", "OldValue");
+  delay_cache_.DelayKey("Name");
+  StringVector keys;
+  keys.push_back("Name");
+  tiered_cache_->Prefetch(keys);
+
+  // The Get is queued behind the prefetch, which finds the old value after
+  // the Put.  Rather than be handed that, the Get looks again.
+  Callback* callback = InitiateGet("Name");
+  CheckPut("Name", "NewValue");
+  delay_cache_.ReleaseKey("Name");
+  WaitAndCheck(callback, "NewValue");
+  CheckGet("Name", "NewValue");
+}
+
+TEST_F(TieredMetadataCacheTest, PutDuringGetIsNotRememberedAsMissing) {
+  tiered_cache_->set_l1_size_limit(1);
+  delay_cache_.DelayKey("Name");
+
+  // The Get has missed in L2, but hasn't reported it yet.
+  Callback* callback = InitiateGet("Name");
+  CheckPut("Name", "Value");
+  delay_cache_.ReleaseKey("Name");
+  WaitAndCheckNotFound(callback);
+  CheckGet("Name", "Value");
+  EXPECT_EQ(0, Stat("negative_hits"));
+}
+
+TEST_F(TieredMetadataCacheTest, PutDuringGetIsNotShadowedByPromotion) {
+  tiered_cache_->set_promotion_threshold(1);
+  CheckPut(&l2_cache_, "Name", "OldValue");
+  delay_cache_.DelayKey("Name");
+
+  // The Get found the old value, which it may return, but mustn't copy
+  // into L1 over the new one.
+  Callback* callback = InitiateGet("Name");
+  CheckPut("Name", "NewValue");
+  delay_cache_.ReleaseKey("Name");
+  WaitAndCheck(callback, "OldValue");
+  CheckGet(&l1_cache_, "Name", "NewValue");
+  EXPECT_EQ(0, Stat("promotions"));
+}
+
+TEST_F(TieredMetadataCacheTest, PrintStats) {
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  CheckNotFound(Cache(), "Missing");
+  GoogleString out;
+  TieredMetadataCache::PrintStats(&stats_, &out);
+  EXPECT_NE(GoogleString::npos, out.find("l1_hits:       1 (50%)"));
+  EXPECT_NE(GoogleString::npos, out.find("misses:        1 (50%)"));
+}
+
+TEST_F(TieredMetadataCacheTest, Name) {
+  EXPECT_EQ(TieredMetadataCache::FormatName(l1_cache_.Name(),
+                                            delay_cache_.Name()),
+            tiered_cache_->Name());
+}
+
+}  // namespace net_instaweb
@@ -111,6 +111,43 @@ bool RemoveUnneeded(const std::vector<bool>& needed,
   return ret;
 }
 
+// Common header names, which WriteCompactAttributes encodes as their 1-based
+// index into this table.  Entries are matched case-sensitively so that the
+// names are decoded exactly as they were written.  The index is part of the
+// encoding stored in caches, so entries must never be reordered or removed;
+// new ones may only be appended.
+const char* const kCompactHeaderNames[] = {
+  HttpAttributes::kAcceptRanges,
+  HttpAttributes::kAccessControlAllowOrigin,
+  HttpAttributes::kAge,
+  HttpAttributes::kAltSvc,
+  HttpAttributes::kCacheControl,
+  HttpAttributes::kContentDisposition,
+  HttpAttributes::kContentEncoding,
+  HttpAttributes::kContentLanguage,
+  HttpAttributes::kContentLength,
+  HttpAttributes::kContentType,
+  HttpAttributes::kDate,
+  HttpAttributes::kEtag,
+  HttpAttributes::kExpires,
+  HttpAttributes::kLastModified,
+  HttpAttributes::kLink,
+  HttpAttributes::kLocation,
+  HttpAttributes::kPragma,
+  HttpAttributes::kServer,
+  HttpAttributes::kSetCookie,
+  HttpAttributes::kVary,
+  HttpAttributes::kVia,
+  HttpAttributes::kWarning,
+  HttpAttributes::kXContentTypeOptions,
+  HttpAttributes::kXOriginalContentLength,
+  HttpAttributes::kXUACompatible,
+};
+
+// Name code for a name that is not in kCompactHeaderNames, and follows as a
+// length-prefixed literal.
+const uint64 kLiteralHeaderName = 0;
+
 }  // namespace
 
 class MessageHandler;
@@ -129,14 +166,162 @@ template<class Proto> void Headers<Proto>::Clear() {
   proto_->clear_minor_version();
   map_.reset(NULL);
   cookies_.reset(NULL);
+  compact_attributes_.clear();
 }
 
 template<class Proto> void Headers<Proto>::SetProto(Proto* proto) {
   proto_.reset(proto);
+  compact_attributes_.clear();
 }
 
 template<class Proto> void Headers<Proto>::CopyProto(const Proto& proto) {
   proto_->CopyFrom(proto);
+  compact_attributes_.clear();
+}
+
+template<class Proto> void Headers<Proto>::CopyProtoAndAttributes(
+    const Headers<Proto>& other) {
+  proto_->CopyFrom(*other.proto_);
+  compact_attributes_ = other.compact_attributes_;
+}
+
+template<class Proto> void Headers<Proto>::AppendCompactVarint(
+    uint64 value, GoogleString* buf) {
+  while (value >= 0x80) {
+    buf->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buf->push_back(static_cast<char>(value));
+}
+
+template<class Proto> bool Headers<Proto>::ConsumeCompactVarint(
+    StringPiece* buf, uint64* value) {
+  *value = 0;
+  int shift = 0;
+  for (size_t i = 0; (shift < 64) && (i < buf->size()); shift += 7, ++i) {
+    uint64 byte = static_cast<unsigned char>((*buf)[i]);
+    *value |= (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      buf->remove_prefix(i + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+template<class Proto> void Headers<Proto>::AppendCompactString(
+    StringPiece str, GoogleString* buf) {
+  AppendCompactVarint(str.size(), buf);
+  str.AppendToString(buf);
+}
+
+template<class Proto> bool Headers<Proto>::ConsumeCompactString(
+    StringPiece* buf, StringPiece* str) {
+  uint64 size;
+  if (!ConsumeCompactVarint(buf, &size) || (size > buf->size())) {
+    return false;
+  }
+  *str = buf->substr(0, size);
+  buf->remove_prefix(size);
+  return true;
+}
+
+template<class Proto> bool Headers<Proto>::ConsumeCompactAttribute(
+    StringPiece* buf, const char** interned_name, StringPiece* literal_name,
+    StringPiece* value) {
+  uint64 name_code;
+  if (!ConsumeCompactVarint(buf, &name_code)) {
+    return false;
+  }
+  if (name_code == kLiteralHeaderName) {
+    *interned_name = NULL;
+    if (!ConsumeCompactString(buf, literal_name)) {
+      return false;
+    }
+  } else if (name_code <= arraysize(kCompactHeaderNames)) {
+    *interned_name = kCompactHeaderNames[name_code - 1];
+  } else {
+    return false;
+  }
+  return ConsumeCompactString(buf, value);
+}
+
+template<class Proto> void Headers<Proto>::WriteCompactAttributes(
+    GoogleString* buf) const {
+  AppendCompactVarint(NumAttributes(), buf);
+  for (int i = 0, n = NumAttributes(); i < n; ++i) {
+    const GoogleString& name = Name(i);
+    uint64 name_code = kLiteralHeaderName;
+    for (int j = 0, m = arraysize(kCompactHeaderNames); j < m; ++j) {
+      if (name == kCompactHeaderNames[j]) {
+        name_code = j + 1;
+        break;
+      }
+    }
+    AppendCompactVarint(name_code, buf);
+    if (name_code == kLiteralHeaderName) {
+      AppendCompactString(name, buf);
+    }
+    AppendCompactString(Value(i), buf);
+  }
+}
+
+template<class Proto> bool Headers<Proto>::ReadCompactAttributes(
+    StringPiece buf) {
+  proto_->clear_header();
+  map_.reset(NULL);
+  cookies_.reset(NULL);
+  compact_attributes_.clear();
+
+  // Walk the pairs without copying them, so that a corrupt entry is
+  // rejected now rather than on first access.
+  StringPiece remaining(buf);
+  uint64 count;
+  if (!ConsumeCompactVarint(&remaining, &count)) {
+    return false;
+  }
+  for (uint64 i = 0; i < count; ++i) {
+    const char* interned_name;
+    StringPiece literal_name, value;
+    if (!ConsumeCompactAttribute(&remaining, &interned_name, &literal_name,
+                                 &value)) {
+      return false;
+    }
+  }
+  if (!remaining.empty()) {
+    return false;
+  }
+  if (count != 0) {
+    buf.CopyToString(&compact_attributes_);
+  }
+  return true;
+}
+
+template<class Proto> void Headers<Proto>::DecodeCompactAttributes() const {
+  if (compact_attributes_.empty()) {
+    return;
+  }
+  StringPiece remaining(compact_attributes_);
+  uint64 count = 0;
+  bool ok = ConsumeCompactVarint(&remaining, &count);
+  proto_->mutable_header()->Reserve(count);
+  for (uint64 i = 0; ok && (i < count); ++i) {
+    const char* interned_name;
+    StringPiece literal_name, value;
+    ok = ConsumeCompactAttribute(&remaining, &interned_name, &literal_name,
+                                 &value);
+    if (ok) {
+      NameValue* name_value = proto_->add_header();
+      if (interned_name != NULL) {
+        name_value->set_name(interned_name);
+      } else {
+        name_value->set_name(literal_name.data(), literal_name.size());
+      }
+      name_value->set_value(value.data(), value.size());
+    }
+  }
+  DCHECK(ok) << "compact attributes were checked by ReadCompactAttributes";
+  compact_attributes_.clear();
 }
 
 template<class Proto> int Headers<Proto>::major_version() const {
@@ -162,18 +347,22 @@ template<class Proto> void Headers<Proto>::set_minor_version(
 }
 
 template<class Proto> int Headers<Proto>::NumAttributes() const {
+  DecodeCompactAttributes();
   return proto_->header_size();
 }
 
 template<class Proto> const GoogleString& Headers<Proto>::Name(int i) const {
+  DecodeCompactAttributes();
   return proto_->header(i).name();
 }
 
 template<class Proto> const GoogleString& Headers<Proto>::Value(int i) const {
+  DecodeCompactAttributes();
   return proto_->header(i).value();
 }
 
 template<class Proto> void Headers<Proto>::SetValue(int i, StringPiece value) {
+  DecodeCompactAttributes();
   value.CopyToString(proto_->mutable_header(i)->mutable_value());
   map_.reset(NULL);
   cookies_.reset(NULL);
@@ -306,6 +495,7 @@ void SplitValues(StringPiece name, StringPiece comma_separated_values,
 
 template<class Proto> void Headers<Proto>::Add(
     const StringPiece& name, const StringPiece& value) {
+  DecodeCompactAttributes();
   NameValue* name_value = proto_->add_header();
   name_value->set_name(name.data(), name.size());
   name_value->set_value(value.data(), value.size());
@@ -464,6 +654,7 @@ bool Headers<Proto>::RemoveFromHeaders(
 
 template<class Proto> bool Headers<Proto>::RemoveAllWithPrefix(
     const StringPiece& prefix) {
+  DecodeCompactAttributes();
   protobuf::RepeatedPtrField<NameValue>* headers = proto_->mutable_header();
   std::vector<bool> to_keep;
   to_keep.reserve(headers->size());
@@ -596,6 +787,7 @@ template<class Proto> void Headers<Proto>::UpdateFrom(
 
 template<class Proto> bool Headers<Proto>::WriteAsBinary(
     Writer* writer, MessageHandler* handler) {
+  DecodeCompactAttributes();
   GoogleString buf;
   {
     StringOutputStream sstream(&buf);
@@ -625,6 +817,7 @@ template<class Proto> bool Headers<Proto>::WriteAsHttp(
 }
 
 template<class Proto> void Headers<Proto>::CopyToProto(Proto* proto) const {
+  DecodeCompactAttributes();
   proto->CopyFrom(*proto_);
 }
 
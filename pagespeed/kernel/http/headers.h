@@ -69,7 +69,9 @@ template<class Proto> class Headers {
   //   http://tools.ietf.org/html/draft-ietf-httpbis-p1-messaging-26#section-3.2.2
   //
   // Note that Lookup, though declared const, is NOT thread-safe.  This
-  // is because it lazily generates a map.
+  // is because it lazily generates a map.  The same goes for NumAttributes,
+  // Name and Value on headers read from a compact encoding, which decode the
+  // name/value pairs on first access.
   // TODO(jmarantz): this is a problem waiting to happen, but I believe it
   // will not be a problem in the immediate future.  We can refactor our way
   // around this problem by moving the Map to an explicit separate class that
@@ -194,8 +196,39 @@ template<class Proto> class Headers {
   void SetProto(Proto* proto);  // Takes ownership of the argument.
   void CopyProto(const Proto& proto);
 
+  // Like CopyProto(*other.proto()), but also carries over any name/value
+  // pairs that other has not decoded yet, without decoding them.
+  void CopyProtoAndAttributes(const Headers<Proto>& other);
+
   void PopulateMap() const;  // const is a lie, mutates map_.
 
+  // Appends the name/value pairs to *buf in a compact encoding: a varint
+  // count, and then for each pair the name, either as an index into a fixed
+  // table of common header names or as a length-prefixed literal, followed
+  // by the length-prefixed value.
+  void WriteCompactAttributes(GoogleString* buf) const;
+
+  // Replaces the name/value pairs with the ones encoded in buf by
+  // WriteCompactAttributes.  The encoding is checked right away, but the
+  // pairs are only decoded into the proto when they are first accessed.
+  // Returns false, leaving no name/value pairs, if buf is corrupt.
+  bool ReadCompactAttributes(StringPiece buf);
+
+  // Varints and length-prefixed strings, as used by the compact encoding,
+  // for subclasses that add their own fields to it.  The Consume methods
+  // remove what they decode from the front of *buf, and return false if it
+  // is malformed.
+  static void AppendCompactVarint(uint64 value, GoogleString* buf);
+  static bool ConsumeCompactVarint(StringPiece* buf, uint64* value);
+  static void AppendCompactString(StringPiece str, GoogleString* buf);
+  static bool ConsumeCompactString(StringPiece* buf, StringPiece* str);
+
+  // Decodes any pairs held back by ReadCompactAttributes into the proto.
+  // proto() and mutable_proto() do not do this for you, so subclasses must
+  // call it before touching the proto's header entries.  const is a lie,
+  // mutates proto_.
+  void DecodeCompactAttributes() const;
+
   // Populates the cookies map and returns a const pointer to it. 'name' is
   // the name of the header to lookup: either "Cookie" for request headers or
   // "Set-Cookie" for response headers. The header is assumed to contain semi-
@@ -227,6 +260,14 @@ template<class Proto> class Headers {
   // will contain the original pairs including comma-separated values.
   void AddToMap(const StringPiece& name, const StringPiece& value) const;
 
+  // Consumes one name/value pair written by WriteCompactAttributes from the
+  // front of *buf.  A name from the table of common names is returned in
+  // *interned_name, and any other in *literal_name, with *interned_name NULL.
+  static bool ConsumeCompactAttribute(StringPiece* buf,
+                                      const char** interned_name,
+                                      StringPiece* literal_name,
+                                      StringPiece* value);
+
   // We have two representations for the name/value pairs.  Proto contains a
   // simple string-pair vector, but lacks a fast associative lookup.  So we
   // will build structures for associative lookup lazily, and keep them
@@ -240,6 +281,10 @@ template<class Proto> class Headers {
   // being set multiple times though we don't necessarily handle that correctly.
   mutable scoped_ptr<CookieMultimap> cookies_;
 
+  // Name/value pairs read by ReadCompactAttributes that have not been decoded
+  // into proto_ yet.  Empty if there are none.
+  mutable GoogleString compact_attributes_;
+
   DISALLOW_COPY_AND_ASSIGN(Headers);
 };
 
@@ -91,6 +91,39 @@ void ApplyTimeDelta(const char* attr, int64 delta_ms,
   }
 }
 
+// A block written by WriteAsCompactBinary starts with kCompactHeadersMagic,
+// which can never start a serialized HttpResponseHeaders (it would be a tag
+// for field 0 with wire type 7, neither of which is valid), followed by the
+// format version.  Then come the flags below as a varint, a varint for each
+// scalar field present (status code, HTTP version, then the computed date and
+// caching fields), the reason phrase if present, and the name/value pairs
+// written by WriteCompactAttributes.
+const char kCompactHeadersMagic = '\x07';
+const char kCompactHeadersVersion = 1;
+
+// Flags recording which proto fields are present, and the values of the
+// boolean ones.
+enum CompactHeadersFlag {
+  kHasStatusCode = 1 << 0,
+  kHasReasonPhrase = 1 << 1,
+  kHasMajorVersion = 1 << 2,
+  kHasMinorVersion = 1 << 3,
+  kHasDateMs = 1 << 4,
+  kHasExpirationTimeMs = 1 << 5,
+  kHasLastModifiedTimeMs = 1 << 6,
+  kHasCacheTtlMs = 1 << 7,
+  kHasBrowserCacheable = 1 << 8,
+  kBrowserCacheable = 1 << 9,
+  kHasProxyCacheable = 1 << 10,
+  kProxyCacheable = 1 << 11,
+  kHasRequiresBrowserRevalidation = 1 << 12,
+  kRequiresBrowserRevalidation = 1 << 13,
+  kHasRequiresProxyRevalidation = 1 << 14,
+  kRequiresProxyRevalidation = 1 << 15,
+  kHasIsImplicitlyCacheable = 1 << 16,
+  kIsImplicitlyCacheable = 1 << 17,
+};
+
 }  // namespace
 
 bool ResponseHeaders::IsImminentlyExpiring(
@@ -194,7 +227,7 @@ void ResponseHeaders::FixDateHeaders(int64 now_ms) {
 
 void ResponseHeaders::CopyFrom(const ResponseHeaders& other) {
   Headers<HttpResponseHeaders>::Clear();
-  Headers<HttpResponseHeaders>::CopyProto(*other.proto());
+  Headers<HttpResponseHeaders>::CopyProtoAndAttributes(other);
   cache_fields_dirty_ = other.cache_fields_dirty_;
   force_cache_ttl_ms_ = other.force_cache_ttl_ms_;
   force_cached_ = other.force_cached_;
@@ -371,12 +404,150 @@ bool ResponseHeaders::WriteAsBinary(Writer* writer, MessageHandler* handler) {
   return Headers<HttpResponseHeaders>::WriteAsBinary(writer, handler);
 }
 
+bool ResponseHeaders::WriteAsCompactBinary(Writer* writer,
+                                           MessageHandler* handler) {
+  if (cache_fields_dirty_) {
+    ComputeCaching();
+  }
+  const HttpResponseHeaders& proto = *this->proto();
+  uint64 flags = 0;
+  if (proto.has_status_code()) flags |= kHasStatusCode;
+  if (proto.has_reason_phrase()) flags |= kHasReasonPhrase;
+  if (proto.has_major_version()) flags |= kHasMajorVersion;
+  if (proto.has_minor_version()) flags |= kHasMinorVersion;
+  if (proto.has_date_ms()) flags |= kHasDateMs;
+  if (proto.has_expiration_time_ms()) flags |= kHasExpirationTimeMs;
+  if (proto.has_last_modified_time_ms()) flags |= kHasLastModifiedTimeMs;
+  if (proto.has_cache_ttl_ms()) flags |= kHasCacheTtlMs;
+  if (proto.has_browser_cacheable()) flags |= kHasBrowserCacheable;
+  if (proto.browser_cacheable()) flags |= kBrowserCacheable;
+  if (proto.has_proxy_cacheable()) flags |= kHasProxyCacheable;
+  if (proto.proxy_cacheable()) flags |= kProxyCacheable;
+  if (proto.has_requires_browser_revalidation()) {
+    flags |= kHasRequiresBrowserRevalidation;
+  }
+  if (proto.requires_browser_revalidation()) {
+    flags |= kRequiresBrowserRevalidation;
+  }
+  if (proto.has_requires_proxy_revalidation()) {
+    flags |= kHasRequiresProxyRevalidation;
+  }
+  if (proto.requires_proxy_revalidation()) {
+    flags |= kRequiresProxyRevalidation;
+  }
+  if (proto.has_is_implicitly_cacheable()) flags |= kHasIsImplicitlyCacheable;
+  if (proto.is_implicitly_cacheable()) flags |= kIsImplicitlyCacheable;
+
+  // Negative values are written as 64-bit two's complement, as protobuf
+  // does for int32 and int64 fields.
+  GoogleString buf;
+  buf.push_back(kCompactHeadersMagic);
+  buf.push_back(kCompactHeadersVersion);
+  AppendCompactVarint(flags, &buf);
+  if (flags & kHasStatusCode) {
+    AppendCompactVarint(static_cast<int64>(proto.status_code()), &buf);
+  }
+  if (flags & kHasMajorVersion) {
+    AppendCompactVarint(static_cast<int64>(proto.major_version()), &buf);
+  }
+  if (flags & kHasMinorVersion) {
+    AppendCompactVarint(static_cast<int64>(proto.minor_version()), &buf);
+  }
+  if (flags & kHasDateMs) {
+    AppendCompactVarint(proto.date_ms(), &buf);
+  }
+  if (flags & kHasExpirationTimeMs) {
+    AppendCompactVarint(proto.expiration_time_ms(), &buf);
+  }
+  if (flags & kHasLastModifiedTimeMs) {
+    AppendCompactVarint(proto.last_modified_time_ms(), &buf);
+  }
+  if (flags & kHasCacheTtlMs) {
+    AppendCompactVarint(proto.cache_ttl_ms(), &buf);
+  }
+  if (flags & kHasReasonPhrase) {
+    AppendCompactString(proto.reason_phrase(), &buf);
+  }
+  WriteCompactAttributes(&buf);
+  return writer->Write(buf, handler);
+}
+
 bool ResponseHeaders::ReadFromBinary(const StringPiece& buf,
                                      MessageHandler* message_handler) {
   cache_fields_dirty_ = false;
+  if (!buf.empty() && (buf[0] == kCompactHeadersMagic)) {
+    return ReadFromCompactBinary(buf);
+  }
   return Headers<HttpResponseHeaders>::ReadFromBinary(buf, message_handler);
 }
 
+bool ResponseHeaders::ReadFromCompactBinary(StringPiece buf) {
+  Clear();
+  // Like protobuf parsing, leave unset exactly the fields that were unset
+  // when the block was written.
+  HttpResponseHeaders* proto = mutable_proto();
+  proto->Clear();
+  if ((buf.size() < 2) || (buf[1] != kCompactHeadersVersion)) {
+    return false;
+  }
+  buf.remove_prefix(2);
+  uint64 flags, value;
+  if (!ConsumeCompactVarint(&buf, &flags)) {
+    return false;
+  }
+  if (flags & kHasStatusCode) {
+    if (!ConsumeCompactVarint(&buf, &value)) return false;
+    proto->set_status_code(static_cast<int32>(value));
+  }
+  if (flags & kHasMajorVersion) {
+    if (!ConsumeCompactVarint(&buf, &value)) return false;
+    proto->set_major_version(static_cast<int32>(value));
+  }
+  if (flags & kHasMinorVersion) {
+    if (!ConsumeCompactVarint(&buf, &value)) return false;
+    proto->set_minor_version(static_cast<int32>(value));
+  }
+  if (flags & kHasDateMs) {
+    if (!ConsumeCompactVarint(&buf, &value)) return false;
+    proto->set_date_ms(static_cast<int64>(value));
+  }
+  if (flags & kHasExpirationTimeMs) {
+    if (!ConsumeCompactVarint(&buf, &value)) return false;
+    proto->set_expiration_time_ms(static_cast<int64>(value));
+  }
+  if (flags & kHasLastModifiedTimeMs) {
+    if (!ConsumeCompactVarint(&buf, &value)) return false;
+    proto->set_last_modified_time_ms(static_cast<int64>(value));
+  }
+  if (flags & kHasCacheTtlMs) {
+    if (!ConsumeCompactVarint(&buf, &value)) return false;
+    proto->set_cache_ttl_ms(static_cast<int64>(value));
+  }
+  if (flags & kHasReasonPhrase) {
+    StringPiece reason_phrase;
+    if (!ConsumeCompactString(&buf, &reason_phrase)) return false;
+    proto->set_reason_phrase(reason_phrase.data(), reason_phrase.size());
+  }
+  if (flags & kHasBrowserCacheable) {
+    proto->set_browser_cacheable((flags & kBrowserCacheable) != 0);
+  }
+  if (flags & kHasProxyCacheable) {
+    proto->set_proxy_cacheable((flags & kProxyCacheable) != 0);
+  }
+  if (flags & kHasRequiresBrowserRevalidation) {
+    proto->set_requires_browser_revalidation(
+        (flags & kRequiresBrowserRevalidation) != 0);
+  }
+  if (flags & kHasRequiresProxyRevalidation) {
+    proto->set_requires_proxy_revalidation(
+        (flags & kRequiresProxyRevalidation) != 0);
+  }
+  if (flags & kHasIsImplicitlyCacheable) {
+    proto->set_is_implicitly_cacheable((flags & kIsImplicitlyCacheable) != 0);
+  }
+  return ReadCompactAttributes(buf);
+}
+
 // Serialize meta-data to a binary stream.
 bool ResponseHeaders::WriteAsHttp(Writer* writer, MessageHandler* handler)
     const {
@@ -414,6 +585,29 @@ bool ResponseHeaders::RequiresProxyRevalidation() const {
   return proto()->requires_proxy_revalidation();
 }
 
+bool ResponseHeaders::GetStaleWhileRevalidateMs(int64* window_ms) const {
+  static const char kStaleWhileRevalidate[] = "stale-while-revalidate=";
+  ConstStringStarVector cc_values;
+  Lookup(HttpAttributes::kCacheControl, &cc_values);
+  for (int i = 0, n = cc_values.size(); i < n; ++i) {
+    if (cc_values[i] == NULL) {
+      continue;
+    }
+    StringPiece value(*cc_values[i]);
+    int64 window_sec;
+    if (StringCaseStartsWith(value, kStaleWhileRevalidate)) {
+      value.remove_prefix(STATIC_STRLEN(kStaleWhileRevalidate));
+      if (StringToInt64(value, &window_sec) && window_sec >= 0) {
+        // Bound it as max-age is, so that a huge value can't overflow.
+        window_sec = std::min(window_sec, static_cast<int64>(kint32max));
+        *window_ms = window_sec * Timer::kSecondMs;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
 bool ResponseHeaders::IsProxyCacheable(
     RequestHeaders::Properties req_properties,
     VaryOption respect_vary,
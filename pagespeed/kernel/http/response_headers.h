@@ -93,9 +93,18 @@ class ResponseHeaders : public Headers<HttpResponseHeaders> {
   // Serialize HTTP response header to a binary stream.
   virtual bool WriteAsBinary(Writer* writer, MessageHandler* message_handler);
 
-  // Read HTTP response header from a binary string.  Note that this
-  // is distinct from HTTP response-header parsing, which is in
-  // ResponseHeadersParser.
+  // Serialize HTTP response header to a compact, versioned binary block, as
+  // stored in HTTPValue.  After a magic byte and the version come a varint of
+  // flags saying which fields are present, a varint for each present status,
+  // version, date and caching field, the reason phrase, and then the
+  // name/value pairs, with common header names interned.  The scalar fields
+  // come first, so ReadFromBinary recovers them without decoding the
+  // name/value pairs, which are only decoded when first accessed.
+  bool WriteAsCompactBinary(Writer* writer, MessageHandler* message_handler);
+
+  // Read HTTP response header from a binary string written by either
+  // WriteAsBinary or WriteAsCompactBinary.  Note that this is distinct from
+  // HTTP response-header parsing, which is in ResponseHeadersParser.
   virtual bool ReadFromBinary(const StringPiece& buf, MessageHandler* handler);
 
   // Serialize HTTP response header in HTTP format so it can be re-parsed.
@@ -153,6 +162,12 @@ class ResponseHeaders : public Headers<HttpResponseHeaders> {
   // it's OK to serve stale content while freshening in the background.
   bool RequiresProxyRevalidation() const;
 
+  // Looks for a Cache-Control: stale-while-revalidate=<sec> directive
+  // (RFC 5861), returning true and setting *window_ms to how long past
+  // expiry the response may be served stale while it is refreshed, if
+  // there is one.
+  bool GetStaleWhileRevalidateMs(int64* window_ms) const;
+
   // Note(sligocki): I think CacheExpirationTimeMs will return 0 if !IsCacheable
   // TODO(sligocki): Look through callsites and make sure this is being
   // interpreted correctly.
@@ -399,6 +414,9 @@ class ResponseHeaders : public Headers<HttpResponseHeaders> {
  private:
   void Init(const HttpOptions& options);
 
+  // Reads a block written by WriteAsCompactBinary.
+  bool ReadFromCompactBinary(StringPiece buf);
+
   // Parse the original and fresh content types, and add a new header based
   // on the two of them, giving preference to the original.
   // e.g. if the original specified charset=UTF-8 and the new one specified
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the cost of decoding the response headers stored with a cached
+// resource, as done on every HTTPCache hit, for headers written as an
+// HttpResponseHeaders protobuf (WriteAsBinary, as used before) and with
+// WriteAsCompactBinary (as HTTPValue stores them now).  Each benchmark reads
+// the headers and then asks for:
+//   Status:       the status code and computed expiration time only.
+//   CacheControl: also the Cache-Control values, which needs the map.
+//   All:          also every name and value, as when serving the response.
+//
+// Each benchmark reports the rate at which it decodes encoded bytes.  The
+// protobuf encoding is 592 bytes, and the compact one 380.  Reading
+// just the status and caching fields skips decoding the name/value pairs
+// altogether.  Once the pairs are needed, the two cost about the same, as
+// building the name/value map dominates.
+//
+// Benchmark                  Time(ns) Iterations
+// ----------------------------------------------
+// BM_ReadProtobufStatus          3684     320000
+// BM_ReadCompactStatus            519    3200000
+// BM_ReadProtobufCacheControl    9254     160000
+// BM_ReadCompactCacheControl     8878     160000
+// BM_ReadProtobufAll            11442     128000
+// BM_ReadCompactAll              8418     128000
+//
+// Disclaimer: comparing runs over time and across different machines
+// can be misleading.  When contemplating an algorithm change, always do
+// interleaved runs with the old & new algorithm.
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/benchmark.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/string_writer.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/http/http_names.h"
+#include "pagespeed/kernel/http/response_headers.h"
+
+namespace {
+
+const int64 kDateMs = 1270493386000LL;  // Mon, 05 Apr 2010 18:49:46 GMT
+
+enum Access { kStatus, kCacheControl, kAll };
+
+// Typical headers for a cached image.
+void FillHeaders(net_instaweb::ResponseHeaders* headers) {
+  headers->SetStatusAndReason(net_instaweb::HttpStatus::kOK);
+  headers->Add(net_instaweb::HttpAttributes::kServer, "Apache/2.4.7 (Ubuntu)");
+  headers->Add(net_instaweb::HttpAttributes::kAcceptRanges, "bytes");
+  headers->Add(net_instaweb::HttpAttributes::kContentLength, "44113");
+  headers->Add(net_instaweb::HttpAttributes::kContentType, "image/jpeg");
+  headers->Add(net_instaweb::HttpAttributes::kEtag,
+               "W/\"PSA-aj-nlGrt6p5X1\"");
+  headers->Add(net_instaweb::HttpAttributes::kVary, "Accept-Encoding");
+  headers->Add(net_instaweb::HttpAttributes::kAccessControlAllowOrigin, "*");
+  headers->Add("X-Original-Content-Length", "62381");
+  headers->Add("Timing-Allow-Origin", "*");
+  headers->Add("Strict-Transport-Security", "max-age=31536000");
+  headers->Add("Link",
+               "<http://www.example.com/images/puzzle.jpg>; rel=\"canonical\"");
+  headers->SetLastModified(kDateMs - net_instaweb::Timer::kWeekMs);
+  headers->SetDateAndCaching(kDateMs, net_instaweb::Timer::kYearMs,
+                             ", public");
+  headers->ComputeCaching();
+}
+
+void ReadHeaders(bool compact, Access access, int iters) {
+  StopBenchmarkTiming();
+  net_instaweb::ResponseHeaders headers;
+  FillHeaders(&headers);
+  GoogleString encoded;
+  net_instaweb::StringWriter writer(&encoded);
+  if (compact) {
+    headers.WriteAsCompactBinary(&writer, NULL);
+  } else {
+    headers.WriteAsBinary(&writer, NULL);
+  }
+
+  int64 total = 0;
+  StartBenchmarkTiming();
+  for (int i = 0; i < iters; ++i) {
+    net_instaweb::ResponseHeaders read_headers;
+    CHECK(read_headers.ReadFromBinary(encoded, NULL));
+    total += read_headers.status_code();
+    total += read_headers.CacheExpirationTimeMs();
+    if (access != kStatus) {
+      total += read_headers.Has(net_instaweb::HttpAttributes::kCacheControl);
+    }
+    if (access == kAll) {
+      for (int j = 0, n = read_headers.NumAttributes(); j < n; ++j) {
+        total += read_headers.Name(j).size() + read_headers.Value(j).size();
+      }
+    }
+  }
+  StopBenchmarkTiming();
+  CHECK_NE(0, total);
+  SetBenchmarkBytesProcessed(static_cast<int64>(iters) * encoded.size());
+}
+
+static void BM_ReadProtobufStatus(int iters) {
+  ReadHeaders(false, kStatus, iters);
+}
+
+static void BM_ReadCompactStatus(int iters) {
+  ReadHeaders(true, kStatus, iters);
+}
+
+static void BM_ReadProtobufCacheControl(int iters) {
+  ReadHeaders(false, kCacheControl, iters);
+}
+
+static void BM_ReadCompactCacheControl(int iters) {
+  ReadHeaders(true, kCacheControl, iters);
+}
+
+static void BM_ReadProtobufAll(int iters) {
+  ReadHeaders(false, kAll, iters);
+}
+
+static void BM_ReadCompactAll(int iters) {
+  ReadHeaders(true, kAll, iters);
+}
+
+}  // namespace
+
+BENCHMARK(BM_ReadProtobufStatus);
+BENCHMARK(BM_ReadCompactStatus);
+BENCHMARK(BM_ReadProtobufCacheControl);
+BENCHMARK(BM_ReadCompactCacheControl);
+BENCHMARK(BM_ReadProtobufAll);
+BENCHMARK(BM_ReadCompactAll);
@@ -294,6 +294,118 @@ TEST_F(ResponseHeadersTest, TestParseAndWrite) {
   ResponseHeaders response_headers3;
   ASSERT_TRUE(response_headers3.ReadFromBinary(outbuf, &message_handler_));
   CheckGoogleHeaders(response_headers3);
+
+  // Same for the compact binary encoding.
+  outbuf.clear();
+  response_headers_.WriteAsCompactBinary(&writer, &message_handler_);
+  ResponseHeaders response_headers4;
+  ASSERT_TRUE(response_headers4.ReadFromBinary(outbuf, &message_handler_));
+  CheckGoogleHeaders(response_headers4);
+}
+
+TEST_F(ResponseHeadersTest, TestCompactBinaryKeepsComputedFields) {
+  ParseHeaders(StrCat("HTTP/1.1 200 OK\r\n"
+                      "Date: ", start_time_string_, "\r\n"
+                      "Cache-Control: max-age=300\r\n"
+                      "content-type: text/css\r\n"
+                      "Last-Modified: ", start_time_string_, "\r\n"
+                      "\r\n"));
+  response_headers_.ComputeCaching();
+  GoogleString compact, proto;
+  StringWriter compact_writer(&compact), proto_writer(&proto);
+  ASSERT_TRUE(response_headers_.WriteAsCompactBinary(&compact_writer,
+                                                     &message_handler_));
+  ASSERT_TRUE(response_headers_.WriteAsBinary(&proto_writer,
+                                              &message_handler_));
+  EXPECT_GT(proto.size(), compact.size());
+
+  ResponseHeaders headers;
+  ASSERT_TRUE(headers.ReadFromBinary(compact, &message_handler_));
+  EXPECT_FALSE(headers.cache_fields_dirty());
+  EXPECT_EQ(HttpStatus::kOK, headers.status_code());
+  EXPECT_EQ(1, headers.major_version());
+  EXPECT_EQ(1, headers.minor_version());
+  EXPECT_TRUE(headers.has_date_ms());
+  EXPECT_EQ(MockTimer::kApr_5_2010_ms, headers.date_ms());
+  EXPECT_EQ(MockTimer::kApr_5_2010_ms, headers.last_modified_time_ms());
+  EXPECT_EQ(MockTimer::kApr_5_2010_ms + 5 * Timer::kMinuteMs,
+            headers.CacheExpirationTimeMs());
+  EXPECT_EQ(5 * Timer::kMinuteMs, headers.cache_ttl_ms());
+  EXPECT_TRUE(headers.IsBrowserCacheable());
+  EXPECT_TRUE(headers.IsProxyCacheable());
+
+  // Reserializing as a protobuf gives back exactly what we started with,
+  // including which optional fields are set.
+  GoogleString reserialized;
+  StringWriter reserialized_writer(&reserialized);
+  ASSERT_TRUE(headers.WriteAsBinary(&reserialized_writer, &message_handler_));
+  EXPECT_EQ(proto, reserialized);
+}
+
+TEST_F(ResponseHeadersTest, TestCompactBinaryMutateBeforeDecoding) {
+  ParseHeaders("HTTP/1.1 200 OK\r\n"
+               "Cache-Control: max-age=300\r\n"
+               "X-Custom: 1\r\n"
+               "\r\n");
+  GoogleString compact;
+  StringWriter writer(&compact);
+  ASSERT_TRUE(response_headers_.WriteAsCompactBinary(&writer,
+                                                     &message_handler_));
+
+  // New headers land after the ones read, even if added before those
+  // are decoded.
+  ResponseHeaders added;
+  ASSERT_TRUE(added.ReadFromBinary(compact, &message_handler_));
+  added.Add("X-Added", "2");
+  ASSERT_EQ(3, added.NumAttributes());
+  EXPECT_STREQ(HttpAttributes::kCacheControl, added.Name(0));
+  EXPECT_STREQ("X-Custom", added.Name(1));
+  EXPECT_STREQ("X-Added", added.Name(2));
+
+  ResponseHeaders removed;
+  ASSERT_TRUE(removed.ReadFromBinary(compact, &message_handler_));
+  EXPECT_TRUE(removed.RemoveAllWithPrefix("X-"));
+  EXPECT_EQ(1, removed.NumAttributes());
+
+  // Copies share the undecoded headers, and decode them independently.
+  ResponseHeaders original;
+  ASSERT_TRUE(original.ReadFromBinary(compact, &message_handler_));
+  ResponseHeaders copy;
+  copy.CopyFrom(original);
+  copy.Replace("X-Custom", "3");
+  EXPECT_STREQ("1", original.Lookup1("X-Custom"));
+  EXPECT_STREQ("3", copy.Lookup1("X-Custom"));
+
+  // Reading over headers that were decoded discards them.
+  ASSERT_TRUE(copy.ReadFromBinary(compact, &message_handler_));
+  EXPECT_STREQ("1", copy.Lookup1("X-Custom"));
+  EXPECT_EQ(2, copy.NumAttributes());
+}
+
+TEST_F(ResponseHeadersTest, TestCompactBinaryCorrupt) {
+  ParseHeaders("HTTP/1.1 200 OK\r\n"
+               "Cache-Control: max-age=300\r\n"
+               "X-Custom: 1\r\n"
+               "\r\n");
+  GoogleString compact;
+  StringWriter writer(&compact);
+  ASSERT_TRUE(response_headers_.WriteAsCompactBinary(&writer,
+                                                     &message_handler_));
+  ResponseHeaders headers;
+  for (int i = 1, n = compact.size(); i < n; ++i) {
+    EXPECT_FALSE(headers.ReadFromBinary(StringPiece(compact).substr(0, i),
+                                        &message_handler_)) << i;
+  }
+  EXPECT_FALSE(headers.ReadFromBinary(StrCat(compact, "x"),
+                                      &message_handler_));
+
+  // An unknown version of the encoding is rejected.
+  GoogleString future(compact);
+  ++future[1];
+  EXPECT_FALSE(headers.ReadFromBinary(future, &message_handler_));
+
+  ASSERT_TRUE(headers.ReadFromBinary(compact, &message_handler_));
+  EXPECT_STREQ("1", headers.Lookup1("X-Custom"));
 }
 
 TEST_F(ResponseHeadersTest, TestSizeEstimate) {
@@ -1298,6 +1410,44 @@ TEST_F(ResponseHeadersTest, TestRequiresProxyRevalidation) {
   EXPECT_TRUE(response_headers_.IsProxyCacheable());
 }
 
+TEST_F(ResponseHeadersTest, TestStaleWhileRevalidate) {
+  int64 window_ms = -1;
+  response_headers_.Clear();
+  ParseHeaders(StrCat(
+      "HTTP/1.0 200 (OK)\r\n"
+      "Date: ", start_time_string_, "\r\n"
+      "Cache-Control: max-age=360\r\n"
+      "\r\n"));
+  EXPECT_FALSE(response_headers_.GetStaleWhileRevalidateMs(&window_ms));
+
+  response_headers_.Clear();
+  ParseHeaders(StrCat(
+      "HTTP/1.0 200 (OK)\r\n"
+      "Date: ", start_time_string_, "\r\n"
+      "Cache-Control: max-age=360, Stale-While-Revalidate=60\r\n"
+      "\r\n"));
+  EXPECT_TRUE(response_headers_.GetStaleWhileRevalidateMs(&window_ms));
+  EXPECT_EQ(60 * Timer::kSecondMs, window_ms);
+
+  response_headers_.Clear();
+  ParseHeaders(StrCat(
+      "HTTP/1.0 200 (OK)\r\n"
+      "Date: ", start_time_string_, "\r\n"
+      "Cache-Control: max-age=360, stale-while-revalidate=soon\r\n"
+      "\r\n"));
+  EXPECT_FALSE(response_headers_.GetStaleWhileRevalidateMs(&window_ms));
+
+  response_headers_.Clear();
+  ParseHeaders(StrCat(
+      "HTTP/1.0 200 (OK)\r\n"
+      "Date: ", start_time_string_, "\r\n"
+      "Cache-Control: max-age=360, "
+      "stale-while-revalidate=9223372036854775807\r\n"
+      "\r\n"));
+  EXPECT_TRUE(response_headers_.GetStaleWhileRevalidateMs(&window_ms));
+  EXPECT_EQ(kint32max * Timer::kSecondMs, window_ms);
+}
+
 TEST_F(ResponseHeadersTest, TestProxyAndMustRevalidate) {
   const GoogleString comma_headers = StrCat(
       "HTTP/1.0 200 (OK)\r\n"
@@ -38,6 +38,7 @@
 #include "pagespeed/kernel/sharedmem/shared_mem_lock_manager_test_base.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_statistics_test_base.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_test_base.h"
+#include "pagespeed/kernel/sharedmem/slab_shared_mem_cache_test_base.h"
 #include "pagespeed/kernel/util/platform.h"
 
 namespace net_instaweb {
@@ -120,6 +121,8 @@ INSTANTIATE_TYPED_TEST_CASE_P(InprocessShm, SharedMemStatisticsTestTemplate,
                               InProcessSharedMemEnv);
 INSTANTIATE_TYPED_TEST_CASE_P(InprocessShm, SharedMemTestTemplate,
                               InProcessSharedMemEnv);
+INSTANTIATE_TYPED_TEST_CASE_P(InprocessShm, SlabSharedMemCacheTestTemplate,
+                              InProcessSharedMemEnv);
 
 }  // namespace
 
@@ -32,6 +32,7 @@
 #include "pagespeed/kernel/sharedmem/shared_mem_lock_manager_test_base.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_statistics_test_base.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_test_base.h"
+#include "pagespeed/kernel/sharedmem/slab_shared_mem_cache_test_base.h"
 #include "pagespeed/kernel/thread/pthread_shared_mem.h"
 
 namespace net_instaweb {
@@ -143,6 +144,8 @@ INSTANTIATE_TYPED_TEST_CASE_P(PthreadProc, SharedMemStatisticsTestTemplate,
                               PthreadSharedMemProcEnv);
 INSTANTIATE_TYPED_TEST_CASE_P(PthreadProc, SharedMemTestTemplate,
                               PthreadSharedMemProcEnv);
+INSTANTIATE_TYPED_TEST_CASE_P(PthreadProc, SlabSharedMemCacheTestTemplate,
+                              PthreadSharedMemProcEnv);
 INSTANTIATE_TYPED_TEST_CASE_P(PthreadThread, SharedCircularBufferTestTemplate,
                               PthreadSharedMemThreadEnv);
 INSTANTIATE_TYPED_TEST_CASE_P(PthreadThread, SharedDynamicStringMapTestTemplate,
@@ -157,6 +160,8 @@ INSTANTIATE_TYPED_TEST_CASE_P(PthreadThread, SharedMemStatisticsTestTemplate,
                               PthreadSharedMemThreadEnv);
 INSTANTIATE_TYPED_TEST_CASE_P(PthreadThread, SharedMemTestTemplate,
                               PthreadSharedMemThreadEnv);
+INSTANTIATE_TYPED_TEST_CASE_P(PthreadThread, SlabSharedMemCacheTestTemplate,
+                              PthreadSharedMemThreadEnv);
 
 }  // namespace
 
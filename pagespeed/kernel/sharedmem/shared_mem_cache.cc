@@ -86,6 +86,13 @@
 // last_use_timestamp_ms denotes when the entry was last touched, for
 // associativity replacement.
 //
+// referenced is only used in kTouchClock mode, where hits set it rather than
+// moving the entry to the front of the LRU chain and updating its timestamp.
+// When freeing up blocks, a referenced entry at the rear of the LRU is moved
+// to the front (and given the current time) with the bit cleared, instead of
+// being evicted. Associativity replacement likewise prefers unreferenced
+// entries.
+//
 // byte_size is the size of the actual payload in bytes (not counting
 // internal fragmentation or our bookkeeping overhead).
 //
@@ -113,6 +120,17 @@
 // True       0           Writer working.
 //
 // For now, writers wait in sleep loop, while readers simply fail/miss.
+// Readers also miss if open_count is already at kMaxOpenCount.
+//
+// version makes the entry a seqlock for readers that do not take the sector
+// lock at all, which is how Get normally proceeds: it reads the version,
+// compares the key, copies the payload by walking the block successor list,
+// and then checks that the version hasn't changed. Writers (who still hold
+// the sector lock) make the version odd before they change the entry's key,
+// size, or blocks --- including when taking its blocks away to evict it ---
+// and even again once they are done, so a reader that raced with them sees
+// a different or odd version and retries. After a few failed attempts, it
+// falls back to the locked path described above, which uses open_count.
 //
 // TODO(morlovich): Evaluate using chaining and one more layer of indirection
 // instead, as it should hopefully produce much better utilization and avoid
@@ -120,6 +138,7 @@
 
 #include "pagespeed/kernel/sharedmem/shared_mem_cache.h"
 
+#include <algorithm>
 #include <cstddef>                     // for size_t
 #include <cstring>
 #include <map>
@@ -129,6 +148,7 @@
 #include "base/logging.h"
 #include "pagespeed/kernel/base/abstract_mutex.h"
 #include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/atomic_int32.h"
 #include "pagespeed/kernel/base/base64_util.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/cache_interface.h"
@@ -142,9 +162,15 @@
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_cache_data.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_cache_snapshot.pb.h"
 #include "pagespeed/kernel/thread/slow_worker.h"
+#ifdef USE_SYSTEM_ZLIB
+#include "zlib.h"  // NOLINT
+#else
+#include "third_party/zlib/zlib.h"
+#endif
 
 namespace net_instaweb {
 
@@ -157,6 +183,7 @@ using SharedMemCacheData::SectorStats;
 using SharedMemCacheData::kInvalidBlock;
 using SharedMemCacheData::kInvalidEntry;
 using SharedMemCacheData::kHashSize;
+using SharedMemCacheData::kMaxOpenCount;
 
 namespace {
 
@@ -164,6 +191,33 @@ namespace {
 // format.
 const int kSnapshotVersion = 1;
 
+// Likewise for raw sector images, which also need to change whenever the
+// layout of the sector does in a way that RawSnapshotCacheKey doesn't
+// capture, e.g. when adding fields to CacheEntry or SectorStats.
+const int kRawSnapshotVersion = 2;
+
+const char kRawSnapshotMagic[4] = { 'S', 'M', 'C', 'I' };
+
+// Raw sector images are stored preceded by this header.
+struct RawSnapshotHeader {
+  char magic[4];
+  uint32 checksum;  // CRC-32 of the image.
+  uint64 image_size;
+};
+
+uint32 ImageChecksum(StringPiece image) {
+  uLong crc = crc32(0L, Z_NULL, 0);
+  const Bytef* data = reinterpret_cast<const Bytef*>(image.data());
+  size_t remaining = image.size();
+  while (remaining > 0) {
+    uInt chunk = static_cast<uInt>(std::min<size_t>(remaining, 1 << 30));
+    crc = crc32(crc, data, chunk);
+    data += chunk;
+    remaining -= chunk;
+  }
+  return static_cast<uint32>(crc);
+}
+
 bool IsAllNil(const StringPiece& raw_hash) {
   bool all_nil = true;
   for (size_t c = 0; c < raw_hash.length(); ++c) {
@@ -194,8 +248,29 @@ GoogleString DebugTextHash(CacheEntry* entry, size_t size) {
 
 #endif  // NDEBUG
 
+// Moves the value of a process-local counter into a shared one. The
+// caller must hold the lock protecting the shared counter.
+void FoldInto(AtomicInt32* local, int64* shared) {
+  int32 value = local->value();
+  if (value != 0) {
+    local->BarrierIncrement(-value);
+    *shared += value;
+  }
+}
+
 }  // namespace
 
+// Lock-free gets can't update the SectorStats in shared memory, since those
+// are protected by the sector lock, so they count themselves here, and
+// NoteLockAcquired transfers the counts over.
+template<size_t kBlockSize>
+struct SharedMemCache<kBlockSize>::LockFreeStats {
+  AtomicInt32 num_get;
+  AtomicInt32 num_get_hit;
+  AtomicInt32 num_get_lock_free;
+  AtomicInt32 num_get_retries;
+};
+
 // If you add any new parameters also include them in SnapshotCacheKey() or else
 // people will restore invalid snapshots and have a corrupt cache.
 template<size_t kBlockSize>
@@ -211,6 +286,8 @@ SharedMemCache<kBlockSize>::SharedMemCache(
       entries_per_sector_(entries_per_sector),
       blocks_per_sector_(blocks_per_sector),
       checkpoint_interval_sec_(-1),
+      touch_mode_(kTouchLru),
+      snapshot_format_(kSnapshotProtobuf),
       handler_(handler),
       snapshot_path_(""),
       file_cache_(NULL) {
@@ -224,6 +301,7 @@ GoogleString SharedMemCache<kBlockSize>::FormatName() {
 template<size_t kBlockSize>
 SharedMemCache<kBlockSize>::~SharedMemCache() {
   STLDeleteElements(&sectors_);
+  STLDeleteElements(&lock_free_stats_);
 }
 
 template<size_t kBlockSize>
@@ -249,6 +327,8 @@ bool SharedMemCache<kBlockSize>::InitCache(bool parent) {
 
   STLDeleteElements(&sectors_);
   sectors_.clear();
+  STLDeleteElements(&lock_free_stats_);
+  lock_free_stats_.clear();
   for (int s = 0; s < num_sectors_; ++s) {
     scoped_ptr<Sector<kBlockSize> > sec(
         new Sector<kBlockSize>(segment_.get(), s * sector_size,
@@ -267,6 +347,7 @@ bool SharedMemCache<kBlockSize>::InitCache(bool parent) {
       return false;
     }
     sectors_.push_back(sec.release());
+    lock_free_stats_.push_back(new LockFreeStats);
   }
 
   if (parent) {
@@ -332,15 +413,20 @@ void SharedMemCache<kBlockSize>::ComputeDimensions(
 }
 
 template<size_t kBlockSize>
-GoogleString SharedMemCache<kBlockSize>::DumpStats() {
-  SectorStats aggregate;
-  for (size_t c = 0; c < sectors_.size(); ++c) {
+void SharedMemCache<kBlockSize>::AggregateStats(SectorStats* stats) {
+  for (int c = 0; c < num_sectors_; ++c) {
     ScopedMutex lock(sectors_[c]->mutex());
-    aggregate.Add(*sectors_[c]->sector_stats());
+    FoldLockFreeStats(c);
+    stats->Add(*sectors_[c]->sector_stats());
   }
+}
 
+template<size_t kBlockSize>
+GoogleString SharedMemCache<kBlockSize>::DumpStats() {
+  SectorStats aggregate;
+  AggregateStats(&aggregate);
   return aggregate.Dump(entries_per_sector_* num_sectors_,
-                        blocks_per_sector_ * num_sectors_);
+                        blocks_per_sector_ * num_sectors_, kBlockSize);
 }
 
 template<size_t kBlockSize>
@@ -408,6 +494,116 @@ void SharedMemCache<kBlockSize>::RestoreSnapshot(
   }
 }
 
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::AppendSectorRawHashes(
+    int sector_num, StringVector* raw_hashes) {
+  CHECK_LE(0, sector_num);
+  CHECK_LT(sector_num, num_sectors_);
+
+  Sector<kBlockSize>* sector = sectors_[sector_num];
+  ScopedMutex lock(sector->mutex());
+  for (EntryNum cur = sector->OldestEntryNum(); cur != kInvalidEntry;
+       cur = sector->EntryAt(cur)->lru_prev) {
+    CacheEntry* cur_entry = sector->EntryAt(cur);
+    if (!cur_entry->creating) {
+      raw_hashes->push_back(GoogleString(cur_entry->hash_bytes, kHashSize));
+    }
+  }
+}
+
+template<size_t kBlockSize>
+bool SharedMemCache<kBlockSize>::AddSectorImageToSnapshot(
+    int sector_num, int64 last_checkpoint_ms, GoogleString* dest) {
+  CHECK_LE(0, sector_num);
+  CHECK_LT(sector_num, num_sectors_);
+
+  Sector<kBlockSize>* sector = sectors_[sector_num];
+  size_t header_pos = dest->size();
+  dest->reserve(header_pos + sizeof(RawSnapshotHeader) + sector->ImageSize());
+  dest->append(sizeof(RawSnapshotHeader), '\0');
+  {
+    ScopedMutex lock(sector->mutex());
+    SectorStats* stats = sector->sector_stats();
+    DCHECK(!(last_checkpoint_ms > stats->last_checkpoint_ms));
+    if (last_checkpoint_ms < stats->last_checkpoint_ms) {
+      // Another thread already snapshotted this sector; do nothing.
+      dest->resize(header_pos);
+      return false;
+    }
+
+    // Entries that are in the middle of being written are copied as-is, and
+    // dropped by RepairRestoredSector.
+    sector->AppendImage(dest);
+    stats->last_checkpoint_ms = timer_->NowMs();
+  }
+
+  // The checksum doesn't need to hold up other users of the sector.
+  RawSnapshotHeader header;
+  std::memcpy(header.magic, kRawSnapshotMagic, sizeof(header.magic));
+  header.image_size = sector->ImageSize();
+  header.checksum = ImageChecksum(
+      StringPiece(*dest).substr(header_pos + sizeof(header)));
+  std::memcpy(&(*dest)[header_pos], &header, sizeof(header));
+  return true;
+}
+
+template<size_t kBlockSize>
+bool SharedMemCache<kBlockSize>::RestoreSectorImage(int sector_num,
+                                                    StringPiece image) {
+  CHECK_LE(0, sector_num);
+  CHECK_LT(sector_num, num_sectors_);
+
+  Sector<kBlockSize>* sector = sectors_[sector_num];
+  RawSnapshotHeader header;
+  if (image.size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, image.data(), sizeof(header));
+  StringPiece body = image.substr(sizeof(header));
+  if ((std::memcmp(header.magic, kRawSnapshotMagic,
+                   sizeof(header.magic)) != 0) ||
+      (header.image_size != sector->ImageSize()) ||
+      (body.size() != sector->ImageSize()) ||
+      (header.checksum != ImageChecksum(body))) {
+    handler_->Message(
+        kWarning, "SharedMemCache: ignoring bad snapshot image of sector %d "
+        "of %s", sector_num, filename_.c_str());
+    return false;
+  }
+
+  ScopedMutex lock(sector->mutex());
+  sector->RestoreImage(body);
+  RepairRestoredSector(sector);
+  return true;
+}
+
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::RepairRestoredSector(
+    Sector<kBlockSize>* sector) {
+  for (EntryNum e = 0; e < entries_per_sector_; ++e) {
+    CacheEntry* entry = sector->EntryAt(e);
+    entry->version = 0;
+    entry->open_count = 0;
+    if (entry->creating) {
+      // Whoever was writing this entry may not have been done copying in the
+      // payload, so we can't trust it.
+      entry->creating = false;
+      BlockVector blocks;
+      sector->BlockListForEntry(entry, &blocks);
+      sector->ReturnBlocksToFreeList(blocks);
+      MarkEntryFree(sector, e);
+    }
+  }
+
+  // Start statistics afresh, except for those describing the contents.
+  SectorStats* stats = sector->sector_stats();
+  SectorStats restored;
+  restored.used_entries = stats->used_entries;
+  restored.used_blocks = stats->used_blocks;
+  restored.used_bytes = stats->used_bytes;
+  *stats = restored;
+}
+
 template<size_t kBlockSize>
 void SharedMemCache<kBlockSize>::MarshalSnapshot(
     const SharedMemCacheDump& dump, GoogleString* out) {
@@ -471,6 +667,7 @@ void SharedMemCache<kBlockSize>::PutRawHash(const GoogleString& raw_hash,
   SectorStats* stats = sector->sector_stats();
 
   ScopedMutex lock(sector->mutex());
+  NoteLockAcquired(pos.sector);
   ++stats->num_put;
   int64 last_checkpoint_ms = stats->last_checkpoint_ms;
 
@@ -505,8 +702,7 @@ void SharedMemCache<kBlockSize>::PutRawHash(const GoogleString& raw_hash,
     EntryNum cand_key = pos.keys[p];
     CacheEntry* cand = sector->EntryAt(cand_key);
     if (Writeable(cand)) {
-      if ((best_key == kInvalidEntry) ||
-          (cand->last_use_timestamp_ms < best->last_use_timestamp_ms)) {
+      if ((best_key == kInvalidEntry) || LessRecentlyUsed(cand, best)) {
         best = cand;
         best_key = cand_key;
       }
@@ -519,6 +715,13 @@ void SharedMemCache<kBlockSize>::PutRawHash(const GoogleString& raw_hash,
     return;
   }
 
+  // Snapshot restores (checkpoint_ok false) are not subject to admission,
+  // since the restored entries did not arrive through Get.
+  if (checkpoint_ok && !ShouldAdmit(sector, best_key, raw_hash, value_size)) {
+    ++stats->num_put_rejected;
+    return;
+  }
+
   if (best->byte_size != 0 ||
       !IsAllNil(StringPiece(best->hash_bytes, kHashSize))) {
     ++stats->num_put_replace;
@@ -583,22 +786,48 @@ GoogleString SharedMemCache<kBlockSize>::SnapshotCacheKey(
                        IntegerToString(sector_num)));
 }
 
+template<size_t kBlockSize>
+GoogleString SharedMemCache<kBlockSize>::RawSnapshotCacheKey(
+    int sector_num) const {
+  return StrCat("shm_metadata_cache/raw_snapshot/",
+                filename_, "/",
+                IntegerToString(kRawSnapshotVersion), "/",
+                StrCat(IntegerToString(kBlockSize), "/",
+                       IntegerToString(entries_per_sector_), "/",
+                       IntegerToString(blocks_per_sector_), "/",
+                       IntegerToString(num_sectors_), "/",
+                       IntegerToString(shm_runtime_->SharedMutexSize()), "/",
+                       IntegerToString(sector_num)));
+}
+
 template<size_t kBlockSize>
 void SharedMemCache<kBlockSize>::WriteOutSnapshotFromWorkerThread(
     int sector_num, int64 last_checkpoint_ms) {
-  SharedMemCacheDump snapshot;
-  bool updated = AddSectorToSnapshot(sector_num, last_checkpoint_ms, &snapshot);
-  if (!updated) {
-    return;  // Another thread updated it first.  Nothing needs doing.
-  }
   GoogleString snapshot_s;
-  MarshalSnapshot(snapshot, &snapshot_s);
-  SharedString snapshot_s_shared(snapshot_s);
+  GoogleString key;
+  if (snapshot_format_ == kSnapshotRawImage) {
+    if (!AddSectorImageToSnapshot(sector_num, last_checkpoint_ms,
+                                  &snapshot_s)) {
+      return;  // Another thread updated it first.  Nothing needs doing.
+    }
+    key = RawSnapshotCacheKey(sector_num);
+  } else {
+    SharedMemCacheDump snapshot;
+    bool updated =
+        AddSectorToSnapshot(sector_num, last_checkpoint_ms, &snapshot);
+    if (!updated) {
+      return;  // Another thread updated it first.  Nothing needs doing.
+    }
+    MarshalSnapshot(snapshot, &snapshot_s);
+    key = SnapshotCacheKey(sector_num);
+  }
+  SharedString snapshot_s_shared;
+  snapshot_s_shared.SwapWithString(&snapshot_s);
 
   CHECK(file_cache_ != NULL);
   // It's safe for us to use the file cache from an arbitrary thread because
   // the file cache is thread-agnostic, having no writable member variables.
-  file_cache_->Put(SnapshotCacheKey(sector_num), snapshot_s_shared);
+  file_cache_->Put(key, snapshot_s_shared);
 }
 
 template<size_t kBlockSize>
@@ -617,17 +846,32 @@ void SharedMemCache<kBlockSize>::RestoreFromDisk() {
   // on the file cache being a synchronous cache.
   CHECK(file_cache_->IsBlocking());
   for (int sector_num = 0; sector_num < num_sectors_; ++sector_num) {
+    RestoreSectorFromDisk(sector_num);
+  }
+  // Some of these may have failed, or there may not have been any in the file
+  // cache at all.  This is fine; restoring the snapshots is best-effort.
+}
+
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::RestoreSectorFromDisk(int sector_num) {
+  if (snapshot_format_ == kSnapshotRawImage) {
     CacheInterface::SynchronousCallback callback;
-    file_cache_->Get(SnapshotCacheKey(sector_num), &callback);
+    file_cache_->Get(RawSnapshotCacheKey(sector_num), &callback);
     CHECK(callback.called());
-    if (callback.state() == CacheInterface::kAvailable) {
-      SharedMemCacheDump snapshot;
-      DemarshalSnapshot(callback.value().Value(), &snapshot);
-      RestoreSnapshot(snapshot);
+    if (callback.state() == CacheInterface::kAvailable &&
+        RestoreSectorImage(sector_num, callback.value().Value())) {
+      return;
     }
   }
-  // Some of these may have failed, or there may not have been any in the file
-  // cache at all.  This is fine; restoring the snapshots is best-effort.
+
+  CacheInterface::SynchronousCallback callback;
+  file_cache_->Get(SnapshotCacheKey(sector_num), &callback);
+  CHECK(callback.called());
+  if (callback.state() == CacheInterface::kAvailable) {
+    SharedMemCacheDump snapshot;
+    DemarshalSnapshot(callback.value().Value(), &snapshot);
+    RestoreSnapshot(snapshot);
+  }
 }
 
 // Expects sector->mutex() held on entry, leaves it held on exit.
@@ -648,7 +892,8 @@ void SharedMemCache<kBlockSize>::PutIntoEntry(
 
   // Grab more room if needed.
   if (blocks.size() < want_blocks) {
-    if (!TryAllocateBlocks(sector, want_blocks - blocks.size(), &blocks)) {
+    if (!TryAllocateBlocks(sector, want_blocks - blocks.size(),
+                           last_use_timestamp_ms, &blocks)) {
       // Allocation failed. We torpedo the entry, free all the blocks
       // (both those it has originally and any the above call picked up),
       // and fail the insertion. This should be pretty much impossible.
@@ -656,6 +901,7 @@ void SharedMemCache<kBlockSize>::PutIntoEntry(
       sector->ReturnBlocksToFreeList(blocks);
       entry->creating = false;
       MarkEntryFree(sector, entry_num);
+      sector->EndEntryUpdate(entry);
       return;
     }
   }
@@ -670,6 +916,7 @@ void SharedMemCache<kBlockSize>::PutIntoEntry(
     sector->ReturnBlocksToFreeList(extras);
   }
 
+  sector->sector_stats()->used_bytes += value.size() - entry->byte_size;
   entry->byte_size = value.size();
   TouchEntry(sector, last_use_timestamp_ms, entry_num);
 
@@ -694,18 +941,35 @@ void SharedMemCache<kBlockSize>::PutIntoEntry(
 
   // We're done, clear creating bit.
   entry->creating = false;
+  sector->EndEntryUpdate(entry);
 }
 
 template<size_t kBlockSize>
 void SharedMemCache<kBlockSize>::Get(const GoogleString& key,
                                      Callback* callback) {
-  GoogleString raw_hash = ToRawHash(key);
+  GetWithRawHash(key, ToRawHash(key), callback);
+}
+
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::GetWithRawHash(const GoogleString& key,
+                                                const GoogleString& raw_hash,
+                                                Callback* callback) {
+  if (admission_policy_.get() != NULL) {
+    admission_policy_->RecordAccess(
+        FrequencyAdmissionPolicy::HashKey(raw_hash));
+  }
   Position pos;
   ExtractPosition(raw_hash, &pos);
   CacheInterface::KeyState key_state = kNotFound;
+  if (TryLockFreeGet(raw_hash, pos, callback, &key_state)) {
+    ValidateAndReportResult(key, key_state, callback);
+    return;
+  }
+
   Sector<kBlockSize>* sector = sectors_[pos.sector];
   {
     ScopedMutex lock(sector->mutex());
+    NoteLockAcquired(pos.sector);
     SectorStats* stats = sector->sector_stats();
     ++stats->num_get;
 
@@ -723,6 +987,142 @@ void SharedMemCache<kBlockSize>::Get(const GoogleString& key,
   ValidateAndReportResult(key, key_state, callback);
 }
 
+template<size_t kBlockSize>
+typename SharedMemCache<kBlockSize>::LockFreeResult
+SharedMemCache<kBlockSize>::LockFreeLookup(
+    Sector<kBlockSize>* sector, const GoogleString& raw_hash,
+    const Position& pos, SharedString* value, EntryNum* entry_num,
+    int32* version) {
+  for (int p = 0; p < kAssociativity; ++p) {
+    EntryNum cand_key = pos.keys[p];
+    CacheEntry* cand = sector->EntryAt(cand_key);
+    int32 cand_version = sector->EntryVersion(cand);
+    if ((cand_version & 1) != 0) {
+      // Mid-update; we can't tell what key it will hold.
+      return kLockFreeConflict;
+    }
+
+    if (KeyMatch(cand, raw_hash)) {
+      // Everything we read here may be garbage if a writer comes along, so
+      // make sure it's at least in bounds before relying on it.
+      int32 byte_size = cand->byte_size;
+      BlockNum block = cand->first_block;
+      if (byte_size < 0 ||
+          static_cast<size_t>(byte_size) > MaxValueSize()) {
+        return kLockFreeConflict;
+      }
+
+      SharedString str;
+      str.Extend(byte_size);
+      size_t total_blocks = sector->DataBlocksForSize(byte_size);
+      int offset = 0;
+      for (size_t b = 0; b < total_blocks; ++b) {
+        if (block < 0 || block >= blocks_per_sector_) {
+          return kLockFreeConflict;
+        }
+        int bytes = sector->BytesInPortion(byte_size, b, total_blocks);
+        str.WriteAt(offset, sector->BlockBytes(block), bytes);
+        offset += bytes;
+        block = sector->RacyGetBlockSuccessor(block);
+      }
+
+      if (!sector->EntryUnchangedSince(cand, cand_version)) {
+        return kLockFreeConflict;
+      }
+      *value = str;
+      *entry_num = cand_key;
+      *version = cand_version;
+      return kLockFreeHit;
+    }
+
+    // The key comparison could have been against a half-written hash.
+    if (!sector->EntryUnchangedSince(cand, cand_version)) {
+      return kLockFreeConflict;
+    }
+  }
+  return kLockFreeMiss;
+}
+
+template<size_t kBlockSize>
+bool SharedMemCache<kBlockSize>::TryLockFreeGet(
+    const GoogleString& raw_hash, const Position& pos, Callback* callback,
+    CacheInterface::KeyState* key_state) {
+  Sector<kBlockSize>* sector = sectors_[pos.sector];
+  LockFreeStats* stats = lock_free_stats_[pos.sector];
+  for (int attempt = 0; attempt < kLockFreeGetAttempts; ++attempt) {
+    SharedString value;
+    EntryNum entry_num = kInvalidEntry;
+    int32 version = 0;
+    switch (LockFreeLookup(sector, raw_hash, pos, &value, &entry_num,
+                           &version)) {
+      case kLockFreeHit:
+        stats->num_get.NoBarrierIncrement(1);
+        stats->num_get_hit.NoBarrierIncrement(1);
+        stats->num_get_lock_free.NoBarrierIncrement(1);
+        MaybeTouchEntry(pos.sector, entry_num, version);
+        callback->set_value(value);
+        *key_state = kAvailable;
+        return true;
+      case kLockFreeMiss:
+        stats->num_get.NoBarrierIncrement(1);
+        stats->num_get_lock_free.NoBarrierIncrement(1);
+        *key_state = kNotFound;
+        return true;
+      case kLockFreeConflict:
+        stats->num_get_retries.NoBarrierIncrement(1);
+        break;
+    }
+  }
+  return false;
+}
+
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::MaybeTouchEntry(int sector_num,
+                                                 EntryNum entry_num,
+                                                 int32 version) {
+  Sector<kBlockSize>* sector = sectors_[sector_num];
+  CacheEntry* entry = sector->EntryAt(entry_num);
+  if (touch_mode_ == kTouchClock) {
+    // If the entry got replaced meanwhile, this gives the new one an
+    // undeserved second chance, which is harmless.
+    if (!entry->referenced) {
+      entry->referenced = 1;
+    }
+    return;
+  }
+
+  int64 now_ms = timer_->NowMs();
+  if (entry->last_use_timestamp_ms >= now_ms) {
+    return;
+  }
+  if (sector->mutex()->TryLock()) {
+    NoteLockAcquired(sector_num);
+    // The entry may have been replaced or freed since we read it.
+    if (sector->EntryVersion(entry) == version) {
+      TouchEntry(sector, now_ms, entry_num);
+    }
+    sector->mutex()->Unlock();
+  }
+}
+
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::NoteLockAcquired(int sector_num) {
+  ++sectors_[sector_num]->sector_stats()->num_lock_acquisitions;
+  FoldLockFreeStats(sector_num);
+}
+
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::FoldLockFreeStats(int sector_num) {
+  SectorStats* sector_stats = sectors_[sector_num]->sector_stats();
+  LockFreeStats* lock_free_stats = lock_free_stats_[sector_num];
+  FoldInto(&lock_free_stats->num_get, &sector_stats->num_get);
+  FoldInto(&lock_free_stats->num_get_hit, &sector_stats->num_get_hit);
+  FoldInto(&lock_free_stats->num_get_lock_free,
+           &sector_stats->num_get_lock_free);
+  FoldInto(&lock_free_stats->num_get_retries,
+           &sector_stats->num_get_retries);
+}
+
 // Expects sector->mutex() held on entry, leaves it held on exit.
 template<size_t kBlockSize>
 CacheInterface::KeyState SharedMemCache<kBlockSize>::GetFromEntry(
@@ -735,9 +1135,14 @@ CacheInterface::KeyState SharedMemCache<kBlockSize>::GetFromEntry(
     // For now, consider concurrent creation a miss.
     return kNotFound;
   }
+  if (entry->open_count == kMaxOpenCount) {
+    // Another reader would wrap the count to 0 and let the entry be evicted
+    // from under everyone reading it, so treat this as a miss, too.
+    return kNotFound;
+  }
   ++entry->open_count;
 
-  TouchEntry(sector, timer_->NowMs(), entry_num);
+  TouchEntryOnHit(sector, timer_->NowMs(), entry_num);
 
   BlockVector blocks;
   sector->BlockListForEntry(entry, &blocks);
@@ -774,6 +1179,7 @@ void SharedMemCache<kBlockSize>::Delete(const GoogleString& key) {
 
   Sector<kBlockSize>* sector = sectors_[pos.sector];
   ScopedMutex lock(sector->mutex());
+  NoteLockAcquired(pos.sector);
 
   for (int p = 0; p < kAssociativity; ++p) {
     EntryNum cand_key = pos.keys[p];
@@ -801,6 +1207,7 @@ void SharedMemCache<kBlockSize>::DeleteEntry(Sector<kBlockSize>* sector,
   sector->ReturnBlocksToFreeList(blocks);
   entry->creating = false;
   MarkEntryFree(sector, entry_num);
+  sector->EndEntryUpdate(entry);
 }
 
 template<size_t kBlockSize>
@@ -811,10 +1218,13 @@ void SharedMemCache<kBlockSize>::SanityCheck() {
 
     // Make sure that all blocks are accounted for exactly once.
 
-    // First collect all blocks referred to from entries
+    // First collect all blocks referred to from entries, and check that the
+    // payload sizes add up while at it.
     std::map<BlockNum, int> block_occur;
+    int64 used_bytes = 0;
     for (EntryNum e = 0; e < entries_per_sector_; ++e) {
       CacheEntry* entry = sector->EntryAt(e);
+      used_bytes += entry->byte_size;
       BlockVector blocks;
       sector->BlockListForEntry(entry, &blocks);
       for (size_t i = 0; i < blocks.size(); ++i) {
@@ -835,6 +1245,7 @@ void SharedMemCache<kBlockSize>::SanityCheck() {
          i != block_occur.end(); ++i) {
       CHECK_EQ(1, i->second);
     }
+    CHECK_EQ(used_bytes, sector->sector_stats()->used_bytes);
   }
 }
 
@@ -866,17 +1277,31 @@ void SharedMemCache<kBlockSize>::RegisterSnapshotFileCache(
 
 template<size_t kBlockSize>
 bool SharedMemCache<kBlockSize>::TryAllocateBlocks(
-    Sector<kBlockSize>* sector, int goal, BlockVector* blocks) {
+    Sector<kBlockSize>* sector, int goal, int64 last_use_timestamp_ms,
+    BlockVector* blocks) {
   // See how much we have in freelist.
   int got = sector->AllocBlocksFromFreeList(goal, blocks);
 
   // If not enough, start walking back in LRU and take blocks from those files.
+  // Readers can keep setting reference bits as we go, so bound how many
+  // second chances we hand out to make sure we terminate.
   EntryNum entry_num = sector->OldestEntryNum();
+  int second_chances = 0;
   while ((entry_num != kInvalidEntry) && (got < goal)) {
     CacheEntry* entry = sector->EntryAt(entry_num);
-    if (Writeable(entry)) {
+    if (entry->referenced && second_chances < entries_per_sector_) {
+      ++second_chances;
+      ++sector->sector_stats()->num_second_chances;
+      EntryNum prev = entry->lru_prev;
+      TouchEntry(sector, last_use_timestamp_ms, entry_num);
+      entry_num = (prev == kInvalidEntry) ? sector->OldestEntryNum() : prev;
+    } else if (Writeable(entry)) {
+      // Lock-free readers of the entry must notice that its blocks are
+      // about to be reused.
+      sector->BeginEntryUpdate(entry);
       got += sector->BlockListForEntry(entry, blocks);
       MarkEntryFree(sector, entry_num);
+      sector->EndEntryUpdate(entry);
       entry_num = sector->OldestEntryNum();
     } else {
       entry_num = entry->lru_prev;
@@ -886,6 +1311,36 @@ bool SharedMemCache<kBlockSize>::TryAllocateBlocks(
   return (got >= goal);
 }
 
+template<size_t kBlockSize>
+bool SharedMemCache<kBlockSize>::ShouldAdmit(
+    Sector<kBlockSize>* sector, EntryNum dest_num,
+    const GoogleString& raw_hash, size_t value_size) {
+  if (admission_policy_.get() == NULL) {
+    return true;
+  }
+
+  // If the destination holds some other key, that is what we would evict.
+  // Otherwise we may still have to reclaim blocks from the oldest entry in
+  // the sector.
+  CacheEntry* victim = sector->EntryAt(dest_num);
+  if (victim->byte_size == 0 &&
+      IsAllNil(StringPiece(victim->hash_bytes, kHashSize))) {
+    int64 free_blocks =
+        blocks_per_sector_ - sector->sector_stats()->used_blocks;
+    EntryNum oldest = sector->OldestEntryNum();
+    if ((static_cast<int64>(sector->DataBlocksForSize(value_size)) <=
+         free_blocks) || (oldest == kInvalidEntry)) {
+      return true;
+    }
+    victim = sector->EntryAt(oldest);
+  }
+
+  return admission_policy_->Admit(
+      FrequencyAdmissionPolicy::HashKey(raw_hash),
+      FrequencyAdmissionPolicy::HashKey(
+          StringPiece(victim->hash_bytes, kHashSize)));
+}
+
 template<size_t kBlockSize>
 void SharedMemCache<kBlockSize>::MarkEntryFree(Sector<kBlockSize>* sector,
                                                EntryNum entry_num) {
@@ -893,7 +1348,9 @@ void SharedMemCache<kBlockSize>::MarkEntryFree(Sector<kBlockSize>* sector,
   CacheEntry* entry = sector->EntryAt(entry_num);
   CHECK(Writeable(entry));
   std::memset(entry->hash_bytes, 0, kHashSize);
+  entry->referenced = 0;
   entry->last_use_timestamp_ms = 0;
+  sector->sector_stats()->used_bytes -= entry->byte_size;
   entry->byte_size = 0;
   entry->first_block = kInvalidBlock;
 }
@@ -905,9 +1362,33 @@ void SharedMemCache<kBlockSize>::TouchEntry(Sector<kBlockSize>* sector,
   CacheEntry* entry = sector->EntryAt(entry_num);
   sector->UnlinkEntryFromLRU(entry_num);
   sector->InsertEntryIntoLRU(entry_num);
+  entry->referenced = 0;
   entry->last_use_timestamp_ms = last_use_timestamp_ms;
 }
 
+template<size_t kBlockSize>
+void SharedMemCache<kBlockSize>::TouchEntryOnHit(Sector<kBlockSize>* sector,
+                                                 int64 last_use_timestamp_ms,
+                                                 EntryNum entry_num) {
+  if (touch_mode_ == kTouchClock) {
+    CacheEntry* entry = sector->EntryAt(entry_num);
+    if (!entry->referenced) {
+      entry->referenced = 1;
+    }
+  } else {
+    TouchEntry(sector, last_use_timestamp_ms, entry_num);
+  }
+}
+
+template<size_t kBlockSize>
+bool SharedMemCache<kBlockSize>::LessRecentlyUsed(const CacheEntry* a,
+                                                  const CacheEntry* b) {
+  if (a->referenced != b->referenced) {
+    return !a->referenced;
+  }
+  return a->last_use_timestamp_ms < b->last_use_timestamp_ms;
+}
+
 template<size_t kBlockSize>
 bool SharedMemCache<kBlockSize>::Writeable(const CacheEntry* entry) {
   return (entry->open_count == 0) && !entry->creating;
@@ -980,6 +1461,11 @@ void SharedMemCache<kBlockSize>::EnsureReadyForWriting(
   // to true they will both avoid this entry. (And there are no other writers
   // as if there were, we would have given up ourselves).
   //
+  // Lock-free readers don't look at ->creating but at the version, which
+  // stays odd until the write is complete; they needn't be waited for,
+  // since they will retry once they notice the change.
+  //
+  sector->BeginEntryUpdate(entry);
   entry->creating = true;
 
   // Now just wait for previous readers to leave.
@@ -1012,6 +1498,8 @@ void SharedMemCache<kBlockSize>::SetLastWriteMsForTesting(
 }
 
 template class SharedMemCache<64>;  // metadata ("rname") cache
+template class SharedMemCache<256>;  // metadata cache slab class
+template class SharedMemCache<1024>;  // metadata cache slab class
 template class SharedMemCache<512>;  // testing
 template class SharedMemCache<4096>;  // HTTP cache
 
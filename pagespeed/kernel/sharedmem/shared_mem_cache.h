@@ -30,6 +30,7 @@
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_annotations.h"
 #include "pagespeed/kernel/cache/file_cache.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_cache_data.h"
 
 namespace net_instaweb {
@@ -48,6 +49,32 @@ class SharedMemCache : public CacheInterface {
   static const int kAssociativity = 4;  // Note: changing this requires changing
                                         // code of ExtractPosition as well.
 
+  // How a cache hit affects the order in which entries get evicted.
+  enum TouchMode {
+    // The entry is moved to the front of its sector's LRU list, which
+    // needs the sector lock.
+    kTouchLru,
+    // The entry's reference bit is set, unless it already is, so repeated
+    // hits on popular entries don't write to shared memory at all. Entries
+    // are only moved to the front of the LRU when eviction finds them
+    // referenced at its tail, which then clears the bit (the CLOCK or
+    // second-chance algorithm).
+    kTouchClock
+  };
+
+  // How sectors are checkpointed to the snapshot file cache.
+  enum SnapshotFormat {
+    // Entries are serialized into a SharedMemCacheDump protobuf, and are
+    // re-inserted one by one on restore.
+    kSnapshotProtobuf,
+    // The sector's memory is copied out verbatim along with a checksum, and
+    // copied straight back in on restore, which is much cheaper at both ends.
+    // Such images are only usable by a cache with exactly the same layout;
+    // if there isn't one for a sector, restore falls back to a protobuf
+    // snapshot, if present.
+    kSnapshotRawImage
+  };
+
   // Initializes the cache's settings, but does not actually touch the shared
   // memory --- you must call Initialize or Attach (and handle them potentially
   // returning false) to do so. The filename parameter will be used to identify
@@ -100,6 +127,39 @@ class SharedMemCache : public CacheInterface {
     return (blocks_per_sector_ * kBlockSize) / 8;
   }
 
+  // Total number of directory entries across all sectors.
+  int num_entries() const { return num_sectors_ * entries_per_sector_; }
+
+  // Filters insertions of new keys through a frequency-based admission
+  // policy: a Put that would displace an existing entry, either because it
+  // conflicts with it in the associativity set or because blocks must be
+  // reclaimed from the sector's LRU, is dropped unless the new key has
+  // recently been looked up more often than that entry.  Takes ownership of
+  // policy.  Should be called before any concurrent use of the cache.
+  //
+  // Note that the policy lives in process-local memory, so each process
+  // attached to the cache bases its decisions on the lookups it has seen
+  // itself.  Restoring a snapshot bypasses the policy.
+  void set_admission_policy(FrequencyAdmissionPolicy* policy) {
+    admission_policy_.reset(policy);
+  }
+
+  // Sums up the statistics of all sectors into *stats, which should be
+  // freshly constructed.
+  void AggregateStats(SharedMemCacheData::SectorStats* stats);
+
+  // Selects the format checkpoints are written in; the default is
+  // kSnapshotProtobuf. Must be called before Initialize to affect restore.
+  void set_snapshot_format(SnapshotFormat format) {
+    snapshot_format_ = format;
+  }
+  SnapshotFormat snapshot_format() const { return snapshot_format_; }
+
+  // Selects how hits update the replacement order; the default is
+  // kTouchLru. Every process using the cache should use the same setting.
+  void set_touch_mode(TouchMode mode) { touch_mode_ = mode; }
+  TouchMode touch_mode() const { return touch_mode_; }
+
   // Returns some statistics as plaintext.
   // TODO(morlovich): Potentially periodically push these to the main
   // Statistics system (or pull to it from these).
@@ -120,6 +180,25 @@ class SharedMemCache : public CacheInterface {
   // may contain multiple sectors.
   void RestoreSnapshot(const SharedMemCacheDump& dump);
 
+  // Like AddSectorToSnapshot, but appends a checksummed raw image of the
+  // sector to *dest, for kSnapshotRawImage.
+  bool AddSectorImageToSnapshot(int sector_num, int64 last_checkpoint_ms,
+                                GoogleString* dest);
+
+  // Replaces the contents of the given sector with an image produced by
+  // AddSectorImageToSnapshot. Returns false, leaving the sector alone, if
+  // the image is corrupt or doesn't match the sector's geometry.
+  bool RestoreSectorImage(int sector_num, StringPiece image);
+
+  // Returns the hash the cache identifies key by.
+  GoogleString ToRawHash(const GoogleString& key);
+
+  int num_sectors() const { return num_sectors_; }
+
+  // Appends the hashes of all the entries in the given sector to
+  // *raw_hashes, skipping entries that are still being written.
+  void AppendSectorRawHashes(int sector_num, StringVector* raw_hashes);
+
   // Encode/Decode SharedMemCacheDump objects.
   static void MarshalSnapshot(const SharedMemCacheDump& dump,
                               GoogleString* out);
@@ -127,6 +206,11 @@ class SharedMemCache : public CacheInterface {
                                 SharedMemCacheDump* out);
 
   virtual void Get(const GoogleString& key, Callback* callback);
+
+  // Like Get, for a caller that already has the key's ToRawHash.
+  void GetWithRawHash(const GoogleString& key, const GoogleString& raw_hash,
+                      Callback* callback);
+
   virtual void Put(const GoogleString& key, const SharedString& value);
   virtual void Delete(const GoogleString& key);
   static GoogleString FormatName();
@@ -161,6 +245,18 @@ class SharedMemCache : public CacheInterface {
 
  private:
   class WriteOutSnapshotFunction;
+  struct LockFreeStats;
+
+  // Result of a lookup made without holding the sector lock.
+  enum LockFreeResult {
+    kLockFreeHit,
+    kLockFreeMiss,
+    kLockFreeConflict  // raced with a writer; need to retry.
+  };
+
+  // How many times a Get tries to read an entry without the sector lock
+  // before falling back to locking it.
+  static const int kLockFreeGetAttempts = 3;
 
   // Describes potential placements of a key
   struct Position {
@@ -179,6 +275,39 @@ class SharedMemCache : public CacheInterface {
   void PutRawHash(const GoogleString& raw_hash, int64 last_use_timestamp_ms,
                   const SharedString& value, bool checkpoint_ok);
 
+  // Tries to find raw_hash and copy its payload into *value without holding
+  // the sector lock, relying on entry versions to detect racing writers. On
+  // a hit, also returns the entry and the version the read was validated
+  // against.
+  LockFreeResult LockFreeLookup(
+      SharedMemCacheData::Sector<kBlockSize>* sector,
+      const GoogleString& raw_hash, const Position& pos, SharedString* value,
+      SharedMemCacheData::EntryNum* entry_num, int32* version);
+
+  // Serves a Get without the sector lock if possible, retrying a few times
+  // if it races with writers. Returns false if the caller needs to fall back
+  // to a locked lookup, and true if *key_state (and, on a hit, the callback's
+  // value) has been filled in.
+  bool TryLockFreeGet(const GoogleString& raw_hash, const Position& pos,
+                      Callback* callback, CacheInterface::KeyState* key_state);
+
+  // After a lock-free hit, marks the entry referenced in kTouchClock mode.
+  // Otherwise moves it to the front of the LRU if it hasn't already been
+  // touched this millisecond, and the sector lock can be had without waiting
+  // for it. The LRU is only a replacement hint, so skipping some of these
+  // updates is harmless, and it keeps readers of popular entries from
+  // contending on the lock.
+  void MaybeTouchEntry(int sector_num, SharedMemCacheData::EntryNum entry_num,
+                       int32 version);
+
+  // Called after taking a sector lock for a cache operation: counts the
+  // acquisition, and folds this process' lock-free statistics for the
+  // sector into the shared ones.
+  void NoteLockAcquired(int sector_num)
+      EXCLUSIVE_LOCKS_REQUIRED(sectors_[sector_num]->mutex());
+  void FoldLockFreeStats(int sector_num)
+      EXCLUSIVE_LOCKS_REQUIRED(sectors_[sector_num]->mutex());
+
   // Finish a get, with the entry matching and sector lock held.  Releases lock
   // while performing the read, but takes it again before returning.
   CacheInterface::KeyState GetFromEntry(
@@ -206,8 +335,19 @@ class SharedMemCache : public CacheInterface {
   // Note that in case of failure, some blocks may still have been allocated,
   // so the caller may have to clean them up. When successful, this method may
   // allocate more memory than is requested.
+  //
+  // Entries that are marked referenced are moved to the front of the LRU
+  // instead of being evicted, and get last_use_timestamp_ms.
   bool TryAllocateBlocks(SharedMemCacheData::Sector<kBlockSize>* sector,
-                         int goal, SharedMemCacheData::BlockVector* blocks)
+                         int goal, int64 last_use_timestamp_ms,
+                         SharedMemCacheData::BlockVector* blocks)
+      EXCLUSIVE_LOCKS_REQUIRED(sector->mutex());
+
+  // Returns whether a new key may be written into the directory entry
+  // dest_num, which is not currently holding it, given the admission policy.
+  bool ShouldAdmit(SharedMemCacheData::Sector<kBlockSize>* sector,
+                   SharedMemCacheData::EntryNum dest_num,
+                   const GoogleString& raw_hash, size_t value_size)
       EXCLUSIVE_LOCKS_REQUIRED(sector->mutex());
 
   // Marks the given entry free in the directory, and unlinks it from the LRU.
@@ -220,6 +360,15 @@ class SharedMemCache : public CacheInterface {
                   int64 last_use_timestamp_ms,
                   SharedMemCacheData::EntryNum entry_num);
 
+  // Records a hit on the entry according to touch_mode_.
+  void TouchEntryOnHit(SharedMemCacheData::Sector<kBlockSize>* sector,
+                       int64 last_use_timestamp_ms,
+                       SharedMemCacheData::EntryNum entry_num);
+
+  // Returns true if a should be replaced in preference to b.
+  static bool LessRecentlyUsed(const SharedMemCacheData::CacheEntry* a,
+                               const SharedMemCacheData::CacheEntry* b);
+
   // Returns true if the entry can be written (in particular meaning it's not
   // opened by someone else)
   bool Writeable(const SharedMemCacheData::CacheEntry* entry);
@@ -227,8 +376,6 @@ class SharedMemCache : public CacheInterface {
   bool KeyMatch(SharedMemCacheData::CacheEntry* entry,
                 const GoogleString& raw_hash);
 
-  GoogleString ToRawHash(const GoogleString& key);
-
   // Given a hash, tells what sector and what entries in it to check.
   void ExtractPosition(const GoogleString& raw_hash, Position* out_pos);
 
@@ -262,6 +409,18 @@ class SharedMemCache : public CacheInterface {
   // into the other.
   GoogleString SnapshotCacheKey(int sector_num) const;
 
+  // Likewise, for raw images, which also depend on the exact memory layout.
+  GoogleString RawSnapshotCacheKey(int sector_num) const;
+
+  // Restores a single sector from the file cache in the configured format.
+  void RestoreSectorFromDisk(int sector_num);
+
+  // Cleans up after restoring a sector image: entries that were being
+  // written to when the image was taken are dropped, and per-process state
+  // such as reader counts and operation statistics is reset.
+  void RepairRestoredSector(SharedMemCacheData::Sector<kBlockSize>* sector)
+      EXCLUSIVE_LOCKS_REQUIRED(sector->mutex());
+
   AbstractSharedMem* shm_runtime_;
   const Hasher* hasher_;
   Timer* timer_;
@@ -270,14 +429,18 @@ class SharedMemCache : public CacheInterface {
   int entries_per_sector_;
   int blocks_per_sector_;
   int checkpoint_interval_sec_;
+  TouchMode touch_mode_;
+  SnapshotFormat snapshot_format_;
   MessageHandler* handler_;
   GoogleString snapshot_path_;
   FileCache* file_cache_;
 
   scoped_ptr<AbstractSharedMemSegment> segment_;
   std::vector<SharedMemCacheData::Sector<kBlockSize>*> sectors_;
+  std::vector<LockFreeStats*> lock_free_stats_;  // parallel to sectors_
 
   GoogleString name_;
+  scoped_ptr<FrequencyAdmissionPolicy> admission_policy_;
 
   DISALLOW_COPY_AND_ASSIGN(SharedMemCache);
 };
@@ -21,6 +21,8 @@
 
 #include "pagespeed/kernel/sharedmem/shared_mem_cache_data.h"
 
+#include <cstring>
+
 #include "base/logging.h"
 #include "pagespeed/kernel/base/abstract_mutex.h"
 #include "pagespeed/kernel/base/abstract_shared_mem.h"
@@ -49,7 +51,7 @@ struct Sector<kBlockSize>::MemLayout {
     // Check out alignment assumptions -- everything must be of a size
     // that's multiple of 8. The exact sizes don't matter too much, but
     // we check it anyway to avoid surprises.
-    CHECK_EQ(104u, sizeof(SectorHeader));
+    CHECK_EQ(152u, sizeof(SectorHeader));
     CHECK_EQ(48u, sizeof(CacheEntry));
 
     header_bytes = AlignTo(8, sizeof(SectorHeader) + mutex_size);
@@ -72,9 +74,11 @@ Sector<kBlockSize>::Sector(AbstractSharedMemSegment* segment,
                            size_t data_blocks)
     : cache_entries_(cache_entries),
       data_blocks_(data_blocks),
+      mutex_size_(segment->SharedMutexSize()),
       segment_(segment),
       sector_offset_(sector_offset) {
-  MemLayout layout(segment->SharedMutexSize(), cache_entries, data_blocks);
+  MemLayout layout(mutex_size_, cache_entries, data_blocks);
+  sector_bytes_ = layout.metadata_bytes + data_blocks * kBlockSize;
   char* base = const_cast<char*>(segment->Base()) + sector_offset;
   sector_header_ = reinterpret_cast<SectorHeader*>(base);
   block_successors_ = reinterpret_cast<BlockNum*>(base + layout.header_bytes);
@@ -115,6 +119,8 @@ bool Sector<kBlockSize>::Initialize(MessageHandler* handler)
     entry->lru_prev = kInvalidEntry;
     entry->lru_next = kInvalidEntry;
     entry->first_block = kInvalidBlock;
+    entry->referenced = 0;
+    entry->version = 0;
   }
 
   // Initialize the freelist and block successor list.
@@ -138,6 +144,25 @@ size_t Sector<kBlockSize>::RequiredSize(AbstractSharedMem* shmem_runtime,
   return layout.metadata_bytes + data_blocks * kBlockSize;
 }
 
+template<size_t kBlockSize>
+void Sector<kBlockSize>::AppendImage(GoogleString* out) {
+  const char* base = reinterpret_cast<const char*>(sector_header_);
+  size_t after_mutex = sizeof(SectorHeader) + mutex_size_;
+  out->reserve(out->size() + ImageSize());
+  out->append(base, sizeof(SectorHeader));
+  out->append(base + after_mutex, sector_bytes_ - after_mutex);
+}
+
+template<size_t kBlockSize>
+void Sector<kBlockSize>::RestoreImage(StringPiece image) {
+  CHECK_EQ(ImageSize(), image.size());
+  char* base = reinterpret_cast<char*>(sector_header_);
+  size_t after_mutex = sizeof(SectorHeader) + mutex_size_;
+  std::memcpy(base, image.data(), sizeof(SectorHeader));
+  std::memcpy(base + after_mutex, image.data() + sizeof(SectorHeader),
+              sector_bytes_ - after_mutex);
+}
+
 template<size_t kBlockSize>
 int Sector<kBlockSize>::AllocBlocksFromFreeList(int goal,
                                                 BlockVector* blocks) {
@@ -249,11 +274,17 @@ SectorStats::SectorStats()
       num_put_concurrent_create(0),
       num_put_concurrent_full_set(0),
       num_put_spins(0),
+      num_put_rejected(0),
+      num_second_chances(0),
       num_get(0),
       num_get_hit(0),
+      num_get_lock_free(0),
+      num_get_retries(0),
+      num_lock_acquisitions(0),
       last_checkpoint_ms(0),
       used_entries(0),
-      used_blocks(0) {
+      used_blocks(0),
+      used_bytes(0) {
 }
 
 void SectorStats::Add(const SectorStats& other) {
@@ -263,14 +294,21 @@ void SectorStats::Add(const SectorStats& other) {
   num_put_concurrent_create += other.num_put_concurrent_create;
   num_put_concurrent_full_set += other.num_put_concurrent_full_set;
   num_put_spins += other.num_put_spins;
+  num_put_rejected += other.num_put_rejected;
+  num_second_chances += other.num_second_chances;
   num_get += other.num_get;
   num_get_hit += other.num_get_hit;
+  num_get_lock_free += other.num_get_lock_free;
+  num_get_retries += other.num_get_retries;
+  num_lock_acquisitions += other.num_lock_acquisitions;
   used_entries += other.used_entries;
   used_blocks += other.used_blocks;
+  used_bytes += other.used_bytes;
 }
 
 GoogleString SectorStats::Dump(size_t total_entries,
-                               size_t total_blocks) const {
+                               size_t total_blocks,
+                               size_t block_size) const {
   GoogleString out;
   StringAppendF(&out, "Total put operations: %s\n",
                 Integer64ToString(num_put).c_str());
@@ -287,12 +325,25 @@ GoogleString SectorStats::Dump(size_t total_entries,
   StringAppendF(
       &out, "  spinning sleeps performed by writers: %s\n",
       Integer64ToString(num_put_spins).c_str());
+  StringAppendF(
+      &out, "  rejected by admission policy: %s\n",
+      Integer64ToString(num_put_rejected).c_str());
+  StringAppendF(
+      &out, "  recently used entries spared from eviction: %s\n",
+      Integer64ToString(num_second_chances).c_str());
 
   StringAppendF(&out, "Total get operations: %s\n",
                 Integer64ToString(num_get).c_str());
   StringAppendF(&out, "  hits: %s (%.2f%%)\n",
                 Integer64ToString(num_get_hit).c_str(),
                 percent(num_get_hit, num_get));
+  StringAppendF(&out, "  served without sector lock: %s (%.2f%%)\n",
+                Integer64ToString(num_get_lock_free).c_str(),
+                percent(num_get_lock_free, num_get));
+  StringAppendF(&out, "  lock-free reads retried: %s\n",
+                Integer64ToString(num_get_retries).c_str());
+  StringAppendF(&out, "Sector lock acquisitions: %s\n",
+                Integer64ToString(num_lock_acquisitions).c_str());
 
   StringAppendF(&out, "Entries used: %s (%.2f%%)\n",
                 Integer64ToString(used_entries).c_str(),
@@ -300,18 +351,24 @@ GoogleString SectorStats::Dump(size_t total_entries,
   StringAppendF(&out, "Blocks used: %s (%.2f%%)\n",
                 Integer64ToString(used_blocks).c_str(),
                 percent(used_blocks, total_blocks));
+  StringAppendF(&out, "Payload bytes: %s (%.2f%% of used block space)\n",
+                Integer64ToString(used_bytes).c_str(),
+                percent(used_bytes, used_blocks * block_size));
   return out;
 }
 
 template<size_t kBlockSize>
 void Sector<kBlockSize>::DumpStats(MessageHandler* handler) {
   mutex()->Lock();
-  GoogleString dump = sector_stats()->Dump(cache_entries_, data_blocks_);
+  GoogleString dump = sector_stats()->Dump(cache_entries_, data_blocks_,
+                                           kBlockSize);
   mutex()->Unlock();
   handler->MessageS(kError, dump);
 }
 
 template class Sector<64>;
+template class Sector<256>;
+template class Sector<1024>;
 template class Sector<512>;
 template class Sector<4096>;
 
@@ -26,9 +26,11 @@
 #include <vector>
 
 #include "base/logging.h"
+#include "pagespeed/kernel/base/atomicops.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_annotations.h"
 
 namespace net_instaweb {
@@ -48,6 +50,9 @@ const BlockNum kInvalidBlock = -1;
 const EntryNum kInvalidEntry = -1;
 const size_t kHashSize = 16;
 
+// Most readers CacheEntry::open_count can record.
+const uint16 kMaxOpenCount = kuint16max;
+
 struct SectorStats {
   SectorStats();
 
@@ -64,19 +69,32 @@ struct SectorStats {
   int64 num_put_concurrent_create;
   int64 num_put_concurrent_full_set;
   int64 num_put_spins;  // # of times writers had to sleep behind readers
+  int64 num_put_rejected;  // new keys turned away by the admission policy
+  int64 num_second_chances;  // referenced entries spared from eviction
   int64 num_get;    // # of calls to get
   int64 num_get_hit;
+  int64 num_get_lock_free;  // gets answered without taking the sector lock
+  int64 num_get_retries;  // lock-free reads redone due to concurrent writes
+  int64 num_lock_acquisitions;  // cache operations that took the sector lock
   int64 last_checkpoint_ms;  // When this sector was last checkpointed to disk.
 
+  // Note that lock-free gets are first counted in process-local memory, and
+  // only added to the above when that process next takes the sector lock.
+
   // Current state stats --- updated by SharedMemCacheData
   int64 used_entries;
   int64 used_blocks;
 
+  // Payload bytes held by used entries --- updated by SharedMemCache. The
+  // difference from the space in used_blocks is lost to fragmentation.
+  int64 used_bytes;
+
   // Adds number to this object's. No concurrency control is done.
   void Add(const SectorStats& other);
 
   // Text dump of the statistics. No concurrency control is done.
-  GoogleString Dump(size_t total_entries, size_t total_blocks) const;
+  GoogleString Dump(size_t total_entries, size_t total_blocks,
+                    size_t block_size) const;
 };
 
 struct SectorHeader {
@@ -103,13 +121,21 @@ struct CacheEntry {
 
   BlockNum first_block;
 
+  // Set by hits when the cache uses CLOCK replacement, and cleared when the
+  // entry is given a second chance. This is written without holding the
+  // sector lock, so it must not share a bit-field with the members below.
+  uint8 referenced;
+
   // When this is true, someone is trying to overwrite this entry.
-  bool creating : 1;
+  bool creating;
 
-  // Number of readers currently accessing the data.
-  uint32 open_count : 31;
+  // Number of readers currently accessing the data, up to kMaxOpenCount.
+  uint16 open_count;
 
-  uint32 padding;  // ensures we're 8-aligned.
+  // Sequence number for lock-free readers: odd while a writer is changing the
+  // key, size or payload of the entry, and advanced to even again once it's
+  // done. Also keeps the struct 8-aligned.
+  base::subtle::Atomic32 version;
 };
 
 // Helper for operating on a given sector's data structures; helping
@@ -188,6 +214,19 @@ class Sector {
     }
   }
 
+  // Variant of GetBlockSuccessor for lock-free readers. The result may be
+  // stale, so the read must be validated with EntryUnchangedSince; an
+  // out-of-range value is returned as kInvalidBlock.
+  BlockNum RacyGetBlockSuccessor(BlockNum block) NO_THREAD_SAFETY_ANALYSIS {
+    DCHECK_GE(block, 0);
+    DCHECK_LT(block, static_cast<BlockNum>(data_blocks_));
+    BlockNum next = base::subtle::NoBarrier_Load(&block_successors_[block]);
+    if (next < 0 || next >= static_cast<BlockNum>(data_blocks_)) {
+      return kInvalidBlock;
+    }
+    return next;
+  }
+
   // Freelist ops.
   // ------------------------------------------------------------
 
@@ -225,6 +264,35 @@ class Sector {
     return sector_header_->lru_list_rear;
   }
 
+  // Entry version (seqlock) ops.
+  // ------------------------------------------------------------
+
+  // Brackets any change to an entry's key, size, block list, or block
+  // contents, so that lock-free readers overlapping with it retry.
+  void BeginEntryUpdate(CacheEntry* entry) EXCLUSIVE_LOCKS_REQUIRED(mutex()) {
+    int32 version = base::subtle::Barrier_AtomicIncrement(&entry->version, 1);
+    DCHECK_EQ(1, version & 1);
+  }
+
+  void EndEntryUpdate(CacheEntry* entry) EXCLUSIVE_LOCKS_REQUIRED(mutex()) {
+    int32 version = base::subtle::Barrier_AtomicIncrement(&entry->version, 1);
+    DCHECK_EQ(0, version & 1);
+  }
+
+  // Returns the version a lock-free read of the entry should be validated
+  // against. It is odd if an update is in progress.
+  static int32 EntryVersion(const CacheEntry* entry) {
+    return base::subtle::Acquire_Load(&entry->version);
+  }
+
+  // Returns true if the entry has not been updated since EntryVersion
+  // returned version, which means that everything read from it (and its
+  // blocks) in the meantime is consistent.
+  static bool EntryUnchangedSince(const CacheEntry* entry, int32 version) {
+    base::subtle::MemoryBarrier();
+    return base::subtle::NoBarrier_Load(&entry->version) == version;
+  }
+
   // Block ops.
   // ------------------------------------------------------------
 
@@ -251,6 +319,22 @@ class Sector {
   int BlockListForEntry(CacheEntry* entry, BlockVector* out_blocks)
       EXCLUSIVE_LOCKS_REQUIRED(mutex());
 
+  // Raw sector images, for snapshots
+  // ------------------------------------------------------------
+
+  // Size of the images produced by AppendImage.
+  size_t ImageSize() const { return sector_bytes_ - mutex_size_; }
+
+  // Appends a byte-for-byte copy of everything in the sector except for
+  // its mutex to *out.
+  void AppendImage(GoogleString* out) EXCLUSIVE_LOCKS_REQUIRED(mutex());
+
+  // Overwrites everything in the sector except for its mutex with an image
+  // produced by AppendImage on a sector of the same geometry. Does not do
+  // anything about operations that were in progress in the imaged sector.
+  // Precondition: image.size() == ImageSize()
+  void RestoreImage(StringPiece image) EXCLUSIVE_LOCKS_REQUIRED(mutex());
+
   // Statistics stuff
   // ------------------------------------------------------------
 
@@ -272,6 +356,8 @@ class Sector {
   // Configured geometry
   size_t cache_entries_;
   size_t data_blocks_;
+  size_t mutex_size_;
+  size_t sector_bytes_;  // including the mutex.
 
   // Pointers to where various things are, and our sizes
   AbstractSharedMemSegment* segment_;
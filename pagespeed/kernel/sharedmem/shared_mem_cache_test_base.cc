@@ -23,11 +23,14 @@
 
 #include "base/logging.h"               // for Check_EQImpl, CHECK_EQ
 #include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/null_mutex.h"
 #include "pagespeed/kernel/base/shared_string.h"
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_cache.h"
+#include "pagespeed/kernel/sharedmem/shared_mem_cache_data.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_cache_snapshot.pb.h"
 #include "pagespeed/kernel/util/platform.h"
 
@@ -41,6 +44,9 @@ const int kSectors = 2;
 const int kSectorBlocks = 2000;
 const int kSectorEntries = 256;
 const int kSpinRuns = 100;
+const int kConcurrentKeys = 12;
+const int kConcurrentWrites = 10000;
+const int kConcurrentReads = 10000;
 // Tests don't actually rely on this value, it just needs to be >0.
 const int kSnapshotIntervalMs = 1000;
 
@@ -291,6 +297,222 @@ void SharedMemCacheTestBase::TestEvict() {
   small_cache->GlobalCleanup(shmem_runtime_.get(), kAltSegment, &handler_);
 }
 
+void SharedMemCacheTestBase::TestAdmissionPolicy() {
+  const int kAssociativity = SharedMemCache<kBlockSize>::kAssociativity;
+
+  // As in TestConflict, a single sector with kAssociativity entries makes
+  // every new key contend with the existing ones.
+  scoped_ptr<SharedMemCache<kBlockSize> > small_cache(
+      new SharedMemCache<kBlockSize>(shmem_runtime_.get(), kAltSegment, &timer_,
+                                     &hasher_, 1 /* sectors*/,
+                                     kAssociativity /* entries / sector */,
+                                     kSectorBlocks, &handler_));
+  FrequencyAdmissionPolicy* policy =
+      new FrequencyAdmissionPolicy(1000, new NullMutex);
+  small_cache->set_admission_policy(policy);
+  ASSERT_TRUE(small_cache->Initialize());
+
+  CheckPut(small_cache.get(), "hot", "value");
+  for (int i = 0; i < 5; ++i) {
+    CheckGet(small_cache.get(), "hot", "value");
+    timer_.AdvanceMs(1);
+  }
+
+  // A stream of keys that are each looked up once, as on a miss, and then
+  // inserted, fills up the free entries but must not displace "hot".
+  for (int c = 0; c < 10 * kAssociativity; ++c) {
+    GoogleString key = StrCat("once", IntegerToString(c));
+    CheckNotFound(small_cache.get(), key.c_str());
+    CheckPut(small_cache.get(), key, key);
+    timer_.AdvanceMs(1);
+  }
+  CheckGet(small_cache.get(), "hot", "value");
+  EXPECT_LT(0, policy->num_rejected());
+
+  // A key that is requested often enough does get in.
+  for (int i = 0; i < 10; ++i) {
+    CheckNotFound(small_cache.get(), "popular");
+  }
+  CheckPut(small_cache.get(), "popular", "value");
+  CheckGet(small_cache.get(), "popular", "value");
+  small_cache->SanityCheck();
+
+  small_cache->GlobalCleanup(shmem_runtime_.get(), kAltSegment, &handler_);
+}
+
+void SharedMemCacheTestBase::TestLockFreeGet() {
+  CheckPut("key", large_);
+
+  SharedMemCacheData::SectorStats before;
+  cache_->AggregateStats(&before);
+  for (int i = 0; i < 10; ++i) {
+    CheckGet("key", large_);
+    CheckNotFound("absent");
+  }
+
+  // With the clock stopped, the entry is as fresh as the LRU can record,
+  // so none of the lookups need the sector lock.
+  SharedMemCacheData::SectorStats after;
+  cache_->AggregateStats(&after);
+  EXPECT_EQ(20, after.num_get - before.num_get);
+  EXPECT_EQ(10, after.num_get_hit - before.num_get_hit);
+  EXPECT_EQ(20, after.num_get_lock_free - before.num_get_lock_free);
+  EXPECT_EQ(0, after.num_get_retries - before.num_get_retries);
+  EXPECT_EQ(0, after.num_lock_acquisitions - before.num_lock_acquisitions);
+
+  // Once time moves on, the first hit takes the lock to refresh the LRU
+  // position, but the following ones don't.
+  timer_.AdvanceMs(1);
+  CheckGet("key", large_);
+  CheckGet("key", large_);
+  SharedMemCacheData::SectorStats touched;
+  cache_->AggregateStats(&touched);
+  EXPECT_EQ(2, touched.num_get_lock_free - after.num_get_lock_free);
+  EXPECT_EQ(1, touched.num_lock_acquisitions - after.num_lock_acquisitions);
+
+  // Lock-free readers see updates and deletions.
+  CheckPut("key", "short");
+  CheckGet("key", "short");
+  CheckDelete("key");
+  CheckNotFound("key");
+}
+
+SharedMemCache<SharedMemCacheTestBase::kBlockSize>*
+SharedMemCacheTestBase::MakeConcurrentCache() {
+  // A single sector with few entries and blocks, so that the writers keep
+  // evicting each other's keys and reusing the freed blocks.
+  return new SharedMemCache<kBlockSize>(
+      shmem_runtime_.get(), kAltSegment, &timer_, &hasher_, 1 /* sectors */,
+      2 * SharedMemCache<kBlockSize>::kAssociativity /* entries / sector */,
+      64 /* blocks / sector */, &handler_);
+}
+
+GoogleString SharedMemCacheTestBase::ConcurrentValue(int key, int generation) {
+  // The value names its key and generation, which determine the rest of it,
+  // so that a reader can tell a torn value from a whole one. Its size
+  // varies so that rewriting a key also changes its block list.
+  GoogleString value = StrCat(IntegerToString(key), ":",
+                              IntegerToString(generation), ":");
+  size_t size = value.size() + (generation * 397) % (6 * kBlockSize);
+  value.append(size - value.size(), 'a' + (key + generation) % 26);
+  return value;
+}
+
+bool SharedMemCacheTestBase::CheckConcurrentRead(
+    SharedMemCache<kBlockSize>* cache, int key) {
+  CacheTestBase::Callback callback;
+  cache->Get(StrCat("key", IntegerToString(key)), callback.Reset());
+  if (!callback.called()) {
+    return false;
+  }
+  if (callback.state() != CacheInterface::kAvailable) {
+    return true;
+  }
+  StringPiece value = callback.value().Value();
+  StringPieceVector fields;
+  SplitStringPieceToVector(value, ":", &fields, false);
+  int value_key, generation;
+  return (fields.size() >= 3 &&
+          StringToInt(fields[0], &value_key) && value_key == key &&
+          StringToInt(fields[1], &generation) &&
+          value == ConcurrentValue(key, generation));
+}
+
+void SharedMemCacheTestBase::TestConcurrentReadersAndWriters() {
+  scoped_ptr<SharedMemCache<kBlockSize> > concurrent_cache(
+      MakeConcurrentCache());
+  ASSERT_TRUE(concurrent_cache->Initialize());
+
+  CreateChild(&SharedMemCacheTestBase::TestConcurrentWriterChild);
+  CreateChild(&SharedMemCacheTestBase::TestConcurrentWriterChild);
+  CreateChild(&SharedMemCacheTestBase::TestConcurrentReaderChild);
+
+  for (int i = 0; i < kConcurrentReads; ++i) {
+    EXPECT_TRUE(CheckConcurrentRead(concurrent_cache.get(),
+                                    i % kConcurrentKeys));
+  }
+  test_env_->WaitForChildren();
+
+  // Everything that's left must be intact, too.
+  for (int key = 0; key < kConcurrentKeys; ++key) {
+    EXPECT_TRUE(CheckConcurrentRead(concurrent_cache.get(), key));
+  }
+  concurrent_cache->SanityCheck();
+  concurrent_cache->GlobalCleanup(shmem_runtime_.get(), kAltSegment,
+                                  &handler_);
+}
+
+void SharedMemCacheTestBase::TestConcurrentWriterChild() {
+  scoped_ptr<SharedMemCache<kBlockSize> > child_cache(MakeConcurrentCache());
+  if (!child_cache->Attach()) {
+    test_env_->ChildFailed();
+  }
+  for (int i = 0; i < kConcurrentWrites; ++i) {
+    int key = i % kConcurrentKeys;
+    GoogleString key_name = StrCat("key", IntegerToString(key));
+    if (i % 7 == 0) {
+      child_cache->Delete(key_name);
+    } else {
+      child_cache->Put(key_name, SharedString(ConcurrentValue(key, i)));
+    }
+  }
+}
+
+void SharedMemCacheTestBase::TestConcurrentReaderChild() {
+  scoped_ptr<SharedMemCache<kBlockSize> > child_cache(MakeConcurrentCache());
+  if (!child_cache->Attach()) {
+    test_env_->ChildFailed();
+  }
+  for (int i = 0; i < kConcurrentReads; ++i) {
+    if (!CheckConcurrentRead(child_cache.get(), i % kConcurrentKeys)) {
+      test_env_->ChildFailed();
+    }
+  }
+}
+
+void SharedMemCacheTestBase::TestClockReplacement() {
+  // As in TestEvict, use a single sector, so that we know exactly when it
+  // runs out of blocks.
+  scoped_ptr<SharedMemCache<kBlockSize> > small_cache(
+      new SharedMemCache<kBlockSize>(shmem_runtime_.get(), kAltSegment, &timer_,
+                                     &hasher_, 1 /* sectors*/,
+                                     kSectorBlocks * 4 /* entries / sector */,
+                                     kSectorBlocks, &handler_));
+  small_cache->set_touch_mode(SharedMemCache<kBlockSize>::kTouchClock);
+  ASSERT_TRUE(small_cache->Initialize());
+
+  // large_ takes 3 blocks, so this leaves 2 of them free.
+  const int kNumEntries = kSectorBlocks / 3;
+  for (int c = 0; c < kNumEntries; ++c) {
+    CheckPut(small_cache.get(), IntegerToString(c), large_);
+    timer_.AdvanceMs(1);
+  }
+
+  // Hits on the oldest entry only mark it, without taking the lock.
+  SharedMemCacheData::SectorStats before;
+  small_cache->AggregateStats(&before);
+  CheckGet(small_cache.get(), "0", large_);
+  timer_.AdvanceMs(1);
+  CheckGet(small_cache.get(), "0", large_);
+  SharedMemCacheData::SectorStats after;
+  small_cache->AggregateStats(&after);
+  EXPECT_EQ(0, after.num_lock_acquisitions - before.num_lock_acquisitions);
+
+  // Making room for one more spares "0", and evicts the next oldest instead.
+  CheckPut(small_cache.get(), "new", large_);
+  CheckGet(small_cache.get(), "new", large_);
+  CheckGet(small_cache.get(), "0", large_);
+  CheckNotFound(small_cache.get(), "1");
+  CheckGet(small_cache.get(), "2", large_);
+
+  SharedMemCacheData::SectorStats evicted;
+  small_cache->AggregateStats(&evicted);
+  EXPECT_EQ(1, evicted.num_second_chances);
+  small_cache->SanityCheck();
+
+  small_cache->GlobalCleanup(shmem_runtime_.get(), kAltSegment, &handler_);
+}
+
 void SharedMemCacheTestBase::CheckDumpsEqual(
     const SharedMemCacheDump& a, const SharedMemCacheDump& b,
     const char* test_label) {
@@ -397,6 +619,112 @@ void SharedMemCacheTestBase::TestSnapshot() {
   EXPECT_EQ(0, dump_ts_mismatch.entry_size());
 }
 
+void SharedMemCacheTestBase::TestRawSnapshot() {
+  const int kEntries = 10;
+  const int64 kLastWriteMs = 1234567;
+
+  for (int i = 0; i < kEntries; ++i) {
+    CheckPut(StrCat("key", IntegerToString(i)),
+             StrCat("val", IntegerToString(i)));
+    timer_.AdvanceMs(1);
+  }
+  CheckPut("large", large_);
+
+  GoogleString images[kSectors];
+  for (int i = 0; i < kSectors; ++i) {
+    Cache()->SetLastWriteMsForTesting(i, kLastWriteMs);
+    EXPECT_TRUE(Cache()->AddSectorImageToSnapshot(i, kLastWriteMs,
+                                                  &images[i]));
+    EXPECT_EQ(timer_.NowMs(), Cache()->GetLastWriteMsForTesting(i));
+  }
+
+  // As with protobuf snapshots, mismatched checkpoint timestamps don't
+  // produce anything.
+  GoogleString ts_mismatch;
+  Cache()->SetLastWriteMsForTesting(0, kLastWriteMs);
+  EXPECT_FALSE(Cache()->AddSectorImageToSnapshot(0, kLastWriteMs - 1,
+                                                 &ts_mismatch));
+  EXPECT_TRUE(ts_mismatch.empty());
+
+  ResetCache();
+  CheckNotFound("large");
+
+  // Damaged images are rejected.
+  GoogleString corrupt = images[0];
+  corrupt[corrupt.size() / 2] ^= 1;
+  EXPECT_FALSE(Cache()->RestoreSectorImage(0, corrupt));
+  EXPECT_FALSE(Cache()->RestoreSectorImage(
+      0, StringPiece(images[0]).substr(0, images[0].size() - 1)));
+  EXPECT_FALSE(Cache()->RestoreSectorImage(0, ""));
+
+  for (int i = 0; i < kSectors; ++i) {
+    EXPECT_TRUE(Cache()->RestoreSectorImage(i, images[i]));
+  }
+  cache_->SanityCheck();
+  for (int i = 0; i < kEntries; ++i) {
+    CheckGet(StrCat("key", IntegerToString(i)),
+             StrCat("val", IntegerToString(i)));
+  }
+  CheckGet("large", large_);
+
+  // Operation counts start over, but the contents are accounted for.
+  SharedMemCacheData::SectorStats stats;
+  cache_->AggregateStats(&stats);
+  EXPECT_EQ(0, stats.num_put);
+  EXPECT_EQ(kEntries + 1, stats.used_entries);
+  EXPECT_EQ(0, Cache()->GetLastWriteMsForTesting(0));
+
+  // Images only fit caches with the same geometry.
+  scoped_ptr<SharedMemCache<kBlockSize> > other_cache(
+      new SharedMemCache<kBlockSize>(shmem_runtime_.get(), kAltSegment, &timer_,
+                                     &hasher_, kSectors, kSectorEntries * 2,
+                                     kSectorBlocks, &handler_));
+  ASSERT_TRUE(other_cache->Initialize());
+  EXPECT_FALSE(other_cache->RestoreSectorImage(0, images[0]));
+  other_cache->GlobalCleanup(shmem_runtime_.get(), kAltSegment, &handler_);
+
+  // Now go through the file cache: raw images are written and restored, and
+  // a cache using them can still pick up protobuf snapshots.
+  const GoogleString kPath = "/a-path";
+  FileCacheTestWrapper file_cache_wrapper(
+      kPath, thread_system_.get(), &timer_, &handler_);
+  cache_.reset(new SharedMemCache<kBlockSize>(
+      shmem_runtime_.get(), kPath, &timer_, &hasher_, kSectors,
+      kSectorEntries, kSectorBlocks, &handler_));
+  cache_->RegisterSnapshotFileCache(file_cache_wrapper.file_cache(),
+                                    kSnapshotIntervalMs);
+  EXPECT_TRUE(cache_->Initialize());
+  CheckPut("proto", "value");
+  for (int i = 0; i < kSectors; ++i) {
+    cache_->SetLastWriteMsForTesting(i, kLastWriteMs);
+    cache_->WriteOutSnapshotForTesting(i, kLastWriteMs);
+  }
+
+  cache_.reset(new SharedMemCache<kBlockSize>(
+      shmem_runtime_.get(), kPath, &timer_, &hasher_, kSectors,
+      kSectorEntries, kSectorBlocks, &handler_));
+  cache_->set_snapshot_format(SharedMemCache<kBlockSize>::kSnapshotRawImage);
+  cache_->RegisterSnapshotFileCache(file_cache_wrapper.file_cache(),
+                                    kSnapshotIntervalMs);
+  EXPECT_TRUE(cache_->Initialize());
+  CheckGet("proto", "value");
+  CheckPut("raw", "value");
+  for (int i = 0; i < kSectors; ++i) {
+    cache_->SetLastWriteMsForTesting(i, kLastWriteMs);
+    cache_->WriteOutSnapshotForTesting(i, kLastWriteMs);
+  }
+
+  cache_.reset(new SharedMemCache<kBlockSize>(
+      shmem_runtime_.get(), kPath, &timer_, &hasher_, kSectors,
+      kSectorEntries, kSectorBlocks, &handler_));
+  cache_->set_snapshot_format(SharedMemCache<kBlockSize>::kSnapshotRawImage);
+  cache_->RegisterSnapshotFileCache(file_cache_wrapper.file_cache(),
+                                    kSnapshotIntervalMs);
+  EXPECT_TRUE(cache_->Initialize());
+  CheckGet("proto", "value");
+  CheckGet("raw", "value");
+}
+
 void SharedMemCacheTestBase::CheckDelete(const char* key) {
   cache_->Delete(key);
   SanityCheck();
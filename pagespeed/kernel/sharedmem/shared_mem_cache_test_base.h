@@ -55,7 +55,12 @@ class SharedMemCacheTestBase : public CacheTestBase {
   void TestReaderWriter();
   void TestConflict();
   void TestEvict();
+  void TestAdmissionPolicy();
+  void TestLockFreeGet();
+  void TestConcurrentReadersAndWriters();
+  void TestClockReplacement();
   void TestSnapshot();
+  void TestRawSnapshot();
   void TestRegisterSnapshotFileCache();
   void TestCheckpointAndRestore();
 
@@ -72,6 +77,14 @@ class SharedMemCacheTestBase : public CacheTestBase {
   void CheckDelete(const char* key);
   void TestReaderWriterChild();
 
+  // Helpers for TestConcurrentReadersAndWriters.
+  SharedMemCache<kBlockSize>* MakeConcurrentCache();
+  GoogleString ConcurrentValue(int key, int generation);
+  // Returns false if a lookup of key produced a torn value.
+  bool CheckConcurrentRead(SharedMemCache<kBlockSize>* cache, int key);
+  void TestConcurrentWriterChild();
+  void TestConcurrentReaderChild();
+
   scoped_ptr<SharedMemTestEnv> test_env_;
   scoped_ptr<AbstractSharedMem> shmem_runtime_;
   scoped_ptr<SharedMemCache<kBlockSize> > cache_;
@@ -158,10 +171,30 @@ TYPED_TEST_P(SharedMemCacheTestTemplate, TestEvict) {
   SharedMemCacheTestBase::TestEvict();
 }
 
+TYPED_TEST_P(SharedMemCacheTestTemplate, TestAdmissionPolicy) {
+  SharedMemCacheTestBase::TestAdmissionPolicy();
+}
+
+TYPED_TEST_P(SharedMemCacheTestTemplate, TestLockFreeGet) {
+  SharedMemCacheTestBase::TestLockFreeGet();
+}
+
+TYPED_TEST_P(SharedMemCacheTestTemplate, TestConcurrentReadersAndWriters) {
+  SharedMemCacheTestBase::TestConcurrentReadersAndWriters();
+}
+
+TYPED_TEST_P(SharedMemCacheTestTemplate, TestClockReplacement) {
+  SharedMemCacheTestBase::TestClockReplacement();
+}
+
 TYPED_TEST_P(SharedMemCacheTestTemplate, TestSnapshot) {
   SharedMemCacheTestBase::TestSnapshot();
 }
 
+TYPED_TEST_P(SharedMemCacheTestTemplate, TestRawSnapshot) {
+  SharedMemCacheTestBase::TestRawSnapshot();
+}
+
 TYPED_TEST_P(SharedMemCacheTestTemplate, TestRegisterSnapshotFileCache) {
   SharedMemCacheTestBase::TestRegisterSnapshotFileCache();
 }
@@ -172,8 +205,10 @@ TYPED_TEST_P(SharedMemCacheTestTemplate, TestCheckpointAndRestore) {
 
 REGISTER_TYPED_TEST_CASE_P(SharedMemCacheTestTemplate, TestBasic, TestReinsert,
                            TestReplacement, TestReaderWriter, TestConflict,
-                           TestEvict, TestSnapshot,
-                           TestRegisterSnapshotFileCache,
+                           TestEvict, TestAdmissionPolicy, TestLockFreeGet,
+                           TestConcurrentReadersAndWriters,
+                           TestClockReplacement, TestSnapshot,
+                           TestRawSnapshot, TestRegisterSnapshotFileCache,
                            TestCheckpointAndRestore);
 
 }  // namespace net_instaweb
@@ -0,0 +1,668 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/sharedmem/slab_shared_mem_cache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/atomicops.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/stl_util.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
+#include "pagespeed/kernel/sharedmem/shared_mem_cache.h"
+#include "pagespeed/kernel/sharedmem/shared_mem_cache_data.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// Blocks of data per entry each class is dimensioned for.  Values only go to
+// a class when its block size suits them, so this is about the same for all
+// of them; 2 is what the single-class metadata cache uses.
+const int kBlockEntryRatio = 2;
+
+// Per-block overhead, for the block successor list.
+const size_t kBlockOverhead = 4;
+
+// How much more memory than the tightest fit, in eighths, a value may take
+// up in a class with larger blocks.  Smaller blocks always fit best, or
+// nearly so, but make for long chains that take longer to copy in and out.
+const size_t kSlackEighths = 1;
+
+// Slots per set of the directory; 16 4-byte slots fill a cache line.
+const int kSlotsPerSet = 16;
+
+// Directory slots per entry of the classes, so that sets rarely overflow.
+const int kSlotsPerEntry = 2;
+
+GoogleString ClassSegment(const GoogleString& filename, size_t block_size) {
+  return StrCat(filename, "/slab", IntegerToString(block_size));
+}
+
+GoogleString DirectorySegment(const GoogleString& filename) {
+  return StrCat(filename, "/slab_directory");
+}
+
+uint64 HashBytesToUint64(const char* bytes, int num_bytes) {
+  uint64 result = 0;
+  for (int i = 0; i < num_bytes; ++i) {
+    result = (result << 8) | static_cast<uint8>(bytes[i]);
+  }
+  return result;
+}
+
+double Percent(int64 portion, int64 total) {
+  return (total == 0) ? 0.0 : (100.0 * portion) / total;
+}
+
+}  // namespace
+
+// Maps keys to the class they're stored in.  The directory is a hash table
+// of kSlotsPerSet-way sets of 32-bit slots, in shared memory.  Each slot
+// holds 29 bits of a key's hash as a tag, and the class number plus one in
+// the low 3 bits, with 0 meaning an empty slot.  Readers scan a set without
+// locking; writers hold the mutex of the set's shard.
+//
+// When a set is full, a new key takes over the slot picked by its hash.  The
+// key that had the slot is then unreachable, even if its class still holds
+// it, which costs some space until the class evicts it but is otherwise the
+// same as a miss.
+class SlabSharedMemCache::Directory {
+ public:
+  // Marks keys found in more than one class while rebuilding.
+  static const int kConflict = 7;
+  static const int kMaxClasses = kConflict - 1;
+
+  Directory(AbstractSharedMem* shm_runtime, const GoogleString& filename,
+            int shards, int64 slots, MessageHandler* handler)
+      : shm_runtime_(shm_runtime),
+        filename_(filename),
+        num_shards_(shards),
+        num_sets_(std::max<int64>(1, (slots + kSlotsPerSet - 1) /
+                                         kSlotsPerSet)),
+        handler_(handler),
+        slots_(NULL) {
+    size_t mutex_bytes = num_shards_ * shm_runtime_->SharedMutexSize();
+    slots_offset_ = ((mutex_bytes + 63) / 64) * 64;
+  }
+
+  ~Directory() {
+    STLDeleteElements(&mutexes_);
+  }
+
+  bool Initialize() {
+    if (!Init(true)) {
+      return false;
+    }
+    for (int s = 0; s < num_shards_; ++s) {
+      if (!segment_->InitializeSharedMutex(
+              s * shm_runtime_->SharedMutexSize(), handler_)) {
+        return false;
+      }
+    }
+    Clear();
+    return AttachMutexes();
+  }
+
+  bool Attach() {
+    return Init(false) && AttachMutexes();
+  }
+
+  static void GlobalCleanup(AbstractSharedMem* shm_runtime,
+                            const GoogleString& filename,
+                            MessageHandler* handler) {
+    shm_runtime->DestroySegment(DirectorySegment(filename), handler);
+  }
+
+  // Forgets all keys.  Must not be called concurrently with other use.
+  void Clear() {
+    std::memset(slots_, 0, num_sets_ * kSlotsPerSet * sizeof(*slots_));
+  }
+
+  // Returns the class raw_hash is in, or -1 if unknown.
+  int Lookup(const GoogleString& raw_hash) {
+    base::subtle::Atomic32* set = SetFor(raw_hash);
+    uint32 tag = Tag(raw_hash);
+    for (int i = 0; i < kSlotsPerSet; ++i) {
+      uint32 slot = base::subtle::Acquire_Load(&set[i]);
+      if ((slot != 0) && (SlotTag(slot) == tag)) {
+        int code = slot & kConflict;
+        return (code == kConflict) ? -1 : code - 1;
+      }
+    }
+    return -1;
+  }
+
+  // Records that raw_hash is now in class_num, or in no class if class_num
+  // is -1, and returns the class it was in before, -1 if none was recorded,
+  // or kConflict if it may be in any of them.
+  int Update(const GoogleString& raw_hash, int class_num) {
+    base::subtle::Atomic32* set = SetFor(raw_hash);
+    uint32 tag = Tag(raw_hash);
+    uint32 new_slot =
+        (class_num < 0) ? 0 : ((tag << 3) | static_cast<uint32>(class_num + 1));
+    ScopedMutex lock(ShardMutexFor(raw_hash));
+    int free_slot = -1;
+    for (int i = 0; i < kSlotsPerSet; ++i) {
+      uint32 slot = base::subtle::NoBarrier_Load(&set[i]);
+      if (slot == 0) {
+        if (free_slot < 0) {
+          free_slot = i;
+        }
+      } else if (SlotTag(slot) == tag) {
+        base::subtle::Release_Store(&set[i], new_slot);
+        int code = slot & kConflict;
+        return (code == kConflict) ? kConflict : code - 1;
+      }
+    }
+    if (new_slot != 0) {
+      if (free_slot < 0) {
+        free_slot = static_cast<uint8>(raw_hash[kVictimByte]) % kSlotsPerSet;
+      }
+      base::subtle::Release_Store(&set[free_slot], new_slot);
+    }
+    return -1;
+  }
+
+  // Like Update, but if raw_hash is already recorded in a different class,
+  // marks it as being in conflict so lookups miss it, since there's no
+  // telling which copy is current.
+  void Restore(const GoogleString& raw_hash, int class_num) {
+    base::subtle::Atomic32* set = SetFor(raw_hash);
+    uint32 tag = Tag(raw_hash);
+    ScopedMutex lock(ShardMutexFor(raw_hash));
+    for (int i = 0; i < kSlotsPerSet; ++i) {
+      uint32 slot = base::subtle::NoBarrier_Load(&set[i]);
+      if (slot == 0) {
+        base::subtle::Release_Store(
+            &set[i], (tag << 3) | static_cast<uint32>(class_num + 1));
+        return;
+      } else if (SlotTag(slot) == tag) {
+        if ((slot & kConflict) != static_cast<uint32>(class_num + 1)) {
+          base::subtle::Release_Store(&set[i], (tag << 3) | kConflict);
+        }
+        return;
+      }
+    }
+    // Keys that don't fit are simply left out; they're misses.
+  }
+
+  size_t SegmentSize() const {
+    return slots_offset_ + num_sets_ * kSlotsPerSet * sizeof(*slots_);
+  }
+
+ private:
+  // The tag comes from the first 4 bytes of the hash, the set from the 8
+  // after it, and the slot to take over in a full set from the one after.
+  static const int kSetByte = 4;
+  static const int kVictimByte = 12;
+
+  bool Init(bool parent) {
+    GoogleString name = DirectorySegment(filename_);
+    if (parent) {
+      segment_.reset(
+          shm_runtime_->CreateSegment(name, SegmentSize(), handler_));
+    } else {
+      segment_.reset(
+          shm_runtime_->AttachToSegment(name, SegmentSize(), handler_));
+    }
+    if (segment_.get() == NULL) {
+      handler_->Message(
+          kError, "SlabSharedMemCache: can't %s directory segment %s",
+          parent ? "create" : "attach", name.c_str());
+      return false;
+    }
+    slots_ = reinterpret_cast<base::subtle::Atomic32*>(
+        const_cast<char*>(segment_->Base()) + slots_offset_);
+    return true;
+  }
+
+  bool AttachMutexes() {
+    STLDeleteElements(&mutexes_);
+    for (int s = 0; s < num_shards_; ++s) {
+      AbstractMutex* mutex = segment_->AttachToSharedMutex(
+          s * shm_runtime_->SharedMutexSize());
+      if (mutex == NULL) {
+        return false;
+      }
+      mutexes_.push_back(mutex);
+    }
+    return true;
+  }
+
+  static uint32 Tag(const GoogleString& raw_hash) {
+    return HashBytesToUint64(raw_hash.data(), 4) >> 3;
+  }
+
+  static uint32 SlotTag(uint32 slot) { return slot >> 3; }
+
+  int64 SetNum(const GoogleString& raw_hash) const {
+    return HashBytesToUint64(raw_hash.data() + kSetByte, 8) % num_sets_;
+  }
+
+  base::subtle::Atomic32* SetFor(const GoogleString& raw_hash) {
+    DCHECK_LT(kVictimByte, static_cast<int>(raw_hash.size()));
+    return slots_ + SetNum(raw_hash) * kSlotsPerSet;
+  }
+
+  AbstractMutex* ShardMutexFor(const GoogleString& raw_hash) {
+    return mutexes_[SetNum(raw_hash) % num_shards_];
+  }
+
+  AbstractSharedMem* shm_runtime_;
+  GoogleString filename_;
+  int num_shards_;
+  int64 num_sets_;
+  size_t slots_offset_;
+  MessageHandler* handler_;
+  scoped_ptr<AbstractSharedMemSegment> segment_;
+  base::subtle::Atomic32* slots_;
+  std::vector<AbstractMutex*> mutexes_;
+
+  DISALLOW_COPY_AND_ASSIGN(Directory);
+};
+
+// Type-independent interface to the SharedMemCache of one class.
+class SlabSharedMemCache::SlabClass {
+ public:
+  SlabClass() {}
+  virtual ~SlabClass() {}
+
+  virtual size_t block_size() const = 0;
+  virtual CacheInterface* cache() = 0;
+  virtual bool Initialize() = 0;
+  virtual bool Attach() = 0;
+  virtual void RegisterSnapshotFileCache(FileCache* potential_file_cache,
+                                         int checkpoint_interval_sec) = 0;
+  virtual void set_clock_replacement(bool clock_replacement) = 0;
+  virtual void set_raw_snapshots(bool raw_snapshots) = 0;
+  virtual void set_admission_policy(FrequencyAdmissionPolicy* policy) = 0;
+  virtual int num_entries() const = 0;
+  virtual int num_blocks() const = 0;
+  virtual int num_sectors() const = 0;
+  virtual int64 size_cap() const = 0;
+  virtual size_t MaxValueSize() const = 0;
+  virtual GoogleString ToRawHash(const GoogleString& key) = 0;
+  virtual void GetWithRawHash(const GoogleString& key,
+                              const GoogleString& raw_hash,
+                              CacheInterface::Callback* callback) = 0;
+  virtual void AppendSectorRawHashes(int sector_num,
+                                     StringVector* raw_hashes) = 0;
+  virtual void AggregateStats(SharedMemCacheData::SectorStats* stats) = 0;
+  virtual GoogleString DumpStats() = 0;
+  virtual void SanityCheck() = 0;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(SlabClass);
+};
+
+template<size_t kBlockSize>
+class SlabSharedMemCache::SlabClassImpl : public SlabSharedMemCache::SlabClass {
+ public:
+  typedef SharedMemCache<kBlockSize> Cache;
+
+  SlabClassImpl(AbstractSharedMem* shm_runtime, const GoogleString& filename,
+                Timer* timer, const Hasher* hasher, int sectors,
+                int64 size_kb, MessageHandler* handler) {
+    int entries, blocks;
+    Cache::ComputeDimensions(size_kb, kBlockEntryRatio, sectors, &entries,
+                             &blocks, &size_cap_);
+    num_blocks_ = blocks * sectors;
+    cache_.reset(new Cache(shm_runtime, ClassSegment(filename, kBlockSize),
+                           timer, hasher, sectors, entries, blocks, handler));
+  }
+
+  static void GlobalCleanup(AbstractSharedMem* shm_runtime,
+                            const GoogleString& filename,
+                            MessageHandler* handler) {
+    Cache::GlobalCleanup(shm_runtime, ClassSegment(filename, kBlockSize),
+                         handler);
+  }
+
+  virtual size_t block_size() const { return kBlockSize; }
+  virtual CacheInterface* cache() { return cache_.get(); }
+  virtual bool Initialize() { return cache_->Initialize(); }
+  virtual bool Attach() { return cache_->Attach(); }
+  virtual void RegisterSnapshotFileCache(FileCache* potential_file_cache,
+                                         int checkpoint_interval_sec) {
+    cache_->RegisterSnapshotFileCache(potential_file_cache,
+                                      checkpoint_interval_sec);
+  }
+  virtual void set_clock_replacement(bool clock_replacement) {
+    cache_->set_touch_mode(clock_replacement ? Cache::kTouchClock
+                                             : Cache::kTouchLru);
+  }
+  virtual void set_raw_snapshots(bool raw_snapshots) {
+    cache_->set_snapshot_format(raw_snapshots ? Cache::kSnapshotRawImage
+                                              : Cache::kSnapshotProtobuf);
+  }
+  virtual void set_admission_policy(FrequencyAdmissionPolicy* policy) {
+    cache_->set_admission_policy(policy);
+  }
+  virtual int num_entries() const { return cache_->num_entries(); }
+  virtual int num_blocks() const { return num_blocks_; }
+  virtual int num_sectors() const { return cache_->num_sectors(); }
+  virtual int64 size_cap() const { return size_cap_; }
+  virtual size_t MaxValueSize() const { return cache_->MaxValueSize(); }
+  virtual GoogleString ToRawHash(const GoogleString& key) {
+    return cache_->ToRawHash(key);
+  }
+  virtual void GetWithRawHash(const GoogleString& key,
+                              const GoogleString& raw_hash,
+                              CacheInterface::Callback* callback) {
+    cache_->GetWithRawHash(key, raw_hash, callback);
+  }
+  virtual void AppendSectorRawHashes(int sector_num,
+                                     StringVector* raw_hashes) {
+    cache_->AppendSectorRawHashes(sector_num, raw_hashes);
+  }
+  virtual void AggregateStats(SharedMemCacheData::SectorStats* stats) {
+    cache_->AggregateStats(stats);
+  }
+  virtual GoogleString DumpStats() { return cache_->DumpStats(); }
+  virtual void SanityCheck() { cache_->SanityCheck(); }
+
+ private:
+  scoped_ptr<Cache> cache_;
+  int num_blocks_;
+  int64 size_cap_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlabClassImpl);
+};
+
+// The classes and the percentage of the memory each gets.  Metadata values
+// are mostly a few hundred bytes, with a tail of inlined resources running
+// into kilobytes.  The block sizes listed here and in GlobalCleanup need
+// SharedMemCache instantiations in shared_mem_cache.cc.
+SlabSharedMemCache::SlabSharedMemCache(
+    AbstractSharedMem* shm_runtime, const GoogleString& filename,
+    Timer* timer, const Hasher* hasher, int sectors, int64 size_kb,
+    MessageHandler* handler) {
+  classes_.push_back(new SlabClassImpl<64>(
+      shm_runtime, filename, timer, hasher, sectors, size_kb * 20 / 100,
+      handler));
+  classes_.push_back(new SlabClassImpl<256>(
+      shm_runtime, filename, timer, hasher, sectors, size_kb * 30 / 100,
+      handler));
+  classes_.push_back(new SlabClassImpl<1024>(
+      shm_runtime, filename, timer, hasher, sectors, size_kb * 30 / 100,
+      handler));
+  classes_.push_back(new SlabClassImpl<4096>(
+      shm_runtime, filename, timer, hasher, sectors, size_kb * 20 / 100,
+      handler));
+  DCHECK_LE(num_classes(), Directory::kMaxClasses);
+
+  int64 total_entries = 0;
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    total_entries += classes_[c]->num_entries();
+  }
+  directory_.reset(new Directory(shm_runtime, filename, sectors,
+                                 total_entries * kSlotsPerEntry, handler));
+}
+
+SlabSharedMemCache::~SlabSharedMemCache() {
+  STLDeleteElements(&classes_);
+}
+
+bool SlabSharedMemCache::Initialize() {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    if (!classes_[c]->Initialize()) {
+      return false;
+    }
+  }
+  if (!directory_->Initialize()) {
+    return false;
+  }
+  RebuildDirectory();
+  return true;
+}
+
+bool SlabSharedMemCache::Attach() {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    if (!classes_[c]->Attach()) {
+      return false;
+    }
+  }
+  return directory_->Attach();
+}
+
+void SlabSharedMemCache::RebuildDirectoryForTesting() {
+  directory_->Clear();
+  RebuildDirectory();
+}
+
+void SlabSharedMemCache::RebuildDirectory() {
+  // The classes may have been restored from snapshots, so index what they
+  // hold.  A sector at a time keeps the hash list short.
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    for (int sector = 0; sector < classes_[c]->num_sectors(); ++sector) {
+      StringVector raw_hashes;
+      classes_[c]->AppendSectorRawHashes(sector, &raw_hashes);
+      for (int i = 0, m = raw_hashes.size(); i < m; ++i) {
+        directory_->Restore(raw_hashes[i], c);
+      }
+    }
+  }
+}
+
+void SlabSharedMemCache::GlobalCleanup(AbstractSharedMem* shm_runtime,
+                                       const GoogleString& filename,
+                                       MessageHandler* message_handler) {
+  SlabClassImpl<64>::GlobalCleanup(shm_runtime, filename, message_handler);
+  SlabClassImpl<256>::GlobalCleanup(shm_runtime, filename, message_handler);
+  SlabClassImpl<1024>::GlobalCleanup(shm_runtime, filename, message_handler);
+  SlabClassImpl<4096>::GlobalCleanup(shm_runtime, filename, message_handler);
+  Directory::GlobalCleanup(shm_runtime, filename, message_handler);
+}
+
+void SlabSharedMemCache::RegisterSnapshotFileCache(
+    FileCache* potential_file_cache, int checkpoint_interval_sec) {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    classes_[c]->RegisterSnapshotFileCache(potential_file_cache,
+                                           checkpoint_interval_sec);
+  }
+}
+
+bool SlabSharedMemCache::CheckDimensions(size_t min_value_cap,
+                                         GoogleString* error_msg) const {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    size_t needed = classes_[(c + 1 < n) ? c + 1 : c]->block_size();
+    if (classes_[c]->size_cap() < static_cast<int64>(needed)) {
+      *error_msg = StrCat(
+          "class with ", IntegerToString(classes_[c]->block_size()),
+          "-byte blocks can only store values up to ",
+          Integer64ToString(classes_[c]->size_cap()), " bytes, not ",
+          IntegerToString(needed));
+      return false;
+    }
+  }
+  if (classes_.back()->size_cap() < static_cast<int64>(min_value_cap)) {
+    *error_msg = StrCat(
+        "largest values stored would be ",
+        Integer64ToString(classes_.back()->size_cap()), " bytes, under ",
+        IntegerToString(min_value_cap));
+    return false;
+  }
+  return true;
+}
+
+void SlabSharedMemCache::set_clock_replacement(bool clock_replacement) {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    classes_[c]->set_clock_replacement(clock_replacement);
+  }
+}
+
+void SlabSharedMemCache::set_raw_snapshots(bool raw_snapshots) {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    classes_[c]->set_raw_snapshots(raw_snapshots);
+  }
+}
+
+void SlabSharedMemCache::EnableAdmissionFilter(ThreadSystem* thread_system) {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    classes_[c]->set_admission_policy(new FrequencyAdmissionPolicy(
+        classes_[c]->num_entries(), thread_system->NewMutex()));
+  }
+}
+
+size_t SlabSharedMemCache::MaxValueSize() const {
+  size_t max_size = 0;
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    max_size = std::max(max_size, classes_[c]->MaxValueSize());
+  }
+  return max_size;
+}
+
+size_t SlabSharedMemCache::class_block_size(int class_num) const {
+  return classes_[class_num]->block_size();
+}
+
+int SlabSharedMemCache::ClassForValueSize(size_t value_size) const {
+  // Find how much memory the value needs in each class, counting the block
+  // successor list, and pick the class with the largest blocks that's
+  // within kSlackEighths of the tightest fit.
+  std::vector<size_t> footprints(classes_.size(), 0);
+  size_t min_footprint = 0;
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    if (value_size > classes_[c]->MaxValueSize()) {
+      continue;
+    }
+    size_t block_size = classes_[c]->block_size();
+    size_t blocks = std::max<size_t>(
+        1, (value_size + block_size - 1) / block_size);
+    footprints[c] = blocks * (block_size + kBlockOverhead);
+    if (min_footprint == 0 || footprints[c] < min_footprint) {
+      min_footprint = footprints[c];
+    }
+  }
+  for (int c = classes_.size() - 1; c >= 0; --c) {
+    if (footprints[c] != 0 &&
+        footprints[c] * 8 <= min_footprint * (8 + kSlackEighths)) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+void SlabSharedMemCache::AggregateClassStats(
+    int class_num, SharedMemCacheData::SectorStats* stats) {
+  classes_[class_num]->AggregateStats(stats);
+}
+
+GoogleString SlabSharedMemCache::DumpStats() {
+  GoogleString out;
+  StringAppendF(&out, "%-12s%-20s%-20s%-22s%s\n", "Block size",
+                "Entries used", "Blocks used", "Payload/block space",
+                "Hits");
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    SlabClass* slab_class = classes_[c];
+    SharedMemCacheData::SectorStats stats;
+    slab_class->AggregateStats(&stats);
+    GoogleString entries = StringPrintf(
+        "%s (%.1f%%)", Integer64ToString(stats.used_entries).c_str(),
+        Percent(stats.used_entries, slab_class->num_entries()));
+    GoogleString blocks = StringPrintf(
+        "%s (%.1f%%)", Integer64ToString(stats.used_blocks).c_str(),
+        Percent(stats.used_blocks, slab_class->num_blocks()));
+    GoogleString payload = StringPrintf(
+        "%.1f%%", Percent(stats.used_bytes,
+                          stats.used_blocks * slab_class->block_size()));
+    StringAppendF(&out, "%-12s%-20s%-20s%-22s%s\n",
+                  IntegerToString(slab_class->block_size()).c_str(),
+                  entries.c_str(), blocks.c_str(), payload.c_str(),
+                  Integer64ToString(stats.num_get_hit).c_str());
+  }
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    StrAppend(&out, "\nSlab class ",
+              IntegerToString(classes_[c]->block_size()), ":\n",
+              classes_[c]->DumpStats());
+  }
+  return out;
+}
+
+void SlabSharedMemCache::SanityCheck() {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    classes_[c]->SanityCheck();
+  }
+}
+
+int SlabSharedMemCache::DirectoryClassForKey(const GoogleString& key) {
+  return directory_->Lookup(classes_[0]->ToRawHash(key));
+}
+
+void SlabSharedMemCache::Get(const GoogleString& key, Callback* callback) {
+  // All the classes share a hasher, so the hash that finds the key in the
+  // directory also finds it in its class.
+  GoogleString raw_hash = classes_[0]->ToRawHash(key);
+  int class_num = directory_->Lookup(raw_hash);
+  if (class_num >= 0) {
+    SynchronousCallback probe;
+    classes_[class_num]->GetWithRawHash(key, raw_hash, &probe);
+    if (probe.state() == kAvailable) {
+      callback->set_value(probe.value());
+      ValidateAndReportResult(key, kAvailable, callback);
+      return;
+    }
+  }
+  ValidateAndReportResult(key, kNotFound, callback);
+}
+
+void SlabSharedMemCache::Put(const GoogleString& key,
+                             const SharedString& value) {
+  // Store the value before pointing the directory at it, so a lookup
+  // never goes to a class the value isn't in yet.
+  int target = ClassForValueSize(value.size());
+  if (target >= 0) {
+    classes_[target]->cache()->Put(key, value);
+  }
+  int previous = directory_->Update(classes_[0]->ToRawHash(key), target);
+  if (previous == Directory::kConflict) {
+    DeleteFromOtherClasses(key, target);
+  } else if ((previous >= 0) && (previous != target)) {
+    classes_[previous]->cache()->Delete(key);
+  }
+}
+
+void SlabSharedMemCache::Delete(const GoogleString& key) {
+  int previous = directory_->Update(classes_[0]->ToRawHash(key), -1);
+  if (previous == Directory::kConflict) {
+    DeleteFromOtherClasses(key, -1);
+  } else if (previous >= 0) {
+    classes_[previous]->cache()->Delete(key);
+  }
+}
+
+void SlabSharedMemCache::DeleteFromOtherClasses(const GoogleString& key,
+                                                int keep_class) {
+  for (int c = 0, n = classes_.size(); c < n; ++c) {
+    if (c != keep_class) {
+      classes_[c]->cache()->Delete(key);
+    }
+  }
+}
+
+}  // namespace net_instaweb
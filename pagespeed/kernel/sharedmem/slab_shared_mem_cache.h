@@ -0,0 +1,143 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_SHAREDMEM_SLAB_SHARED_MEM_CACHE_H_
+#define PAGESPEED_KERNEL_SHAREDMEM_SLAB_SHARED_MEM_CACHE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/cache_interface.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/sharedmem/shared_mem_cache_data.h"
+
+namespace net_instaweb {
+
+class AbstractSharedMem;
+class FileCache;
+class Hasher;
+class MessageHandler;
+class ThreadSystem;
+class Timer;
+
+// A shared memory cache that splits its memory between several block-size
+// classes, each a SharedMemCache of its own, and stores every value in the
+// class that fits it best.  With a single block size, small values waste
+// most of their last block while large ones need long block chains; giving
+// each its own class lets the same amount of memory hold more entries.
+//
+// Memory is divided between the classes in fixed proportions.  A directory
+// in its own shared memory segment records which class each key was last
+// stored in, so a lookup only touches the one class that may hold the key,
+// and a miss on a key the directory doesn't know touches none.  When a Put
+// moves a key to a different class, the copy in the old class is deleted so
+// it can't come back.  The directory is rebuilt from the classes' contents
+// when they're restored from snapshots.
+class SlabSharedMemCache : public CacheInterface {
+ public:
+  // Like SharedMemCache, this only records settings: Initialize or Attach
+  // must be called before use.  size_kb is split between the classes, each
+  // of which gets 'sectors' sectors.  filename is used as a prefix for the
+  // classes' shared memory segments.
+  SlabSharedMemCache(AbstractSharedMem* shm_runtime,
+                     const GoogleString& filename, Timer* timer,
+                     const Hasher* hasher, int sectors, int64 size_kb,
+                     MessageHandler* handler);
+  virtual ~SlabSharedMemCache();
+
+  // See the SharedMemCache methods of the same names.
+  bool Initialize();
+  bool Attach();
+  static void GlobalCleanup(AbstractSharedMem* shm_runtime,
+                            const GoogleString& filename,
+                            MessageHandler* message_handler);
+  void RegisterSnapshotFileCache(FileCache* potential_file_cache,
+                                 int checkpoint_interval_sec);
+
+  // Returns whether every class is big enough to be of use: each must be
+  // able to store values as big as the next class's blocks (or its own
+  // blocks, for the largest class), and the largest values the cache takes
+  // must be at least min_value_cap bytes.  Otherwise, explains in
+  // *error_msg.  This only looks at the configured dimensions, so it can be
+  // called before Initialize.
+  bool CheckDimensions(size_t min_value_cap, GoogleString* error_msg) const;
+
+  // These apply the corresponding SharedMemCache settings to every class,
+  // and must be called before Initialize.
+  void set_clock_replacement(bool clock_replacement);
+  void set_raw_snapshots(bool raw_snapshots);
+  void EnableAdmissionFilter(ThreadSystem* thread_system);
+
+  // Returns the largest size of an object this cache can store.
+  size_t MaxValueSize() const;
+
+  int num_classes() const { return classes_.size(); }
+  size_t class_block_size(int class_num) const;
+
+  // Returns which class a value of the given size is stored in, or -1 if it
+  // is too big for all of them.
+  int ClassForValueSize(size_t value_size) const;
+
+  // Sums up the statistics of all sectors of the given class into *stats,
+  // which should be freshly constructed.
+  void AggregateClassStats(int class_num,
+                           SharedMemCacheData::SectorStats* stats);
+
+  // Returns per-class occupancy and fragmentation, followed by the
+  // statistics of each class, as plaintext.
+  GoogleString DumpStats();
+
+  void SanityCheck();
+
+  // Returns the class the directory has the key in, or -1 if none.
+  int DirectoryClassForKey(const GoogleString& key);
+
+  // Clears the directory and rebuilds it from the contents of the classes,
+  // as Initialize does after restoring them.
+  void RebuildDirectoryForTesting();
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, const SharedString& value);
+  virtual void Delete(const GoogleString& key);
+  static GoogleString FormatName() { return "SlabSharedMemCache"; }
+  virtual GoogleString Name() const { return FormatName(); }
+
+  virtual bool IsBlocking() const { return true; }
+  virtual bool IsHealthy() const { return true; }
+  virtual void ShutDown() {}
+
+ private:
+  class Directory;
+  class SlabClass;
+  template<size_t kBlockSize> class SlabClassImpl;
+
+  void RebuildDirectory();
+
+  // Deletes key from every class but keep_class.
+  void DeleteFromOtherClasses(const GoogleString& key, int keep_class);
+
+  std::vector<SlabClass*> classes_;  // In increasing order of block size.
+  scoped_ptr<Directory> directory_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlabSharedMemCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_SHAREDMEM_SLAB_SHARED_MEM_CACHE_H_
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/sharedmem/slab_shared_mem_cache_test_base.h"
+
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/sharedmem/shared_mem_cache_data.h"
+#include "pagespeed/kernel/util/platform.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kSegment[] = "slab_cache";
+const int kSectors = 2;
+const int kSizeKb = 4096;
+
+}  // namespace
+
+SlabSharedMemCacheTestBase::SlabSharedMemCacheTestBase(SharedMemTestEnv* env)
+    : test_env_(env),
+      shmem_runtime_(env->CreateSharedMemRuntime()),
+      thread_system_(Platform::CreateThreadSystem()),
+      handler_(thread_system_->NewMutex()),
+      timer_(thread_system_->NewMutex(), 0) {
+  cache_.reset(new SlabSharedMemCache(shmem_runtime_.get(), kSegment, &timer_,
+                                      &hasher_, kSectors, kSizeKb, &handler_));
+  EXPECT_TRUE(cache_->Initialize());
+}
+
+void SlabSharedMemCacheTestBase::TearDown() {
+  cache_->SanityCheck();
+  SlabSharedMemCache::GlobalCleanup(shmem_runtime_.get(), kSegment, &handler_);
+  CacheTestBase::TearDown();
+}
+
+int64 SlabSharedMemCacheTestBase::UsedEntries(int class_num) {
+  SharedMemCacheData::SectorStats stats;
+  cache_->AggregateClassStats(class_num, &stats);
+  return stats.used_entries;
+}
+
+int64 SlabSharedMemCacheTestBase::NumGets(int class_num) {
+  SharedMemCacheData::SectorStats stats;
+  cache_->AggregateClassStats(class_num, &stats);
+  return stats.num_get;
+}
+
+void SlabSharedMemCacheTestBase::TestBasic() {
+  CheckNotFound("404");
+  CheckPut("200", "OK");
+  CheckGet("200", "OK");
+
+  GoogleString medium(700, 'm');
+  GoogleString large(10000, 'L');
+  CheckPut("medium", medium);
+  CheckPut("large", large);
+  CheckGet("200", "OK");
+  CheckGet("medium", medium);
+  CheckGet("large", large);
+
+  CheckDelete("medium");
+  CheckNotFound("medium");
+  CheckGet("large", large);
+}
+
+void SlabSharedMemCacheTestBase::TestClassForValueSize() {
+  ASSERT_EQ(4, cache_->num_classes());
+  EXPECT_EQ(64, cache_->class_block_size(0));
+  EXPECT_EQ(256, cache_->class_block_size(1));
+  EXPECT_EQ(1024, cache_->class_block_size(2));
+  EXPECT_EQ(4096, cache_->class_block_size(3));
+
+  EXPECT_EQ(0, cache_->ClassForValueSize(0));
+  EXPECT_EQ(0, cache_->ClassForValueSize(64));
+  EXPECT_EQ(0, cache_->ClassForValueSize(150));
+  EXPECT_EQ(0, cache_->ClassForValueSize(300));
+
+  // 4 blocks of 64 bytes take up more room than one of 256 once the block
+  // successor list is counted.
+  EXPECT_EQ(1, cache_->ClassForValueSize(200));
+
+  // 3 blocks of 256 bytes are a little bigger than 11 of 64, but close
+  // enough to be worth the shorter chain.
+  EXPECT_EQ(1, cache_->ClassForValueSize(700));
+  EXPECT_EQ(2, cache_->ClassForValueSize(1000));
+
+  // Chaining five 1k blocks wastes less than two 4k ones, but a single 4k
+  // block beats four 1k ones.
+  EXPECT_EQ(2, cache_->ClassForValueSize(5000));
+  EXPECT_EQ(3, cache_->ClassForValueSize(4000));
+
+  EXPECT_EQ(-1, cache_->ClassForValueSize(cache_->MaxValueSize() + 1));
+}
+
+void SlabSharedMemCacheTestBase::TestValueChangesClass() {
+  CheckPut("key", "small");
+  EXPECT_EQ(1, UsedEntries(0));
+  EXPECT_EQ(0, UsedEntries(3));
+
+  GoogleString large(4000, 'L');
+  CheckPut("key", large);
+  EXPECT_EQ(0, UsedEntries(0));
+  EXPECT_EQ(1, UsedEntries(3));
+  CheckGet("key", large);
+
+  CheckPut("key", "small again");
+  EXPECT_EQ(1, UsedEntries(0));
+  EXPECT_EQ(0, UsedEntries(3));
+  CheckGet("key", "small again");
+}
+
+void SlabSharedMemCacheTestBase::TestTooLarge() {
+  CheckPut("key", "small");
+  GoogleString too_large(cache_->MaxValueSize() + 1, 'X');
+  CheckPut("key", too_large);
+
+  // The old value must not be left around.
+  CheckNotFound("key");
+}
+
+void SlabSharedMemCacheTestBase::TestStats() {
+  CheckPut("a", GoogleString(100, 'a'));
+  CheckPut("b", GoogleString(700, 'b'));
+
+  SharedMemCacheData::SectorStats stats;
+  cache_->AggregateClassStats(1, &stats);
+  EXPECT_EQ(1, stats.used_entries);
+  EXPECT_EQ(3, stats.used_blocks);
+  EXPECT_EQ(700, stats.used_bytes);
+
+  GoogleString dump = cache_->DumpStats();
+  EXPECT_NE(GoogleString::npos, dump.find("Payload/block space"));
+  EXPECT_NE(GoogleString::npos, dump.find("Slab class 4096:"));
+}
+
+void SlabSharedMemCacheTestBase::TestLookupTouchesOneClass() {
+  GoogleString large(4000, 'L');
+  CheckPut("small", "small");
+  CheckPut("large", large);
+  EXPECT_EQ(0, cache_->DirectoryClassForKey("small"));
+  EXPECT_EQ(3, cache_->DirectoryClassForKey("large"));
+  EXPECT_EQ(-1, cache_->DirectoryClassForKey("absent"));
+
+  CheckGet("large", large);
+  EXPECT_EQ(0, NumGets(0));
+  EXPECT_EQ(0, NumGets(1));
+  EXPECT_EQ(0, NumGets(2));
+  EXPECT_EQ(1, NumGets(3));
+
+  // A key the directory doesn't know doesn't get looked up at all.
+  CheckNotFound("absent");
+  for (int c = 0; c < cache_->num_classes(); ++c) {
+    EXPECT_EQ((c == 3) ? 1 : 0, NumGets(c)) << c;
+  }
+
+  CheckDelete("large");
+  EXPECT_EQ(-1, cache_->DirectoryClassForKey("large"));
+  EXPECT_EQ(0, UsedEntries(3));
+}
+
+void SlabSharedMemCacheTestBase::TestRebuildDirectory() {
+  GoogleString medium(700, 'm');
+  GoogleString large(4000, 'L');
+  CheckPut("small", "small");
+  CheckPut("medium", medium);
+  CheckPut("large", large);
+
+  cache_->RebuildDirectoryForTesting();
+  EXPECT_EQ(0, cache_->DirectoryClassForKey("small"));
+  EXPECT_EQ(1, cache_->DirectoryClassForKey("medium"));
+  EXPECT_EQ(3, cache_->DirectoryClassForKey("large"));
+  CheckGet("small", "small");
+  CheckGet("medium", medium);
+  CheckGet("large", large);
+}
+
+void SlabSharedMemCacheTestBase::TestCheckDimensions() {
+  GoogleString error_msg;
+  EXPECT_TRUE(cache_->CheckDimensions(3 * 1024, &error_msg)) << error_msg;
+
+  // Values bigger than the largest class takes.
+  EXPECT_FALSE(cache_->CheckDimensions(cache_->MaxValueSize() + 1,
+                                       &error_msg));
+  EXPECT_NE(GoogleString::npos, error_msg.find("largest values"));
+
+  // With 64k split over 2 sectors, the 1k class only gets 4 entries and 8
+  // blocks a sector, so it can't store anything bigger than 1k, although
+  // values up to 4k are meant for it.
+  SlabSharedMemCache small_cache(shmem_runtime_.get(), "small_slab_cache",
+                                 &timer_, &hasher_, kSectors, 64, &handler_);
+  EXPECT_FALSE(small_cache.CheckDimensions(3 * 1024, &error_msg));
+  EXPECT_EQ("class with 1024-byte blocks can only store values up to 1024 "
+            "bytes, not 4096", error_msg);
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_SHAREDMEM_SLAB_SHARED_MEM_CACHE_TEST_BASE_H_
+#define PAGESPEED_KERNEL_SHAREDMEM_SLAB_SHARED_MEM_CACHE_TEST_BASE_H_
+
+#include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/md5_hasher.h"
+#include "pagespeed/kernel/base/mock_message_handler.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/cache/cache_test_base.h"
+#include "pagespeed/kernel/sharedmem/shared_mem_test_base.h"
+#include "pagespeed/kernel/sharedmem/slab_shared_mem_cache.h"
+
+namespace net_instaweb {
+
+class ThreadSystem;
+
+class SlabSharedMemCacheTestBase : public CacheTestBase {
+ protected:
+  explicit SlabSharedMemCacheTestBase(SharedMemTestEnv* test_env);
+
+  virtual void TearDown();
+
+  virtual SlabSharedMemCache* Cache() { return cache_.get(); }
+
+  void TestBasic();
+  void TestClassForValueSize();
+  void TestValueChangesClass();
+  void TestTooLarge();
+  void TestStats();
+  void TestLookupTouchesOneClass();
+  void TestRebuildDirectory();
+  void TestCheckDimensions();
+
+ private:
+  // Returns the number of entries in use in the given class.
+  int64 UsedEntries(int class_num);
+
+  // Returns the number of lookups the given class has served.
+  int64 NumGets(int class_num);
+
+  scoped_ptr<SharedMemTestEnv> test_env_;
+  scoped_ptr<AbstractSharedMem> shmem_runtime_;
+  scoped_ptr<SlabSharedMemCache> cache_;
+  MD5Hasher hasher_;
+  scoped_ptr<ThreadSystem> thread_system_;
+  MockMessageHandler handler_;
+  MockTimer timer_;
+
+  DISALLOW_COPY_AND_ASSIGN(SlabSharedMemCacheTestBase);
+};
+
+template<typename ConcreteTestEnv>
+class SlabSharedMemCacheTestTemplate : public SlabSharedMemCacheTestBase {
+ public:
+  SlabSharedMemCacheTestTemplate()
+      : SlabSharedMemCacheTestBase(new ConcreteTestEnv) {
+  }
+};
+
+TYPED_TEST_CASE_P(SlabSharedMemCacheTestTemplate);
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestBasic) {
+  SlabSharedMemCacheTestBase::TestBasic();
+}
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestClassForValueSize) {
+  SlabSharedMemCacheTestBase::TestClassForValueSize();
+}
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestValueChangesClass) {
+  SlabSharedMemCacheTestBase::TestValueChangesClass();
+}
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestTooLarge) {
+  SlabSharedMemCacheTestBase::TestTooLarge();
+}
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestStats) {
+  SlabSharedMemCacheTestBase::TestStats();
+}
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestLookupTouchesOneClass) {
+  SlabSharedMemCacheTestBase::TestLookupTouchesOneClass();
+}
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestRebuildDirectory) {
+  SlabSharedMemCacheTestBase::TestRebuildDirectory();
+}
+
+TYPED_TEST_P(SlabSharedMemCacheTestTemplate, TestCheckDimensions) {
+  SlabSharedMemCacheTestBase::TestCheckDimensions();
+}
+
+REGISTER_TYPED_TEST_CASE_P(SlabSharedMemCacheTestTemplate, TestBasic,
+                           TestClassForValueSize, TestValueChangesClass,
+                           TestTooLarge, TestStats, TestLookupTouchesOneClass,
+                           TestRebuildDirectory, TestCheckDimensions);
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_SHAREDMEM_SLAB_SHARED_MEM_CACHE_TEST_BASE_H_
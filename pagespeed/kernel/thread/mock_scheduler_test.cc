@@ -168,6 +168,34 @@ TEST_F(MockSchedulerTest, Cancellation) {
   EXPECT_EQ("124", string_);
 }
 
+// Alarms are filed by millisecond, and by coarser units the further off they
+// are; make sure they still run in order to the microsecond.
+TEST_F(MockSchedulerTest, OrderingAcrossTimeScales) {
+  const int64 kSecondUs = Timer::kSecondUs;
+  AddTask(kDelayMs * Timer::kMsUs, 'g');
+  AddTask(70 * kSecondUs + 2, 'f');
+  Scheduler::Alarm* alarm_to_cancel = AddTask(70 * kSecondUs + 1, 'x');
+  AddTask(70 * kSecondUs, 'e');
+  AddTask(1500, 'c');
+  AddTask(1999, 'd');
+  AddTask(1001, 'b');
+  AddTask(1000, 'a');
+  {
+    ScopedMutex lock(scheduler_->mutex());
+    scheduler_->CancelAlarm(alarm_to_cancel);
+  }
+  AdvanceTimeUs(1500);
+  EXPECT_EQ("abc", string_);
+  AddTask(1600, 'C');  // Later in the same millisecond as 'c'.
+  AddTask(1000, 'B');  // Already due.
+  AdvanceTimeUs(100);
+  EXPECT_EQ("abcBC", string_);
+  AdvanceTimeUs(70 * kSecondUs);
+  EXPECT_EQ("abcBCdef", string_);
+  AdvanceTimeMs(kWaitMs);
+  EXPECT_EQ("abcBCdefg", string_);
+}
+
 // Verifies that we can add a new alarm from an Alarm::Run() method.
 TEST_F(MockSchedulerTest, ChainedAlarms) {
   int count = 10;
@@ -24,8 +24,12 @@
 
 #include "base/logging.h"
 #include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/atomicops.h"
 #include "pagespeed/kernel/base/condvar.h"
 #include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/stl_util.h"
+#include "pagespeed/kernel/base/thread.h"
 #include "pagespeed/kernel/base/thread_annotations.h"
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
@@ -34,6 +38,8 @@
 
 namespace net_instaweb {
 
+const int64 QueuedWorkerPool::kNoDeadline;
+
 namespace {
 
 inline void UpdateWaveform(Waveform* queue_size, int delta) {
@@ -44,8 +50,121 @@ inline void UpdateWaveform(Waveform* queue_size, int delta) {
 
 const size_t kUnboundedQueue = 0;
 
+// The capacity of each worker's run queue.  Must be a power of 2.
+const int kRunQueueCapacity = 1024;
+
 }  // namespace
 
+// A bounded lock-free queue of runnable sequences, which any thread may push
+// to or pop from.  This is Dmitry Vyukov's bounded MPMC queue: each cell
+// carries a sequence number saying whether it is ready to be written or
+// read at a given position, so pushes and pops only contend on the position
+// they claim with a compare-and-swap.
+//
+// A Chase-Lev deque would make pushes by the owning worker cheaper, but
+// sequences mostly become runnable on threads outside the pool.
+class QueuedWorkerPool::RunQueue {
+ public:
+  RunQueue() : enqueue_position_(0), dequeue_position_(0) {
+    for (int i = 0; i < kRunQueueCapacity; ++i) {
+      base::subtle::NoBarrier_Store(&cells_[i].sequence_number, i);
+      cells_[i].sequence = NULL;
+    }
+  }
+
+  // Returns false if the queue is full.
+  bool Push(Sequence* sequence) {
+    Cell* cell;
+    base::subtle::AtomicWord position =
+        base::subtle::NoBarrier_Load(&enqueue_position_);
+    while (true) {
+      cell = &cells_[position & (kRunQueueCapacity - 1)];
+      base::subtle::AtomicWord diff =
+          base::subtle::Acquire_Load(&cell->sequence_number) - position;
+      if (diff == 0) {
+        base::subtle::AtomicWord prev = base::subtle::NoBarrier_CompareAndSwap(
+            &enqueue_position_, position, position + 1);
+        if (prev == position) {
+          break;
+        }
+        position = prev;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = base::subtle::NoBarrier_Load(&enqueue_position_);
+      }
+    }
+    cell->sequence = sequence;
+    base::subtle::Release_Store(&cell->sequence_number, position + 1);
+    return true;
+  }
+
+  // Returns NULL if the queue is empty.
+  Sequence* Pop() {
+    Cell* cell;
+    base::subtle::AtomicWord position =
+        base::subtle::NoBarrier_Load(&dequeue_position_);
+    while (true) {
+      cell = &cells_[position & (kRunQueueCapacity - 1)];
+      base::subtle::AtomicWord diff =
+          base::subtle::Acquire_Load(&cell->sequence_number) - (position + 1);
+      if (diff == 0) {
+        base::subtle::AtomicWord prev = base::subtle::NoBarrier_CompareAndSwap(
+            &dequeue_position_, position, position + 1);
+        if (prev == position) {
+          break;
+        }
+        position = prev;
+      } else if (diff < 0) {
+        return NULL;
+      } else {
+        position = base::subtle::NoBarrier_Load(&dequeue_position_);
+      }
+    }
+    Sequence* sequence = cell->sequence;
+    base::subtle::Release_Store(&cell->sequence_number,
+                                position + kRunQueueCapacity);
+    return sequence;
+  }
+
+ private:
+  struct Cell {
+    volatile base::subtle::AtomicWord sequence_number;
+    Sequence* sequence;
+  };
+
+  // The positions are kept on separate cache lines from each other and
+  // from the cells, so that pushes and pops don't contend.
+  char padding0_[64];
+  Cell cells_[kRunQueueCapacity];
+  char padding1_[64];
+  volatile base::subtle::AtomicWord enqueue_position_;
+  char padding2_[64];
+  volatile base::subtle::AtomicWord dequeue_position_;
+  char padding3_[64];
+
+  DISALLOW_COPY_AND_ASSIGN(RunQueue);
+};
+
+class QueuedWorkerPool::StealingWorker : public ThreadSystem::Thread {
+ public:
+  StealingWorker(QueuedWorkerPool* pool, int index, StringPiece name)
+      : Thread(pool->thread_system_, name, ThreadSystem::kJoinable),
+        pool_(pool),
+        index_(index) {
+  }
+
+  virtual void Run() {
+    pool_->RunStealingWorker(index_);
+  }
+
+ private:
+  QueuedWorkerPool* pool_;
+  int index_;
+
+  DISALLOW_COPY_AND_ASSIGN(StealingWorker);
+};
+
 QueuedWorkerPool::QueuedWorkerPool(
     int max_workers, StringPiece thread_name_base, ThreadSystem* thread_system)
     : thread_system_(thread_system),
@@ -53,7 +172,15 @@ QueuedWorkerPool::QueuedWorkerPool(
       max_workers_(max_workers),
       shutdown_(false),
       queue_size_(NULL),
-      load_shedding_threshold_(kNoLoadShedding) {
+      load_shedding_threshold_(kNoLoadShedding),
+      timer_(NULL),
+      next_queue_order_(0),
+      deadline_streak_(0),
+      on_time_queue_delay_ms_(NULL),
+      background_queue_delay_ms_(NULL),
+      work_stealing_(false),
+      sleep_mutex_(thread_system_->NewMutex()),
+      wakeup_condvar_(sleep_mutex_->NewCondvar()) {
   thread_name_base.CopyToString(&thread_name_base_);
 }
 
@@ -67,6 +194,7 @@ QueuedWorkerPool::~QueuedWorkerPool() {
     sequence->WaitForShutDown();
     delete sequence;
   }
+  STLDeleteElements(&run_queues_);
 }
 
 void QueuedWorkerPool::ShutDown() {
@@ -142,6 +270,7 @@ void QueuedWorkerPool::WaitForShutDownComplete() {
     delete worker;
   }
   available_workers_.clear();
+  StopStealingWorkers();
 }
 
 // Runs computable tasks through a worker.  Note that a first
@@ -169,19 +298,23 @@ QueuedWorkerPool::Sequence* QueuedWorkerPool::AssignWorkerToNextSequence(
   Sequence* sequence = NULL;
   ScopedMutex lock(mutex_.get());
   if (!shutdown_) {
-    if (queued_sequences_.empty()) {
+    if (NumWaitingSequences() == 0) {
       int erased = active_workers_.erase(worker);
       DCHECK_EQ(1, erased);
       available_workers_.push_back(worker);
     } else {
-      sequence = queued_sequences_.front();
-      queued_sequences_.pop_front();
+      sequence = DequeueSequence();
     }
   }
   return sequence;
 }
 
 void QueuedWorkerPool::QueueSequence(Sequence* sequence) {
+  if (work_stealing_) {
+    QueueSequenceForStealing(sequence);
+    return;
+  }
+
   QueuedWorker* worker = NULL;
   Sequence* drop_sequence = NULL;
   {
@@ -198,15 +331,14 @@ void QueuedWorkerPool::QueueSequence(Sequence* sequence) {
         active_workers_.insert(worker);
       } else {
         // No workers available: must queue the sequence.
-        queued_sequences_.push_back(sequence);
+        EnqueueSequence(sequence);
 
         // If too many sequences are waiting, we will cancel the oldest
         // waiting one.
         if ((load_shedding_threshold_ != kNoLoadShedding) &&
-            (queued_sequences_.size() >
+            (NumWaitingSequences() >
              static_cast<size_t>(load_shedding_threshold_))) {
-          drop_sequence = queued_sequences_.front();
-          queued_sequences_.pop_front();
+          drop_sequence = ShedSequence();
         }
       }
     } else {
@@ -215,6 +347,10 @@ void QueuedWorkerPool::QueueSequence(Sequence* sequence) {
       available_workers_.pop_back();
       active_workers_.insert(worker);
     }
+    if ((worker != NULL) && (timer_ != NULL)) {
+      sequence->queued_us_ = timer_->NowUs();
+      RecordQueueDelay(sequence, sequence->queued_us_);
+    }
   }
 
   if (drop_sequence != NULL) {
@@ -230,6 +366,298 @@ void QueuedWorkerPool::QueueSequence(Sequence* sequence) {
   }
 }
 
+bool QueuedWorkerPool::CompareDeadlines::operator()(const Sequence* a,
+                                                    const Sequence* b) const {
+  return QueuedWorkerPool::EarlierDeadline(a, b);
+}
+
+bool QueuedWorkerPool::EarlierDeadline(const Sequence* a, const Sequence* b) {
+  if (a->deadline_us_ != b->deadline_us_) {
+    return a->deadline_us_ < b->deadline_us_;
+  }
+  return a->queue_order_ < b->queue_order_;
+}
+
+void QueuedWorkerPool::EnableDeadlineScheduling(Timer* timer) {
+  DCHECK(all_sequences_.empty());
+  DCHECK(!work_stealing_);
+  timer_ = timer;
+}
+
+void QueuedWorkerPool::SetSequenceDeadline(Sequence* sequence,
+                                           int64 deadline_us) {
+  ScopedMutex lock(mutex_.get());
+  SetSequenceDeadlineMutexHeld(sequence, deadline_us);
+}
+
+void QueuedWorkerPool::SetSequenceDeadlineMutexHeld(Sequence* sequence,
+                                                    int64 deadline_us) {
+  if (!sequence->in_deadline_queue_) {
+    sequence->deadline_us_ = deadline_us;
+    return;
+  }
+
+  // The sequence is waiting, so re-file it under its new deadline, keeping
+  // its place among sequences with the same one.
+  deadline_sequences_.erase(sequence);
+  sequence->deadline_us_ = deadline_us;
+  if (deadline_us == kNoDeadline) {
+    sequence->in_deadline_queue_ = false;
+    queued_sequences_.push_back(sequence);
+  } else {
+    deadline_sequences_.insert(sequence);
+  }
+}
+
+void QueuedWorkerPool::EnqueueSequence(Sequence* sequence) {
+  if (timer_ == NULL) {
+    queued_sequences_.push_back(sequence);
+    return;
+  }
+  if (sequence->in_deadline_queue_) {
+    // A recycled sequence can be re-queued before its last turn comes up.
+    return;
+  }
+  sequence->queued_us_ = timer_->NowUs();
+  sequence->queue_order_ = next_queue_order_++;
+  if (sequence->deadline_us_ == kNoDeadline) {
+    queued_sequences_.push_back(sequence);
+  } else {
+    sequence->in_deadline_queue_ = true;
+    deadline_sequences_.insert(sequence);
+  }
+}
+
+QueuedWorkerPool::Sequence* QueuedWorkerPool::DequeueSequence() {
+  Sequence* sequence = NULL;
+  if (timer_ == NULL) {
+    sequence = queued_sequences_.front();
+    queued_sequences_.pop_front();
+    return sequence;
+  }
+
+  // Demote the sequences whose deadlines have passed to the background.
+  int64 now_us = timer_->NowUs();
+  while (!deadline_sequences_.empty()) {
+    DeadlineQueue::iterator first = deadline_sequences_.begin();
+    sequence = *first;
+    if (sequence->deadline_us_ > now_us) {
+      break;
+    }
+    deadline_sequences_.erase(first);
+    sequence->in_deadline_queue_ = false;
+    queued_sequences_.push_back(sequence);
+  }
+
+  if (!deadline_sequences_.empty() &&
+      (queued_sequences_.empty() ||
+       (++deadline_streak_ < kMaxDeadlineStreak))) {
+    DeadlineQueue::iterator first = deadline_sequences_.begin();
+    sequence = *first;
+    deadline_sequences_.erase(first);
+    sequence->in_deadline_queue_ = false;
+  } else {
+    deadline_streak_ = 0;
+    sequence = queued_sequences_.front();
+    queued_sequences_.pop_front();
+  }
+  RecordQueueDelay(sequence, now_us);
+  return sequence;
+}
+
+QueuedWorkerPool::Sequence* QueuedWorkerPool::ShedSequence() {
+  Sequence* sequence = NULL;
+  if (!queued_sequences_.empty()) {
+    sequence = queued_sequences_.front();
+    queued_sequences_.pop_front();
+  } else {
+    // Of the sequences with the latest deadline, shed the one that has
+    // waited longest, as we would without deadlines.
+    DeadlineQueue::iterator victim = deadline_sequences_.end();
+    --victim;
+    while (victim != deadline_sequences_.begin()) {
+      DeadlineQueue::iterator prev = victim;
+      --prev;
+      if ((*prev)->deadline_us_ != (*victim)->deadline_us_) {
+        break;
+      }
+      victim = prev;
+    }
+    sequence = *victim;
+    deadline_sequences_.erase(victim);
+    sequence->in_deadline_queue_ = false;
+  }
+  return sequence;
+}
+
+size_t QueuedWorkerPool::NumWaitingSequences() {
+  return queued_sequences_.size() + deadline_sequences_.size();
+}
+
+void QueuedWorkerPool::RecordQueueDelay(Sequence* sequence, int64 now_us) {
+  bool on_time = (sequence->deadline_us_ != kNoDeadline) &&
+      (now_us < sequence->deadline_us_);
+  Histogram* histogram =
+      on_time ? on_time_queue_delay_ms_ : background_queue_delay_ms_;
+  if (histogram != NULL) {
+    histogram->Add((now_us - sequence->queued_us_) / Timer::kMsUs);
+  }
+}
+
+void QueuedWorkerPool::set_work_stealing(bool x) {
+  DCHECK(all_sequences_.empty());
+  DCHECK(!x || (timer_ == NULL));
+  work_stealing_ = x;
+  if (x && run_queues_.empty()) {
+    for (size_t i = 0; i < max_workers_; ++i) {
+      run_queues_.push_back(new RunQueue);
+    }
+  }
+}
+
+void QueuedWorkerPool::QueueSequenceForStealing(Sequence* sequence) {
+  if (num_stealing_workers_.value() == 0) {
+    StartStealingWorker();
+  }
+  int num_workers = num_stealing_workers_.value();
+  if (num_workers == 0) {
+    // We are shutting down, and the sequence's functions will be canceled.
+    return;
+  }
+
+  // Spread the sequences evenly among the workers.  They can't go to the
+  // queue of the worker that made them runnable, as Add may be called on any
+  // thread.
+  uint32 next = next_run_queue_.NoBarrierIncrement(1);
+  RunQueue* run_queue = run_queues_[next % num_workers];
+  if (!run_queue->Push(sequence)) {
+    ScopedMutex lock(mutex_.get());
+    queued_sequences_.push_back(sequence);
+    num_overflow_sequences_.BarrierIncrement(1);
+  }
+
+  // If too many sequences are waiting, we cancel the oldest one waiting for
+  // the same worker.
+  Sequence* drop_sequence = NULL;
+  int num_queued = num_queued_sequences_.BarrierIncrement(1);
+  if ((load_shedding_threshold_ != kNoLoadShedding) &&
+      (num_queued > load_shedding_threshold_)) {
+    drop_sequence = run_queue->Pop();
+    if (drop_sequence != NULL) {
+      num_queued_sequences_.BarrierIncrement(-1);
+      drop_sequence->Cancel();
+    }
+  }
+
+  // As with available_workers_, we start another thread only if there
+  // aren't enough idle ones to take all the waiting sequences.
+  //
+  // The increment of num_queued_sequences_ and WaitForSequence's increment
+  // of num_sleeping_workers_ are both full barriers, so either we see the
+  // worker going to sleep, or it sees our sequence.
+  int num_sleeping = num_sleeping_workers_.value();
+  if ((num_queued > num_sleeping) &&
+      (num_workers < static_cast<int>(max_workers_))) {
+    StartStealingWorker();
+  }
+  if (num_sleeping > 0) {
+    ScopedMutex lock(sleep_mutex_.get());
+    wakeup_condvar_->Signal();
+  }
+}
+
+void QueuedWorkerPool::StartStealingWorker() {
+  ScopedMutex lock(mutex_.get());
+  int index = stealing_workers_.size();
+  if (shutdown_ || (index >= static_cast<int>(max_workers_))) {
+    return;
+  }
+  StealingWorker* worker = new StealingWorker(
+      this, index, StrCat(thread_name_base_, "-", IntegerToString(index)));
+  if (!worker->Start()) {
+    LOG(DFATAL) << "Unable to start worker thread";
+    delete worker;
+    return;
+  }
+  stealing_workers_.push_back(worker);
+  num_stealing_workers_.set_value(index + 1);
+}
+
+void QueuedWorkerPool::RunStealingWorker(int index) {
+  while (!stopping_.value()) {
+    Sequence* sequence = TakeSequence(index);
+    if (sequence == NULL) {
+      WaitForSequence();
+    } else {
+      // As in Run, we drain a sequence before looking for another.
+      while (Function* function = sequence->NextFunction()) {
+        function->CallRun();
+      }
+    }
+  }
+}
+
+QueuedWorkerPool::Sequence* QueuedWorkerPool::TakeSequence(int index) {
+  Sequence* sequence = NULL;
+
+  // Sequences that overflowed a run queue are the oldest, so they go first.
+  if (num_overflow_sequences_.value() > 0) {
+    ScopedMutex lock(mutex_.get());
+    if (!queued_sequences_.empty()) {
+      sequence = queued_sequences_.front();
+      queued_sequences_.pop_front();
+      num_overflow_sequences_.BarrierIncrement(-1);
+    }
+  }
+  if (sequence == NULL) {
+    sequence = run_queues_[index]->Pop();
+  }
+
+  // Steal, starting with the next worker along so that the thieves spread
+  // out.
+  int num_workers = num_stealing_workers_.value();
+  for (int i = 1; (sequence == NULL) && (i < num_workers); ++i) {
+    sequence = run_queues_[(index + i) % num_workers]->Pop();
+  }
+  if (sequence != NULL) {
+    num_queued_sequences_.BarrierIncrement(-1);
+  }
+  return sequence;
+}
+
+void QueuedWorkerPool::WaitForSequence() {
+  ScopedMutex lock(sleep_mutex_.get());
+  num_sleeping_workers_.BarrierIncrement(1);
+  if ((num_queued_sequences_.value() == 0) && !stopping_.value()) {
+    // QueueSequenceForStealing signals us after counting its sequence, and
+    // StopStealingWorkers broadcasts after setting stopping_, both under
+    // sleep_mutex_, so we can't miss either once we've checked them here.
+    wakeup_condvar_->Wait();
+  }
+  num_sleeping_workers_.BarrierIncrement(-1);
+}
+
+void QueuedWorkerPool::StopStealingWorkers() {
+  std::vector<StealingWorker*> workers;
+  {
+    ScopedMutex lock(mutex_.get());
+    workers.swap(stealing_workers_);
+    num_stealing_workers_.set_value(0);
+  }
+  if (workers.empty()) {
+    return;
+  }
+  {
+    ScopedMutex lock(sleep_mutex_.get());
+    stopping_.set_value(true);
+    wakeup_condvar_->Broadcast();
+  }
+  for (int i = 0, n = workers.size(); i < n; ++i) {
+    workers[i]->Join();
+    delete workers[i];
+  }
+}
+
 bool QueuedWorkerPool::AreBusy(const SequenceSet& sequences)
     NO_THREAD_SAFETY_ANALYSIS {
   // This is the only operation that accesses multiple workers at once.
@@ -274,6 +702,7 @@ QueuedWorkerPool::Sequence* QueuedWorkerPool::NewSequence() {
       free_sequences_.pop_back();
       sequence->Reset();
     }
+    SetSequenceDeadlineMutexHeld(sequence, kNoDeadline);
   }
   return sequence;
 }
@@ -303,7 +732,11 @@ QueuedWorkerPool::Sequence::Sequence(ThreadSystem* thread_system,
       pool_(pool),
       termination_condvar_(sequence_mutex_->NewCondvar()),
       queue_size_(NULL),
-      max_queue_size_(kUnboundedQueue) {
+      max_queue_size_(kUnboundedQueue),
+      deadline_us_(kNoDeadline),
+      queued_us_(0),
+      queue_order_(0),
+      in_deadline_queue_(false) {
   Reset();
 }
 
@@ -409,6 +842,17 @@ void QueuedWorkerPool::Sequence::Add(Function* function) {
   UpdateWaveform(queue_size_, cancel ? 0 : 1);
 }
 
+void QueuedWorkerPool::Sequence::set_deadline_us(int64 deadline_us) {
+  QueuedWorkerPool* pool;
+  {
+    ScopedMutex lock(sequence_mutex_.get());
+    pool = pool_;
+  }
+  if (pool != NULL) {
+    pool->SetSequenceDeadline(this, deadline_us);
+  }
+}
+
 void QueuedWorkerPool::Sequence::CancelPendingFunctions() {
   std::deque<Function*> cancel_queue;
   {
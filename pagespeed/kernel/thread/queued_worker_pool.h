@@ -31,6 +31,8 @@
 #include <vector>
 
 #include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/atomic_bool.h"
+#include "pagespeed/kernel/base/atomic_int32.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/function.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
@@ -42,14 +44,27 @@
 
 namespace net_instaweb {
 
+class Histogram;
 class QueuedWorker;
+class Timer;
 class Waveform;
 
 // Maintains a predefined number of worker threads, and dispatches any
 // number of groups of sequential tasks to those threads.
+//
+// By default, sequences that have work to do wait in a single queue guarded
+// by the pool's mutex.  With set_work_stealing(true), each worker thread
+// instead has its own lock-free run queue; sequences are spread among them,
+// and a worker whose queue is empty steals from the others before going to
+// sleep.  Either way, a sequence runs on at most one thread at a time, so
+// its functions still run in order.
+//
+// With EnableDeadlineScheduling, sequences may be given deadlines, and those
+// waiting to run are taken earliest-deadline-first rather than in order.
 class QueuedWorkerPool {
  public:
   static const int kNoLoadShedding = -1;
+  static const int64 kNoDeadline = -1;
 
   QueuedWorkerPool(int max_workers, StringPiece thread_name_base,
                    ThreadSystem* thread_system);
@@ -104,6 +119,13 @@ class QueuedWorkerPool {
 
     void set_queue_size_stat(Waveform* x) { queue_size_ = x; }
 
+    // Sets the time by which the work in this sequence is needed, or
+    // kNoDeadline, which is the default.  This only matters if the pool
+    // schedules by deadline.  If the sequence is waiting to run with a
+    // deadline, the change takes effect immediately; otherwise, it does
+    // the next time the sequence waits.
+    void set_deadline_us(int64 deadline_us);
+
     // Sets the maximum number of functions that can be enqueued to a sequence.
     // By default, sequences are unbounded.  When a bound is reached, the oldest
     // functions are retired by calling Cancel() on them.
@@ -158,6 +180,12 @@ class QueuedWorkerPool {
     Waveform* queue_size_;
     size_t max_queue_size_;
 
+    // Deadline scheduling state, protected by pool_->mutex_.
+    int64 deadline_us_;
+    int64 queued_us_;        // When the sequence last started waiting.
+    uint64 queue_order_;     // Orders waiting sequences with equal deadlines.
+    bool in_deadline_queue_;
+
     DISALLOW_COPY_AND_ASSIGN(Sequence);
   };
 
@@ -216,18 +244,86 @@ class QueuedWorkerPool {
   // Should be called before starting any work.
   void SetLoadSheddingThreshold(int x);
 
+  // Dispatches sequences through per-worker run queues rather than through
+  // the pool's mutex, so that many threads on many cores don't contend for
+  // it.  When load shedding, the sequence canceled is the oldest in one
+  // worker's queue rather than the oldest overall.
+  //
+  // Should be called before starting any work.
+  void set_work_stealing(bool x);
+  bool work_stealing() const { return work_stealing_; }
+
+  // Runs waiting sequences earliest-deadline-first, rather than in the order
+  // they were queued.  Sequences without a deadline, and those whose deadline
+  // passes while they wait, are background work: they run in the order they
+  // were queued, once no sequences with deadlines are waiting, except that one
+  // in every kMaxDeadlineStreak sequences run is taken from the background so
+  // that it can't starve.  When load shedding, the oldest background sequence
+  // is canceled, or if there are none, the oldest of those with the latest
+  // deadline.
+  //
+  // timer tells when deadlines have passed.  This is not supported together
+  // with work stealing.
+  //
+  // Should be called before starting any work.
+  void EnableDeadlineScheduling(Timer* timer);
+
+  // Records in the given histograms how many milliseconds each sequence
+  // waited for a worker: in on_time for sequences that started before their
+  // deadlines, and in background for the rest.  Either may be NULL.  Only
+  // takes effect with EnableDeadlineScheduling.
+  //
+  // Should be called before starting any work.
+  void set_queue_delay_histograms(Histogram* on_time, Histogram* background) {
+    on_time_queue_delay_ms_ = on_time;
+    background_queue_delay_ms_ = background;
+  }
+
   // Sets up a timed-variable statistic indicating the current queue depth.
   //
   // This must be called prior to creating sequences.
   void set_queue_size_stat(Waveform* x) { queue_size_ = x; }
 
  private:
+  class RunQueue;
+  class StealingWorker;
   friend class Sequence;
   void Run(Sequence* sequence, QueuedWorker* worker);
   void QueueSequence(Sequence* sequence);
   Sequence* AssignWorkerToNextSequence(QueuedWorker* worker);
   void SequenceNoLongerActive(Sequence* sequence);
 
+  // Deadline scheduling.  Sequences with deadlines wait in
+  // deadline_sequences_, and background ones in queued_sequences_.
+  static const int kMaxDeadlineStreak = 4;
+  struct CompareDeadlines {
+    bool operator()(const Sequence* a, const Sequence* b) const;
+  };
+  typedef std::set<Sequence*, CompareDeadlines> DeadlineQueue;
+  static bool EarlierDeadline(const Sequence* a, const Sequence* b);
+  void SetSequenceDeadline(Sequence* sequence, int64 deadline_us);
+  void SetSequenceDeadlineMutexHeld(Sequence* sequence, int64 deadline_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // Adds sequence to the waiting sequences.
+  void EnqueueSequence(Sequence* sequence) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // Returns the next waiting sequence to run, which there must be.
+  Sequence* DequeueSequence() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // Removes and returns the waiting sequence to cancel when load shedding.
+  Sequence* ShedSequence() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  size_t NumWaitingSequences() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // Records the queue delay of sequence, which is about to run.
+  void RecordQueueDelay(Sequence* sequence, int64 now_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // The work-stealing counterparts of the above.  Worker number 'index' runs
+  // RunStealingWorker, taking sequences from run_queues_[index] first.
+  void QueueSequenceForStealing(Sequence* sequence);
+  void StartStealingWorker();
+  void RunStealingWorker(int index);
+  Sequence* TakeSequence(int index);
+  void WaitForSequence();
+  void StopStealingWorkers();
+
   ThreadSystem* thread_system_;
   scoped_ptr<AbstractMutex> mutex_;
 
@@ -249,6 +345,29 @@ class QueuedWorkerPool {
   Waveform* queue_size_;
   int load_shedding_threshold_;
 
+  // State for deadline scheduling, which is enabled iff timer_ != NULL.
+  Timer* timer_;
+  DeadlineQueue deadline_sequences_;  // protected by mutex_
+  uint64 next_queue_order_;           // protected by mutex_
+  int deadline_streak_;               // protected by mutex_
+  Histogram* on_time_queue_delay_ms_;
+  Histogram* background_queue_delay_ms_;
+
+  // State for work stealing.  run_queues_ has one entry per potential
+  // worker and doesn't change once work starts.  Sequences only go in
+  // queued_sequences_ when their worker's run queue is full.
+  bool work_stealing_;
+  std::vector<RunQueue*> run_queues_;
+  std::vector<StealingWorker*> stealing_workers_;  // protected by mutex_
+  AtomicInt32 num_stealing_workers_;
+  AtomicInt32 next_run_queue_;
+  AtomicInt32 num_queued_sequences_;
+  AtomicInt32 num_overflow_sequences_;
+  AtomicInt32 num_sleeping_workers_;
+  AtomicBool stopping_;
+  scoped_ptr<ThreadSystem::CondvarCapableMutex> sleep_mutex_;
+  scoped_ptr<ThreadSystem::Condvar> wakeup_condvar_;
+
   DISALLOW_COPY_AND_ASSIGN(QueuedWorkerPool);
 };
 
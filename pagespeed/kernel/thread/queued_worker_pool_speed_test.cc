@@ -0,0 +1,174 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the throughput of QueuedWorkerPool with and without work
+// stealing, as the number of threads grows.  Each iteration runs one tiny
+// function, which adds the next function of its chain to another sequence,
+// as rewrites do when they hand off to each other.  So nearly every function
+// makes an idle sequence runnable, which is the path that goes through the
+// pool's mutex without work stealing.  There are 4 chains per thread.
+//
+// Measured on a single-core Linux VM, -O2:
+//
+// Benchmark                                  Time(ns) Iterations
+// --------------------------------------------------------------
+// QueuedWorkerPoolThroughput/1                      65   22727272
+// QueuedWorkerPoolThroughput/2                     399    3926701
+// QueuedWorkerPoolThroughput/4                     152    9868420
+// QueuedWorkerPoolThroughput/8                     101   14851485
+// QueuedWorkerPoolThroughput/16                     75   19230768
+// QueuedWorkerPoolThroughput/32                     65   23437500
+// QueuedWorkerPoolThroughput/64                     96   14851485
+// WorkStealingThroughput/1                          62   24590163
+// WorkStealingThroughput/2                         127   11718750
+// WorkStealingThroughput/4                         251    7042252
+// WorkStealingThroughput/8                         121   12096774
+// WorkStealingThroughput/16                        185    8241757
+// WorkStealingThroughput/32                        244    6382978
+// WorkStealingThroughput/64                        279    5357142
+//
+// With one core only one thread runs at a time, so there is no contention
+// for the pool's mutex for work stealing to relieve, and a thread that runs
+// out of work spends its time slice scanning the other run queues.  These
+// numbers show the cost of that; whether stealing pays off needs a run on a
+// machine with as many cores as threads.
+//
+// Disclaimer: comparing runs over time and across different machines
+// can be misleading.  When contemplating an algorithm change, always do
+// interleaved runs with the old & new algorithm.
+
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
+
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/benchmark.h"
+#include "pagespeed/kernel/base/condvar.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/util/platform.h"
+
+namespace {
+
+const int kChainsPerThread = 4;
+const int kSequencesPerChain = 2;
+
+// Counts down the chains still running.
+class Countdown {
+ public:
+  Countdown(net_instaweb::ThreadSystem* thread_system, int count)
+      : mutex_(thread_system->NewMutex()),
+        condvar_(mutex_->NewCondvar()),
+        count_(count) {
+  }
+
+  void Decrement() {
+    net_instaweb::ScopedMutex lock(mutex_.get());
+    if (--count_ == 0) {
+      condvar_->Signal();
+    }
+  }
+
+  void Wait() {
+    net_instaweb::ScopedMutex lock(mutex_.get());
+    while (count_ > 0) {
+      condvar_->Wait();
+    }
+  }
+
+ private:
+  scoped_ptr<net_instaweb::ThreadSystem::CondvarCapableMutex> mutex_;
+  scoped_ptr<net_instaweb::ThreadSystem::Condvar> condvar_;
+  int count_;
+
+  DISALLOW_COPY_AND_ASSIGN(Countdown);
+};
+
+typedef std::vector<net_instaweb::QueuedWorkerPool::Sequence*> SequenceVector;
+
+class Hop : public net_instaweb::Function {
+ public:
+  Hop(int index, int remaining, SequenceVector* sequences,
+      Countdown* countdown)
+      : index_(index),
+        remaining_(remaining),
+        sequences_(sequences),
+        countdown_(countdown) {
+  }
+
+ protected:
+  virtual void Run() {
+    if (remaining_ == 0) {
+      countdown_->Decrement();
+    } else {
+      // Hop past the sequences the other chains start on, so chains rarely
+      // meet on a sequence.
+      int next = (index_ + kSequencesPerChain) % sequences_->size();
+      (*sequences_)[next]->Add(
+          new Hop(next, remaining_ - 1, sequences_, countdown_));
+    }
+  }
+
+ private:
+  int index_;
+  int remaining_;
+  SequenceVector* sequences_;
+  Countdown* countdown_;
+
+  DISALLOW_COPY_AND_ASSIGN(Hop);
+};
+
+void RunChains(int iters, int num_threads, bool work_stealing) {
+  StopBenchmarkTiming();
+  scoped_ptr<net_instaweb::ThreadSystem> thread_system(
+      net_instaweb::Platform::CreateThreadSystem());
+  net_instaweb::QueuedWorkerPool pool(num_threads, "speed_test",
+                                      thread_system.get());
+  pool.set_work_stealing(work_stealing);
+  int num_chains = kChainsPerThread * num_threads;
+  SequenceVector sequences;
+  for (int i = 0; i < num_chains * kSequencesPerChain; ++i) {
+    sequences.push_back(pool.NewSequence());
+  }
+  Countdown countdown(thread_system.get(), num_chains);
+  int hops_per_chain = iters / num_chains;
+  StartBenchmarkTiming();
+
+  for (int i = 0; i < num_chains; ++i) {
+    int index = i * kSequencesPerChain;
+    sequences[index]->Add(
+        new Hop(index, hops_per_chain, &sequences, &countdown));
+  }
+  countdown.Wait();
+
+  StopBenchmarkTiming();
+  pool.ShutDown();
+  StartBenchmarkTiming();
+}
+
+static void QueuedWorkerPoolThroughput(int iters, int num_threads) {
+  RunChains(iters, num_threads, false);
+}
+
+static void WorkStealingThroughput(int iters, int num_threads) {
+  RunChains(iters, num_threads, true);
+}
+
+}  // namespace
+
+BENCHMARK_RANGE(QueuedWorkerPoolThroughput, 1, 64);
+BENCHMARK_RANGE(WorkStealingThroughput, 1, 64);
@@ -19,11 +19,17 @@
 
 #include "pagespeed/kernel/thread/queued_worker_pool.h"
 
+#include <vector>
+
 #include "base/logging.h"
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/function.h"
 #include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/mock_timer.h"
 #include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/thread/worker_test_base.h"
 
 namespace net_instaweb {
@@ -50,6 +56,16 @@ class QueuedWorkerPoolTest: public WorkerTestBase {
   DISALLOW_COPY_AND_ASSIGN(QueuedWorkerPoolTest);
 };
 
+// Tests that don't depend on how sequences are scheduled run with
+// work_stealing == GetParam() as both true and false.
+class QueuedWorkerPoolModeTest : public QueuedWorkerPoolTest,
+                                 public ::testing::WithParamInterface<bool> {
+ public:
+  QueuedWorkerPoolModeTest() {
+    worker_->set_work_stealing(GetParam());
+  }
+};
+
 // A function that, without protection of a mutex, increments a shared
 // integer.  The intent is that the QueuedWorkerPool::Sequence is
 // enforcing the sequentiality on our behalf so we don't have to worry
@@ -79,7 +95,7 @@ class Increment : public Function {
 };
 
 // Tests that all the jobs queued in one sequence should run sequentially.
-TEST_F(QueuedWorkerPoolTest, BasicOperation) {
+TEST_P(QueuedWorkerPoolModeTest, BasicOperation) {
   const int kBound = 42;
   int count = 0;
   SyncPoint sync(thread_runtime_.get());
@@ -96,7 +112,7 @@ TEST_F(QueuedWorkerPoolTest, BasicOperation) {
 }
 
 // Test ordinary and cancelled AddFunction callback.
-TEST_F(QueuedWorkerPoolTest, AddFunctionTest) {
+TEST_P(QueuedWorkerPoolModeTest, AddFunctionTest) {
   const int kBound = 5;
   int count1 = 0;
   int count2 = 0;
@@ -124,7 +140,7 @@ TEST_F(QueuedWorkerPoolTest, AddFunctionTest) {
 // Makes sure that even if one sequence is blocked, another can
 // complete, because we have more than one thread at our disposal in
 // this worker.
-TEST_F(QueuedWorkerPoolTest, SlowAndFastSequences) {
+TEST_P(QueuedWorkerPoolModeTest, SlowAndFastSequences) {
   const int kBound = 42;
   int count = 0;
   SyncPoint sync(thread_runtime_.get());
@@ -173,7 +189,7 @@ class MakeNewSequence : public Function {
   DISALLOW_COPY_AND_ASSIGN(MakeNewSequence);
 };
 
-TEST_F(QueuedWorkerPoolTest, RestartSequenceFromFunction) {
+TEST_P(QueuedWorkerPoolModeTest, RestartSequenceFromFunction) {
   SyncPoint sync(thread_runtime_.get());
   QueuedWorkerPool::Sequence* sequence = worker_->NewSequence();
   sequence->Add(new MakeNewSequence(&sync, worker_.get(), sequence));
@@ -202,7 +218,7 @@ class LogOpsFunction : public Function {
 
 // Make sure calling add after worker was shut down Cancel()s the function
 // properly.
-TEST_F(QueuedWorkerPoolTest, AddAfterShutDown) {
+TEST_P(QueuedWorkerPoolModeTest, AddAfterShutDown) {
   QueuedWorkerPool::Sequence* sequence = worker_->NewSequence();
   worker_->ShutDown();
   LogOpsFunction f;
@@ -292,7 +308,61 @@ class NotifyAndWait : public Function {
   WorkerTestBase::SyncPoint* wait_;
 };
 
-TEST_F(QueuedWorkerPoolTest, MaxQueueSize) {
+// With work stealing, load shedding cancels the oldest sequence queued for
+// one worker rather than the oldest overall, so only the number canceled
+// is checked.
+TEST_F(QueuedWorkerPoolTest, LoadSheddingWithWorkStealing) {
+  const int kThresh = 100;
+  worker_->set_work_stealing(true);
+  worker_->SetLoadSheddingThreshold(kThresh);
+
+  // Wedge both threads, and make sure they have started, so that every
+  // LogOps below waits in a run queue.
+  SyncPoint wedge1_started(thread_runtime_.get());
+  SyncPoint wedge2_started(thread_runtime_.get());
+  SyncPoint wedge1_sync(thread_runtime_.get());
+  SyncPoint wedge2_sync(thread_runtime_.get());
+  QueuedWorkerPool::Sequence* wedge1 = worker_->NewSequence();
+  wedge1->Add(new NotifyAndWait(&wedge1_started, &wedge1_sync));
+  QueuedWorkerPool::Sequence* wedge2 = worker_->NewSequence();
+  wedge2->Add(new NotifyAndWait(&wedge2_started, &wedge2_sync));
+  wedge1_started.Wait();
+  wedge2_started.Wait();
+
+  std::vector<QueuedWorkerPool::Sequence*> log_ops;
+  std::vector<LogOpsFunction*> log_ops_functions;
+  for (int i = 0; i < 2 * kThresh; ++i) {
+    QueuedWorkerPool::Sequence* sequence = worker_->NewSequence();
+    LogOpsFunction* function = new LogOpsFunction();
+    sequence->Add(function);
+    log_ops.push_back(sequence);
+    log_ops_functions.push_back(function);
+  }
+
+  wedge1_sync.Notify();
+  wedge2_sync.Notify();
+  for (int i = 0; i < 2 * kThresh; ++i) {
+    WaitUntilSequenceCompletes(log_ops[i]);
+  }
+  worker_->ShutDown();
+  worker_->FreeSequence(wedge1);
+  worker_->FreeSequence(wedge2);
+
+  int num_canceled = 0;
+  for (int i = 0; i < 2 * kThresh; ++i) {
+    EXPECT_NE(log_ops_functions[i]->cancel_called(),
+              log_ops_functions[i]->run_called());
+    if (log_ops_functions[i]->cancel_called()) {
+      ++num_canceled;
+    }
+    delete log_ops_functions[i];
+    worker_->FreeSequence(log_ops[i]);
+  }
+  // Each sequence queued beyond kThresh cancels one.
+  EXPECT_EQ(kThresh, num_canceled);
+}
+
+TEST_P(QueuedWorkerPoolModeTest, MaxQueueSize) {
   SyncPoint started(thread_runtime_.get());
   SyncPoint wait(thread_runtime_.get());
   SyncPoint done(thread_runtime_.get());
@@ -312,7 +382,7 @@ TEST_F(QueuedWorkerPoolTest, MaxQueueSize) {
   EXPECT_EQ(-97, count);
 }
 
-TEST_F(QueuedWorkerPoolTest, CancelPending) {
+TEST_P(QueuedWorkerPoolModeTest, CancelPending) {
   SyncPoint wait(thread_runtime_.get());
   SyncPoint done(thread_runtime_.get());
   QueuedWorkerPool::Sequence* sequence = worker_->NewSequence();
@@ -328,6 +398,221 @@ TEST_F(QueuedWorkerPoolTest, CancelPending) {
   EXPECT_EQ(-300, count);
 }
 
+// Runs many sequences at once, each adding to another, so that sequences
+// become runnable on worker threads as well as on the main thread.
+class Relay : public Function {
+ public:
+  Relay(int index, int remaining,
+        std::vector<QueuedWorkerPool::Sequence*>* sequences,
+        std::vector<int>* counts, WorkerTestBase::SyncPoint* done)
+      : index_(index),
+        remaining_(remaining),
+        sequences_(sequences),
+        counts_(counts),
+        done_(done) {
+  }
+
+ protected:
+  virtual void Run() {
+    // Each sequence's count is only touched by its own functions.
+    ++(*counts_)[index_];
+    if (remaining_ == 0) {
+      done_->Notify();
+    } else {
+      int next = (index_ + 1) % sequences_->size();
+      (*sequences_)[next]->Add(
+          new Relay(next, remaining_ - 1, sequences_, counts_, done_));
+    }
+  }
+
+ private:
+  int index_;
+  int remaining_;
+  std::vector<QueuedWorkerPool::Sequence*>* sequences_;
+  std::vector<int>* counts_;
+  WorkerTestBase::SyncPoint* done_;
+
+  DISALLOW_COPY_AND_ASSIGN(Relay);
+};
+
+TEST_P(QueuedWorkerPoolModeTest, ManySequences) {
+  const int kNumSequences = 50;
+  const int kNumRelays = 20;
+  const int kHops = 100;
+  std::vector<QueuedWorkerPool::Sequence*> sequences;
+  for (int i = 0; i < kNumSequences; ++i) {
+    sequences.push_back(worker_->NewSequence());
+  }
+  std::vector<int> counts(kNumSequences);
+  std::vector<SyncPoint*> done;
+  for (int i = 0; i < kNumRelays; ++i) {
+    done.push_back(new SyncPoint(thread_runtime_.get()));
+    sequences[i]->Add(new Relay(i, kHops, &sequences, &counts, done[i]));
+  }
+  int total = 0;
+  for (int i = 0; i < kNumRelays; ++i) {
+    done[i]->Wait();
+    delete done[i];
+  }
+  for (int i = 0; i < kNumSequences; ++i) {
+    WaitUntilSequenceCompletes(sequences[i]);
+    total += counts[i];
+    worker_->FreeSequence(sequences[i]);
+  }
+  EXPECT_EQ(kNumRelays * (kHops + 1), total);
+}
+
+INSTANTIATE_TEST_CASE_P(QueuedWorkerPoolModeTestInstance,
+                        QueuedWorkerPoolModeTest,
+                        ::testing::Bool());
+
+// Appends a character to a string when run, or its upper-case version when
+// canceled, notifying a SyncPoint once the string reaches a given length.
+class AppendChar : public Function {
+ public:
+  AppendChar(char c, GoogleString* str, int notify_length,
+             WorkerTestBase::SyncPoint* sync)
+      : c_(c), str_(str), notify_length_(notify_length), sync_(sync) {
+  }
+
+ protected:
+  virtual void Run() { Append(c_); }
+  virtual void Cancel() { Append(UpperChar(c_)); }
+
+ private:
+  void Append(char c) {
+    str_->push_back(c);
+    if (static_cast<int>(str_->size()) == notify_length_) {
+      sync_->Notify();
+    }
+  }
+
+  char c_;
+  GoogleString* str_;
+  int notify_length_;
+  WorkerTestBase::SyncPoint* sync_;
+
+  DISALLOW_COPY_AND_ASSIGN(AppendChar);
+};
+
+// Tests deadline scheduling with a single worker thread, which we wedge while
+// queueing up sequences, so that we can see the order they run in.
+class QueuedWorkerPoolDeadlineTest : public WorkerTestBase {
+ public:
+  QueuedWorkerPoolDeadlineTest()
+      : timer_(thread_runtime_->NewMutex(), MockTimer::kApr_5_2010_ms),
+        pool_(new QueuedWorkerPool(1, "deadline_test",
+                                   thread_runtime_.get())),
+        on_time_(thread_runtime_->NewMutex()),
+        background_(thread_runtime_->NewMutex()),
+        wedge_started_(thread_runtime_.get()),
+        wedge_release_(thread_runtime_.get()),
+        done_(thread_runtime_.get()) {
+    pool_->EnableDeadlineScheduling(&timer_);
+    pool_->set_queue_delay_histograms(&on_time_, &background_);
+    wedge_ = pool_->NewSequence();
+    wedge_->Add(new NotifyAndWait(&wedge_started_, &wedge_release_));
+    wedge_started_.Wait();
+  }
+
+  // Adds a sequence with the given deadline, relative to now, running
+  // AppendChar(c).  The worker is done when result_ has num_chars.
+  QueuedWorkerPool::Sequence* AddSequence(char c, int64 deadline_ms,
+                                          int num_chars) {
+    QueuedWorkerPool::Sequence* sequence = pool_->NewSequence();
+    if (deadline_ms != QueuedWorkerPool::kNoDeadline) {
+      sequence->set_deadline_us(timer_.NowUs() + deadline_ms * Timer::kMsUs);
+    }
+    sequence->Add(new AppendChar(c, &result_, num_chars, &done_));
+    return sequence;
+  }
+
+  void RunAll() {
+    wedge_release_.Notify();
+    done_.Wait();
+    pool_->ShutDown();
+  }
+
+ protected:
+  MockTimer timer_;
+  scoped_ptr<QueuedWorkerPool> pool_;
+  CountHistogram on_time_;
+  CountHistogram background_;
+  SyncPoint wedge_started_;
+  SyncPoint wedge_release_;
+  SyncPoint done_;
+  QueuedWorkerPool::Sequence* wedge_;
+  GoogleString result_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(QueuedWorkerPoolDeadlineTest);
+};
+
+TEST_F(QueuedWorkerPoolDeadlineTest, EarliestDeadlineFirst) {
+  const int64 kNone = QueuedWorkerPool::kNoDeadline;
+  AddSequence('a', kNone, 6);
+  AddSequence('b', 300, 6);
+  AddSequence('c', 200, 6);
+  AddSequence('d', 50, 6);
+  AddSequence('e', kNone, 6);
+  AddSequence('f', 100, 6);
+
+  // 'd' misses its deadline while waiting, so it is demoted to run after the
+  // background sequences queued before it was.
+  timer_.AdvanceMs(75);
+  RunAll();
+  EXPECT_EQ("fcbaed", result_);
+  EXPECT_EQ(3, on_time_.Count());
+  EXPECT_EQ(4, background_.Count());  // Including the wedge.
+}
+
+TEST_F(QueuedWorkerPoolDeadlineTest, BackgroundIsNotStarved) {
+  AddSequence('a', QueuedWorkerPool::kNoDeadline, 6);
+  AddSequence('b', 100, 6);
+  AddSequence('c', 200, 6);
+  AddSequence('d', 300, 6);
+  AddSequence('e', 400, 6);
+  AddSequence('f', 500, 6);
+  RunAll();
+  EXPECT_EQ("bcdaef", result_);
+}
+
+TEST_F(QueuedWorkerPoolDeadlineTest, ChangeDeadlineWhileWaiting) {
+  QueuedWorkerPool::Sequence* a = AddSequence('a', 500, 3);
+  QueuedWorkerPool::Sequence* b = AddSequence('b', 400, 3);
+  AddSequence('c', QueuedWorkerPool::kNoDeadline, 3);
+  a->set_deadline_us(timer_.NowUs() + 300 * Timer::kMsUs);
+  b->set_deadline_us(QueuedWorkerPool::kNoDeadline);
+  RunAll();
+  EXPECT_EQ("acb", result_);
+}
+
+TEST_F(QueuedWorkerPoolDeadlineTest, LoadShedding) {
+  pool_->SetLoadSheddingThreshold(2);
+
+  // Background sequences are shed first, then the latest deadlines.
+  AddSequence('a', QueuedWorkerPool::kNoDeadline, 4);
+  AddSequence('b', 100, 4);
+  AddSequence('c', 200, 4);
+  EXPECT_EQ("A", result_);
+  AddSequence('d', 300, 4);
+  EXPECT_EQ("AD", result_);
+  RunAll();
+  EXPECT_EQ("ADbc", result_);
+}
+
+TEST_F(QueuedWorkerPoolDeadlineTest, LoadSheddingEqualDeadlines) {
+  pool_->SetLoadSheddingThreshold(2);
+
+  // Of the sequences sharing the latest deadline, the oldest is shed.
+  AddSequence('a', 100, 3);
+  AddSequence('b', 200, 3);
+  AddSequence('c', 200, 3);
+  EXPECT_EQ("B", result_);
+  RunAll();
+  EXPECT_EQ("Bac", result_);
+}
+
 }  // namespace
 
 }  // namespace net_instaweb
@@ -19,6 +19,7 @@
 
 #include <algorithm>
 #include <set>
+#include <vector>
 
 #include "base/logging.h"
 #include "pagespeed/kernel/base/abstract_mutex.h"
@@ -29,6 +30,7 @@
 #include "pagespeed/kernel/base/thread_annotations.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/thread/scheduler_sequence.h"
+#include "pagespeed/kernel/thread/timer_wheel.h"
 
 namespace net_instaweb {
 
@@ -36,6 +38,11 @@ namespace {
 
 const int kIndexNotSet = 0;
 
+// Alarms are filed in alarm_wheel_ by the millisecond they are due in.
+int64 AlarmTick(int64 wakeup_time_us) {
+  return wakeup_time_us / Timer::kMsUs;
+}
+
 }  // namespace
 
 // Basic Alarm type (forward declared in the .h file).  Note that Alarms are
@@ -44,7 +51,7 @@ const int kIndexNotSet = 0;
 // that Alarms hold the scheduler lock when they are invoked; the alarm drops
 // the lock before invoking its embedded callback and re-takes it afterwards if
 // that is necessary.
-class Scheduler::Alarm {
+class Scheduler::Alarm : public TimerWheel::Entry {
  public:
   virtual void RunAlarm() = 0;
   virtual void CancelAlarm() = 0;
@@ -127,10 +134,10 @@ class FunctionAlarm : public Scheduler::Alarm {
 // should only be used internally to the scheduler, but are semi-exposed due to
 // C++ naming restrictions.  The first two implement condvar waiting.  When we
 // wait using BlockingTimedWait or TimedWait, we put a single alarm into two
-// queues: the outstanding_alarms_ queue, where it will be run if the wait times
+// queues: the outstanding alarms, where it will be run if the wait times
 // out, and the waiting_alarms_ queue, where it will be canceled if a signal
 // arrives.  The system assumes the waiting_alarms_ queue is a subset of the
-// outstanding_alarms_ queue, because it holds *only* alarms from ...TimedWait
+// outstanding alarms, because it holds *only* alarms from ...TimedWait
 // operations, so on signal the contents of waiting_alarms are cancelled thus
 // removing them from waiting_alarms and invoking the Cancel() method.  However,
 // on timeout the Run() method must remove the alarm from the waiting_alarms_
@@ -206,6 +213,7 @@ Scheduler::Scheduler(ThreadSystem* thread_system, Timer* timer)
       mutex_(thread_system->NewMutex()),
       condvar_(mutex_->NewCondvar()),
       index_(kIndexNotSet),
+      alarm_wheel_(0),
       signal_count_(0),
       running_waiting_alarms_(false) {
 }
@@ -213,10 +221,8 @@ Scheduler::Scheduler(ThreadSystem* thread_system, Timer* timer)
 Scheduler::~Scheduler() {
 #if SCHEDULER_CANCEL_OUTSTANDING_ALARMS_ON_DESTRUCTION
   ScopedMutex lock(mutex_.get());
-  while (!outstanding_alarms_.empty()) {
-    AlarmSet::iterator p = outstanding_alarms_.begin();
-    Alarm* alarm = *p;
-    outstanding_alarms_.erase(p);
+  for (Alarm* alarm = FirstAlarm(); alarm != NULL; alarm = FirstAlarm()) {
+    ready_alarms_.erase(ready_alarms_.begin());
     alarm->CancelAlarm();
   }
 #endif
@@ -237,9 +243,9 @@ void Scheduler::BlockingTimedWaitUs(int64 timeout_us) {
   while (signal_count_ == original_signal_count && !timed_out &&
          next_wakeup_us > 0) {
     // Now we have to block until either we time out, or we are signaled.  We
-    // stop when outstanding_alarms_ is empty (and thus RunAlarms(NULL) == 0) as
-    // a belt and suspenders protection against programmer error; this ought to
-    // imply timed_out.
+    // stop when there are no outstanding alarms (and thus RunAlarms(NULL) ==
+    // 0) as a belt and suspenders protection against programmer error; this
+    // ought to imply timed_out.
     AwaitWakeupUntilUs(std::min(wakeup_time_us, next_wakeup_us));
     next_wakeup_us = RunAlarms(NULL);
   }
@@ -263,7 +269,7 @@ void Scheduler::CancelWaiting(Alarm* alarm) {
   // a benign race here that meant alarm had been erased from waiting_alarms_ by
   // a pending Signal operation.  Tighter locking on Alarm objects should have
   // eliminated this hole, but we continue to use presence / absence in
-  // outstanding_alarms_ to resolve signal/cancel races.
+  // the outstanding alarms to resolve signal/cancel races.
   mutex_->DCheckLocked();
   waiting_alarms_.erase(alarm);
 }
@@ -311,14 +317,20 @@ void Scheduler::InsertAlarmAtUsMutexHeld(int64 wakeup_time_us,
   alarm->index_ = ++index_;
 
   if (broadcast_on_wakeup_change) {
-    bool wakeup_time_changed = outstanding_alarms_.empty() ||
-        (wakeup_time_us < (*outstanding_alarms_.begin())->wakeup_time_us_);
+    Alarm* first_alarm = FirstAlarm();
+    bool wakeup_time_changed = (first_alarm == NULL) ||
+        (wakeup_time_us < first_alarm->wakeup_time_us_);
     if (wakeup_time_changed) {
       condvar_->Broadcast();
     }
   }
 
-  outstanding_alarms_.insert(alarm);
+  int64 tick = AlarmTick(wakeup_time_us);
+  if (tick > alarm_wheel_.base_tick()) {
+    alarm_wheel_.Insert(tick, alarm);
+  } else {
+    ready_alarms_.insert(alarm);
+  }
 }
 
 Scheduler::Alarm* Scheduler::AddAlarmAtUs(int64 wakeup_time_us,
@@ -339,30 +351,61 @@ Scheduler::Alarm* Scheduler::AddAlarmAtUsMutexHeld(int64 wakeup_time_us,
 
 bool Scheduler::CancelAlarm(Alarm* alarm) {
   mutex_->DCheckLocked();
-  if (outstanding_alarms_.erase(alarm) != 0) {
-    // Note: the following call may drop and re-lock the scheduler mutex.
-    alarm->CancelAlarm();
-    return true;
-  } else {
+  if (alarm->in_wheel()) {
+    alarm_wheel_.Remove(alarm);
+  } else if (ready_alarms_.erase(alarm) == 0) {
     return false;
   }
+  // Note: the following call may drop and re-lock the scheduler mutex.
+  alarm->CancelAlarm();
+  return true;
+}
+
+void Scheduler::ExpireAlarms(int64 now_us) {
+  alarm_wheel_.AdvanceTo(AlarmTick(now_us), &expired_alarms_);
+  ReadyExpiredAlarms();
+}
+
+Scheduler::Alarm* Scheduler::FirstAlarm() {
+  if (ready_alarms_.empty()) {
+    // Everything in the wheel is due after everything in ready_alarms_, so
+    // the next alarm is in the wheel's earliest tick.  That may lie in the
+    // future, in which case alarms added that are due before it go straight
+    // to ready_alarms_.
+    if (!alarm_wheel_.AdvanceToNext(&expired_alarms_)) {
+      return NULL;
+    }
+    ReadyExpiredAlarms();
+  }
+  return *ready_alarms_.begin();
+}
+
+void Scheduler::ReadyExpiredAlarms() {
+  for (int i = 0, n = expired_alarms_.size(); i < n; ++i) {
+    ready_alarms_.insert(static_cast<Alarm*>(expired_alarms_[i]));
+  }
+  expired_alarms_.clear();
 }
 
 int64 Scheduler::RunAlarms(bool* ran_alarms) {
-  while (!outstanding_alarms_.empty()) {
+  for (;;) {
     mutex_->DCheckLocked();
-    // We don't use the iterator to go through the set, because we're dropping
-    // the lock in mid-loop thus permitting new insertions and cancellations.
-    AlarmSet::iterator first_alarm_iterator = outstanding_alarms_.begin();
-    Alarm* first_alarm = *first_alarm_iterator;
+    // Move every alarm that's due out of the wheel in one batch.  We don't
+    // iterate through ready_alarms_, because we're dropping the lock in
+    // mid-loop thus permitting new insertions and cancellations.
     int64 now_us = timer_->NowUs();
+    ExpireAlarms(now_us);
+    Alarm* first_alarm = FirstAlarm();
+    if (first_alarm == NULL) {
+      break;
+    }
     if (now_us < first_alarm->wakeup_time_us_) {
       // The next deadline lies in the future.
       return first_alarm->wakeup_time_us_;
     }
     // first_alarm should be run.  It can't have been cancelled as we've held
     // the lock since we found it.
-    outstanding_alarms_.erase(first_alarm_iterator);  // Prevent cancellation.
+    ready_alarms_.erase(ready_alarms_.begin());  // Prevent cancellation.
     if (ran_alarms != NULL) {
       *ran_alarms = true;
     }
@@ -400,13 +443,13 @@ bool Scheduler::ProcessAlarmsOrWaitUs(int64 timeout_us) {
 
     next_wakeup_us = RunAlarms(NULL);
   }
-  return !outstanding_alarms_.empty();
+  return !NoPendingAlarms();
 }
 
 // For testing purposes, let a tester know when the scheduler has quiesced.
 bool Scheduler::NoPendingAlarms() {
   mutex_->DCheckLocked();
-  return (outstanding_alarms_.empty());
+  return ready_alarms_.empty() && alarm_wheel_.empty();
 }
 
 SchedulerBlockingFunction::SchedulerBlockingFunction(Scheduler* scheduler)
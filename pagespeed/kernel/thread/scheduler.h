@@ -18,6 +18,7 @@
 #define PAGESPEED_KERNEL_THREAD_SCHEDULER_H_
 
 #include <set>
+#include <vector>
 
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/condvar.h"
@@ -27,6 +28,7 @@
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/thread/queued_worker_pool.h"
+#include "pagespeed/kernel/thread/timer_wheel.h"
 
 // TODO(jmarantz): The Scheduler should cancel all outstanding operations
 // on destruction.  Deploying this requires further analysis of shutdown
@@ -201,6 +203,16 @@ class Scheduler {
   void CancelWaiting(Alarm* alarm);
   bool NoPendingAlarms();
 
+  // Moves the alarms in alarm_wheel_ due by now_us to ready_alarms_.
+  void ExpireAlarms(int64 now_us) EXCLUSIVE_LOCKS_REQUIRED(mutex());
+
+  // Returns the next alarm due, moving it (and any alarms due in the same
+  // tick) out of alarm_wheel_ if need be, or NULL if there are none.
+  Alarm* FirstAlarm() EXCLUSIVE_LOCKS_REQUIRED(mutex());
+
+  // Moves expired_alarms_ to ready_alarms_.
+  void ReadyExpiredAlarms() EXCLUSIVE_LOCKS_REQUIRED(mutex());
+
   ThreadSystem* thread_system_;
   Timer* timer_;
   scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex_;
@@ -208,9 +220,13 @@ class Scheduler {
   // signal_count_ increasing) events occur.
   scoped_ptr<ThreadSystem::Condvar> condvar_;
   uint32 index_;  // Used to disambiguate alarms with equal deadlines
-  AlarmSet outstanding_alarms_;  // Priority queue of future alarms
-  // An alarm may be deleted iff it is successfully removed from
-  // outstanding_alarms_.
+  // Outstanding alarms are kept in alarm_wheel_, with millisecond ticks,
+  // which adds and cancels them in constant time.  Those due in the wheel's
+  // base tick or earlier are moved to ready_alarms_, which runs them in order.
+  // An alarm may be deleted iff it is successfully removed from one of them.
+  TimerWheel alarm_wheel_;
+  AlarmSet ready_alarms_;
+  std::vector<TimerWheel::Entry*> expired_alarms_;  // Scratch space.
   int64 signal_count_;           // Number of times Signal has been called
   AlarmSet waiting_alarms_;      // Alarms waiting for signal_count to change
   bool running_waiting_alarms_;  // True if we're in process of invoking
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the cost of adding and cancelling Scheduler alarms, with a growing
+// number outstanding, as fetch and rewrite deadlines do: nearly all of them
+// are cancelled before they are due.  Each iteration cancels the oldest alarm
+// and adds a new one, due between one and two minutes later, with
+// AddAlarmAtUs.  Time moves forward a microsecond per iteration.
+//
+// Benchmark                                  Time(ns) Iterations
+// --------------------------------------------------------------
+// SchedulerAlarmChurn/1024                         313    3200000
+// SchedulerAlarmChurn/2048                         335    6400000
+// SchedulerAlarmChurn/4096                         383    3200000
+// SchedulerAlarmChurn/8192                         488    3200000
+// SchedulerAlarmChurn/16384                        431    3200000
+// SchedulerAlarmChurn/32768                        529    3200000
+// SchedulerAlarmChurn/65536                        811    1280000
+//
+// Before alarms were filed in a TimerWheel, when they were all in a std::set,
+// the same machine gave:
+//
+// SchedulerAlarmChurn/1024                         545    3200000
+// SchedulerAlarmChurn/2048                         507    3200000
+// SchedulerAlarmChurn/4096                         485    3200000
+// SchedulerAlarmChurn/8192                         638    2560000
+// SchedulerAlarmChurn/16384                        745    1600000
+// SchedulerAlarmChurn/32768                       1339    1280000
+// SchedulerAlarmChurn/65536                       1877     640000
+//
+// Disclaimer: comparing runs over time and across different machines
+// can be misleading.  When contemplating an algorithm change, always do
+// interleaved runs with the old & new algorithm.
+
+#include "pagespeed/kernel/thread/scheduler.h"
+
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/benchmark.h"
+#include "pagespeed/kernel/base/function.h"
+#include "pagespeed/kernel/base/mock_timer.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/util/platform.h"
+
+namespace {
+
+const int64 kMinDelayUs = 60 * net_instaweb::Timer::kSecondUs;
+
+class NullFunction : public net_instaweb::Function {
+ public:
+  NullFunction() {}
+
+ protected:
+  virtual void Run() {}
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(NullFunction);
+};
+
+static void SchedulerAlarmChurn(int iters, int num_outstanding) {
+  StopBenchmarkTiming();
+  scoped_ptr<net_instaweb::ThreadSystem> thread_system(
+      net_instaweb::Platform::CreateThreadSystem());
+  net_instaweb::MockTimer timer(thread_system->NewMutex(),
+                                net_instaweb::MockTimer::kApr_5_2010_ms);
+  net_instaweb::Scheduler scheduler(thread_system.get(), &timer);
+  std::vector<net_instaweb::Scheduler::Alarm*> alarms(num_outstanding);
+  uint32 random = 1;
+  for (int i = 0; i < num_outstanding; ++i) {
+    random = random * 1103515245 + 12345;
+    alarms[i] = scheduler.AddAlarmAtUs(
+        timer.NowUs() + kMinDelayUs + random % kMinDelayUs,
+        new NullFunction);
+  }
+  StartBenchmarkTiming();
+
+  for (int i = 0; i < iters; ++i) {
+    int index = i % num_outstanding;
+    {
+      net_instaweb::ScopedMutex lock(scheduler.mutex());
+      CHECK(scheduler.CancelAlarm(alarms[index]));
+    }
+    timer.AdvanceUs(1);
+    random = random * 1103515245 + 12345;
+    alarms[index] = scheduler.AddAlarmAtUs(
+        timer.NowUs() + kMinDelayUs + random % kMinDelayUs,
+        new NullFunction);
+  }
+
+  StopBenchmarkTiming();
+  net_instaweb::ScopedMutex lock(scheduler.mutex());
+  for (int i = 0; i < num_outstanding; ++i) {
+    scheduler.CancelAlarm(alarms[i]);
+  }
+  StartBenchmarkTiming();
+}
+
+}  // namespace
+
+BENCHMARK_RANGE(SchedulerAlarmChurn, 1 << 10, 1 << 16);
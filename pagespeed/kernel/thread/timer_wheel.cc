@@ -0,0 +1,208 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/kernel/thread/timer_wheel.h"
+
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const uint64 kSignBit = static_cast<uint64>(1) << 63;
+
+uint64 ToUnsigned(int64 tick) {
+  return static_cast<uint64>(tick) ^ kSignBit;
+}
+
+// Returns the index of the highest set bit of x, which must not be 0.
+int HighestSetBit(uint64 x) {
+  int bit = 0;
+  for (int shift = 32; shift > 0; shift >>= 1) {
+    if ((x >> shift) != 0) {
+      x >>= shift;
+      bit += shift;
+    }
+  }
+  return bit;
+}
+
+// Returns the index of the lowest set bit of x, which must not be 0.
+int LowestSetBit(uint64 x) {
+  int bit = 0;
+  for (int shift = 32; shift > 0; shift >>= 1) {
+    uint64 low_bits = (static_cast<uint64>(1) << shift) - 1;
+    if ((x & low_bits) == 0) {
+      x >>= shift;
+      bit += shift;
+    }
+  }
+  return bit;
+}
+
+// Returns x with its low num_bits bits cleared.
+uint64 ClearLowBits(uint64 x, int num_bits) {
+  return (num_bits >= 64) ? 0 : ((x >> num_bits) << num_bits);
+}
+
+}  // namespace
+
+const int TimerWheel::Entry::kNotInWheel;
+
+TimerWheel::TimerWheel(int64 base_tick)
+    : base_(ToUnsigned(base_tick)),
+      size_(0) {
+  for (int i = 0; i < kNumLevels * kSlotsPerLevel; ++i) {
+    slots_[i] = NULL;
+  }
+  for (int i = 0; i < kNumLevels; ++i) {
+    occupied_[i] = 0;
+  }
+}
+
+TimerWheel::~TimerWheel() {
+}
+
+int64 TimerWheel::base_tick() const {
+  return static_cast<int64>(base_ ^ kSignBit);
+}
+
+void TimerWheel::Insert(int64 tick, Entry* entry) {
+  DCHECK(!entry->in_wheel());
+  entry->tick_ = tick;
+  Link(entry);
+  ++size_;
+}
+
+void TimerWheel::Remove(Entry* entry) {
+  DCHECK(entry->in_wheel());
+  Unlink(entry);
+  --size_;
+}
+
+void TimerWheel::Link(Entry* entry) {
+  uint64 tick = ToUnsigned(entry->tick_);
+  DCHECK_GT(tick, base_);
+  int level = HighestSetBit(tick ^ base_) / kBitsPerLevel;
+  int digit = (tick >> (level * kBitsPerLevel)) & (kSlotsPerLevel - 1);
+  int slot = level * kSlotsPerLevel + digit;
+  entry->slot_ = slot;
+  entry->prev_ = NULL;
+  entry->next_ = slots_[slot];
+  if (entry->next_ != NULL) {
+    entry->next_->prev_ = entry;
+  }
+  slots_[slot] = entry;
+  occupied_[level] |= static_cast<uint64>(1) << digit;
+}
+
+void TimerWheel::Unlink(Entry* entry) {
+  int slot = entry->slot_;
+  if (entry->prev_ == NULL) {
+    slots_[slot] = entry->next_;
+    if (entry->next_ == NULL) {
+      occupied_[slot / kSlotsPerLevel] &=
+          ~(static_cast<uint64>(1) << (slot % kSlotsPerLevel));
+    }
+  } else {
+    entry->prev_->next_ = entry->next_;
+  }
+  if (entry->next_ != NULL) {
+    entry->next_->prev_ = entry->prev_;
+  }
+  entry->prev_ = NULL;
+  entry->next_ = NULL;
+  entry->slot_ = Entry::kNotInWheel;
+}
+
+int TimerWheel::EarliestSlot(uint64* start) const {
+  DCHECK_LT(0, size_);
+  for (int level = 0; level < kNumLevels; ++level) {
+    if (occupied_[level] != 0) {
+      int shift = level * kBitsPerLevel;
+      int digit = LowestSetBit(occupied_[level]);
+      DCHECK_GT(digit, static_cast<int>(
+          (base_ >> shift) & (kSlotsPerLevel - 1)));
+      *start = ClearLowBits(base_, shift + kBitsPerLevel) |
+          (static_cast<uint64>(digit) << shift);
+      return level * kSlotsPerLevel + digit;
+    }
+  }
+  LOG(DFATAL) << "No slot found in non-empty wheel";
+  *start = base_;
+  return 0;
+}
+
+void TimerWheel::Cascade(int slot, uint64 start,
+                         std::vector<Entry*>* expired) {
+  base_ = start;
+  Entry* entry = slots_[slot];
+  slots_[slot] = NULL;
+  occupied_[slot / kSlotsPerLevel] &=
+      ~(static_cast<uint64>(1) << (slot % kSlotsPerLevel));
+  while (entry != NULL) {
+    Entry* next = entry->next_;
+    if (ToUnsigned(entry->tick_) == base_) {
+      entry->prev_ = NULL;
+      entry->next_ = NULL;
+      entry->slot_ = Entry::kNotInWheel;
+      --size_;
+      expired->push_back(entry);
+    } else {
+      // base_ now agrees with the entry's tick in the digit that placed it
+      // here, so this files it at a lower level.
+      Link(entry);
+    }
+    entry = next;
+  }
+}
+
+void TimerWheel::AdvanceTo(int64 tick, std::vector<Entry*>* expired) {
+  uint64 target = ToUnsigned(tick);
+  if (target <= base_) {
+    return;
+  }
+  // Jump from one non-empty slot to the next, rather than stepping through
+  // every tick.  Moving the base anywhere short of the earliest slot leaves
+  // every entry in the right place.
+  while (size_ > 0) {
+    uint64 start;
+    int slot = EarliestSlot(&start);
+    if (start > target) {
+      break;
+    }
+    Cascade(slot, start, expired);
+  }
+  base_ = target;
+}
+
+bool TimerWheel::AdvanceToNext(std::vector<Entry*>* expired) {
+  if (size_ == 0) {
+    return false;
+  }
+  size_t num_expired = expired->size();
+  while (expired->size() == num_expired) {
+    uint64 start;
+    int slot = EarliestSlot(&start);
+    Cascade(slot, start, expired);
+  }
+  return true;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_KERNEL_THREAD_TIMER_WHEEL_H_
+#define PAGESPEED_KERNEL_THREAD_TIMER_WHEEL_H_
+
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+
+namespace net_instaweb {
+
+// A hierarchical timing wheel, holding entries that are each due at some
+// integral tick.  Insert and Remove take constant time however many entries
+// there are.  As the wheel advances, an entry moves down at most once per
+// level, and the entries it reaches are handed back in a batch.
+//
+// The wheel has a base tick, which only moves forward, and every entry in
+// the wheel is due after it.  Entries due at or before the base have
+// expired, and are the caller's to keep in order; the wheel only promises
+// that they are due before everything still in it.
+//
+// Entries are intrusive, so the wheel does no allocation, and doesn't own
+// them.  This class is not thread-safe.
+class TimerWheel {
+ public:
+  class Entry {
+   public:
+    Entry() : tick_(0), prev_(NULL), next_(NULL), slot_(kNotInWheel) {}
+
+    int64 tick() const { return tick_; }
+    bool in_wheel() const { return slot_ != kNotInWheel; }
+
+   private:
+    friend class TimerWheel;
+    static const int kNotInWheel = -1;
+
+    int64 tick_;
+    Entry* prev_;
+    Entry* next_;
+    int slot_;
+
+    DISALLOW_COPY_AND_ASSIGN(Entry);
+  };
+
+  explicit TimerWheel(int64 base_tick);
+  ~TimerWheel();
+
+  int64 base_tick() const;
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Adds entry, which must not be in a wheel already, due at tick, which must
+  // be after base_tick().
+  void Insert(int64 tick, Entry* entry);
+
+  // Removes entry, which must be in this wheel.
+  void Remove(Entry* entry);
+
+  // Moves the base forward to tick, if it is later, removing the entries due
+  // at or before it from the wheel and appending them to *expired.
+  void AdvanceTo(int64 tick, std::vector<Entry*>* expired);
+
+  // Moves the base forward to the earliest tick that any entry is due at, and
+  // removes and appends those entries to *expired.  Returns false, leaving
+  // the base alone, if the wheel is empty.
+  bool AdvanceToNext(std::vector<Entry*>* expired);
+
+ private:
+  static const int kBitsPerLevel = 6;
+  static const int kSlotsPerLevel = 1 << kBitsPerLevel;
+  static const int kNumLevels = (64 + kBitsPerLevel - 1) / kBitsPerLevel;
+
+  // Files entry in the slot for its tick, relative to base_.
+  void Link(Entry* entry);
+  void Unlink(Entry* entry);
+
+  // Returns the earliest slot holding any entries, setting *start to the
+  // first tick it covers.  The wheel must not be empty.
+  int EarliestSlot(uint64* start) const;
+
+  // Moves base_ to start, the first tick of slot, and re-files the entries in
+  // slot, appending those due at start to *expired.
+  void Cascade(int slot, uint64 start, std::vector<Entry*>* expired);
+
+  // Ticks are stored offset by 2^63, so that unsigned comparison orders them
+  // like the signed ticks.  Each entry lives at the level of the highest
+  // digit (of kBitsPerLevel bits) in which its tick differs from base_, in
+  // the slot for its value of that digit.  That slot is always later than
+  // base_'s value of the digit, so the earliest entries are in the lowest
+  // non-empty level.
+  uint64 base_;
+  Entry* slots_[kNumLevels * kSlotsPerLevel];
+  uint64 occupied_[kNumLevels];  // Bit d is set if slot d is non-empty.
+  int size_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_KERNEL_THREAD_TIMER_WHEEL_H_
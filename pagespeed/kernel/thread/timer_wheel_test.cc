@@ -0,0 +1,196 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the hierarchical timing wheel.
+
+#include "pagespeed/kernel/thread/timer_wheel.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/gtest.h"
+
+namespace net_instaweb {
+
+namespace {
+
+typedef std::vector<TimerWheel::Entry*> EntryVector;
+
+class TimerWheelTest : public testing::Test {
+ protected:
+  TimerWheelTest() : wheel_(1000) {}
+
+  // Returns the ticks of the entries expired since the last call, sorted.
+  std::vector<int64> ExpiredTicks() {
+    std::vector<int64> ticks;
+    for (int i = 0, n = expired_.size(); i < n; ++i) {
+      EXPECT_FALSE(expired_[i]->in_wheel());
+      ticks.push_back(expired_[i]->tick());
+    }
+    std::sort(ticks.begin(), ticks.end());
+    expired_.clear();
+    return ticks;
+  }
+
+  TimerWheel wheel_;
+  EntryVector expired_;
+};
+
+TEST_F(TimerWheelTest, EntriesExpireInBatches) {
+  TimerWheel::Entry a, b, c, d;
+  wheel_.Insert(1005, &a);
+  wheel_.Insert(1100, &b);
+  wheel_.Insert(1005, &c);
+  wheel_.Insert(5000, &d);
+  EXPECT_EQ(4, wheel_.size());
+  EXPECT_TRUE(a.in_wheel());
+
+  wheel_.AdvanceTo(1004, &expired_);
+  EXPECT_TRUE(ExpiredTicks().empty());
+  EXPECT_EQ(1004, wheel_.base_tick());
+
+  wheel_.AdvanceTo(1100, &expired_);
+  std::vector<int64> ticks = ExpiredTicks();
+  ASSERT_EQ(3, ticks.size());
+  EXPECT_EQ(1005, ticks[0]);
+  EXPECT_EQ(1005, ticks[1]);
+  EXPECT_EQ(1100, ticks[2]);
+  EXPECT_EQ(1, wheel_.size());
+  EXPECT_EQ(1100, wheel_.base_tick());
+
+  // Moving backwards does nothing.
+  wheel_.AdvanceTo(10, &expired_);
+  EXPECT_EQ(1100, wheel_.base_tick());
+
+  wheel_.AdvanceTo(1000000, &expired_);
+  ticks = ExpiredTicks();
+  ASSERT_EQ(1, ticks.size());
+  EXPECT_EQ(5000, ticks[0]);
+  EXPECT_TRUE(wheel_.empty());
+}
+
+TEST_F(TimerWheelTest, Remove) {
+  TimerWheel::Entry a, b, c;
+  wheel_.Insert(2000, &a);
+  wheel_.Insert(2000, &b);
+  wheel_.Insert(3000, &c);
+  wheel_.Remove(&b);
+  EXPECT_FALSE(b.in_wheel());
+  wheel_.Remove(&c);
+  EXPECT_EQ(1, wheel_.size());
+
+  // Entries can be re-inserted once removed.
+  wheel_.Insert(2500, &c);
+  wheel_.AdvanceTo(3000, &expired_);
+  std::vector<int64> ticks = ExpiredTicks();
+  ASSERT_EQ(2, ticks.size());
+  EXPECT_EQ(2000, ticks[0]);
+  EXPECT_EQ(2500, ticks[1]);
+}
+
+TEST_F(TimerWheelTest, AdvanceToNext) {
+  EXPECT_FALSE(wheel_.AdvanceToNext(&expired_));
+  EXPECT_EQ(1000, wheel_.base_tick());
+
+  TimerWheel::Entry a, b, c;
+  wheel_.Insert(1 << 30, &a);
+  wheel_.Insert(77777, &b);
+  wheel_.Insert(77777, &c);
+  ASSERT_TRUE(wheel_.AdvanceToNext(&expired_));
+  EXPECT_EQ(77777, wheel_.base_tick());
+  EXPECT_EQ(2, ExpiredTicks().size());
+  ASSERT_TRUE(wheel_.AdvanceToNext(&expired_));
+  EXPECT_EQ(1 << 30, wheel_.base_tick());
+  EXPECT_EQ(1, ExpiredTicks().size());
+  EXPECT_FALSE(wheel_.AdvanceToNext(&expired_));
+}
+
+TEST_F(TimerWheelTest, ExtremeTicks) {
+  TimerWheel wheel(-5);
+  TimerWheel::Entry a, b, c;
+  wheel.Insert(kint64max, &a);
+  wheel.Insert(3, &b);
+  wheel.Insert(-4, &c);
+  ASSERT_TRUE(wheel.AdvanceToNext(&expired_));
+  EXPECT_EQ(-4, wheel.base_tick());
+  wheel.AdvanceTo(kint64max - 1, &expired_);
+  std::vector<int64> ticks = ExpiredTicks();
+  ASSERT_EQ(2, ticks.size());
+  EXPECT_EQ(-4, ticks[0]);
+  EXPECT_EQ(3, ticks[1]);
+  ASSERT_TRUE(wheel.AdvanceToNext(&expired_));
+  EXPECT_EQ(kint64max, wheel.base_tick());
+  EXPECT_EQ(1, ExpiredTicks().size());
+}
+
+// Checks the wheel against a multimap, with entries added, removed, and
+// expired at random.
+TEST_F(TimerWheelTest, MatchesSortedOrder) {
+  const int kNumEntries = 2000;
+  std::vector<TimerWheel::Entry> entries(kNumEntries);
+  std::multimap<int64, TimerWheel::Entry*> expected;
+  uint32 random = 12345;
+  for (int round = 0; round < 20000; ++round) {
+    random = random * 1103515245 + 12345;
+    TimerWheel::Entry* entry = &entries[(random >> 8) % kNumEntries];
+    int op = (random >> 4) % 4;
+    if (!entry->in_wheel()) {
+      // Mix near and far deadlines.
+      int64 delay = 1 + ((op == 0) ? (random % 50000) : (random % 100));
+      int64 tick = wheel_.base_tick() + delay;
+      wheel_.Insert(tick, entry);
+      expected.insert(std::make_pair(tick, entry));
+    } else if (op == 0) {
+      wheel_.Remove(entry);
+      std::multimap<int64, TimerWheel::Entry*>::iterator p =
+          expected.find(entry->tick());
+      while (p->second != entry) {
+        ++p;
+      }
+      expected.erase(p);
+    } else if (op == 1) {
+      wheel_.AdvanceTo(wheel_.base_tick() + (random % 200), &expired_);
+    } else if (op == 2) {
+      ASSERT_TRUE(wheel_.AdvanceToNext(&expired_));
+      EXPECT_EQ(expected.begin()->first, wheel_.base_tick());
+    }
+
+    // Everything expired must have been the earliest expected.
+    int num_expired = expired_.size();
+    for (int i = 0; i < num_expired; ++i) {
+      ASSERT_FALSE(expected.empty());
+      EXPECT_EQ(expected.begin()->first, expired_[i]->tick());
+      std::multimap<int64, TimerWheel::Entry*>::iterator p = expected.begin();
+      while (p->second != expired_[i]) {
+        ++p;
+        ASSERT_TRUE(p != expected.end());
+        ASSERT_EQ(expected.begin()->first, p->first);
+      }
+      expected.erase(p);
+    }
+    expired_.clear();
+    if (!expected.empty()) {
+      EXPECT_LT(wheel_.base_tick(), expected.begin()->first);
+    }
+    ASSERT_EQ(static_cast<int>(expected.size()), wheel_.size());
+  }
+}
+
+}  // namespace
+
+}  // namespace net_instaweb
@@ -47,9 +47,16 @@ bool BrotliInflater::Compress(StringPiece in, int compression_level,
                               MessageHandler* handler, Writer* writer) {
   size_t compressed_size = BrotliEncoderMaxCompressedSize(in.length());
   uint8_t* compressed = new uint8_t[compressed_size];
+  // A window larger than the input doesn't help, and at the higher levels
+  // setting one up costs far more than compressing a small input.
+  int window_bits = BROTLI_MIN_WINDOW_BITS;
+  while ((window_bits < BROTLI_DEFAULT_WINDOW) &&
+         ((static_cast<size_t>(1) << window_bits) < in.length())) {
+    ++window_bits;
+  }
   // Compress in one shot with BrotliCompress.
   bool result = false;
-  if (BrotliEncoderCompress(compression_level, BROTLI_DEFAULT_WINDOW,
+  if (BrotliEncoderCompress(compression_level, window_bits,
                             BROTLI_DEFAULT_MODE, in.length(),
                             reinterpret_cast<const uint8_t*>(in.data()),
                             &compressed_size, compressed)) {
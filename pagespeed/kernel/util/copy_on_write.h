@@ -69,8 +69,9 @@ class CopyOnWrite {
   // Merges in the contents of src into this.  To increase speed and
   // save memory, this method shares storage with src if this was empty.
   void MergeOrShare(const CopyOnWrite& src) {
-    // If src is empty then the function is a no-op.
-    if (!src->empty()) {
+    // If src is empty, or we already share its storage, then the function is
+    // a no-op.
+    if (!src->empty() && (get() != src.get())) {
       // If this is empty, then we want to make it share src's storage.
       if ((*this)->empty()) {
         *this = src;
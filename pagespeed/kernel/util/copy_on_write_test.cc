@@ -133,5 +133,13 @@ TEST_F(CopyOnWriteTest, MergeOrShareRequiringClassMerge) {
   EXPECT_EQ(3, cow_int_vector_a_->size());
 }
 
+TEST_F(CopyOnWriteTest, MergeOrShareSharedStorage) {
+  // Merging objects that already share storage neither copies nor merges.
+  CopyOnWrite<IntVector> share(cow_int_vector_a_);
+  cow_int_vector_a_.MergeOrShare(share);
+  EXPECT_EQ(cow_int_vector_a_.get(), share.get()) << "same storage";
+  EXPECT_EQ(2, cow_int_vector_a_->size());
+}
+
 }  // namespace
 }  // namespace net_instaweb
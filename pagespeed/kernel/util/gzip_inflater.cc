@@ -315,6 +315,20 @@ void GzipInflater::ShutDown() {
 // TODO(jmarantz): make an incremental interface to Deflate.
 bool GzipInflater::Deflate(StringPiece in, InflateType format,
                            int compression_level, Writer *writer) {
+  return DeflateHelper(in, format, compression_level, StringPiece(),
+                       false /* fit_window */, writer);
+}
+
+bool GzipInflater::DeflateWithDictionary(StringPiece in, int compression_level,
+                                         StringPiece dictionary,
+                                         Writer* writer) {
+  return DeflateHelper(in, kDeflate, compression_level, dictionary,
+                       true /* fit_window */, writer);
+}
+
+bool GzipInflater::DeflateHelper(StringPiece in, InflateType format,
+                                 int compression_level, StringPiece dictionary,
+                                 bool fit_window, Writer* writer) {
   z_stream strm;
   char out[kStackBufferSize];
 
@@ -331,12 +345,33 @@ bool GzipInflater::Deflate(StringPiece in, InflateType format,
   if (format == kGzip) {
     ret = deflateInit2(&strm, compression_level, Z_DEFLATED, 16 | 15, 8,
                        Z_DEFAULT_STRATEGY);
-  } else {
+  } else if (!fit_window) {
     ret = deflateInit(&strm, compression_level);
+  } else {
+    // Setting up the default 32KB window and hash tables costs far more than
+    // compressing a small value, so we size them to what we'll compress.
+    // Inflate accepts any window size.
+    int window_bits = 9;
+    while ((window_bits < MAX_WBITS) &&
+           ((static_cast<size_t>(1) << window_bits) <
+            in.size() + dictionary.size())) {
+      ++window_bits;
+    }
+    ret = deflateInit2(&strm, compression_level, Z_DEFLATED, window_bits,
+                       window_bits - 7 /* memLevel */, Z_DEFAULT_STRATEGY);
   }
   if (ret != Z_OK) {
     return false;
   }
+  if (!dictionary.empty()) {
+    DCHECK_EQ(kDeflate, format);
+    if (deflateSetDictionary(
+            &strm, reinterpret_cast<const Bytef*>(dictionary.data()),
+            dictionary.size()) != Z_OK) {
+      deflateEnd(&strm);
+      return false;
+    }
+  }
 
   // compress until end of file
   strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
@@ -372,6 +407,16 @@ bool GzipInflater::Deflate(StringPiece in, InflateType format, Writer* writer) {
 // TODO(jmarantz): Consider using the incremental interface to implement
 // Inflate.
 bool GzipInflater::Inflate(StringPiece in, InflateType format, Writer* writer) {
+  return InflateHelper(in, format, StringPiece(), writer);
+}
+
+bool GzipInflater::InflateWithDictionary(StringPiece in, StringPiece dictionary,
+                                         Writer* writer) {
+  return InflateHelper(in, kDeflate, dictionary, writer);
+}
+
+bool GzipInflater::InflateHelper(StringPiece in, InflateType format,
+                                 StringPiece dictionary, Writer* writer) {
   z_stream strm;
   char out[kStackBufferSize];
   const int kOutSize = sizeof(out);
@@ -399,7 +444,17 @@ bool GzipInflater::Inflate(StringPiece in, InflateType format, Writer* writer) {
   do {
     strm.avail_out = kOutSize;
     strm.next_out = reinterpret_cast<Bytef*>(out);
-    switch (inflate(&strm, Z_NO_FLUSH)) {
+    int ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret == Z_NEED_DICT && !dictionary.empty()) {
+      // Fails with Z_DATA_ERROR if the stream wants a different dictionary.
+      ret = inflateSetDictionary(
+          &strm, reinterpret_cast<const Bytef*>(dictionary.data()),
+          dictionary.size());
+      if (ret == Z_OK) {
+        ret = inflate(&strm, Z_NO_FLUSH);
+      }
+    }
+    switch (ret) {
       case Z_STREAM_ERROR:
         LOG(DFATAL) << "state should not be not clobbered";
         FALLTHROUGH_INTENDED;
@@ -76,6 +76,19 @@ class GzipInflater {
   // if there was some kind of failure, such as a corrupt input.
   static bool Inflate(StringPiece in, InflateType format, Writer* writer);
 
+  // Deflates and inflates kDeflate streams that use a preset dictionary.
+  // Small inputs that share a lot of content with the dictionary compress
+  // much better than they would on their own.  The stream records the
+  // Adler-32 of the dictionary, so inflating with a different dictionary
+  // fails rather than producing garbage.  With an empty dictionary the
+  // streams are interchangeable with those of Deflate and Inflate with
+  // kDeflate.  DeflateWithDictionary sizes its window to the input and
+  // dictionary, which makes it much cheaper than Deflate for small inputs.
+  static bool DeflateWithDictionary(StringPiece in, int compression_level,
+                                    StringPiece dictionary, Writer* writer);
+  static bool InflateWithDictionary(StringPiece in, StringPiece dictionary,
+                                    Writer* writer);
+
   // Checks whether in starts with the gzip file signature.
   static bool HasGzipMagicBytes(StringPiece in);
 
@@ -88,6 +101,12 @@ class GzipInflater {
     FORMAT_RAW_INFLATE,  // RFC1951
   };
 
+  static bool DeflateHelper(StringPiece in, InflateType format,
+                            int compression_level, StringPiece dictionary,
+                            bool fit_window, Writer* writer);
+  static bool InflateHelper(StringPiece in, InflateType format,
+                            StringPiece dictionary, Writer* writer);
+
   static bool GetWindowBitsForFormat(
       StreamFormat format, int* out_window_bits);
   void Free();
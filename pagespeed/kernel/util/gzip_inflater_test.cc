@@ -216,6 +216,37 @@ TEST_F(GzipInflaterTest, InflateDeflateLargeDataHighEntropy) {
   TestInflateDeflate(value);
 }
 
+TEST_F(GzipInflaterTest, InflateDeflateWithDictionary) {
+  const char kDictionary[] = "The quick brown fox jumps over the lazy dog";
+  const char kPayload[] = "The quick brown fox jumps over the lazy cat";
+  GoogleString plain, with_dictionary, inflated;
+  StringWriter plain_writer(&plain);
+  EXPECT_TRUE(GzipInflater::Deflate(kPayload, GzipInflater::kDeflate,
+                                    &plain_writer));
+  StringWriter deflate_writer(&with_dictionary);
+  EXPECT_TRUE(GzipInflater::DeflateWithDictionary(kPayload, 9, kDictionary,
+                                                  &deflate_writer));
+  EXPECT_GT(plain.size(), with_dictionary.size());
+
+  StringWriter inflate_writer(&inflated);
+  EXPECT_TRUE(GzipInflater::InflateWithDictionary(with_dictionary, kDictionary,
+                                                  &inflate_writer));
+  EXPECT_STREQ(kPayload, inflated);
+
+  // Without the dictionary, or with the wrong one, inflating fails.
+  inflated.clear();
+  EXPECT_FALSE(GzipInflater::Inflate(with_dictionary, GzipInflater::kDeflate,
+                                     &inflate_writer));
+  EXPECT_FALSE(GzipInflater::InflateWithDictionary(
+      with_dictionary, "the wrong dictionary", &inflate_writer));
+  EXPECT_TRUE(inflated.empty());
+
+  // Streams made without a dictionary inflate fine when one is given.
+  EXPECT_TRUE(GzipInflater::InflateWithDictionary(plain, kDictionary,
+                                                  &inflate_writer));
+  EXPECT_STREQ(kPayload, inflated);
+}
+
 TEST_F(GzipInflaterTest, IncrementalInflateOfOneShotDeflate) {
   const char kPayload[] = "The quick brown fox jumps over the lazy dog";
   GoogleString deflated, inflated;
@@ -24,6 +24,7 @@
 
 #include "net/instaweb/http/public/async_fetch.h"
 #include "net/instaweb/http/public/http_cache.h"
+#include "net/instaweb/rewriter/public/cache_warmer.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
 #include "net/instaweb/rewriter/public/rewrite_query.h"
 #include "net/instaweb/rewriter/public/server_context.h"
@@ -278,6 +279,15 @@ void AdminSite::StatisticsHandler(const RewriteOptions& options,
   fetch->Write("<pre id='stat'>", message_handler_);
   stats->Dump(fetch, message_handler_);
   fetch->Write("</pre>\n", message_handler_);
+  // Cache hit ratios aren't statistics themselves, so that lookups don't
+  // have to keep them up to date; work them out from the hit and miss
+  // counts instead.
+  GoogleString hit_ratios;
+  SystemCaches::PrintHitRatios(stats, &hit_ratios);
+  if (!hit_ratios.empty()) {
+    fetch->Write(StrCat("<pre id='hit_ratios'>", hit_ratios, "</pre>\n"),
+                 message_handler_);
+  }
   StringPiece statistics_js = options.Enabled(RewriteOptions::kDebug) ?
         JS_statistics_js :
         JS_statistics_js_opt;
@@ -414,8 +424,8 @@ GoogleString HackCacheDescriptor(StringPiece name) {
   // overly cryptic; it's designed for unit tests.  But let's extract
   // a few keywords out of this to understand the main pointers.
   static const char* kCacheKeywords[] = {
-    "Compressed", "Async", "SharedMemCache", "LRUCache", "AprMemCache",
-    "FileCache", "RedisCache"
+    "TieredMetadataCache", "Compressed", "Async", "SharedMemCache",
+    "LRUCache", "AprMemCache", "FileCache", "RedisCache"
   };
   const char* delim = "";
   for (int i = 0, n = arraysize(kCacheKeywords); i < n; ++i) {
@@ -494,6 +504,7 @@ void AdminSite::PrintCaches(bool is_global, AdminSource source,
                             const QueryParams& query_params,
                             const RewriteOptions* options,
                             SystemCachePath* cache_path,
+                            CacheWarmer* cache_warmer,
                             AsyncFetch* fetch, SystemCaches* system_caches,
                             CacheInterface* filesystem_metadata_cache,
                             HTTPCache* http_cache,
@@ -563,6 +574,10 @@ void AdminSite::PrintCaches(bool is_global, AdminSource source,
         PurgeHandler(resolved.Spec(), cache_path, fetch);
       }
     }
+  } else if ((source == kPageSpeedAdmin) &&
+             query_params.Lookup1Unescaped("warm", &url)) {
+    GoogleUrl origin(stripped_gurl.Origin());
+    WarmHandler(url, origin, cache_warmer, server_context, fetch);
   } else {
     GoogleString head_markup = StrCat(
         "<style>", CSS_caches_css, "</style>\n");
@@ -705,10 +720,11 @@ void AdminSite::MessageHistoryHandler(const RewriteOptions& options,
 void AdminSite::AdminPage(
     bool is_global, const GoogleUrl& stripped_gurl,
     const QueryParams& query_params, const RewriteOptions* options,
-    SystemCachePath* cache_path, AsyncFetch* fetch, SystemCaches* system_caches,
-    CacheInterface* filesystem_metadata_cache, HTTPCache* http_cache,
-    CacheInterface* metadata_cache, PropertyCache* page_property_cache,
-    ServerContext* server_context, Statistics* statistics, Statistics* stats,
+    SystemCachePath* cache_path, CacheWarmer* cache_warmer, AsyncFetch* fetch,
+    SystemCaches* system_caches, CacheInterface* filesystem_metadata_cache,
+    HTTPCache* http_cache, CacheInterface* metadata_cache,
+    PropertyCache* page_property_cache, ServerContext* server_context,
+    Statistics* statistics, Statistics* stats,
     SystemRewriteOptions* global_system_rewrite_options) {
   // The handler is "pagespeed_admin", so we must dispatch off of
   // the remainder of the URL.  For
@@ -765,7 +781,7 @@ void AdminSite::AdminPage(
       MessageHistoryHandler(*options, kPageSpeedAdmin, fetch);
     } else if (leaf == "cache") {
       PrintCaches(is_global, kPageSpeedAdmin, stripped_gurl, query_params,
-                  options, cache_path, fetch, system_caches,
+                  options, cache_path, cache_warmer, fetch, system_caches,
                   filesystem_metadata_cache, http_cache, metadata_cache,
                   page_property_cache, server_context);
     } else if (leaf == "histograms") {
@@ -813,7 +829,7 @@ void AdminSite::StatisticsPage(
     GoogleUrl empty_url;
     PrintCaches(is_global, kStatistics, empty_url, query_params,
                 options, NULL,  // cache_path is reference from statistics page.
-                fetch, system_caches, filesystem_metadata_cache,
+                NULL, fetch, system_caches, filesystem_metadata_cache,
                 http_cache, metadata_cache, page_property_cache,
                 server_context);
   } else {
@@ -871,14 +887,52 @@ void AdminSite::PurgeHandler(StringPiece url, SystemCachePath* cache_path,
       new PurgeFetchCallbackGasket(fetch, message_handler_);
   PurgeContext::PurgeCallback* callback = NewCallback(
       gasket, &PurgeFetchCallbackGasket::Done);
-  if (strings::EndsWith(url, "*")) {
-    // If the url is "*" we'll just purge everything.  Note that we will
-    // ignore any sub-paths in the expression.  We can only purge the
-    // entire cache, or specific URLs, not general wildcards.
+  GoogleUrl gurl(url);
+  if ((url == "*") ||
+      (gurl.IsWebValid() && (gurl.PathAndLeaf() == "/*"))) {
+    // If the url is "*", or a site's root with a wildcard, we'll just purge
+    // everything.
     purge_context->SetCachePurgeGlobalTimestampMs(now_ms, callback);
   } else {
+    // Any other URL ending in "*" purges every URL it is a prefix of.
     purge_context->AddPurgeUrl(url, now_ms, callback);
   }
 }
 
+void AdminSite::WarmHandler(StringPiece source, const GoogleUrl& origin,
+                            CacheWarmer* cache_warmer,
+                            ServerContext* server_context, AsyncFetch* fetch) {
+  ResponseHeaders* response_headers = fetch->response_headers();
+  response_headers->SetStatusAndReason(HttpStatus::kOK);
+  response_headers->Add(HttpAttributes::kContentType, "text/html");
+  if (cache_warmer == NULL) {
+    fetch->Write("Cache warming not enabled: please add\n", message_handler_);
+    HtmlKeywords::WritePre(
+        StrCat("  ", server_context->FormatOption("CacheWarmingConcurrency",
+                                                  "2")),
+        "", fetch, message_handler_);
+    fetch->Write("\nto your configuration file.", message_handler_);
+    fetch->Done(true);
+    return;
+  }
+
+  int num_pages = 0;
+  if (source == "recent") {
+    num_pages = cache_warmer->WarmRecentUrls(NULL);
+  } else {
+    GoogleString error;
+    if (!cache_warmer->WarmFromSource(source, origin, NULL, &num_pages,
+                                      &error)) {
+      GoogleString escaped;
+      HtmlKeywords::Escape(error, &escaped);
+      fetch->Write(escaped, message_handler_);
+      fetch->Done(true);
+      return;
+    }
+  }
+  fetch->Write(StrCat("Warming ", IntegerToString(num_pages), " pages"),
+               message_handler_);
+  fetch->Done(true);
+}
+
 }  // namespace net_instaweb
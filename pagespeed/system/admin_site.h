@@ -25,6 +25,7 @@ namespace net_instaweb {
 
 class AsyncFetch;
 class CacheInterface;
+class CacheWarmer;
 class GoogleUrl;
 class HTTPCache;
 class MessageHandler;
@@ -78,7 +79,7 @@ class AdminSite {
   void AdminPage(bool is_global, const GoogleUrl& stripped_gurl,
                  const QueryParams& query_params,
                  const RewriteOptions* options,
-                 SystemCachePath* cache_path,
+                 SystemCachePath* cache_path, CacheWarmer* cache_warmer,
                  AsyncFetch* fetch, SystemCaches* system_caches,
                  CacheInterface* filesystem_metadata_cache,
                  HTTPCache* http_cache, CacheInterface* metadata_cache,
@@ -129,11 +130,12 @@ class AdminSite {
 
   // Print statistics about the caches.  In the future this will also
   // be a launching point for examining cache entries and purging them.
+  // cache_warmer may be NULL if cache warming is off.
   void PrintCaches(bool is_global, AdminSource source,
                    const GoogleUrl& stripped_gurl,
                    const QueryParams& query_params,
                    const RewriteOptions* options,
-                   SystemCachePath* cache_path,
+                   SystemCachePath* cache_path, CacheWarmer* cache_warmer,
                    AsyncFetch* fetch, SystemCaches* system_caches,
                    CacheInterface* filesystem_metadata_cache,
                    HTTPCache* http_cache, CacheInterface* metadata_cache,
@@ -147,6 +149,14 @@ class AdminSite {
   void PurgeHandler(StringPiece url, SystemCachePath* cache_path,
                     AsyncFetch* fetch);
 
+  // Queues for warming the pages listed in source, which is either "recent"
+  // for the pages recently served, or the name of a sitemap or access log in
+  // the CacheWarmingDirectory.  Access log entries are resolved against
+  // origin.
+  void WarmHandler(StringPiece source, const GoogleUrl& origin,
+                   CacheWarmer* cache_warmer, ServerContext* server_context,
+                   AsyncFetch* fetch);
+
   // Return the message handler for debugging use.
   MessageHandler* MessageHandlerForTesting() { return message_handler_; }
 
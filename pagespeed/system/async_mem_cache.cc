@@ -0,0 +1,900 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/system/async_mem_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <utility>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/condvar.h"
+#include "pagespeed/kernel/base/hasher.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread.h"
+#include "pagespeed/kernel/cache/key_value_codec.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kTimeouts[] = "async_memcache_timeouts";
+const char kErrors[] = "async_memcache_errors";
+const char kBackedOff[] = "async_memcache_backed_off";
+const char kDroppedPuts[] = "async_memcache_dropped_puts";
+
+// The parts of the memcached binary protocol we use; see
+// https://github.com/memcached/memcached/wiki/BinaryProtocolRevamped
+const uint8 kRequestMagic = 0x80;
+const uint8 kResponseMagic = 0x81;
+const uint8 kOpcodeNoop = 0x0a;
+const uint8 kOpcodeGetKQ = 0x0d;
+const uint8 kOpcodeSetQ = 0x11;
+const uint8 kOpcodeDeleteQ = 0x14;
+const uint16 kStatusOk = 0x0000;
+const uint16 kStatusKeyNotFound = 0x0001;
+const size_t kHeaderSize = 24;
+const size_t kSetExtrasSize = 8;  // flags and expiration, both left 0.
+
+const int kMaxPollIntervalMs = Timer::kSecondMs;
+const size_t kReadBufferSize = 32 * 1024;
+
+void AppendBigEndian(uint32 value, int bytes, GoogleString* out) {
+  for (int shift = 8 * (bytes - 1); shift >= 0; shift -= 8) {
+    out->push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+uint32 ReadBigEndian(const char* data, int bytes) {
+  uint32 value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value = (value << 8) | static_cast<uint8>(data[i]);
+  }
+  return value;
+}
+
+// Appends a request with the given key and value.  The extras, if any, are
+// all zero.
+void AppendRequest(uint8 opcode, StringPiece key, size_t extras_size,
+                   StringPiece value, uint32 opaque, GoogleString* out) {
+  out->push_back(static_cast<char>(kRequestMagic));
+  out->push_back(static_cast<char>(opcode));
+  AppendBigEndian(key.size(), 2, out);
+  out->push_back(static_cast<char>(extras_size));
+  out->push_back(0);                  // data type
+  AppendBigEndian(0, 2, out);         // vbucket
+  AppendBigEndian(extras_size + key.size() + value.size(), 4, out);
+  AppendBigEndian(opaque, 4, out);
+  AppendBigEndian(0, 4, out);         // CAS
+  AppendBigEndian(0, 4, out);
+  out->append(extras_size, '\0');
+  key.AppendToString(out);
+  value.AppendToString(out);
+}
+
+}  // namespace
+
+// The keys owned by one server in a Get or MultiGet, looked up together.
+struct AsyncMemCache::Lookup {
+  Lookup() : first_opaque(0), deadline_us(0) {}
+
+  MultiGetRequest keys;
+  std::vector<bool> found;
+  std::vector<SharedString> values;
+
+  // The GETKQ for keys[i] is sent with opaque first_opaque + i, and the NOOP
+  // ending the batch with first_opaque + keys.size().
+  uint32 first_opaque;
+  int64 deadline_us;
+};
+
+struct AsyncMemCache::Server {
+  enum State { kDisconnected, kConnecting, kConnected };
+
+  explicit Server(const ExternalServerSpec& server_spec)
+      : spec(server_spec), resolved(false), family(0), address_length(0),
+        fd(-1), state(kDisconnected), connect_deadline_us(0), next_opaque(0),
+        consecutive_failures(0), retry_time_ms(0) {
+    memset(&address, 0, sizeof(address));
+  }
+
+  ExternalServerSpec spec;
+
+  // The address spec resolves to.  Written by StartUp before the I/O thread
+  // starts, and only read after.
+  bool resolved;
+  int family;
+  struct sockaddr_storage address;
+  socklen_t address_length;
+
+  int fd;
+  State state;
+  int64 connect_deadline_us;
+  GoogleString output;          // Requests not yet written.
+  GoogleString input;           // Responses read but not yet parsed.
+  std::deque<Lookup*> lookups;  // Sent or queued, oldest first.
+  uint32 next_opaque;
+  int consecutive_failures;
+  int64 retry_time_ms;          // Backed off until then.
+};
+
+class AsyncMemCache::IoThread : public ThreadSystem::Thread {
+ public:
+  IoThread(AsyncMemCache* cache, ThreadSystem* thread_system)
+      : ThreadSystem::Thread(thread_system, "memcached_io",
+                             ThreadSystem::kJoinable),
+        cache_(cache) {}
+
+  virtual void Run() { cache_->Run(); }
+
+ private:
+  AsyncMemCache* cache_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoThread);
+};
+
+// Waits for the lookups it forwards to AsyncMemCache, and then runs their
+// callbacks on the calling thread.
+class AsyncMemCache::BlockingCache : public CacheInterface {
+ public:
+  BlockingCache(AsyncMemCache* cache, ThreadSystem* thread_system)
+      : cache_(cache), thread_system_(thread_system) {}
+
+  virtual void Get(const GoogleString& key, Callback* callback) {
+    MultiGetRequest* request = new MultiGetRequest;
+    request->push_back(KeyCallback(key, callback));
+    MultiGet(request);
+  }
+
+  virtual void MultiGet(MultiGetRequest* request) {
+    scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex(
+        thread_system_->NewMutex());
+    scoped_ptr<ThreadSystem::Condvar> condvar(mutex->NewCondvar());
+    int pending = request->size();
+    std::vector<WaitingCallback*> waiting;
+    MultiGetRequest* forwarded = new MultiGetRequest;
+    for (int i = 0, n = request->size(); i < n; ++i) {
+      waiting.push_back(
+          new WaitingCallback(mutex.get(), condvar.get(), &pending));
+      forwarded->push_back(KeyCallback((*request)[i].key, waiting.back()));
+    }
+    cache_->MultiGet(forwarded);
+    {
+      ScopedMutex lock(mutex.get());
+      while (pending > 0) {
+        condvar->Wait();
+      }
+    }
+    for (int i = 0, n = request->size(); i < n; ++i) {
+      KeyCallback* key_callback = &(*request)[i];
+      key_callback->callback->set_value(waiting[i]->value());
+      ValidateAndReportResult(key_callback->key, waiting[i]->state(),
+                              key_callback->callback);
+      delete waiting[i];
+    }
+    delete request;
+  }
+
+  virtual void Put(const GoogleString& key, const SharedString& value) {
+    cache_->Put(key, value);
+  }
+  virtual void Delete(const GoogleString& key) { cache_->Delete(key); }
+  virtual bool MustEncodeKeyInValueOnPut() const { return true; }
+  virtual void PutWithKeyInValue(const GoogleString& key,
+                                 const SharedString& key_and_value) {
+    cache_->PutWithKeyInValue(key, key_and_value);
+  }
+
+  virtual GoogleString Name() const { return cache_->Name(); }
+  virtual bool IsBlocking() const { return true; }
+  virtual bool IsHealthy() const { return cache_->IsHealthy(); }
+  virtual void ShutDown() { cache_->ShutDown(); }
+
+ private:
+  class WaitingCallback : public Callback {
+   public:
+    WaitingCallback(AbstractMutex* mutex, ThreadSystem::Condvar* condvar,
+                    int* pending)
+        : mutex_(mutex), condvar_(condvar), pending_(pending),
+          state_(kNotFound) {}
+
+    KeyState state() const { return state_; }
+
+   protected:
+    virtual void Done(KeyState state) {
+      ScopedMutex lock(mutex_);
+      state_ = state;
+      if (--*pending_ == 0) {
+        condvar_->Signal();
+      }
+    }
+
+   private:
+    AbstractMutex* mutex_;
+    ThreadSystem::Condvar* condvar_;
+    int* pending_;
+    KeyState state_;
+
+    DISALLOW_COPY_AND_ASSIGN(WaitingCallback);
+  };
+
+  AsyncMemCache* cache_;
+  ThreadSystem* thread_system_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockingCache);
+};
+
+AsyncMemCache::AsyncMemCache(const ExternalClusterSpec& cluster,
+                             Hasher* hasher, ThreadSystem* thread_system,
+                             Statistics* statistics, Timer* timer,
+                             MessageHandler* handler)
+    : cluster_spec_(cluster),
+      hasher_(hasher),
+      thread_system_(thread_system),
+      timer_(timer),
+      message_handler_(handler),
+      timeout_us_(500 * Timer::kMsUs),
+      mutex_(thread_system->NewMutex()),
+      running_(false),
+      wakeup_pending_(false),
+      wakeup_read_fd_(-1),
+      wakeup_write_fd_(-1),
+      blocking_cache_(new BlockingCache(this, thread_system)),
+      timeouts_(statistics->GetVariable(kTimeouts)),
+      errors_(statistics->GetVariable(kErrors)),
+      backed_off_(statistics->GetVariable(kBackedOff)),
+      dropped_puts_(statistics->GetVariable(kDroppedPuts)) {
+  for (int i = 0, n = cluster_spec_.servers.size(); i < n; ++i) {
+    const ExternalServerSpec& spec = cluster_spec_.servers[i];
+    servers_.push_back(new Server(spec));
+    for (int point = 0; point < kPointsPerServer; ++point) {
+      ring_.push_back(std::make_pair(
+          hasher_->HashToUint64(
+              StrCat(spec.ToString(), "-", IntegerToString(point))),
+          i));
+    }
+  }
+  std::sort(ring_.begin(), ring_.end());
+}
+
+AsyncMemCache::~AsyncMemCache() {
+  ShutDown();
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    delete servers_[i];
+  }
+  if (wakeup_read_fd_ >= 0) {
+    close(wakeup_read_fd_);
+    close(wakeup_write_fd_);
+  }
+}
+
+void AsyncMemCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kTimeouts);
+  statistics->AddVariable(kErrors);
+  statistics->AddVariable(kBackedOff);
+  statistics->AddVariable(kDroppedPuts);
+}
+
+bool AsyncMemCache::StartUp() {
+  // Look the servers up before the I/O thread starts, since getaddrinfo
+  // blocks, and may take seconds when DNS is slow.
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    Resolve(servers_[i]);
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    message_handler_->Message(kError, "AsyncMemCache: pipe failed: %s",
+                              strerror(errno));
+    return false;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  wakeup_read_fd_ = fds[0];
+  wakeup_write_fd_ = fds[1];
+
+  ScopedMutex lock(mutex_.get());
+  DCHECK(io_thread_.get() == NULL);
+  io_thread_.reset(new IoThread(this, thread_system_));
+  running_ = true;
+  if (!io_thread_->Start()) {
+    running_ = false;
+    io_thread_.reset(NULL);
+    message_handler_->Message(kError,
+                              "AsyncMemCache: could not start I/O thread");
+    return false;
+  }
+  return true;
+}
+
+CacheInterface* AsyncMemCache::blocking_cache() {
+  return blocking_cache_.get();
+}
+
+int AsyncMemCache::ServerIndex(const GoogleString& key) const {
+  DCHECK(!ring_.empty());
+  uint64 position = hasher_->HashToUint64(key);
+  std::vector<std::pair<uint64, int> >::const_iterator point =
+      std::lower_bound(ring_.begin(), ring_.end(),
+                       std::make_pair(position, 0));
+  if (point == ring_.end()) {
+    point = ring_.begin();
+  }
+  return point->second;
+}
+
+void AsyncMemCache::Get(const GoogleString& key, Callback* callback) {
+  MultiGetRequest* request = new MultiGetRequest;
+  request->push_back(KeyCallback(key, callback));
+  MultiGet(request);
+}
+
+void AsyncMemCache::MultiGet(MultiGetRequest* request) {
+  std::vector<Lookup*> lookups(servers_.size(), NULL);
+  for (int i = 0, n = request->size(); i < n; ++i) {
+    Lookup*& lookup = lookups[ServerIndex((*request)[i].key)];
+    if (lookup == NULL) {
+      lookup = new Lookup;
+    }
+    lookup->keys.push_back((*request)[i]);
+  }
+  delete request;
+
+  LookupVector failed;
+  {
+    ScopedMutex lock(mutex_.get());
+    int64 now_us = timer_->NowUs();
+    for (int i = 0, n = lookups.size(); i < n; ++i) {
+      if (lookups[i] == NULL) {
+        // No keys for this server.
+      } else if (running_) {
+        QueueLookup(servers_[i], lookups[i], now_us, &failed);
+      } else {
+        failed.push_back(lookups[i]);
+      }
+    }
+  }
+  ReportLookups(&failed);
+}
+
+void AsyncMemCache::QueueLookup(Server* server, Lookup* lookup, int64 now_us,
+                                LookupVector* failed) {
+  if (!IsAvailable(server, now_us / Timer::kMsUs)) {
+    failed->push_back(lookup);
+    return;
+  }
+  int num_keys = lookup->keys.size();
+  lookup->found.resize(num_keys, false);
+  lookup->values.resize(num_keys);
+  lookup->first_opaque = server->next_opaque;
+  lookup->deadline_us = now_us + timeout_us_;
+  server->next_opaque += num_keys + 1;
+  for (int i = 0; i < num_keys; ++i) {
+    AppendRequest(kOpcodeGetKQ, hasher_->Hash(lookup->keys[i].key), 0, "",
+                  lookup->first_opaque + i, &server->output);
+  }
+  AppendRequest(kOpcodeNoop, "", 0, "", lookup->first_opaque + num_keys,
+                &server->output);
+  server->lookups.push_back(lookup);
+  WakeIoThread();
+}
+
+void AsyncMemCache::Put(const GoogleString& key, const SharedString& value) {
+  SharedString key_and_value;
+  if (key_value_codec::Encode(key, value, &key_and_value)) {
+    PutHelper(key, key_and_value);
+  } else {
+    message_handler_->Message(
+        kError, "AsyncMemCache::Put error: key size %d too large, first "
+        "100 bytes of key is: %s",
+        static_cast<int>(key.size()), key.substr(0, 100).c_str());
+  }
+}
+
+void AsyncMemCache::PutWithKeyInValue(const GoogleString& key,
+                                      const SharedString& key_and_value) {
+  PutHelper(key, key_and_value);
+}
+
+void AsyncMemCache::PutHelper(const GoogleString& key,
+                              const SharedString& key_and_value) {
+  Server* server = servers_[ServerIndex(key)];
+  ScopedMutex lock(mutex_.get());
+  if (!running_ || !IsAvailable(server, timer_->NowMs())) {
+    return;
+  }
+  if (server->output.size() > kMaxBufferedBytes) {
+    dropped_puts_->Add(1);
+    return;
+  }
+  AppendRequest(kOpcodeSetQ, hasher_->Hash(key), kSetExtrasSize,
+                key_and_value.Value(), server->next_opaque++,
+                &server->output);
+  WakeIoThread();
+}
+
+void AsyncMemCache::Delete(const GoogleString& key) {
+  // As with AprMemCache, this removes the FallbackCache's sentinel for a
+  // large value, but not the value itself.
+  Server* server = servers_[ServerIndex(key)];
+  ScopedMutex lock(mutex_.get());
+  if (!running_ || !IsAvailable(server, timer_->NowMs())) {
+    return;
+  }
+  AppendRequest(kOpcodeDeleteQ, hasher_->Hash(key), 0, "",
+                server->next_opaque++, &server->output);
+  WakeIoThread();
+}
+
+bool AsyncMemCache::IsAvailable(Server* server, int64 now_ms) {
+  if (server->retry_time_ms > now_ms) {
+    backed_off_->Add(1);
+    return false;
+  }
+  return true;
+}
+
+void AsyncMemCache::WakeIoThread() {
+  if (!wakeup_pending_) {
+    wakeup_pending_ = true;
+    char byte = 0;
+    if (write(wakeup_write_fd_, &byte, 1) != 1) {
+      // The pipe is full, so the I/O thread is already due to wake up.
+    }
+  }
+}
+
+void AsyncMemCache::Run() {
+  std::vector<struct pollfd> fds;
+  std::vector<Server*> polled;
+  LookupVector done;
+  while (true) {
+    fds.clear();
+    polled.clear();
+    int timeout_ms = kMaxPollIntervalMs;
+    {
+      ScopedMutex lock(mutex_.get());
+      if (!running_) {
+        break;
+      }
+      wakeup_pending_ = false;
+      int64 now_us = timer_->NowUs();
+      int64 now_ms = now_us / Timer::kMsUs;
+      for (int i = 0, n = servers_.size(); i < n; ++i) {
+        Server* server = servers_[i];
+        if ((server->fd < 0) &&
+            (!server->output.empty() || !server->lookups.empty())) {
+          StartConnect(server, now_us, &done);
+        }
+        CheckDeadlines(server, now_us, &done);
+        if (server->state == Server::kConnected && !server->output.empty()) {
+          Write(server, now_ms, &done);
+        }
+        if (server->fd >= 0) {
+          struct pollfd pfd;
+          pfd.fd = server->fd;
+          pfd.events = POLLIN;
+          pfd.revents = 0;
+          int64 deadline_us = 0;
+          if (server->state == Server::kConnecting) {
+            pfd.events |= POLLOUT;
+            deadline_us = server->connect_deadline_us;
+          } else if (!server->output.empty()) {
+            pfd.events |= POLLOUT;
+          }
+          if (!server->lookups.empty() &&
+              ((deadline_us == 0) ||
+               (server->lookups.front()->deadline_us < deadline_us))) {
+            deadline_us = server->lookups.front()->deadline_us;
+          }
+          if (deadline_us != 0) {
+            int64 wait_ms = (deadline_us - now_us + Timer::kMsUs - 1) /
+                Timer::kMsUs;
+            wait_ms = std::max(wait_ms, static_cast<int64>(0));
+            timeout_ms = std::min(timeout_ms, static_cast<int>(wait_ms));
+          }
+          fds.push_back(pfd);
+          polled.push_back(server);
+        }
+      }
+    }
+    ReportLookups(&done);
+
+    struct pollfd wakeup;
+    wakeup.fd = wakeup_read_fd_;
+    wakeup.events = POLLIN;
+    wakeup.revents = 0;
+    fds.push_back(wakeup);
+    if (poll(&fds[0], fds.size(), timeout_ms) < 0) {
+      if (errno != EINTR) {
+        message_handler_->Message(kError, "AsyncMemCache: poll failed: %s",
+                                  strerror(errno));
+      }
+      continue;
+    }
+    if ((fds.back().revents & POLLIN) != 0) {
+      char buffer[64];
+      while (read(wakeup_read_fd_, buffer, sizeof(buffer)) > 0) {
+      }
+    }
+
+    {
+      ScopedMutex lock(mutex_.get());
+      int64 now_ms = timer_->NowMs();
+      for (int i = 0, n = polled.size(); i < n; ++i) {
+        Server* server = polled[i];
+        int revents = fds[i].revents;
+        if ((revents == 0) || (server->fd != fds[i].fd)) {
+          continue;
+        }
+        if (server->state == Server::kConnecting) {
+          FinishConnect(server, now_ms, &done);
+        }
+        if ((server->state == Server::kConnected) &&
+            ((revents & (POLLIN | POLLERR | POLLHUP)) != 0)) {
+          Read(server, now_ms, &done);
+        }
+        if ((server->state == Server::kConnected) &&
+            ((revents & POLLOUT) != 0)) {
+          Write(server, now_ms, &done);
+        }
+      }
+    }
+    ReportLookups(&done);
+  }
+}
+
+void AsyncMemCache::Resolve(Server* server) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addresses = NULL;
+  GoogleString port = IntegerToString(server->spec.port);
+  if (getaddrinfo(server->spec.host.c_str(), port.c_str(), &hints,
+                  &addresses) != 0 || (addresses == NULL)) {
+    message_handler_->Message(kError, "AsyncMemCache: %s could not be resolved",
+                              server->spec.ToString().c_str());
+    return;
+  }
+  DCHECK_LE(addresses->ai_addrlen, sizeof(server->address));
+  server->family = addresses->ai_family;
+  memcpy(&server->address, addresses->ai_addr, addresses->ai_addrlen);
+  server->address_length = addresses->ai_addrlen;
+  server->resolved = true;
+  freeaddrinfo(addresses);
+}
+
+void AsyncMemCache::StartConnect(Server* server, int64 now_us,
+                                 LookupVector* done) {
+  int64 now_ms = now_us / Timer::kMsUs;
+  if (!server->resolved) {
+    Fail(server, "could not be resolved", now_ms, done);
+    return;
+  }
+  int fd = socket(server->family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    Fail(server, "socket failed", now_ms, done);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  server->fd = fd;
+  int result = connect(
+      fd, reinterpret_cast<const struct sockaddr*>(&server->address),
+      server->address_length);
+  if (result == 0) {
+    server->state = Server::kConnected;
+  } else if (errno == EINPROGRESS) {
+    server->state = Server::kConnecting;
+    server->connect_deadline_us = now_us + timeout_us_;
+  } else {
+    Fail(server, "refused the connection", now_ms, done);
+  }
+}
+
+void AsyncMemCache::FinishConnect(Server* server, int64 now_ms,
+                                  LookupVector* done) {
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if ((getsockopt(server->fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) ||
+      (error != 0)) {
+    Fail(server, "refused the connection", now_ms, done);
+  } else {
+    server->state = Server::kConnected;
+  }
+}
+
+void AsyncMemCache::CheckDeadlines(Server* server, int64 now_us,
+                                   LookupVector* done) {
+  // Responses arrive in the order the requests were sent, so if the oldest
+  // lookup hasn't been answered in time, none of the others will be.
+  int64 now_ms = now_us / Timer::kMsUs;
+  if ((server->state == Server::kConnecting) &&
+      (server->connect_deadline_us <= now_us)) {
+    timeouts_->Add(1);
+    Fail(server, "timed out connecting", now_ms, done);
+  } else if (!server->lookups.empty() &&
+             (server->lookups.front()->deadline_us <= now_us)) {
+    timeouts_->Add(1);
+    Fail(server, "timed out", now_ms, done);
+  }
+}
+
+void AsyncMemCache::Write(Server* server, int64 now_ms, LookupVector* done) {
+  size_t written = 0;
+  while (written < server->output.size()) {
+    ssize_t bytes = send(server->fd, server->output.data() + written,
+                         server->output.size() - written, MSG_NOSIGNAL);
+    if (bytes > 0) {
+      written += bytes;
+    } else if ((bytes < 0) && (errno == EINTR)) {
+      continue;
+    } else if ((bytes < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      break;
+    } else {
+      Fail(server, "write failed", now_ms, done);
+      return;
+    }
+  }
+  server->output.erase(0, written);
+}
+
+void AsyncMemCache::Read(Server* server, int64 now_ms, LookupVector* done) {
+  char buffer[kReadBufferSize];
+  while (true) {
+    ssize_t bytes = recv(server->fd, buffer, sizeof(buffer), 0);
+    if (bytes > 0) {
+      server->input.append(buffer, bytes);
+    } else if ((bytes < 0) && (errno == EINTR)) {
+      continue;
+    } else if ((bytes < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      break;
+    } else if ((bytes == 0) && server->lookups.empty() &&
+               server->output.empty()) {
+      // The server closed an idle connection; reconnect when next needed.
+      Close(server, done);
+      return;
+    } else {
+      Fail(server, "closed the connection", now_ms, done);
+      return;
+    }
+  }
+  if (!ParseResponses(server, done)) {
+    Fail(server, "sent an invalid response", now_ms, done);
+  }
+}
+
+bool AsyncMemCache::ParseResponses(Server* server, LookupVector* done) {
+  const GoogleString& input = server->input;
+  size_t pos = 0;
+  while (input.size() - pos >= kHeaderSize) {
+    const char* header = input.data() + pos;
+    uint8 magic = header[0];
+    uint8 opcode = header[1];
+    uint32 key_size = ReadBigEndian(header + 2, 2);
+    uint32 extras_size = static_cast<uint8>(header[4]);
+    uint32 status = ReadBigEndian(header + 6, 2);
+    uint32 body_size = ReadBigEndian(header + 8, 4);
+    uint32 opaque = ReadBigEndian(header + 12, 4);
+    if ((magic != kResponseMagic) || (extras_size + key_size > body_size)) {
+      return false;
+    }
+    if (input.size() - pos - kHeaderSize < body_size) {
+      break;  // Wait for the rest of the body.
+    }
+    const char* value = header + kHeaderSize + extras_size + key_size;
+    size_t value_size = body_size - extras_size - key_size;
+    pos += kHeaderSize + body_size;
+
+    if ((opcode == kOpcodeSetQ) || (opcode == kOpcodeDeleteQ)) {
+      // Quiet writes are only answered when they fail.
+      if ((opcode == kOpcodeSetQ) || (status != kStatusKeyNotFound)) {
+        errors_->Add(1);
+        message_handler_->Message(
+            kWarning, "AsyncMemCache: server %s failed a %s with status %d",
+            server->spec.ToString().c_str(),
+            (opcode == kOpcodeSetQ) ? "Put" : "Delete",
+            static_cast<int>(status));
+      }
+      continue;
+    }
+    if (((opcode != kOpcodeGetKQ) && (opcode != kOpcodeNoop)) ||
+        server->lookups.empty()) {
+      return false;
+    }
+    Lookup* lookup = server->lookups.front();
+    uint32 index = opaque - lookup->first_opaque;
+    uint32 num_keys = lookup->keys.size();
+    if (opcode == kOpcodeNoop) {
+      if (index != num_keys) {
+        return false;
+      }
+      server->lookups.pop_front();
+      server->consecutive_failures = 0;
+      done->push_back(lookup);
+    } else if (index >= num_keys) {
+      return false;
+    } else if (status == kStatusOk) {
+      lookup->found[index] = true;
+      lookup->values[index].Assign(value, value_size);
+    } else {
+      // A miss isn't answered at all, so this is an error, but only for the
+      // one key.
+      errors_->Add(1);
+    }
+  }
+  server->input.erase(0, pos);
+  return true;
+}
+
+void AsyncMemCache::Fail(Server* server, const char* reason, int64 now_ms,
+                         LookupVector* done) {
+  errors_->Add(1);
+  ++server->consecutive_failures;
+  int64 backoff_ms = kMinBackoffMs;
+  for (int i = 1; (i < server->consecutive_failures) &&
+           (backoff_ms < kMaxBackoffMs); ++i) {
+    backoff_ms *= 2;
+  }
+  backoff_ms = std::min(backoff_ms, kMaxBackoffMs);
+  server->retry_time_ms = now_ms + backoff_ms;
+  message_handler_->Message(
+      kWarning, "AsyncMemCache: memcached server %s %s; backing off for %d ms",
+      server->spec.ToString().c_str(), reason, static_cast<int>(backoff_ms));
+  Close(server, done);
+}
+
+void AsyncMemCache::Close(Server* server, LookupVector* done) {
+  if (server->fd >= 0) {
+    close(server->fd);
+    server->fd = -1;
+  }
+  server->state = Server::kDisconnected;
+  server->input.clear();
+  server->output.clear();
+  done->insert(done->end(), server->lookups.begin(), server->lookups.end());
+  server->lookups.clear();
+}
+
+void AsyncMemCache::ReportLookups(LookupVector* done) {
+  for (int i = 0, n = done->size(); i < n; ++i) {
+    Lookup* lookup = (*done)[i];
+    for (int j = 0, m = lookup->keys.size(); j < m; ++j) {
+      KeyCallback* key_callback = &lookup->keys[j];
+      if ((j < static_cast<int>(lookup->found.size())) && lookup->found[j]) {
+        DecodeValueMatchingKeyAndCallCallback(
+            key_callback->key, lookup->values[j], key_callback->callback);
+      } else {
+        ValidateAndReportResult(key_callback->key, kNotFound,
+                                key_callback->callback);
+      }
+    }
+    delete lookup;
+  }
+  done->clear();
+}
+
+void AsyncMemCache::DecodeValueMatchingKeyAndCallCallback(
+    const GoogleString& key, const SharedString& data, Callback* callback) {
+  SharedString key_and_value(data);
+  GoogleString actual_key;
+  SharedString value;
+  if (!key_value_codec::Decode(&key_and_value, &actual_key, &value)) {
+    message_handler_->Message(
+        kError, "AsyncMemCache: decoding error on key %s", key.c_str());
+    ValidateAndReportResult(key, kNotFound, callback);
+  } else if (actual_key != key) {
+    message_handler_->Message(
+        kError, "AsyncMemCache: key collision %s != %s", key.c_str(),
+        actual_key.c_str());
+    ValidateAndReportResult(key, kNotFound, callback);
+  } else {
+    callback->set_value(value);
+    ValidateAndReportResult(key, kAvailable, callback);
+  }
+}
+
+bool AsyncMemCache::GetStatus(GoogleString* buffer) {
+  ScopedMutex lock(mutex_.get());
+  int64 now_ms = timer_->NowMs();
+  bool ret = true;
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    Server* server = servers_[i];
+    const char* state = "idle";
+    if (server->retry_time_ms > now_ms) {
+      state = "backed off";
+      ret = false;
+    } else if (server->state == Server::kConnecting) {
+      state = "connecting";
+    } else if (server->state == Server::kConnected) {
+      state = "connected";
+    }
+    StrAppend(buffer, "memcached server ", server->spec.ToString(), " ",
+              state, "\n");
+    StrAppend(buffer, "lookups_in_flight:     ",
+              IntegerToString(server->lookups.size()), "\n");
+    StrAppend(buffer, "bytes_to_write:        ",
+              IntegerToString(server->output.size()), "\n");
+    StrAppend(buffer, "consecutive_failures:  ",
+              IntegerToString(server->consecutive_failures), "\n");
+    if (server->retry_time_ms > now_ms) {
+      StrAppend(buffer, "retry_in_ms:           ",
+                Integer64ToString(server->retry_time_ms - now_ms), "\n");
+    }
+    StrAppend(buffer, "\n");
+  }
+  return ret;
+}
+
+bool AsyncMemCache::IsHealthy() const {
+  ScopedMutex lock(mutex_.get());
+  if (!running_) {
+    return false;
+  }
+  int64 now_ms = timer_->NowMs();
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    if (servers_[i]->retry_time_ms <= now_ms) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void AsyncMemCache::ShutDown() {
+  scoped_ptr<IoThread> io_thread;
+  {
+    ScopedMutex lock(mutex_.get());
+    if (running_) {
+      running_ = false;
+      WakeIoThread();
+    }
+    io_thread.reset(io_thread_.release());
+  }
+  if (io_thread.get() == NULL) {
+    return;
+  }
+  io_thread->Join();
+
+  LookupVector done;
+  {
+    ScopedMutex lock(mutex_.get());
+    for (int i = 0, n = servers_.size(); i < n; ++i) {
+      Close(servers_[i], &done);
+    }
+  }
+  ReportLookups(&done);
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_SYSTEM_ASYNC_MEM_CACHE_H_
+#define PAGESPEED_SYSTEM_ASYNC_MEM_CACHE_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/system/external_server_spec.h"
+
+namespace net_instaweb {
+
+class Hasher;
+class MessageHandler;
+class Statistics;
+class Variable;
+
+// Event-driven memcached client, speaking the binary protocol, for use in
+// place of AprMemCache.  Rather than tying up a thread for every operation in
+// flight, all the servers are driven by a single I/O thread which polls their
+// non-blocking connections:
+//
+// - Requests are pipelined: each server has a single connection on which
+//   requests are written as they are issued, without waiting for the
+//   responses to earlier ones.
+// - MultiGet sends the keys for each server as a batch of quiet GETKQ
+//   requests followed by a NOOP, so the server only answers with the hits
+//   and the NOOP marks the end of the batch.  Puts and Deletes are quiet too.
+// - Keys are spread across the servers by consistent hashing, so adding or
+//   removing a server only moves the keys it owns.
+// - Each server's health is tracked separately.  A connection error or
+//   timeout fails the requests in flight on that server and backs it off
+//   exponentially, during which its keys are reported as not found without
+//   being sent.  The other servers are unaffected.
+//
+// Callbacks are run on the I/O thread, and so must not block.  Like
+// AprMemCache, keys are hashed before being sent to memcached, and the
+// original key is stored with the value to detect collisions.
+class AsyncMemCache : public CacheInterface {
+ public:
+  // Same limit as AprMemCache; larger values go to the FallbackCache.
+  static const size_t kValueSizeThreshold = 1 * 1000 * 1000;
+
+  // Number of points each server is given on the consistent-hashing ring.
+  static const int kPointsPerServer = 160;
+
+  // After the first error a server is backed off for kMinBackoffMs, doubling
+  // on each further consecutive error up to kMaxBackoffMs.
+  static const int64 kMinBackoffMs = 500;
+  static const int64 kMaxBackoffMs = 30 * Timer::kSecondMs;
+
+  // Puts are dropped rather than buffered once this much output is waiting
+  // to be written to a server.
+  static const size_t kMaxBufferedBytes = 16 * 1000 * 1000;
+
+  // Does not take ownership of hasher, thread_system, statistics, timer or
+  // handler.  No connections are made until StartUp is called.
+  AsyncMemCache(const ExternalClusterSpec& cluster, Hasher* hasher,
+                ThreadSystem* thread_system, Statistics* statistics,
+                Timer* timer, MessageHandler* handler);
+  virtual ~AsyncMemCache();
+
+  static void InitStats(Statistics* statistics);
+
+  const ExternalClusterSpec& cluster_spec() const { return cluster_spec_; }
+
+  // Looks up the servers' addresses, and starts the I/O thread.  Servers are
+  // connected to lazily, on the first operation that needs them.  A server
+  // whose name can't be resolved here is treated as down until restart.
+  // Until this is called every lookup misses.  Returns false if the thread
+  // could not be started.
+  bool StartUp();
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, const SharedString& value);
+  virtual void Delete(const GoogleString& key);
+  virtual void MultiGet(MultiGetRequest* request);
+
+  virtual bool MustEncodeKeyInValueOnPut() const { return true; }
+  virtual void PutWithKeyInValue(const GoogleString& key,
+                                 const SharedString& key_and_value);
+
+  // Appends the state of the connection to each server.  Returns false if
+  // any of them is backed off after errors.
+  bool GetStatus(GoogleString* status_string);
+
+  static GoogleString FormatName() { return "AsyncMemCache"; }
+  virtual GoogleString Name() const { return FormatName(); }
+
+  virtual bool IsBlocking() const { return false; }
+
+  // Healthy as long as the I/O thread is running and some server is not
+  // backed off.
+  virtual bool IsHealthy() const;
+
+  // Stops the I/O thread, reporting every lookup still in flight as not
+  // found, and closes the connections.
+  virtual void ShutDown();
+
+  // Returns a view of this cache whose lookups wait for their results, for
+  // the users of SystemCaches that need a blocking cache.  Owned by this
+  // object.  It must not be used from within a callback, which runs on the
+  // I/O thread.
+  CacheInterface* blocking_cache();
+
+  // Sets the time, in microseconds, a lookup may wait for its response
+  // before the connection it was sent on is considered broken.  This should
+  // be called at setup time.
+  void set_timeout_us(int64 timeout_us) { timeout_us_ = timeout_us; }
+
+  // Returns the index in cluster_spec() of the server that owns key.
+  int ServerIndex(const GoogleString& key) const;
+
+ private:
+  class BlockingCache;
+  class IoThread;
+  struct Lookup;
+  struct Server;
+  typedef std::vector<Lookup*> LookupVector;
+
+  // Queues a lookup of the given keys, all owned by server.  If the server
+  // is backed off, the lookup is instead added to *failed.
+  void QueueLookup(Server* server, Lookup* lookup, int64 now_us,
+                   LookupVector* failed) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Appends a quiet SET of key_and_value to the output of key's server.
+  void PutHelper(const GoogleString& key, const SharedString& key_and_value);
+
+  // Returns false if the server is backed off, counting the rejection.
+  bool IsAvailable(Server* server, int64 now_ms)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void WakeIoThread() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Looks up server's address, blocking.  Called by StartUp before the I/O
+  // thread is started, so that no lookup waits behind DNS.
+  void Resolve(Server* server);
+
+  // The I/O loop, and its helpers, all run on the I/O thread.
+  void Run();
+  void StartConnect(Server* server, int64 now_us, LookupVector* done)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void FinishConnect(Server* server, int64 now_ms, LookupVector* done)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void CheckDeadlines(Server* server, int64 now_us, LookupVector* done)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void Write(Server* server, int64 now_ms, LookupVector* done)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void Read(Server* server, int64 now_ms, LookupVector* done)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Parses the responses in server->input, moving the lookups they finish
+  // to *done.  Returns false on a protocol error.
+  bool ParseResponses(Server* server, LookupVector* done)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Closes the server's connection, moves its lookups in flight to *done,
+  // and backs it off.
+  void Fail(Server* server, const char* reason, int64 now_ms,
+            LookupVector* done) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void Close(Server* server, LookupVector* done)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Runs the callbacks of finished lookups and deletes them.
+  void ReportLookups(LookupVector* done) LOCKS_EXCLUDED(mutex_);
+  void DecodeValueMatchingKeyAndCallCallback(
+      const GoogleString& key, const SharedString& data, Callback* callback);
+
+  ExternalClusterSpec cluster_spec_;
+  Hasher* hasher_;
+  ThreadSystem* thread_system_;
+  Timer* timer_;
+  MessageHandler* message_handler_;
+  int64 timeout_us_;
+
+  // The consistent-hashing ring: points sorted by position, each naming the
+  // index of a server.  Fixed at construction.
+  std::vector<std::pair<uint64, int> > ring_;
+
+  // The servers themselves are fixed at construction, but all their state is
+  // guarded by mutex_.
+  scoped_ptr<AbstractMutex> mutex_;
+  std::vector<Server*> servers_;
+  scoped_ptr<IoThread> io_thread_ GUARDED_BY(mutex_);
+  bool running_ GUARDED_BY(mutex_);
+  bool wakeup_pending_ GUARDED_BY(mutex_);
+
+  // Written to wake the I/O thread out of poll() when there is new output.
+  int wakeup_read_fd_;
+  int wakeup_write_fd_;
+
+  scoped_ptr<BlockingCache> blocking_cache_;
+
+  Variable* timeouts_;
+  Variable* errors_;
+  Variable* backed_off_;
+  Variable* dropped_puts_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncMemCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_SYSTEM_ASYNC_MEM_CACHE_H_
@@ -0,0 +1,302 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the event-driven memcached client against the in-tree stand-in
+// server.
+
+#include "pagespeed/system/async_mem_cache.h"
+
+#include <cstdlib>
+
+#include "pagespeed/kernel/base/google_message_handler.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/md5_hasher.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_test_base.h"
+#include "pagespeed/kernel/thread/worker_test_base.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+#include "pagespeed/system/external_server_spec.h"
+#include "pagespeed/system/memcached_server_for_testing.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const int64 kTimeoutUs = 200 * Timer::kMsUs;
+
+}  // namespace
+
+class AsyncMemCacheTest : public CacheTestBase {
+ protected:
+  class AsyncCallback : public CacheTestBase::Callback {
+   public:
+    explicit AsyncCallback(AsyncMemCacheTest* test)
+        : Callback(test),
+          sync_point_(test->thread_system_.get()) {
+    }
+
+    virtual void Done(CacheInterface::KeyState state) {
+      Callback::Done(state);
+      sync_point_.Notify();
+    }
+
+    virtual void Wait() { sync_point_.Wait(); }
+
+   private:
+    WorkerTestBase::SyncPoint sync_point_;
+  };
+
+  AsyncMemCacheTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        timer_(Platform::CreateTimer()),
+        statistics_(thread_system_.get()) {
+    set_mutex(thread_system_->NewMutex());
+    AsyncMemCache::InitStats(&statistics_);
+  }
+
+  virtual ~AsyncMemCacheTest() {
+    if (cache_.get() != NULL) {
+      cache_->ShutDown();
+    }
+    for (int i = 0, n = servers_.size(); i < n; ++i) {
+      delete servers_[i];
+    }
+  }
+
+  // Starts num_servers stand-in servers and a cache using them all.
+  void StartServers(int num_servers) {
+    for (int i = 0; i < num_servers; ++i) {
+      servers_.push_back(
+          new MemcachedServerForTesting(0, thread_system_.get()));
+      ASSERT_TRUE(servers_.back()->StartServing());
+      cluster_.servers.push_back(
+          ExternalServerSpec("127.0.0.1", servers_.back()->port()));
+    }
+    StartCache();
+  }
+
+  void StartCache() {
+    cache_.reset(new AsyncMemCache(cluster_, &hasher_, thread_system_.get(),
+                                   &statistics_, timer_.get(), &handler_));
+    cache_->set_timeout_us(kTimeoutUs);
+    ASSERT_TRUE(cache_->StartUp());
+  }
+
+  // Returns a key that AsyncMemCache stores on servers_[index].
+  GoogleString KeyOnServer(int index) {
+    for (int i = 0; ; ++i) {
+      GoogleString key = StrCat("key", IntegerToString(i));
+      if (cache_->ServerIndex(key) == index) {
+        return key;
+      }
+    }
+  }
+
+  int64 Stat(const char* name) {
+    return statistics_.GetVariable(StrCat("async_memcache_", name))->Get();
+  }
+
+  virtual CacheInterface* Cache() { return cache_.get(); }
+  virtual Callback* NewCallback() { return new AsyncCallback(this); }
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  scoped_ptr<Timer> timer_;
+  SimpleStats statistics_;
+  MD5Hasher hasher_;
+  GoogleMessageHandler handler_;
+  ExternalClusterSpec cluster_;
+  std::vector<MemcachedServerForTesting*> servers_;
+  scoped_ptr<AsyncMemCache> cache_;
+};
+
+TEST_F(AsyncMemCacheTest, PutGetDelete) {
+  StartServers(1);
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  CheckNotFound("Another Name");
+
+  CheckPut("Name", "NewValue");
+  CheckGet("Name", "NewValue");
+
+  CheckDelete("Name");
+  CheckNotFound("Name");
+  CheckDelete("Name");  // Deleting a missing key isn't an error.
+  CheckNotFound("Name");
+  EXPECT_EQ(0, Stat("errors"));
+  EXPECT_TRUE(cache_->IsHealthy());
+}
+
+TEST_F(AsyncMemCacheTest, MultiGetIsOneBatchPerServer) {
+  StartServers(2);
+  GoogleString key0 = KeyOnServer(0);
+  GoogleString key1 = KeyOnServer(1);
+  CheckPut(key0, "v0");
+  CheckPut(key1, "v1");
+  int batches0 = servers_[0]->num_batches();
+  int batches1 = servers_[1]->num_batches();
+
+  Callback* n0 = AddCallback();
+  Callback* not_found = AddCallback();
+  Callback* n1 = AddCallback();
+  IssueMultiGet(n0, key0, not_found, "not_found", n1, key1);
+  WaitAndCheck(n0, "v0");
+  WaitAndCheckNotFound(not_found);
+  WaitAndCheck(n1, "v1");
+
+  // Each server saw its keys in a single batch.
+  EXPECT_EQ(1, servers_[0]->num_batches() - batches0);
+  EXPECT_EQ(1, servers_[1]->num_batches() - batches1);
+  EXPECT_EQ(3, servers_[0]->num_keys_looked_up() +
+            servers_[1]->num_keys_looked_up());
+  EXPECT_EQ(1, servers_[0]->num_connections());
+  EXPECT_EQ(1, servers_[1]->num_connections());
+}
+
+TEST_F(AsyncMemCacheTest, PipelinedGets) {
+  StartServers(1);
+  CheckPut("Name", "Value");
+
+  // Issue a number of Gets before any of them are answered; they share the
+  // server's one connection.
+  servers_[0]->set_paused(true);
+  std::vector<Callback*> callbacks;
+  for (int i = 0; i < 10; ++i) {
+    callbacks.push_back(InitiateGet((i % 2 == 0) ? "Name" : "Missing"));
+  }
+  servers_[0]->set_paused(false);
+  for (int i = 0; i < 10; ++i) {
+    if (i % 2 == 0) {
+      WaitAndCheck(callbacks[i], "Value");
+    } else {
+      WaitAndCheckNotFound(callbacks[i]);
+    }
+  }
+  EXPECT_EQ(1, servers_[0]->num_connections());
+}
+
+TEST_F(AsyncMemCacheTest, ConsistentHashing) {
+  for (int i = 0; i < 3; ++i) {
+    cluster_.servers.push_back(ExternalServerSpec("127.0.0.1", 1000 + i));
+  }
+  StartCache();
+  std::vector<int> server_of_key;
+  int keys_per_server[3] = {0, 0, 0};
+  const int kNumKeys = 3000;
+  for (int i = 0; i < kNumKeys; ++i) {
+    int index = cache_->ServerIndex(IntegerToString(i));
+    server_of_key.push_back(index);
+    ++keys_per_server[index];
+  }
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_LT(kNumKeys / 5, keys_per_server[i]);
+  }
+
+  // Removing the last server only moves the keys that were on it.
+  cluster_.servers.pop_back();
+  StartCache();
+  for (int i = 0; i < kNumKeys; ++i) {
+    int index = cache_->ServerIndex(IntegerToString(i));
+    if (server_of_key[i] != 2) {
+      EXPECT_EQ(server_of_key[i], index);
+    }
+  }
+}
+
+TEST_F(AsyncMemCacheTest, TimeoutBacksOffServer) {
+  StartServers(1);
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  servers_[0]->set_paused(true);
+  CheckNotFound("Name");
+  EXPECT_EQ(1, Stat("timeouts"));
+  EXPECT_FALSE(cache_->IsHealthy());
+  GoogleString status;
+  EXPECT_FALSE(cache_->GetStatus(&status));
+  EXPECT_NE(GoogleString::npos, status.find("backed off")) << status;
+
+  // While backed off, lookups fail without being sent.
+  servers_[0]->set_paused(false);
+  CheckNotFound("Name");
+  EXPECT_EQ(1, Stat("backed_off"));
+
+  // Once the backoff expires, the server is reconnected to.
+  timer_->SleepMs(AsyncMemCache::kMinBackoffMs + 50);
+  EXPECT_TRUE(cache_->IsHealthy());
+  CheckGet("Name", "Value");
+  EXPECT_EQ(2, servers_[0]->num_connections());
+}
+
+TEST_F(AsyncMemCacheTest, DeadServerOnlyAffectsItsKeys) {
+  StartServers(2);
+  GoogleString key0 = KeyOnServer(0);
+  GoogleString key1 = KeyOnServer(1);
+  CheckPut(key0, "v0");
+  CheckPut(key1, "v1");
+  servers_[1]->ShutDown();
+
+  CheckNotFound(key1.c_str());
+  EXPECT_LT(0, Stat("errors"));
+  CheckGet(key0, "v0");
+  EXPECT_TRUE(cache_->IsHealthy());
+}
+
+TEST_F(AsyncMemCacheTest, ConnectionRefused) {
+  StartServers(1);
+  servers_[0]->ShutDown();
+  CheckNotFound("Name");
+  EXPECT_EQ(1, Stat("errors"));
+  EXPECT_FALSE(cache_->IsHealthy());
+}
+
+TEST_F(AsyncMemCacheTest, ShutDownReportsLookupsInFlight) {
+  StartServers(1);
+  CheckPut("Name", "Value");
+  servers_[0]->set_paused(true);
+  Callback* callback = InitiateGet("Name");
+  cache_->ShutDown();
+  WaitAndCheckNotFound(callback);
+  EXPECT_FALSE(cache_->IsHealthy());
+  CheckNotFound("Name");
+  servers_[0]->set_paused(false);
+}
+
+TEST_F(AsyncMemCacheTest, BlockingCache) {
+  StartServers(2);
+  CacheInterface* blocking = cache_->blocking_cache();
+  EXPECT_TRUE(blocking->IsBlocking());
+  CheckPut(blocking, "Name", "Value");
+
+  // The default callback doesn't wait, so this checks that the value is
+  // there by the time Get returns.
+  Callback callback(this);
+  blocking->Get("Name", &callback);
+  EXPECT_TRUE(callback.called());
+  EXPECT_EQ(CacheInterface::kAvailable, callback.state());
+  EXPECT_EQ("Value", callback.value_str());
+
+  CheckDelete("Name");
+  Callback missing(this);
+  blocking->Get("Name", &missing);
+  EXPECT_TRUE(missing.called());
+  EXPECT_EQ(CacheInterface::kNotFound, missing.state());
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,946 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/system/async_redis_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/condvar.h"
+#include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/statistics.h"
+#include "pagespeed/kernel/base/thread.h"
+#include "pagespeed/system/redis_cache.h"
+#include "third_party/hiredis/src/async.h"
+#include "third_party/hiredis/src/hiredis.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kTimeouts[] = "async_redis_timeouts";
+const char kErrors[] = "async_redis_errors";
+const char kBackedOff[] = "async_redis_backed_off";
+const char kRedirections[] = "async_redis_redirections";
+const char kClusterSlotsFetches[] = "async_redis_cluster_slots_fetches";
+
+// As in RedisCache, a command is sent to at most two servers.
+const int kMaxRedirections = 1;
+
+const int kMaxPollIntervalMs = Timer::kSecondMs;
+
+}  // namespace
+
+// A command written to a connection's pipeline.  A lookup holds the keys of
+// one MGET, all in the same hash slot unless the server isn't a cluster.
+struct AsyncRedisCache::Request {
+  enum Type { kLookup, kPut, kDelete, kClusterSlots };
+
+  explicit Request(Type request_type)
+      : type(request_type), connection(NULL), redirections(0), asking(false),
+        deadline_us(0) {}
+
+  Type type;
+  MultiGetRequest keys;              // kLookup
+  std::vector<bool> found;
+  std::vector<SharedString> values;
+  GoogleString key;                  // kPut and kDelete
+  SharedString value;                // kPut
+  Connection* connection;            // Where it was last sent.
+  int redirections;
+  bool asking;                       // Must be preceded by ASKING.
+  int64 deadline_us;
+};
+
+struct AsyncRedisCache::Connection {
+  enum State { kDisconnected, kConnecting, kConnected };
+
+  Connection(AsyncRedisCache* redis_cache, const ExternalServerSpec& spec_in)
+      : cache(redis_cache), spec(spec_in), context(NULL),
+        state(kDisconnected), generation(0), reading(false), writing(false),
+        connect_deadline_us(0), retry_time_ms(0) {}
+
+  AsyncRedisCache* cache;
+  ExternalServerSpec spec;
+  redisAsyncContext* context;        // NULL when disconnected.
+  State state;
+  int generation;                    // Bumped for every new context.
+  bool reading;                      // What hiredis asked us to poll for.
+  bool writing;
+  int64 connect_deadline_us;
+  int64 retry_time_ms;               // Backed off until then.
+  std::deque<Request*> in_flight;    // Sent, oldest first.
+};
+
+class AsyncRedisCache::IoThread : public ThreadSystem::Thread {
+ public:
+  IoThread(AsyncRedisCache* cache, ThreadSystem* thread_system)
+      : ThreadSystem::Thread(thread_system, "redis_io",
+                             ThreadSystem::kJoinable),
+        cache_(cache) {}
+
+  virtual void Run() { cache_->Run(); }
+
+ private:
+  AsyncRedisCache* cache_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoThread);
+};
+
+// Waits for the lookups it forwards to AsyncRedisCache, and then runs their
+// callbacks on the calling thread.
+class AsyncRedisCache::BlockingCache : public CacheInterface {
+ public:
+  BlockingCache(AsyncRedisCache* cache, ThreadSystem* thread_system)
+      : cache_(cache), thread_system_(thread_system) {}
+
+  virtual void Get(const GoogleString& key, Callback* callback) {
+    MultiGetRequest* request = new MultiGetRequest;
+    request->push_back(KeyCallback(key, callback));
+    MultiGet(request);
+  }
+
+  virtual void MultiGet(MultiGetRequest* request) {
+    scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex(
+        thread_system_->NewMutex());
+    scoped_ptr<ThreadSystem::Condvar> condvar(mutex->NewCondvar());
+    int pending = request->size();
+    std::vector<WaitingCallback*> waiting;
+    MultiGetRequest* forwarded = new MultiGetRequest;
+    for (int i = 0, n = request->size(); i < n; ++i) {
+      waiting.push_back(
+          new WaitingCallback(mutex.get(), condvar.get(), &pending));
+      forwarded->push_back(KeyCallback((*request)[i].key, waiting.back()));
+    }
+    cache_->MultiGet(forwarded);
+    {
+      ScopedMutex lock(mutex.get());
+      while (pending > 0) {
+        condvar->Wait();
+      }
+    }
+    for (int i = 0, n = request->size(); i < n; ++i) {
+      KeyCallback* key_callback = &(*request)[i];
+      key_callback->callback->set_value(waiting[i]->value());
+      ValidateAndReportResult(key_callback->key, waiting[i]->state(),
+                              key_callback->callback);
+      delete waiting[i];
+    }
+    delete request;
+  }
+
+  virtual void Put(const GoogleString& key, const SharedString& value) {
+    cache_->Put(key, value);
+  }
+  virtual void Delete(const GoogleString& key) { cache_->Delete(key); }
+
+  virtual GoogleString Name() const { return cache_->Name(); }
+  virtual bool IsBlocking() const { return true; }
+  virtual bool IsHealthy() const { return cache_->IsHealthy(); }
+  virtual void ShutDown() { cache_->ShutDown(); }
+
+ private:
+  class WaitingCallback : public Callback {
+   public:
+    WaitingCallback(AbstractMutex* mutex, ThreadSystem::Condvar* condvar,
+                    int* pending)
+        : mutex_(mutex), condvar_(condvar), pending_(pending),
+          state_(kNotFound) {}
+
+    KeyState state() const { return state_; }
+
+   protected:
+    virtual void Done(KeyState state) {
+      ScopedMutex lock(mutex_);
+      state_ = state;
+      if (--*pending_ == 0) {
+        condvar_->Signal();
+      }
+    }
+
+   private:
+    AbstractMutex* mutex_;
+    ThreadSystem::Condvar* condvar_;
+    int* pending_;
+    KeyState state_;
+
+    DISALLOW_COPY_AND_ASSIGN(WaitingCallback);
+  };
+
+  AsyncRedisCache* cache_;
+  ThreadSystem* thread_system_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlockingCache);
+};
+
+AsyncRedisCache::AsyncRedisCache(StringPiece host, int port,
+                                 ThreadSystem* thread_system,
+                                 MessageHandler* handler, Timer* timer,
+                                 int64 reconnection_delay_ms,
+                                 int64 timeout_us, Statistics* stats)
+    : main_spec_(host.as_string(), port),
+      thread_system_(thread_system),
+      message_handler_(handler),
+      timer_(timer),
+      reconnection_delay_ms_(reconnection_delay_ms),
+      timeout_us_(timeout_us),
+      mutex_(thread_system->NewMutex()),
+      running_(false),
+      wakeup_pending_(false),
+      main_connection_(NULL),
+      cluster_mode_(kUnknown),
+      cluster_slots_pending_(false),
+      wakeup_read_fd_(-1),
+      wakeup_write_fd_(-1),
+      blocking_cache_(new BlockingCache(this, thread_system)),
+      timeouts_(stats->GetVariable(kTimeouts)),
+      errors_(stats->GetVariable(kErrors)),
+      backed_off_(stats->GetVariable(kBackedOff)),
+      redirections_(stats->GetVariable(kRedirections)),
+      cluster_slots_fetches_(stats->GetVariable(kClusterSlotsFetches)) {
+  ScopedMutex lock(mutex_.get());
+  main_connection_ = GetOrCreateConnection(main_spec_);
+}
+
+AsyncRedisCache::~AsyncRedisCache() {
+  ShutDown();
+  for (std::map<GoogleString, Connection*>::iterator it =
+           connections_.begin(); it != connections_.end(); ++it) {
+    delete it->second;
+  }
+  if (wakeup_read_fd_ >= 0) {
+    close(wakeup_read_fd_);
+    close(wakeup_write_fd_);
+  }
+}
+
+void AsyncRedisCache::InitStats(Statistics* stats) {
+  stats->AddVariable(kTimeouts);
+  stats->AddVariable(kErrors);
+  stats->AddVariable(kBackedOff);
+  stats->AddVariable(kRedirections);
+  stats->AddVariable(kClusterSlotsFetches);
+}
+
+GoogleString AsyncRedisCache::ServerDescription() const {
+  return main_spec_.ToString();
+}
+
+bool AsyncRedisCache::StartUp() {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    message_handler_->Message(kError, "AsyncRedisCache: pipe failed: %s",
+                              strerror(errno));
+    return false;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  wakeup_read_fd_ = fds[0];
+  wakeup_write_fd_ = fds[1];
+
+  ScopedMutex lock(mutex_.get());
+  DCHECK(io_thread_.get() == NULL);
+  io_thread_.reset(new IoThread(this, thread_system_));
+  running_ = true;
+  if (!io_thread_->Start()) {
+    running_ = false;
+    io_thread_.reset(NULL);
+    message_handler_->Message(kError,
+                              "AsyncRedisCache: could not start I/O thread");
+    return false;
+  }
+  return true;
+}
+
+CacheInterface* AsyncRedisCache::blocking_cache() {
+  return blocking_cache_.get();
+}
+
+void AsyncRedisCache::Get(const GoogleString& key, Callback* callback) {
+  MultiGetRequest* request = new MultiGetRequest;
+  request->push_back(KeyCallback(key, callback));
+  MultiGet(request);
+}
+
+void AsyncRedisCache::MultiGet(MultiGetRequest* request) {
+  Request* lookup = new Request(Request::kLookup);
+  lookup->keys.swap(*request);
+  delete request;
+  Queue(lookup);
+}
+
+void AsyncRedisCache::Put(const GoogleString& key, const SharedString& value) {
+  Request* put = new Request(Request::kPut);
+  put->key = key;
+  put->value = value;
+  Queue(put);
+}
+
+void AsyncRedisCache::Delete(const GoogleString& key) {
+  Request* del = new Request(Request::kDelete);
+  del->key = key;
+  Queue(del);
+}
+
+void AsyncRedisCache::Queue(Request* request) {
+  {
+    ScopedMutex lock(mutex_.get());
+    if (running_) {
+      queued_.push_back(request);
+      WakeIoThread();
+      return;
+    }
+  }
+  if (request->type == Request::kLookup) {
+    RequestVector failed(1, request);
+    ReportLookups(&failed);
+  } else {
+    delete request;
+  }
+}
+
+void AsyncRedisCache::WakeIoThread() {
+  if (!wakeup_pending_) {
+    wakeup_pending_ = true;
+    char byte = 0;
+    if (write(wakeup_write_fd_, &byte, 1) != 1) {
+      // The pipe is full, so the I/O thread is already due to wake up.
+    }
+  }
+}
+
+void AsyncRedisCache::Run() {
+  std::vector<struct pollfd> fds;
+  std::vector<Connection*> polled;
+  std::vector<int> generations;
+  RequestVector done;
+  while (true) {
+    fds.clear();
+    polled.clear();
+    generations.clear();
+    int timeout_ms = kMaxPollIntervalMs;
+    {
+      ScopedMutex lock(mutex_.get());
+      if (!running_) {
+        break;
+      }
+      wakeup_pending_ = false;
+      int64 now_us = timer_->NowUs();
+      if ((cluster_mode_ == kUnknown) && !cluster_slots_pending_ &&
+          (main_connection_->retry_time_ms <= now_us / Timer::kMsUs)) {
+        FetchClusterSlots(main_connection_, now_us);
+      }
+      RequestVector queued;
+      queued.swap(queued_);
+      for (int i = 0, n = queued.size(); i < n; ++i) {
+        Route(queued[i], now_us);
+      }
+      for (std::map<GoogleString, Connection*>::iterator it =
+               connections_.begin(); it != connections_.end(); ++it) {
+        Connection* connection = it->second;
+        CheckDeadlines(connection, now_us);
+        if ((connection->context == NULL) ||
+            (!connection->reading && !connection->writing)) {
+          continue;
+        }
+        struct pollfd pfd;
+        pfd.fd = connection->context->c.fd;
+        pfd.events = (connection->reading ? POLLIN : 0) |
+            (connection->writing ? POLLOUT : 0);
+        pfd.revents = 0;
+        int64 deadline_us = 0;
+        if (connection->state == Connection::kConnecting) {
+          deadline_us = connection->connect_deadline_us;
+        }
+        if (!connection->in_flight.empty() &&
+            ((deadline_us == 0) ||
+             (connection->in_flight.front()->deadline_us < deadline_us))) {
+          deadline_us = connection->in_flight.front()->deadline_us;
+        }
+        if (deadline_us != 0) {
+          int64 wait_ms = (deadline_us - now_us + Timer::kMsUs - 1) /
+              Timer::kMsUs;
+          timeout_ms = std::min(
+              timeout_ms,
+              static_cast<int>(std::max(wait_ms, static_cast<int64>(0))));
+        }
+        fds.push_back(pfd);
+        polled.push_back(connection);
+        generations.push_back(connection->generation);
+      }
+      done.swap(done_);
+    }
+    ReportLookups(&done);
+
+    struct pollfd wakeup;
+    wakeup.fd = wakeup_read_fd_;
+    wakeup.events = POLLIN;
+    wakeup.revents = 0;
+    fds.push_back(wakeup);
+    if (poll(&fds[0], fds.size(), timeout_ms) < 0) {
+      if (errno != EINTR) {
+        message_handler_->Message(kError, "AsyncRedisCache: poll failed: %s",
+                                  strerror(errno));
+      }
+      continue;
+    }
+    if ((fds.back().revents & POLLIN) != 0) {
+      char buffer[64];
+      while (read(wakeup_read_fd_, buffer, sizeof(buffer)) > 0) {
+      }
+    }
+
+    {
+      ScopedMutex lock(mutex_.get());
+      for (int i = 0, n = polled.size(); i < n; ++i) {
+        Connection* connection = polled[i];
+        int revents = fds[i].revents;
+        // Reading can free the context, and a new one may have been made
+        // since we polled, so check it's still the one we polled each time.
+        if ((revents & (POLLIN | POLLERR | POLLHUP)) != 0 &&
+            (connection->context != NULL) &&
+            (connection->generation == generations[i]) &&
+            connection->reading) {
+          redisAsyncHandleRead(connection->context);
+        }
+        if ((revents & (POLLOUT | POLLERR | POLLHUP)) != 0 &&
+            (connection->context != NULL) &&
+            (connection->generation == generations[i]) &&
+            connection->writing) {
+          redisAsyncHandleWrite(connection->context);
+        }
+      }
+      done.swap(done_);
+    }
+    ReportLookups(&done);
+  }
+}
+
+void AsyncRedisCache::Route(Request* request, int64 now_us) {
+  if (request->type != Request::kLookup) {
+    Send(LookupConnection(RedisCache::HashSlot(request->key)), request,
+         now_us);
+    return;
+  }
+  if (cluster_mode_ == kStandalone) {
+    Send(main_connection_, request, now_us);
+    return;
+  }
+  // Until we know the server isn't a cluster, MGET may only name keys in one
+  // slot.
+  std::map<int, Request*> by_slot;
+  for (int i = 0, n = request->keys.size(); i < n; ++i) {
+    Request*& lookup = by_slot[RedisCache::HashSlot(request->keys[i].key)];
+    if (lookup == NULL) {
+      lookup = new Request(Request::kLookup);
+    }
+    lookup->keys.push_back(request->keys[i]);
+  }
+  delete request;
+  for (std::map<int, Request*>::iterator it = by_slot.begin();
+       it != by_slot.end(); ++it) {
+    Send(LookupConnection(it->first), it->second, now_us);
+  }
+}
+
+AsyncRedisCache::Connection* AsyncRedisCache::LookupConnection(int slot) {
+  // cluster_mappings_ is sorted; find the first range not ending before slot.
+  std::vector<ClusterMapping>::iterator it = std::lower_bound(
+      cluster_mappings_.begin(), cluster_mappings_.end(), slot,
+      [](const ClusterMapping& mapping, int slot) {
+        return mapping.end_slot < slot;
+      });
+  if ((it != cluster_mappings_.end()) && (slot >= it->start_slot)) {
+    return it->connection;
+  }
+  return main_connection_;
+}
+
+AsyncRedisCache::Connection* AsyncRedisCache::GetOrCreateConnection(
+    const ExternalServerSpec& spec) {
+  Connection*& connection = connections_[spec.ToString()];
+  if (connection == NULL) {
+    connection = new Connection(this, spec);
+  }
+  return connection;
+}
+
+void AsyncRedisCache::Send(Connection* connection, Request* request,
+                           int64 now_us) {
+  if (connection->context == NULL) {
+    if (connection->retry_time_ms > now_us / Timer::kMsUs) {
+      backed_off_->Add(1);
+      Finish(request);
+      return;
+    }
+    if (!Connect(connection, now_us)) {
+      Finish(request);
+      return;
+    }
+  }
+
+  std::vector<const char*> argv;
+  std::vector<size_t> argv_lengths;
+  switch (request->type) {
+    case Request::kLookup:
+      argv.push_back("MGET");
+      argv_lengths.push_back(4);
+      for (int i = 0, n = request->keys.size(); i < n; ++i) {
+        argv.push_back(request->keys[i].key.data());
+        argv_lengths.push_back(request->keys[i].key.size());
+      }
+      break;
+    case Request::kPut:
+      argv.push_back("SET");
+      argv_lengths.push_back(3);
+      argv.push_back(request->key.data());
+      argv_lengths.push_back(request->key.size());
+      argv.push_back(request->value.data());
+      argv_lengths.push_back(request->value.size());
+      break;
+    case Request::kDelete:
+      argv.push_back("DEL");
+      argv_lengths.push_back(3);
+      argv.push_back(request->key.data());
+      argv_lengths.push_back(request->key.size());
+      break;
+    case Request::kClusterSlots:
+      argv.push_back("CLUSTER");
+      argv_lengths.push_back(7);
+      argv.push_back("SLOTS");
+      argv_lengths.push_back(5);
+      break;
+  }
+
+  // The reply to ASKING is of no interest, so it has no callback.
+  if ((request->asking &&
+       (redisAsyncCommand(connection->context, NULL, NULL, "ASKING") !=
+        REDIS_OK)) ||
+      (redisAsyncCommandArgv(connection->context, OnReply, request,
+                             argv.size(), &argv[0], &argv_lengths[0]) !=
+       REDIS_OK)) {
+    errors_->Add(1);
+    Finish(request);
+    return;
+  }
+  request->connection = connection;
+  request->deadline_us = now_us + timeout_us_;
+  connection->in_flight.push_back(request);
+}
+
+bool AsyncRedisCache::Connect(Connection* connection, int64 now_us) {
+  // As with AsyncMemCache, the name lookup blocks the I/O thread.  It is only
+  // done when (re)connecting, which is rare.
+  redisAsyncContext* context = redisAsyncConnect(
+      connection->spec.host.c_str(), connection->spec.port);
+  if (context == NULL) {
+    BackOff(connection, "could not be connected to");
+    return false;
+  }
+  if (context->err != 0) {
+    BackOff(connection, context->errstr);
+    redisAsyncFree(context);
+    return false;
+  }
+  context->data = connection;
+  context->ev.data = connection;
+  context->ev.addRead = AddRead;
+  context->ev.delRead = DelRead;
+  context->ev.addWrite = AddWrite;
+  context->ev.delWrite = DelWrite;
+  context->ev.cleanup = Cleanup;
+  connection->context = context;
+  connection->state = Connection::kConnecting;
+  connection->connect_deadline_us = now_us + timeout_us_;
+  ++connection->generation;
+  // Setting the connect callback asks us to poll for writability, which is
+  // how a finished connect() shows.
+  redisAsyncSetConnectCallback(context, OnConnect);
+  redisAsyncSetDisconnectCallback(context, OnDisconnect);
+  return true;
+}
+
+void AsyncRedisCache::FetchClusterSlots(Connection* connection,
+                                        int64 now_us) {
+  cluster_slots_pending_ = true;
+  cluster_slots_fetches_->Add(1);
+  Send(connection, new Request(Request::kClusterSlots), now_us);
+}
+
+void AsyncRedisCache::HandleReply(Connection* connection, Request* request,
+                                  void* reply) {
+  std::deque<Request*>::iterator it = std::find(
+      connection->in_flight.begin(), connection->in_flight.end(), request);
+  if (it != connection->in_flight.end()) {
+    connection->in_flight.erase(it);
+  }
+  if (reply == NULL) {
+    // The connection failed or was closed, which was counted there.
+  } else if (FollowRedirection(connection, request, reply)) {
+    return;
+  } else if (request->type == Request::kLookup) {
+    HandleLookupReply(request, reply);
+  } else if (request->type == Request::kClusterSlots) {
+    HandleClusterSlotsReply(reply);
+  } else if (static_cast<redisReply*>(reply)->type == REDIS_REPLY_ERROR) {
+    redisReply* error = static_cast<redisReply*>(reply);
+    errors_->Add(1);
+    message_handler_->Message(
+        kWarning, "AsyncRedisCache: redis server %s failed a %s: %s",
+        connection->spec.ToString().c_str(),
+        (request->type == Request::kPut) ? "Put" : "Delete", error->str);
+  }
+  Finish(request);
+}
+
+void AsyncRedisCache::HandleLookupReply(Request* request, void* reply) {
+  redisReply* values = static_cast<redisReply*>(reply);
+  int num_keys = request->keys.size();
+  if ((values->type != REDIS_REPLY_ARRAY) ||
+      (values->elements != static_cast<size_t>(num_keys))) {
+    errors_->Add(1);
+    message_handler_->Message(
+        kWarning, "AsyncRedisCache: unexpected reply to MGET of %d keys: %s",
+        num_keys,
+        (values->type == REDIS_REPLY_ERROR) ? values->str : "wrong type");
+    return;
+  }
+  request->found.resize(num_keys, false);
+  request->values.resize(num_keys);
+  for (int i = 0; i < num_keys; ++i) {
+    redisReply* value = values->element[i];
+    if (value->type == REDIS_REPLY_STRING) {
+      request->found[i] = true;
+      request->values[i].Assign(value->str, value->len);
+    }
+  }
+}
+
+void AsyncRedisCache::HandleClusterSlotsReply(void* reply) {
+  redisReply* slots = static_cast<redisReply*>(reply);
+  if (slots->type == REDIS_REPLY_ERROR) {
+    // "ERR This instance has cluster support disabled".
+    cluster_mode_ = kStandalone;
+    return;
+  }
+  if (slots->type != REDIS_REPLY_ARRAY) {
+    message_handler_->Message(
+        kError, "AsyncRedisCache: wrong type in reply from CLUSTER SLOTS");
+    return;
+  }
+  cluster_mode_ = kCluster;
+
+  // The layout of the reply is described in
+  // RedisCache::FetchClusterSlotMapping.
+  std::vector<ClusterMapping> new_cluster_mappings;
+  for (size_t i = 0; i < slots->elements; ++i) {
+    redisReply* server_info = slots->element[i];
+    if ((server_info->type != REDIS_REPLY_ARRAY) ||
+        (server_info->elements < 3)) {
+      message_handler_->Message(
+          kError, "AsyncRedisCache: got short reply for CLUSTER SLOTS");
+      return;
+    }
+    redisReply* start_slot_range = server_info->element[0];
+    redisReply* end_slot_range = server_info->element[1];
+    redisReply* master_spec = server_info->element[2];
+    if ((start_slot_range->type != REDIS_REPLY_INTEGER) ||
+        (end_slot_range->type != REDIS_REPLY_INTEGER) ||
+        (master_spec->type != REDIS_REPLY_ARRAY) ||
+        (master_spec->elements < 2) ||
+        (master_spec->element[0]->type != REDIS_REPLY_STRING) ||
+        (master_spec->element[1]->type != REDIS_REPLY_INTEGER) ||
+        (start_slot_range->integer > end_slot_range->integer)) {
+      message_handler_->Message(
+          kError, "AsyncRedisCache: invalid range in reply from CLUSTER SLOTS");
+      return;
+    }
+    new_cluster_mappings.push_back(ClusterMapping(
+        start_slot_range->integer, end_slot_range->integer,
+        GetOrCreateConnection(ExternalServerSpec(
+            master_spec->element[0]->str,
+            master_spec->element[1]->integer))));
+  }
+  std::sort(new_cluster_mappings.begin(), new_cluster_mappings.end(),
+            [](const ClusterMapping& a, const ClusterMapping& b) {
+              return a.start_slot < b.start_slot;
+            });
+  for (size_t i = 1; i < new_cluster_mappings.size(); ++i) {
+    if (new_cluster_mappings[i].start_slot <=
+        new_cluster_mappings[i - 1].end_slot) {
+      message_handler_->Message(
+          kError, "AsyncRedisCache: overlapping slot ranges from CLUSTER "
+          "SLOTS");
+      return;
+    }
+  }
+  cluster_mappings_.swap(new_cluster_mappings);
+}
+
+bool AsyncRedisCache::FollowRedirection(Connection* connection,
+                                        Request* request, void* reply) {
+  redisReply* error = static_cast<redisReply*>(reply);
+  if (error->type != REDIS_REPLY_ERROR) {
+    return false;
+  }
+  StringPiece message(error->str, error->len);
+  bool moved = strings::StartsWith(message, "MOVED ");
+  if (!moved && !strings::StartsWith(message, "ASK ")) {
+    return false;
+  }
+  if (moved && !cluster_slots_pending_) {
+    FetchClusterSlots(connection, timer_->NowUs());
+  }
+  ExternalServerSpec target = RedisCache::ParseRedirectionError(message);
+  if (target.empty() || (request->redirections >= kMaxRedirections)) {
+    return false;
+  }
+  redirections_->Add(1);
+  ++request->redirections;
+  request->asking = !moved;
+  Send(GetOrCreateConnection(target), request, timer_->NowUs());
+  return true;
+}
+
+void AsyncRedisCache::Connected(Connection* connection,
+                                const redisAsyncContext* context, bool ok) {
+  if (connection->context != context) {
+    return;
+  }
+  if (ok) {
+    connection->state = Connection::kConnected;
+    return;
+  }
+  // hiredis frees the context when we return.
+  connection->context = NULL;
+  connection->state = Connection::kDisconnected;
+  BackOff(connection, context->errstr);
+}
+
+void AsyncRedisCache::Disconnected(Connection* connection,
+                                   const redisAsyncContext* context, bool ok) {
+  if (connection->context != context) {
+    return;  // We closed it ourselves.
+  }
+  connection->context = NULL;
+  connection->state = Connection::kDisconnected;
+  if (!ok) {
+    BackOff(connection, "closed the connection");
+  }
+}
+
+void AsyncRedisCache::CheckDeadlines(Connection* connection, int64 now_us) {
+  // Replies arrive in the order the commands were sent, so if the oldest
+  // hasn't been answered in time, none of the others will be.
+  if ((connection->state == Connection::kConnecting) &&
+      (connection->connect_deadline_us <= now_us)) {
+    timeouts_->Add(1);
+    BackOff(connection, "timed out connecting");
+    Close(connection);
+  } else if (!connection->in_flight.empty() &&
+             (connection->in_flight.front()->deadline_us <= now_us)) {
+    timeouts_->Add(1);
+    BackOff(connection, "timed out");
+    Close(connection);
+  }
+}
+
+void AsyncRedisCache::Close(Connection* connection) {
+  redisAsyncContext* context = connection->context;
+  connection->context = NULL;
+  connection->state = Connection::kDisconnected;
+  if (context != NULL) {
+    // Runs OnReply with a NULL reply for every command in flight.
+    redisAsyncFree(context);
+  }
+  connection->reading = false;
+  connection->writing = false;
+  while (!connection->in_flight.empty()) {
+    Request* request = connection->in_flight.front();
+    connection->in_flight.pop_front();
+    Finish(request);
+  }
+}
+
+void AsyncRedisCache::BackOff(Connection* connection, const char* reason) {
+  errors_->Add(1);
+  connection->retry_time_ms = timer_->NowMs() + reconnection_delay_ms_;
+  message_handler_->Message(
+      kWarning, "AsyncRedisCache: redis server %s %s; backing off for %d ms",
+      connection->spec.ToString().c_str(), reason,
+      static_cast<int>(reconnection_delay_ms_));
+}
+
+void AsyncRedisCache::Finish(Request* request) {
+  if (request->type == Request::kLookup) {
+    done_.push_back(request);
+    return;
+  }
+  if (request->type == Request::kClusterSlots) {
+    cluster_slots_pending_ = false;
+  }
+  delete request;
+}
+
+void AsyncRedisCache::ReportLookups(RequestVector* done) {
+  for (int i = 0, n = done->size(); i < n; ++i) {
+    Request* lookup = (*done)[i];
+    for (int j = 0, m = lookup->keys.size(); j < m; ++j) {
+      KeyCallback* key_callback = &lookup->keys[j];
+      if ((j < static_cast<int>(lookup->found.size())) && lookup->found[j]) {
+        key_callback->callback->set_value(lookup->values[j]);
+        ValidateAndReportResult(key_callback->key, kAvailable,
+                                key_callback->callback);
+      } else {
+        ValidateAndReportResult(key_callback->key, kNotFound,
+                                key_callback->callback);
+      }
+    }
+    delete lookup;
+  }
+  done->clear();
+}
+
+void AsyncRedisCache::GetStatus(GoogleString* buffer) {
+  ScopedMutex lock(mutex_.get());
+  int64 now_ms = timer_->NowMs();
+  const char* mode = "unknown";
+  if (cluster_mode_ == kStandalone) {
+    mode = "standalone";
+  } else if (cluster_mode_ == kCluster) {
+    mode = "cluster";
+  }
+  StrAppend(buffer, "Statistics for AsyncRedisCache (", ServerDescription(),
+            ", ", mode, "):\n");
+  for (std::map<GoogleString, Connection*>::iterator it =
+           connections_.begin(); it != connections_.end(); ++it) {
+    Connection* connection = it->second;
+    const char* state = "idle";
+    if (connection->retry_time_ms > now_ms) {
+      state = "backed off";
+    } else if (connection->state == Connection::kConnecting) {
+      state = "connecting";
+    } else if (connection->state == Connection::kConnected) {
+      state = "connected";
+    }
+    StrAppend(buffer, "\nConnection ", connection->spec.ToString(), " ",
+              state, "\n");
+    StrAppend(buffer, "commands_in_flight:    ",
+              IntegerToString(connection->in_flight.size()), "\n");
+    if (connection->retry_time_ms > now_ms) {
+      StrAppend(buffer, "retry_in_ms:           ",
+                Integer64ToString(connection->retry_time_ms - now_ms), "\n");
+    }
+  }
+}
+
+bool AsyncRedisCache::IsHealthy() const {
+  ScopedMutex lock(mutex_.get());
+  return running_ && (main_connection_->retry_time_ms <= timer_->NowMs());
+}
+
+void AsyncRedisCache::ShutDown() {
+  scoped_ptr<IoThread> io_thread;
+  {
+    ScopedMutex lock(mutex_.get());
+    if (running_) {
+      running_ = false;
+      WakeIoThread();
+    }
+    io_thread.reset(io_thread_.release());
+  }
+  if (io_thread.get() == NULL) {
+    return;
+  }
+  io_thread->Join();
+
+  RequestVector done;
+  {
+    ScopedMutex lock(mutex_.get());
+    for (int i = 0, n = queued_.size(); i < n; ++i) {
+      Finish(queued_[i]);
+    }
+    queued_.clear();
+    for (std::map<GoogleString, Connection*>::iterator it =
+             connections_.begin(); it != connections_.end(); ++it) {
+      Close(it->second);
+    }
+    done.swap(done_);
+  }
+  ReportLookups(&done);
+}
+
+int64 AsyncRedisCache::Redirections() const {
+  return redirections_->Get();
+}
+
+int64 AsyncRedisCache::ClusterSlotsFetches() const {
+  return cluster_slots_fetches_->Get();
+}
+
+// hiredis calls these with mutex_ held, since we only call into it that way.
+
+void AsyncRedisCache::OnReply(redisAsyncContext* context, void* reply,
+                              void* privdata) {
+  Request* request = static_cast<Request*>(privdata);
+  Connection* connection = request->connection;
+  connection->cache->HandleReply(connection, request, reply);
+}
+
+void AsyncRedisCache::OnConnect(const redisAsyncContext* context,
+                                int status) {
+  Connection* connection = static_cast<Connection*>(context->data);
+  connection->cache->Connected(connection, context, status == REDIS_OK);
+}
+
+void AsyncRedisCache::OnDisconnect(const redisAsyncContext* context,
+                                   int status) {
+  Connection* connection = static_cast<Connection*>(context->data);
+  connection->cache->Disconnected(connection, context, status == REDIS_OK);
+}
+
+void AsyncRedisCache::AddRead(void* privdata) {
+  static_cast<Connection*>(privdata)->reading = true;
+}
+
+void AsyncRedisCache::DelRead(void* privdata) {
+  static_cast<Connection*>(privdata)->reading = false;
+}
+
+void AsyncRedisCache::AddWrite(void* privdata) {
+  static_cast<Connection*>(privdata)->writing = true;
+}
+
+void AsyncRedisCache::DelWrite(void* privdata) {
+  static_cast<Connection*>(privdata)->writing = false;
+}
+
+void AsyncRedisCache::Cleanup(void* privdata) {
+  Connection* connection = static_cast<Connection*>(privdata);
+  connection->reading = false;
+  connection->writing = false;
+}
+
+}  // namespace net_instaweb
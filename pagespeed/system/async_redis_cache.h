@@ -0,0 +1,247 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_SYSTEM_ASYNC_REDIS_CACHE_H_
+#define PAGESPEED_SYSTEM_ASYNC_REDIS_CACHE_H_
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/system/external_server_spec.h"
+
+struct redisAsyncContext;
+
+namespace net_instaweb {
+
+class MessageHandler;
+class Statistics;
+class Variable;
+
+// Event-driven Redis client, for use in place of RedisCache.  Rather than
+// tying up a thread for every command in flight, all the connections are
+// driven by a single I/O thread, using hiredis' asynchronous API with the
+// thread's own poll() loop standing in for an event library:
+//
+// - Commands are pipelined: each server has a single connection on which
+//   commands are written as they are issued, without waiting for the replies
+//   to earlier ones.
+// - A MultiGet is sent as MGET.  In a cluster, MGET can only name keys in one
+//   hash slot, so the keys are split by slot, and each slot's MGET is sent to
+//   the node the slot mapping assigns it to.  Against a single server, the
+//   whole batch is one MGET.
+// - Which of these applies, and the slot mapping itself, are learned from
+//   CLUSTER SLOTS, sent to the main server when it is connected to.  MOVED
+//   and ASK redirections are followed from the I/O thread, and a MOVED
+//   refreshes the mapping, as in RedisCache.
+// - A connection error or timeout fails the commands in flight on that
+//   connection, and its keys are reported as not found without being sent
+//   until reconnection_delay_ms has passed.
+//
+// Unlike RedisCache, hot keys are not replicated locally.  Callbacks are run
+// on the I/O thread, and so must not block.
+class AsyncRedisCache : public CacheInterface {
+ public:
+  // Does not take ownership of thread_system, handler, timer or stats.  No
+  // connections are made until StartUp is called.
+  AsyncRedisCache(StringPiece host, int port, ThreadSystem* thread_system,
+                  MessageHandler* handler, Timer* timer,
+                  int64 reconnection_delay_ms, int64 timeout_us,
+                  Statistics* stats);
+  virtual ~AsyncRedisCache();
+
+  static void InitStats(Statistics* stats);
+
+  GoogleString ServerDescription() const;
+
+  // Starts the I/O thread, which connects to the main server.  Until this is
+  // called every lookup misses.  Returns false if the thread could not be
+  // started.
+  bool StartUp();
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, const SharedString& value);
+  virtual void Delete(const GoogleString& key);
+  virtual void MultiGet(MultiGetRequest* request);
+
+  // Appends the state of the connection to each server.
+  void GetStatus(GoogleString* status_string);
+
+  static GoogleString FormatName() { return "AsyncRedisCache"; }
+  virtual GoogleString Name() const { return FormatName(); }
+
+  virtual bool IsBlocking() const { return false; }
+
+  // Healthy as long as the I/O thread is running and the main server is not
+  // waiting out reconnection_delay_ms after an error.
+  virtual bool IsHealthy() const;
+
+  // Stops the I/O thread, reporting every lookup still in flight as not
+  // found, and closes the connections.
+  virtual void ShutDown();
+
+  // Returns a view of this cache whose lookups wait for their results, for
+  // the users of SystemCaches that need a blocking cache.  Owned by this
+  // object.  It must not be used from within a callback, which runs on the
+  // I/O thread.
+  CacheInterface* blocking_cache();
+
+  // Total number of MOVED and ASK redirections followed.
+  int64 Redirections() const;
+
+  // Total number of times the cluster slot mapping was requested.
+  int64 ClusterSlotsFetches() const;
+
+ private:
+  class BlockingCache;
+  class IoThread;
+  struct Connection;
+  struct Request;
+  typedef std::vector<Request*> RequestVector;
+
+  // Whether the main server is a cluster node, as answered by CLUSTER SLOTS.
+  enum ClusterMode { kUnknown, kStandalone, kCluster };
+
+  struct ClusterMapping {
+    ClusterMapping(int start, int end, Connection* conn)
+        : start_slot(start), end_slot(end), connection(conn) {}
+    int start_slot;
+    int end_slot;
+    Connection* connection;
+  };
+
+  // Hands request to the I/O thread, or fails it if we are not running.
+  void Queue(Request* request);
+  void WakeIoThread() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // The I/O loop, and its helpers, all run on the I/O thread.
+  void Run();
+
+  // Splits a lookup into one request per connection and hash slot, and
+  // sends them.
+  void Route(Request* request, int64 now_us) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Returns the connection to the node serving slot, or the main connection
+  // if we don't know it.
+  Connection* LookupConnection(int slot) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  Connection* GetOrCreateConnection(const ExternalServerSpec& spec)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Writes request to connection's pipeline, connecting first if need be.
+  // Fails the request if the connection is waiting to reconnect.
+  void Send(Connection* connection, Request* request, int64 now_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  bool Connect(Connection* connection, int64 now_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void FetchClusterSlots(Connection* connection, int64 now_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Handles the reply to request, which is NULL if the connection failed.
+  void HandleReply(Connection* connection, Request* request, void* reply)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void HandleLookupReply(Request* request, void* reply)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void HandleClusterSlotsReply(void* reply) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Follows a MOVED or ASK error, returning false if reply isn't one.
+  bool FollowRedirection(Connection* connection, Request* request,
+                         void* reply) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Called when hiredis reports that connecting to the server succeeded or
+  // failed, or that context was disconnected.  On failure hiredis frees
+  // context itself, failing the commands in flight.
+  void Connected(Connection* connection, const redisAsyncContext* context,
+                 bool ok) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void Disconnected(Connection* connection, const redisAsyncContext* context,
+                    bool ok) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  void CheckDeadlines(Connection* connection, int64 now_us)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Closes connection, failing its commands in flight.
+  void Close(Connection* connection) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Makes connection wait reconnection_delay_ms before it is used again.
+  void BackOff(Connection* connection, const char* reason)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Moves a request that ends here to done_ if it's a lookup, or deletes it.
+  void Finish(Request* request) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Runs the callbacks of finished lookups and deletes them.
+  void ReportLookups(RequestVector* done) LOCKS_EXCLUDED(mutex_);
+
+  // hiredis hooks; privdata is the Connection or Request.
+  static void OnReply(redisAsyncContext* context, void* reply, void* privdata);
+  static void OnConnect(const redisAsyncContext* context, int status);
+  static void OnDisconnect(const redisAsyncContext* context, int status);
+  static void AddRead(void* privdata);
+  static void DelRead(void* privdata);
+  static void AddWrite(void* privdata);
+  static void DelWrite(void* privdata);
+  static void Cleanup(void* privdata);
+
+  const ExternalServerSpec main_spec_;
+  ThreadSystem* thread_system_;
+  MessageHandler* message_handler_;
+  Timer* timer_;
+  const int64 reconnection_delay_ms_;
+  const int64 timeout_us_;
+
+  // Everything the I/O thread uses is guarded by mutex_, which it holds
+  // except while it waits in poll() and runs callbacks.  hiredis is not
+  // thread-safe, so it is only ever called with mutex_ held.
+  scoped_ptr<AbstractMutex> mutex_;
+  scoped_ptr<IoThread> io_thread_ GUARDED_BY(mutex_);
+  bool running_ GUARDED_BY(mutex_);
+  bool wakeup_pending_ GUARDED_BY(mutex_);
+  RequestVector queued_ GUARDED_BY(mutex_);
+  RequestVector done_ GUARDED_BY(mutex_);
+
+  // Connections are only ever added, so raw pointers to them stay valid.
+  std::map<GoogleString, Connection*> connections_ GUARDED_BY(mutex_);
+  Connection* main_connection_ GUARDED_BY(mutex_);
+  ClusterMode cluster_mode_ GUARDED_BY(mutex_);
+  bool cluster_slots_pending_ GUARDED_BY(mutex_);
+  std::vector<ClusterMapping> cluster_mappings_ GUARDED_BY(mutex_);
+
+  // Written to wake the I/O thread out of poll() when there is new work.
+  int wakeup_read_fd_;
+  int wakeup_write_fd_;
+
+  scoped_ptr<BlockingCache> blocking_cache_;
+
+  Variable* timeouts_;
+  Variable* errors_;
+  Variable* backed_off_;
+  Variable* redirections_;
+  Variable* cluster_slots_fetches_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncRedisCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_SYSTEM_ASYNC_REDIS_CACHE_H_
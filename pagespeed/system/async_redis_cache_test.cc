@@ -0,0 +1,409 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit-test the event-driven Redis client against a real server, and against
+// Redis Cluster if one is configured.  See install/run_program_with_redis.sh
+// and install/run_program_with_redis_cluster.sh.
+
+#include "pagespeed/system/async_redis_cache.h"
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "apr_network_io.h"  // NOLINT
+#include "base/logging.h"
+#include "pagespeed/kernel/base/google_message_handler.h"
+#include "pagespeed/kernel/base/gtest.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_test_base.h"
+#include "pagespeed/kernel/thread/worker_test_base.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+#include "pagespeed/system/redis_cache_cluster_setup.h"
+#include "pagespeed/system/tcp_connection_for_testing.h"
+#include "pagespeed/system/tcp_server_thread_for_testing.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const int64 kReconnectionDelayMs = 100;
+const int64 kTimeoutUs = 100 * Timer::kMsUs;
+
+// As in redis_cache_cluster_test.cc; node 1 is the one we connect to.
+const char kKeyOnNode1[] = "Foobar";        // Slots 0-5499
+const char kKeyOnNode2[] = "SomeOtherKey";  // Slots 5500-10999
+const char kKeyOnNode3[] = "Key";           // Slots 11000-16383
+
+}  // namespace
+
+class AsyncRedisCacheTest : public CacheTestBase {
+ protected:
+  class AsyncCallback : public CacheTestBase::Callback {
+   public:
+    explicit AsyncCallback(AsyncRedisCacheTest* test)
+        : Callback(test),
+          sync_point_(test->thread_system_.get()) {
+    }
+
+    virtual void Done(CacheInterface::KeyState state) {
+      Callback::Done(state);
+      sync_point_.Notify();
+    }
+
+    virtual void Wait() { sync_point_.Wait(); }
+
+   private:
+    WorkerTestBase::SyncPoint sync_point_;
+  };
+
+  AsyncRedisCacheTest()
+      : thread_system_(Platform::CreateThreadSystem()),
+        timer_(Platform::CreateTimer()),
+        statistics_(thread_system_.get()) {
+    set_mutex(thread_system_->NewMutex());
+    AsyncRedisCache::InitStats(&statistics_);
+  }
+
+  virtual ~AsyncRedisCacheTest() {
+    if (cache_.get() != NULL) {
+      cache_->ShutDown();
+    }
+  }
+
+  static void SetUpTestCase() {
+    apr_initialize();
+    TcpServerThreadForTesting::PickListenPortOnce(&unused_port_);
+    CHECK_NE(unused_port_, 0);
+  }
+
+  static void TearDownTestCase() {
+    apr_terminate();
+  }
+
+  bool InitRedisOrSkip() {
+    const char* port_string = getenv("REDIS_PORT");
+    if (port_string == NULL || !StringToInt(port_string, &port_)) {
+      LOG(ERROR) << "AsyncRedisCache tests are skipped because env var "
+                 << "$REDIS_PORT is not set to an integer. Set that "
+                 << "to the port number where redis is running to "
+                 << "enable the tests. See install/run_program_with_redis.sh";
+      return false;
+    }
+    RedisCommand("FLUSHALL");
+    RedisCommand("CONFIG RESETSTAT");
+    StartCache(port_);
+    return true;
+  }
+
+  void StartCache(int port) {
+    cache_.reset(new AsyncRedisCache(
+        "localhost", port, thread_system_.get(), &handler_, timer_.get(),
+        kReconnectionDelayMs, kTimeoutUs, &statistics_));
+    ASSERT_TRUE(cache_->StartUp());
+  }
+
+  // Sends command to the server on a connection of its own, and returns the
+  // first line of the reply.
+  GoogleString RedisCommand(StringPiece command) {
+    TcpConnectionForTesting conn;
+    CHECK(conn.Connect("localhost", port_))
+        << "Cannot connect to Redis server";
+    conn.Send(StrCat(command, "\r\n"));
+    return conn.ReadLineCrLf();
+  }
+
+  // Returns the number of times the server has run command, from INFO.
+  int CommandCalls(StringPiece command) {
+    TcpConnectionForTesting conn;
+    CHECK(conn.Connect("localhost", port_));
+    conn.Send("INFO commandstats\r\n");
+    GoogleString header = conn.ReadLineCrLf();
+    int length;
+    CHECK(StringToInt(header.substr(1, header.size() - 3), &length));
+    GoogleString info = conn.ReadBytes(length + 2);
+    GoogleString marker = StrCat("cmdstat_", command, ":calls=");
+    size_t pos = info.find(marker);
+    if (pos == GoogleString::npos) {
+      return 0;
+    }
+    int calls = 0;
+    for (pos += marker.size(); isdigit(info[pos]); ++pos) {
+      calls = calls * 10 + (info[pos] - '0');
+    }
+    return calls;
+  }
+
+  int64 Stat(const char* name) {
+    return statistics_.GetVariable(StrCat("async_redis_", name))->Get();
+  }
+
+  virtual CacheInterface* Cache() { return cache_.get(); }
+  virtual Callback* NewCallback() { return new AsyncCallback(this); }
+
+  static apr_port_t unused_port_;
+
+  scoped_ptr<ThreadSystem> thread_system_;
+  scoped_ptr<Timer> timer_;
+  SimpleStats statistics_;
+  GoogleMessageHandler handler_;
+  int port_;
+  scoped_ptr<AsyncRedisCache> cache_;
+};
+
+apr_port_t AsyncRedisCacheTest::unused_port_ = 0;
+
+TEST_F(AsyncRedisCacheTest, PutGetDelete) {
+  if (!InitRedisOrSkip()) {
+    return;
+  }
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  CheckNotFound("Another Name");
+
+  CheckPut("Name", "NewValue");
+  CheckGet("Name", "NewValue");
+
+  CheckDelete("Name");
+  CheckNotFound("Name");
+  EXPECT_TRUE(cache_->IsHealthy());
+  EXPECT_EQ(0, Stat("errors"));
+}
+
+TEST_F(AsyncRedisCacheTest, MultiGetIsOneMget) {
+  if (!InitRedisOrSkip()) {
+    return;
+  }
+  CheckPut("Name1", "Value1");
+  CheckPut("Name2", "Value2");
+  // Make sure the server has learned it isn't a cluster node before counting.
+  CheckGet("Name1", "Value1");
+  int mgets = CommandCalls("mget");
+
+  Callback* n1 = AddCallback();
+  Callback* n2 = AddCallback();
+  Callback* not_found = AddCallback();
+  IssueMultiGet(n1, "Name1", not_found, "Bogus", n2, "Name2");
+  WaitAndCheck(n1, "Value1");
+  WaitAndCheckNotFound(not_found);
+  WaitAndCheck(n2, "Value2");
+  EXPECT_EQ(mgets + 1, CommandCalls("mget"));
+  EXPECT_EQ(0, CommandCalls("get"));
+
+  GoogleString status;
+  cache_->GetStatus(&status);
+  EXPECT_NE(GoogleString::npos, status.find("standalone")) << status;
+  EXPECT_NE(GoogleString::npos, status.find("connected")) << status;
+}
+
+TEST_F(AsyncRedisCacheTest, PipelinedGets) {
+  if (!InitRedisOrSkip()) {
+    return;
+  }
+  CheckPut("Name", "Value");
+  std::vector<Callback*> callbacks;
+  for (int i = 0; i < 20; ++i) {
+    callbacks.push_back(InitiateGet("Name"));
+  }
+  for (int i = 0, n = callbacks.size(); i < n; ++i) {
+    WaitAndCheck(callbacks[i], "Value");
+  }
+  EXPECT_EQ(0, Stat("errors"));
+}
+
+TEST_F(AsyncRedisCacheTest, TimeoutBacksOffServer) {
+  if (!InitRedisOrSkip()) {
+    return;
+  }
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+
+  // Stall the server for longer than the timeout.
+  TcpConnectionForTesting sleeper;
+  ASSERT_TRUE(sleeper.Connect("localhost", port_));
+  sleeper.Send("DEBUG SLEEP 0.3\r\n");
+  timer_->SleepMs(20);
+  CheckNotFound("Name");
+  EXPECT_EQ(1, Stat("timeouts"));
+  EXPECT_FALSE(cache_->IsHealthy());
+  GoogleString status;
+  cache_->GetStatus(&status);
+  EXPECT_NE(GoogleString::npos, status.find("backed off")) << status;
+
+  // While backed off, lookups fail without being sent.
+  CheckNotFound("Name");
+  EXPECT_EQ(1, Stat("backed_off"));
+  EXPECT_EQ("+OK\r\n", sleeper.ReadLineCrLf());
+
+  // Once the backoff expires, the server is reconnected to.
+  timer_->SleepMs(kReconnectionDelayMs + 50);
+  EXPECT_TRUE(cache_->IsHealthy());
+  CheckGet("Name", "Value");
+}
+
+TEST_F(AsyncRedisCacheTest, ConnectionRefused) {
+  port_ = unused_port_;
+  StartCache(unused_port_);
+  CheckNotFound("Name");
+  EXPECT_EQ(1, Stat("errors"));
+  EXPECT_FALSE(cache_->IsHealthy());
+
+  // Until the delay has passed, no connection is attempted.
+  int64 backed_off = Stat("backed_off");
+  CheckNotFound("Name");
+  EXPECT_EQ(backed_off + 1, Stat("backed_off"));
+  EXPECT_EQ(1, Stat("errors"));
+}
+
+TEST_F(AsyncRedisCacheTest, ShutDownReportsLookupsInFlight) {
+  if (!InitRedisOrSkip()) {
+    return;
+  }
+  CheckPut("Name", "Value");
+  CheckGet("Name", "Value");
+  TcpConnectionForTesting sleeper;
+  ASSERT_TRUE(sleeper.Connect("localhost", port_));
+  sleeper.Send("DEBUG SLEEP 0.05\r\n");
+  timer_->SleepMs(20);
+  Callback* callback = InitiateGet("Name");
+  cache_->ShutDown();
+  WaitAndCheckNotFound(callback);
+  EXPECT_FALSE(cache_->IsHealthy());
+  CheckNotFound("Name");
+  EXPECT_EQ("+OK\r\n", sleeper.ReadLineCrLf());
+}
+
+TEST_F(AsyncRedisCacheTest, BlockingCache) {
+  if (!InitRedisOrSkip()) {
+    return;
+  }
+  CacheInterface* blocking = cache_->blocking_cache();
+  EXPECT_TRUE(blocking->IsBlocking());
+  CheckPut(blocking, "Name", "Value");
+
+  // The default callback doesn't wait, so this checks that the value is
+  // there by the time Get returns.
+  Callback callback(this);
+  blocking->Get("Name", &callback);
+  EXPECT_TRUE(callback.called());
+  EXPECT_EQ(CacheInterface::kAvailable, callback.state());
+  EXPECT_EQ("Value", callback.value_str());
+
+  CheckDelete("Name");
+  Callback missing(this);
+  blocking->Get("Name", &missing);
+  EXPECT_TRUE(missing.called());
+  EXPECT_EQ(CacheInterface::kNotFound, missing.state());
+}
+
+typedef std::vector<std::unique_ptr<TcpConnectionForTesting>> ConnectionList;
+
+class AsyncRedisCacheClusterTest : public AsyncRedisCacheTest {
+ protected:
+  void TearDown() override {
+    RedisCluster::FlushAll(&connections_);
+  }
+
+  bool InitRedisClusterOrSkip() {
+    if (!RedisCluster::LoadConfiguration(&node_ids_, &ports_, &connections_)) {
+      return false;  // Already logged an error.
+    }
+    port_ = ports_[0];
+    StartCache(ports_[0]);
+    return true;
+  }
+
+  StringVector node_ids_;
+  std::vector<int> ports_;
+  ConnectionList connections_;
+};
+
+TEST_F(AsyncRedisCacheClusterTest, LearnsSlotMapping) {
+  if (!InitRedisClusterOrSkip()) {
+    return;
+  }
+  // The slot mapping is fetched as soon as the first node is connected to,
+  // and its reply comes back before that of the first lookup.
+  CheckPut(kKeyOnNode1, "Value1");
+  CheckGet(kKeyOnNode1, "Value1");
+  EXPECT_EQ(1, cache_->ClusterSlotsFetches());
+
+  // So keys on the other nodes go straight there.
+  CheckPut(kKeyOnNode2, "Value2");
+  CheckPut(kKeyOnNode3, "Value3");
+  CheckGet(kKeyOnNode2, "Value2");
+  CheckGet(kKeyOnNode3, "Value3");
+  CheckDelete(kKeyOnNode3);
+  CheckNotFound(kKeyOnNode3);
+  EXPECT_EQ(0, cache_->Redirections());
+  EXPECT_EQ(1, cache_->ClusterSlotsFetches());
+
+  GoogleString status;
+  cache_->GetStatus(&status);
+  EXPECT_NE(GoogleString::npos, status.find("cluster")) << status;
+}
+
+TEST_F(AsyncRedisCacheClusterTest, MultiGetIsOneMgetPerSlot) {
+  if (!InitRedisClusterOrSkip()) {
+    return;
+  }
+  CheckPut(kKeyOnNode1, "Value1");
+  CheckPut(kKeyOnNode2, "Value2");
+  CheckPut(kKeyOnNode3, "Value3");
+
+  Callback* node1 = AddCallback();
+  Callback* node2 = AddCallback();
+  Callback* node3 = AddCallback();
+  IssueMultiGet(node1, kKeyOnNode1, node2, kKeyOnNode2, node3, kKeyOnNode3);
+  WaitAndCheck(node1, "Value1");
+  WaitAndCheck(node2, "Value2");
+  WaitAndCheck(node3, "Value3");
+  EXPECT_EQ(0, Stat("errors"));
+}
+
+TEST_F(AsyncRedisCacheClusterTest, LookupsBeforeSlotMappingIsKnown) {
+  if (!InitRedisClusterOrSkip()) {
+    return;
+  }
+  CheckPut(kKeyOnNode1, "Value1");
+  CheckPut(kKeyOnNode2, "Value2");
+  CheckPut(kKeyOnNode3, "Value3");
+  // Puts that haven't been sent are dropped on shutdown, so wait for them.
+  CheckGet(kKeyOnNode1, "Value1");
+  CheckGet(kKeyOnNode2, "Value2");
+  CheckGet(kKeyOnNode3, "Value3");
+
+  // A new cache may send these before it has the slot mapping, in which case
+  // they go to the first node and are redirected from there.
+  int64 redirections = cache_->Redirections();
+  StartCache(ports_[0]);
+  Callback* node1 = AddCallback();
+  Callback* node2 = AddCallback();
+  Callback* node3 = AddCallback();
+  IssueMultiGet(node1, kKeyOnNode1, node2, kKeyOnNode2, node3, kKeyOnNode3);
+  WaitAndCheck(node1, "Value1");
+  WaitAndCheck(node2, "Value2");
+  WaitAndCheck(node3, "Value3");
+  EXPECT_GE(redirections + 2, cache_->Redirections());
+  EXPECT_EQ(0, Stat("errors"));
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,311 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pagespeed/system/memcached_server_for_testing.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const uint8 kRequestMagic = 0x80;
+const uint8 kResponseMagic = 0x81;
+const uint8 kOpcodeNoop = 0x0a;
+const uint8 kOpcodeGetKQ = 0x0d;
+const uint8 kOpcodeSetQ = 0x11;
+const uint8 kOpcodeDeleteQ = 0x14;
+const uint16 kStatusKeyNotFound = 0x0001;
+const uint16 kStatusUnknownCommand = 0x0081;
+const size_t kHeaderSize = 24;
+const size_t kGetExtrasSize = 4;  // flags
+
+void AppendBigEndian(uint32 value, int bytes, GoogleString* out) {
+  for (int shift = 8 * (bytes - 1); shift >= 0; shift -= 8) {
+    out->push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+uint32 ReadBigEndian(const char* data, int bytes) {
+  uint32 value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value = (value << 8) | static_cast<uint8>(data[i]);
+  }
+  return value;
+}
+
+void AppendResponse(uint8 opcode, uint16 status, StringPiece key,
+                    size_t extras_size, StringPiece value, uint32 opaque,
+                    GoogleString* out) {
+  out->push_back(static_cast<char>(kResponseMagic));
+  out->push_back(static_cast<char>(opcode));
+  AppendBigEndian(key.size(), 2, out);
+  out->push_back(static_cast<char>(extras_size));
+  out->push_back(0);
+  AppendBigEndian(status, 2, out);
+  AppendBigEndian(extras_size + key.size() + value.size(), 4, out);
+  AppendBigEndian(opaque, 4, out);
+  AppendBigEndian(0, 4, out);
+  AppendBigEndian(0, 4, out);
+  out->append(extras_size, '\0');
+  key.AppendToString(out);
+  value.AppendToString(out);
+}
+
+}  // namespace
+
+struct MemcachedServerForTesting::Connection {
+  explicit Connection(int connection_fd) : fd(connection_fd) {}
+
+  int fd;
+  GoogleString input;
+  GoogleString output;
+};
+
+MemcachedServerForTesting::MemcachedServerForTesting(
+    int port, ThreadSystem* thread_system)
+    : ThreadSystem::Thread(thread_system, "fake_memcached",
+                           ThreadSystem::kJoinable),
+      port_(port),
+      listen_fd_(-1),
+      wakeup_read_fd_(-1),
+      wakeup_write_fd_(-1),
+      mutex_(thread_system->NewMutex()),
+      shutting_down_(false),
+      paused_(false),
+      num_keys_looked_up_(0),
+      num_batches_(0),
+      num_connections_(0) {
+}
+
+MemcachedServerForTesting::~MemcachedServerForTesting() {
+  ShutDown();
+}
+
+bool MemcachedServerForTesting::StartServing() {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK_GE(listen_fd_, 0);
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port_);
+  socklen_t length = sizeof(address);
+  if ((bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&address),
+            length) != 0) ||
+      (listen(listen_fd_, 16) != 0) ||
+      (getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&address),
+                   &length) != 0)) {
+    LOG(ERROR) << "Could not listen on port " << port_ << ": "
+               << strerror(errno);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  port_ = ntohs(address.sin_port);
+  int fds[2];
+  CHECK_EQ(0, pipe(fds));
+  wakeup_read_fd_ = fds[0];
+  wakeup_write_fd_ = fds[1];
+  return Start();
+}
+
+void MemcachedServerForTesting::ShutDown() {
+  {
+    ScopedMutex lock(mutex_.get());
+    if (shutting_down_ || !Started()) {
+      return;
+    }
+    shutting_down_ = true;
+  }
+  char byte = 0;
+  CHECK_EQ(1, write(wakeup_write_fd_, &byte, 1));
+  Join();
+  close(listen_fd_);
+  close(wakeup_read_fd_);
+  close(wakeup_write_fd_);
+}
+
+void MemcachedServerForTesting::set_paused(bool paused) {
+  {
+    ScopedMutex lock(mutex_.get());
+    paused_ = paused;
+  }
+  if (!paused && Started()) {
+    char byte = 0;
+    CHECK_EQ(1, write(wakeup_write_fd_, &byte, 1));
+  }
+}
+
+int MemcachedServerForTesting::num_keys_looked_up() {
+  ScopedMutex lock(mutex_.get());
+  return num_keys_looked_up_;
+}
+
+int MemcachedServerForTesting::num_batches() {
+  ScopedMutex lock(mutex_.get());
+  return num_batches_;
+}
+
+int MemcachedServerForTesting::num_connections() {
+  ScopedMutex lock(mutex_.get());
+  return num_connections_;
+}
+
+void MemcachedServerForTesting::Run() {
+  std::vector<Connection*> connections;
+  std::vector<struct pollfd> fds;
+  while (true) {
+    fds.clear();
+    struct pollfd pfd;
+    pfd.fd = wakeup_read_fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    fds.push_back(pfd);
+    pfd.fd = listen_fd_;
+    fds.push_back(pfd);
+    for (int i = 0, n = connections.size(); i < n; ++i) {
+      pfd.fd = connections[i]->fd;
+      pfd.events = POLLIN | (connections[i]->output.empty() ? 0 : POLLOUT);
+      fds.push_back(pfd);
+    }
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      CHECK_EQ(EINTR, errno);
+      continue;
+    }
+    if ((fds[0].revents & POLLIN) != 0) {
+      char buffer[64];
+      CHECK_GT(read(wakeup_read_fd_, buffer, sizeof(buffer)), 0);
+    }
+    ScopedMutex lock(mutex_.get());
+    if (shutting_down_) {
+      break;
+    }
+    std::vector<Connection*> open_connections;
+    for (int i = 0, n = connections.size(); i < n; ++i) {
+      Connection* connection = connections[i];
+      int revents = fds[i + 2].revents;
+      bool keep = true;
+      if ((revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+        char buffer[16 * 1024];
+        ssize_t bytes = read(connection->fd, buffer, sizeof(buffer));
+        if (bytes <= 0) {
+          keep = false;
+        } else {
+          connection->input.append(buffer, bytes);
+        }
+      }
+      if (keep && !paused_) {
+        keep = HandleRequests(connection);
+      }
+      if (keep && !connection->output.empty()) {
+        ssize_t bytes = write(connection->fd, connection->output.data(),
+                              connection->output.size());
+        if (bytes > 0) {
+          connection->output.erase(0, bytes);
+        }
+      }
+      if (keep) {
+        open_connections.push_back(connection);
+      } else {
+        close(connection->fd);
+        delete connection;
+      }
+    }
+    connections.swap(open_connections);
+    if ((fds[1].revents & POLLIN) != 0) {
+      int fd = accept(listen_fd_, NULL, NULL);
+      if (fd >= 0) {
+        connections.push_back(new Connection(fd));
+        ++num_connections_;
+      }
+    }
+  }
+  for (int i = 0, n = connections.size(); i < n; ++i) {
+    close(connections[i]->fd);
+    delete connections[i];
+  }
+}
+
+bool MemcachedServerForTesting::HandleRequests(Connection* connection) {
+  const GoogleString& input = connection->input;
+  size_t pos = 0;
+  while (input.size() - pos >= kHeaderSize) {
+    const char* header = input.data() + pos;
+    uint8 opcode = header[1];
+    uint32 key_size = ReadBigEndian(header + 2, 2);
+    uint32 extras_size = static_cast<uint8>(header[4]);
+    uint32 body_size = ReadBigEndian(header + 8, 4);
+    uint32 opaque = ReadBigEndian(header + 12, 4);
+    if ((static_cast<uint8>(header[0]) != kRequestMagic) ||
+        (extras_size + key_size > body_size)) {
+      return false;
+    }
+    if (input.size() - pos - kHeaderSize < body_size) {
+      break;
+    }
+    GoogleString key(header + kHeaderSize + extras_size, key_size);
+    GoogleString value(header + kHeaderSize + extras_size + key_size,
+                       body_size - extras_size - key_size);
+    pos += kHeaderSize + body_size;
+    switch (opcode) {
+      case kOpcodeGetKQ: {
+        ++num_keys_looked_up_;
+        std::map<GoogleString, GoogleString>::iterator p = values_.find(key);
+        if (p != values_.end()) {
+          AppendResponse(opcode, 0, key, kGetExtrasSize, p->second, opaque,
+                         &connection->output);
+        }
+        break;
+      }
+      case kOpcodeNoop:
+        ++num_batches_;
+        AppendResponse(opcode, 0, "", 0, "", opaque, &connection->output);
+        break;
+      case kOpcodeSetQ:
+        values_[key] = value;
+        break;
+      case kOpcodeDeleteQ:
+        if (values_.erase(key) == 0) {
+          AppendResponse(opcode, kStatusKeyNotFound, "", 0, "", opaque,
+                         &connection->output);
+        }
+        break;
+      default:
+        AppendResponse(opcode, kStatusUnknownCommand, "", 0, "", opaque,
+                       &connection->output);
+        break;
+    }
+  }
+  connection->input.erase(0, pos);
+  return true;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PAGESPEED_SYSTEM_MEMCACHED_SERVER_FOR_TESTING_H_
+#define PAGESPEED_SYSTEM_MEMCACHED_SERVER_FOR_TESTING_H_
+
+#include <map>
+
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/thread.h"
+#include "pagespeed/kernel/base/thread_annotations.h"
+#include "pagespeed/kernel/base/thread_system.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+
+// A stand-in for memcached, speaking just enough of the binary protocol for
+// AsyncMemCache: GETKQ, NOOP, SETQ and DELETEQ.  It listens on an
+// ephemeral port on localhost, and serves any number of connections from
+// one thread.  Absolutely not suitable for use outside of tests.
+class MemcachedServerForTesting : public ThreadSystem::Thread {
+ public:
+  // port may be 0, in which case the system picks one.
+  MemcachedServerForTesting(int port, ThreadSystem* thread_system);
+  virtual ~MemcachedServerForTesting();
+
+  // Binds the port and starts serving.  Returns false on failure.
+  bool StartServing();
+
+  // Closes the listening socket and all connections, and waits for the
+  // thread to exit.
+  void ShutDown();
+
+  int port() const { return port_; }
+
+  // While paused, requests are read but not answered, as if the server had
+  // hung.  Unpausing answers them.
+  void set_paused(bool paused) LOCKS_EXCLUDED(mutex_);
+
+  // The number of keys looked up, and the number of batches (NOOPs) they
+  // were sent in.
+  int num_keys_looked_up() LOCKS_EXCLUDED(mutex_);
+  int num_batches() LOCKS_EXCLUDED(mutex_);
+  int num_connections() LOCKS_EXCLUDED(mutex_);
+
+ protected:
+  virtual void Run();
+
+ private:
+  struct Connection;
+
+  // Answers the complete requests at the start of connection->input.
+  // Returns false if the connection should be closed.
+  bool HandleRequests(Connection* connection) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  int port_;
+  int listen_fd_;
+  int wakeup_read_fd_;
+  int wakeup_write_fd_;
+  scoped_ptr<AbstractMutex> mutex_;
+  bool shutting_down_ GUARDED_BY(mutex_);
+  bool paused_ GUARDED_BY(mutex_);
+  std::map<GoogleString, GoogleString> values_ GUARDED_BY(mutex_);
+  int num_keys_looked_up_ GUARDED_BY(mutex_);
+  int num_batches_ GUARDED_BY(mutex_);
+  int num_connections_ GUARDED_BY(mutex_);
+
+  DISALLOW_COPY_AND_ASSIGN(MemcachedServerForTesting);
+};
+
+}  // namespace net_instaweb
+
+#endif  // PAGESPEED_SYSTEM_MEMCACHED_SERVER_FOR_TESTING_H_
@@ -80,6 +80,7 @@ static const int kMaxRedirections = 1;
 
 const char kRedisClusterRedirections[] = "redis_cluster_redirections";
 const char kRedisClusterSlotsFetches[] = "redis_cluster_slots_fetches";
+const char kRedisStatsPrefix[] = "redis";
 
 RedisCache::RedisCache(StringPiece host, int port, ThreadSystem* thread_system,
                        MessageHandler* message_handler, Timer* timer,
@@ -95,6 +96,7 @@ RedisCache::RedisCache(StringPiece host, int port, ThreadSystem* thread_system,
       thread_synchronizer_(new ThreadSynchronizer(thread_system)),
       connections_lock_(thread_system_->NewRWLock()),
       cluster_map_lock_(thread_system_->NewRWLock()),
+      stats_(stats),
       main_connection_(nullptr) {
   redirections_ = stats->GetVariable(kRedisClusterRedirections);
   cluster_slots_fetches_ = stats->GetVariable(kRedisClusterSlotsFetches);
@@ -108,6 +110,13 @@ GoogleString RedisCache::ServerDescription() const {
 void RedisCache::InitStats(Statistics* stats) {
   stats->AddVariable(kRedisClusterRedirections);
   stats->AddVariable(kRedisClusterSlotsFetches);
+  HotKeyReplica::InitStats(kRedisStatsPrefix, stats);
+}
+
+void RedisCache::EnableHotKeyReplica(const HotKeyReplica::Options& options) {
+  CHECK(main_connection_ == nullptr) << "Must be called before StartUp()";
+  hot_key_replica_.reset(new HotKeyReplica(
+      options, kRedisStatsPrefix, thread_system_, timer_, stats_));
 }
 
 void RedisCache::StartUp(bool connect_now) {
@@ -153,24 +162,147 @@ void RedisCache::ShutDown() {
 }
 
 void RedisCache::Get(const GoogleString& key, Callback* callback) {
+  HotKeyReplica::LookupResult replica_result = HotKeyReplica::kFetch;
+  if (hot_key_replica_ != nullptr) {
+    SharedString value;
+    bool found = false;
+    replica_result = hot_key_replica_->Lookup(key, true /* may_wait */, &value,
+                                              &found);
+    if (replica_result == HotKeyReplica::kLocal) {
+      if (found) {
+        callback->set_value(value);
+      }
+      ValidateAndReportResult(
+          key, found ? CacheInterface::kAvailable : CacheInterface::kNotFound,
+          callback);
+      return;
+    }
+  }
+  GetFromRedis(key, replica_result, callback);
+}
+
+void RedisCache::GetFromRedis(const GoogleString& key,
+                              HotKeyReplica::LookupResult replica_result,
+                              Callback* callback) {
   KeyState keyState = CacheInterface::kNotFound;
   RedisReply reply = RedisCommand(
       LookupConnection(key),
       "GET %b", {REDIS_REPLY_STRING, REDIS_REPLY_NIL},
       key.data(), key.length());
 
+  SharedString value;
   if (reply) {
     if (reply->type == REDIS_REPLY_STRING) {
       // The only type of values that we store in Redis is string.
-      callback->set_value(SharedString(StringPiece(reply->str, reply->len)));
+      value.Assign(reply->str, reply->len);
+      callback->set_value(value);
       keyState = CacheInterface::kAvailable;
     } else {
       // REDIS_REPLY_NIL means 'key not found', do nothing.
     }
   }
+  if (replica_result == HotKeyReplica::kFetchAndReport) {
+    hot_key_replica_->FetchDone(key, reply != nullptr,
+                                keyState == CacheInterface::kAvailable, value);
+  }
   ValidateAndReportResult(key, keyState, callback);
 }
 
+void RedisCache::MultiGet(MultiGetRequest* request) {
+  // Answer what we can from the hot-key replica.  We must not wait for other
+  // threads' fetches here, as they may be waiting for ours.
+  std::vector<HotKeyReplica::LookupResult> replica_results(
+      request->size(), HotKeyReplica::kFetch);
+  if (hot_key_replica_ != nullptr) {
+    for (int i = 0, n = request->size(); i < n; ++i) {
+      KeyCallback* key_callback = &(*request)[i];
+      SharedString value;
+      bool found = false;
+      replica_results[i] = hot_key_replica_->Lookup(
+          key_callback->key, false /* may_wait */, &value, &found);
+      if (replica_results[i] == HotKeyReplica::kLocal) {
+        if (found) {
+          key_callback->callback->set_value(value);
+        }
+        ValidateAndReportResult(
+            key_callback->key,
+            found ? CacheInterface::kAvailable : CacheInterface::kNotFound,
+            key_callback->callback);
+      }
+    }
+  }
+
+  // Split the rest of the request into one batch per server, remembering
+  // where in the request each key came from.
+  std::map<Connection*, std::vector<int>> batches;
+  for (int i = 0, n = request->size(); i < n; ++i) {
+    if (replica_results[i] == HotKeyReplica::kLocal) {
+      continue;
+    }
+    Connection* conn = LookupConnection((*request)[i].key);
+    if (conn != nullptr) {
+      batches[conn].push_back(i);
+    }
+  }
+  std::vector<RedisReply> results(request->size());
+  std::vector<int> redirected;
+  for (auto& batch : batches) {
+    Connection* conn = batch.first;
+    const std::vector<int>& indices = batch.second;
+    std::vector<const GoogleString*> keys;
+    for (int index : indices) {
+      keys.push_back(&(*request)[index].key);
+    }
+
+    ScopedMutex lock(conn->GetOperationMutex());
+    std::vector<RedisReply> replies;
+    conn->PipelinedGet(keys, &replies);
+    for (int j = 0, n = indices.size(); j < n; ++j) {
+      RedisReply& reply = replies[j];
+      // ValidateRedisReply should be called for every reply to update state.
+      if (IsRedirection(reply)) {
+        conn->ValidateRedisReply(reply, {REDIS_REPLY_ERROR}, "GET");
+        redirected.push_back(indices[j]);
+      } else if (conn->ValidateRedisReply(
+                     reply, {REDIS_REPLY_STRING, REDIS_REPLY_NIL}, "GET")) {
+        results[indices[j]] = std::move(reply);
+      }
+    }
+  }
+
+  // Redirections are rare enough (they only happen until we learn the
+  // cluster's slot mapping, or while a slot migrates) that we just retry
+  // those keys one by one, the way Get() does, which follows them.
+  std::sort(redirected.begin(), redirected.end());
+  for (int i = 0, n = request->size(); i < n; ++i) {
+    KeyCallback* key_callback = &(*request)[i];
+    if (replica_results[i] == HotKeyReplica::kLocal) {
+      continue;
+    }
+    if (std::binary_search(redirected.begin(), redirected.end(), i)) {
+      GetFromRedis(key_callback->key, replica_results[i],
+                   key_callback->callback);
+      continue;
+    }
+    KeyState key_state = CacheInterface::kNotFound;
+    const RedisReply& reply = results[i];
+    SharedString value;
+    if (reply && reply->type == REDIS_REPLY_STRING) {
+      value.Assign(reply->str, reply->len);
+      key_callback->callback->set_value(value);
+      key_state = CacheInterface::kAvailable;
+    }
+    if (replica_results[i] == HotKeyReplica::kFetchAndReport) {
+      hot_key_replica_->FetchDone(key_callback->key, reply != nullptr,
+                                  key_state == CacheInterface::kAvailable,
+                                  value);
+    }
+    ValidateAndReportResult(key_callback->key, key_state,
+                            key_callback->callback);
+  }
+  delete request;
+}
+
 void RedisCache::Put(const GoogleString& key, const SharedString& value) {
   RedisReply reply = RedisCommand(
       LookupConnection(key),
@@ -185,7 +317,9 @@ void RedisCache::Put(const GoogleString& key, const SharedString& value) {
 
   GoogleString answer(reply->str, reply->len);
   if (answer == "OK") {
-    // Success, nothing to do.
+    if (hot_key_replica_ != nullptr) {
+      hot_key_replica_->Put(key, value);
+    }
   } else {
     LOG(DFATAL) << "Unexpected status from redis as answer to SET: " << answer;
     message_handler_->Message(
@@ -199,6 +333,9 @@ void RedisCache::Delete(const GoogleString& key) {
   // that amount; all other errors are handled by RedisCommand.
   RedisCommand(LookupConnection(key),
                "DEL %b", {REDIS_REPLY_INTEGER}, key.data(), key.length());
+  if (hot_key_replica_ != nullptr) {
+    hot_key_replica_->Delete(key);
+  }
 }
 
 void RedisCache::GetStatus(GoogleString* buffer) {
@@ -226,6 +363,11 @@ void RedisCache::GetStatus(GoogleString* buffer) {
       StrAppend(buffer, "Error calling INFO");
     }
   }
+
+  if (hot_key_replica_ != nullptr) {
+    StrAppend(buffer, "\n");
+    hot_key_replica_->AppendStatus(buffer);
+  }
 }
 
 RedisCache::RedisReply RedisCache::RedisCommand(
@@ -312,11 +454,22 @@ RedisCache::RedisReply RedisCache::RedisCommand(
   return reply;
 }
 
+// static
+bool RedisCache::IsRedirection(const RedisReply& reply) {
+  if (!reply || reply->type != REDIS_REPLY_ERROR) {
+    return false;
+  }
+  StringPiece error(reply->str, reply->len);
+  return strings::StartsWith(error, "MOVED ") ||
+         strings::StartsWith(error, "ASK ");
+}
+
 // Redis may return errors like this: `MOVED 12182 127.0.0.1:7215`,
 // `ASK 12182 127.0.0.1:1419`. First token is type of redirection (permanent or
 // there is a migration in process), second token is calculated key slot, third
 // token specified the node we should re-ask (host:port). See
 // http://redis.io/topics/cluster-spec#moved-redirection.
+// static
 ExternalServerSpec RedisCache::ParseRedirectionError(StringPiece error) {
   StringPieceVector error_tokens;
   SplitStringPieceToVector(error, " ", &error_tokens,
@@ -675,6 +828,49 @@ RedisCache::RedisReply RedisCache::Connection::RedisCommand(
   return reply;
 }
 
+void RedisCache::Connection::PipelinedGet(
+    const std::vector<const GoogleString*>& keys,
+    std::vector<RedisReply>* replies) {
+  replies->clear();
+  replies->resize(keys.size());
+  if (!EnsureConnection()) {
+    return;
+  }
+
+  // hiredis only buffers appended commands; the first redisGetReply() writes
+  // them all out before it waits for the first reply.
+  bool ok = true;
+  for (const GoogleString* key : keys) {
+    if (redisAppendCommand(redis_.get(), "GET %b", key->data(),
+                           key->length()) != REDIS_OK) {
+      ok = false;
+      break;
+    }
+  }
+  for (int i = 0, n = replies->size(); ok && i < n; ++i) {
+    void* result = nullptr;
+    if (redisGetReply(redis_.get(), &result) != REDIS_OK) {
+      ok = false;
+      break;
+    }
+    (*replies)[i].reset(static_cast<redisReply*>(result));
+  }
+  if (!ok) {
+    // Whatever is left of the pipeline is still buffered in the context, or
+    // on its way back from the server, so every reply read from it from now
+    // on would be taken for the wrong key. Drop the context, and fail the
+    // whole batch so that no reply is checked against a dead connection.
+    LogRedisContextError(redis_.get(), "GET");
+    replies->clear();
+    replies->resize(keys.size());
+    ScopedMutex lock(state_mutex_.get());
+    redis_.reset();
+    state_ = kDisconnected;
+  }
+  redis_cache_->thread_synchronizer_->Signal("RedisCommand.After.Signal");
+  redis_cache_->thread_synchronizer_->Wait("RedisCommand.After.Wait");
+}
+
 void RedisCache::Connection::LogRedisContextError(redisContext* context,
                                       const char* cause) {
   if (context == nullptr) {
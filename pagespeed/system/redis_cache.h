@@ -38,6 +38,7 @@
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
+#include "pagespeed/kernel/cache/hot_key_replica.h"
 #include "pagespeed/kernel/thread/thread_synchronizer.h"
 #include "pagespeed/system/external_server_spec.h"
 #include "third_party/hiredis/src/hiredis.h"
@@ -69,6 +70,21 @@ namespace net_instaweb {
 //
 // http://redis.io/topics/cluster-spec explains this all.
 //
+// MultiGet() groups the keys by the server we expect to own them and sends
+// each server all of its GETs before reading any reply, so a batch costs one
+// round trip per server rather than one per key.  Keys that turn out to be
+// redirected are then looked up one by one, the same way Get() does it.
+//
+// Each Connection is a blocking hiredis context used under a mutex, so every
+// request in flight holds a thread (normally AsyncCache's) for its round trip.
+// AsyncRedisCache does the same work from a single event loop using hiredis'
+// async API, and is used instead when RedisAsyncClient is set.
+//
+// A few very popular keys can saturate the one cluster node that owns them.
+// With EnableHotKeyReplica(), each RedisCache keeps a short-lived local copy
+// of the keys it reads most often, and answers lookups of them without a
+// round trip; see HotKeyReplica.  GetStatus() lists the current hot keys.
+//
 // TODO(yeputons): consider extracting a common interface with AprMemCache.
 // TODO(yeputons): consider making Redis-reported errors treated as failures.
 // TODO(yeputons): add redis AUTH command support.
@@ -89,6 +105,10 @@ class RedisCache : public CacheInterface {
 
   void StartUp(bool connect_now = true);
 
+  // Replicates hot keys locally, as described above.  Must be called before
+  // StartUp().
+  void EnableHotKeyReplica(const HotKeyReplica::Options& options);
+
   // CacheInterface implementations.
   GoogleString Name() const override { return FormatName(); }
   bool IsBlocking() const override { return true; }
@@ -99,16 +119,22 @@ class RedisCache : public CacheInterface {
 
   // CacheInterface implementations.
   void Get(const GoogleString& key, Callback* callback) override;
+  void MultiGet(MultiGetRequest* request) override;
   void Put(const GoogleString& key, const SharedString& value) override;
   void Delete(const GoogleString& key) override;
 
   // Appends detailed status for each server to a string.  If a server fails to
   // report a status, then for that server we append an error message instead.
+  // Also lists the hot keys, if they are replicated.
   void GetStatus(GoogleString* status_string);
 
   // Redis spec defined hasher for keys.  Static, since it's a pure function.
   static int HashSlot(StringPiece key);
 
+  // Returns the server named by a MOVED or ASK error, or an empty spec if
+  // error can't be parsed.  Shared with AsyncRedisCache.
+  static ExternalServerSpec ParseRedirectionError(StringPiece error);
+
   // Total number of times we hit one server and were redirected to a different
   // one.
   int64 Redirections() {
@@ -163,6 +189,16 @@ class RedisCache : public CacheInterface {
     RedisReply RedisCommand(const char* format, ...)
         EXCLUSIVE_LOCKS_REQUIRED(redis_mutex_) LOCKS_EXCLUDED(state_mutex_);
 
+    // Sends GET for each key, then reads all the replies, so that the whole
+    // batch costs a single round trip.  Leaves one entry in replies per key;
+    // if sending or reading any of them fails, all entries are nullptr and
+    // the connection is dropped, as its pipeline is out of step.
+    // Each reply must be followed by ValidateRedisReply() under the same
+    // lock.
+    void PipelinedGet(const std::vector<const GoogleString*>& keys,
+                      std::vector<RedisReply>* replies)
+        EXCLUSIVE_LOCKS_REQUIRED(redis_mutex_) LOCKS_EXCLUDED(state_mutex_);
+
     bool ValidateRedisReply(const RedisReply& reply,
                             std::initializer_list<int> valid_types,
                             const char* command_executed)
@@ -225,11 +261,18 @@ class RedisCache : public CacheInterface {
   RedisReply RedisCommand(Connection* connection, const char* format,
                           std::initializer_list<int> valid_reply_types, ...);
 
+  // Looks key up in Redis and reports the result to callback, and, if
+  // replica_result is kFetchAndReport, to the hot-key replica.
+  void GetFromRedis(const GoogleString& key,
+                    HotKeyReplica::LookupResult replica_result,
+                    Callback* callback);
+
   ThreadSynchronizer* GetThreadSynchronizerForTesting() const {
     return thread_synchronizer_.get();
   }
 
-  ExternalServerSpec ParseRedirectionError(StringPiece error);
+  // Returns true if reply is a MOVED or ASK error from Redis Cluster.
+  static bool IsRedirection(const RedisReply& reply);
 
   // Must not be called under Connection::GetOperationLock(), that will cause
   // lock inversion and potential theoretical deadlock.
@@ -256,6 +299,7 @@ class RedisCache : public CacheInterface {
   const scoped_ptr<ThreadSynchronizer> thread_synchronizer_;
   const scoped_ptr<ThreadSystem::RWLock> connections_lock_;
   const scoped_ptr<ThreadSystem::RWLock> cluster_map_lock_;
+  Statistics* stats_;
   Variable* redirections_;
   Variable* cluster_slots_fetches_;
 
@@ -267,6 +311,9 @@ class RedisCache : public CacheInterface {
   // Not guarded, but should only be modified in StartUp().
   Connection* main_connection_;
 
+  // Not guarded, but should only be modified before StartUp().
+  scoped_ptr<HotKeyReplica> hot_key_replica_;
+
   friend class RedisCacheTest;
   DISALLOW_COPY_AND_ASSIGN(RedisCache);
 };
@@ -232,6 +232,46 @@ TEST_F(RedisCacheClusterTest, SlotBoundaries) {
   }
 }
 
+TEST_F(RedisCacheClusterTest, MultiGet) {
+  if (!InitRedisClusterOrSkip()) {
+    return;
+  }
+
+  CheckPut(kKeyOnNode1, kValue1);
+  CheckPut(kKeyOnNode2, kValue2);
+  CheckPut(kKeyOnNode3, kValue3);
+  EXPECT_EQ(1, cache_->Redirections());
+  EXPECT_EQ(1, cache_->ClusterSlotsFetches());
+
+  // Start over with a cache that doesn't know the slot mapping yet, so the
+  // whole batch goes to the first node.  The keys it doesn't own are retried
+  // one by one, and the first retry fetches the mapping.
+  cache_.reset(new RedisCache("localhost", ports_[0], thread_system_.get(),
+                              &handler_, &timer_, kReconnectionDelayMs,
+                              kTimeoutUs, &statistics_));
+  cache_->StartUp();
+  Callback* node1 = AddCallback();
+  Callback* node2 = AddCallback();
+  Callback* node3 = AddCallback();
+  IssueMultiGet(node1, kKeyOnNode1, node2, kKeyOnNode2, node3, kKeyOnNode3);
+  WaitAndCheck(node1, kValue1);
+  WaitAndCheck(node2, kValue2);
+  WaitAndCheck(node3, kValue3);
+  EXPECT_EQ(2, cache_->Redirections());
+  EXPECT_EQ(2, cache_->ClusterSlotsFetches());
+
+  // Now each node gets its own batch, and nothing is redirected.
+  node1 = AddCallback();
+  node2 = AddCallback();
+  node3 = AddCallback();
+  IssueMultiGet(node1, kKeyOnNode1, node2, kKeyOnNode2, node3, kKeyOnNode3);
+  WaitAndCheck(node1, kValue1);
+  WaitAndCheck(node2, kValue2);
+  WaitAndCheck(node3, kValue3);
+  EXPECT_EQ(2, cache_->Redirections());
+  EXPECT_EQ(2, cache_->ClusterSlotsFetches());
+}
+
 int CountSubstring(const GoogleString& haystack, const GoogleString& needle) {
   size_t pos = -1;
   int count = 0;
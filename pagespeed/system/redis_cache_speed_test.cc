@@ -0,0 +1,302 @@
+/*
+ * Copyright 2016 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the two ways SystemCaches can talk to Redis: the blocking
+// RedisCache, driven from a one-thread QueuedWorkerPool through AsyncCache,
+// and the event-driven AsyncRedisCache.  Needs a Redis server on $REDIS_PORT,
+// as started by install/run_program_with_redis.sh, which is left holding the
+// keys the benchmarks write.
+//
+// *Get*: the benchmark argument is the number of single-key lookups kept in
+// flight at once, so the time per iteration at higher values is the
+// reciprocal of the throughput.  *MultiGet*: one MultiGet at a time, of as
+// many keys as the argument; the time is per MultiGet.  Every key looked up
+// holds a 1000-byte value.
+//
+// Measured on a single-core Linux VM, -O2, against redis 6.2 on the same
+// machine:
+//
+// Benchmark                      Time(ns) Iterations
+// --------------------------------------------------
+// RedisGetBlocking/1                 9765     162390
+// RedisGetBlocking/2                10466     132297
+// RedisGetBlocking/4                11046     136686
+// RedisGetBlocking/8                10988     142530
+// RedisGetBlocking/16               10877     133416
+// RedisGetBlocking/32               10568     136948
+// RedisGetBlocking/64               10436     138888
+// RedisGetAsync/1                   11608     128019
+// RedisGetAsync/2                    6306     226312
+// RedisGetAsync/4                    4147     385405
+// RedisGetAsync/8                    2701     533238
+// RedisGetAsync/16                   2145     713266
+// RedisGetAsync/32                   2119     703564
+// RedisGetAsync/64                   2170     666666
+// RedisMultiGetBlocking/1           11048     148000
+// RedisMultiGetBlocking/2           12171     126774
+// RedisMultiGetBlocking/4           15080      97827
+// RedisMultiGetBlocking/8           19999      76227
+// RedisMultiGetBlocking/16          29405      50614
+// RedisMultiGetBlocking/32          53443      28231
+// RedisMultiGetBlocking/64         100877      15052
+// RedisMultiGetAsync/1              11547     137173
+// RedisMultiGetAsync/2              12238     125838
+// RedisMultiGetAsync/4              12644     116494
+// RedisMultiGetAsync/8              15380      94452
+// RedisMultiGetAsync/16             21031      73431
+// RedisMultiGetAsync/32             39027      37188
+// RedisMultiGetAsync/64             71415      20557
+//
+// A single lookup costs the same either way.  The blocking path does one
+// round trip at a time however many lookups are waiting, while the async
+// client pipelines them, so its throughput keeps growing up to about 16 in
+// flight.  A MultiGet is one MGET rather than a GET per key, which saves
+// about a third at 64 keys.
+//
+// Disclaimer: comparing runs over time and across different machines
+// can be misleading.  When contemplating an algorithm change, always do
+// interleaved runs with the old & new algorithm.
+
+#include <cstdlib>
+
+#include "base/logging.h"
+#include "pagespeed/kernel/base/abstract_mutex.h"
+#include "pagespeed/kernel/base/basictypes.h"
+#include "pagespeed/kernel/base/benchmark.h"
+#include "pagespeed/kernel/base/cache_interface.h"
+#include "pagespeed/kernel/base/condvar.h"
+#include "pagespeed/kernel/base/null_message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
+#include "pagespeed/kernel/base/shared_string.h"
+#include "pagespeed/kernel/base/string.h"
+#include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/async_cache.h"
+#include "pagespeed/kernel/thread/queued_worker_pool.h"
+#include "pagespeed/kernel/util/platform.h"
+#include "pagespeed/kernel/util/simple_stats.h"
+#include "pagespeed/system/async_redis_cache.h"
+#include "pagespeed/system/redis_cache.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const int kNumKeys = 1000;
+const int kValueSize = 1000;
+const int64 kReconnectionDelayMs = 1000;
+const int64 kTimeoutUs = Timer::kSecondUs;
+
+GoogleString Key(int index) {
+  return StrCat("redis_speed_test/", IntegerToString(index % kNumKeys));
+}
+
+// Keeps a number of lookups in flight until iters of them have completed.
+class Lookups {
+ public:
+  Lookups(CacheInterface* cache, int iters, int keys_per_lookup,
+          ThreadSystem* thread_system)
+      : cache_(cache),
+        keys_per_lookup_(keys_per_lookup),
+        mutex_(thread_system->NewMutex()),
+        done_(mutex_->NewCondvar()),
+        iters_(iters),
+        started_(0),
+        finished_(0),
+        next_key_(0),
+        misses_(0) {}
+
+  void Run(int in_flight) {
+    for (int i = 0; i < in_flight && i < iters_; ++i) {
+      Start();
+    }
+    ScopedMutex lock(mutex_.get());
+    while (finished_ < iters_) {
+      done_->Wait();
+    }
+    CHECK_EQ(0, misses_) << "Lookups missed; is Redis up?";
+  }
+
+ private:
+  // Counts down the keys of one MultiGet.
+  class Callback : public CacheInterface::Callback {
+   public:
+    Callback(Lookups* lookups, int* remaining)
+        : lookups_(lookups), remaining_(remaining) {}
+
+    virtual void Done(CacheInterface::KeyState state) {
+      lookups_->KeyDone(state == CacheInterface::kAvailable, remaining_);
+      delete this;
+    }
+
+   private:
+    Lookups* lookups_;
+    int* remaining_;
+  };
+
+  void Start() {
+    CacheInterface::MultiGetRequest* request =
+        new CacheInterface::MultiGetRequest;
+    int* remaining = new int(keys_per_lookup_);
+    {
+      ScopedMutex lock(mutex_.get());
+      ++started_;
+      for (int i = 0; i < keys_per_lookup_; ++i) {
+        request->push_back(CacheInterface::KeyCallback(
+            Key(next_key_++), new Callback(this, remaining)));
+      }
+    }
+    cache_->MultiGet(request);
+  }
+
+  void KeyDone(bool hit, int* remaining) {
+    bool start_another = false;
+    {
+      ScopedMutex lock(mutex_.get());
+      if (!hit) {
+        ++misses_;
+      }
+      if (--*remaining > 0) {
+        return;
+      }
+      delete remaining;
+      ++finished_;
+      if (started_ < iters_) {
+        start_another = true;
+      } else if (finished_ == iters_) {
+        done_->Signal();
+      }
+    }
+    if (start_another) {
+      Start();
+    }
+  }
+
+  CacheInterface* cache_;
+  const int keys_per_lookup_;
+  scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex_;
+  scoped_ptr<ThreadSystem::Condvar> done_;
+  const int iters_;
+  int started_;
+  int finished_;
+  int next_key_;
+  int misses_;
+
+  DISALLOW_COPY_AND_ASSIGN(Lookups);
+};
+
+// The pieces every benchmark needs.
+class Environment {
+ public:
+  Environment()
+      : thread_system_(Platform::CreateThreadSystem()),
+        timer_(Platform::CreateTimer()),
+        stats_(thread_system_.get()),
+        port_(0) {
+    RedisCache::InitStats(&stats_);
+    AsyncRedisCache::InitStats(&stats_);
+    const char* port_string = getenv("REDIS_PORT");
+    CHECK(port_string != NULL && StringToInt(port_string, &port_))
+        << "Set $REDIS_PORT to the port of a Redis server to run these";
+  }
+
+  // Returns the blocking cache as SystemCaches sets it up, with its worker.
+  CacheInterface* NewBlockingCache() {
+    RedisCache* redis = new RedisCache(
+        "localhost", port_, thread_system_.get(), &handler_, timer_.get(),
+        kReconnectionDelayMs, kTimeoutUs, &stats_);
+    redis->StartUp();
+    blocking_.reset(redis);
+    pool_.reset(new QueuedWorkerPool(1, "redis", thread_system_.get()));
+    return new AsyncCache(redis, pool_.get());
+  }
+
+  CacheInterface* NewAsyncCache() {
+    AsyncRedisCache* redis = new AsyncRedisCache(
+        "localhost", port_, thread_system_.get(), &handler_, timer_.get(),
+        kReconnectionDelayMs, kTimeoutUs, &stats_);
+    CHECK(redis->StartUp());
+    return redis;
+  }
+
+  // Fills Redis with the values the benchmarks look up, then times iters
+  // lookups through cache.
+  void Run(CacheInterface* cache, int iters, int keys_per_lookup,
+           int in_flight) {
+    SharedString value(GoogleString(kValueSize, 'v'));
+    for (int i = 0; i < kNumKeys; ++i) {
+      cache->Put(Key(i), value);
+    }
+    // Make sure the Puts are done before timing.
+    Lookups warm_up(cache, 1, kNumKeys, thread_system_.get());
+    warm_up.Run(1);
+
+    Lookups lookups(cache, iters, keys_per_lookup, thread_system_.get());
+    StartBenchmarkTiming();
+    lookups.Run(in_flight);
+    StopBenchmarkTiming();
+    cache->ShutDown();
+    if (pool_.get() != NULL) {
+      pool_->ShutDown();
+    }
+  }
+
+ private:
+  scoped_ptr<ThreadSystem> thread_system_;
+  scoped_ptr<Timer> timer_;
+  SimpleStats stats_;
+  NullMessageHandler handler_;
+  int port_;
+  scoped_ptr<CacheInterface> blocking_;
+  scoped_ptr<QueuedWorkerPool> pool_;
+};
+
+void Benchmark(bool async, int iters, int keys_per_lookup, int in_flight) {
+  StopBenchmarkTiming();
+  {
+    Environment env;
+    scoped_ptr<CacheInterface> cache(
+        async ? env.NewAsyncCache() : env.NewBlockingCache());
+    env.Run(cache.get(), iters, keys_per_lookup, in_flight);
+  }
+  StartBenchmarkTiming();
+}
+
+}  // namespace
+
+}  // namespace net_instaweb
+
+static void RedisGetBlocking(int iters, int in_flight) {
+  net_instaweb::Benchmark(false, iters, 1, in_flight);
+}
+
+static void RedisGetAsync(int iters, int in_flight) {
+  net_instaweb::Benchmark(true, iters, 1, in_flight);
+}
+
+static void RedisMultiGetBlocking(int iters, int keys) {
+  net_instaweb::Benchmark(false, iters, keys, 1);
+}
+
+static void RedisMultiGetAsync(int iters, int keys) {
+  net_instaweb::Benchmark(true, iters, keys, 1);
+}
+
+BENCHMARK_RANGE(RedisGetBlocking, 1, 64);
+BENCHMARK_RANGE(RedisGetAsync, 1, 64);
+BENCHMARK_RANGE(RedisMultiGetBlocking, 1, 64);
+BENCHMARK_RANGE(RedisMultiGetAsync, 1, 64);
@@ -62,7 +62,9 @@ class RedisCacheTest : public CacheTestBase {
     RedisCache::InitStats(&statistics_);
   }
 
-  bool InitRedisOrSkip() {
+  // If hot_key_options is non-null, hot keys are replicated with them.
+  bool InitRedisOrSkip(
+      const HotKeyReplica::Options* hot_key_options = nullptr) {
     const char* portString = getenv("REDIS_PORT");
     int port;
     if (portString == nullptr || !StringToInt(portString, &port)) {
@@ -84,6 +86,9 @@ class RedisCacheTest : public CacheTestBase {
     cache_.reset(new RedisCache("localhost", port, thread_system_.get(),
                                 &handler_, &timer_, kReconnectionDelayMs,
                                 kTimeoutUs, &statistics_));
+    if (hot_key_options != nullptr) {
+      cache_->EnableHotKeyReplica(*hot_key_options);
+    }
     cache_->StartUp();
     return true;
   }
@@ -235,6 +240,44 @@ TEST_F(RedisCacheTest, GetStatus) {
   EXPECT_THAT(status, HasSubstr("used_memory:"));
 }
 
+TEST_F(RedisCacheTest, HotKeysAreReplicated) {
+  HotKeyReplica::Options options;
+  options.ttl_ms = 1000;
+  options.sample_rate = 1;
+  options.hot_threshold = 2;
+  if (!InitRedisOrSkip(&options)) {
+    return;
+  }
+
+  CheckPut(kSomeKey, kSomeValue);
+  CheckGet(kSomeKey, kSomeValue);
+  CheckGet(kSomeKey, kSomeValue);  // Now hot, and replicated.
+
+  // Change the value behind the cache's back; the replica still answers.
+  {
+    int port;
+    ASSERT_TRUE(StringToInt(getenv("REDIS_PORT"), &port));
+    TcpConnectionForTesting conn;
+    ASSERT_TRUE(conn.Connect("localhost", port));
+    conn.Send(StrCat("SET ", kSomeKey, " Other\r\n"));
+    ASSERT_EQ("+OK\r\n", conn.ReadLineCrLf());
+  }
+  CheckGet(kSomeKey, kSomeValue);
+  EXPECT_EQ(1, statistics_.GetVariable("redis_hot_key_local_hits")->Get());
+
+  GoogleString status;
+  cache_->GetStatus(&status);
+  EXPECT_THAT(status, HasSubstr(StrCat(kSomeKey, ": frequency")));
+
+  // Once the replica expires, the new value is read.
+  timer_.AdvanceMs(options.ttl_ms);
+  CheckGet(kSomeKey, "Other");
+
+  // Writes through the cache are seen immediately.
+  CheckPut(kSomeKey, kSomeValue);
+  CheckGet(kSomeKey, kSomeValue);
+}
+
 // Two following tests are identical and ensure that no keys are leaked between
 // tests through shared running Redis server.
 TEST_F(RedisCacheTest, TestsAreIsolated1) {
@@ -288,6 +331,112 @@ class RedisGetRespondingServerThread : public TcpServerThreadForTesting {
   }
 };
 
+// Answers a MultiGet for three keys only after it has received all three
+// GETs, so a client that waits for each reply before sending the next
+// command times out.
+class RedisPipelineRespondingServerThread : public TcpServerThreadForTesting {
+ public:
+  RedisPipelineRespondingServerThread(apr_port_t listen_port,
+                                      ThreadSystem* thread_system)
+      : TcpServerThreadForTesting(listen_port, "redis_pipeline_server",
+                                  thread_system) {}
+
+  virtual ~RedisPipelineRespondingServerThread() { ShutDown(); }
+
+ private:
+  void HandleClientConnection(apr_socket_t* sock) override {
+    static const char kRequest[] =
+        "*2\r\n$3\r\nGET\r\n$2\r\nn0\r\n"
+        "*2\r\n$3\r\nGET\r\n$9\r\nnot_found\r\n"
+        "*2\r\n$3\r\nGET\r\n$2\r\nn1\r\n";
+    static const char kAnswer[] = "$2\r\nv0\r\n$-1\r\n$2\r\nv1\r\n";
+    apr_size_t answer_size = STATIC_STRLEN(kAnswer);
+
+    GoogleString request;
+    while (request.size() < STATIC_STRLEN(kRequest)) {
+      char buf[STATIC_STRLEN(kRequest)];
+      apr_size_t size = sizeof(buf);
+      if (apr_socket_recv(sock, buf, &size) != APR_SUCCESS) {
+        break;
+      }
+      request.append(buf, size);
+    }
+    EXPECT_EQ(kRequest, request);
+
+    apr_socket_send(sock, kAnswer, &answer_size);
+    apr_socket_close(sock);
+  }
+};
+
+TEST_F(RedisCacheTest, MultiGetIsPipelined) {
+  InitRedisWithCustomServer();
+  ASSERT_TRUE(StartCustomServer<RedisPipelineRespondingServerThread>());
+  cache_->StartUp();
+
+  Callback* n0 = AddCallback();
+  Callback* not_found = AddCallback();
+  Callback* n1 = AddCallback();
+  IssueMultiGet(n0, "n0", not_found, "not_found", n1, "n1");
+  WaitAndCheck(n0, "v0");
+  WaitAndCheckNotFound(not_found);
+  WaitAndCheck(n1, "v1");
+}
+
+// Receives a MultiGet for three keys, but answers only the first before it
+// closes the connection.
+class RedisPartialPipelineServerThread : public TcpServerThreadForTesting {
+ public:
+  RedisPartialPipelineServerThread(apr_port_t listen_port,
+                                   ThreadSystem* thread_system)
+      : TcpServerThreadForTesting(listen_port, "redis_partial_pipeline_server",
+                                  thread_system) {}
+
+  virtual ~RedisPartialPipelineServerThread() { ShutDown(); }
+
+ private:
+  void HandleClientConnection(apr_socket_t* sock) override {
+    static const char kRequest[] =
+        "*2\r\n$3\r\nGET\r\n$2\r\nn0\r\n"
+        "*2\r\n$3\r\nGET\r\n$2\r\nn1\r\n"
+        "*2\r\n$3\r\nGET\r\n$2\r\nn2\r\n";
+    static const char kAnswer[] = "$2\r\nv0\r\n";
+    apr_size_t answer_size = STATIC_STRLEN(kAnswer);
+
+    GoogleString request;
+    while (request.size() < STATIC_STRLEN(kRequest)) {
+      char buf[STATIC_STRLEN(kRequest)];
+      apr_size_t size = sizeof(buf);
+      if (apr_socket_recv(sock, buf, &size) != APR_SUCCESS) {
+        break;
+      }
+      request.append(buf, size);
+    }
+    EXPECT_EQ(kRequest, request);
+
+    apr_socket_send(sock, kAnswer, &answer_size);
+    apr_socket_close(sock);
+  }
+};
+
+TEST_F(RedisCacheTest, MultiGetFailsWholeBatchOnBrokenPipeline) {
+  InitRedisWithCustomServer();
+  ASSERT_TRUE(StartCustomServer<RedisPartialPipelineServerThread>());
+  cache_->StartUp();
+
+  Callback* n0 = AddCallback();
+  Callback* n1 = AddCallback();
+  Callback* n2 = AddCallback();
+  IssueMultiGet(n0, "n0", n1, "n1", n2, "n2");
+  WaitAndCheckNotFound(n0);
+  WaitAndCheckNotFound(n1);
+  WaitAndCheckNotFound(n2);
+
+  // The connection was dropped, and the next request makes a new one.
+  ASSERT_TRUE(StartCustomServer<RedisGetRespondingServerThread>());
+  EXPECT_TRUE(Cache()->IsHealthy());
+  CheckGet(kSomeKey, kSomeValue);
+}
+
 TEST_F(RedisCacheTest, ReconnectsInstantly) {
   InitRedisWithCustomServer();
   ASSERT_TRUE(StartCustomServer<RedisGetRespondingServerThread>());
@@ -562,7 +711,16 @@ TEST_F(RedisCacheOperationTimeoutTest, Get) {
   CheckNotFound("Key");
 }
 
-// TODO(yeputons): test MultiGet when it's a single command, not sequenced GET()
+// The whole batch is sent at once, so it should time out just once.
+TEST_F(RedisCacheOperationTimeoutTest, MultiGet) {
+  Callback* n0 = AddCallback();
+  Callback* n1 = AddCallback();
+  Callback* n2 = AddCallback();
+  IssueMultiGet(n0, "n0", n1, "n1", n2, "n2");
+  WaitAndCheckNotFound(n0);
+  WaitAndCheckNotFound(n1);
+  WaitAndCheckNotFound(n2);
+}
 
 TEST_F(RedisCacheOperationTimeoutTest, Put) {
   CheckPut("Key", "Value");
@@ -24,13 +24,17 @@
 #include "pagespeed/kernel/base/basictypes.h"
 #include "pagespeed/kernel/base/callback.h"
 #include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/null_mutex.h"
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/cache/cache_interface.h"
 #include "pagespeed/kernel/cache/cache_stats.h"
 #include "pagespeed/kernel/cache/file_cache.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
 #include "pagespeed/kernel/cache/lru_cache.h"
 #include "pagespeed/kernel/cache/purge_context.h"
 #include "pagespeed/kernel/cache/purge_set.h"
+#include "pagespeed/kernel/cache/segment_file_cache.h"
+#include "pagespeed/kernel/cache/sharded_lru_cache.h"
 #include "pagespeed/kernel/cache/threadsafe_cache.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_lock_manager.h"
 #include "pagespeed/kernel/util/file_system_lock_manager.h"
@@ -39,6 +43,20 @@
 
 namespace net_instaweb {
 
+namespace {
+
+// Assumed average size of an LRU cache entry, used to size the frequency
+// sketch for CacheAdmissionFilter.  Over-estimating the number of entries
+// only costs a few bytes per entry.
+const int kAdmissionFilterBytesPerEntry = 256;
+
+// Subdirectory of the file cache path holding a SegmentFileCache, and the
+// number of shards it is split into.
+const char kSegmentsDir[] = "/!segments!";
+const int kSegmentFileCacheShards = 16;
+
+}  // namespace
+
 const char SystemCachePath::kFileCache[] = "file_cache";
 const char SystemCachePath::kLruCache[] = "lru_cache";
 
@@ -54,6 +72,7 @@ SystemCachePath::SystemCachePath(const StringPiece& path,
       shm_runtime_(shm_runtime),
       lock_manager_(NULL),
       file_cache_backend_(NULL),
+      segment_file_cache_backend_(NULL),
       lru_cache_(NULL),
       file_cache_(NULL),
       cache_flush_filename_(config->cache_flush_filename()),
@@ -110,28 +129,69 @@ SystemCachePath::SystemCachePath(const StringPiece& path,
       config->file_cache_clean_interval_ms(),
       config->file_cache_clean_size_kb() * 1024,
       config->file_cache_clean_inode_limit());
+  policy->incremental_cleaning = config->file_cache_incremental_cleaning();
+  policy->clean_files_per_sec = config->file_cache_clean_files_per_sec();
+  policy->clean_bytes_per_sec = config->file_cache_clean_bytes_per_sec();
   file_cache_backend_ =
       new FileCache(config->file_cache_path(), factory->file_system(),
                     factory->thread_system(), NULL, policy,
                     factory->statistics(), factory->message_handler());
   factory->TakeOwnership(file_cache_backend_);
-  file_cache_ = new CacheStats(kFileCache, file_cache_backend_,
+  CacheInterface* file_cache = file_cache_backend_;
+  if (config->segmented_file_cache() && !unplugged_) {
+    // The target size is settled in ChildInit, once all the configurations
+    // sharing this path have been merged.
+    segment_file_cache_backend_ = new SegmentFileCache(
+        StrCat(config->file_cache_path(), kSegmentsDir),
+        kSegmentFileCacheShards, 0 /* target_size_bytes */,
+        factory->file_system(), factory->thread_system(), factory->timer(),
+        NULL, factory->statistics(), factory->message_handler());
+    factory->TakeOwnership(segment_file_cache_backend_);
+    file_cache = segment_file_cache_backend_;
+  }
+  file_cache_ = new CacheStats(kFileCache, file_cache,
                                factory->timer(), factory->statistics());
   factory->TakeOwnership(file_cache_);
 
   if (config->lru_cache_kb_per_process() != 0) {
-    LRUCache* lru_cache = new LRUCache(
-        config->lru_cache_kb_per_process() * 1024);
-    factory->TakeOwnership(lru_cache);
+    CacheInterface* memory_cache;
+    if (config->lru_cache_shards() > 0) {
+      // The sharded cache does its own per-segment locking, so it does not
+      // need a ThreadsafeCache wrapper.
+      ShardedLRUCache* sharded_cache = new ShardedLRUCache(
+          config->lru_cache_kb_per_process() * 1024,
+          config->lru_cache_shards(), factory->thread_system());
+      if (config->cache_admission_filter()) {
+        // All the shards share the policy, so it needs its own mutex.
+        sharded_cache->set_admission_policy(new FrequencyAdmissionPolicy(
+            config->lru_cache_kb_per_process() * 1024 /
+                kAdmissionFilterBytesPerEntry,
+            factory->thread_system()->NewMutex()));
+      }
+      memory_cache = sharded_cache;
+      factory->TakeOwnership(memory_cache);
+    } else {
+      LRUCache* lru_cache = new LRUCache(
+          config->lru_cache_kb_per_process() * 1024);
+      factory->TakeOwnership(lru_cache);
+      if (config->cache_admission_filter()) {
+        // The LRUCache is only accessed under the ThreadsafeCache mutex
+        // below, so the policy does not need its own.
+        lru_cache->set_admission_policy(new FrequencyAdmissionPolicy(
+            config->lru_cache_kb_per_process() * 1024 /
+                kAdmissionFilterBytesPerEntry,
+            new NullMutex));
+      }
 
-    // We only add the threadsafe-wrapper to the LRUCache.  The FileCache
-    // is naturally thread-safe because it's got no writable member variables.
-    // And surrounding that slower-running class with a mutex would likely
-    // cause contention.
-    ThreadsafeCache* ts_cache =
-        new ThreadsafeCache(lru_cache, factory->thread_system()->NewMutex());
-    factory->TakeOwnership(ts_cache);
-    lru_cache_ = new CacheStats(kLruCache, ts_cache, factory->timer(),
+      // We only add the threadsafe-wrapper to the LRUCache.  The FileCache
+      // is naturally thread-safe because it's got no writable member
+      // variables.  And surrounding that slower-running class with a mutex
+      // would likely cause contention.
+      memory_cache =
+          new ThreadsafeCache(lru_cache, factory->thread_system()->NewMutex());
+      factory->TakeOwnership(memory_cache);
+    }
+    lru_cache_ = new CacheStats(kLruCache, memory_cache, factory->timer(),
                                 factory->statistics());
     factory->TakeOwnership(lru_cache_);
   }
@@ -232,6 +292,18 @@ void SystemCachePath::ChildInit(SlowWorker* cache_clean_worker) {
   if (file_cache_backend_ != NULL) {
     file_cache_backend_->set_worker(cache_clean_worker);
   }
+  if (segment_file_cache_backend_ != NULL) {
+    // The segment cache enforces the size limit itself.  Cleaning the
+    // FileCache, which only holds a few snapshots, would walk into the
+    // segment directory and remove segments behind its back.
+    FileCache::CachePolicy* policy =
+        file_cache_backend_->mutable_cache_policy();
+    segment_file_cache_backend_->set_target_size_bytes(
+        policy->clean_interval_ms == FileCache::kDisableCleaning
+        ? 0 : policy->target_size_bytes);
+    policy->clean_interval_ms = FileCache::kDisableCleaning;
+    segment_file_cache_backend_->set_worker(cache_clean_worker);
+  }
 
   purge_context_.reset(new PurgeContext(cache_flush_filename_,
                                         factory_->file_system(),
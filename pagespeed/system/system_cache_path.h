@@ -38,6 +38,7 @@ class NamedLockManager;
 class PurgeContext;
 class PurgeSet;
 class RewriteDriverFactory;
+class SegmentFileCache;
 class SharedMemLockManager;
 class SlowWorker;
 class SystemServerContext;
@@ -69,8 +70,13 @@ class SystemCachePath {
   CacheInterface* file_cache() { return file_cache_; }
 
   // Access to backend for testing.  Do not use this directly in production
-  // as it lacks statistics wrappers, etc.
+  // as it lacks statistics wrappers, etc.  With SegmentedFileCache, the
+  // FileCache backend only holds shared memory cache snapshots, and
+  // file_cache() is backed by segment_file_cache_backend() instead.
   FileCache* file_cache_backend() { return file_cache_backend_; }
+  SegmentFileCache* segment_file_cache_backend() {
+    return segment_file_cache_backend_;
+  }
   NamedLockManager* lock_manager() { return lock_manager_; }
 
   // See comments in SystemCaches for calling conventions on these.
@@ -136,6 +142,7 @@ class SystemCachePath {
   scoped_ptr<FileSystemLockManager> file_system_lock_manager_;
   NamedLockManager* lock_manager_;
   FileCache* file_cache_backend_;  // owned by file_cache_
+  SegmentFileCache* segment_file_cache_backend_;  // owned by file_cache_
   CacheInterface* lru_cache_;
   CacheInterface* file_cache_;
   GoogleString cache_flush_filename_;
@@ -29,6 +29,8 @@
 #include "net/instaweb/rewriter/public/rewrite_options.h"
 #include "net/instaweb/rewriter/public/server_context.h"
 #include "pagespeed/system/apr_mem_cache.h"
+#include "pagespeed/system/async_mem_cache.h"
+#include "pagespeed/system/async_redis_cache.h"
 #include "pagespeed/system/redis_cache.h"
 #include "pagespeed/system/system_cache_path.h"
 #include "pagespeed/system/system_rewrite_options.h"
@@ -36,25 +38,97 @@
 #include "pagespeed/system/external_server_spec.h"
 #include "net/instaweb/util/public/property_cache.h"
 #include "pagespeed/kernel/base/abstract_shared_mem.h"
+#include "pagespeed/kernel/base/callback.h"
+#include "pagespeed/kernel/base/file_system.h"
 #include "pagespeed/kernel/base/md5_hasher.h"
 #include "pagespeed/kernel/base/message_handler.h"
+#include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/statistics.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_writer.h"
 #include "pagespeed/kernel/base/thread_system.h"
+#include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/cache/async_cache.h"
 #include "pagespeed/kernel/cache/cache_batcher.h"
+#include "pagespeed/kernel/cache/cache_codec.h"
+#include "pagespeed/kernel/cache/cache_dictionary_builder.h"
 #include "pagespeed/kernel/cache/cache_stats.h"
 #include "pagespeed/kernel/cache/compressed_cache.h"
 #include "pagespeed/kernel/cache/fallback_cache.h"
 #include "pagespeed/kernel/cache/file_cache.h"
+#include "pagespeed/kernel/cache/frequency_admission_policy.h"
 #include "pagespeed/kernel/cache/purge_context.h"
+#include "pagespeed/kernel/cache/segment_file_cache.h"
+#include "pagespeed/kernel/cache/tiered_metadata_cache.h"
 #include "pagespeed/kernel/cache/write_through_cache.h"
+#include "pagespeed/kernel/sharedmem/slab_shared_mem_cache.h"
 #include "pagespeed/kernel/thread/queued_worker_pool.h"
 #include "pagespeed/kernel/thread/slow_worker.h"
 
 namespace net_instaweb {
 
+namespace {
+
+const int kShmMetadataCacheSectors = 128;
+
+// The smallest limit on value size a shared memory metadata cache may have.
+// With 2K inlining thresholds, something like 3K is needed.
+const int kShmMetadataCacheMinSizeCap = 3 * 1024;
+
+// A metadata cache dictionary is trained on one in every
+// kDictionarySampleInterval values written, until there are
+// kDictionarySamples of them.  zlib needs more time to load larger
+// dictionaries, and 4KB captures most of what our values share.
+const int kDictionarySamples = 1000;
+const int kDictionarySampleInterval = 10;
+const int kDictionarySize = 4 * 1024;
+
+// Every process trains a dictionary, but only the first to finish saves it.
+// The others find it saved, or the lock held, and drop theirs.
+const int64 kDictionaryLockTimeoutMs = 10 * Timer::kMinuteMs;
+
+// Saves a trained metadata cache dictionary, to be used after the next
+// restart: switching dictionaries while running would make what the other
+// processes wrote unreadable.  Runs on the slow worker.
+class DictionaryWriter : public Callback1<const GoogleString&> {
+ public:
+  DictionaryWriter(const GoogleString& path, FileSystem* file_system,
+                   Timer* timer, MessageHandler* handler)
+      : path_(path),
+        lock_name_(StrCat(path, ".lock")),
+        file_system_(file_system),
+        timer_(timer),
+        handler_(handler) {}
+  virtual ~DictionaryWriter() {}
+
+  virtual void Run(const GoogleString& dictionary) {
+    if (!dictionary.empty() &&
+        file_system_->TryLockWithTimeout(lock_name_, kDictionaryLockTimeoutMs,
+                                         timer_, handler_).is_true()) {
+      if (!file_system_->Exists(path_.c_str(), handler_).is_true() &&
+          file_system_->WriteFileAtomic(path_, dictionary, handler_)) {
+        handler_->Message(
+            kInfo, "Saved a %d byte metadata cache dictionary to %s; it will "
+            "be used after the next restart.",
+            static_cast<int>(dictionary.size()), path_.c_str());
+      }
+      file_system_->Unlock(lock_name_, handler_);
+    }
+    delete this;
+  }
+
+ private:
+  GoogleString path_;
+  GoogleString lock_name_;
+  FileSystem* file_system_;
+  Timer* timer_;
+  MessageHandler* handler_;
+
+  DISALLOW_COPY_AND_ASSIGN(DictionaryWriter);
+};
+
+}  // namespace
+
 const char SystemCaches::kMemcachedAsync[] = "memcached_async";
 const char SystemCaches::kMemcachedBlocking[] = "memcached_blocking";
 const char SystemCaches::kRedisAsync[] = "redis_async";
@@ -71,7 +145,8 @@ SystemCaches::SystemCaches(
       is_root_process_(true),
       was_shut_down_(false),
       cache_hasher_(20),
-      default_shm_metadata_cache_creation_failed_(false) {
+      default_shm_metadata_cache_creation_failed_(false),
+      has_tiered_metadata_cache_(false) {
 }
 
 SystemCaches::~SystemCaches() {
@@ -91,6 +166,13 @@ void SystemCaches::ShutDown(MessageHandler* message_handler) {
   // to access FileCache and similar objects we're about to blow away.
   if (!is_root_process_) {
     slow_worker_->ShutDown();
+
+    // Now that nothing is compacting them, let file caches that keep state
+    // in memory write it out.
+    for (PathCacheMap::iterator p = path_cache_map_.begin(),
+             e = path_cache_map_.end(); p != e; ++p) {
+      p->second->file_cache()->ShutDown();
+    }
   }
 
   // Take down any threads serving external caches, then wait for shut down to
@@ -111,6 +193,9 @@ void SystemCaches::ShutDown(MessageHandler* message_handler) {
   if (redis_pool_) {
     redis_pool_->InitiateShutDown();
   }
+  if (fallback_pool_) {
+    fallback_pool_->InitiateShutDown();
+  }
   if (memcached_pool_) {
     memcached_pool_->WaitForShutDownComplete();
     memcached_pool_.reset(nullptr);
@@ -119,6 +204,10 @@ void SystemCaches::ShutDown(MessageHandler* message_handler) {
     redis_pool_->WaitForShutDownComplete();
     redis_pool_.reset(nullptr);
   }
+  if (fallback_pool_) {
+    fallback_pool_->WaitForShutDownComplete();
+    fallback_pool_.reset(nullptr);
+  }
 
   if (is_root_process_) {
     // Cleanup per-path shm resources.
@@ -133,6 +222,9 @@ void SystemCaches::ShutDown(MessageHandler* message_handler) {
       if (p->second->cache_backend != NULL && p->second->initialized) {
         MetadataShmCache::GlobalCleanup(shared_mem_runtime_, p->second->segment,
                                         message_handler);
+      } else if (p->second->slab_backend != NULL && p->second->initialized) {
+        SlabSharedMemCache::GlobalCleanup(
+            shared_mem_runtime_, p->second->segment, message_handler);
       }
     }
   }
@@ -157,18 +249,26 @@ SystemCachePath* SystemCaches::GetCache(SystemRewriteOptions* config) {
 
 SystemCaches::ExternalCacheInterfaces
 SystemCaches::ConstructExternalCacheInterfacesFromBlocking(
-    CacheInterface* backend,
-    QueuedWorkerPool* pool, int batcher_max_parallel_lookups,
+    CacheInterface* backend, QueuedWorkerPool* pool,
+    const CacheBatcher::Options& batcher_options,
     const char* async_stats_name, const char* blocking_stats_name) {
+  CacheInterface* async_backend = backend;
+  if (pool != NULL) {
+    async_backend = new AsyncCache(backend, pool);
+    factory_->TakeOwnership(async_backend);
+  }
+  return ConstructExternalCacheInterfaces(
+      async_backend, backend, batcher_options, async_stats_name,
+      blocking_stats_name);
+}
 
+SystemCaches::ExternalCacheInterfaces
+SystemCaches::ConstructExternalCacheInterfaces(
+    CacheInterface* async_backend, CacheInterface* blocking_backend,
+    const CacheBatcher::Options& batcher_options,
+    const char* async_stats_name, const char* blocking_stats_name) {
   ExternalCacheInterfaces result;
-
-  if (pool == NULL) {
-    result.async = backend;
-  } else {
-    result.async = new AsyncCache(backend, pool);
-    factory_->TakeOwnership(result.async);
-  }
+  result.async = async_backend;
 
   // Put the batcher above the stats so that the stats sees the MultiGets
   // and can show us the histogram of how they are sized.
@@ -178,13 +278,10 @@ SystemCaches::ConstructExternalCacheInterfacesFromBlocking(
                                 factory_->statistics());
   factory_->TakeOwnership(result.async);
 
-  CacheBatcher::Options options;
-  if (batcher_max_parallel_lookups != -1) {
-    options.max_parallel_lookups = batcher_max_parallel_lookups;
-  }
   CacheBatcher* batcher = new CacheBatcher(
-      options,
+      batcher_options,
       result.async,
+      factory_->scheduler(),
       factory_->thread_system()->NewMutex(),
       factory_->statistics());
   factory_->TakeOwnership(batcher);
@@ -192,15 +289,39 @@ SystemCaches::ConstructExternalCacheInterfacesFromBlocking(
 
   // Populate the blocking interface, giving it its own
   // statistics wrapper.
-  result.blocking = new CacheStats(blocking_stats_name, backend,
+  result.blocking = new CacheStats(blocking_stats_name, blocking_backend,
                                    factory_->timer(), factory_->statistics());
   factory_->TakeOwnership(result.blocking);
   return result;
 }
 
+CacheBatcher::Options SystemCaches::BatcherOptions(
+    const SystemRewriteOptions* config) {
+  CacheBatcher::Options options;
+  options.adaptive = config->cache_batcher_adaptive();
+  options.target_latency_us = config->cache_batcher_target_latency_us();
+  options.get_deadline_us = config->cache_batcher_get_deadline_us();
+  return options;
+}
+
 SystemCaches::ExternalCacheInterfaces SystemCaches::NewMemcached(
     SystemRewriteOptions* config) {
   const ExternalClusterSpec& servers_specs = config->memcached_servers();
+  if (config->memcached_async_client()) {
+    // AsyncMemCache drives all its connections from its own thread, so it
+    // needs no worker pool, and MemcachedThreads doesn't apply.
+    AsyncMemCache* mem_cache =
+        new AsyncMemCache(servers_specs, &cache_hasher_,
+                          factory_->thread_system(), factory_->statistics(),
+                          factory_->timer(), factory_->message_handler());
+    factory_->TakeOwnership(mem_cache);
+    mem_cache->set_timeout_us(config->memcached_timeout_us());
+    async_memcache_servers_.push_back(mem_cache);
+    return ConstructExternalCacheInterfaces(
+        mem_cache, mem_cache->blocking_cache(), BatcherOptions(config),
+        kMemcachedAsync, kMemcachedBlocking);
+  }
+
   AprMemCache* mem_cache =
       new AprMemCache(servers_specs, thread_limit_, &cache_hasher_,
                       factory_->statistics(), factory_->timer(),
@@ -226,14 +347,16 @@ SystemCaches::ExternalCacheInterfaces SystemCaches::NewMemcached(
           new QueuedWorkerPool(num_threads, "memcached",
                                factory_->thread_system()));
     }
+    CacheBatcher::Options batcher_options = BatcherOptions(config);
+    batcher_options.max_parallel_lookups = num_threads;
     return ConstructExternalCacheInterfacesFromBlocking(
-        mem_cache, memcached_pool_.get(), num_threads, kMemcachedAsync,
+        mem_cache, memcached_pool_.get(), batcher_options, kMemcachedAsync,
         kMemcachedBlocking);
   } else {
     return ConstructExternalCacheInterfacesFromBlocking(
         mem_cache,
         NULL,  // No worker pool.
-        -1,    // Do not change batcher's max_parallel_lookups.
+        BatcherOptions(config),
         kMemcachedAsync, kMemcachedBlocking);
   }
 }
@@ -241,6 +364,26 @@ SystemCaches::ExternalCacheInterfaces SystemCaches::NewMemcached(
 SystemCaches::ExternalCacheInterfaces SystemCaches::NewRedis(
     SystemRewriteOptions* config) {
   const ExternalServerSpec& server_spec = config->redis_server();
+  if (config->redis_async_client()) {
+    // AsyncRedisCache drives all its connections from its own thread, so it
+    // needs no worker pool, and batches go out as MGETs.
+    AsyncRedisCache* redis_server = new AsyncRedisCache(
+        server_spec.host, server_spec.port, factory_->thread_system(),
+        factory_->message_handler(), factory_->timer(),
+        config->redis_reconnection_delay_ms(), config->redis_timeout_us(),
+        factory_->statistics());
+    factory_->TakeOwnership(redis_server);
+    async_redis_servers_.push_back(redis_server);
+    if (config->redis_hot_key_ttl_ms() > 0) {
+      factory_->message_handler()->Message(
+          kWarning, "RedisHotKeyTtlMs is not supported with "
+          "RedisAsyncClient; hot keys will not be replicated");
+    }
+    return ConstructExternalCacheInterfaces(
+        redis_server, redis_server->blocking_cache(), BatcherOptions(config),
+        kRedisAsync, kRedisBlocking);
+  }
+
   RedisCache* redis_server = new RedisCache(
       server_spec.host, server_spec.port, factory_->thread_system(),
       factory_->message_handler(), factory_->timer(),
@@ -248,6 +391,11 @@ SystemCaches::ExternalCacheInterfaces SystemCaches::NewRedis(
       factory_->statistics());
   factory_->TakeOwnership(redis_server);
   redis_servers_.push_back(redis_server);
+  if (config->redis_hot_key_ttl_ms() > 0) {
+    HotKeyReplica::Options hot_key_options;
+    hot_key_options.ttl_ms = config->redis_hot_key_ttl_ms();
+    redis_server->EnableHotKeyReplica(hot_key_options);
+  }
   if (redis_pool_.get() == NULL) {
     // TODO(yeputons): consider using more than one thread and making the amount
     // configurable. For memcached using more than one thread was not boosting
@@ -261,8 +409,11 @@ SystemCaches::ExternalCacheInterfaces SystemCaches::NewRedis(
     redis_pool_.reset(
         new QueuedWorkerPool(1, "redis", factory_->thread_system()));
   }
+  CacheBatcher::Options batcher_options = BatcherOptions(config);
+  batcher_options.max_parallel_lookups = 1;
   return ConstructExternalCacheInterfacesFromBlocking(
-      redis_server, redis_pool_.get(), 1, kRedisAsync, kRedisBlocking);
+      redis_server, redis_pool_.get(), batcher_options, kRedisAsync,
+      kRedisBlocking);
 }
 
 SystemCaches::ExternalCacheInterfaces SystemCaches::NewExternalCache(
@@ -283,14 +434,25 @@ SystemCaches::ExternalCacheInterfaces SystemCaches::NewExternalCache(
     spec_signature =
         StrCat("r;", config->redis_server().ToString(), ";",
                IntegerToString(config->redis_reconnection_delay_ms()), ";",
-               IntegerToString(config->redis_timeout_us()));
+               IntegerToString(config->redis_timeout_us()), ";",
+               Integer64ToString(config->redis_hot_key_ttl_ms()),
+               config->redis_async_client() ? ";a" : "");
   } else if (use_memcached) {
     spec_signature = StrCat("m;", config->memcached_servers().ToString(), ";",
                             IntegerToString(config->memcached_threads()), ";",
-                            IntegerToString(config->memcached_timeout_us()));
+                            IntegerToString(config->memcached_timeout_us()),
+                            config->memcached_async_client() ? ";a" : "");
   } else {
     return ExternalCacheInterfaces();
   }
+  if (config->cache_batcher_adaptive() ||
+      (config->cache_batcher_get_deadline_us() != 0)) {
+    StrAppend(&spec_signature, ";b",
+              config->cache_batcher_adaptive() ? "a" : "", ",",
+              Integer64ToString(config->cache_batcher_target_latency_us()),
+              ",",
+              Integer64ToString(config->cache_batcher_get_deadline_us()));
+  }
 
   ExternalCachesMap::iterator iterator;
   bool inserted;
@@ -320,7 +482,20 @@ SystemCaches::ExternalCacheInterfaces SystemCaches::NewExternalCache(
 
     CacheInterface* file_cache = GetCache(config)->file_cache();
 
-    result.async = new FallbackCache(result.async, file_cache,
+    // AsyncMemCache reports lookups from its I/O thread, so a large value's
+    // file cache lookup, made from that callback, would hold up every other
+    // memcached operation.  Have a worker do it instead.
+    CacheInterface* async_file_cache = file_cache;
+    if (config->memcached_async_client()) {
+      if (fallback_pool_.get() == NULL) {
+        fallback_pool_.reset(new QueuedWorkerPool(
+            1, "memcached_fallback", factory_->thread_system()));
+      }
+      async_file_cache = new AsyncCache(file_cache, fallback_pool_.get());
+      factory_->TakeOwnership(async_file_cache);
+    }
+
+    result.async = new FallbackCache(result.async, async_file_cache,
                                      AprMemCache::kValueSizeThreshold,
                                      factory_->message_handler());
     factory_->TakeOwnership(result.async);
@@ -342,15 +517,13 @@ bool SystemCaches::CreateShmMetadataCache(
   if (result.second) {
     int entries, blocks;
     int64 size_cap;
-    const int kSectors = 128;
     MetadataShmCache::ComputeDimensions(
         size_kb, 2 /* block/entry ratio, based empirically off load tests */,
-        kSectors, &entries, &blocks, &size_cap);
+        kShmMetadataCacheSectors, &entries, &blocks, &size_cap);
 
-    // Make sure the size cap is not unusably low. In particular, with 2K
-    // inlining thresholds, something like 3K is needed. (As of time of writing,
-    // that required about 4.3MiB).
-    if (size_cap < 3 * 1024) {
+    // Make sure the size cap is not unusably low. (As of time of writing,
+    // kShmMetadataCacheMinSizeCap required about 4.3MiB).
+    if (size_cap < kShmMetadataCacheMinSizeCap) {
       metadata_shm_caches_.erase(result.first);
       *error_msg = "Shared memory cache unusably small.";
       return false;
@@ -358,13 +531,14 @@ bool SystemCaches::CreateShmMetadataCache(
       cache_info = new MetadataShmCacheInfo;
       factory_->TakeOwnership(cache_info);
       cache_info->segment = StrCat(name, "/metadata_cache");
+      cache_info->size_kb = size_kb;
       cache_info->cache_backend =
           new SharedMemCache<64>(
               shared_mem_runtime_,
               cache_info->segment,
               factory_->timer(),
               factory_->hasher(),
-              kSectors,
+              kShmMetadataCacheSectors,
               entries,  /* entries per sector */
               blocks /* blocks per sector*/,
               factory_->message_handler());
@@ -551,7 +725,9 @@ void SystemCaches::SetupCaches(ServerContext* server_context,
       FallbackCache* metadata_fallback =
           new FallbackCache(
               shm_metadata_cache, file_cache,
-              shm_metadata_cache_info->cache_backend->MaxValueSize(),
+              (shm_metadata_cache_info->slab_backend != NULL)
+                  ? shm_metadata_cache_info->slab_backend->MaxValueSize()
+                  : shm_metadata_cache_info->cache_backend->MaxValueSize(),
               factory_->message_handler());
       // SharedMemCache uses hash-produced fixed size keys internally, so its
       // value size limit isn't affected by key length changes.
@@ -569,9 +745,48 @@ void SystemCaches::SetupCaches(ServerContext* server_context,
     metadata_l2 = http_l2;  // external or file cache.
   }
 
+  // With codecs configured, the layers are compressed separately, so memory
+  // can be left uncompressed, or use a codec that decompresses faster, while
+  // disk or network use one that compresses better.
+  bool compress_layers = config->compress_metadata_cache() &&
+      !(config->metadata_cache_l1_codec().empty() &&
+        config->metadata_cache_l2_codec().empty());
+  if (compress_layers) {
+    GoogleString dictionary;
+    CacheDictionaryBuilder* builder = NULL;
+    if (!LoadMetadataCacheDictionary(config, &dictionary)) {
+      builder = NewMetadataCacheDictionaryBuilder(config);
+    }
+    if (metadata_l1 != NULL) {
+      metadata_l1 = NewCompressedCache(
+          metadata_l1, config->metadata_cache_l1_codec(), dictionary,
+          NULL /* builder */, server_context);
+    }
+    if (property_store_cache != NULL) {
+      property_store_cache = NewCompressedCache(
+          property_store_cache, config->metadata_cache_l2_codec(), dictionary,
+          NULL /* builder */, server_context);
+    }
+    metadata_l2 = NewCompressedCache(
+        metadata_l2, config->metadata_cache_l2_codec(), dictionary, builder,
+        server_context);
+  }
+
   CacheInterface* metadata_cache;
 
-  if (metadata_l1 != NULL) {
+  if ((metadata_l1 != NULL) && config->tiered_metadata_cache()) {
+    TieredMetadataCache* tiered_cache = new TieredMetadataCache(
+        metadata_l1, metadata_l2, factory_->timer(),
+        factory_->thread_system(), stats);
+    server_context->DeleteCacheOnDestruction(tiered_cache);
+    tiered_cache->set_l1_size_limit(l1_size_limit);
+    tiered_cache->set_negative_ttl_ms(config->metadata_cache_negative_ttl_ms());
+    tiered_cache->set_promotion_threshold(
+        config->metadata_cache_promotion_threshold());
+    server_context->set_tiered_metadata_cache(tiered_cache);
+    has_tiered_metadata_cache_ = true;
+    metadata_cache = tiered_cache;
+  } else if (metadata_l1 != NULL) {
     WriteThroughCache* write_through_cache = new WriteThroughCache(
         metadata_l1, metadata_l2);
     server_context->DeleteCacheOnDestruction(write_through_cache);
@@ -588,7 +803,7 @@ void SystemCaches::SetupCaches(ServerContext* server_context,
   if (property_store_cache == NULL) {
     property_store_cache = metadata_l2;
   }
-  if (config->compress_metadata_cache()) {
+  if (config->compress_metadata_cache() && !compress_layers) {
     metadata_cache = new CompressedCache(metadata_cache, stats);
     server_context->DeleteCacheOnDestruction(metadata_cache);
     property_store_cache = new CompressedCache(property_store_cache, stats);
@@ -604,11 +819,68 @@ void SystemCaches::SetupCaches(ServerContext* server_context,
   system_server_context->SetCachePath(caches_for_path);
 }
 
+bool SystemCaches::LoadMetadataCacheDictionary(SystemRewriteOptions* config,
+                                               GoogleString* dictionary) {
+  const GoogleString& path = config->metadata_cache_dictionary();
+  if (path.empty()) {
+    return true;
+  }
+  FileSystem* file_system = factory_->file_system();
+  MessageHandler* handler = factory_->message_handler();
+  if (!file_system->Exists(path.c_str(), handler).is_true()) {
+    return false;
+  }
+  if (!file_system->ReadFile(path.c_str(), dictionary, handler)) {
+    handler->Message(kWarning, "Could not read metadata cache dictionary %s",
+                     path.c_str());
+    dictionary->clear();
+  }
+  return true;
+}
+
+CacheDictionaryBuilder* SystemCaches::NewMetadataCacheDictionaryBuilder(
+    SystemRewriteOptions* config) {
+  // Training runs on the slow worker, which the root process doesn't have.
+  // Only the first server context using a dictionary file trains one.
+  const GoogleString& path = config->metadata_cache_dictionary();
+  if ((slow_worker_.get() == NULL) ||
+      !dictionaries_in_training_.insert(path).second) {
+    return NULL;
+  }
+  return new CacheDictionaryBuilder(
+      kDictionarySamples, kDictionarySampleInterval, kDictionarySize,
+      slow_worker_.get(), factory_->thread_system()->NewMutex(),
+      new DictionaryWriter(path, factory_->file_system(), factory_->timer(),
+                           factory_->message_handler()));
+}
+
+CacheInterface* SystemCaches::NewCompressedCache(
+    CacheInterface* cache, const GoogleString& codec_name,
+    StringPiece dictionary, CacheDictionaryBuilder* builder,
+    ServerContext* server_context) {
+  scoped_ptr<CacheDictionaryBuilder> builder_deleter(builder);
+  if (codec_name.empty()) {
+    return cache;
+  }
+  CacheCodec* codec = CacheCodec::Create(codec_name, dictionary);
+  if (codec == NULL) {
+    factory_->message_handler()->Message(
+        kWarning, "Unknown metadata cache codec %s; not compressing %s",
+        codec_name.c_str(), cache->Name().c_str());
+    return cache;
+  }
+  CompressedCache* compressed_cache =
+      new CompressedCache(cache, codec, server_context->statistics());
+  compressed_cache->set_dictionary_builder(builder_deleter.release());
+  server_context->DeleteCacheOnDestruction(compressed_cache);
+  return compressed_cache;
+}
+
 void SystemCaches::RegisterConfig(SystemRewriteOptions* config) {
   // Should fill in path_cache_map_.
   GetCache(config);
   // Should fill in external_caches_map_, memcache_servers_, and
-  // redis_servers_.
+  // redis_servers_ or async_redis_servers_.
   NewExternalCache(config);
 
   // GetShmMetadataCacheOrDefault will create a default cache if one is needed
@@ -622,6 +894,10 @@ void SystemCaches::RootInit() {
   for (MetadataShmCacheMap::iterator p = metadata_shm_caches_.begin(),
            e = metadata_shm_caches_.end(); p != e; ++p) {
     MetadataShmCacheInfo* cache_info = p->second;
+    if (global_options->shm_metadata_cache_slabs() &&
+        RootInitSlabShmCache(global_options, p->first, cache_info)) {
+      continue;
+    }
 
     // If we're using the default shared memory cache and different vhosts have
     // set the FileCachePath differently, then where should we store the
@@ -651,6 +927,24 @@ void SystemCaches::RootInit() {
           global_options->shm_metadata_cache_checkpoint_interval_sec());
     }
 
+    if (global_options->shm_metadata_cache_clock_replacement()) {
+      cache_info->cache_backend->set_touch_mode(MetadataShmCache::kTouchClock);
+    }
+
+    if (global_options->shm_metadata_cache_raw_snapshots()) {
+      cache_info->cache_backend->set_snapshot_format(
+          MetadataShmCache::kSnapshotRawImage);
+    }
+
+    if (global_options->cache_admission_filter()) {
+      // Each process gets its own copy of the policy when it forks, so
+      // admission decisions are based on the lookups that process has seen.
+      cache_info->cache_backend->set_admission_policy(
+          new FrequencyAdmissionPolicy(
+              cache_info->cache_backend->num_entries(),
+              factory_->thread_system()->NewMutex()));
+    }
+
     if (cache_info->cache_backend->Initialize()) {
       cache_info->initialized = true;
       cache_info->cache_to_use =
@@ -673,6 +967,60 @@ void SystemCaches::RootInit() {
   }
 }
 
+bool SystemCaches::RootInitSlabShmCache(
+    const SystemRewriteOptions* global_options, const GoogleString& name,
+    MetadataShmCacheInfo* cache_info) {
+  scoped_ptr<SlabSharedMemCache> new_slab_cache(new SlabSharedMemCache(
+      shared_mem_runtime_, cache_info->segment, factory_->timer(),
+      factory_->hasher(), kShmMetadataCacheSectors, cache_info->size_kb,
+      factory_->message_handler()));
+  GoogleString error_msg;
+  if (!new_slab_cache->CheckDimensions(kShmMetadataCacheMinSizeCap,
+                                       &error_msg)) {
+    factory_->message_handler()->Message(
+        kWarning, "Shared memory cache %s is too small for "
+        "ShmMetadataCacheSlabs (%s); using a single block size.",
+        name.c_str(), error_msg.c_str());
+    return false;
+  }
+
+  // The single-block-size cache was only configured, never initialized, so
+  // it can simply be dropped in favor of the slab cache.
+  cache_info->cache_backend = NULL;
+  SlabSharedMemCache* slab_cache = new_slab_cache.release();
+  factory_->TakeOwnership(slab_cache);
+
+  // See RootInit for how the snapshot file cache is chosen.
+  for (PathCacheMap::iterator q = path_cache_map_.begin(),
+           f = path_cache_map_.end(); q != f; ++q) {
+    slab_cache->RegisterSnapshotFileCache(
+        q->second->file_cache_backend(),
+        global_options->shm_metadata_cache_checkpoint_interval_sec());
+  }
+  slab_cache->set_clock_replacement(
+      global_options->shm_metadata_cache_clock_replacement());
+  slab_cache->set_raw_snapshots(
+      global_options->shm_metadata_cache_raw_snapshots());
+  if (global_options->cache_admission_filter()) {
+    slab_cache->EnableAdmissionFilter(factory_->thread_system());
+  }
+
+  if (slab_cache->Initialize()) {
+    cache_info->initialized = true;
+    cache_info->slab_backend = slab_cache;
+    cache_info->cache_to_use =
+        new CacheStats(kShmCache, slab_cache, factory_->timer(),
+                       factory_->statistics());
+    factory_->TakeOwnership(cache_info->cache_to_use);
+  } else {
+    factory_->message_handler()->Message(
+        kWarning, "Unable to initialize shared memory cache: %s.",
+        name.c_str());
+    cache_info->cache_to_use = NULL;
+  }
+  return true;
+}
+
 void SystemCaches::ChildInit() {
   is_root_process_ = false;
 
@@ -681,6 +1029,14 @@ void SystemCaches::ChildInit() {
   for (MetadataShmCacheMap::iterator p = metadata_shm_caches_.begin(),
            e = metadata_shm_caches_.end(); p != e; ++p) {
     MetadataShmCacheInfo* cache_info = p->second;
+    if ((cache_info->slab_backend != NULL) &&
+        !cache_info->slab_backend->Attach()) {
+      factory_->message_handler()->Message(
+          kWarning, "Unable to attach to shared memory cache: %s.",
+          p->first.c_str());
+      cache_info->slab_backend = NULL;
+      cache_info->cache_to_use = NULL;
+    }
     if ((cache_info->cache_backend != NULL) &&
         !cache_info->cache_backend->Attach()) {
       factory_->message_handler()->Message(
@@ -711,9 +1067,25 @@ void SystemCaches::ChildInit() {
     }
   }
 
+  for (AsyncMemCache* mem_cache : async_memcache_servers_) {
+    if (!mem_cache->StartUp()) {
+      factory_->message_handler()->Message(
+          kError, "Could not start memcached client for %s",
+          mem_cache->cluster_spec().ToString().c_str());
+    }
+  }
+
   for (RedisCache* redis_cache : redis_servers_) {
     redis_cache->StartUp();
   }
+
+  for (AsyncRedisCache* redis_cache : async_redis_servers_) {
+    if (!redis_cache->StartUp()) {
+      factory_->message_handler()->Message(
+          kError, "Could not start Redis client for %s",
+          redis_cache->ServerDescription().c_str());
+    }
+  }
 }
 
 void SystemCaches::StopCacheActivity() {
@@ -738,7 +1110,10 @@ void SystemCaches::StopCacheActivity() {
 
 void SystemCaches::InitStats(Statistics* statistics) {
   AprMemCache::InitStats(statistics);
+  AsyncMemCache::InitStats(statistics);
+  AsyncRedisCache::InitStats(statistics);
   FileCache::InitStats(statistics);
+  SegmentFileCache::InitStats(statistics);
   CacheStats::InitStats(SystemCachePath::kFileCache, statistics);
   CacheStats::InitStats(SystemCachePath::kLruCache, statistics);
   CacheStats::InitStats(kShmCache, statistics);
@@ -749,6 +1124,22 @@ void SystemCaches::InitStats(Statistics* statistics) {
   CompressedCache::InitStats(statistics);
   PurgeContext::InitStats(statistics);
   RedisCache::InitStats(statistics);
+  TieredMetadataCache::InitStats(statistics);
+}
+
+void SystemCaches::PrintHitRatios(Statistics* statistics,
+                                  GoogleString* out) {
+  const char* prefixes[] = {
+    SystemCachePath::kFileCache, SystemCachePath::kLruCache, kShmCache,
+    kMemcachedAsync, kMemcachedBlocking, kRedisAsync, kRedisBlocking
+  };
+  for (int i = 0, n = arraysize(prefixes); i < n; ++i) {
+    int64 percent = CacheStats::HitRatioPercent(prefixes[i], statistics);
+    if (percent >= 0) {
+      StrAppend(out, prefixes[i], "_hit_ratio_percent: ",
+                Integer64ToString(percent), "\n");
+    }
+  }
 }
 
 void SystemCaches::PrintCacheStats(StatFlags flags, GoogleString* out) {
@@ -758,16 +1149,23 @@ void SystemCaches::PrintCacheStats(StatFlags flags, GoogleString* out) {
     for (MetadataShmCacheMap::iterator p = metadata_shm_caches_.begin(),
              e = metadata_shm_caches_.end(); p != e; ++p) {
       MetadataShmCacheInfo* cache_info = p->second;
-      if (cache_info->cache_backend != NULL) {
+      if (cache_info->cache_backend != NULL ||
+          cache_info->slab_backend != NULL) {
         StrAppend(out, "\nShared memory metadata cache '", p->first,
                   "' statistics:\n");
         StringWriter writer(out);
-        writer.Write(cache_info->cache_backend->DumpStats(),
+        writer.Write((cache_info->slab_backend != NULL)
+                         ? cache_info->slab_backend->DumpStats()
+                         : cache_info->cache_backend->DumpStats(),
                      factory_->message_handler());
       }
     }
   }
 
+  if (has_tiered_metadata_cache_) {
+    TieredMetadataCache::PrintStats(factory_->statistics(), out);
+  }
+
   if (flags & kIncludeMemcached) {
     for (int i = 0, n = memcache_servers_.size(); i < n; ++i) {
       AprMemCache* mem_cache = memcache_servers_[i];
@@ -776,6 +1174,10 @@ void SystemCaches::PrintCacheStats(StatFlags flags, GoogleString* out) {
                   mem_cache->cluster_spec().ToString());
       }
     }
+    for (AsyncMemCache* mem_cache : async_memcache_servers_) {
+      // Servers that are backed off are reported as such in the status.
+      mem_cache->GetStatus(out);
+    }
   }
 
   if (flags & kIncludeRedis) {
@@ -784,6 +1186,9 @@ void SystemCaches::PrintCacheStats(StatFlags flags, GoogleString* out) {
       // and others don't, so have GetStatus handle error reporting.
       redis->GetStatus(out);
     }
+    for (AsyncRedisCache* redis : async_redis_servers_) {
+      redis->GetStatus(out);
+    }
   }
 }
 
@@ -19,6 +19,7 @@
 #define PAGESPEED_SYSTEM_SYSTEM_CACHES_H_
 
 #include <map>
+#include <set>
 #include <vector>
 
 #include "pagespeed/kernel/base/basictypes.h"
@@ -28,6 +29,7 @@
 #include "pagespeed/kernel/base/scoped_ptr.h"
 #include "pagespeed/kernel/base/string.h"
 #include "pagespeed/kernel/base/string_util.h"
+#include "pagespeed/kernel/cache/cache_batcher.h"
 #include "pagespeed/kernel/sharedmem/shared_mem_cache.h"
 #include "pagespeed/system/redis_cache.h"
 #include "pagespeed/system/system_rewrite_options.h"
@@ -36,10 +38,14 @@ namespace net_instaweb {
 
 class AbstractSharedMem;
 class AprMemCache;
+class AsyncMemCache;
+class AsyncRedisCache;
+class CacheDictionaryBuilder;
 class NamedLockManager;
 class QueuedWorkerPool;
 class RewriteDriverFactory;
 class ServerContext;
+class SlabSharedMemCache;
 class SlowWorker;
 class Statistics;
 class SystemCachePath;
@@ -78,6 +84,10 @@ class SystemCaches {
   // Registers all statistics the cache backends may use.
   static void InitStats(Statistics* statistics);
 
+  // Appends a <prefix>_hit_ratio_percent line to *out for each of the
+  // CacheStats prefixes above that has had lookups.
+  static void PrintHitRatios(Statistics* statistics, GoogleString* out);
+
   // thread_limit is an estimate of number of threads that may access the
   // cache at the same time. Does not take ownership of shm_runtime.
   SystemCaches(RewriteDriverFactory* factory,
@@ -143,12 +153,16 @@ class SystemCaches {
   typedef SharedMemCache<64> MetadataShmCache;
   struct MetadataShmCacheInfo {
     MetadataShmCacheInfo()
-        : cache_to_use(NULL), cache_backend(NULL), initialized(false) {}
+        : cache_to_use(NULL), cache_backend(NULL), slab_backend(NULL),
+          size_kb(0), initialized(false) {}
 
     // Note that the fields may be NULL if e.g. initialization failed.
     CacheInterface* cache_to_use;  // may be CacheStats or such.
     GoogleString segment;
     MetadataShmCache* cache_backend;
+    // With ShmMetadataCacheSlabs, RootInit replaces cache_backend with this.
+    SlabSharedMemCache* slab_backend;
+    int64 size_kb;
     bool initialized;  // This is needed since in some scenarios we may
                        // not end up as far as calling ->Initialize() before
                        // we get shutdown.
@@ -166,16 +180,26 @@ class SystemCaches {
   // If pool is NULL, this wrapping is omitted, effictively yielding a blocking
   // cache instead of async (this is used for compatibility with
   // MemcachedThreads 0 config option). Async version is then wrapped in
-  // CacheBatcher. The value of batcher_max_parallel_lookups will be used to
-  // override the batcher's max_parallel_lookups. If you don't want to override
-  // it, pass in -1.
+  // CacheBatcher, configured with batcher_options.
   //
   // Each cache is also wrapped in CacheStatistics with given name. All newly
   // created wrappers are owned by SystemCaches.
   ExternalCacheInterfaces ConstructExternalCacheInterfacesFromBlocking(
       CacheInterface* backend, QueuedWorkerPool* pool,
-      int batcher_max_parallel_lookups, const char* async_stats_name,
-      const char* blocking_stats_name);
+      const CacheBatcher::Options& batcher_options,
+      const char* async_stats_name, const char* blocking_stats_name);
+
+  // As above, but for a backend that provides its own non-blocking and
+  // blocking interfaces, such as AsyncMemCache.
+  ExternalCacheInterfaces ConstructExternalCacheInterfaces(
+      CacheInterface* async_backend, CacheInterface* blocking_backend,
+      const CacheBatcher::Options& batcher_options,
+      const char* async_stats_name, const char* blocking_stats_name);
+
+  // Returns the CacheBatcher options set by config, which apply to the
+  // batchers of all the external caches.
+  static CacheBatcher::Options BatcherOptions(
+      const SystemRewriteOptions* config);
 
   // Constructs external cache interfaces for a configuration. Both blocking
   // and (potentially) non-blocking interfaces are constructed, and given
@@ -203,6 +227,34 @@ class SystemCaches {
   MetadataShmCacheInfo* GetShmMetadataCacheOrDefault(
       SystemRewriteOptions* config);
 
+  // RootInit for a shared memory metadata cache with ShmMetadataCacheSlabs
+  // enabled.  Returns false, leaving the cache to be set up with a single
+  // block size, if it's too small to split into classes.
+  bool RootInitSlabShmCache(const SystemRewriteOptions* global_options,
+                            const GoogleString& name,
+                            MetadataShmCacheInfo* cache_info);
+
+  // Reads the MetadataCacheDictionary file into *dictionary.  Returns false
+  // if a dictionary should be trained and saved there instead.
+  bool LoadMetadataCacheDictionary(SystemRewriteOptions* config,
+                                   GoogleString* dictionary);
+
+  // Returns a CacheDictionaryBuilder that saves the dictionary it trains to
+  // the MetadataCacheDictionary file, or NULL if this process is already
+  // training one for that file or can't train one.
+  CacheDictionaryBuilder* NewMetadataCacheDictionaryBuilder(
+      SystemRewriteOptions* config);
+
+  // Wraps cache in a CompressedCache using the named codec, which is owned
+  // by server_context.  Returns cache itself if codec_name is empty or
+  // unknown.  If builder is not NULL, the CompressedCache takes ownership of
+  // it and feeds it the values written.
+  CacheInterface* NewCompressedCache(CacheInterface* cache,
+                                     const GoogleString& codec_name,
+                                     StringPiece dictionary,
+                                     CacheDictionaryBuilder* builder,
+                                     ServerContext* server_context);
+
   // Establishes common cohorts for the property cache.
   void SetupPcacheCohorts(ServerContext* server_context,
                           bool enable_property_cache);
@@ -227,6 +279,9 @@ class SystemCaches {
   typedef std::map<GoogleString, SystemCachePath*> PathCacheMap;
   PathCacheMap path_cache_map_;
 
+  // The MetadataCacheDictionary files we have made a builder for.
+  std::set<GoogleString> dictionaries_in_training_;
+
   // The QueuedWorkerPool for async cache-gets is shared among all memcached
   // connections. We have similar pool for Redis.
   // TODO(yeputons): consider reducing to a single pool. Potential problem: if
@@ -236,13 +291,19 @@ class SystemCaches {
   scoped_ptr<QueuedWorkerPool> memcached_pool_;
   scoped_ptr<QueuedWorkerPool> redis_pool_;
 
+  // Runs the file cache lookups of the FallbackCaches wrapped around
+  // AsyncMemCache, which mustn't block its I/O thread.
+  scoped_ptr<QueuedWorkerPool> fallback_pool_;
+
   // Explicit lists of AprMemCache/RedisCache instances are stored individually,
   // as they require extra treatment during startup and shutdown.
   // TODO(yeputons): consider reducing to a single vector when these classes
   // have common base class. Potential problem: users may want to enable
   // statistics for only memcached or only Redis (see kIncludeMemcached flag).
   std::vector<AprMemCache*> memcache_servers_;
+  std::vector<AsyncMemCache*> async_memcache_servers_;
   std::vector<RedisCache*> redis_servers_;
+  std::vector<AsyncRedisCache*> async_redis_servers_;
 
   // As each external cache object typically holds a TCP connection, we do not
   // want to allocate one per vhost (there can be tens of thousands of vhosts).
@@ -265,6 +326,10 @@ class SystemCaches {
 
   bool default_shm_metadata_cache_creation_failed_;
 
+  // Whether any server context was set up with a TieredMetadataCache, so
+  // its statistics are worth printing.
+  bool has_tiered_metadata_cache_;
+
   DISALLOW_COPY_AND_ASSIGN(SystemCaches);
 };
 
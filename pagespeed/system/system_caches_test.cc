@@ -40,6 +40,8 @@
 #include "net/instaweb/rewriter/public/test_rewrite_driver_factory.h"
 #include "pagespeed/system/admin_site.h"
 #include "pagespeed/system/apr_mem_cache.h"
+#include "pagespeed/system/async_mem_cache.h"
+#include "pagespeed/system/async_redis_cache.h"
 #include "pagespeed/system/system_cache_path.h"
 #include "pagespeed/system/system_rewrite_options.h"
 #include "pagespeed/system/system_server_context.h"
@@ -65,13 +67,16 @@
 #include "pagespeed/kernel/base/timer.h"
 #include "pagespeed/kernel/cache/async_cache.h"
 #include "pagespeed/kernel/cache/cache_batcher.h"
+#include "pagespeed/kernel/cache/cache_codec.h"
 #include "pagespeed/kernel/cache/cache_spammer.h"
 #include "pagespeed/kernel/cache/cache_stats.h"
 #include "pagespeed/kernel/cache/compressed_cache.h"
 #include "pagespeed/kernel/cache/fallback_cache.h"
 #include "pagespeed/kernel/cache/file_cache.h"
 #include "pagespeed/kernel/cache/lru_cache.h"
+#include "pagespeed/kernel/cache/sharded_lru_cache.h"
 #include "pagespeed/kernel/cache/threadsafe_cache.h"
+#include "pagespeed/kernel/cache/tiered_metadata_cache.h"
 #include "pagespeed/kernel/cache/write_through_cache.h"
 #include "pagespeed/kernel/http/content_type.h"
 #include "pagespeed/kernel/http/request_headers.h"
@@ -398,6 +403,91 @@ TEST_F(SystemCachesTest, BasicFileAndLruCache) {
   EXPECT_TRUE(server_context->filesystem_metadata_cache() == NULL);
 }
 
+TEST_F(SystemCachesTest, FileAndLruCacheTiered) {
+  options_->set_file_cache_path(kCachePath);
+  options_->set_use_shared_mem_locking(false);
+  options_->set_lru_cache_kb_per_process(100);
+  options_->set_default_shared_memory_cache_kb(0);
+  options_->set_tiered_metadata_cache(true);
+  PrepareWithConfig(options_.get());
+
+  // Only the metadata cache is tiered.
+  scoped_ptr<ServerContext> server_context(
+      SetupServerContext(options_.release()));
+  EXPECT_STREQ(
+      Compressed(TieredMetadataCache::FormatName(
+          Stats("lru_cache", ThreadsafeLRU()), FileCacheWithStats())),
+      server_context->metadata_cache()->Name());
+  ASSERT_TRUE(server_context->tiered_metadata_cache() != NULL);
+  EXPECT_EQ(TieredMetadataCache::kDefaultNegativeTtlMs,
+            server_context->tiered_metadata_cache()->negative_ttl_ms());
+  EXPECT_STREQ(
+      HttpCache(
+          WriteThrough(
+              Stats("lru_cache", ThreadsafeLRU()),
+              FileCacheWithStats())),
+      server_context->http_cache()->Name());
+
+  GoogleString stats;
+  system_caches_->PrintCacheStats(SystemCaches::kDefaultStatFlags, &stats);
+  EXPECT_NE(GoogleString::npos,
+            stats.find("Tiered metadata cache statistics:"));
+}
+
+TEST_F(SystemCachesTest, FileAndLruCacheWithCodecs) {
+  options_->set_file_cache_path(kCachePath);
+  options_->set_use_shared_mem_locking(false);
+  options_->set_lru_cache_kb_per_process(100);
+  options_->set_default_shared_memory_cache_kb(0);
+  options_->set_metadata_cache_l1_codec(CacheCodec::kBrotli);
+  options_->set_metadata_cache_l2_codec(CacheCodec::kDeflate);
+  PrepareWithConfig(options_.get());
+
+  // Each layer is compressed with its own codec.
+  scoped_ptr<ServerContext> server_context(
+      SetupServerContext(options_.release()));
+  EXPECT_STREQ(
+      WriteThrough(
+          CompressedCache::FormatName(CacheCodec::kBrotli,
+                                      Stats("lru_cache", ThreadsafeLRU())),
+          CompressedCache::FormatName(CacheCodec::kDeflate,
+                                      FileCacheWithStats())),
+      server_context->metadata_cache()->Name());
+  EXPECT_STREQ(
+      Pcache(CompressedCache::FormatName(CacheCodec::kDeflate,
+                                         FileCacheWithStats())),
+      server_context->page_property_cache()->property_store()->Name());
+  EXPECT_STREQ(
+      HttpCache(
+          WriteThrough(
+              Stats("lru_cache", ThreadsafeLRU()),
+              FileCacheWithStats())),
+      server_context->http_cache()->Name());
+}
+
+TEST_F(SystemCachesTest, BasicFileAndShardedLruCache) {
+  options_->set_file_cache_path(kCachePath);
+  options_->set_use_shared_mem_locking(false);
+  options_->set_lru_cache_kb_per_process(100);
+  options_->set_lru_cache_shards(8);
+  options_->set_default_shared_memory_cache_kb(0);
+  PrepareWithConfig(options_.get());
+
+  scoped_ptr<ServerContext> server_context(
+      SetupServerContext(options_.release()));
+  EXPECT_STREQ(
+      Compressed(WriteThrough(Stats("lru_cache",
+                                    ShardedLRUCache::FormatName(8)),
+                              FileCacheWithStats())),
+      server_context->metadata_cache()->Name());
+  EXPECT_STREQ(
+      HttpCache(
+          WriteThrough(
+              Stats("lru_cache", ShardedLRUCache::FormatName(8)),
+              FileCacheWithStats())),
+      server_context->http_cache()->Name());
+}
+
 TEST_F(SystemCachesTest, BasicFileOnlyCache) {
   options_->set_file_cache_path(kCachePath);
   options_->set_use_shared_mem_locking(false);
@@ -797,6 +887,40 @@ TEST_F(SystemCachesMemCacheTest, BasicMemCachedAndNoLru_2_Threads) {
   TestBasicMemCacheAndNoLru(2, 1);  // Clamp to 1.
 }
 
+TEST_F(SystemCachesMemCacheTest, AsyncClient) {
+  if (ServerSpec().empty()) {
+    return;
+  }
+
+  options_->set_file_cache_path(kCachePath);
+  options_->set_use_shared_mem_locking(false);
+  options_->set_lru_cache_kb_per_process(0);
+  options_->set_memcached_servers(ServerSpec());
+  options_->set_memcached_async_client(true);
+  options_->set_default_shared_memory_cache_kb(0);
+  PrepareWithConfig(options_.get());
+
+  scoped_ptr<ServerContext> server_context(
+      SetupServerContext(options_.release()));
+
+  // No AsyncCache or worker pool is needed, and the blocking interface waits
+  // for the same client.  Large values are looked up in the file cache from
+  // a worker, rather than from the client's I/O thread.
+  GoogleString mem_cache = Batcher(
+      Stats(SystemCaches::kMemcachedAsync, AsyncMemCache::FormatName()),
+      1, 1000);
+  EXPECT_STREQ(
+      HttpCache(Fallback(mem_cache, AsyncCache::FormatName(
+          Stats("file_cache", FileCacheName())))),
+      server_context->http_cache()->Name());
+  EXPECT_TRUE(server_context->filesystem_metadata_cache()->IsBlocking());
+  EXPECT_STREQ(
+      Fallback(Stats(SystemCaches::kMemcachedBlocking,
+                     AsyncMemCache::FormatName()),
+               FileCacheWithStats()),
+      server_context->filesystem_metadata_cache()->Name());
+}
+
 class SystemCachesRedisCacheTest : public SystemCachesExternalCacheTestBase {
  protected:
   // TODO(yeputons): share this code with SystemCachesMemCacheTest or move it to
@@ -845,6 +969,35 @@ class SystemCachesRedisCacheTest : public SystemCachesExternalCacheTestBase {
 
 ADD_EXTERNAL_CACHE_TESTS(SystemCachesRedisCacheTest)
 
+TEST_F(SystemCachesRedisCacheTest, AsyncClient) {
+  if (ServerSpec().empty()) {
+    return;
+  }
+
+  options_->set_file_cache_path(kCachePath);
+  options_->set_use_shared_mem_locking(false);
+  options_->set_lru_cache_kb_per_process(0);
+  options_->set_redis_server(ServerSpec());
+  options_->set_redis_async_client(true);
+  options_->set_default_shared_memory_cache_kb(0);
+  PrepareWithConfig(options_.get());
+
+  scoped_ptr<ServerContext> server_context(
+      SetupServerContext(options_.release()));
+
+  // As with memcached, no AsyncCache or worker pool is needed, and the
+  // blocking interface waits for the same client.
+  EXPECT_STREQ(
+      HttpCache(Batcher(
+          Stats(SystemCaches::kRedisAsync, AsyncRedisCache::FormatName()),
+          1, 1000)),
+      server_context->http_cache()->Name());
+  EXPECT_TRUE(server_context->filesystem_metadata_cache()->IsBlocking());
+  EXPECT_STREQ(
+      Stats(SystemCaches::kRedisBlocking, AsyncRedisCache::FormatName()),
+      server_context->filesystem_metadata_cache()->Name());
+}
+
 TEST_F(SystemCachesTest, BasicFileLockManager) {
   options_->set_file_cache_path(kCachePath);
   options_->set_use_shared_mem_locking(false);
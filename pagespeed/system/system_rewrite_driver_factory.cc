@@ -27,6 +27,7 @@
 
 #include "apr_general.h"
 #include "base/logging.h"
+#include "net/instaweb/http/public/coalescing_url_async_fetcher.h"
 #include "net/instaweb/http/public/http_dump_url_async_writer.h"
 #include "net/instaweb/http/public/http_dump_url_fetcher.h"
 #include "net/instaweb/http/public/rate_controller.h"
@@ -38,8 +39,14 @@
 #include "net/instaweb/rewriter/public/static_asset_manager.h"
 #include "pagespeed/controller/central_controller_rpc_client.h"
 #include "pagespeed/controller/central_controller_rpc_server.h"
+#include "pagespeed/controller/cost_weighted_expensive_operation_controller.h"
+#include "pagespeed/controller/expensive_operation_controller.h"
 #include "pagespeed/controller/popularity_contest_schedule_rewrite_controller.h"
 #include "pagespeed/controller/queued_expensive_operation_controller.h"
+#include "pagespeed/controller/schedule_rewrite_controller.h"
+#include "pagespeed/controller/shared_mem_central_controller.h"
+#include "pagespeed/controller/shared_mem_central_controller_server.h"
+#include "pagespeed/controller/shared_mem_controller_ring.h"
 #include "pagespeed/system/controller_manager.h"
 #include "pagespeed/system/controller_process.h"
 #include "pagespeed/system/in_place_resource_recorder.h"
@@ -110,7 +117,8 @@ SystemRewriteDriverFactory::SystemRewriteDriverFactory(
       install_crash_handler_(false),
       thread_counts_finalized_(false),
       num_rewrite_threads_(-1),
-      num_expensive_rewrite_threads_(-1) {
+      num_expensive_rewrite_threads_(-1),
+      central_controller_segment_created_(false) {
   if (shared_mem_runtime == NULL) {
 #ifdef PAGESPEED_SUPPORT_POSIX_SHARED_MEM
     shared_mem_runtime = new PthreadSharedMem();
@@ -205,6 +213,7 @@ void SystemRewriteDriverFactory::InitStats(Statistics* statistics) {
                                  statistics);
   InPlaceResourceRecorder::InitStats(statistics);
   RateController::InitStats(statistics);
+  CoalescingUrlAsyncFetcher::InitStats(statistics);
   CentralControllerRpcClient::InitStats(statistics);
 
   statistics->AddVariable(kShutdownCount);
@@ -247,6 +256,18 @@ QueuedWorkerPool* SystemRewriteDriverFactory::CreateWorkerPool(
   }
 }
 
+bool SystemRewriteDriverFactory::RewriteWorkersStealWork() {
+  const SystemRewriteOptions* conf =
+      SystemRewriteOptions::DynamicCast(default_options());
+  return (conf != NULL) && conf->experimental_rewrite_work_stealing();
+}
+
+bool SystemRewriteDriverFactory::RewriteWorkersScheduleByDeadline() {
+  const SystemRewriteOptions* conf =
+      SystemRewriteOptions::DynamicCast(default_options());
+  return (conf != NULL) && conf->experimental_rewrite_deadline_scheduling();
+}
+
 void SystemRewriteDriverFactory::ParentOrChildInit() {
   SharedCircularBufferInit(is_root_process_);
 }
@@ -277,17 +298,53 @@ void SystemRewriteDriverFactory::PrepareControllerProcess() {
 
 void SystemRewriteDriverFactory::StartController(
     const SystemRewriteOptions& options) {
-  if (!options.controller_port().empty()) {
-    std::unique_ptr<CentralControllerRpcServer> controller(
-        new CentralControllerRpcServer(
-            options.controller_port(), new QueuedExpensiveOperationController(
-                                           options.image_max_rewrites_at_once(),
-                                           thread_system(), statistics()),
-            new PopularityContestScheduleRewriteController(
-                thread_system(), statistics(), timer(),
-                options.popularity_contest_max_inflight_requests(),
-                options.popularity_contest_max_queue_size()),
-            message_handler()));
+  bool shared_mem = options.controller_shared_mem();
+  if (shared_mem || !options.controller_port().empty()) {
+    ExpensiveOperationController* expensive_operation_controller;
+    int max_rewrites = options.image_max_rewrites_at_once();
+    if (options.image_rewrite_cpu_budget_ms() > 0 && max_rewrites != 0) {
+      // Until it has timings, charge each rewrite an equal share of the
+      // budget, so that it starts out limiting rewrites as
+      // image_max_rewrites_at_once would have.
+      int64 budget_us = options.image_rewrite_cpu_budget_ms() * Timer::kMsUs;
+      if (max_rewrites < 0) {
+        max_rewrites = RewriteOptions::kDefaultImageMaxRewritesAtOnce;
+      }
+      expensive_operation_controller =
+          new CostWeightedExpensiveOperationController(
+              budget_us, budget_us / max_rewrites, timer(), thread_system(),
+              statistics());
+    } else {
+      expensive_operation_controller = new QueuedExpensiveOperationController(
+          max_rewrites, thread_system(), statistics());
+    }
+    ScheduleRewriteController* rewrite_controller =
+        new PopularityContestScheduleRewriteController(
+            thread_system(), statistics(), timer(),
+            options.popularity_contest_max_inflight_requests(),
+            options.popularity_contest_max_queue_size());
+    std::unique_ptr<ControllerProcess> controller;
+    if (shared_mem) {
+      // The segment must exist before we fork off anything that attaches.
+      SharedMemControllerRing ring(shared_mem_runtime(),
+                                   CentralControllerSegmentName(),
+                                   SharedMemControllerRing::kDefaultNumSlots);
+      if (!ring.Initialize(message_handler())) {
+        delete expensive_operation_controller;
+        delete rewrite_controller;
+        return;
+      }
+      central_controller_segment_created_ = true;
+      controller.reset(new SharedMemCentralControllerServer(
+          shared_mem_runtime(), CentralControllerSegmentName(),
+          SharedMemControllerRing::kDefaultNumSlots,
+          expensive_operation_controller, rewrite_controller, thread_system(),
+          timer(), message_handler()));
+    } else {
+      controller.reset(new CentralControllerRpcServer(
+          options.controller_port(), expensive_operation_controller,
+          rewrite_controller, message_handler()));
+    }
     // In the forked process, this call starts a new event loop and never
     // returns.
     ControllerManager::ForkControllerProcess(
@@ -295,6 +352,10 @@ void SystemRewriteDriverFactory::StartController(
   }
 }
 
+GoogleString SystemRewriteDriverFactory::CentralControllerSegmentName() {
+  return StrCat(filename_prefix(), "central_controller");
+}
+
 void SystemRewriteDriverFactory::RootInit() {
   ParentOrChildInit();
 
@@ -368,6 +429,15 @@ SystemRewriteDriverFactory::GetCentralController(
     NamedLockManager* lock_manager) {
   const SystemRewriteOptions* conf =
       SystemRewriteOptions::DynamicCast(default_options());
+  if (conf->controller_shared_mem()) {
+    if (central_controller_ == nullptr) {
+      central_controller_ = std::make_shared<SharedMemCentralController>(
+          shared_mem_runtime(), CentralControllerSegmentName(),
+          SharedMemControllerRing::kDefaultNumSlots, thread_system(),
+          message_handler());
+    }
+    return central_controller_;
+  }
   if (conf->controller_port().empty()) {
     return RewriteDriverFactory::GetCentralController(lock_manager);
   }
@@ -602,6 +672,12 @@ void SystemRewriteDriverFactory::ShutDown() {
                                          message_handler());
     }
 
+    if (central_controller_segment_created_) {
+      SharedMemControllerRing::GlobalCleanup(shared_mem_runtime(),
+                                             CentralControllerSegmentName(),
+                                             message_handler());
+    }
+
     // Cleanup SharedCircularBuffer.
     // Use GoogleMessageHandler instead of SystemMessageHandler.
     // As we are cleaning SharedCircularBuffer, we do not want to write to its
@@ -677,6 +753,14 @@ UrlAsyncFetcher* SystemRewriteDriverFactory::GetFetcher(
               kError, "Can't enable fetch rate-limiting without statistics");
         }
       }
+      if (config->fetch_coalescing_max_waiters() > 0) {
+        // Outermost, so that fetches waiting on one another don't take up
+        // rate-limiting slots.
+        TakeOwnership(fetcher);
+        fetcher = new CoalescingUrlAsyncFetcher(
+            fetcher, scheduler(), config->fetch_coalescing_max_waiters(),
+            config->fetch_coalescing_timeout_ms(), statistics());
+      }
     }
     iter->second = fetcher;
   }
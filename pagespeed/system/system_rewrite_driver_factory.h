@@ -293,6 +293,8 @@ class SystemRewriteDriverFactory : public RewriteDriverFactory {
   virtual void SetupCaches(ServerContext* server_context);
   virtual QueuedWorkerPool* CreateWorkerPool(WorkerPoolCategory pool,
                                              StringPiece name);
+  virtual bool RewriteWorkersStealWork();
+  virtual bool RewriteWorkersScheduleByDeadline();
 
   // TODO(jefftk): create SystemMessageHandler and get rid of these hooks.
   virtual void SetupMessageHandlers() {}
@@ -351,6 +353,10 @@ class SystemRewriteDriverFactory : public RewriteDriverFactory {
 
   virtual UrlAsyncFetcher* DefaultAsyncUrlFetcher();
 
+  // Name of the shared-memory segment through which we reach the central
+  // controller, when ExperimentalCentralControllerSharedMem is on.
+  GoogleString CentralControllerSegmentName();
+
   scoped_ptr<SharedMemStatistics> shared_mem_statistics_;
   // While split statistics in the ServerContext cleans up the actual objects,
   // we do the segment cleanup for local stats here.
@@ -413,7 +419,10 @@ class SystemRewriteDriverFactory : public RewriteDriverFactory {
   int num_rewrite_threads_;
   int num_expensive_rewrite_threads_;
 
-  std::shared_ptr<CentralControllerRpcClient> central_controller_;
+  std::shared_ptr<CentralController> central_controller_;
+  // True iff this is the root process, and it created the segment named by
+  // CentralControllerSegmentName().
+  bool central_controller_segment_created_;
 
   DISALLOW_COPY_AND_ASSIGN(SystemRewriteDriverFactory);
 };
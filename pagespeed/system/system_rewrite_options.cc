@@ -25,6 +25,8 @@
 #include "pagespeed/kernel/base/string_util.h"
 #include "pagespeed/kernel/base/thread_system.h"
 #include "pagespeed/kernel/base/timer.h"
+#include "pagespeed/kernel/cache/cache_batcher.h"
+#include "pagespeed/kernel/cache/tiered_metadata_cache.h"
 #include "pagespeed/system/serf_url_async_fetcher.h"
 
 namespace net_instaweb {
@@ -39,10 +41,14 @@ const char kFetchHttps[] = "FetchHttps";
 
 const char SystemRewriteOptions::kCentralControllerPort[] =
     "ExperimentalCentralControllerPort";
+const char SystemRewriteOptions::kCentralControllerSharedMem[] =
+    "ExperimentalCentralControllerSharedMem";
 const char SystemRewriteOptions::kPopularityContestMaxInFlight[] =
     "ExperimentalPopularityContestMaxInFlight";
 const char SystemRewriteOptions::kPopularityContestMaxQueueSize[] =
     "ExperimentalPopularityContestMaxQueueSize";
+const char SystemRewriteOptions::kImageRewriteCpuBudgetMs[] =
+    "ExperimentalImageRewriteCpuBudgetMs";
 const char SystemRewriteOptions::kStaticAssetCDN[] = "StaticAssetCDN";
 const char SystemRewriteOptions::kRedisServer[] = "RedisServer";
 const char SystemRewriteOptions::kRedisReconnectionDelayMs[] =
@@ -108,6 +114,29 @@ void SystemRewriteOptions::AddProperties() {
                     RewriteOptions::kMemcachedTimeoutUs,
                     "Maximum time in microseconds to allow for memcached "
                         "transactions", true);
+  AddSystemProperty(false, &SystemRewriteOptions::memcached_async_client_,
+                    "amac", "MemcachedAsyncClient", kProcessScopeStrict,
+                    "Whether to talk to memcached with the event-driven "
+                        "binary-protocol client, which pipelines requests "
+                        "and backs off each server separately, rather than "
+                        "with MemcachedThreads blocking threads.", true);
+  AddSystemProperty(false, &SystemRewriteOptions::cache_batcher_adaptive_,
+                    "cbad", "CacheBatcherAdaptive", kProcessScopeStrict,
+                    "Whether to adjust the parallelism and batch size of "
+                        "lookups in the external cache from their observed "
+                        "latency.", true);
+  AddSystemProperty(CacheBatcher::kDefaultTargetLatencyUs,
+                    &SystemRewriteOptions::cache_batcher_target_latency_us_,
+                    "cbtl", "CacheBatcherTargetLatencyUs",
+                    kProcessScopeStrict,
+                    "With CacheBatcherAdaptive, the 90th percentile latency "
+                        "in microseconds above which external cache lookups "
+                        "are throttled.", true);
+  AddSystemProperty(0, &SystemRewriteOptions::cache_batcher_get_deadline_us_,
+                    "cbgd", "CacheBatcherGetDeadlineUs", kProcessScopeStrict,
+                    "Maximum time in microseconds an external cache lookup "
+                        "may take, queued or awaiting a reply, before it is "
+                        "treated as a miss; 0 means no limit.", true);
   AddSystemProperty(ExternalServerSpec(),
                     &SystemRewriteOptions::redis_server_, "rds",
                     SystemRewriteOptions::kRedisServer,
@@ -123,6 +152,45 @@ void SystemRewriteOptions::AddProperties() {
                     SystemRewriteOptions::kRedisTimeoutUs,
                     "Timeout for all Redis operations and connection (us)",
                     true);
+  AddSystemProperty(0, &SystemRewriteOptions::redis_hot_key_ttl_ms_, "rhkt",
+                    "RedisHotKeyTtlMs", kProcessScopeStrict,
+                    "How long in milliseconds each process may serve its own "
+                        "copy of the most frequently read Redis keys; 0 "
+                        "disables hot-key replication.", true);
+  AddSystemProperty(false, &SystemRewriteOptions::redis_async_client_,
+                    "rdac", "RedisAsyncClient", kProcessScopeStrict,
+                    "Whether to talk to Redis with the event-driven client, "
+                        "which pipelines commands and sends each batch of "
+                        "lookups as MGET, rather than with one blocking "
+                        "thread.", true);
+  AddSystemProperty(0, &SystemRewriteOptions::cache_warming_concurrency_,
+                    "cwc", "CacheWarmingConcurrency", kProcessScopeStrict,
+                    "How many pages each process may warm the cache for at "
+                        "once, when asked to from the admin caches page; 0 "
+                        "disables cache warming.", true);
+  AddSystemProperty(10, &SystemRewriteOptions::cache_warming_cpu_percent_,
+                    "cwcp", "CacheWarmingCpuPercent", kProcessScopeStrict,
+                    "The share of time, in percent, that cache warming may "
+                        "spend parsing pages.", true);
+  AddSystemProperty("", &SystemRewriteOptions::cache_warming_directory_,
+                    "cwd", "CacheWarmingDirectory", kProcessScopeStrict,
+                    "Directory holding the sitemaps and access logs that the "
+                        "admin caches page may warm the cache from.", false);
+  AddSystemProperty(false,
+                    &SystemRewriteOptions::experimental_rewrite_work_stealing_,
+                    "erws", "ExperimentalRewriteWorkStealing",
+                    kProcessScopeStrict,
+                    "Experimental: whether the rewrite threads take work from "
+                        "per-thread queues, stealing from each other when "
+                        "idle, rather than from one shared queue.", true);
+  AddSystemProperty(false,
+                    &SystemRewriteOptions::
+                        experimental_rewrite_deadline_scheduling_,
+                    "erds", "ExperimentalRewriteDeadlineScheduling",
+                    kProcessScopeStrict,
+                    "Experimental: whether the rewrite threads run the work "
+                        "with the nearest rewrite deadline first, rather "
+                        "than in the order it was queued.", true);
   AddSystemProperty(50 * Timer::kMsUs,  // 50 ms
                     &SystemRewriteOptions::slow_file_latency_threshold_us_,
                     "asflt", "SlowFileLatencyUs",
@@ -175,6 +243,29 @@ void SystemRewriteOptions::AddProperties() {
                     "afcl", RewriteOptions::kFileCacheCleanInodeLimit,
                     "Set the target number of inodes for the file cache; 0 "
                         "means no limit", true);
+  AddSystemProperty(false,
+                    &SystemRewriteOptions::file_cache_incremental_cleaning_,
+                    "afcic", "FileCacheIncrementalCleaning",
+                    kProcessScopeStrict,
+                    "Whether to clean the file cache a little every second, "
+                    "keeping an estimate of its size, rather than scanning "
+                    "all of it every FileCacheCleanIntervalMs.", true);
+  AddSystemProperty(1000,
+                    &SystemRewriteOptions::file_cache_clean_files_per_sec_,
+                    "afcfs", "FileCacheCleanFilesPerSec", kProcessScopeStrict,
+                    "With FileCacheIncrementalCleaning, the number of files "
+                    "per second cleaning may look at or delete.", true);
+  AddSystemProperty(0,
+                    &SystemRewriteOptions::file_cache_clean_bytes_per_sec_,
+                    "afcbs", "FileCacheCleanBytesPerSec", kProcessScopeStrict,
+                    "With FileCacheIncrementalCleaning, the number of bytes "
+                    "per second cleaning may delete; 0 means no limit.",
+                    true);
+  AddSystemProperty(false, &SystemRewriteOptions::segmented_file_cache_,
+                    "sfc", "SegmentedFileCache", kProcessScopeStrict,
+                    "Whether to store the file cache in large append-only "
+                    "segment files with an in-memory index, rather than in "
+                    "a file per entry.", true);
   AddSystemProperty(0, &SystemRewriteOptions::lru_cache_byte_limit_, "alcb",
                     RewriteOptions::kLruCacheByteLimit,
                     "Set the maximum byte size entry to store in the "
@@ -183,6 +274,16 @@ void SystemRewriteOptions::AddProperties() {
                     RewriteOptions::kLruCacheKbPerProcess,
                     "Set the total size, in KB, of the per-process in-memory "
                         "LRU cache", true);
+  AddSystemProperty(0, &SystemRewriteOptions::lru_cache_shards_, "alcs",
+                    "LRUCacheShards",
+                    "Number of independently locked segments to split the "
+                        "per-process in-memory LRU cache into; 0 uses a "
+                        "single lock", true);
+  AddSystemProperty(false, &SystemRewriteOptions::cache_admission_filter_,
+                    "acaf", "CacheAdmissionFilter",
+                    "Whether the per-process LRU cache and the shared memory "
+                        "metadata cache only let new entries evict old ones "
+                        "that are less frequently requested", true);
   AddSystemProperty("", &SystemRewriteOptions::cache_flush_filename_, "acff",
                     RewriteOptions::kCacheFlushFilename,
                     "Name of file to check for timestamp updates used to flush "
@@ -199,6 +300,45 @@ void SystemRewriteOptions::AddProperties() {
                     "cc", RewriteOptions::kCompressMetadataCache,
                     "Whether to compress cache entries before writing them to "
                     "memory or disk.", true);
+  AddSystemProperty("", &SystemRewriteOptions::metadata_cache_l1_codec_,
+                    "mcl1c", "MetadataCacheL1Codec", kProcessScopeStrict,
+                    "Codec used to compress the per-process or shared memory "
+                        "metadata cache: deflate, brotli or brotli-fast.  "
+                        "Empty leaves it uncompressed when "
+                        "MetadataCacheL2Codec is set.", true);
+  AddSystemProperty("", &SystemRewriteOptions::metadata_cache_l2_codec_,
+                    "mcl2c", "MetadataCacheL2Codec", kProcessScopeStrict,
+                    "Codec used to compress the file cache or external cache "
+                        "copy of the metadata cache and the property cache: "
+                        "deflate, brotli or brotli-fast.  Empty leaves it "
+                        "uncompressed when MetadataCacheL1Codec is set.",
+                    true);
+  AddSystemProperty("", &SystemRewriteOptions::metadata_cache_dictionary_,
+                    "mcdict", "MetadataCacheDictionary", kProcessScopeStrict,
+                    "File holding the dictionary used by the deflate metadata "
+                        "cache codec.  If it doesn't exist, one is "
+                        "trained on the values written and saved there for "
+                        "the next restart.", false);
+  AddSystemProperty(false, &SystemRewriteOptions::tiered_metadata_cache_,
+                    "tmc", "TieredMetadataCache", kProcessScopeStrict,
+                    "Whether to put a TieredMetadataCache in front of the "
+                        "metadata cache levels, which remembers misses, only "
+                        "copies frequently read entries into the first level, "
+                        "and prefetches each page's entries together.", true);
+  AddSystemProperty(TieredMetadataCache::kDefaultNegativeTtlMs,
+                    &SystemRewriteOptions::metadata_cache_negative_ttl_ms_,
+                    "mcnttl", "MetadataCacheNegativeTtlMs",
+                    kProcessScopeStrict,
+                    "With TieredMetadataCache, how long, in milliseconds, a "
+                        "metadata cache miss is remembered.  0 disables "
+                        "this.", true);
+  AddSystemProperty(TieredMetadataCache::kDefaultPromotionThreshold,
+                    &SystemRewriteOptions::metadata_cache_promotion_threshold_,
+                    "mcpt", "MetadataCachePromotionThreshold",
+                    kProcessScopeStrict,
+                    "With TieredMetadataCache, how many recent lookups of a "
+                        "metadata cache entry are needed before it is copied "
+                        "from the second level into the first.", true);
   AddSystemProperty("enable", &SystemRewriteOptions::https_options_, "fhs",
                     kFetchHttps, "Controls direct fetching of HTTPS resources."
                     "  Value is comma-separated list of keywords: "
@@ -238,6 +378,11 @@ void SystemRewriteOptions::AddProperties() {
                     SystemRewriteOptions::kCentralControllerPort,
                     kProcessScopeStrict,
                     "TCP port for central controller processes", false);
+  AddSystemProperty(false, &SystemRewriteOptions::controller_shared_mem_,
+                    "ccsm", SystemRewriteOptions::kCentralControllerSharedMem,
+                    kProcessScopeStrict,
+                    "Run a central controller process, and reach it through "
+                    "shared memory rather than over gRPC", false);
   AddSystemProperty(
       10, &SystemRewriteOptions::popularity_contest_max_inflight_requests_,
       "pci", SystemRewriteOptions::kPopularityContestMaxInFlight,
@@ -247,6 +392,12 @@ void SystemRewriteOptions::AddProperties() {
       1000, &SystemRewriteOptions::popularity_contest_max_queue_size_, "pcq",
       SystemRewriteOptions::kPopularityContestMaxQueueSize, kProcessScopeStrict,
       "Max number of queued rewrites allowed in the popularity contest", false);
+  AddSystemProperty(
+      0, &SystemRewriteOptions::image_rewrite_cpu_budget_ms_, "ircb",
+      SystemRewriteOptions::kImageRewriteCpuBudgetMs, kProcessScopeStrict,
+      "Estimated CPU time, across all processes, of the image rewrites "
+      "allowed to run at once.  Set to 0 to limit their number instead.",
+      false);
   AddSystemProperty(false, &SystemRewriteOptions::disable_loopback_routing_,
                     "adlr",
                     "DangerPermitFetchFromUnknownHosts",
@@ -257,6 +408,17 @@ void SystemRewriteOptions::AddProperties() {
                     "FetchWithGzip", kLegacyProcessScope,
                     "Request http content from origin servers using gzip",
                     true);
+  AddSystemProperty(0, &SystemRewriteOptions::fetch_coalescing_max_waiters_,
+                    "fcw", "FetchCoalescingMaxWaiters", kProcessScopeStrict,
+                    "Maximum number of concurrent identical fetches that wait "
+                    "for a fetch already in progress rather than going to the "
+                    "origin themselves.  Set to 0 to turn off coalescing.",
+                    true);
+  AddSystemProperty(2000, &SystemRewriteOptions::fetch_coalescing_timeout_ms_,
+                    "fct", "FetchCoalescingTimeoutMs", kProcessScopeStrict,
+                    "How long a coalesced fetch waits for the fetch it is "
+                    "waiting on before going to the origin itself.  Set to 0 "
+                    "to wait for as long as that fetch takes.", true);
   AddSystemProperty(1024 * 1024 * 10,  /* 10 Megabytes */
                     &SystemRewriteOptions::ipro_max_response_bytes_,
                     "imrb", "IproMaxResponseBytes", kLegacyProcessScope,
@@ -281,6 +443,29 @@ void SystemRewriteOptions::AddProperties() {
                     kProcessScopeStrict,
                     "How often to checkpoint the shared memory metadata cache "
                     "to disk.  Set to 0 to turn off checkpointing.", true);
+  AddSystemProperty(false,
+                    &SystemRewriteOptions::
+                    shm_metadata_cache_clock_replacement_,
+                    "smcr", "ShmMetadataCacheClockReplacement",
+                    kProcessScopeStrict,
+                    "Whether shared memory metadata cache hits only mark "
+                    "entries as referenced, deferring LRU updates until "
+                    "something needs to be evicted.", true);
+  AddSystemProperty(false,
+                    &SystemRewriteOptions::
+                    shm_metadata_cache_raw_snapshots_,
+                    "smrs", "ShmMetadataCacheRawSnapshots",
+                    kProcessScopeStrict,
+                    "Whether to checkpoint the shared memory metadata cache "
+                    "as checksummed copies of its memory, which are faster "
+                    "to write and restore than per-entry snapshots.", true);
+  AddSystemProperty(false,
+                    &SystemRewriteOptions::shm_metadata_cache_slabs_,
+                    "smsl", "ShmMetadataCacheSlabs",
+                    kProcessScopeStrict,
+                    "Whether to split shared memory metadata caches into "
+                    "classes with different block sizes, storing each value "
+                    "in the class that suits its size best.", true);
   AddSystemProperty("",
                     &SystemRewriteOptions::purge_method_,
                     "pm", "PurgeMethod", kServerScope,
@@ -42,8 +42,10 @@ class SystemRewriteOptions : public RewriteOptions {
   typedef std::set<StaticAssetEnum::StaticAsset> StaticAssetSet;
 
   static const char kCentralControllerPort[];
+  static const char kCentralControllerSharedMem[];
   static const char kPopularityContestMaxInFlight[];
   static const char kPopularityContestMaxQueueSize[];
+  static const char kImageRewriteCpuBudgetMs[];
   static const char kStaticAssetCDN[];
   static const char kRedisServer[];
   static const char kRedisReconnectionDelayMs[];
@@ -95,6 +97,30 @@ class SystemRewriteOptions : public RewriteOptions {
   void set_file_cache_clean_inode_limit(int64 x) {
     set_option(x, &file_cache_clean_inode_limit_);
   }
+  bool file_cache_incremental_cleaning() const {
+    return file_cache_incremental_cleaning_.value();
+  }
+  void set_file_cache_incremental_cleaning(bool x) {
+    set_option(x, &file_cache_incremental_cleaning_);
+  }
+  int64 file_cache_clean_files_per_sec() const {
+    return file_cache_clean_files_per_sec_.value();
+  }
+  void set_file_cache_clean_files_per_sec(int64 x) {
+    set_option(x, &file_cache_clean_files_per_sec_);
+  }
+  int64 file_cache_clean_bytes_per_sec() const {
+    return file_cache_clean_bytes_per_sec_.value();
+  }
+  void set_file_cache_clean_bytes_per_sec(int64 x) {
+    set_option(x, &file_cache_clean_bytes_per_sec_);
+  }
+  bool segmented_file_cache() const {
+    return segmented_file_cache_.value();
+  }
+  void set_segmented_file_cache(bool x) {
+    set_option(x, &segmented_file_cache_);
+  }
   int64 lru_cache_byte_limit() const {
     return lru_cache_byte_limit_.value();
   }
@@ -107,6 +133,18 @@ class SystemRewriteOptions : public RewriteOptions {
   void set_lru_cache_kb_per_process(int64 x) {
     set_option(x, &lru_cache_kb_per_process_);
   }
+  int lru_cache_shards() const {
+    return lru_cache_shards_.value();
+  }
+  void set_lru_cache_shards(int x) {
+    set_option(x, &lru_cache_shards_);
+  }
+  bool cache_admission_filter() const {
+    return cache_admission_filter_.value();
+  }
+  void set_cache_admission_filter(bool x) {
+    set_option(x, &cache_admission_filter_);
+  }
   bool use_shared_mem_locking() const {
     return use_shared_mem_locking_.value();
   }
@@ -119,6 +157,42 @@ class SystemRewriteOptions : public RewriteOptions {
   void set_compress_metadata_cache(bool x) {
     set_option(x, &compress_metadata_cache_);
   }
+  const GoogleString& metadata_cache_l1_codec() const {
+    return metadata_cache_l1_codec_.value();
+  }
+  void set_metadata_cache_l1_codec(const GoogleString& x) {
+    set_option(x, &metadata_cache_l1_codec_);
+  }
+  const GoogleString& metadata_cache_l2_codec() const {
+    return metadata_cache_l2_codec_.value();
+  }
+  void set_metadata_cache_l2_codec(const GoogleString& x) {
+    set_option(x, &metadata_cache_l2_codec_);
+  }
+  const GoogleString& metadata_cache_dictionary() const {
+    return metadata_cache_dictionary_.value();
+  }
+  void set_metadata_cache_dictionary(const GoogleString& x) {
+    set_option(x, &metadata_cache_dictionary_);
+  }
+  bool tiered_metadata_cache() const {
+    return tiered_metadata_cache_.value();
+  }
+  void set_tiered_metadata_cache(bool x) {
+    set_option(x, &tiered_metadata_cache_);
+  }
+  int64 metadata_cache_negative_ttl_ms() const {
+    return metadata_cache_negative_ttl_ms_.value();
+  }
+  void set_metadata_cache_negative_ttl_ms(int64 x) {
+    set_option(x, &metadata_cache_negative_ttl_ms_);
+  }
+  int metadata_cache_promotion_threshold() const {
+    return metadata_cache_promotion_threshold_.value();
+  }
+  void set_metadata_cache_promotion_threshold(int x) {
+    set_option(x, &metadata_cache_promotion_threshold_);
+  }
   bool statistics_enabled() const {
     return statistics_enabled_.value();
   }
@@ -175,6 +249,30 @@ class SystemRewriteOptions : public RewriteOptions {
   void set_memcached_timeout_us(int x) {
     set_option(x, &memcached_timeout_us_);
   }
+  bool memcached_async_client() const {
+    return memcached_async_client_.value();
+  }
+  void set_memcached_async_client(bool x) {
+    set_option(x, &memcached_async_client_);
+  }
+  bool cache_batcher_adaptive() const {
+    return cache_batcher_adaptive_.value();
+  }
+  void set_cache_batcher_adaptive(bool x) {
+    set_option(x, &cache_batcher_adaptive_);
+  }
+  int64 cache_batcher_target_latency_us() const {
+    return cache_batcher_target_latency_us_.value();
+  }
+  void set_cache_batcher_target_latency_us(int64 x) {
+    set_option(x, &cache_batcher_target_latency_us_);
+  }
+  int64 cache_batcher_get_deadline_us() const {
+    return cache_batcher_get_deadline_us_.value();
+  }
+  void set_cache_batcher_get_deadline_us(int64 x) {
+    set_option(x, &cache_batcher_get_deadline_us_);
+  }
   const ExternalServerSpec& redis_server() const {
     return redis_server_.value();
   }
@@ -187,6 +285,48 @@ class SystemRewriteOptions : public RewriteOptions {
   int64 redis_timeout_us() const {
     return redis_timeout_us_.value();
   }
+  int cache_warming_concurrency() const {
+    return cache_warming_concurrency_.value();
+  }
+  void set_cache_warming_concurrency(int x) {
+    set_option(x, &cache_warming_concurrency_);
+  }
+  int cache_warming_cpu_percent() const {
+    return cache_warming_cpu_percent_.value();
+  }
+  void set_cache_warming_cpu_percent(int x) {
+    set_option(x, &cache_warming_cpu_percent_);
+  }
+  const GoogleString& cache_warming_directory() const {
+    return cache_warming_directory_.value();
+  }
+  void set_cache_warming_directory(const GoogleString& x) {
+    set_option(x, &cache_warming_directory_);
+  }
+  int64 redis_hot_key_ttl_ms() const {
+    return redis_hot_key_ttl_ms_.value();
+  }
+  void set_redis_hot_key_ttl_ms(int64 x) {
+    set_option(x, &redis_hot_key_ttl_ms_);
+  }
+  bool redis_async_client() const {
+    return redis_async_client_.value();
+  }
+  void set_redis_async_client(bool x) {
+    set_option(x, &redis_async_client_);
+  }
+  bool experimental_rewrite_work_stealing() const {
+    return experimental_rewrite_work_stealing_.value();
+  }
+  void set_experimental_rewrite_work_stealing(bool x) {
+    set_option(x, &experimental_rewrite_work_stealing_);
+  }
+  bool experimental_rewrite_deadline_scheduling() const {
+    return experimental_rewrite_deadline_scheduling_.value();
+  }
+  void set_experimental_rewrite_deadline_scheduling(bool x) {
+    set_option(x, &experimental_rewrite_deadline_scheduling_);
+  }
   int64 slow_file_latency_threshold_us() const {
     return slow_file_latency_threshold_us_.value();
   }
@@ -206,12 +346,18 @@ class SystemRewriteOptions : public RewriteOptions {
   const GoogleString& controller_port() const {
     return controller_port_.value();
   }
+  bool controller_shared_mem() const {
+    return controller_shared_mem_.value();
+  }
   int popularity_contest_max_inflight_requests() const {
     return popularity_contest_max_inflight_requests_.value();
   }
   int popularity_contest_max_queue_size() const {
     return popularity_contest_max_queue_size_.value();
   }
+  int64 image_rewrite_cpu_budget_ms() const {
+    return image_rewrite_cpu_budget_ms_.value();
+  }
 
   // Cache flushing configuration.
   void set_cache_flush_poll_interval_sec(int64 num_seconds) {
@@ -264,6 +410,18 @@ class SystemRewriteOptions : public RewriteOptions {
   bool fetch_with_gzip() const {
     return fetch_with_gzip_.value();
   }
+  int fetch_coalescing_max_waiters() const {
+    return fetch_coalescing_max_waiters_.value();
+  }
+  void set_fetch_coalescing_max_waiters(int x) {
+    set_option(x, &fetch_coalescing_max_waiters_);
+  }
+  int64 fetch_coalescing_timeout_ms() const {
+    return fetch_coalescing_timeout_ms_.value();
+  }
+  void set_fetch_coalescing_timeout_ms(int64 x) {
+    set_option(x, &fetch_coalescing_timeout_ms_);
+  }
   int64 ipro_max_response_bytes() const {
     return ipro_max_response_bytes_.value();
   }
@@ -279,6 +437,24 @@ class SystemRewriteOptions : public RewriteOptions {
   int shm_metadata_cache_checkpoint_interval_sec() const {
     return shm_metadata_cache_checkpoint_interval_sec_.value();
   }
+  bool shm_metadata_cache_clock_replacement() const {
+    return shm_metadata_cache_clock_replacement_.value();
+  }
+  void set_shm_metadata_cache_clock_replacement(bool x) {
+    set_option(x, &shm_metadata_cache_clock_replacement_);
+  }
+  bool shm_metadata_cache_raw_snapshots() const {
+    return shm_metadata_cache_raw_snapshots_.value();
+  }
+  void set_shm_metadata_cache_raw_snapshots(bool x) {
+    set_option(x, &shm_metadata_cache_raw_snapshots_);
+  }
+  bool shm_metadata_cache_slabs() const {
+    return shm_metadata_cache_slabs_.value();
+  }
+  void set_shm_metadata_cache_slabs(bool x) {
+    set_option(x, &shm_metadata_cache_slabs_);
+  }
   void set_purge_method(const GoogleString& x) {
     set_option(x, &purge_method_);
   }
@@ -477,6 +653,13 @@ class SystemRewriteOptions : public RewriteOptions {
   Option<bool> statistics_logging_enabled_;
   Option<bool> use_shared_mem_locking_;
   Option<bool> compress_metadata_cache_;
+  Option<bool> cache_admission_filter_;
+  Option<GoogleString> metadata_cache_l1_codec_;
+  Option<GoogleString> metadata_cache_l2_codec_;
+  Option<GoogleString> metadata_cache_dictionary_;
+  Option<bool> tiered_metadata_cache_;
+  Option<int64> metadata_cache_negative_ttl_ms_;
+  Option<int> metadata_cache_promotion_threshold_;
 
   Option<bool> slurp_read_only_;
   Option<bool> test_proxy_;
@@ -491,21 +674,48 @@ class SystemRewriteOptions : public RewriteOptions {
   // cleartext.  We'll decompress as we read the content if needed.
   Option<bool> fetch_with_gzip_;
 
+  // Concurrent identical fetches of a resource that has expired or not been
+  // cached yet wait for one another rather than all going to the origin.
+  Option<int> fetch_coalescing_max_waiters_;
+  Option<int64> fetch_coalescing_timeout_ms_;
+
   ControllerPortOption controller_port_;
+  // If true, the central controller is reached through shared memory rather
+  // than over gRPC, and controller_port_ is not needed.
+  Option<bool> controller_shared_mem_;
   Option<int> popularity_contest_max_inflight_requests_;
   Option<int> popularity_contest_max_queue_size_;
+  // If positive, the central controller admits image rewrites against this
+  // much estimated CPU time, rather than image_max_rewrites_at_once of them.
+  Option<int64> image_rewrite_cpu_budget_ms_;
 
   Option<int> memcached_threads_;
   Option<int> memcached_timeout_us_;
+  Option<bool> memcached_async_client_;
+  Option<bool> cache_batcher_adaptive_;
+  Option<int64> cache_batcher_target_latency_us_;
+  Option<int64> cache_batcher_get_deadline_us_;
   Option<int64> redis_reconnection_delay_ms_;
   Option<int64> redis_timeout_us_;
+  Option<int64> redis_hot_key_ttl_ms_;
+  Option<bool> redis_async_client_;
+  Option<int> cache_warming_concurrency_;
+  Option<int> cache_warming_cpu_percent_;
+  Option<GoogleString> cache_warming_directory_;
+  Option<bool> experimental_rewrite_work_stealing_;
+  Option<bool> experimental_rewrite_deadline_scheduling_;
 
   Option<int64> slow_file_latency_threshold_us_;
   Option<int64> file_cache_clean_inode_limit_;
+  Option<bool> file_cache_incremental_cleaning_;
+  Option<int64> file_cache_clean_files_per_sec_;
+  Option<int64> file_cache_clean_bytes_per_sec_;
+  Option<bool> segmented_file_cache_;
   Option<int64> file_cache_clean_interval_ms_;
   Option<int64> file_cache_clean_size_kb_;
   Option<int64> lru_cache_byte_limit_;
   Option<int64> lru_cache_kb_per_process_;
+  Option<int> lru_cache_shards_;
   Option<int64> statistics_logging_interval_ms_;
   // If cache_flush_poll_interval_sec_<=0 then we turn off polling for
   // cache-flushes.
@@ -516,6 +726,9 @@ class SystemRewriteOptions : public RewriteOptions {
   Option<int64> ipro_max_concurrent_recordings_;
   Option<int64> default_shared_memory_cache_kb_;
   Option<int> shm_metadata_cache_checkpoint_interval_sec_;
+  Option<bool> shm_metadata_cache_clock_replacement_;
+  Option<bool> shm_metadata_cache_raw_snapshots_;
+  Option<bool> shm_metadata_cache_slabs_;
   Option<GoogleString> purge_method_;
 
   StaticAssetCDNOptions static_assets_to_cdn_;
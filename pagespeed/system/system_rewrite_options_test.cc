@@ -272,6 +272,28 @@ TEST_F(SystemRewriteOptionsTest, CentralControllerBadTcpPort) {
   EXPECT_NE("", msg);
 }
 
+TEST_F(SystemRewriteOptionsTest, RewriteSchedulingInitValue) {
+  EXPECT_FALSE(options_.experimental_rewrite_deadline_scheduling());
+  EXPECT_FALSE(options_.experimental_rewrite_work_stealing());
+}
+
+TEST_F(SystemRewriteOptionsTest, RewriteDeadlineScheduling) {
+  GoogleString msg;
+  EXPECT_EQ(RewriteOptions::kOptionOk,
+            options_.ParseAndSetOptionFromName1(
+                "ExperimentalRewriteDeadlineScheduling", "on", &msg,
+                &handler_));
+  EXPECT_TRUE(options_.experimental_rewrite_deadline_scheduling());
+  EXPECT_EQ("", msg);
+
+  EXPECT_EQ(RewriteOptions::kOptionValueInvalid,
+            options_.ParseAndSetOptionFromName1(
+                "ExperimentalRewriteDeadlineScheduling", "maybe", &msg,
+                &handler_));
+  EXPECT_TRUE(options_.experimental_rewrite_deadline_scheduling());
+  EXPECT_NE("", msg);
+}
+
 TEST_F(SystemRewriteOptionsTest, RedisServer) {
   TestExternalCacheSingleOption(SystemRewriteOptions::kRedisServer,
                                 &SystemRewriteOptions::redis_server,
@@ -19,6 +19,7 @@
 #include "base/logging.h"
 #include "net/instaweb/http/public/url_async_fetcher.h"
 #include "net/instaweb/http/public/url_async_fetcher_stats.h"
+#include "net/instaweb/rewriter/public/cache_warmer.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
 #include "net/instaweb/rewriter/public/rewrite_driver_factory.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
@@ -290,6 +291,15 @@ void SystemServerContext::ChildInit(SystemRewriteDriverFactory* factory) {
     html_rewrite_time_us_histogram_ = statistics()->GetHistogram(
         kHtmlRewriteTimeUsHistogram);
     html_rewrite_time_us_histogram_->SetMaxValue(2 * Timer::kSecondUs);
+
+    const SystemRewriteOptions* config = global_system_rewrite_options();
+    if (config->cache_warming_concurrency() > 0) {
+      CacheWarmer::Options warmer_options;
+      warmer_options.max_concurrency = config->cache_warming_concurrency();
+      warmer_options.cpu_percent = config->cache_warming_cpu_percent();
+      warmer_options.source_dir = config->cache_warming_directory();
+      cache_warmer_.reset(new CacheWarmer(warmer_options, this));
+    }
   }
 }
 
@@ -374,7 +384,8 @@ void SystemServerContext::PrintCaches(bool is_global,
                                       const RewriteOptions* options,
                                       AsyncFetch* fetch) {
   admin_site_->PrintCaches(is_global, source, stripped_gurl, query_params,
-                           options, cache_path(), fetch, system_caches_,
+                           options, cache_path(), cache_warmer_.get(), fetch,
+                           system_caches_,
                            filesystem_metadata_cache(), http_cache(),
                            metadata_cache(), page_property_cache(), this);
 }
@@ -398,7 +409,8 @@ void SystemServerContext::AdminPage(
   Statistics* stats = is_global ? factory()->statistics()
       : statistics();
   admin_site_->AdminPage(is_global, stripped_gurl, query_params, options,
-                         cache_path(), fetch, system_caches_,
+                         cache_path(), cache_warmer_.get(), fetch,
+                         system_caches_,
                          filesystem_metadata_cache(), http_cache(),
                          metadata_cache(), page_property_cache(), this,
                          statistics(), stats,  global_system_rewrite_options());
@@ -31,6 +31,7 @@
 namespace net_instaweb {
 
 class AsyncFetch;
+class CacheWarmer;
 class GoogleUrl;
 class Histogram;
 class QueryParams;
@@ -196,6 +197,9 @@ class SystemServerContext : public ServerContext {
 
   Variable* statistics_404_count();
 
+  // Returns NULL if cache warming is off.
+  CacheWarmer* cache_warmer() { return cache_warmer_.get(); }
+
  private:
   // Checks the timestamp of cache.flush, updating the purge context as
   // needed.
@@ -209,6 +213,7 @@ class SystemServerContext : public ServerContext {
   void CheckLegacyGlobalCacheFlushFile();
 
   scoped_ptr<AdminSite> admin_site_;
+  scoped_ptr<CacheWarmer> cache_warmer_;
 
   bool initialized_;
   bool use_per_vhost_statistics_;